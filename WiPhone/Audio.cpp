@@ -29,6 +29,7 @@ governing permissions and limitations under the License.
 
 #include "Audio.h"
 #include "config.h"
+#include "CallTrace.h"
 
 //#define TAG "audio" // log tags don't seem to work in Arduino
 
@@ -522,6 +523,10 @@ void Audio::loop() {
   //uint32_t oldSmp = this->playDecFramesLeft;
   if (this->playDecFramesLeft>0) {
     this->playChunk();
+    if (this->firstSample) {
+      this->firstSample = false;
+      callTrace.mark(CallTrace::FIRST_PLAYED);
+    }
   }
   //info.time[1] = micros();
   //info.samples[0] = oldSmp - this->playDecFramesLeft;
@@ -743,6 +748,9 @@ void Audio::loop() {
         //log_d("RTP packet received: %d", len);
 
         // Stats
+        if (this->packetsReceived == 0) {
+          callTrace.mark(CallTrace::FIRST_RTP);
+        }
         this->packetsReceived++;
         uint16_t remotePort = rtp.remotePort();
         if (rtp.remotePort() % 2 == 0) {
@@ -762,8 +770,17 @@ void Audio::loop() {
         // Parse packet
 
         len = rtp.read(playEnc, sizeof(playEnc) - 1);
-        if (len > 12) {
-          if (rtp.remotePort() == rtpRemotePort || !rtpRemotePort) {    // ensuring that the audio comes from the right port; TODO: ensure also that it comes from the right IP
+        if (len > 12 && (playEnc[0] & 0xC0) == 0x80) {      // RTP version 2 (late STUN responses and other strays are dropped)
+          if (this->firstPacket && rtpRemotePort && (playEnc[1] & 0x7f) == rtpPayloadType &&
+              (rtp.remotePort() != rtpRemotePort || ((uint32_t) rtpRemoteIP && rtp.remoteIP() != rtpRemoteIP))) {
+            // Symmetric RTP (RFC 4961): the other party sends from where it receives, which behind NAT is not what its SDP says.
+            // Latch onto the source of the first packet of the stream for both receiving and sending.
+            log_i("RTP latched to %s:%d", rtp.remoteIP().toString().c_str(), rtp.remotePort());
+            rtpLatchedFromPort = rtpRemotePort;
+            rtpRemoteIP = rtp.remoteIP();
+            rtpRemotePort = rtp.remotePort();
+          }
+          if (!rtpRemotePort || (rtp.remotePort() == rtpRemotePort && (!(uint32_t) rtpRemoteIP || rtp.remoteIP() == rtpRemoteIP))) {    // ensuring that the audio comes from the right source
             // Parse RTP packet
             //uint8_t payloadType = rtpRecv.decodeHeader(playEnc);
 
@@ -790,6 +807,7 @@ void Audio::loop() {
               if (this->firstPacket) {
                 inSeq = true;
                 this->firstPacket = false;
+                this->msFirstPacket = millis() | 1;     // never 0
                 log_i("Sound source (SSRC): %u", rtpRecv.getSSRC());
               }
 
@@ -993,6 +1011,9 @@ AUDIO_INLINE bool Audio::playSample() {
 
 void Audio::newCall() {
   this->firstPacket = true;
+  this->rtpLatchedFromPort = 0;
+  this->firstSample = true;
+  this->msFirstPacket = 0;
   this->lastSequenceNum = 0;
 
   this->rtpPort = 0;
@@ -1035,14 +1056,37 @@ uint16_t Audio::openRtpConnection(uint16_t rtpLocalPort) {
   return rtpLocalPort;
 }
 
-bool Audio::playRtpStream(uint8_t payloadType, uint16_t remotePort) {
-  log_d("playing rtp");
+/* Description:
+ *      get everything slow out of the way while an outgoing call is being set up, so that the first RTP packet
+ *      (early media or answer) is heard right away: socket is bound, audio codec and I2S are powered up (muted: nothing plays yet).
+ *      The sample rate of the preferred codec is used; playRtpStream() adjusts it if another codec gets negotiated.
+ */
+bool Audio::prepareRtp(uint16_t rtpLocalPort) {
+  this->openRtpConnection(rtpLocalPort);
+  this->newCall();
+  this->configureRtp(G722_RTP_PAYLOAD);
+  return this->turnOn();
+}
 
-  // Determine sample rate and initialize audio configs
+/* Description:
+ *      I2S configuration for a VoIP codec. Reinstalling the I2S driver takes a while and pops,
+ *      so it is skipped if the audio is already running with the same configuration.
+ */
+void Audio::configureRtp(uint8_t payloadType) {
   uint16_t sampleRate = (payloadType == ALAW_RTP_PAYLOAD || payloadType == ULAW_RTP_PAYLOAD) ? 8000 : 16000;      // default is 16000
+  if (this->audioOn && this->monoOut && this->dataChannels == 1 && this->sampleRate == sampleRate) {
+    return;
+  }
   this->setSampleRate(sampleRate);
   this->setDataChannels(1);
   this->setMonoOutput(true);      // this should be called last (since it shows all the configs via Serial)   TODO
+}
+
+bool Audio::playRtpStream(uint8_t payloadType, uint16_t remotePort) {
+  log_d("playing rtp");
+
+  // Determine sample rate and initialize audio configs
+  this->configureRtp(payloadType);
 
   // Start the audio systems (if not started)
   if (!this->turnOn()) {
@@ -1065,25 +1109,58 @@ bool Audio::playRtpStream(uint8_t payloadType, uint16_t remotePort) {
   // Reset debugging
   this->loopCnt = this->runCnt = this->rtpCnt = 0;
 
+  // Restart detection of a silent remote party
+  rtpSilentScan = millis();
+  rtpSilentPeriod = RTP_SILENT_OFF;
+
   // Kickstart playback
   this->playback = Playback::RtpStream;
+  callTrace.mark(CallTrace::RTP_OPENED);
 
   return true;
 }
 
+/* Description:
+ *      apply a media session renegotiated during the call (re-INVITE): new remote address, codec or direction.
+ *      When nothing flows either way (call on hold) the codec and I2S are powered down, the RTP socket is kept;
+ *      resuming powers them up again. Streams that don't change keep running undisturbed.
+ */
+bool Audio::updateRtpStream(uint8_t payloadType, IPAddress remoteAddr, uint16_t remotePort, bool send, bool recv) {
+  log_d("RTP stream update: send=%d, recv=%d", (int) send, (int) recv);
+  if (!send && !recv) {
+    this->microphoneStreamOut = false;
+    return this->audioOn ? this->shutdown() : true;
+  }
+  bool changed = !this->audioOn || payloadType != this->rtpPayloadType ||
+                 (this->rtpLatchedFromPort ? remotePort != this->rtpLatchedFromPort : remoteAddr != this->rtpRemoteIP || remotePort != this->rtpRemotePort);
+  bool succ = true;
+  if (!recv) {
+    if (this->playback == Playback::RtpStream) {
+      this->ceasePlayback();
+    }
+  } else if (changed || this->playback != Playback::RtpStream) {
+    succ = this->playRtpStream(payloadType, remotePort);
+  }
+  if (!send) {
+    this->microphoneStreamOut = false;
+  } else if (changed || !this->microphoneStreamOut) {
+    succ = this->sendRtpStreamFromMic(payloadType, remoteAddr, remotePort) && succ;
+  }
+  return succ;
+}
+
 bool Audio::sendRtpStreamFromMic(uint8_t payloadType, IPAddress remoteAddr, uint16_t remotePort) {
 
   // TODO: check correctness of the parameters
   this->rtpPayloadType = payloadType;
-  this->rtpRemoteIP = remoteAddr;
-  this->rtpRemotePort = remotePort;
+  if (!this->rtpLatchedFromPort || remotePort != this->rtpLatchedFromPort) {     // keep sending where the stream being received comes from
+    this->rtpRemoteIP = remoteAddr;
+    this->rtpRemotePort = remotePort;
+  }
 
   // Determine sample rate and initialize audio configs
   // Configuration is exactly the same as for playback
-  uint16_t sampleRate = (payloadType == ALAW_RTP_PAYLOAD || payloadType == ULAW_RTP_PAYLOAD) ? 8000 : 16000;      // default is 16000
-  this->setSampleRate(sampleRate);
-  this->setDataChannels(1);
-  this->setMonoOutput(true);      // this should be called last (since it shows all the configs via Serial)   TODO
+  this->configureRtp(payloadType);
 
   // Start the audio systems (if not started)
   if (!this->turnOn()) {
@@ -1100,6 +1177,7 @@ bool Audio::sendRtpStreamFromMic(uint8_t payloadType, IPAddress remoteAddr, uint
   rtpSend.newSession();
   // Kickstart streaming
   this->microphoneStreamOut = true;
+  return true;
 }
 
 bool Audio::recordFromMic() {
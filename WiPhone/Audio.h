@@ -140,7 +140,12 @@ public:
     G722_RTP_PAYLOAD = 9          // G.722
   };
   uint16_t openRtpConnection(uint16_t rtpLocalPort);                         // the port that will be listened to AND from which RTP will be sent TODO: allows these two to be different
+  bool prepareRtp(uint16_t rtpLocalPort);                                    // open RTP socket and power up codec & I2S before the remote SDP is known
+  uint32_t firstPacketMillis() {
+    return this->msFirstPacket;                                              // millis() of the first good packet since playRtpStream(), 0 - none yet
+  }
   bool playRtpStream(uint8_t payloadType, uint16_t rtpRemotePort = 0);       // remote port - play audio only from that port
+  bool updateRtpStream(uint8_t payloadType, IPAddress rtpRemoteIP, uint16_t rtpRemotePort, bool send, bool recv);    // apply renegotiated session (hold/resume)
 
   // Actions related to microphone
   // TODO: first open port, than feed that port to TinySIP for SDP
@@ -203,6 +208,7 @@ protected:
   bool playChunk();
   AUDIO_INLINE bool playSample();
   void codecReconfig();
+  void configureRtp(uint8_t payloadType);
 
   // Specific to MP3
   void readID3Metadata();
@@ -286,10 +292,13 @@ protected:
   WiFiUDP     rtp;
   IPAddress   rtpRemoteIP;
   uint16_t    rtpRemotePort = 0;
+  uint16_t    rtpLatchedFromPort = 0;       // remote port from SDP, if the stream got latched to another source (symmetric RTP)
   uint8_t     rtpPayloadType;
   RTPacket    rtpSend;                      // this one is initialized with parameters from
   RTPacket    rtpRecv;
   bool        firstPacket;                  // is the next incoming packet will the first in audio stream?
+  uint32_t    msFirstPacket = 0;            // when the first packet of the stream arrived
+  bool        firstSample = false;          // nothing of the stream has been played yet (see CallTrace)
   uint16_t    lastSequenceNum;              // last RTP sequence num
   //uint32_t    pos;                          // position in playback     TODO
   uint16_t    rtpPort;
@@ -0,0 +1,169 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#include "CallTrace.h"
+
+CallTrace callTrace;
+
+const uint16_t CallTrace::BUCKET_MS[BUCKETS-1] = { 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+
+CallTrace::CallTrace() {
+  memset(usFirst, 0, sizeof(usFirst));
+  memset(histogram, 0, sizeof(histogram));
+}
+
+const char* CallTrace::name(Milestone_t m) {
+  switch (m) {
+  case START_CALL:
+    return "startCall";
+  case CONNECTED:
+    return "connected";
+  case INVITE_SENT:
+    return "INVITE sent";
+  case TRYING:
+    return "100 Trying";
+  case RINGING:
+    return "180 Ringing";
+  case PROGRESS:
+    return "183 Progress";
+  case ANSWERED:
+    return "200 OK";
+  case ACK_SENT:
+    return "ACK sent";
+  case RTP_OPENED:
+    return "RTP opened";
+  case FIRST_RTP:
+    return "first RTP";
+  case FIRST_PLAYED:
+    return "first played";
+  case ACCEPT_CALL:
+    return "acceptCall";
+  case OK_SENT:
+    return "200 OK sent";
+  case ACK_RECEIVED:
+    return "ACK received";
+  default:
+    return "?";
+  }
+}
+
+/* Description:
+ *     begin tracing a new call (the previous one, if not finished, is folded into the histograms).
+ */
+void CallTrace::start(Milestone_t first) {
+  if (running) {
+    finish();
+  }
+  memset(usFirst, 0, sizeof(usFirst));
+  ringNext = 0;
+  nEvents = 0;
+  usStart = micros();
+  running = true;
+  this->first = first;
+  mark(first);
+}
+
+void CallTrace::mark(Milestone_t m) {
+  if (!running || m >= MILESTONES) {
+    return;
+  }
+  uint32_t us = micros() - usStart;
+  ring[ringNext].milestone = m;
+  ring[ringNext].us = us;
+  ringNext = (ringNext + 1) % RING_SIZE;
+  nEvents++;
+  if (!usFirst[m]) {
+    usFirst[m] = us | 1;
+  }
+}
+
+/* Description:
+ *     stop tracing the call and add its stages to the histograms.
+ */
+void CallTrace::finish() {
+  if (!running) {
+    return;
+  }
+  running = false;
+  nCalls++;
+  for (int m = 0; m < MILESTONES; m++) {
+    if (m == first || !usFirst[m]) {
+      continue;
+    }
+    // The stage ends here and begins at the milestone reached right before
+    uint32_t usPrev = usFirst[first];
+    for (int p = 0; p < MILESTONES; p++) {
+      if (p != m && usFirst[p] && usFirst[p] <= usFirst[m] && usFirst[p] > usPrev) {
+        usPrev = usFirst[p];
+      }
+    }
+    uint32_t ms = (usFirst[m] - usPrev) / 1000;
+    int b = 0;
+    while (b < BUCKETS-1 && ms >= BUCKET_MS[b]) {
+      b++;
+    }
+    if (histogram[m][b] < 0xffff) {
+      histogram[m][b]++;
+    }
+  }
+}
+
+/* Description:
+ *     print the events of the last call in the order they happened.
+ */
+size_t CallTrace::report(char* buff, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  buff[0] = '\0';
+  size_t len = 0;
+  uint16_t n = nEvents < RING_SIZE ? nEvents : RING_SIZE;
+  int written = snprintf(buff, size, "call trace: %u events%s\n", nEvents, nEvents > RING_SIZE ? " (oldest dropped)" : "");
+  if (written > 0) {
+    len = (size_t) written < size ? written : size - 1;
+  }
+  for (uint16_t i = 0; i < n && len < size - 1; i++) {
+    const Event& e = ring[(ringNext + RING_SIZE - n + i) % RING_SIZE];
+    written = snprintf(buff + len, size - len, "  %6u.%03u ms  %s\n", e.us / 1000, e.us % 1000, name((Milestone_t) e.milestone));
+    if (written <= 0) {
+      break;
+    }
+    len += (size_t) written < size - len ? written : size - len - 1;
+  }
+  return len;
+}
+
+uint16_t CallTrace::stageCount(Milestone_t m) {
+  uint16_t n = 0;
+  for (int b = 0; b < BUCKETS; b++) {
+    n += histogram[m][b];
+  }
+  return n;
+}
+
+uint32_t CallTrace::stagePercentileMs(Milestone_t m, uint8_t percent) {
+  uint16_t total = stageCount(m);
+  if (total == 0) {
+    return 0;
+  }
+  uint32_t target = ((uint32_t) total * percent + 99) / 100;       // rank of the percentile, rounded up
+  uint32_t seen = 0;
+  for (int b = 0; b < BUCKETS-1; b++) {
+    seen += histogram[m][b];
+    if (seen >= target) {
+      return BUCKET_MS[b];
+    }
+  }
+  return 0xffffffff;      // beyond the last bound
+}
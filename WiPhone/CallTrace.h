@@ -0,0 +1,97 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef CALL_TRACE_H
+#define CALL_TRACE_H
+
+#include <Arduino.h>
+
+/* Description:
+ *     timeline of a call setup: from pressing CALL (or answering an incoming call) till the first audio sample played.
+ *
+ *     Every milestone gets a micros() timestamp in a fixed ring of events (repeated milestones, like an INVITE resent
+ *     with credentials, are kept too). The trace is written out when the call ends (see report()) and folded into
+ *     per-stage histograms: a stage is the time from the preceding milestone reached to the first occurrence of this one.
+ *
+ *     Everything runs in the main loop (TinySIP and Audio::loop()), so no locking is needed.
+ */
+class CallTrace {
+public:
+
+  typedef enum Milestone {
+    START_CALL = 0,       // TinySIP::startCall()
+    CONNECTED,            // connection to the proxy is ready for the INVITE (ensureIpConnection)
+    INVITE_SENT,
+    TRYING,               // 100
+    RINGING,              // 180
+    PROGRESS,             // any other provisional response
+    ANSWERED,             // any 2xx
+    ACK_SENT,             // ACK for 2xx
+    RTP_OPENED,           // Audio::playRtpStream()
+    FIRST_RTP,            // first RTP packet received
+    FIRST_PLAYED,         // first decoded sample written to I2S
+    ACCEPT_CALL,          // TinySIP::acceptCall(): an incoming call starts here instead of START_CALL
+    OK_SENT,              // 200 OK for the incoming INVITE
+    ACK_RECEIVED,         // ACK for that 200 OK
+    MILESTONES
+  } Milestone_t;
+
+  static const int RING_SIZE = 32;                    // events of one call
+  static const int BUCKETS = 9;
+  static const uint16_t BUCKET_MS[BUCKETS-1];         // upper bounds of the histogram buckets, the last one is open
+
+  CallTrace();
+
+  void start(Milestone_t first = START_CALL);         // START_CALL or ACCEPT_CALL
+  void mark(Milestone_t m);
+  void finish();
+  bool active() {
+    return running;
+  };
+
+  // Last call
+  size_t report(char* buff, size_t size);             // one line per event, returns the length written
+  uint32_t reachedMs(Milestone_t m) {
+    return usFirst[m] / 1000;
+  };
+
+  // Histograms over all the calls traced since boot
+  uint16_t calls() {
+    return nCalls;
+  };
+  uint16_t stageCount(Milestone_t m);
+  uint32_t stagePercentileMs(Milestone_t m, uint8_t percent);       // upper bound of the bucket, 0 - no data
+  static const char* name(Milestone_t m);
+
+protected:
+  struct Event {
+    uint8_t milestone;
+    uint32_t us;
+  };
+
+  Event ring[RING_SIZE];
+  uint8_t ringNext = 0;
+  uint16_t nEvents = 0;             // events of the current call, including those overwritten in the ring
+  bool running = false;
+  Milestone_t first = START_CALL;   // where the current call started
+  uint32_t usStart = 0;
+  uint32_t usFirst[MILESTONES];     // first occurrence since the start (| 1, so that 0 means "not reached")
+
+  uint16_t histogram[MILESTONES][BUCKETS];
+  uint16_t nCalls = 0;
+};
+
+extern CallTrace callTrace;
+
+#endif // CALL_TRACE_H
@@ -0,0 +1,193 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#include "CallerId.h"
+#include "helpers.h"
+
+CallerIdCache callerIds;
+
+CallerIdCache::CallerIdCache()
+  : tableDyn(NULL), capacity(0), count(0), textBytes(0), built(false), msBuildStart(0) {
+  memset(&statistics, 0, sizeof(statistics));
+}
+
+CallerIdCache::~CallerIdCache() {
+  this->clear();
+}
+
+void CallerIdCache::clear() {
+  for (size_t i = 0; i < capacity; i++) {
+    freeNull((void **) &tableDyn[i].textDyn);
+  }
+  freeNull((void **) &tableDyn);
+  capacity = 0;
+  count = 0;
+  textBytes = 0;
+  built = false;
+}
+
+void CallerIdCache::beginBuild() {
+  this->clear();
+  msBuildStart = millis();
+}
+
+void CallerIdCache::endBuild() {
+  built = true;
+  statistics.builds++;
+  statistics.msBuild = millis() - msBuildStart;
+  log_d("caller IDs: %d, memory: %d, built in %d ms", (int) count, (int) this->memoryUsed(), statistics.msBuild);
+}
+
+/* Description:
+ *     the part of a URI that identifies a contact, in lower case: without the display name and angle brackets, the
+ *     scheme (sip, sips, tel), the default port of the scheme, parameters and headers.
+ *     "\"Bob\" <SIP:Bob@Example.com:5060;transport=tcp>" -> "bob@example.com", "tel:+1234" -> "+1234".
+ * Return:
+ *     false if nothing is left or the result doesn't fit
+ */
+bool CallerIdCache::normalize(const char* uri, char* out, size_t size, size_t* userLength) {
+  if (uri == NULL || size == 0) {
+    return false;
+  }
+  const char* bracket = strchr(uri, '<');
+  if (bracket != NULL) {
+    uri = bracket + 1;
+  }
+  while (isspace((unsigned char) *uri)) {
+    uri++;
+  }
+  const char* defaultPort = ":5060";
+  if (!strncasecmp(uri, "sip:", 4)) {
+    uri += 4;
+  } else if (!strncasecmp(uri, "sips:", 5)) {
+    uri += 5;
+    defaultPort = ":5061";
+  } else if (!strncasecmp(uri, "tel:", 4)) {
+    uri += 4;
+    defaultPort = NULL;
+  }
+
+  // User part (up to '@'), then host and port (up to parameters or headers)
+  size_t end = strcspn(uri, "?> \t\r\n");
+  const char* at = (const char*) memchr(uri, '@', end);
+  size_t user = at != NULL ? at - uri : 0;
+  size_t len = user + strcspn(uri + user, ";?> \t\r\n");
+  if (at == NULL) {
+    user = len;
+  }
+  if (at != NULL && defaultPort != NULL && len - user > 5 && !strncmp(uri + len - 5, defaultPort, 5)) {
+    len -= 5;
+  }
+  if (len == 0 || len >= size) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    out[i] = tolower((unsigned char) uri[i]);
+  }
+  out[len] = '\0';
+  if (userLength != NULL) {
+    *userLength = user;
+  }
+  return true;
+}
+
+bool CallerIdCache::add(const char* name, const char* uri) {
+  char key[MAX_URI_LENGTH + 1];
+  if (!normalize(uri, key, sizeof(key))) {
+    return false;
+  }
+  uint32_t hash = hash_murmur(key);
+  if ((count + 1) * 2 > capacity && !this->grow()) {
+    return false;
+  }
+  Entry* e = this->find(key, hash);
+  if (e->textDyn != NULL) {
+    return false;         // an earlier contact has it
+  }
+  if (name == NULL) {
+    name = "";
+  }
+  size_t keyLen = strlen(key);
+  size_t nameLen = strlen(name);
+  char* text = (char*) extMalloc(keyLen + nameLen + 2);
+  if (text == NULL) {
+    log_e("out of memory");
+    return false;
+  }
+  memcpy(text, key, keyLen + 1);
+  memcpy(text + keyLen + 1, name, nameLen + 1);
+  e->hash = hash;
+  e->textDyn = text;
+  count++;
+  textBytes += keyLen + nameLen + 2;
+  return true;
+}
+
+CallerIdCache::Entry* CallerIdCache::find(const char* key, uint32_t hash) {
+  size_t i = hash & (capacity - 1);
+  while (tableDyn[i].textDyn != NULL && (tableDyn[i].hash != hash || strcmp(tableDyn[i].textDyn, key))) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &tableDyn[i];
+}
+
+bool CallerIdCache::grow() {
+  size_t newCapacity = capacity ? capacity * 2 : MIN_CAPACITY;
+  Entry* newTable = (Entry*) extCalloc(newCapacity, sizeof(Entry));
+  if (newTable == NULL) {
+    log_e("out of memory");
+    return false;
+  }
+  Entry* oldTable = tableDyn;
+  size_t oldCapacity = capacity;
+  tableDyn = newTable;
+  capacity = newCapacity;
+  for (size_t i = 0; i < oldCapacity; i++) {
+    if (oldTable[i].textDyn != NULL) {
+      *this->find(oldTable[i].textDyn, oldTable[i].hash) = oldTable[i];
+    }
+  }
+  free(oldTable);
+  return true;
+}
+
+const char* CallerIdCache::name(const char* uri) {
+  uint32_t us = micros();
+  const char* res = NULL;
+  char key[MAX_URI_LENGTH + 1];
+  size_t user;
+  if (count > 0 && normalize(uri, key, sizeof(key), &user)) {
+    Entry* e = this->find(key, hash_murmur(key));
+    if (e->textDyn == NULL && user > 0 && user < strlen(key)) {
+      // Contacts saved as just a number
+      key[user] = '\0';
+      e = this->find(key, hash_murmur(key));
+    }
+    if (e->textDyn != NULL) {
+      res = e->textDyn + strlen(e->textDyn) + 1;
+    }
+  }
+  us = micros() - us;
+  statistics.lookups++;
+  statistics.known += res != NULL;
+  statistics.usTotal += us;
+  if (us > statistics.usMax) {
+    statistics.usMax = us;
+  }
+  return res;
+}
+
+size_t CallerIdCache::memoryUsed() {
+  return capacity * sizeof(Entry) + textBytes;
+}
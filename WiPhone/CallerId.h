@@ -0,0 +1,90 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef CALLER_ID_H
+#define CALLER_ID_H
+
+#include <Arduino.h>
+
+/* Description:
+ *     names of the phonebook contacts by their SIP URI, for incoming calls and the lists of messages: a hash table
+ *     (open addressing) of the normalized URIs, so that a lookup doesn't depend on the size of the phonebook.
+ *
+ *     URIs are normalized the way AddrSpec splits them: "<SIP:Bob@Example.com:5060;transport=tcp>" and
+ *     "sip:bob@example.com" are the same contact. Phonebook entries may be just numbers ("1234", "sip:1234"): those are
+ *     found by the user part of any URI with the number, whatever its domain.
+ *
+ *     The table is built from the whole phonebook when first needed (see PhonebookApp::callerName()) and cleared
+ *     whenever the phonebook changes, to be built again.
+ */
+class CallerIdCache {
+public:
+  static const size_t MAX_URI_LENGTH = 96;            // normalized; longer URIs are not cached
+
+  struct Stats {
+    uint32_t lookups;
+    uint32_t known;                                   // found in the phonebook
+    uint32_t usTotal;                                 // of all the lookups
+    uint32_t usMax;
+    uint32_t builds;
+    uint32_t msBuild;                                 // of the last build
+  };
+
+  CallerIdCache();
+  ~CallerIdCache();
+
+  // Building
+  void clear();                                       // empty, not built (the phonebook changed)
+  void beginBuild();
+  void endBuild();
+  bool isBuilt() {
+    return built;
+  };
+  bool add(const char* name, const char* uri);        // the first contact with a URI keeps it
+
+  const char* name(const char* uri);                  // NULL - not a contact (or not built); valid until clear()
+
+  size_t size() {
+    return count;
+  };
+  size_t memoryUsed();
+  const Stats& stats() {
+    return statistics;
+  };
+
+  static bool normalize(const char* uri, char* out, size_t size, size_t* userLength=NULL);
+
+protected:
+  static const size_t MIN_CAPACITY = 64;
+
+  struct Entry {
+    uint32_t hash;
+    char* textDyn;                                    // "normalized URI\0name\0"; NULL - empty
+  };
+
+  Entry* tableDyn;
+  size_t capacity;                                    // power of 2, at least twice the count
+  size_t count;
+  size_t textBytes;
+  bool built;
+  uint32_t msBuildStart;
+  Stats statistics;
+
+  Entry* find(const char* key, uint32_t hash);        // its entry or the empty one where it would go
+  bool grow();
+};
+
+extern CallerIdCache callerIds;
+
+#endif // CALLER_ID_H
@@ -0,0 +1,304 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#include "ContactIndex.h"
+
+ContactIndex contactIndex;
+
+static const int MAX_WORDS = 8;       // indexed per name or user part
+
+ContactIndex::ContactIndex()
+  : freeSlots(0), textBytes(0), building(false), built(false) {
+  memset(keypad, 0, sizeof(keypad));
+}
+
+ContactIndex::~ContactIndex() {
+  this->clear();
+}
+
+void ContactIndex::setKeypad(const char* const keys[], int n) {
+  memset(keypad, 0, sizeof(keypad));
+  for (int i = 0; i < n; i++) {
+    char digit = i < 10 ? '0' + i : '#';
+    for (const char* c = keys[i]; *c; c++) {
+      unsigned char u = *c;         // char may be signed: bytes above 127 are not on the keypad
+      if (u < sizeof(keypad) && !keypad[u]) {
+        keypad[tolower(u)] = digit;
+        keypad[toupper(u)] = digit;
+      }
+    }
+  }
+}
+
+void ContactIndex::clear() {
+  for (size_t i = 0; i < contacts.size(); i++) {
+    freeNull((void **) &contacts[i].textDyn);
+  }
+  contacts.clear();
+  keys.clear();
+  freeSlots = 0;
+  textBytes = 0;
+  building = false;
+  built = false;
+}
+
+void ContactIndex::beginBuild() {
+  this->clear();
+  building = true;
+}
+
+void ContactIndex::endBuild() {
+  keys.sort(compareKeys);
+  building = false;
+  built = true;
+  log_d("contacts indexed: %d, keys: %d, memory: %d", (int) this->size(), (int) keys.size(), (int) this->memoryUsed());
+}
+
+/* Description:
+ *     keypad digits of the characters in [s, end) (those not on the keypad are skipped), and where the words start in
+ *     them: at a letter or digit that follows anything else.
+ * Return:
+ *     number of digits written to `out`, which is NUL-terminated
+ */
+size_t ContactIndex::digitsOf(const char* s, const char* end, char* out, size_t* wordStarts, int& nWords) {
+  size_t len = 0;
+  bool inWord = false;
+  nWords = 0;
+  for (; s < end; s++) {
+    unsigned char c = *s;
+    if (c >= sizeof(keypad) || !keypad[c]) {
+      inWord = false;
+      continue;
+    }
+    if (isalnum(c)) {
+      if (!inWord && nWords < MAX_WORDS) {
+        wordStarts[nWords++] = len;
+      }
+      inWord = true;
+    } else {
+      inWord = false;
+    }
+    out[len++] = keypad[c];
+  }
+  out[len] = '\0';
+  return len;
+}
+
+/* Description:
+ *     user part of a URI: after the scheme, up to the host or parameters
+ */
+static const char* userPart(const char* uri, const char*& end) {
+  if (!strncasecmp(uri, "sip:", 4) || !strncasecmp(uri, "tel:", 4)) {
+    uri += 4;
+  } else if (!strncasecmp(uri, "sips:", 5)) {
+    uri += 5;
+  }
+  end = uri + strcspn(uri, "@;?");
+  return uri;
+}
+
+static size_t textSize(const char* name, const char* uri) {
+  const char* userEnd;
+  const char* user = userPart(uri, userEnd);
+  return 2 * strlen(name) + strlen(uri) + (userEnd - user) + 4;
+}
+
+bool ContactIndex::add(const char* name, const char* uri) {
+  if (!building && !built) {
+    return false;
+  }
+  if (name == NULL) {
+    name = "";
+  }
+  if (uri == NULL) {
+    uri = "";
+  }
+
+  const char* userEnd;
+  const char* user = userPart(uri, userEnd);
+  size_t nameLen = strlen(name);
+  size_t uriLen = strlen(uri);
+  if (nameLen + 1 + uriLen > UINT16_MAX || contacts.size() - freeSlots >= UINT16_MAX) {
+    return false;
+  }
+  size_t size = textSize(name, uri);
+  char* text = (char*) extMalloc(size);
+  if (text == NULL) {
+    log_e("out of memory");
+    return false;
+  }
+  memcpy(text, name, nameLen + 1);
+  memcpy(text + nameLen + 1, uri, uriLen + 1);
+  char* nameDigits = text + nameLen + 1 + uriLen + 1;
+  size_t nameStarts[MAX_WORDS], userStarts[MAX_WORDS];
+  int nNameWords, nUserWords;
+  char* userDigits = nameDigits + this->digitsOf(name, name + nameLen, nameDigits, nameStarts, nNameWords) + 1;
+  this->digitsOf(user, userEnd, userDigits, userStarts, nUserWords);
+
+  // Slot
+  Contact contact;
+  contact.textDyn = text;
+  contact.uriOffset = nameLen + 1;
+  size_t slot = contacts.size();
+  if (freeSlots > 0) {
+    for (slot = 0; contacts[slot].textDyn != NULL; slot++);
+    contacts[slot] = contact;
+    freeSlots--;
+  } else if (!contacts.add(contact)) {
+    free(text);
+    return false;
+  }
+  textBytes += size;
+
+  // Keys
+  bool ok = true;
+  for (int i = 0; i < nNameWords && ok; i++) {
+    ok = this->addKey(nameDigits + nameStarts[i], slot, i == 0 ? 0 : 1);
+  }
+  for (int i = 0; i < nUserWords && ok; i++) {
+    ok = this->addKey(userDigits + userStarts[i], slot, 2);
+  }
+  if (!ok) {
+    this->remove(name, uri);
+  }
+  return ok;
+}
+
+bool ContactIndex::addKey(const char* digits, uint16_t contact, uint8_t rank) {
+  Key key;
+  key.digits = digits;
+  memset(key.prefix, 0, sizeof(key.prefix));                   // NUL-padded, not terminated
+  memcpy(key.prefix, digits, strnlen(digits, sizeof(key.prefix)));
+  key.contact = contact;
+  key.rank = rank;
+  if (building) {
+    return keys.add(key);     // sorted at the end
+  }
+  size_t lo = 0, hi = keys.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (compareKeys(&keys[mid], &key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return keys.insert(lo, key);
+}
+
+bool ContactIndex::remove(const char* name, const char* uri) {
+  if (!building && !built) {
+    return false;
+  }
+  if (name == NULL) {
+    name = "";
+  }
+  if (uri == NULL) {
+    uri = "";
+  }
+  size_t slot;
+  for (slot = 0; slot < contacts.size(); slot++) {
+    const char* text = contacts[slot].textDyn;
+    if (text != NULL && !strcmp(text, name) && !strcmp(text + contacts[slot].uriOffset, uri)) {
+      break;
+    }
+  }
+  if (slot >= contacts.size()) {
+    return false;
+  }
+
+  // Drop its keys, keeping the order of the others
+  size_t j = 0;
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (keys[i].contact != slot) {
+      keys[j++] = keys[i];
+    }
+  }
+  while (keys.size() > j) {
+    keys.remove(keys.size() - 1);
+  }
+
+  textBytes -= textSize(contacts[slot].textDyn, contacts[slot].textDyn + contacts[slot].uriOffset);
+  freeNull((void **) &contacts[slot].textDyn);
+  freeSlots++;
+  return true;
+}
+
+size_t ContactIndex::firstKey(uint8_t rank, const char* digits, size_t len) {
+  size_t lo = 0, hi = keys.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (keys[mid].rank < rank || (keys[mid].rank == rank && comparePrefix(keys[mid], digits, len) < 0)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+int ContactIndex::find(const char* digits, Match* matches, int max) {
+  size_t len = digits != NULL ? strlen(digits) : 0;
+  if (!built || len == 0 || len > MAX_DIGITS) {
+    return 0;
+  }
+
+  // The keys of each rank starting with the digits are next to each other, in the order of their digits
+  int n = 0;
+  uint16_t found[MAX_MATCHES];
+  for (uint8_t rank = 0; rank <= 2 && n < max && n < MAX_MATCHES; rank++) {
+    for (size_t i = this->firstKey(rank, digits, len);
+         n < max && n < MAX_MATCHES && i < keys.size() && keys[i].rank == rank && !comparePrefix(keys[i], digits, len); i++) {
+      uint16_t c = keys[i].contact;
+      int k;
+      for (k = 0; k < n && found[k] != c; k++);
+      if (k == n) {
+        found[n] = c;
+        matches[n].name = contacts[c].textDyn;
+        matches[n].uri = matches[n].name + contacts[c].uriOffset;
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+size_t ContactIndex::memoryUsed() {
+  return contacts.maxSize() * sizeof(Contact) + keys.maxSize() * sizeof(Key) + textBytes;
+}
+
+/* Description:
+ *     compare the first `len` digits of a key, as strncmp(key.digits, digits, len) would
+ */
+int ContactIndex::comparePrefix(const Key& key, const char* digits, size_t len) {
+  int res = strncmp(key.prefix, digits, len < sizeof(key.prefix) ? len : sizeof(key.prefix));
+  if (res || len <= sizeof(key.prefix) || key.prefix[sizeof(key.prefix) - 1] == '\0') {
+    return res;
+  }
+  return strncmp(key.digits + sizeof(key.prefix), digits + sizeof(key.prefix), len - sizeof(key.prefix));
+}
+
+int ContactIndex::compareKeys(Key* a, Key* b) {
+  if (a->rank != b->rank) {
+    return a->rank - b->rank;
+  }
+  int res = strncmp(a->prefix, b->prefix, sizeof(a->prefix));
+  if (!res && a->prefix[sizeof(a->prefix) - 1] != '\0') {
+    res = strcmp(a->digits + sizeof(a->prefix), b->digits + sizeof(b->prefix));
+  }
+  if (res) {
+    return res;
+  }
+  return (int) a->contact - (int) b->contact;
+}
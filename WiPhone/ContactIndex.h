@@ -0,0 +1,107 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef CONTACT_INDEX_H
+#define CONTACT_INDEX_H
+
+#include <Arduino.h>
+#include "LinearArray.h"
+
+/* Description:
+ *     T9 search of the phonebook contacts: the digits typed on the keypad (as in GUI::alphNum, "abc2" -> '2') are
+ *     matched against the beginnings of the words of contact names and of the user part of their SIP URIs.
+ *     "5646" finds "John Smith", "Peter Johnson" and "sip:john.doe@example.org"; "12345" finds "sip:+12345@...".
+ *
+ *     Every word is a key: a pointer to its digits, sorted by rank (first word of the name, other words, URI), then
+ *     by the digits. For each rank the keys starting with the digits typed are next to each other and are found by
+ *     binary search, and only as many of them are read as there are matches to return: a lookup takes O(log n) however
+ *     many contacts match a short prefix. The first digits are copied into the key, so that the search seldom has to
+ *     touch the contacts.
+ *     Each contact is one allocation in PSRAM: "name\0uri\0digits of name\0digits of user\0".
+ *
+ *     The index is built once from the whole phonebook (see PhonebookApp::indexContacts()), then kept up to date with
+ *     add() and remove() as contacts are added, edited or deleted.
+ */
+class ContactIndex {
+public:
+  static const size_t MAX_DIGITS = 32;                // typed; longer words are indexed anyway
+  static const int MAX_MATCHES = 8;                   // per find()
+
+  struct Match {
+    const char* name;                                 // valid until the index changes
+    const char* uri;
+  };
+
+  ContactIndex();
+  ~ContactIndex();
+
+  void setKeypad(const char* const keys[], int n);    // characters of each key: keys[i] -> '0' + i ('#' for 10)
+
+  // Building
+  void clear();                                       // empty, not built (the phonebook changed as a whole)
+  void beginBuild();
+  void endBuild();
+  bool isBuilt() {
+    return built;
+  };
+
+  // Changes (ignored while the index is not built: it will be built from the phonebook as it is then)
+  bool add(const char* name, const char* uri);
+  bool remove(const char* name, const char* uri);     // one contact with both the same
+
+  /* Description:
+   *     contacts with a word starting with `digits`: first those whose name starts with them, then those with another
+   *     word of the name, then those with the user part of the URI; each of these groups in the order of the digits of
+   *     the word (so that "Bob", 262, comes before "Anna", 2662, for "2").
+   * Return:
+   *     number of matches written (at most `max` and MAX_MATCHES)
+   */
+  int find(const char* digits, Match* matches, int max);
+
+  size_t size() {
+    return contacts.size() - freeSlots;
+  };
+  size_t memoryUsed();
+
+protected:
+  struct Contact {
+    char* textDyn;                                    // "name\0uri\0digits\0digits\0"; NULL - free slot
+    uint16_t uriOffset;
+  };
+  struct Key {
+    const char* digits;                               // of a word, up to the end of the name or user part
+    char prefix[4];                                   // its first digits (NUL-padded): most keys are compared by these
+    uint16_t contact;
+    uint8_t rank;                                     // 0 - first word of the name, 1 - other word, 2 - URI
+  };
+
+  LinearArray<Contact, LA_EXTERNAL_RAM> contacts;
+  LinearArray<Key, LA_EXTERNAL_RAM> keys;             // sorted by rank, digits and contact, except while building
+  size_t freeSlots;
+  size_t textBytes;
+  bool building;
+  bool built;
+  char keypad[128];                                   // ASCII character -> digit, '\0' - not on the keypad
+
+  size_t digitsOf(const char* s, const char* end, char* out, size_t* wordStarts, int& nWords);
+  bool addKey(const char* digits, uint16_t contact, uint8_t rank);
+  size_t firstKey(uint8_t rank, const char* digits, size_t len);     // position of the first key >= (rank, digits)
+
+  static int comparePrefix(const Key& key, const char* digits, size_t len);
+  static int compareKeys(Key* a, Key* b);
+};
+
+extern ContactIndex contactIndex;
+
+#endif // CONTACT_INDEX_H
@@ -13,7 +13,9 @@ governing permissions and limitations under the License.
 */
 
 #include "GUI.h"
+#include "Stun.h"
 #include "tinySIP.h"
+#include "TlsConnection.h"
 #include "ota.h"
 #include "Test.h"
 
@@ -31,6 +33,7 @@ governing permissions and limitations under the License.
 
 LCD* static_lcd = NULL;
 bool UDP_SIP = false;
+bool TLS_SIP = false;         // SIP over TLS (UDP_SIP is false then)
 bool loudSpkr = false;
 bool wifiOn = true;
 
@@ -47,6 +50,9 @@ GUI::GUI() {
   footer = new FooterWidget("???", "???", state);
   mainMenu = NULL;
 
+  // Contacts are searched with the same keypad letters as typed
+  contactIndex.setKeypad(alphNum, 11);
+
   // Cursor position
   xPos = 0;
   yPos = 0;
@@ -399,11 +405,12 @@ void ControlState::setSipAccount(const char* dispName, const char* uri, const ch
     } else {
       UDP_SIP = false;
     }
+    TLS_SIP = !strcmp(global_UDP_TCP_SIP, "TLS-SIP");
     log_d("new globalUDP_TCP_SIP: %s", global_UDP_TCP_SIP);
   }
 
   if (sipAccountChanged) {
-    log_d("SIP ACCOUNT CHANGED UDP-SIP:%d", UDP_SIP);
+    log_d("SIP ACCOUNT CHANGED UDP-SIP:%d TLS-SIP:%d", UDP_SIP, TLS_SIP);
     sipRegistered = false;
   }
 }
@@ -513,6 +520,9 @@ void ControlState::setSipState(CallState newState) {
   showCallState(newState);
   log_d("");
   sipState = newState;
+  if (newState != CallState::Call) {
+    callHoldRequested = callOnHold = callRemoteHold = false;
+  }
 }
 
 bool ControlState::scheduleEvent(EventType event, uint32_t msTriggerAt) {
@@ -840,6 +850,9 @@ appEventResult GUI::processEvent(uint32_t now, EventType event) {
         case TIME_UPDATE_EVENT:
           p = "TIME_UPDATE_EVENT";
           break;
+        case PRESENCE_UPDATE_EVENT:
+          p = "PRESENCE_UPDATE_EVENT";
+          break;
         case USER_SERIAL_EVENT:
           p = "USER_SERIAL_EVENT";
           break;
@@ -992,6 +1005,7 @@ appEventResult GUI::processEvent(uint32_t now, EventType event) {
               res |= runningApp->isWindowed() ? REDRAW_ALL : REDRAW_SCREEN;  // initialize screen for the newly launched app
             }
           } else if (menu[ci].action == GUI_ACTION_RESTART) {
+            IniFile::syncAll();
             ESP.restart();
           }
         }
@@ -1392,7 +1406,7 @@ void GUI::enterApp(ActionID_t app) {
     break;
   case GUI_APP_DIALING:
     // NOTE: passing physical screen `lcd` for creating the CallApp recursively
-    runningApp = new DialingApp(audio, *screen, lcd, state, header, footer);
+    runningApp = new DialingApp(audio, *screen, lcd, state, flash, header, footer);
     break;
   case GUI_APP_PHONEBOOK:
     // NOTE: passing physical screen `lcd` for creating the CallApp recursively
@@ -1831,6 +1845,7 @@ appEventResult OtaApp::processEvent(EventType event) {
     Ota o("");
     o.setUserRequestedUpdate(true);
     o.reset();
+    IniFile::syncAll();
     ESP.restart();
   }
 
@@ -2405,10 +2420,14 @@ void NotepadApp::redrawScreen(bool redrawAll) {
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - -  Dialing app  - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-DialingApp::DialingApp(Audio* audio, LCD& disp, LCD& hardDisp, ControlState& state, HeaderWidget* header, FooterWidget* footer)
-  : WindowedApp(disp, state, header, footer), FocusableApp(1), audio(audio), hardDisp(hardDisp) {
+DialingApp::DialingApp(Audio* audio, LCD& disp, LCD& hardDisp, ControlState& state, Storage& flash, HeaderWidget* header, FooterWidget* footer)
+  : WindowedApp(disp, state, header, footer), FocusableApp(1), audio(audio), hardDisp(hardDisp), flash(flash) {
   log_d("create DialingApp");
 
+  if (!contactIndex.isBuilt()) {
+    PhonebookApp::indexContacts(flash);
+  }
+
   header->setTitle("Dialing");
   footer->setButtons("Call", "Clear");
 
@@ -2418,10 +2437,17 @@ DialingApp::DialingApp(Audio* audio, LCD& disp, LCD& hardDisp, ControlState& sta
 
   const int16_t xPad =  5;
   const int16_t yPad =  3;
-  textArea = new MultilineTextWidget(0, yOff, lcd.width(), lcd.height() - footer->height() - yOff,
+  const int16_t suggestionHeight = 26;
+  textArea = new MultilineTextWidget(0, yOff, lcd.width(), lcd.height() - footer->height() - N_SUGGESTIONS*suggestionHeight - yOff,
                                      NULL, state, 70, fonts[AKROBAT_BOLD_32], InputType::Numeric, xPad, yPad);
   textArea->verticalCentering(true);
   textArea->setColors(WP_COLOR_1, WP_COLOR_0);
+  yOff += textArea->height();
+
+  for (int i = 0; i < N_SUGGESTIONS; i++) {
+    suggestionLabels[i] = new LabelWidget(0, yOff, lcd.width(), suggestionHeight, "", WP_COLOR_1, WP_COLOR_0, fonts[AKROBAT_BOLD_18], LabelWidget::LEFT_TO_RIGHT, 8);
+    yOff += suggestionHeight;
+  }
 
   // Focusables
   this->addFocusableWidget(textArea);
@@ -2434,6 +2460,41 @@ DialingApp::~DialingApp() {
     delete callApp;
   }
   delete textArea;
+  delete errorLabel;
+  for (int i = 0; i < N_SUGGESTIONS; i++) {
+    delete suggestionLabels[i];
+  }
+}
+
+/* Description:
+ *     find the contacts matching the digits typed, as on the keypad letters ("5646" -> "John"), unless a whole
+ *     number is being typed in with other characters too.
+ */
+void DialingApp::suggest() {
+  const char* text = textArea->getText();
+  nSuggestions = 0;
+  suggestion = -1;
+  if (text != NULL && *text && strspn(text, "0123456789") == strlen(text)) {
+    nSuggestions = contactIndex.find(text, suggestions, N_SUGGESTIONS);
+  }
+  this->showSuggestions();
+}
+
+void DialingApp::showSuggestions() {
+  for (int i = 0; i < N_SUGGESTIONS; i++) {
+    if (i < nSuggestions) {
+      char buff[100];
+      snprintf(buff, sizeof(buff), "%s  %s", *suggestions[i].name ? suggestions[i].name : "(no name)", suggestions[i].uri);
+      suggestionLabels[i]->setText(buff);
+    } else {
+      suggestionLabels[i]->setText("");
+    }
+    if (i == suggestion) {
+      suggestionLabels[i]->setColors(WP_COLOR_1, WP_ACCENT_1);
+    } else {
+      suggestionLabels[i]->setColors(WP_COLOR_1, WP_COLOR_0);
+    }
+  }
 }
 
 appEventResult DialingApp::processEvent(EventType event) {
@@ -2452,9 +2513,14 @@ appEventResult DialingApp::processEvent(EventType event) {
   } else if (LOGIC_BUTTON_OK(event)) {
     if (controlState.isCallPossible()) {
       // Make a call
-      log_d("CALLING %s", textArea->getText());
-
-      controlState.setRemoteNameUri("Dialed number", textArea->getText());
+      if (suggestion >= 0) {
+        log_d("CALLING %s", suggestions[suggestion].uri);
+        controlState.setRemoteNameUri(suggestions[suggestion].name, suggestions[suggestion].uri);
+      } else {
+        log_d("CALLING %s", textArea->getText());
+        const char* name = PhonebookApp::callerName(flash, textArea->getText());
+        controlState.setRemoteNameUri(name != NULL ? name : "Dialed number", textArea->getText());
+      }
       controlState.setSipReason("");
       controlState.setSipState(CallState::InvitingCallee);
 
@@ -2470,11 +2536,21 @@ appEventResult DialingApp::processEvent(EventType event) {
     }
   } else if (event == WIPHONE_KEY_END) {
     return EXIT_APP;
+  } else if ((event == WIPHONE_KEY_DOWN || event == WIPHONE_KEY_UP) && nSuggestions > 0) {
+    // Choose a contact to call instead of the number
+    if (event == WIPHONE_KEY_DOWN) {
+      suggestion = suggestion + 1 < nSuggestions ? suggestion + 1 : -1;
+    } else {
+      suggestion = suggestion >= 0 ? suggestion - 1 : nSuggestions - 1;
+    }
+    this->showSuggestions();
+    return REDRAW_SCREEN;
   }
   if (event == '*') {
     event = '+';  // temporary solution to allow + input
   }
   textArea->processEvent(event);
+  this->suggest();
   return REDRAW_SCREEN;
 }
 
@@ -2490,6 +2566,9 @@ void DialingApp::redrawScreen(bool redrawAll) {
     this->error = false;
   }
   ((GUIWidget*) textArea)->redraw(lcd);
+  for (int i = 0; i < N_SUGGESTIONS; i++) {
+    ((GUIWidget*) suggestionLabels[i])->refresh(lcd, !this->screenInited || redrawAll);
+  }
   this->screenInited = true;
 }
 
@@ -3521,6 +3600,7 @@ PhonebookApp::PhonebookApp(Audio* audio, LCD& lcd, LCD& hardDisp, ControlState&
   // Menu widgets
   menu    = NULL;
   options = NULL;
+  t9Digits[0] = '\0';
 
   // VIEWING widgets
   const int16_t pad =  8;
@@ -3753,7 +3833,8 @@ void PhonebookApp::createLoadMenu() {
                         "Phonebook is empty", fonts[AKROBAT_EXTRABOLD_22], N_MENU_ITEMS);
   menu->setStyle(MenuWidget::DEFAULT_STYLE, WP_COLOR_0, WP_COLOR_1, WP_COLOR_1, WP_ACCENT_1);   // in original design it used WP_ACCENT_0, but this doesn't make sense: too bright, text cannot be read
 
-  // Add all individual addresses
+  // Add all individual addresses (the contacts they show presence of must be known first)
+  watchPresence(flash, controlState.fromUriDyn);
   if (flash.phonebook.isLoaded() || flash.loadPhonebook()) {
     for (auto si = flash.phonebook.iterator(1); si.valid(); ++si) {
       MenuOptionPhonebook* option = new MenuOptionPhonebook((int)si, 1, si->getValueSafe("n", ""), si->getValueSafe("s", ""));
@@ -3766,12 +3847,146 @@ void PhonebookApp::createLoadMenu() {
 
 }
 
+/* Description:
+ *     passes the SIP URIs of a phonebook file to presence.watch() as the file is parsed, without loading it.
+ */
+class PhonebookUriVisitor : public NanoIni::Visitor {
+public:
+  bool section(const char* title, size_t titleLength) {
+    nSections++;
+    return true;
+  }
+  bool keyValue(const char* key, size_t keyLength, const char* value, size_t valueLength) {
+    // Key "s" of the contacts (section 0 is the header)
+    if (nSections > 1 && key && keyLength == 1 && *key == 's' && valueLength > 0 && valueLength <= PresenceTable::MAX_URI_LENGTH) {
+      char uri[PresenceTable::MAX_URI_LENGTH + 1];
+      memcpy(uri, value, valueLength);
+      uri[valueLength] = '\0';
+      presence.watch(uri);
+    }
+    return true;
+  }
+
+protected:
+  int nSections = 0;
+};
+
+/* Description:
+ *     the contacts of the phonebook are watched for presence by the primary account (see TinySIP::checkPresence).
+ *     Done whenever the phonebook menu is (re)loaded, that is after every change of the phonebook too.
+ *     At boot the phonebook is not loaded yet: its file is only scanned.
+ */
+void PhonebookApp::watchPresence(Storage& flash, const char* accountUri) {
+  presence.beginList(accountUri);
+  PhonebookUriVisitor visitor;
+  if (flash.phonebook.isLoaded() || (!IniFile::scan(Storage::PhonebookFile, visitor) && flash.loadPhonebook())) {     // no file: restored from NVS
+    for (auto si = flash.phonebook.iterator(1); si.valid(); ++si) {
+      const char* uri = si->getValueSafe("s", "");
+      if (*uri) {
+        presence.watch(uri);
+      }
+    }
+  }
+  presence.endList();
+}
+
+/* Description:
+ *     passes the name and SIP URI of every contact of a phonebook file to a function as the file is parsed, without
+ *     loading it.
+ */
+class PhonebookContactVisitor : public NanoIni::Visitor {
+public:
+  PhonebookContactVisitor(PhonebookApp::ContactFunction found) : found(found) {}
+  ~PhonebookContactVisitor() {
+    freeNull((void **) &nameDyn);
+    freeNull((void **) &uriDyn);
+  }
+  bool section(const char* title, size_t titleLength) {
+    this->flush();
+    nSections++;
+    return true;
+  }
+  bool keyValue(const char* key, size_t keyLength, const char* value, size_t valueLength) {
+    // Keys "n" and "s" of the contacts (section 0 is the header)
+    if (nSections > 1 && key && keyLength == 1 && (*key == 'n' || *key == 's')) {
+      char** p = *key == 'n' ? &nameDyn : &uriDyn;
+      freeNull((void **) p);
+      *p = extStrndup(value ? value : "", valueLength);
+    }
+    return true;
+  }
+  void end() {
+    this->flush();
+  }
+
+protected:
+  PhonebookApp::ContactFunction found;
+  int nSections = 0;
+  char* nameDyn = NULL;
+  char* uriDyn = NULL;
+
+  void flush() {
+    if (nameDyn || uriDyn) {
+      found(nameDyn ? nameDyn : "", uriDyn ? uriDyn : "");
+    }
+    freeNull((void **) &nameDyn);
+    freeNull((void **) &uriDyn);
+  }
+};
+
+/* Description:
+ *     name and SIP URI of every contact, in the order of the phonebook. The phonebook is not loaded for it if it is
+ *     not yet: its file is only scanned.
+ */
+void PhonebookApp::forEachContact(Storage& flash, ContactFunction found) {
+  PhonebookContactVisitor visitor(found);
+  if (flash.phonebook.isLoaded() || (!IniFile::scan(Storage::PhonebookFile, visitor) && flash.loadPhonebook())) {     // no file: restored from NVS
+    for (auto si = flash.phonebook.iterator(1); si.valid(); ++si) {
+      found(si->getValueSafe("n", ""), si->getValueSafe("s", ""));
+    }
+  }
+}
+
+/* Description:
+ *     the T9 search of DialingApp and of the phonebook menu is built once, the first time it is needed, then kept up to
+ *     date as contacts are added, edited and deleted here.
+ */
+void PhonebookApp::indexContacts(Storage& flash) {
+  contactIndex.beginBuild();
+  forEachContact(flash, [](const char* name, const char* uri) {
+    contactIndex.add(name, uri);
+  });
+  contactIndex.endBuild();
+}
+
+/* Description:
+ *     name of the contact with a SIP URI, to be shown instead of the URI (see CallerIdCache). The cache is built when
+ *     first needed after every change of the phonebook.
+ * Return:
+ *     NULL if the URI is not in the phonebook
+ */
+const char* PhonebookApp::callerName(Storage& flash, const char* uri) {
+  if (!callerIds.isBuilt()) {
+    callerIds.beginBuild();
+    forEachContact(flash, [](const char* name, const char* contactUri) {
+      callerIds.add(name, contactUri);
+    });
+    callerIds.endBuild();
+  }
+  return callerIds.name(uri);
+}
+
 appEventResult PhonebookApp::processEvent(EventType event) {
   log_i("processEvent PhonebookApp");
 
   appEventResult res = DO_NOTHING;
 
-  if (messageApp != NULL) {
+  if (event == PRESENCE_UPDATE_EVENT) {
+
+    // Only the status dots of the menu change
+    return messageApp==NULL && appState==SELECTING ? REDRAW_SCREEN : DO_NOTHING;
+
+  } else if (messageApp != NULL) {
 
     if ((res = messageApp->processEvent(event)) & EXIT_APP) {
       changeState(appState);    // appState doesn't change, we just use this to update Header and Footer widgets
@@ -3800,8 +4015,34 @@ appEventResult PhonebookApp::processEvent(EventType event) {
     } else if (event == WIPHONE_KEY_SELECT) {
       currentKey = 0;   // empty / new
       res |= changeState(ADDING);
+    } else if (event >= '0' && event <= '9') {
+      // T9: jump to the best contact for the digits typed so far, or for this one alone
+      size_t len = strlen(t9Digits);
+      if (len >= ContactIndex::MAX_DIGITS) {
+        len = 0;
+      }
+      t9Digits[len] = event;
+      t9Digits[len + 1] = '\0';
+      if (!contactIndex.isBuilt()) {
+        indexContacts(flash);
+      }
+      ContactIndex::Match match;
+      if (!contactIndex.find(t9Digits, &match, 1)) {
+        t9Digits[0] = event;
+        t9Digits[1] = '\0';
+      }
+      if (contactIndex.find(t9Digits, &match, 1)) {
+        for (auto si = flash.phonebook.iterator(1); si.valid(); ++si) {
+          if (!strcmp(si->getValueSafe("n", ""), match.name) && !strcmp(si->getValueSafe("s", ""), match.uri)) {
+            menu->select((int)si);
+            break;
+          }
+        }
+      }
+      res |= REDRAW_SCREEN;
     } else {
       // Probably navigation or search
+      t9Digits[0] = '\0';
       menu->processEvent(event);
       MenuOption::keyType sel = menu->readChosen();
       if (sel>0) {
@@ -3866,6 +4107,8 @@ appEventResult PhonebookApp::processEvent(EventType event) {
           res |= changeState(EDITING);
         } else if (sel==0x102) {
           // "Delete" option selected
+          callerIds.clear();
+          contactIndex.remove(flash.phonebook[currentKey].getValueSafe("n", ""), flash.phonebook[currentKey].getValueSafe("s", ""));
           if (flash.phonebook.removeSection(currentKey)) {
             flash.phonebook.store();
           }
@@ -3919,7 +4162,9 @@ appEventResult PhonebookApp::processEvent(EventType event) {
     if (LOGIC_BUTTON_OK(event)) {
 
       log_v("modifying phonebook");
+      callerIds.clear();
       if (currentKey) {
+        contactIndex.remove(flash.phonebook[currentKey].getValueSafe("n", ""), flash.phonebook[currentKey].getValueSafe("s", ""));
         flash.phonebook.removeSection(currentKey);
       }
       flash.phonebook.addSection();
@@ -3938,6 +4183,7 @@ appEventResult PhonebookApp::processEvent(EventType event) {
       }
       flash.phonebook[-1]["s"] = sipUriInput->getText();
       flash.phonebook[-1]["l"] = loraInput->getText();
+      contactIndex.add(flash.phonebook[-1].getValueSafe("n", ""), flash.phonebook[-1].getValueSafe("s", ""));
       flash.phonebook.reorderLast(1, &(Storage::phonebookCompare));
 
       // Save phonebook
@@ -4177,6 +4423,7 @@ SipAccountsApp::SipAccountsApp(LCD& lcd, ControlState& state, Storage& flash, He
   udpTcpSipSelection = new ChoiceWidget(lcd.width()/2, yOff-passwordInput->height(), lcd.width()/2, 35);
   udpTcpSipSelection->addChoice("UDP-SIP");
   udpTcpSipSelection->addChoice("TCP-SIP");
+  udpTcpSipSelection->addChoice("TLS-SIP");
   yOff += udpTcpSipSelection->height();
 
   // Populate menu
@@ -4275,17 +4522,21 @@ void SipAccountsApp::changeState(SipAccountsAppState_t newState) {
         }
         //read the UDP-SIP selection from ini (as backward-compatible)
         bool tmpUDP_SIP = false;
+        bool tmpTLS_SIP = false;
         if (ini[currentKey].hasKey("u")) {
           if(strcmp(ini[currentKey]["u"], "UDP-SIP") == 0) {
             tmpUDP_SIP = true;
           } else {
             tmpUDP_SIP = false;
+            tmpTLS_SIP = strcmp(ini[currentKey]["u"], "TLS-SIP") == 0;
           }
         } else {
           tmpUDP_SIP = false;
         }
         if(tmpUDP_SIP) {
           udpTcpSipSelection->setValue(0);
+        } else if(tmpTLS_SIP) {
+          udpTcpSipSelection->setValue(2);
         } else {
           udpTcpSipSelection->setValue(1);
         }
@@ -4297,6 +4548,19 @@ void SipAccountsApp::changeState(SipAccountsAppState_t newState) {
         viewMenu->deleteAll();
         viewMenu->addOption("Edit", NULL, 1003, 1, icon_edit_b, sizeof(icon_edit_b), icon_edit_w, sizeof(icon_edit_w));
         viewMenu->addOption(primary ? "Unmake primary" : "Make primary", NULL, 1004, 1, icon_edit_b, sizeof(icon_edit_b), icon_edit_w, sizeof(icon_edit_w));
+        if (!primary) {
+          // Besides the primary account, others can stay registered at the same time (see SipPool)
+          bool registered = currentKey < ini.nSections() && ini[currentKey].hasKey("r");
+          viewMenu->addOption(registered ? "Don't keep registered" : "Keep registered", NULL, 1005, 1, icon_edit_b, sizeof(icon_edit_b), icon_edit_w, sizeof(icon_edit_w));
+        }
+        // NAT traversal: the STUN server of the primary account is used (see StunClient)
+        bool stunUsed = currentKey < ini.nSections() && ini[currentKey].hasKey("t");
+        viewMenu->addOption(stunUsed ? "Don't use STUN" : "Use STUN", NULL, 1006, 1, icon_edit_b, sizeof(icon_edit_b), icon_edit_w, sizeof(icon_edit_w));
+        // SIP over TLS: the server certificate must be verified, unless turned off for the account (see initTls)
+        if (currentKey < ini.nSections() && !strcmp(ini[currentKey].getValueSafe("u", ""), "TLS-SIP")) {
+          bool insecure = ini[currentKey].hasKey("i");
+          viewMenu->addOption(insecure ? "Verify TLS server" : "Don't verify TLS server", NULL, 1007, 1, icon_edit_b, sizeof(icon_edit_b), icon_edit_w, sizeof(icon_edit_w));
+        }
         viewMenu->addOption("Delete", NULL, 1009, 1, icon_delete_r, sizeof(icon_delete_r), icon_delete_w, sizeof(icon_delete_w));
       }
 
@@ -4465,6 +4729,71 @@ appEventResult SipAccountsApp::processEvent(EventType event) {
             changeState(VIEWING);
             res |= REDRAW_ALL;
           }
+        } else if (sel==1005) {
+
+          // "Keep registered" toggle for a secondary SIP account
+
+          if (currentKey < ini.nSections()) {
+            if (ini[currentKey].hasKey("r")) {
+              ini[currentKey].remove("r");
+            } else {
+              ini[currentKey]["r"] = "y";   // "register = yes"
+            }
+            controlState.sipAccountChanged = true;     // reconnect all the accounts
+
+            // Store changes
+            if (ini.store()) {
+              log_v("saved");
+            } else {
+              log_e("failed to save");
+            }
+            changeState(VIEWING);
+            res |= REDRAW_ALL;
+          }
+        } else if (sel==1006) {
+
+          // "Use STUN" toggle: the server can be changed in the file (e.g. to a local one for testing)
+
+          if (currentKey < ini.nSections()) {
+            if (ini[currentKey].hasKey("t")) {
+              ini[currentKey].remove("t");
+            } else {
+              ini[currentKey]["t"] = StunClient::DEFAULT_SERVER;
+            }
+            if (ini[currentKey].hasKey("m")) {
+              controlState.sipAccountChanged = true;     // reconnect to advertise other addresses
+            }
+
+            // Store changes
+            if (ini.store()) {
+              log_v("saved");
+            } else {
+              log_e("failed to save");
+            }
+            changeState(VIEWING);
+            res |= REDRAW_ALL;
+          }
+        } else if (sel==1007) {
+
+          // "Don't verify TLS server" toggle: for a provider whose CA is not trusted by the phone
+
+          if (currentKey < ini.nSections()) {
+            if (ini[currentKey].hasKey("i")) {
+              ini[currentKey].remove("i");
+            } else {
+              ini[currentKey]["i"] = "y";   // "insecure = yes"
+            }
+            controlState.sipAccountChanged = true;     // reconnect with the new setting
+
+            // Store changes
+            if (ini.store()) {
+              log_v("saved");
+            } else {
+              log_e("failed to save");
+            }
+            changeState(VIEWING);
+            res |= REDRAW_ALL;
+          }
         } else if (sel==1009) {
           // "Delete" option selected
           if (currentKey < ini.nSections() && ini[currentKey].hasKey("m")) {
@@ -4491,6 +4820,7 @@ appEventResult SipAccountsApp::processEvent(EventType event) {
     if (LOGIC_BUTTON_OK(event)) {
       //get current UDP_SIP value (UDP - TCP selection choicewidget)
       bool tmpUDP_SIP = false;
+      bool tmpTLS_SIP = false;
       if (udpTcpSipSelection != NULL) {
         log_e("udptcpsipselection: %d", udpTcpSipSelection->getValue());
         switch (udpTcpSipSelection->getValue()) {
@@ -4500,6 +4830,10 @@ appEventResult SipAccountsApp::processEvent(EventType event) {
         case 1: // TCP-SIP
           tmpUDP_SIP = false;
           break;
+        case 2: // TLS-SIP
+          tmpUDP_SIP = false;
+          tmpTLS_SIP = true;
+          break;
         default:
           log_e("Unknown UDP-SIP - TCP-SIP selection: %d", udpTcpSipSelection->getValue());
           tmpUDP_SIP = false;
@@ -4517,6 +4851,8 @@ appEventResult SipAccountsApp::processEvent(EventType event) {
         //set udp-tcp selection
         if(tmpUDP_SIP) {
           ini[s]["u"] = "UDP-SIP";
+        } else if(tmpTLS_SIP) {
+          ini[s]["u"] = "TLS-SIP";
         } else {
           ini[s]["u"] = "TCP-SIP";
         }
@@ -4531,6 +4867,9 @@ appEventResult SipAccountsApp::processEvent(EventType event) {
         if(tmpUDP_SIP) {
           ini[currentKey]["u"] = "UDP-SIP";
           log_e("ini[currentKey][u] = UDP-SIP");
+        } else if(tmpTLS_SIP) {
+          ini[currentKey]["u"] = "TLS-SIP";
+          log_e("ini[currentKey][u] = TLS-SIP");
         } else {
           ini[currentKey]["u"] = "TCP-SIP";
           log_e("ini[currentKey][u] = TCP-SIP");
@@ -4753,6 +5092,11 @@ appEventResult CallApp::processEvent(EventType event) {
       controlState.setSipState(CallState::Accept);
       res |= REDRAW_SCREEN | REDRAW_FOOTER;
       audio->chooseSpeaker(EARSPEAKER);
+    } else if (controlState.sipState == CallState::Call && event == WIPHONE_KEY_OK) {
+      // Put on hold / resume (SELECT is the loudspeaker toggle)
+      stateCaption->setText(controlState.callOnHold ? "Resuming" : "Holding");
+      controlState.callHoldRequested = true;
+      res |= REDRAW_SCREEN;
     }
 
   } else if (event == CALL_UPDATE_EVENT) {
@@ -4776,8 +5120,8 @@ appEventResult CallApp::processEvent(EventType event) {
 
     } else if (controlState.sipState == CallState::Call) {
 
-      // Notify about start of the call
-      stateCaption->setText("Call in progress");
+      // Notify about start of the call (or about its hold state)
+      stateCaption->setText(controlState.callOnHold ? "On hold" : controlState.callRemoteHold ? "Held by remote" : "Call in progress");
       res |= REDRAW_SCREEN;
 
     } else if (controlState.sipState == CallState::HungUp) {
@@ -4796,7 +5140,7 @@ appEventResult CallApp::processEvent(EventType event) {
 
     int8_t earpieceVol, headphonesVol, loudspeakerVol;
     //audio->getVolumes(earpieceVol, headphonesVol, loudspeakerVol);
-    if ((ini.load() ) && !ini.isEmpty()) {
+    if ((ini.isLoaded() || ini.load()) && !ini.isEmpty()) {
       if (ini.hasSection("audio")) {
           log_d("getting audio info");
           earpieceVol = ini["audio"].getIntValueSafe(earpieceVolField, earpieceVol);
@@ -4829,10 +5173,7 @@ appEventResult CallApp::processEvent(EventType event) {
     ini["audio"][earpieceVolField] = earpieceVol;
     ini["audio"][headphonesVolField] = headphonesVol;
     ini["audio"][loudspeakerVolField] = loudspeakerVol;
-    if (ini.store()) {
-      log_d("new audio settings are saved");
-    }
-    ini.unload();
+    ini.storeLater();       // a few presses in a row are saved at once (or when the call ends)
     audio->setVolumes(earpieceVol, headphonesVol, loudspeakerVol);
     audio->getVolumes(earpieceVol, headphonesVol, loudspeakerVol);
     log_d("New Volumes are earspkr %d headphone %d loudspkr %d", earpieceVol,headphonesVol,loudspeakerVol );
@@ -6376,9 +6717,17 @@ MessagesApp::MessagesApp(LCD& lcd, ControlState& state, Storage& flash, HeaderWi
 
   inboxMenu = NULL;
   sentMenu = NULL;
+  conversationUri[0] = '\0';
+  conversationTitle[0] = '\0';
+  searchQuery[0] = '\0';
+  searchTitle[0] = '\0';
 
   subApp = NULL;
 
+  // Subscribe to app timer event: read ahead the messages next to those shown while idle
+  controlState.msAppTimerEventLast = millis();
+  controlState.msAppTimerEventPeriod = 200;
+
   enterState(MAIN);
 }
 
@@ -6394,6 +6743,21 @@ MessagesApp::~MessagesApp() {
   if(sentMenu) {
     delete sentMenu;
   }
+  if (conversationsMenu) {
+    delete conversationsMenu;
+  }
+  if (conversationMenu) {
+    delete conversationMenu;
+  }
+  if (searchMenu) {
+    delete searchMenu;
+  }
+  if (searchLabel) {
+    delete searchLabel;
+  }
+  if (searchInput) {
+    delete searchInput;
+  }
 
   if(subApp) {
     delete subApp;
@@ -6408,12 +6772,26 @@ void MessagesApp::enterState(MessagesState_t state) {
     header->setTitle("Inbox");
   } else if (state == OUTBOX) {
     header->setTitle("Outbox");
-  }
-  footer->setButtons("Select", "Back");
+  } else if (state == CONVERSATIONS) {
+    header->setTitle("Conversations");
+  } else if (state == CONVERSATION) {
+    header->setTitle(conversationTitle);
+  } else if (state == SEARCH) {
+    header->setTitle("Search");
+  } else if (state == SEARCH_RESULTS) {
+    header->setTitle(searchTitle);
+  }
+  footer->setButtons(state == SEARCH ? "Search" : "Select", "Back");
   appState = state;
 }
 
 appEventResult MessagesApp::processEvent(EventType event) {
+  if (event == APP_TIMER_EVENT) {
+    if (!subApp && (appState == INBOX || appState == OUTBOX)) {
+      flash.messages.prefetch();
+    }
+    return DO_NOTHING;
+  }
   log_i("processEvent MessagesApp %d", event);
 
   appEventResult res = REDRAW_SCREEN;
@@ -6431,6 +6809,17 @@ appEventResult MessagesApp::processEvent(EventType event) {
       // New message arrived: redraw inbox
       this->createLoadMessageMenu(INCOMING, inboxOffset, 0);
       res |= REDRAW_SCREEN;
+    } else if (appState == CONVERSATIONS) {
+      this->createConversationsMenu();
+      res |= REDRAW_SCREEN;
+    } else if (appState == CONVERSATION) {
+      this->createLoadConversationMenu(-1, 0);
+      res |= REDRAW_SCREEN;
+    } else if (appState == SEARCH_RESULTS) {
+      this->search();
+      this->createLoadSearchMenu(-1, 0);
+      enterState(SEARCH_RESULTS);     // number found in the title
+      res |= REDRAW_SCREEN;
     }
 
     // We assume that header will be redrawn by GUI class for this event, so we don't do res |= REDRAW_HEADER here
@@ -6447,7 +6836,10 @@ appEventResult MessagesApp::processEvent(EventType event) {
           flash.messages.clearPreloaded();
           // Create menus
           int32_t offset = ((ViewMessageApp*)subApp)->messageOffset;        // TODO: use it for preserving the visible offset
-          this->createLoadMessageMenu(appState==INBOX ? INCOMING : SENT, -1, 0);
+          if (appState == SEARCH_RESULTS) {
+            this->search();           // compacting the messages drops the results
+          }
+          this->reloadMessageMenu(-1, 0);
           this->createMainMenu();
         }
         // After viewing message `appState` stays the same, just need to change Title and Header widgets
@@ -6480,6 +6872,12 @@ appEventResult MessagesApp::processEvent(EventType event) {
       case 3:
         enterState(COMPOSING);
         break;
+      case 4:
+        enterState(CONVERSATIONS);
+        break;
+      case 5:
+        enterState(SEARCH);
+        break;
       default:
         log_e("unknown key");
         break;
@@ -6490,17 +6888,22 @@ appEventResult MessagesApp::processEvent(EventType event) {
         this->createLoadMessageMenu(INCOMING, inboxOffset, 0);
       } else if (appState == OUTBOX) {
         this->createLoadMessageMenu(SENT, sentOffset, 0);
+      } else if (appState == CONVERSATIONS) {
+        this->createConversationsMenu();
+      } else if (appState == SEARCH) {
+        this->createSearchInput();
       } else if (appState == COMPOSING) {
         subApp = new CreateMessageApp(lcd, controlState, flash, header, footer);
       }
     }
 
-  } else if ((appState == INBOX || appState == OUTBOX) && (event == WIPHONE_KEY_UP || event == WIPHONE_KEY_DOWN)) {
+  } else if ((appState == INBOX || appState == OUTBOX || appState == CONVERSATION || appState == SEARCH_RESULTS) &&
+             (event == WIPHONE_KEY_UP || event == WIPHONE_KEY_DOWN)) {
 
     // This is a bit hackish way to allow displaying potentially unlimited number of messages without lags. The idea is simple:
     //   More messages get preloaded from the files when user attempts to go past currently displayed N_MENU_ITEMS (5) messages.
 
-    MenuWidget* box = (appState == INBOX) ? inboxMenu : sentMenu;
+    MenuWidget* box = this->messageMenu();
 
     if (event == WIPHONE_KEY_DOWN && box->isSelectedLast()) {
 
@@ -6511,8 +6914,8 @@ appEventResult MessagesApp::processEvent(EventType event) {
         int32_t messageOffset = this->decodeMessageOffset(selectedKey);
         if (-messageOffset >= N_MENU_ITEMS) {      // negative messageOffset expected here
           int32_t newMessageOffset = messageOffset + N_MENU_ITEMS - 2;
-          this->createLoadMessageMenu(appState == INBOX, newMessageOffset, selectedKey);
-          box = (appState == INBOX) ? inboxMenu : sentMenu;
+          this->reloadMessageMenu(newMessageOffset, selectedKey);
+          box = this->messageMenu();
           if (!box->isSelectedLast()) {
             box->processEvent(event);
           }
@@ -6528,8 +6931,8 @@ appEventResult MessagesApp::processEvent(EventType event) {
       int32_t messageOffset = this->decodeMessageOffset(selectedKey);
       if (messageOffset < -1) {      // negative messageOffset expected here
         int32_t newMessageOffset = messageOffset + 1;
-        this->createLoadMessageMenu(appState == INBOX, newMessageOffset, selectedKey);
-        box = (appState == INBOX) ? inboxMenu : sentMenu;
+        this->reloadMessageMenu(newMessageOffset, selectedKey);
+        box = this->messageMenu();
         box->processEvent(event);
         res |= REDRAW_ALL;
       }
@@ -6573,6 +6976,75 @@ appEventResult MessagesApp::processEvent(EventType event) {
       res |= REDRAW_ALL;
     }
 
+  } else if (appState == CONVERSATIONS) {
+
+    if (LOGIC_BUTTON_BACK(event)) {
+      this->createMainMenu();       // unread counts may have changed
+      enterState(MAIN);
+      res |= REDRAW_ALL;
+    } else {
+      conversationsMenu->processEvent(event);
+      MenuOption::keyType selectedKey = conversationsMenu->readChosen();
+      if (LOGIC_BUTTON_OK(event) && selectedKey > 0) {
+        // Open the conversation: it is found by its URI from now on (compacting the messages renumbers conversations)
+        const Messages::Conversation& conversation = flash.messages.getConversation(selectedKey - 1);
+        snprintf(conversationUri, sizeof(conversationUri), "%s", conversation.uriDyn);
+        const char* name = PhonebookApp::callerName(flash, conversationUri);
+        snprintf(conversationTitle, sizeof(conversationTitle), "%s", name != NULL && *name ? name : conversationUri);
+        enterState(CONVERSATION);
+        this->createLoadConversationMenu(-1, 0);
+      }
+      res |= REDRAW_ALL;
+    }
+
+  } else if (appState == CONVERSATION) {
+
+    if (LOGIC_BUTTON_BACK(event)) {
+      this->createConversationsMenu();
+      enterState(CONVERSATIONS);
+      res |= REDRAW_ALL;
+    } else if (LOGIC_BUTTON_OK(event)) {
+      // View message
+      conversationMenu->processEvent(event);
+      MenuOption::keyType selectedKey = conversationMenu->readChosen();
+      int32_t messageOffset = this->decodeMessageOffset(selectedKey);
+      subApp = new ViewMessageApp(messageOffset, lcd, controlState, flash, header, footer);
+      this->createLoadConversationMenu(messageOffset, selectedKey);
+      res |= REDRAW_ALL;
+    }
+
+  } else if (appState == SEARCH) {
+
+    if (event == WIPHONE_KEY_END || (event == WIPHONE_KEY_BACK && !*searchInput->getText())) {    // BACK is backspace otherwise
+      enterState(MAIN);
+      res |= REDRAW_ALL;
+    } else if (LOGIC_BUTTON_OK(event)) {
+      if (*searchInput->getText()) {
+        snprintf(searchQuery, sizeof(searchQuery), "%s", searchInput->getText());
+        this->search();
+        enterState(SEARCH_RESULTS);
+        this->createLoadSearchMenu(-1, 0);
+        res |= REDRAW_ALL;
+      }
+    } else {
+      searchInput->processEvent(event);
+    }
+
+  } else if (appState == SEARCH_RESULTS) {
+
+    if (LOGIC_BUTTON_BACK(event)) {
+      enterState(SEARCH);
+      res |= REDRAW_ALL;
+    } else if (LOGIC_BUTTON_OK(event)) {
+      // View message
+      searchMenu->processEvent(event);
+      MenuOption::keyType selectedKey = searchMenu->readChosen();
+      int32_t messageOffset = this->decodeMessageOffset(selectedKey);
+      subApp = new ViewMessageApp(messageOffset, lcd, controlState, flash, header, footer);
+      this->createLoadSearchMenu(messageOffset, selectedKey);
+      res |= REDRAW_ALL;
+    }
+
   }
 
   return res;
@@ -6638,6 +7110,17 @@ void MessagesApp::createMainMenu() {
     }
   }
   mainMenu->addOption("Sent", str, 2, 1, icon_Outbox_b, sizeof(icon_Outbox_b), icon_Outbox_w, sizeof(icon_Outbox_w));
+  if (flash.messages.isLoaded()) {
+    LinearArray<int32_t, LA_EXTERNAL_RAM> list;
+    flash.messages.listConversations(list);
+    if (list.size() > 0) {
+      snprintf(str, sizeof(str), "%d Contacts", list.size());
+    } else {
+      snprintf(str, sizeof(str), "No messages");
+    }
+  }
+  mainMenu->addOption("Conversations", str, 4, 1, icon_Messages_b, sizeof(icon_Messages_b), icon_Messages_w, sizeof(icon_Messages_w));
+  mainMenu->addOption("Search", NULL, 5, 1, icon_message_b, sizeof(icon_message_b), icon_message_w, sizeof(icon_message_w));
 
   if (selectedKey) {
     mainMenu->select(selectedKey);
@@ -6674,7 +7157,8 @@ void MessagesApp::createLoadMessageMenu(bool incoming, int32_t offset, MenuOptio
   for (auto it = flash.messages.iteratorCount(offset, N_MENU_ITEMS); it.valid(); ++it) {
     log_i("Looping over messages");
     MenuOption::keyType key = this->encodeMessageOffset((int32_t)it);
-    option = new MenuOptionIconnedTimed(key, it->isRead() ? MenuWidget::DEFAULT_STYLE : MenuWidget::ALTERNATE_STYLE, it->getOtherUri(), it->getMessageText(), it->getTime());
+    const char* name = PhonebookApp::callerName(flash, it->getOtherUri());
+    option = new MenuOptionIconnedTimed(key, it->isRead() ? MenuWidget::DEFAULT_STYLE : MenuWidget::ALTERNATE_STYLE, name != NULL && *name ? name : it->getOtherUri(), it->getMessageText(), it->getTime());
     if (option) {
       menu->addOption(option);
     }
@@ -6684,6 +7168,144 @@ void MessagesApp::createLoadMessageMenu(bool incoming, int32_t offset, MenuOptio
   }
 }
 
+/* Description:
+ *     list of the conversations, the most recent first, from the conversation index alone (no messages are read).
+ */
+void MessagesApp::createConversationsMenu() {
+  MenuOption::keyType selectKey = conversationsMenu ? conversationsMenu->currentKey() : 0;
+  if (conversationsMenu) {
+    delete conversationsMenu;
+  }
+  conversationsMenu = new MenuWidget(0, header->height(), lcd.width(), lcd.height() - header->height() - footer->height(),
+                                     "No messages", fonts[AKROBAT_EXTRABOLD_22], N_MENU_ITEMS, 8);
+  conversationsMenu->setStyle(MenuWidget::DEFAULT_STYLE,   BLACK, GRAY_85, GRAY_95, WP_ACCENT_1);   // All read
+  conversationsMenu->setStyle(MenuWidget::ALTERNATE_STYLE, BLACK, WHITE, WHITE, WP_ACCENT_S);       // With unread messages
+
+  LinearArray<int32_t, LA_EXTERNAL_RAM> list;
+  flash.messages.listConversations(list);
+  for (int32_t i = 0; i < list.size(); i++) {
+    const Messages::Conversation& conversation = flash.messages.getConversation(list[i]);
+    const char* name = PhonebookApp::callerName(flash, conversation.uriDyn);
+    char str[40];
+    if (conversation.unread > 0) {
+      snprintf(str, sizeof(str), "%d messages, %d unread", conversation.count, conversation.unread);
+    } else {
+      snprintf(str, sizeof(str), "%d messages", conversation.count);
+    }
+    MenuOptionIconnedTimed* option = new MenuOptionIconnedTimed(list[i] + 1, conversation.unread > 0 ? MenuWidget::ALTERNATE_STYLE : MenuWidget::DEFAULT_STYLE,
+                                                                name != NULL && *name ? name : conversation.uriDyn, str, conversation.lastTime);
+    if (option) {
+      conversationsMenu->addOption(option);
+    }
+  }
+  if (selectKey) {
+    conversationsMenu->select(selectKey);
+  }
+}
+
+/* Description:
+ *     messages of the conversation shown (both directions), like createLoadMessageMenu().
+ */
+void MessagesApp::createLoadConversationMenu(int32_t offset, MenuOption::keyType selectKey) {
+  log_i("createLoadConversationMenu: %d %d", offset, N_MENU_ITEMS);
+
+  if (conversationMenu) {
+    delete conversationMenu;
+  }
+  conversationMenu = new MenuWidget(0, header->height(), lcd.width(), lcd.height() - header->height() - footer->height(),
+                                    "No messages", fonts[AKROBAT_EXTRABOLD_22], N_MENU_ITEMS, 8);
+  conversationMenu->setStyle(MenuWidget::DEFAULT_STYLE,   BLACK, GRAY_85, GRAY_95, WP_ACCENT_1);    // Read messages & sent
+  conversationMenu->setStyle(MenuWidget::ALTERNATE_STYLE, BLACK, WHITE, WHITE, WP_ACCENT_S);        // Unread messages
+
+  int32_t conversation = flash.messages.findConversation(conversationUri);
+  if (conversation < 0) {
+    return;
+  }
+  flash.messages.preloadConversation(conversation, offset, N_MENU_ITEMS);
+  for (auto it = flash.messages.iteratorCount(offset, N_MENU_ITEMS); it.valid(); ++it) {
+    MenuOption::keyType key = this->encodeMessageOffset((int32_t)it);
+    MenuOptionIconnedTimed* option = new MenuOptionIconnedTimed(key, it->isRead() ? MenuWidget::DEFAULT_STYLE : MenuWidget::ALTERNATE_STYLE,
+                                                                it->isIncoming() ? conversationTitle : "Me", it->getMessageText(), it->getTime());
+    if (option) {
+      conversationMenu->addOption(option);
+    }
+  }
+  if (selectKey) {
+    conversationMenu->select(selectKey);
+  }
+}
+
+void MessagesApp::createSearchInput() {
+  if (searchInput) {
+    return;       // the last text is kept
+  }
+  uint16_t yOff = header->height();
+  searchLabel = new LabelWidget(0, yOff, lcd.width(), 25, "Messages with the text:", WP_ACCENT_1, WP_COLOR_1, fonts[AKROBAT_BOLD_18], LabelWidget::LEFT_TO_RIGHT, 8);
+  yOff += searchLabel->height();
+  searchInput = new TextInputWidget(0, yOff, lcd.width(), 35, controlState, Messages::MAX_SEARCH_LENGTH, fonts[AKROBAT_BOLD_20], InputType::AlphaNum, 8);
+  searchInput->setFocus(true);      // to reveal the cursor
+}
+
+/* Description:
+ *     search the messages for the query (again, after the messages have changed).
+ */
+void MessagesApp::search() {
+  int32_t n = flash.messages.search(searchQuery);
+  if (n > 0) {
+    snprintf(searchTitle, sizeof(searchTitle), "%d found", n);
+  } else {
+    snprintf(searchTitle, sizeof(searchTitle), "Not found");
+  }
+}
+
+/* Description:
+ *     messages found by the last search (both directions), the most recent first, like createLoadMessageMenu().
+ */
+void MessagesApp::createLoadSearchMenu(int32_t offset, MenuOption::keyType selectKey) {
+  log_i("createLoadSearchMenu: %d %d", offset, N_MENU_ITEMS);
+
+  if (searchMenu) {
+    delete searchMenu;
+  }
+  searchMenu = new MenuWidget(0, header->height(), lcd.width(), lcd.height() - header->height() - footer->height(),
+                              "No messages found", fonts[AKROBAT_EXTRABOLD_22], N_MENU_ITEMS, 8);
+  searchMenu->setStyle(MenuWidget::DEFAULT_STYLE,   BLACK, GRAY_85, GRAY_95, WP_ACCENT_1);    // Read messages & sent
+  searchMenu->setStyle(MenuWidget::ALTERNATE_STYLE, BLACK, WHITE, WHITE, WP_ACCENT_S);        // Unread messages
+
+  flash.messages.preloadFound(offset, N_MENU_ITEMS);
+  for (auto it = flash.messages.iteratorCount(offset, N_MENU_ITEMS); it.valid(); ++it) {
+    MenuOption::keyType key = this->encodeMessageOffset((int32_t)it);
+    const char* name = PhonebookApp::callerName(flash, it->getOtherUri());
+    MenuOptionIconnedTimed* option = new MenuOptionIconnedTimed(key, it->isRead() ? MenuWidget::DEFAULT_STYLE : MenuWidget::ALTERNATE_STYLE,
+                                                                name != NULL && *name ? name : it->getOtherUri(), it->getMessageText(), it->getTime());
+    if (option) {
+      searchMenu->addOption(option);
+    }
+  }
+  if (selectKey) {
+    searchMenu->select(selectKey);
+  }
+}
+
+void MessagesApp::reloadMessageMenu(int32_t offset, MenuOption::keyType selectKey) {
+  if (appState == CONVERSATION) {
+    this->createLoadConversationMenu(offset, selectKey);
+  } else if (appState == SEARCH_RESULTS) {
+    this->createLoadSearchMenu(offset, selectKey);
+  } else {
+    this->createLoadMessageMenu(appState == INBOX, offset, selectKey);
+  }
+}
+
+MenuWidget* MessagesApp::messageMenu() {
+  if (appState == CONVERSATION) {
+    return conversationMenu;
+  } else if (appState == SEARCH_RESULTS) {
+    return searchMenu;
+  }
+  return (appState == INBOX) ? inboxMenu : sentMenu;
+}
+
 void MessagesApp::redrawScreen(bool redrawAll) {
   log_i("redraw MessagesApp");
 
@@ -6698,6 +7320,18 @@ void MessagesApp::redrawScreen(bool redrawAll) {
     ((GUIWidget*)inboxMenu)->redraw(lcd);
   } else if (appState == OUTBOX) {
     ((GUIWidget*)sentMenu)->redraw(lcd);
+  } else if (appState == CONVERSATIONS) {
+    ((GUIWidget*)conversationsMenu)->redraw(lcd);
+  } else if (appState == CONVERSATION) {
+    ((GUIWidget*)conversationMenu)->redraw(lcd);
+  } else if (appState == SEARCH) {
+    if (redrawAll) {
+      lcd.fillRect(0, header->height(), lcd.width(), lcd.height() - header->height() - footer->height(), WP_COLOR_1);
+      ((GUIWidget*)searchLabel)->redraw(lcd);
+    }
+    ((GUIWidget*)searchInput)->redraw(lcd);
+  } else if (appState == SEARCH_RESULTS) {
+    ((GUIWidget*)searchMenu)->redraw(lcd);
   }
 }
 
@@ -7678,6 +8312,34 @@ DiagnosticsApp::DiagnosticsApp(Audio* audio, LCD& lcd, ControlState& state)
     yOff += bbPings[i]->height() + spacing;
   }
 
+  // - SIP keepalive and registration refresh
+  bSipKeepalive = new ButtonWidget(xOff, yOff, "Keepalive: -", lcd.width()-spacing, 30, TFT_BLACK, greyBg, greyBorder);
+  this->registerWidget(bSipKeepalive);
+  yOff += bSipKeepalive->height() + spacing;
+  bSipRegister = new ButtonWidget(xOff, yOff, "Register: -", lcd.width()-spacing, 30, TFT_BLACK, greyBg, greyBorder);
+  this->registerWidget(bSipRegister);
+  yOff += bSipRegister->height() + spacing;
+  bSipTls = new ButtonWidget(xOff, yOff, "TLS: -", lcd.width()-spacing, 30, TFT_BLACK, greyBg, greyBorder);
+  this->registerWidget(bSipTls);
+  yOff += bSipTls->height() + spacing;
+
+  // - phonebook names of incoming calls and messages
+  bCallerIds = new ButtonWidget(xOff, yOff, "Caller ID: -", lcd.width()-spacing, 30, TFT_BLACK, greyBg, greyBorder);
+  this->registerWidget(bCallerIds);
+  yOff += bCallerIds->height() + spacing;
+
+  // CALLS
+  xOff = spacing;
+  yOff = 15; //header->height();
+  bCallsTraced = new ButtonWidget(xOff, yOff, "Calls: 0", lcd.width()-spacing, 26, TFT_BLACK, greyBg, greyBorder);
+  this->registerWidget(bCallsTraced);
+  yOff += bCallsTraced->height() + spacing;
+  for (int i=0; i<sizeof(bbCallStages)/sizeof(bbCallStages[0]); i++) {
+    bbCallStages[i] = new ButtonWidget(xOff, yOff, "-", lcd.width()-spacing, 26, TFT_BLACK, greyBg, greyBorder);
+    this->registerWidget(bbCallStages[i]);
+    yOff += bbCallStages[i]->height() + spacing;
+  }
+
   // FILESYSTEMS
   // currently the SD card is tested in main
 
@@ -8094,6 +8756,77 @@ void DiagnosticsApp::updatePing() {
   return; // true;
 }
 
+void DiagnosticsApp::updateSipTimers() {
+  char buff[40];
+  if (controlState.sipKeepaliveS) {
+    snprintf(buff, sizeof(buff), "Keepalive: %us %s", controlState.sipKeepaliveS, controlState.sipKeepaliveLearned ? "learned" : "learning");
+  } else {
+    snprintf(buff, sizeof(buff), "Keepalive: -");
+  }
+  bSipKeepalive->setText(buff);
+  if (controlState.sipRegistered) {
+    snprintf(buff, sizeof(buff), "Register: %us of %us", controlState.sipRegRefreshS, controlState.sipRegExpiresS);
+    bSipRegister->setColors(TFT_BLACK, greenBg, greenBorder);
+  } else {
+    snprintf(buff, sizeof(buff), "Register: -");
+    bSipRegister->setColors(TFT_BLACK, greyBg, greyBorder);
+  }
+  bSipRegister->setText(buff);
+
+  // Average handshake time, full and resumed (see TlsSessionCache)
+  const TlsSessionCache::Stats& full = tlsSessions.stats(false);
+  const TlsSessionCache::Stats& resumed = tlsSessions.stats(true);
+  if (full.count || resumed.count) {
+    snprintf(buff, sizeof(buff), "TLS: %u full %ums, %u res. %ums", full.count, full.count ? full.msTotal / full.count : 0,
+             resumed.count, resumed.count ? resumed.msTotal / resumed.count : 0);
+  } else {
+    snprintf(buff, sizeof(buff), "TLS: -");
+  }
+  bSipTls->setText(buff);
+
+  // Phonebook names of calls and messages (see CallerIdCache): how many were found, average and worst lookup
+  const CallerIdCache::Stats& ids = callerIds.stats();
+  if (ids.lookups) {
+    snprintf(buff, sizeof(buff), "Caller ID: %u%% of %u, %u/%uus", ids.known * 100 / ids.lookups, ids.lookups,
+             ids.usTotal / ids.lookups, ids.usMax);
+  } else {
+    snprintf(buff, sizeof(buff), "Caller ID: -");
+  }
+  bCallerIds->setText(buff);
+}
+
+/* Description:
+ *     median and 90th percentile of every call setup stage (see CallTrace), as upper bounds of the histogram buckets.
+ */
+void DiagnosticsApp::updateCallStages() {
+  char buff[48];
+  snprintf(buff, sizeof(buff), "Calls: %u  (median / 90%%)", callTrace.calls());
+  bCallsTraced->setText(buff);
+  for (int i=0; i<sizeof(bbCallStages)/sizeof(bbCallStages[0]); i++) {
+    CallTrace::Milestone_t m = (CallTrace::Milestone_t) (CallTrace::START_CALL + 1 + i);
+    if (!callTrace.stageCount(m)) {
+      snprintf(buff, sizeof(buff), "%s: -", CallTrace::name(m));
+      bbCallStages[i]->setText(buff);
+      bbCallStages[i]->setColors(TFT_BLACK, greyBg, greyBorder);
+      continue;
+    }
+    const unsigned msOpen = CallTrace::BUCKET_MS[CallTrace::BUCKETS-2];
+    uint32_t ms50 = callTrace.stagePercentileMs(m, 50);
+    uint32_t ms90 = callTrace.stagePercentileMs(m, 90);
+    snprintf(buff, sizeof(buff), "%s: %c%u / %c%u ms", CallTrace::name(m),
+             ms50 == 0xffffffff ? '>' : '<', ms50 == 0xffffffff ? msOpen : (unsigned) ms50,
+             ms90 == 0xffffffff ? '>' : '<', ms90 == 0xffffffff ? msOpen : (unsigned) ms90);
+    bbCallStages[i]->setText(buff);
+    if (ms90 <= 500) {
+      bbCallStages[i]->setColors(TFT_BLACK, greenBg, greenBorder);
+    } else if (ms90 <= 2000) {
+      bbCallStages[i]->setColors(TFT_BLACK, yellowBg, yellowBorder);
+    } else {
+      bbCallStages[i]->setColors(TFT_BLACK, redBg, redBorder);
+    }
+  }
+}
+
 void DiagnosticsApp::updateMic(void) {
   // flash the keypad LEDs based on the mic level
   // this is intended to let us test if the mic is soldered
@@ -8198,6 +8931,13 @@ void DiagnosticsApp::changeState(DiagnosticsView_t newState) {
         bbPings[i]->setColors(TFT_BLACK, greyBg, greyBorder);
       }
     }
+    this->updateSipTimers();
+
+  } else if (newState == CALLS) {
+    controlState.msAppTimerEventLast = millis();
+    controlState.msAppTimerEventPeriod = 1000;
+
+    this->updateCallStages();
 
   } else if (newState == KEYPAD) {
 
@@ -8255,6 +8995,9 @@ appEventResult DiagnosticsApp::processEvent(EventType event) {
       newState = NETWORKS;
       break;
     case NETWORKS:
+      newState = CALLS;
+      break;
+    case CALLS:
       newState = AUDIO;
       break;
     case AUDIO:
@@ -8338,6 +9081,12 @@ appEventResult DiagnosticsApp::processEvent(EventType event) {
   } else if (appState == NETWORKS) {
     if (event == APP_TIMER_EVENT) {
       this->updatePing();
+      this->updateSipTimers();
+      res |= REDRAW_SCREEN;
+    }
+  } else if (appState == CALLS) {
+    if (event == APP_TIMER_EVENT) {
+      this->updateCallStages();
       res |= REDRAW_SCREEN;
     }
   } else if (appState == AUDIO) {
@@ -8520,6 +9269,15 @@ void DiagnosticsApp::redrawScreen(bool redrawAll) {
         ((GUIWidget*) bbPings[i])->refresh(lcd, redrawAll || !screenInited);
       }
     }
+    ((GUIWidget*) bSipKeepalive)->refresh(lcd, redrawAll || !screenInited);
+    ((GUIWidget*) bSipRegister)->refresh(lcd, redrawAll || !screenInited);
+    ((GUIWidget*) bSipTls)->refresh(lcd, redrawAll || !screenInited);
+    ((GUIWidget*) bCallerIds)->refresh(lcd, redrawAll || !screenInited);
+  } else if (appState == CALLS) {
+    ((GUIWidget*) bCallsTraced)->refresh(lcd, redrawAll || !screenInited);
+    for (int i=0; i<sizeof(bbCallStages)/sizeof(bbCallStages[0]); i++) {
+      ((GUIWidget*) bbCallStages[i])->refresh(lcd, redrawAll || !screenInited);
+    }
   } else if (appState == AUDIO) {
     if (!screenInited || redrawAll) {
       //lcd.fillScreen(TFT_BLACK);
@@ -12208,7 +12966,8 @@ void MenuOptionIconnedTimed::redraw(LCD &lcd, uint16_t screenOffX, uint16_t scre
 }
 
 MenuOptionPhonebook::MenuOptionPhonebook(MenuOption::keyType pId, uint16_t pStyle, const char* title, const char* subTitle)
-  : MenuOptionIconned(pId, pStyle, title, subTitle, icon_person_b, sizeof(icon_person_b), icon_person_w, sizeof(icon_person_w)) {
+  : MenuOptionIconned(pId, pStyle, title, subTitle, icon_person_b, sizeof(icon_person_b), icon_person_w, sizeof(icon_person_w)),
+    presenceKey(presence.key(subTitle)) {
 };
 
 void MenuOptionPhonebook::redraw(LCD &lcd, uint16_t screenOffX, uint16_t screenOffY, uint16_t windowWidth, uint16_t windowHeight,
@@ -12249,6 +13008,15 @@ void MenuOptionPhonebook::redraw(LCD &lcd, uint16_t screenOffX, uint16_t screenO
     delete rightIcon;
   }
 
+  // Presence: a dot left of the phone icon (nothing while unknown)
+  PresenceTable::Status_t status = presence.status(presenceKey);
+  if (status != PresenceTable::UNKNOWN) {
+    colorType col = status==PresenceTable::AVAILABLE ? WP_ACCENT_G : status==PresenceTable::BUSY ? TFT_RED :
+                    status==PresenceTable::AWAY ? WP_ACCENT_S : WP_DISAB_1;
+    rightIconOff += 2*presenceRadius + 6;
+    lcd.fillCircle(screenOffX + windowWidth - rightIconOff + presenceRadius, screenOffY + windowHeight/2, presenceRadius, col);
+  }
+
   // Print text
   if (leftIconOff) {
     leftIconOff += 7;
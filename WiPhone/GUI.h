@@ -28,6 +28,10 @@ governing permissions and limitations under the License.
 #include "src/ringbuff.h"
 #include "clock.h"
 #include "Audio.h"
+#include "CallTrace.h"
+#include "Presence.h"
+#include "ContactIndex.h"
+#include "CallerId.h"
 #include "FairyMax.h"
 #include "ota.h"
 #include "driver/uart.h"
@@ -127,6 +131,7 @@ typedef uint16_t colorType;
 #define CALL_UPDATE_EVENT          0x82
 #define WIFI_ICON_UPDATE_EVENT     0x84     // triggered when RSSI level changed SIGNIFICANTLY and icon has to be redrawn
 #define TIME_UPDATE_EVENT          0x88
+#define PRESENCE_UPDATE_EVENT      0x90     // status of a phonebook contact changed (see PresenceTable)
 #define USER_SERIAL_EVENT         0x180
 #define REGISTRATION_UPDATE_EVENT 0x280
 #define BATTERY_BLINK_EVENT       0x480
@@ -227,6 +232,10 @@ public:
   bool sipAccountChanged = false;   // does the SIP proxy requires (re)connecting? (this is set to true whenever user changes preferred account)
   bool sipEnabled = false;          // is the phone set to connect to the SIP proxy? (used for the SIP icon)
   bool sipRegistered = false;       // is the phone registered at the SIP proxy? (used for the SIP icon)
+  uint32_t sipKeepaliveS = 0;       // current keepalive (ping) interval of the proxy flow (used by Diagnostics)
+  bool sipKeepaliveLearned = false; // has the keepalive interval settled?
+  uint32_t sipRegExpiresS = 0;      // registration lifetime granted by the registrar
+  uint32_t sipRegRefreshS = 0;      // registration gets refreshed after this many seconds
 
   bool loadSipAccount();            // load primary (preferred / default) SIP account from flash to RAM
   void setSipAccount(const char* dispName, const char* uri, const char* passwd, const char* UDP_TCP_SIP_Selection);            // use the supplied SIP account (store it in RAM)
@@ -244,6 +253,9 @@ public:
   char* calleeNameDyn;
   char* calleeUriDyn;
   char* lastReasonDyn;
+  bool callHoldRequested = false;   // user wants to put the call on hold or resume it (picked up by the SIP loop)
+  bool callOnHold = false;          // the call is put on hold by us
+  bool callRemoteHold = false;      // the call is put on hold by the remote party
 
   void setRemoteNameUri(const char* dispName, const char* uri);
   void setSipState(CallState state);
@@ -1005,6 +1017,8 @@ public:
                       colorType fgColor, colorType bgColor, bool opaque, bool selected, SmoothFont* font, uint16_t leftOffset);
 protected:
   static const uint8_t rightIconOffset = 8;
+  static const uint8_t presenceRadius = 5;      // status dot left of the phone icon
+  uint32_t presenceKey;                         // of the SIP URI in the presence table
 };
 
 class MenuWidget : public FocusableWidget {
@@ -1408,11 +1422,20 @@ protected:
     INBOX,
     OUTBOX,
     COMPOSING,
+    CONVERSATIONS,
+    CONVERSATION,
+    SEARCH,
+    SEARCH_RESULTS,
   } MessagesState_t;
 
   MenuWidget* mainMenu = NULL;
   MenuWidget* inboxMenu = NULL;
   MenuWidget* sentMenu = NULL;
+  MenuWidget* conversationsMenu = NULL;
+  MenuWidget* conversationMenu = NULL;
+  MenuWidget* searchMenu = NULL;
+  LabelWidget* searchLabel = NULL;
+  TextInputWidget* searchInput = NULL;
   Storage& flash;
   WiPhoneApp* subApp = NULL;            // can be CreateMessageApp or ViewMessageApp
 
@@ -1425,8 +1448,21 @@ protected:
   int32_t sentOffset = -1;
   int32_t sentSelected = -1;
 
+  char conversationUri[CallerIdCache::MAX_URI_LENGTH + 1];    // of the conversation shown (normalized)
+  char conversationTitle[40];
+
+  char searchQuery[Messages::MAX_SEARCH_LENGTH + 1];                // of the results shown
+  char searchTitle[40];
+
   void createMainMenu();
   void createLoadMessageMenu(bool incoming, int32_t offset, MenuOption::keyType selectKey);
+  void createConversationsMenu();
+  void createLoadConversationMenu(int32_t offset, MenuOption::keyType selectKey);
+  void createSearchInput();
+  void createLoadSearchMenu(int32_t offset, MenuOption::keyType selectKey);
+  void search();
+  void reloadMessageMenu(int32_t offset, MenuOption::keyType selectKey);
+  MenuWidget* messageMenu();
 
   MenuOption::keyType encodeMessageOffset(int32_t offset);
   int32_t decodeMessageOffset(MenuOption::keyType key);
@@ -1543,7 +1579,7 @@ protected:
   RingBuffer<float> lastSocs;         // size initialized in the constructor
 
   // App state
-  typedef enum DiagnosticsView { MAIN, NETWORKS, FILESYSTEMS, AUDIO, CONTROL, SCREEN, KEYPAD, CORE, OPTIONS } DiagnosticsView_t;
+  typedef enum DiagnosticsView { MAIN, NETWORKS, CALLS, FILESYSTEMS, AUDIO, CONTROL, SCREEN, KEYPAD, CORE, OPTIONS } DiagnosticsView_t;
   DiagnosticsView_t appState = MAIN;
   void changeState(DiagnosticsView_t newState);
 //  typedef enum DiagnosticsState { PSRAM = 0, KEYPAD } DiagnosticsState_t;
@@ -1575,6 +1611,14 @@ protected:
 
   // - Network
   ButtonWidget* bbPings[2]; //[8];
+  ButtonWidget* bSipKeepalive = NULL;
+  ButtonWidget* bSipRegister = NULL;
+  ButtonWidget* bSipTls = NULL;
+  ButtonWidget* bCallerIds = NULL;
+
+  // - Call setup stages
+  ButtonWidget* bCallsTraced = NULL;
+  ButtonWidget* bbCallStages[CallTrace::FIRST_PLAYED];       // up to FIRST_PLAYED: answering stages don't fit, they are only logged
 
   // - Filesystems
   /*ButtonWidget* testEarSpeaker = NULL;
@@ -1625,6 +1669,8 @@ protected:
   void updateDB();
   void updateUptime();
   void updatePing();
+  void updateSipTimers();
+  void updateCallStages();
   void updateMic();
   void toggleSpeaker();
   bool selfTest();
@@ -2053,7 +2099,7 @@ protected:
 
 class DialingApp : public WindowedApp, FocusableApp {
 public:
-  DialingApp(Audio* audio, LCD& disp, LCD& hardDisp, ControlState& state, HeaderWidget* header, FooterWidget* footer);
+  DialingApp(Audio* audio, LCD& disp, LCD& hardDisp, ControlState& state, Storage& flash, HeaderWidget* header, FooterWidget* footer);
   virtual ~DialingApp();
   ActionID_t getId() {
     return GUI_APP_DIALING;
@@ -2065,16 +2111,28 @@ public:
   };
 
 protected:
+  static const int N_SUGGESTIONS = 3;
+
   Audio* audio;
   LCD& hardDisp;      // hardware display (physical screen, rather than a memory page)
+  Storage& flash;
 
   CallApp*  callApp = NULL;
   bool screenInited = false;
   bool error = false;
 
+  // Contacts matching the digits typed (T9)
+  ContactIndex::Match suggestions[N_SUGGESTIONS];
+  int nSuggestions = 0;
+  int suggestion = -1;                          // selected one; -1 - call the number typed
+
+  void suggest();
+  void showSuggestions();
+
   // Widgets
   MultilineTextWidget* textArea;
   LabelWidget* errorLabel;
+  LabelWidget* suggestionLabels[N_SUGGESTIONS];
 };
 
 class PhonebookApp : public WindowedApp, FocusableApp {
@@ -2090,6 +2148,12 @@ public:
   const char* getSelectedSipUri();            // used in `pick` mode, when phonebook app is not a standalone app
   const char* getSelectedLoraAddress();
   const char* getCombinedAddress();
+  static void watchPresence(Storage& flash, const char* accountUri);     // give the presence table all the SIP URIs of the phonebook
+  static void indexContacts(Storage& flash);                            // build contactIndex from the phonebook
+  static const char* callerName(Storage& flash, const char* uri);       // NULL - not a contact
+
+  typedef void (*ContactFunction)(const char* name, const char* uri);
+  static void forEachContact(Storage& flash, ContactFunction found);
   LCD& getScreen() {
     return callApp==NULL ? lcd : callApp->getScreen();
   };
@@ -2122,6 +2186,7 @@ protected:
 
   // Selecting
   MenuWidget* menu;
+  char t9Digits[ContactIndex::MAX_DIGITS + 1];    // typed to jump to a contact
   LabelWidget* emptyLabel = NULL;       // TODO: show "phonebook is empty" message
 
   void createLoadMenu();
@@ -83,12 +83,12 @@ public:
       return pos_;
     }
     bool      valid() const                         {
-      return pos_ < arr_.size();
+      return (size_t) pos_ < arr_.size();
     }
 
   protected:
-    int pos_;
     LinearArray<T,B>& arr_;
+    int pos_;
   };
 
   LinearArray();
@@ -123,16 +123,18 @@ public:
   bool removeByValue(T element);
   void clear();
   void purge();
+  void useBuffer(T* buffer, size_t size);
 
 protected:
 
   T* arrayDyn;
   size_t arraySize;
   size_t arrayAllocSize;
+  bool borrowed;          // arrayDyn is owned by someone else (see useBuffer)
 };
 
 template <class T, bool B>
-LinearArray<T, B>::LinearArray() : arrayDyn(nullptr), arraySize(0), arrayAllocSize(0) {};
+LinearArray<T, B>::LinearArray() : arrayDyn(nullptr), arraySize(0), arrayAllocSize(0), borrowed(false) {};
 
 template <class T, bool B>
 LinearArray<T, B>::LinearArray(size_t expectedSize) : LinearArray() {
@@ -178,7 +180,20 @@ bool LinearArray<T, B>::ensure(size_t newSize) {
     T* tmp = NULL;
 
     // More memory needs to be allocated
-    if (this->arrayAllocSize > 0) {
+    if (this->borrowed) {
+
+      // Copy the elements out of the borrowed buffer, which is left as it is
+      size_t newAllocSize = newSize > 2 * this->arrayAllocSize ? newSize : 2 * this->arrayAllocSize;
+      tmp = (T*) wMalloc<B>(newAllocSize * sizeof(T));
+      if (tmp != NULL) {
+        for (size_t i = 0; i < this->arraySize; i++) {
+          tmp[i] = this->arrayDyn[i];
+        }
+        this->arrayAllocSize = newAllocSize;
+        this->borrowed = false;
+      }
+
+    } else if (this->arrayAllocSize > 0) {
 
       // Double the amount of storage until it's sufficient
       size_t newAllocSize = this->arrayAllocSize;
@@ -214,9 +229,9 @@ bool LinearArray<T, B>::ensure(size_t newSize) {
     // Logging, success/failure
     if (tmp != NULL) {
       this->arrayDyn = tmp;
-      log_v("realloced: %d", this->arrayAllocSize);
+      log_v("realloced: %d", (int) this->arrayAllocSize);
     } else {
-      log_v("failed to realloc: %d", newSize * sizeof(T));
+      log_v("failed to realloc: %d", (int) (newSize * sizeof(T)));
       return false;
     }
   }
@@ -255,7 +270,7 @@ bool LinearArray<T, B>::extend(T* elements, size_t size) {
   if (this->ensure(this->arraySize + size)) {
     // NOTE: memmove doesn't work for external memory of ESP32!
     //memmove(this->arrayDyn + this->arraySize, elements, size*sizeof(T));
-    for (int i = 0; i < size; i++) {
+    for (size_t i = 0; i < size; i++) {
       this->arrayDyn[this->arraySize + i] = elements[i];
     }
     this->arraySize += size;
@@ -298,7 +313,7 @@ void LinearArray<T, B>::reorderAdded(int (*cmp)(T*, T*)) {
 template <class T, bool B>
 void LinearArray<T, B>::sortFrom(int startAt, int (*cmp)(T*, T*)) {
   // C sorting
-  if (startAt + 1 >= this->arraySize) {
+  if ((size_t) (startAt + 1) >= this->arraySize) {
     return;
   }
   qsort(this->arrayDyn + startAt, this->arraySize - startAt, sizeof(T), (int (*)(const void *, const void *)) cmp);
@@ -364,7 +379,12 @@ bool LinearArray<T, B>::removeByValue(T element) {
  */
 template <class T, bool B>
 void LinearArray<T, B>::clear() {
-  freeNull((void **) &this->arrayDyn);
+  if (this->borrowed) {
+    this->arrayDyn = nullptr;
+    this->borrowed = false;
+  } else {
+    freeNull((void **) &this->arrayDyn);
+  }
   this->arraySize = 0;
   this->arrayAllocSize = 0;
 }
@@ -377,4 +397,17 @@ void LinearArray<T, B>::purge() {
   this->arraySize = 0;
 }
 
+/* Description:
+ *     make the array consist of the `size` elements in `buffer` (e.g. memory of an arena), freeing the array's own memory.
+ *     The buffer is never freed or reallocated: if the array has to grow, the elements are copied into new memory first.
+ */
+template <class T, bool B>
+void LinearArray<T, B>::useBuffer(T* buffer, size_t size) {
+  this->clear();
+  this->arrayDyn = buffer;
+  this->arraySize = size;
+  this->arrayAllocSize = size;
+  this->borrowed = true;
+}
+
 #endif // _LINEAR_ARRAY_H_
@@ -25,7 +25,7 @@ namespace NanoIni {
 
 
 KeyValue::KeyValue()
-  : keyDyn(nullptr), valueDyn(nullptr)
+  : keyDyn(nullptr), valueDyn(nullptr), section(nullptr), keyHash(0), modified(false), arenaObject(false), arenaValue(false)
 {}
 
 KeyValue::KeyValue(const char* key, const char* value) : KeyValue() {
@@ -33,38 +33,30 @@ KeyValue::KeyValue(const char* key, const char* value) : KeyValue() {
     keyDyn = extStrdup(key);
   }
   _escape(keyDyn);
+  keyHash = ValueIndex::keyHash(keyDyn);
   if (value!=nullptr) {
     valueDyn = extStrdup(value);
     _escape(valueDyn);
   }
 }
 
-KeyValue::KeyValue(const char* line, size_t lineLength) : KeyValue() {
-
-  const char* firstEqual = (const char *)memchr(line, '=', lineLength);
-
-  // Parse key
-  if (firstEqual != nullptr) {
-    // Key found
-    if (firstEqual - line > 0) {
-      keyDyn = extStrndup(line, firstEqual - line);
-    }
-
-    // Leave only value in the line
-    lineLength -= firstEqual + 1 - line;
-    line = firstEqual + 1;
+KeyValue::KeyValue(const char* key, size_t keyLength, const char* value, size_t valueLength) : KeyValue() {
+  if (key != nullptr) {
+    keyDyn = extStrndup(key, keyLength);
   }
-
-  // Parse value
-  const char* newLine = (const char *) memchr(line, '\n', lineLength);
-  valueDyn = extStrndup(line, newLine != nullptr ? newLine - line : lineLength);
+  keyHash = ValueIndex::keyHash(keyDyn);
+  valueDyn = extStrndup(value, valueLength);
 
   log_v("Key: %s / Value: %s", keyDyn != nullptr ? keyDyn : "NULL", valueDyn);
 };
 
 KeyValue::~KeyValue() {
-  freeNull((void **) &keyDyn);
-  freeNull((void **) &valueDyn);
+  if (!arenaObject) {
+    freeNull((void **) &keyDyn);
+  }
+  if (!arenaValue) {
+    freeNull((void **) &valueDyn);
+  }
 }
 
 const char* KeyValue::key() const {
@@ -84,13 +76,27 @@ KeyValue::operator bool() const {
 }
 
 const char* KeyValue::operator=(const char* newValue) {
-  freeNull((void **) &valueDyn);
+  Config* ini = section != nullptr ? section->config : nullptr;
+  if (ini != nullptr) {
+    ini->unindexValue(section, this);
+    ini->arenaOnly = false;
+  }
+  if (arenaValue) {
+    valueDyn = nullptr;       // stays in the arena
+    arenaValue = false;
+  } else {
+    freeNull((void **) &valueDyn);
+  }
+  modified = true;
 
   if (newValue != nullptr) {
     valueDyn = extStrdup(newValue);
     _escape(valueDyn);
   }
 
+  if (ini != nullptr) {
+    ini->indexValue(section, this);
+  }
   return valueDyn;
 }
 
@@ -143,59 +149,19 @@ size_t KeyValue::sprint(char* dest) {
 
 
 Section::Section()
-  : titleDyn(nullptr), provisional(nullptr), keyValues()
+  : titleDyn(nullptr), modified(true), arenaObject(false), arenaTitle(false), config(nullptr), position(-1),
+    provisional(nullptr), keyValues()
 {}
 
 Section::Section(const char* title) : Section() {
   titleDyn = extStrdup(title);
 }
 
-/* Description:
- *     parses section from string
- */
-Section::Section(const char* ss, size_t sectionLength, int pos) : Section() {
-
-  if (ss == nullptr || sectionLength == 0) {
-    return;
-  }
-
-  const char* sectionEnd = ss + sectionLength;
-
-  // Parse title
-  if (ss[0] == '[') {
-    // Find end of title
-    const char* titleEnd = ss + 1 + strcspn(ss + 1, "]\n");
-    if (titleEnd > sectionEnd) {
-      titleEnd = sectionEnd;
-    }
-
-    // Special treatment of numeric section titles
-    char* numberEnd;
-    long numericSectionTitle = strtol(ss+1, &numberEnd, 10);
-    if (*(ss+1)!='\0' && numberEnd==titleEnd && numericSectionTitle == pos) {
-      // The title is entirely numeric and coincides with the position -> ignore this title
-    } else {
-      // Otherwise -> valid title, remember it
-      titleDyn = extStrndup(ss + 1, titleEnd - ss - 1);
-    }
-
-    ss = titleEnd + strspn(titleEnd, "]\n");      // past section title end
+Section::Section(const char* title, size_t titleLength) : Section() {
+  if (title != nullptr) {
+    titleDyn = extStrndup(title, titleLength);
   }
   log_v("New section: \"%s\"", titleDyn != nullptr ? titleDyn : "");
-
-  while (ss < sectionEnd) {
-    // Parse key-values line-by-line
-    const char* nextNewLine = (const char*) memchr(ss, '\n', sectionEnd - ss);
-    if (nextNewLine != nullptr) {
-      this->addKeyValue(new KeyValue(ss, nextNewLine - ss));
-      ss = nextNewLine + 1;         // skip the '\n' character in the end of the line
-    } else {
-      this->addKeyValue(new KeyValue(ss, sectionEnd - ss));
-      ss = sectionEnd;
-    }
-
-  }
-
 }
 
 Section::Section(Section& other) : Section() {
@@ -203,16 +169,28 @@ Section::Section(Section& other) : Section() {
 }
 
 Section::~Section() {
-  for (int i=0; i<keyValues.size(); i++) {
-    delete keyValues[i];
+  for (size_t i=0; i<keyValues.size(); i++) {
+    Config::destroy(keyValues[i]);
+  }
+  if (!arenaTitle) {
+    freeNull((void **) &titleDyn);
   }
-  freeNull((void **) &titleDyn);
 }
 
 KeyValue& Section::addKeyValue(KeyValue* keyVal) {
   if (!keyVal->value()) {
     _cleanUp();  // avoid adding second provisional keyValue
   }
+  keyVal->section = this;
+  if (config != nullptr && !keyVal->arenaObject) {
+    config->arenaOnly = false;
+  }
+  if (*keyVal) {
+    modified = true;      // a provisional one only counts once it gets a value
+    if (config != nullptr) {
+      config->indexValue(this, keyVal);
+    }
+  }
   keyValues.add(keyVal);
   return *keyVal;
 }
@@ -244,7 +222,7 @@ KeyValue& Section::putValueBase64(const char* key, const char* text) {
     base64_encodestate state;
     base64_init_encodestate(&state);
     int enclen = base64_encode_block(text, len, buff, &state);
-    enclen = base64_encode_blockend((buff + enclen), &state);
+    enclen += base64_encode_blockend((buff + enclen), &state);
     (*this)[key] = enclen ? buff : "";
     free(buff);
     return (*this)[key];
@@ -266,7 +244,7 @@ void Section::_cleanUp() {
           log_v("PROVISIONAL: ERROR: not found");
         }
       }
-      delete provisional;
+      Config::destroy(provisional);
     }
     provisional = nullptr;
   };
@@ -281,8 +259,13 @@ bool Section::remove(const char* key) {
   for (size_t i=0; i<keyValues.size();) {
     if ((key != nullptr && keyValues[i]->key() != nullptr && !strcmp(keyValues[i]->key(), key)) ||
         (key == nullptr && keyValues[i]->key()==key)) {
+      if (config != nullptr) {
+        config->unindexValue(this, keyValues[i]);
+      }
+      keyValues[i]->section = nullptr;
       keyValues.remove(i);
       found = true;
+      modified = true;
     } else {
       i++;
     }
@@ -291,11 +274,15 @@ bool Section::remove(const char* key) {
 }
 
 KeyValue* Section::_find(const char* key) {
+  uint16_t h = ValueIndex::keyHash(key);
   for (size_t i=0; i<keyValues.size(); i++) {
-    //if (keyValues[i]->value() == nullptr) continue;
-    if ((key != nullptr && keyValues[i]->key() != nullptr && !strcmp(keyValues[i]->key(), key)) ||
-        (key == nullptr && keyValues[i]->key()==key)) {
-      return keyValues[i];
+    KeyValue* kv = keyValues[i];
+    if (kv->keyHash != h) {
+      continue;     // different key for sure
+    }
+    if ((key != nullptr && kv->keyDyn != nullptr && !strcmp(kv->keyDyn, key)) ||
+        (key == nullptr && kv->keyDyn == nullptr)) {
+      return kv;
     }
   }
   return nullptr;
@@ -381,8 +368,13 @@ std::string Section::getValueBase64(const char* key, const char* def) {
       auto len64 = strlen(val);
       auto len = base64_decode_expected_len(len64) + 2;
       char* buff = (char*) malloc(len);
+      if (buff == nullptr) {
+        return std::string(def);
+      }
       base64_decode_chars(val, len64, buff);
-      return std::string(buff);
+      std::string res(buff);
+      free(buff);
+      return res;
     } else if (!val) {
       // attempt to retrieve from a provisional keyValue
       _cleanUp();
@@ -399,8 +391,8 @@ KeyValue& Section::operator[](int index) {
       index = -(index-keyValues.size()) - 1;  // otherwise: complement  -1 -> 0; -2 -> 1, ...
     }
   }
-  if (index >= keyValues.size()) {
-    if (index == keyValues.size() || !keyValues.size()) {
+  if (index >= (int) keyValues.size()) {
+    if (index == (int) keyValues.size() || !keyValues.size()) {
       // add provisional value
       KeyValue& kv = this->addKeyValue(nullptr, nullptr);
       provisional = &kv;
@@ -425,6 +417,25 @@ KeyValue& Section::operator[](const char* key) {
   return kv;
 }
 
+bool Section::isModified() {
+  if (modified) {
+    return true;
+  }
+  for (size_t i=0; i<keyValues.size(); i++) {
+    if (keyValues[i]->modified) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Section::clearModified() {
+  modified = false;
+  for (size_t i=0; i<keyValues.size(); i++) {
+    keyValues[i]->modified = false;
+  }
+}
+
 size_t Section::nValues() {
   return keyValues.size();
 };
@@ -434,16 +445,35 @@ const char* Section::title() {
 };
 
 void Section::setTitle(const char* title) {
-  freeNull((void **) &titleDyn);
+  if (arenaTitle) {
+    titleDyn = nullptr;
+    arenaTitle = false;
+  } else {
+    freeNull((void **) &titleDyn);
+  }
   titleDyn = extStrdup(title);
+  modified = true;
+  if (config != nullptr) {
+    config->arenaOnly = false;
+  }
 }
 
 void Section::deepCopy(Section& other) {
   // Reset all dynamic variables
-  freeNull((void **) &titleDyn);
+  if (arenaTitle) {
+    titleDyn = nullptr;
+    arenaTitle = false;
+  } else {
+    freeNull((void **) &titleDyn);
+  }
   _cleanUp();
-  for (int i=0; i<keyValues.size(); i++) {
-    delete keyValues[i];
+  modified = true;
+  if (config != nullptr) {
+    config->unindexSection(this);
+    config->arenaOnly = false;
+  }
+  for (size_t i=0; i<keyValues.size(); i++) {
+    Config::destroy(keyValues[i]);
   }
   keyValues.clear();
 
@@ -454,8 +484,13 @@ void Section::deepCopy(Section& other) {
 
   // Copy all keyValues
   this->keyValues.ensure(other.nValues());
-  for (int i = 0; i < other.nValues(); i++) {
-    this->keyValues.add(new KeyValue(other[i].key(), other[i].value()));
+  for (size_t i = 0; i < other.nValues(); i++) {
+    KeyValue* kv = new KeyValue(other[i].key(), other[i].value());
+    kv->section = this;
+    this->keyValues.add(kv);
+  }
+  if (config != nullptr) {
+    config->indexSection(this);
   }
 }
 
@@ -479,36 +514,503 @@ size_t Section::sprint(char* dest, int sectionNum, bool numericTitle, bool noTit
     }
     len += sprintf(dest + len, "\n");
   }
-  for (int i=0; i<keyValues.size(); i++) {
+  for (size_t i=0; i<keyValues.size(); i++) {
     len += keyValues[i]->sprint(dest + len);
   }
   return len;
 };
 
 
+// ------------------------------------------------------ Parser class ------------------------------------------------------
+
+
+Parser::Parser(Visitor& visitor)
+  : visitor(visitor), lineDyn(nullptr), lineLength(0), lineAlloc(0), nSections(0), afterTitle(false), stopped(false),
+    offset(0), lineStart(0)
+{}
+
+Parser::~Parser() {
+  freeNull((void **) &lineDyn);
+}
+
+/* Description:
+ *     parse the next chunk of text: every complete line in it, the rest is kept until the next chunk.
+ */
+bool Parser::feed(const char* data, size_t len) {
+  while (len > 0 && !stopped) {
+    const char* newLine = (const char*) memchr(data, '\n', len);
+    if (newLine == nullptr) {
+      // Line continues in the next chunk
+      if (!this->appendPartial(data, len)) {
+        stopped = true;
+      }
+      offset += len;
+      break;
+    }
+    lineStart = offset - lineLength;
+    if (lineLength > 0) {
+      // End of a line started in the previous chunk(s)
+      if (this->appendPartial(data, newLine - data)) {
+        stopped = !this->line(lineDyn, lineLength);
+      } else {
+        stopped = true;
+      }
+      lineLength = 0;
+    } else {
+      stopped = !this->line(data, newLine - data);
+    }
+    offset += newLine + 1 - data;
+    len -= newLine + 1 - data;
+    data = newLine + 1;
+  }
+  return !stopped;
+}
+
+bool Parser::finish() {
+  if (lineLength > 0 && !stopped) {
+    lineStart = offset - lineLength;
+    stopped = !this->line(lineDyn, lineLength);
+  }
+  lineLength = 0;
+  visitor.end();
+  return !stopped;
+}
+
+bool Parser::appendPartial(const char* s, size_t len) {
+  if (lineLength + len + 1 > lineAlloc) {
+    size_t alloc = lineAlloc ? lineAlloc : 64;
+    while (alloc < lineLength + len + 1) {
+      alloc *= 2;
+    }
+    char* p = (char*) extRealloc(lineDyn, alloc);
+    if (p == nullptr) {
+      log_e("line too long: %d", (int) (lineLength + len));
+      return false;
+    }
+    lineDyn = p;
+    lineAlloc = alloc;
+  }
+  memcpy(lineDyn + lineLength, s, len);
+  lineLength += len;
+  lineDyn[lineLength] = '\0';
+  return true;
+}
+
+/* Description:
+ *     parse a single line (without '\n'). The line is followed by '\n' or '\0'.
+ *
+ *     A line starting with '[' starts a section (section 0 if it's the first line), the title is up to the first ']'.
+ *     Any ']' characters and empty lines after the title are skipped. Any other line is a key-value.
+ */
+bool Parser::line(const char* s, size_t len) {
+  if (len > 0 && s[0] == '[') {
+
+    // Parse title
+    const char* titleEnd = (const char*) memchr(s + 1, ']', len - 1);
+    if (titleEnd == nullptr) {
+      titleEnd = s + len;
+    }
+    const char* title = s + 1;
+    size_t titleLength = titleEnd - title;
+
+    // Special treatment of numeric section titles
+    char number[12];
+    if (titleLength > 0 && titleLength < sizeof(number)) {
+      memcpy(number, title, titleLength);
+      number[titleLength] = '\0';
+      char* numberEnd;
+      long numericSectionTitle = strtol(number, &numberEnd, 10);
+      if (numberEnd == number + titleLength && numericSectionTitle == nSections) {
+        // The title is entirely numeric and coincides with the position -> ignore this title
+        title = nullptr;
+      }
+    }
+    nSections++;
+    if (!visitor.section(title, titleLength)) {
+      return false;
+    }
+
+    // Anything after the title
+    afterTitle = true;
+    len -= titleEnd - s;
+    s = titleEnd;
+  } else if (nSections == 0) {
+    nSections++;
+    if (!visitor.section(nullptr, 0)) {
+      return false;
+    }
+  }
+
+  if (afterTitle) {
+    while (len > 0 && *s == ']') {
+      s++;
+      len--;
+    }
+    if (len == 0) {
+      return true;
+    }
+    afterTitle = false;
+  }
+
+  // Key-value
+  const char* firstEqual = (const char*) memchr(s, '=', len);
+  if (firstEqual == nullptr) {
+    return visitor.keyValue(nullptr, 0, s, len);
+  }
+  return visitor.keyValue(firstEqual > s ? s : nullptr, firstEqual - s, firstEqual + 1, len - (firstEqual + 1 - s));
+}
+
+
+// ------------------------------------------------------ ValueIndex class ------------------------------------------------------
+
+
+static uint32_t fnv1a(const char* s, uint32_t h = 2166136261u) {
+  for (; *s; s++) {
+    h = (h ^ (uint8_t) *s) * 16777619u;
+  }
+  return h;
+}
+
+ValueIndex::ValueIndex()
+  : tableDyn(nullptr), capacity(1), count(0), nKeys(0)
+{}
+
+ValueIndex::~ValueIndex() {
+  freeNull((void **) &tableDyn);
+  for (int i = 0; i < nKeys; i++) {
+    freeNull((void **) &keysDyn[i]);
+  }
+}
+
+uint16_t ValueIndex::keyHash(const char* key) {
+  if (key == nullptr) {
+    return 0;
+  }
+  uint32_t h = fnv1a(key);
+  return (h ^ (h >> 16)) | 1;       // never 0
+}
+
+uint32_t ValueIndex::hash(const char* key, const char* value) {
+  return fnv1a(value, fnv1a(key) * 16777619u);
+}
+
+bool ValueIndex::addKey(const char* key) {
+  if (nKeys >= MAX_KEYS) {
+    log_e("too many keys indexed");
+    return false;
+  }
+  keysDyn[nKeys] = extStrdup(key);
+  if (keysDyn[nKeys] == nullptr) {
+    return false;
+  }
+  keyHashes[nKeys++] = keyHash(key);
+  return true;
+}
+
+bool ValueIndex::isKey(const char* key, uint16_t h) {
+  for (int i = 0; i < nKeys; i++) {
+    if (keyHashes[i] == h && !strcmp(keysDyn[i], key)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ValueIndex::add(uint32_t h, Section* section) {
+  if ((count + 1) * 4 > capacity * 3 && !this->resize(capacity < 16 ? 16 : capacity * 2)) {
+    return false;
+  }
+  size_t slot = h & (capacity - 1);
+  while (tableDyn[slot].section != nullptr) {
+    slot = (slot + 1) & (capacity - 1);
+  }
+  tableDyn[slot].hash = h;
+  tableDyn[slot].section = section;
+  count++;
+  return true;
+}
+
+void ValueIndex::remove(uint32_t h, Section* section) {
+  if (tableDyn == nullptr) {
+    return;
+  }
+  size_t mask = capacity - 1;
+  size_t i = h & mask;
+  while (tableDyn[i].section != nullptr && (tableDyn[i].hash != h || tableDyn[i].section != section)) {
+    i = (i + 1) & mask;
+  }
+  if (tableDyn[i].section == nullptr) {
+    return;     // not indexed
+  }
+
+  // Move back the entries that would not be found past the hole
+  for (size_t j = (i + 1) & mask; tableDyn[j].section != nullptr; j = (j + 1) & mask) {
+    size_t home = tableDyn[j].hash & mask;
+    bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if (!stays) {
+      tableDyn[i] = tableDyn[j];
+      i = j;
+    }
+  }
+  tableDyn[i].section = nullptr;
+  count--;
+}
+
+Section* ValueIndex::next(uint32_t h, size_t& slot) {
+  if (tableDyn == nullptr) {
+    return nullptr;
+  }
+  while (tableDyn[slot].section != nullptr) {
+    Entry& e = tableDyn[slot];
+    slot = (slot + 1) & (capacity - 1);
+    if (e.hash == h) {
+      return e.section;
+    }
+  }
+  return nullptr;
+}
+
+void ValueIndex::clear() {
+  freeNull((void **) &tableDyn);
+  capacity = 1;
+  count = 0;
+}
+
+bool ValueIndex::resize(size_t newCapacity) {
+  Entry* table = (Entry*) extMalloc(newCapacity * sizeof(Entry));
+  if (table == nullptr) {
+    log_e("out of memory for %d entries", (int) newCapacity);
+    return false;
+  }
+  for (size_t i = 0; i < newCapacity; i++) {
+    table[i].section = nullptr;
+  }
+  Entry* old = tableDyn;
+  size_t oldCapacity = old != nullptr ? capacity : 0;
+  tableDyn = table;
+  capacity = newCapacity;
+  count = 0;
+  for (size_t i = 0; i < oldCapacity; i++) {
+    if (old[i].section != nullptr) {
+      this->add(old[i].hash, old[i].section);
+    }
+  }
+  free(old);
+  return true;
+}
+
+
+// ------------------------------------------------------ Arena class ------------------------------------------------------
+
+
+Arena::Arena()
+  : chunksDyn(nullptr), allocated(0), nChunks(0)
+{}
+
+Arena::~Arena() {
+  this->reset();
+}
+
+void* Arena::alloc(size_t size, size_t align) {
+  Chunk* chunk = chunksDyn;
+  if (chunk != nullptr) {
+    size_t start = (chunk->used + align - 1) & ~(align - 1);
+    if (start + size <= chunk->size) {
+      chunk->used = start + size;
+      return (char*) (chunk + 1) + start;
+    }
+  }
+
+  // New chunk; a big allocation gets one of its own, which goes after the current chunk (that may still have room)
+  bool own = size > CHUNK_SIZE / 4;
+  size_t dataSize = own ? size : CHUNK_SIZE - sizeof(Chunk);
+  Chunk* added = (Chunk*) extMalloc(sizeof(Chunk) + dataSize);
+  if (added == nullptr) {
+    log_e("out of memory for %d bytes", (int) (sizeof(Chunk) + dataSize));
+    return nullptr;
+  }
+  added->size = dataSize;
+  added->used = size;
+  if (own && chunk != nullptr) {
+    added->next = chunk->next;
+    chunk->next = added;
+  } else {
+    added->next = chunk;
+    chunksDyn = added;
+  }
+  allocated += sizeof(Chunk) + dataSize;
+  nChunks++;
+  return added + 1;
+}
+
+char* Arena::strndup(const char* s, size_t len) {
+  char* p = (char*) this->alloc(len + 1, 1);
+  if (p != nullptr) {
+    memcpy(p, s, len);
+    p[len] = '\0';
+  }
+  return p;
+}
+
+void Arena::reset() {
+  while (chunksDyn != nullptr) {
+    Chunk* next = chunksDyn->next;
+    free(chunksDyn);
+    chunksDyn = next;
+  }
+  allocated = 0;
+  nChunks = 0;
+}
+
+
 // ------------------------------------------------------ Config class ------------------------------------------------------
 
 
-Config::Config() : sections() {}
+Config::Builder::Builder(Config& ini) : ini_(ini), pending() {
+  ini_.clear();
+}
+
+Config::Builder::~Builder() {
+  this->flush();
+}
+
+bool Config::Builder::section(const char* title, size_t titleLength) {
+  this->flush();
+  ini_.addSection(ini_.newSection(title, titleLength));
+  return true;
+}
+
+bool Config::Builder::keyValue(const char* key, size_t keyLength, const char* value, size_t valueLength) {
+  KeyValue* kv = ini_.newKeyValue(key, keyLength, value, valueLength);
+  if (ini_.arenaDyn != nullptr) {
+    pending.add(kv);      // the array of the section goes into the arena once its size is known
+  } else {
+    ini_.sections[ini_.sections.size()-1]->addKeyValue(kv);
+  }
+  return true;
+}
+
+void Config::Builder::end() {
+  this->flush();
+}
+
+/* Description:
+ *     arena: add the pending key-values to the last section, in an array of exactly their number
+ */
+void Config::Builder::flush() {
+  if (pending.size() == 0) {
+    return;
+  }
+  Section* section = ini_.sections[ini_.sections.size()-1];
+  for (size_t i=0; i<pending.size(); i++) {
+    pending[i]->section = section;
+    ini_.indexValue(section, pending[i]);
+  }
+  KeyValue** array = section->arenaObject && section->keyValues.size() == 0
+                     ? (KeyValue**) ini_.arenaDyn->alloc(pending.size() * sizeof(KeyValue*))
+                     : nullptr;
+  if (array != nullptr) {
+    for (size_t i=0; i<pending.size(); i++) {
+      array[i] = pending[i];
+    }
+    section->keyValues.useBuffer(array, pending.size());
+  } else {
+    section->keyValues.extend(&pending[0], pending.size());
+    ini_.arenaOnly = false;
+  }
+  pending.purge();
+}
+
+Config::Config() : sections(), indexDyn(nullptr), arenaDyn(nullptr), arenaOnly(true) {}
 
 Config::Config(const char* s) : Config() {
   parse(s);
 }
 
 Config::~Config() {
-  for (int i=0; i<sections.size(); i++) {
-    delete sections[i];
-  }
+  this->clear();
+  delete indexDyn;
+  delete arenaDyn;
 }
 
 /* Description:
  *     delete all sections (from RAM) and reset the state to empty
  */
 void Config::clear() {
-  for (int i=0; i<sections.size(); i++) {
-    delete sections[i];
+  if (arenaDyn == nullptr || !arenaOnly) {
+    for (size_t i=0; i<sections.size(); i++) {
+      destroy(sections[i]);
+    }
   }
   sections.clear();
+  if (arenaDyn != nullptr) {
+    arenaDyn->reset();      // everything parsed, at once
+  }
+  arenaOnly = true;
+  if (indexDyn != nullptr) {
+    indexDyn->clear();
+  }
+}
+
+bool Config::useArena() {
+  if (arenaDyn == nullptr) {
+    arenaDyn = new Arena();
+  }
+  return arenaDyn != nullptr;
+}
+
+/* Description:
+ *     a section or key-value as parsed, in the arena if it is used (and has memory), allocated separately otherwise
+ */
+Section* Config::newSection(const char* title, size_t titleLength) {
+  if (arenaDyn != nullptr) {
+    void* p = arenaDyn->alloc(sizeof(Section));
+    char* t = title != nullptr ? arenaDyn->strndup(title, titleLength) : nullptr;
+    if (p != nullptr && (t != nullptr || title == nullptr)) {
+      Section* section = new (p) Section();
+      section->titleDyn = t;
+      section->arenaObject = true;
+      section->arenaTitle = true;
+      return section;
+    }
+  }
+  arenaOnly = false;
+  return new Section(title, titleLength);
+}
+
+KeyValue* Config::newKeyValue(const char* key, size_t keyLength, const char* value, size_t valueLength) {
+  if (arenaDyn != nullptr) {
+    void* p = arenaDyn->alloc(sizeof(KeyValue));
+    char* k = key != nullptr ? arenaDyn->strndup(key, keyLength) : nullptr;
+    char* v = arenaDyn->strndup(value, valueLength);
+    if (p != nullptr && (k != nullptr || key == nullptr) && v != nullptr) {
+      KeyValue* kv = new (p) KeyValue();
+      kv->keyDyn = k;
+      kv->keyHash = ValueIndex::keyHash(k);
+      kv->valueDyn = v;
+      kv->arenaObject = true;
+      kv->arenaValue = true;
+      return kv;
+    }
+  }
+  arenaOnly = false;
+  return new KeyValue(key, keyLength, value, valueLength);
+}
+
+void Config::destroy(Section* section) {
+  if (section->arenaObject) {
+    section->~Section();
+  } else {
+    delete section;
+  }
+}
+
+void Config::destroy(KeyValue* kv) {
+  if (kv->arenaObject) {
+    kv->~KeyValue();
+  } else {
+    delete kv;
+  }
 }
 
 void Config::parse(const char* s) {
@@ -516,37 +1018,28 @@ void Config::parse(const char* s) {
     return;
   }
 
-  this->clear();
-
-  // Parse each section
-  const char newSection[] = "\n[";
-  const char* sectionStart = s;
-  const char* sectionEnd;
-  do {
-    sectionEnd = strstr(sectionStart, newSection);
-    int sectionLength;
-    if (sectionEnd != nullptr) {
-      // Next section found
-      sectionLength = sectionEnd - sectionStart + 1;
-    } else {
-      // This is the last section
-      sectionLength = strlen(sectionStart);
-    }
-    this->addSection(new Section(sectionStart, sectionLength, sections.size()));
-    sectionStart += sectionLength;
-  } while (sectionEnd != nullptr);
+  Builder builder(*this);     // clears this
+  Parser parser(builder);
+  parser.feed(s, strlen(s));
+  parser.finish();
 }
 
 void Config::addSection(Section* section) {
+  if (!section->arenaObject) {
+    arenaOnly = false;
+  }
+  section->config = this;
+  section->position = sections.size();
   sections.add(section);
+  this->indexSection(section);
 }
 
 void Config::addSection(const char* title) {
-  sections.add(new Section(title));
+  this->addSection(new Section(title));
 }
 
 size_t Config::addSection() {
-  sections.add(new Section());
+  this->addSection(new Section());
   return sections.size()-1;
 }
 
@@ -555,6 +1048,7 @@ void Config::reorderLast(int startAt, int (*cmp)(Section**, Section**)) {
   for (size_t j = startAt; j < sections.size() - 1; j++) {
     if ((*cmp)(&sections[j], &sections[sections.size() - 1]) > 0) {
       sections.insert(j, sections.pop());
+      this->renumber(j);
       break;
     }
   }
@@ -562,15 +1056,18 @@ void Config::reorderLast(int startAt, int (*cmp)(Section**, Section**)) {
 
 void Config::sortFrom(int startAt, int (*cmp)(Section**, Section**)) {
   this->sections.sortFrom(startAt, cmp);
+  this->renumber(startAt);
 }
 
 /* Description:
  *     remove section by its ordinal position
  */
 bool Config::removeSection(int i) {
-  if (i < sections.size()) {
-    delete sections[i];
+  if (i >= 0 && i < (int) sections.size()) {
+    this->unindexSection(sections[i]);
+    destroy(sections[i]);
     sections.remove(i);
+    this->renumber(i);
     return true;
   }
   return false;
@@ -602,8 +1099,8 @@ Section& Config::operator[](int index) {
       index = -(index-sections.size()) - 1;  // otherwise: complement  -1 -> 0; -2 -> 1, ...
     }
   }
-  if (index >= sections.size()) {
-    if (index == sections.size() || !sections.size()) {
+  if (index >= (int) sections.size()) {
+    if (index == (int) sections.size() || !sections.size()) {
       this->addSection();
     }
     index = sections.size()-1;     // always choose last one
@@ -635,7 +1132,10 @@ int Config::query(const char* key, const char* value) {
   if (key == nullptr || value == nullptr) {
     return -1;
   }
-  for (int i=0; i<this->sections.size(); i++) {
+  if (indexDyn != nullptr && indexDyn->isKey(key, ValueIndex::keyHash(key))) {
+    return this->queryIndexed(key, value, nullptr, nullptr);
+  }
+  for (size_t i=0; i<this->sections.size(); i++) {
     Section* section = this->sections[i];
     if (section == nullptr) {
       continue;  // paranoia
@@ -658,7 +1158,15 @@ int Config::query(const char* key1, const char* value1, const char* key2, const
     log_d("%s : \"%s\"", key1, value1);
     log_d("%s : \"%s\"", key2, value2);
   }
-  for (int i=0; i<this->sections.size(); i++) {
+  if (indexDyn != nullptr && key1 != nullptr && value1 != nullptr && key2 != nullptr && value2 != nullptr) {
+    if (indexDyn->isKey(key1, ValueIndex::keyHash(key1))) {
+      return this->queryIndexed(key1, value1, key2, value2);
+    }
+    if (indexDyn->isKey(key2, ValueIndex::keyHash(key2))) {
+      return this->queryIndexed(key2, value2, key1, value1);
+    }
+  }
+  for (size_t i=0; i<this->sections.size(); i++) {
     Section* section = this->sections[i];
     if (section == nullptr) {
       continue;  // paranoia
@@ -686,7 +1194,7 @@ int Config::query(const char* key, int32_t value) {
   IF_LOG(VERBOSE) {
     log_d("%s : \"%d\"", key, value);
   }
-  for (int i=0; i<this->sections.size(); i++) {
+  for (size_t i=0; i<this->sections.size(); i++) {
     Section* section = this->sections[i];
     if (section == nullptr) {
       continue;  // paranoia
@@ -703,6 +1211,94 @@ int Config::query(const char* key, int32_t value) {
   return -1;
 }
 
+/* Description:
+ *     query() through the index of `key1`: same result as looking at every section (the value of the first key-value
+ *     with the key must match, the first section matching is returned).
+ */
+int Config::queryIndexed(const char* key1, const char* value1, const char* key2, const char* value2) {
+  uint32_t h = ValueIndex::hash(key1, value1);
+  int found = -1;
+  Section* section;
+  for (size_t slot = indexDyn->first(h); (section = indexDyn->next(h, slot)) != nullptr; ) {
+    if (found >= 0 && section->position >= found) {
+      continue;
+    }
+    const char* v = section->getValueSafe(key1);
+    if (v == nullptr || strcmp(v, value1)) {
+      continue;
+    }
+    if (key2 != nullptr) {
+      v = section->getValueSafe(key2);
+      if (v == nullptr || strcmp(v, value2)) {
+        continue;
+      }
+    }
+    found = section->position;
+  }
+  return found;
+}
+
+bool Config::indexKey(const char* key) {
+  if (key == nullptr) {
+    return false;
+  }
+  if (indexDyn == nullptr) {
+    indexDyn = new ValueIndex();
+  }
+  if (indexDyn->isKey(key, ValueIndex::keyHash(key))) {
+    return true;
+  }
+  if (!indexDyn->addKey(key)) {
+    return false;
+  }
+  indexDyn->clear();
+  for (size_t i=0; i<sections.size() && indexDyn != nullptr; i++) {
+    this->indexSection(sections[i]);
+  }
+  return indexDyn != nullptr;
+}
+
+void Config::indexValue(Section* section, KeyValue* kv) {
+  if (indexDyn != nullptr && kv->keyDyn != nullptr && kv->valueDyn != nullptr && indexDyn->isKey(kv->keyDyn, kv->keyHash)) {
+    if (!indexDyn->add(ValueIndex::hash(kv->keyDyn, kv->valueDyn), section)) {
+      this->dropIndex();
+    }
+  }
+}
+
+void Config::unindexValue(Section* section, KeyValue* kv) {
+  if (indexDyn != nullptr && kv->keyDyn != nullptr && kv->valueDyn != nullptr && indexDyn->isKey(kv->keyDyn, kv->keyHash)) {
+    indexDyn->remove(ValueIndex::hash(kv->keyDyn, kv->valueDyn), section);
+  }
+}
+
+void Config::indexSection(Section* section) {
+  for (size_t i=0; i<section->keyValues.size() && indexDyn != nullptr; i++) {
+    this->indexValue(section, section->keyValues[i]);
+  }
+}
+
+void Config::unindexSection(Section* section) {
+  for (size_t i=0; i<section->keyValues.size() && indexDyn != nullptr; i++) {
+    this->unindexValue(section, section->keyValues[i]);
+  }
+}
+
+void Config::renumber(int from) {
+  for (int i=from; i<(int) sections.size(); i++) {
+    sections[i]->position = i;
+  }
+}
+
+/* Description:
+ *     an incomplete index would miss sections: without memory, queries go back to looking at every section
+ */
+void Config::dropIndex() {
+  log_e("index dropped");
+  delete indexDyn;
+  indexDyn = nullptr;
+}
+
 /* Description:
  *     find section which has field with key `key`.
  *     This is intended to be used for finding sections with a unique flag. See setUniqueFlag().
@@ -710,7 +1306,7 @@ int Config::query(const char* key, int32_t value) {
  *     Integer index of the first section found; -1 otherwise
  */
 int Config::findKey(const char* key) {
-  for (int i=0; i<this->sections.size(); i++) {
+  for (size_t i=0; i<this->sections.size(); i++) {
     Section* section = this->sections[i];
     if (section == nullptr) {
       continue;  // paranoia
@@ -726,7 +1322,7 @@ int Config::findKey(const char* key) {
  *     removes fields with key `key` from all sections
  */
 void Config::removeAllKeys(const char* key) {
-  for (int i=0; i<this->sections.size(); i++) {
+  for (size_t i=0; i<this->sections.size(); i++) {
     this->sections[i]->remove(key);
   }
 }
@@ -741,7 +1337,7 @@ bool Config::setUniqueFlag(int index, const char* key) {
   this->removeAllKeys(key);
 
   // Set flag in exactly one section
-  if (index < 0 || index >= this->sections.size()) {
+  if (index < 0 || index >= (int) this->sections.size()) {
     return false;
   }
   (*this->sections[index])[key] = "1";
@@ -781,19 +1377,8 @@ bool Config::isEmpty() const {
  */
 size_t Config::length() {
   size_t len = 0;
-  for (int i=0; i<sections.size(); i++) {
-    len += sections[i]->length();
-    if (*(sections[i]->title()) == '\0') {    // empty title -> it's either first section (no title) or with ordinary numeric title
-      if (i==0) {
-        // Subtract three characters ("[]\n") counted for the first section
-        len -= 3;
-      } else {
-        // Account for numeric title
-        char buff[11];
-        snprintf(buff, 11, "%d", i);
-        len += strlen(buff);
-      }
-    }
+  for (size_t i=0; i<sections.size(); i++) {
+    len += this->sectionLength(i);
   }
   return len;
 }
@@ -805,20 +1390,40 @@ size_t Config::length() {
  */
 size_t Config::sprint(char* str) {
   size_t len = 0;
-  for (int i=0; i<sections.size(); i++) {
-    bool numericTitle = false;
-    bool noTitle = false;
-    if (*(sections[i]->title()) == '\0') {
-      if (i==0) {
-        noTitle = true;
-      }
-      numericTitle = true;
+  for (size_t i=0; i<sections.size(); i++) {
+    len += this->sprintSection(i, str + len);
+  }
+  return len;
+}
+
+size_t Config::sectionLength(int i) {
+  size_t len = sections[i]->length();
+  if (*(sections[i]->title()) == '\0') {    // empty title -> it's either first section (no title) or with ordinary numeric title
+    if (i==0) {
+      // Subtract three characters ("[]\n") counted for the first section
+      len -= 3;
+    } else {
+      // Account for numeric title
+      char buff[11];
+      snprintf(buff, 11, "%d", i);
+      len += strlen(buff);
     }
-    len += sections[i]->sprint(str + len, i, numericTitle, noTitle);
   }
   return len;
 }
 
+size_t Config::sprintSection(int i, char* dest) {
+  bool numericTitle = false;
+  bool noTitle = false;
+  if (*(sections[i]->title()) == '\0') {
+    if (i==0) {
+      noTitle = true;
+    }
+    numericTitle = true;
+  }
+  return sections[i]->sprint(dest, i, numericTitle, noTitle);
+}
+
 /* Description:
  *     return serialized C-string of exactly right size.
  * Complexity:
@@ -834,7 +1439,7 @@ std::unique_ptr<char[]> Config::p_c_str() {
 
 bool isSafeString(const char* str) {
   for (; *str; str++)
-    if (*str < ' ' && *str != '\r' && *str != '\t' || *str >= 127) {
+    if ((*str < ' ' && *str != '\r' && *str != '\t') || *str >= 127) {
       return false;
     }
   return true;
@@ -62,15 +62,19 @@ governing permissions and limitations under the License.
  *     apart from pointers, internally this class will try to store everything into the external
  *     RAM (PSRAM) if possible, allowing to parse and serialize even relatively large INI files.
  *     This is done by using LinearArray<..., LA_EXTERNAL_RAM> objects, extStrdup and extStrndup function.
+ *     With Config::useArena(), parsed sections and key-values go into a few big chunks instead (see Arena).
  */
 
 namespace NanoIni {
 
+class Section;
+class Config;
+
 class KeyValue {
 public:
   KeyValue();
   KeyValue(const char* key, const char* value);
-  KeyValue(const char* line, size_t lineLength);
+  KeyValue(const char* key, size_t keyLength, const char* value, size_t valueLength);   // as parsed: not NUL-terminated
   ~KeyValue();
 
   // Access
@@ -87,9 +91,24 @@ public:
   const char* operator=(float val);
   const char* operator=(KeyValue& other);
 
+  bool isModified() const {
+    return modified;
+  }
+  bool inArena() const {
+    return arenaObject;
+  }
+
 protected:
+  friend class Section;
+  friend class Config;
+
   char* keyDyn;     // can be NULL
   char* valueDyn;   // by convention, should not be NULL; if it is - it is a provisional key-value and is meant to be deleted
+  Section* section; // the one it was added to, if any (for keeping the index of its Config up to date)
+  uint16_t keyHash; // of the key, to skip comparing most keys on lookup (0 - no key)
+  bool modified : 1;      // value assigned since the last clearModified() of its section
+  bool arenaObject : 1;   // this object and its key are in the Arena of its Config
+  bool arenaValue : 1;    // the value is in the Arena (copy-on-write: a new value is allocated as usual)
 
   void _escape(char* p);
 };
@@ -98,7 +117,7 @@ class Section {
 public:
   Section();
   Section(const char* title);
-  Section(const char* ss, size_t sectionLength, int pos);
+  Section(const char* title, size_t titleLength);     // as parsed: not NUL-terminated, NULL - no title
   Section(Section& other);    // deep copy
   ~Section();
 
@@ -130,8 +149,24 @@ public:
   void setTitle(const char* title);
   void deepCopy(Section& other);
 
+  // Changes since the section was loaded or stored (see IniFile::store()). New sections count as modified.
+  bool isModified();                      // complexity: O(n)
+  void clearModified();
+
+  bool inArena() const {
+    return arenaObject;
+  }
+
 protected:
+  friend class KeyValue;
+  friend class Config;
+
   char* titleDyn;                         // can be NULL
+  bool modified : 1;                      // title or set of key-values changed (values of key-values are tracked by them)
+  bool arenaObject : 1;                   // this object and its array of key-values are in the Arena of its Config
+  bool arenaTitle : 1;                    // the title is in the Arena
+  Config* config;                         // the one it was added to, if any
+  int position;                           // in that config
   KeyValue* provisional;                  // KeyValue with NULL value that should be cleaned up on each access; used to allow Python-style declarations
   LinearArray<KeyValue*, LA_EXTERNAL_RAM> keyValues;
 
@@ -139,6 +174,143 @@ protected:
   KeyValue* _find(const char* key);
 };
 
+/*
+ * Description:
+ *     receives the sections and key-values found by Parser, in the order they appear in the text.
+ *     Strings are NOT NUL-terminated and only valid during the call.
+ *     Return false to stop the parsing (e.g. once the section looked for is found).
+ */
+class Visitor {
+public:
+  virtual ~Visitor() {}
+  virtual bool section(const char* title, size_t titleLength) = 0;      // title == nullptr: no title (or numeric title equal to the position)
+  virtual bool keyValue(const char* key, size_t keyLength, const char* value, size_t valueLength) = 0;    // key == nullptr: empty key
+  virtual void end() {}             // Parser::finish() was called
+};
+
+/*
+ * Description:
+ *     line-oriented INI parser fed with chunks of text of any size, e.g. fixed-size reads from a file, so that the whole
+ *     text never has to be in memory. Complete lines are parsed right in the chunk; only a line split between two chunks
+ *     is copied (into a buffer that grows to the longest such line).
+ *
+ *     Results go to a Visitor: Config::Builder builds the sections and key-values of a Config (this is how Config::parse()
+ *     works), other visitors can scan files too large to be loaded.
+ */
+class Parser {
+public:
+  Parser(Visitor& visitor);
+  ~Parser();
+
+  bool feed(const char* data, size_t len);      // false - the visitor stopped parsing
+  bool finish();                                // end of text: parse the last line if it has no '\n'
+  size_t lineOffset() const {                   // position in the text of the line being reported to the visitor
+    return lineStart;
+  }
+
+protected:
+  Visitor& visitor;
+  char* lineDyn;              // beginning of a line from the previous chunks, NUL-terminated
+  size_t lineLength;
+  size_t lineAlloc;
+  int nSections;              // started so far
+  bool afterTitle;            // skipping ']' characters and empty lines after a section title
+  bool stopped;
+  size_t offset;              // position in the text of the data being fed
+  size_t lineStart;
+
+  bool line(const char* s, size_t len);
+  bool appendPartial(const char* s, size_t len);
+};
+
+/*
+ * Description:
+ *     index of the values of a few keys: hash of (key, value) -> sections having it, so that Config::query() doesn't
+ *     have to look at every section. Several sections can have the same hash: query() checks the candidates.
+ *
+ *     Hash table with linear probing, in PSRAM, at most 3/4 full. No tombstones: removing an entry moves the following
+ *     ones of the same probe sequence back.
+ */
+class ValueIndex {
+public:
+  static const int MAX_KEYS = 4;
+
+  ValueIndex();
+  ~ValueIndex();
+
+  bool addKey(const char* key);
+  bool isKey(const char* key, uint16_t keyHash);
+  static uint32_t hash(const char* key, const char* value);
+  static uint16_t keyHash(const char* key);
+
+  bool add(uint32_t hash, Section* section);
+  void remove(uint32_t hash, Section* section);
+  void clear();                                 // all entries, keys stay
+
+  // Candidates:   for (size_t slot = index.first(h); (s = index.next(h, slot)) != nullptr; ) { ... }
+  size_t first(uint32_t hash) {
+    return hash & (capacity - 1);
+  }
+  Section* next(uint32_t hash, size_t& slot);
+  size_t size() {
+    return count;
+  }
+  size_t memoryUsed() {
+    return tableDyn != nullptr ? capacity * sizeof(Entry) : 0;
+  }
+
+protected:
+  struct Entry {
+    uint32_t hash;
+    Section* section;                           // nullptr - empty slot
+  };
+
+  Entry* tableDyn;
+  size_t capacity;                              // power of 2 (1 while empty, so that first() works)
+  size_t count;
+  char* keysDyn[MAX_KEYS];
+  uint16_t keyHashes[MAX_KEYS];
+  int nKeys;
+
+  bool resize(size_t newCapacity);
+};
+
+/*
+ * Description:
+ *     memory for what gets parsed into a Config (see Config::useArena()): sections, key-values, their strings and arrays
+ *     are placed one after another into big chunks in PSRAM. Nothing is freed individually: reset() frees all the
+ *     chunks at once. This saves thousands of small allocations (time, and the heap overhead of each) when a large
+ *     file like the phonebook is loaded and unloaded.
+ */
+class Arena {
+public:
+  static const size_t CHUNK_SIZE = 8192;
+
+  Arena();
+  ~Arena();
+
+  void* alloc(size_t size, size_t align = sizeof(void*));     // nullptr if out of memory
+  char* strndup(const char* s, size_t len);                    // NUL-terminated copy
+  void reset();                                                // free all chunks
+  size_t memoryUsed() const {
+    return allocated;
+  }
+  int chunks() const {
+    return nChunks;
+  }
+
+protected:
+  struct Chunk {
+    Chunk* next;
+    size_t size;        // of the data following this header
+    size_t used;
+  };
+
+  Chunk* chunksDyn;     // the one being filled first
+  size_t allocated;
+  int nChunks;
+};
+
 /* MAIN CLASS: INI parser, interface, serializer */
 
 class Config {
@@ -182,12 +354,12 @@ public:
       return pos_;
     }
     bool      valid() const                         {
-      return pos_ < ini_.nSections();
+      return (size_t) pos_ < ini_.nSections();
     }
 
   protected:
-    int pos_;
     Config& ini_;
+    int pos_;
 
   };
 
@@ -200,6 +372,29 @@ public:
     return SectionsIterator(*this, startAt);
   }
 
+  /* Description:
+   *     builds the sections of a Config from what Parser finds. The Config is cleared first.
+   * Example usage:
+   *     Config::Builder builder(ini);
+   *     Parser parser(builder);
+   *     while (...) parser.feed(chunk, chunkLength);
+   *     parser.finish();
+   */
+  class Builder : public Visitor {
+  public:
+    Builder(Config& ini);
+    ~Builder();
+    bool section(const char* title, size_t titleLength);
+    bool keyValue(const char* key, size_t keyLength, const char* value, size_t valueLength);
+    void end();
+
+  protected:
+    Config& ini_;
+    LinearArray<KeyValue*, LA_EXTERNAL_RAM> pending;     // arena: key-values of the last section, until its end
+
+    void flush();
+  };
+
   /* Description:
    *     delete all sections (from RAM) and reset the state to empty
    */
@@ -235,6 +430,30 @@ public:
   int query(const char* key1, const char* value1, const char* key2, const char* value2);
   int query(const char* key, int32_t value);
 
+  /* Description:
+   *     keep an index of the values of `key` (for up to ValueIndex::MAX_KEYS keys), so that query() with it takes O(1)
+   *     on average instead of O(n). The index is updated on every change: key-values added, assigned or removed,
+   *     sections added, removed or moved. It survives clear() and parsing, so it can be set up before loading.
+   * Return:
+   *     false if out of memory (queries work without the index)
+   */
+  bool indexKey(const char* key);
+  size_t indexMemory() {
+    return indexDyn != nullptr ? indexDyn->memoryUsed() : 0;
+  }
+
+  /* Description:
+   *     parse (Builder, parse()) into an Arena owned by this Config instead of allocating every section, key-value and
+   *     string separately. clear() then frees the arena in one step, without visiting the sections, unless something
+   *     allocated separately was attached since (assigned values, added key-values or sections, new titles).
+   *     Assigning a value to a parsed key-value copies it out of the arena; the old value stays there until clear().
+   *     Takes effect on the next clear() or parsing.
+   */
+  bool useArena();
+  size_t arenaMemory() {
+    return arenaDyn != nullptr ? arenaDyn->memoryUsed() : 0;
+  }
+
   /* Description:
    *     find section which has field with key `key`.
    *     This is intended to be used for finding sections with a unique flag. See setUniqueFlag().
@@ -283,7 +502,30 @@ public:
   std::unique_ptr<char[]> p_c_str();
 
 protected:
+  friend class KeyValue;
+  friend class Section;
+
   LinearArray<Section*, LA_EXTERNAL_RAM> sections;
+  ValueIndex* indexDyn;
+  Arena* arenaDyn;
+  bool arenaOnly;                               // no separately allocated memory is attached to the sections
+
+  Section* newSection(const char* title, size_t titleLength);
+  KeyValue* newKeyValue(const char* key, size_t keyLength, const char* value, size_t valueLength);
+  static void destroy(Section* section);        // delete, or only destruct if it is in an arena
+  static void destroy(KeyValue* kv);
+
+  size_t sectionLength(int i);                  // serialized length of a section (depends on its position)
+  size_t sprintSection(int i, char* dest);
+
+  // Index maintenance
+  void indexValue(Section* section, KeyValue* kv);
+  void unindexValue(Section* section, KeyValue* kv);
+  void indexSection(Section* section);
+  void unindexSection(Section* section);
+  void renumber(int from);                      // positions of the sections from this one on
+  void dropIndex();
+  int queryIndexed(const char* key1, const char* value1, const char* key2, const char* value2);
 };
 
 bool isSafeString(const char* str);
@@ -119,6 +119,47 @@ IPAddress resolveDomain(const char* hostName) {
   return IPAddress(retAddr);
 }
 
+/* Description:
+ *     find UDP sockets among the lwIP socket descriptors. This is needed to wait for incoming data with select() on WiFiUDP objects
+ *     which keep their descriptor private. Typical usage: take the mask before and after WiFiUDP::begin() and pick the new socket.
+ * Return:
+ *     bitmask of UDP socket descriptors; bit N corresponds to descriptor LWIP_SOCKET_OFFSET+N.
+ */
+uint32_t udpSocketsMask(uint16_t localPort) {
+  uint32_t mask = 0;
+  for (int i = 0; i < CONFIG_LWIP_MAX_SOCKETS && i < 32; i++) {
+    int fd = LWIP_SOCKET_OFFSET + i;
+    int type = 0;
+    socklen_t len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_DGRAM) {
+      continue;     // closed socket or not UDP
+    }
+    if (localPort && socketLocalPort(fd) != localPort) {
+      continue;
+    }
+    mask |= 1u << i;
+  }
+  return mask;
+}
+
+int udpSocketFd(uint32_t mask) {
+  for (int i = 0; i < 32; i++) {
+    if (mask & (1u << i)) {
+      return LWIP_SOCKET_OFFSET + i;
+    }
+  }
+  return -1;
+}
+
+uint16_t socketLocalPort(int fd) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  if (fd < 0 || getsockname(fd, (struct sockaddr*) &addr, &len) < 0) {
+    return 0;
+  }
+  return ntohs(addr.sin_port);
+}
+
 // ===================================================== WIFI STATE =====================================================
 
 Networks::Networks() : ini(filename), _userDisabled(false) {
@@ -20,6 +20,7 @@ governing permissions and limitations under the License.
 #include "Storage.h"
 #include "config.h"
 #include "lwip/netdb.h"
+#include "lwip/sockets.h"
 #include "src/ping/ping.h"
 #include <ESPmDNS.h>
 
@@ -38,6 +39,11 @@ extern WiFiUDP udpRtcp;
 extern void connectToWiFi(const char* ssid, const char* pwd);
 extern IPAddress resolveDomain(const char* hostName);
 
+// lwIP socket helpers (WiFiUDP doesn't expose its socket descriptor)
+extern uint32_t udpSocketsMask(uint16_t localPort = 0);   // bitmask of open UDP sockets (bit N is descriptor LWIP_SOCKET_OFFSET+N), optionally only those bound to `localPort`
+extern int udpSocketFd(uint32_t mask);                    // lowest socket descriptor present in the mask, -1 if none
+extern uint16_t socketLocalPort(int fd);                  // port the socket is bound to, 0 if unknown
+
 // Class to save/load WiFi networks data from Flash
 class Networks {
 public:
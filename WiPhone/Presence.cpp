@@ -0,0 +1,560 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#include "Presence.h"
+
+PresenceTable presence;
+
+// - - - - - - - - - - - - - - - - - - - - - -  Minimal XML and MIME scanning  - - - - - - - - - - - - - - - - - - - - - -
+
+// Presence documents are small and only a few elements and attributes matter, so there is no XML parser:
+// tags are found one after another, namespace prefixes are ignored, entities are not decoded.
+
+struct XmlTag {
+  const char* name;       // local name (namespace prefix skipped)
+  size_t nameLen;
+  const char* attrs;      // attributes start here and end at `end`
+  const char* end;
+  bool closing;           // </name>
+  bool empty;             // <name ... />
+};
+
+/* Description:
+ *     find the next element tag in [p, end); declarations and comments are skipped
+ * Return:
+ *     position right after the tag (where its text starts), NULL - no more tags
+ */
+static const char* nextTag(const char* p, const char* end, XmlTag& tag) {
+  while (p < end) {
+    const char* lt = (const char*) memchr(p, '<', end - p);
+    const char* gt = lt!=NULL ? (const char*) memchr(lt, '>', end - lt) : NULL;
+    if (gt==NULL) {
+      return NULL;
+    }
+    p = gt + 1;
+    const char* s = lt + 1;
+    if (*s=='?' || *s=='!') {
+      continue;
+    }
+    tag.closing = *s=='/';
+    if (tag.closing) {
+      s++;
+    }
+    const char* e = s;
+    while (e < gt && !isspace((unsigned char) *e) && *e!='/') {
+      e++;
+    }
+    const char* colon = (const char*) memchr(s, ':', e - s);
+    tag.name = colon!=NULL ? colon + 1 : s;
+    tag.nameLen = e - tag.name;
+    tag.attrs = e;
+    tag.empty = *(gt - 1)=='/';
+    tag.end = tag.empty ? gt - 1 : gt;
+    return p;
+  }
+  return NULL;
+}
+
+static bool isTag(const XmlTag& tag, const char* name) {
+  return tag.nameLen==strlen(name) && !strncmp(tag.name, name, tag.nameLen);
+}
+
+/* Description:
+ *     copy the value of an (unprefixed) attribute of the tag into `out`
+ * Return:
+ *     false if the attribute is absent or doesn't fit
+ */
+static bool xmlAttribute(const XmlTag& tag, const char* name, char* out, size_t size) {
+  size_t len = strlen(name);
+  for (const char* p = tag.attrs; p + len < tag.end; p++) {
+    if (!isspace((unsigned char) p[-1]) || strncmp(p, name, len)) {
+      continue;
+    }
+    const char* q = p + len;
+    while (q < tag.end && isspace((unsigned char) *q)) {
+      q++;
+    }
+    if (q >= tag.end || *q!='=') {
+      continue;
+    }
+    do {
+      q++;
+    } while (q < tag.end && isspace((unsigned char) *q));
+    if (q >= tag.end || (*q!='"' && *q!='\'')) {
+      return false;
+    }
+    const char* e = (const char*) memchr(q + 1, *q, tag.end - q - 1);
+    if (e==NULL || (size_t)(e - q - 1) >= size) {
+      return false;
+    }
+    memcpy(out, q + 1, e - q - 1);
+    out[e - q - 1] = '\0';
+    return true;
+  }
+  return false;
+}
+
+// Text of an element (starting at p) equals `word`, leading and trailing spaces aside
+static bool xmlTextIs(const char* p, const char* end, const char* word) {
+  while (p < end && isspace((unsigned char) *p)) {
+    p++;
+  }
+  size_t len = strlen(word);
+  if (p + len > end || strncasecmp(p, word, len)) {
+    return false;
+  }
+  for (p += len; p < end && *p!='<'; p++) {
+    if (!isspace((unsigned char) *p)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static const char* findIn(const char* p, const char* end, const char* str) {
+  size_t len = strlen(str);
+  for (; p + len <= end; p++) {
+    if (*p==*str && !memcmp(p, str, len)) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+// Media type (without parameters) is `type`
+static bool typeIs(const char* value, size_t len, const char* type) {
+  size_t n = strlen(type);
+  return len >= n && !strncasecmp(value, type, n) && (len==n || value[n]==';' || isspace((unsigned char) value[n]));
+}
+
+/* Description:
+ *     find the next part of a multipart body (RFC 2046, 5.1.1) from p on
+ * Return:
+ *     where to look for the part after it, NULL - no more parts. Content-Type of the part (without CRLF) and its content.
+ */
+static const char* nextPart(const char* p, const char* end, const char* delimiter,
+                            const char*& type, size_t& typeLen, const char*& content, const char*& contentEnd) {
+  // Delimiter line
+  const char* d = findIn(p, end, delimiter);
+  if (d==NULL) {
+    return NULL;
+  }
+  p = d + strlen(delimiter);
+  if (p + 2 <= end && !strncmp(p, "--", 2)) {
+    return NULL;      // close delimiter
+  }
+  p = (const char*) memchr(p, '\n', end - p);
+  if (p==NULL) {
+    return NULL;
+  }
+  p++;
+
+  // Headers of the part
+  type = NULL;
+  typeLen = 0;
+  while (p < end && *p!='\r' && *p!='\n') {
+    const char* eol = (const char*) memchr(p, '\n', end - p);
+    if (eol==NULL) {
+      return NULL;
+    }
+    if (!strncasecmp(p, "Content-Type:", 13)) {
+      type = p + 13;
+      while (type < eol && isspace((unsigned char) *type)) {
+        type++;
+      }
+      typeLen = (eol > type && eol[-1]=='\r' ? eol - 1 : eol) - type;
+    }
+    p = eol + 1;
+  }
+  p += (p < end && *p=='\r') ? 2 : 1;
+  if (p > end) {
+    return NULL;
+  }
+
+  // Content: up to the CRLF before the next delimiter
+  content = p;
+  const char* next = findIn(p, end, delimiter);
+  contentEnd = next!=NULL ? next : end;
+  if (contentEnd > content && contentEnd[-1]=='\n') {
+    contentEnd--;
+  }
+  if (contentEnd > content && contentEnd[-1]=='\r') {
+    contentEnd--;
+  }
+  return next!=NULL ? next : end;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - -  PresenceTable  - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+PresenceTable::PresenceTable()
+  : urisDyn(NULL), urisSize(0), domainDyn(NULL), rlmiVersion(-1), statusRevision(0), watchedVersion(0),
+    newUrisDyn(NULL), newUrisSize(0), newUrisAlloc(0) {
+}
+
+PresenceTable::~PresenceTable() {
+  freeNull((void **) &urisDyn);
+  freeNull((void **) &newUrisDyn);
+  freeNull((void **) &domainDyn);
+}
+
+/* Description:
+ *     phonebook entries may be just numbers: "1234" and "sip:1234" become "sip:1234@<domain of the account>",
+ *     like ControlState::setRemoteNameUri() does before calling them
+ * Return:
+ *     false if the result doesn't fit
+ */
+bool PresenceTable::completeUri(const char* uri, char* out, size_t size) {
+  while (isspace((unsigned char) *uri)) {
+    uri++;
+  }
+  const char* scheme = !strncasecmp(uri, "sip:", 4) || !strncasecmp(uri, "sips:", 5) ? "" : "sip:";
+  int n;
+  if (strchr(uri, '@')!=NULL || domainDyn==NULL) {
+    n = snprintf(out, size, "%s%s", scheme, uri);
+  } else {
+    int user = strcspn(uri, ";?");
+    n = snprintf(out, size, "%s%.*s@%s%s", scheme, user, uri, domainDyn, uri + user);
+  }
+  return n > 0 && (size_t) n < size;
+}
+
+uint32_t PresenceTable::key(const char* uri) {
+  char full[MAX_URI_LENGTH+1];
+  return uri!=NULL && completeUri(uri, full, sizeof(full)) ? hashUri(full) : 0;
+}
+
+/* Description:
+ *     key of a complete URI in the table: "sip:Bob@Example.com;transport=tcp", "<sips:bob@example.com>" and
+ *     "pres:bob@example.com" (PIDF entity) are all the same contact
+ */
+uint32_t PresenceTable::hashUri(const char* uri) {
+  if (uri==NULL) {
+    return 0;
+  }
+  while (isspace((unsigned char) *uri) || *uri=='<') {
+    uri++;
+  }
+  if (!strncasecmp(uri, "sip:", 4)) {
+    uri += 4;
+  } else if (!strncasecmp(uri, "sips:", 5) || !strncasecmp(uri, "pres:", 5)) {
+    uri += 5;
+  }
+  char norm[MAX_URI_LENGTH+1];
+  size_t n = 0;
+  for (; *uri && !strchr(";?> \t\r\n", *uri); uri++) {
+    if (n >= MAX_URI_LENGTH) {
+      return 0;
+    }
+    norm[n++] = tolower((unsigned char) *uri);
+  }
+  if (!n) {
+    return 0;
+  }
+  norm[n] = '\0';
+  uint32_t key = hash_murmur(norm);
+  return key ? key : 1;
+}
+
+int PresenceTable::compareEntries(Entry* a, Entry* b) {
+  return a->key < b->key ? -1 : a->key > b->key ? 1 : 0;
+}
+
+int PresenceTable::find(uint32_t key) {
+  int lo = 0, hi = (int) entries.size() - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (entries[mid].key < key) {
+      lo = mid + 1;
+    } else if (entries[mid].key > key) {
+      hi = mid - 1;
+    } else {
+      return mid;
+    }
+  }
+  return -1;
+}
+
+PresenceTable::Status_t PresenceTable::status(uint32_t key) {
+  int i = key ? find(key) : -1;
+  return i >= 0 ? entries[i].status : UNKNOWN;
+}
+
+void PresenceTable::forget() {
+  bool changed = false;
+  for (size_t i=0; i<entries.size(); i++) {
+    changed |= entries[i].status!=UNKNOWN;
+    entries[i].status = UNKNOWN;
+  }
+  rlmiVersion = -1;
+  if (changed) {
+    statusRevision++;
+  }
+}
+
+bool PresenceTable::set(const char* uri, Status_t status) {
+  int i = find(hashUri(uri));         // entities and resources of the documents are complete URIs
+  if (i < 0) {
+    log_d("presence: %s is not watched", uri);
+    return false;
+  }
+  log_d("presence: %s -> %d", uri, status);
+  entries[i].status = status;
+  return true;
+}
+
+void PresenceTable::beginList(const char* accountUri) {
+  newEntries.purge();
+  newUrisSize = 0;
+
+  // Domain: host of the account URI, without port and parameters
+  freeNull((void **) &domainDyn);
+  const char* host = accountUri!=NULL ? strchr(accountUri, '@') : NULL;
+  if (host!=NULL) {
+    host++;
+    domainDyn = strndup(host, strcspn(host, ":;?> \t"));
+  }
+}
+
+void PresenceTable::watch(const char* uri) {
+  char full[MAX_URI_LENGTH+1];
+  if (uri==NULL || !completeUri(uri, full, sizeof(full)) || newEntries.size() >= MAX_CONTACTS || strpbrk(full, "\"<>&")) {
+    return;     // too long, too many, or can't be put into the XML of the SUBSCRIBE body as it is
+  }
+  uint32_t key = hashUri(full);
+  if (!key) {
+    return;
+  }
+  for (size_t i=0; i<newEntries.size(); i++) {
+    if (newEntries[i].key==key) {
+      return;
+    }
+  }
+  uri = full;
+  size_t len = strlen(uri) + 1;
+  if (newUrisSize + len > newUrisAlloc) {
+    size_t alloc = newUrisAlloc ? newUrisAlloc * 2 : 512;
+    while (alloc < newUrisSize + len) {
+      alloc *= 2;
+    }
+    char* tmp = (char*) extRealloc(newUrisDyn, alloc);
+    if (tmp==NULL) {
+      return;
+    }
+    newUrisDyn = tmp;
+    newUrisAlloc = alloc;
+  }
+  Entry e = { key, UNKNOWN };
+  if (newEntries.add(e)) {
+    memcpy(newUrisDyn + newUrisSize, uri, len);
+    newUrisSize += len;
+  }
+}
+
+void PresenceTable::endList() {
+  newEntries.sort(compareEntries);
+  bool changed = newEntries.size()!=entries.size();
+  for (size_t i=0; i<newEntries.size(); i++) {
+    int j = find(newEntries[i].key);
+    if (j >= 0) {
+      newEntries[i].status = entries[j].status;
+    }
+    changed |= j!=(int) i;
+  }
+
+  entries.purge();
+  if (newEntries.size()) {
+    entries.extend(&newEntries[0], newEntries.size());
+  }
+  freeNull((void **) &urisDyn);
+  urisDyn = newUrisDyn;
+  urisSize = newUrisSize;
+  newUrisDyn = NULL;
+  newUrisSize = newUrisAlloc = 0;
+  newEntries.clear();
+
+  if (changed) {
+    watchedVersion++;
+    statusRevision++;
+    log_i("presence: watching %d contacts", (int) entries.size());
+  }
+}
+
+const char* PresenceTable::firstUri() {
+  return urisSize ? urisDyn : NULL;
+}
+
+const char* PresenceTable::nextUri(const char* uri) {
+  uri += strlen(uri) + 1;
+  return uri < urisDyn + urisSize ? uri : NULL;
+}
+
+/* Description:
+ *     apply the body of a NOTIFY for the presence event package
+ */
+PresenceTable::Result_t PresenceTable::applyNotify(const char* contentType, const char* body, size_t len) {
+  if (contentType==NULL || body==NULL || !len) {
+    return IGNORED;       // e.g. the NOTIFY of a pending subscription
+  }
+  const char* end = body + len;
+  uint32_t before = 0;
+  for (size_t i=0; i<entries.size(); i++) {
+    before = before*31 + entries[i].status;
+  }
+
+  Result_t res = IGNORED;
+  if (typeIs(contentType, strlen(contentType), "application/pidf+xml")) {
+
+    // Single resource
+    if (applyPidf(body, end)) {
+      res = APPLIED;
+    }
+
+  } else if (typeIs(contentType, strlen(contentType), "multipart/related")) {
+
+    // Resource list: RLMI document, then a PIDF document for each resource with an active subscription
+    char delimiter[75] = "--";            // boundary is at most 70 characters (RFC 2046)
+    const char* b = strcasestr(contentType, "boundary=");
+    if (b==NULL) {
+      log_e("presence: no boundary");
+      return IGNORED;
+    }
+    b += 9;
+    char quote = *b=='"' ? *b++ : 0;
+    size_t n = 2;
+    while (*b && n < sizeof(delimiter) - 1 && (quote ? *b!=quote : (*b!=';' && !isspace((unsigned char) *b)))) {
+      delimiter[n++] = *b++;
+    }
+    delimiter[n] = '\0';
+
+    const char* type;
+    size_t typeLen;
+    const char* content;
+    const char* contentEnd;
+    bool rlmi = false;
+    for (const char* p = body; (p = nextPart(p, end, delimiter, type, typeLen, content, contentEnd))!=NULL; ) {
+      if (type!=NULL && typeIs(type, typeLen, "application/rlmi+xml")) {
+        bool fullState = false;
+        res = applyRlmi(content, contentEnd, fullState);
+        if (res==OUT_OF_SEQUENCE) {
+          return res;
+        }
+        rlmi = true;
+        break;
+      }
+    }
+    if (!rlmi) {
+      log_e("presence: no RLMI document");
+      return IGNORED;
+    }
+    for (const char* p = body; (p = nextPart(p, end, delimiter, type, typeLen, content, contentEnd))!=NULL; ) {
+      if (type!=NULL && typeIs(type, typeLen, "application/pidf+xml")) {
+        applyPidf(content, contentEnd);
+      }
+    }
+
+  } else {
+    log_d("presence: unknown body %s", contentType);
+  }
+
+  uint32_t after = 0;
+  for (size_t i=0; i<entries.size(); i++) {
+    after = after*31 + entries[i].status;
+  }
+  if (after!=before) {
+    statusRevision++;
+  }
+  return res;
+}
+
+/* Description:
+ *     check the version of an RLMI document; resources without an active subscription become UNKNOWN.
+ *     The full state starts from scratch: resources left out of it are not known anymore.
+ */
+PresenceTable::Result_t PresenceTable::applyRlmi(const char* doc, const char* end, bool& fullState) {
+  XmlTag tag;
+  char value[MAX_URI_LENGTH+1];
+  const char* p = nextTag(doc, end, tag);
+  if (p==NULL || !isTag(tag, "list") || !xmlAttribute(tag, "version", value, sizeof(value))) {
+    log_e("presence: bad RLMI document");
+    return IGNORED;
+  }
+  int32_t version = atoi(value);
+  fullState = xmlAttribute(tag, "fullState", value, sizeof(value)) && (!strcmp(value, "true") || !strcmp(value, "1"));
+  if (!fullState && (rlmiVersion < 0 || version!=rlmiVersion + 1)) {
+    log_d("presence: version %d after %d", version, rlmiVersion);
+    return OUT_OF_SEQUENCE;
+  }
+  rlmiVersion = version;
+  log_d("presence: RLMI version %d, %s state", version, fullState ? "full" : "partial");
+  if (fullState) {
+    for (size_t i=0; i<entries.size(); i++) {
+      entries[i].status = UNKNOWN;
+    }
+  }
+
+  // Resources: <resource uri="..."> <instance state="active" .../> </resource>
+  char uri[MAX_URI_LENGTH+1] = "";
+  bool active = false;
+  while ((p = nextTag(p, end, tag))!=NULL) {
+    if (isTag(tag, "resource")) {
+      if (!tag.closing) {
+        active = false;
+        if (!xmlAttribute(tag, "uri", uri, sizeof(uri))) {
+          *uri = '\0';
+        }
+      }
+      if ((tag.closing || tag.empty) && *uri) {
+        if (!active) {
+          set(uri, UNKNOWN);
+        }
+        *uri = '\0';
+      }
+    } else if (isTag(tag, "instance") && !tag.closing) {
+      active |= xmlAttribute(tag, "state", value, sizeof(value)) && !strcmp(value, "active");
+    }
+  }
+  return APPLIED;
+}
+
+/* Description:
+ *     status of a presentity from its PIDF document: basic status of the tuples, refined by RPID activities
+ *     (RFC 4480) - that's where the servers put "on the phone".
+ * Return:
+ *     whether the presentity is watched
+ */
+bool PresenceTable::applyPidf(const char* doc, const char* end) {
+  XmlTag tag;
+  char entity[MAX_URI_LENGTH+1] = "";
+  bool open = false, closed = false, busy = false, away = false;
+  for (const char* p = doc; (p = nextTag(p, end, tag))!=NULL; ) {
+    if (tag.closing) {
+      continue;
+    }
+    if (isTag(tag, "presence")) {
+      xmlAttribute(tag, "entity", entity, sizeof(entity));
+    } else if (isTag(tag, "basic") && !tag.empty) {
+      open |= xmlTextIs(p, end, "open");
+      closed |= xmlTextIs(p, end, "closed");
+    } else if (isTag(tag, "on-the-phone") || isTag(tag, "busy") || isTag(tag, "meeting")) {
+      busy = true;
+    } else if (isTag(tag, "away") || isTag(tag, "vacation") || isTag(tag, "sleeping")) {
+      away = true;
+    }
+  }
+  if (!*entity) {
+    log_e("presence: PIDF without entity");
+    return false;
+  }
+  return set(entity, open ? (busy ? BUSY : away ? AWAY : AVAILABLE) : closed ? OFFLINE : UNKNOWN);
+}
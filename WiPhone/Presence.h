@@ -0,0 +1,123 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <Arduino.h>
+#include "LinearArray.h"
+
+/* Description:
+ *     presence (RFC 3856) of the phonebook contacts, learned from the NOTIFYs of a single resource list subscription
+ *     that TinySIP keeps for all of them (RFC 4662, with the list in the SUBSCRIBE body as of RFC 5367).
+ *
+ *     A contact is a 32-bit hash of its normalized SIP URI and a status byte, sorted by hash: the phonebook menu looks
+ *     its items up by binary search on every redraw, without touching the phonebook file. The URIs themselves are
+ *     only kept (packed in one block) to be listed in the SUBSCRIBE body.
+ *
+ *     A NOTIFY body is either one PIDF document (RFC 3863) or multipart/related: an RLMI document (RFC 4662) followed
+ *     by the PIDF documents of its resources. A partial RLMI document (fullState="false") only lists the resources
+ *     that changed, and only those entries are updated. Its version must follow the last one applied; otherwise
+ *     nothing is applied and the subscription has to be refreshed to get the full state again.
+ *
+ *     Everything runs in the main loop (TinySIP writes, the GUI reads), so no locking is needed.
+ */
+class PresenceTable {
+public:
+
+  typedef enum Status : uint8_t {
+    UNKNOWN = 0,        // not reported (yet), or the subscription is gone
+    OFFLINE,
+    AVAILABLE,
+    AWAY,
+    BUSY,               // on the phone, in a meeting
+  } Status_t;
+
+  typedef enum Result {
+    APPLIED = 0,
+    IGNORED,            // not a presence document, or nothing we watch
+    OUT_OF_SEQUENCE,    // partial state that doesn't follow the last version applied
+  } Result_t;
+
+  static const uint16_t MAX_CONTACTS = 200;
+  static const size_t MAX_URI_LENGTH = 96;            // longer URIs are not watched
+
+  PresenceTable();
+  ~PresenceTable();
+
+  // Watched URIs: the whole list is given at once (see PhonebookApp::watchPresence())
+  void beginList(const char* accountUri);             // its domain completes the URIs without one ("sip:1234")
+  void watch(const char* uri);
+  void endList();                                     // contacts that stay keep their status
+  uint16_t size() {
+    return entries.size();
+  };
+  const char* firstUri();
+  const char* nextUri(const char* uri);               // NULL - no more
+
+  // Status
+  uint32_t key(const char* uri);                      // scheme, parameters and case don't matter; 0 - not a URI
+  Status_t status(uint32_t key);
+  Status_t status(const char* uri) {
+    return status(key(uri));
+  };
+  void forget();                                      // all back to UNKNOWN (subscription ended)
+
+  // NOTIFY
+  void newSubscription() {                            // the next RLMI document must carry the full state
+    rlmiVersion = -1;
+  };
+  Result_t applyNotify(const char* contentType, const char* body, size_t len);
+
+  // Changes: revision() - of any status, for redrawing; listVersion() - of the watched URIs, for resubscribing
+  uint32_t revision() {
+    return statusRevision;
+  };
+  uint32_t listVersion() {
+    return watchedVersion;
+  };
+
+protected:
+  struct Entry {
+    uint32_t key;
+    Status_t status;
+  };
+
+  LinearArray<Entry, LA_INTERNAL_RAM> entries;        // sorted by key
+  char* urisDyn;                                      // watched URIs (completed), each NUL-terminated
+  size_t urisSize;
+  char* domainDyn;                                    // of the account
+  int32_t rlmiVersion;                                // of the last RLMI document applied, -1 - none
+  uint32_t statusRevision;
+  uint32_t watchedVersion;
+
+  // List being built between beginList() and endList()
+  LinearArray<Entry, LA_INTERNAL_RAM> newEntries;
+  char* newUrisDyn;
+  size_t newUrisSize;
+  size_t newUrisAlloc;
+
+  int find(uint32_t key);                             // index in entries, -1 - not watched
+  bool completeUri(const char* uri, char* out, size_t size);
+  static uint32_t hashUri(const char* uri);
+  bool set(const char* uri, Status_t status);
+  Result_t applyRlmi(const char* doc, const char* end, bool& fullState);
+  bool applyPidf(const char* doc, const char* end);
+
+  static int compareEntries(Entry* a, Entry* b);
+};
+
+extern PresenceTable presence;
+
+#endif // PRESENCE_H
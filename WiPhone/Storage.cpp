@@ -16,6 +16,7 @@ governing permissions and limitations under the License.
 #include "Storage.h"
 #include "config.h"
 #include "helpers.h"
+#include "CallerId.h"
 
 // # # # # # # # # # # # # # # # # # # # # # # # # # # # #  PHONEBOOK CLASS  # # # # # # # # # # # # # # # # # # # # # # # # # # # #
 
@@ -151,17 +152,17 @@ unsigned int Phonebook::addRecord(PhonebookRecord* newRec) {
       if (rec) {
         // record at lastOff is "greater" than newRec
         // - move contents from lastOff by `len` bytes forward
-        for (int k = phonebookLen+len; k>=lastOff+len; k--) {
+        for (int k = phonebookLen+len; k>=lastOff+(int) len; k--) {
           phonebookDyn[k] = phonebookDyn[k-len];
         }
         // - serialize into the middle of phonebook (no need to NUL-terminate)
-        if (newRec->serialize(phonebookDyn + lastOff) == len) {
+        if (newRec->serialize(phonebookDyn + lastOff) == (int) len) {
           phonebookLen += len;
           newPos = pos;
         }
       } else {
         // insert new record at the end of phonebook
-        if (newRec->serialize(phonebookDyn + phonebookLen) == len) {
+        if (newRec->serialize(phonebookDyn + phonebookLen) == (int) len) {
           phonebookLen += len;
           phonebookDyn[phonebookLen] = '\0';
           newPos = pos;
@@ -214,7 +215,6 @@ bool Phonebook::removeRecord(unsigned int key) {
     }
 
     // Skip the record
-    unsigned int off0 = phonebookOff;
     if (this->next()) {
       // Copy the part after the record
       strncpy(copy + newLen, phonebookDyn + phonebookOff, phonebookLen - phonebookOff);
@@ -294,12 +294,8 @@ void Phonebook::show() {
 
 MessageData::MessageData(NanoIni::Section& message) : NanoIni::Section(message) {}
 
-MessageData::MessageData(NanoIni::Section& message, int partn) : NanoIni::Section(message) {
-  (*this)["p"] = partn;
-}
-
 MessageData::MessageData(const char* fromUri, const char* toUri, const char* text, uint32_t time, bool incoming)
-  : NanoIni::Section() {
+  : NanoIni::Section(), incoming(incoming) {
   // NOTE: similar code is in Messages::saveMessage
   this->putValueFullHex("t", time);
   if (fromUri) {
@@ -343,167 +339,70 @@ unsigned long MessageData::getAckTime() {
   return this->ackTime;
 }
 
-Messages::Messages()
-  : index(indexFile) {
+Messages::Messages() {
+  preloadedIncoming = INCOMING;
   preloadedRangeStart = 0;
   preloadedRangeEnd = 0;
+  preloadedPages[0] = preloadedPages[1] = -1;
+  prefetchPages[0] = prefetchPages[1] = -1;
+  memset(&lastSearch, 0, sizeof(lastSearch));
 };
 
-bool Messages::load(uint32_t unixTime) {
-  // TODO: make sure not to mess things up with unixTime if it is zero
-
-  // Load index file
-  this->loaded = false;
-  if (index.load() && !index.isEmpty()) {
-    // Check version of the file format
-    if (index[0].hasKey("v") && !strcmp(index[0]["v"], "1")) {
-      log_v("Messages index found");
-      IF_LOG(VERBOSE)
-      index.show();
-      this->loaded = true;
-    } else {
-      log_e("Messages index file corrup or unknown format");
-      IF_LOG(VERBOSE)
-      index.show();
-      return false;
-    }
-  } else {
-    log_d("creating Messages index file");
-    index[0]["desc"] = "WiPhone messages index";
-    index[0]["v"] = "1";
-    index.store();
-    this->loaded = true;
-  }
-
-  // Check correctness
-
-  bool removePart = false;
-  bool indexUpdated = false;
-  bool defDirToggle = false;      // used to initialize empty partitions
-  for (auto ipart = index.iterator(1); ipart.valid(); ++ipart) {       // traverse all partitions
-
-    // TODO: mark old empty partitions for deletion
-
-    // Ensure that all partitions have message count
-    int32_t n = ipart->getIntValueSafe("n", -1);
-    if (n < 0) {
-      // No message count: load the partition file
-      IniFile ini;
-      if (this->loadPartition(ini, ipart->getIntValueSafe("p", -1)) && !ini.isEmpty()) {
-        // Updage message count in the index
-        n = ini.nSections() - 1;
-        (*ipart)["n"] = n;
-        log_v("messages found: %d, partition: %s", n, (*ipart).getValueSafe("p", ""));
-        ini.store();
-        indexUpdated = true;
-      } else {
-        if (!ini.isLoaded()) {
-          log_e("partition %s not found", ipart->getValueSafe("p", "\"\""));
-          (*ipart)["remove"] = "1";   // TODO
-          removePart = true;
-        } else {
-          log_e("partition %s is empty", ipart->getValueSafe("p", "\"\""));
-        }
-      }
-    }
+Messages::~Messages() {
+  this->unload();
+}
 
-    // Ensure that all partitions have time fields in the index
-    if (!ipart->hasKey("t1") || !ipart->hasKey("t2")) {
-      if (ipart->hasKey("t2")) {
-        log_d("t2 present, but not t1");
-      } else if (ipart->hasKey("t2")) {
-        log_d("t1 present, but not t2");
-      } else {
-        log_d("t1 & t2 absent");
-      }
-      // Load partition file, find min/max time, update
-      IniFile ini;
-      if (this->loadPartition(ini, ipart->getIntValueSafe("p", -1)) && ini.nSections() > 1) {
-        if (!(ini[0].hasKey("t1") && ini[0].hasKey("t2"))) {
-          // Traverse all messages to find min/max time
-          const char* t1 = NULL;
-          const char* t2 = NULL;
-          for (auto im = ini.iterator(1); im.valid(); ++im) {
-            const char* t = im->getValueSafe("t", NULL);
-            if (!t) {
-              // this message has no time -> set to current minute
-              im->putValueFullHex("t", unixTime);
-              t = im->getValueSafe("t", NULL);
-            } else if (strlen(t)<8) {
-              // this value must have been modified by a human -> align
-              char buff[9];
-              memset(buff, '0', sizeof(buff)-1);
-              buff[8] = '\0';
-              strcpy(buff + 8 - strlen(t), t);
-              (*im)["t"] = buff;
-            }
-            // Find minimum
-            t1 = (t1 && strncasecmp(t, t1, 8) < 0 || !t1) ? t : t1;
-            // Find maximum
-            t2 = (t2 && strncasecmp(t, t2, 8) > 0 || !t2) ? t : t2;
-          }
-          // Update partition time range
-          if (t1 && t2) {
-            ini[0]["t1"] = t1;
-            ini[0]["t2"] = t2;
-            ini.store();
-          }
-        }
-      } else if (ini.isLoaded()) {
-        // if partition file is empty for some reason (should not happen) -> assign it current time (as it must be a "lost" new partition)
-        if (ini.isEmpty() || !ini[0].hasKey("v") && !ini[0].hasKey("desc")) {
-          // if we are here, something is either terribly wrong and/or files were edited by a user
-          if (ini.isEmpty()) {
-            ini.addSection();
-          } else {
-            ini[0].remove(nullptr);  // remove values with empty key
-          }
-          log_e("initializing partiton");
-          ini[0]["desc"] = "WiPhone messages partition";
-          ini[0]["v"] = "1";
-          ini[0]["d"] = ipart->getValueSafe("d", (defDirToggle = !defDirToggle) ? "i" : "o");
-        }
-        log_e("partiton file has no messages");
-        ini[0].putValueFullHex("t1", unixTime);
-        ini[0]["t2"] = ini[0]["t1"];
-        if (!ini[0].hasKey("p") && ipart->hasKey("p")) {
-          ini[0]["p"] = (*ipart)["p"];
-        }
-        ini.store();
-      } else {
-        // Partition file does not exist and shoud be deleted from the index
-        (*ipart)["remove"] = "1";
-        removePart = true;
+/* Description:
+ *     open the messages database (creating it, or migrating the INI partitions of older firmware, if needed) and
+ *     load its index into RAM.
+ */
+bool Messages::load(uint32_t unixTime) {
+  this->unload();
+
+  // Compaction interrupted after the old log was removed
+  if (!SPIFFS.exists(logFile) && SPIFFS.exists(logTmpFile)) {
+    log_e("restoring compacted messages log");
+    replaceCompacted();
+  }
+  SPIFFS.remove(logTmpFile);
+  SPIFFS.remove(indexTmpFile);
+  SPIFFS.remove(conversationsTmpFile);
+
+  // Migration not finished: start it over
+  if (SPIFFS.exists(oldIndexFile)) {
+    SPIFFS.remove(logFile);
+    SPIFFS.remove(indexFile);
+  }
+
+  if (!SPIFFS.exists(logFile)) {
+    SPIFFS.remove(conversationsFile);
+    SPIFFS.remove(filtersFile);
+    if (SPIFFS.exists(oldIndexFile)) {
+      if (!this->migrate(unixTime)) {
+        log_e("failed to migrate messages");
+        SPIFFS.remove(logFile);
+        SPIFFS.remove(indexFile);
+        return false;
       }
-
-      // Update index
-      log_d("updating index");
-      (*ipart)["t1"] = ini[0].getValueSafe("t1", "386d4380");      // default = 2000-01-01
-      (*ipart)["t2"] = ini[0].getValueSafe("t2", "386d4380");
-      indexUpdated = true;
+    } else if (!this->create()) {
+      return false;
     }
+  } else if (!this->open()) {
+    return false;
   }
-  if (indexUpdated || removePart) {
-    if (removePart) {
-      for (int32_t i = 1; i < index.nSections();) {       // traverse all partitions
-        if (index[i].hasKey("remove")) {
-          log_e("removing partition %d from index", i);
-          index.removeSection(i);
-        } else {
-          i++;
-        }
-      }
-    }
-    index.store();
+  if (SPIFFS.exists(oldIndexDoneFile)) {
+    removeOldPartitions();
   }
 
-  // Sort partitions by time in descending order
-  log_v("sorting index");
-  index.sortFrom(1, Storage::messagePartitionCompare);
-
-  IF_LOG(VERBOSE)
-  index.show();
+  this->buildViews();
+  this->loadConversations();
+  this->loadFilters();
+  this->loaded = true;
+  log_d("messages: %d incoming (%d unread), %d sent, %d deleted", (int) inbox.size(), unreadCount, (int) sent.size(), deletedCount);
 
+  if (deletedCount >= COMPACT_MIN_DELETED && deletedCount * 4 >= (int32_t) entries.size()) {
+    this->compact();
+  }
   return true;
 }
 
@@ -511,568 +410,1535 @@ bool Messages::load(uint32_t unixTime) {
  *     clear messages data from cache (and, as a consequence, free memory currently occupied by cache)
  */
 void Messages::unload() {
+  this->clearCache();
   this->clearPreloaded();
-  this->index.unload();
-  if (this->part1.isLoaded()) {
-    this->part1.unload();
-  }
-  if (this->part2.isLoaded()) {
-    this->part2.unload();
-  }
+  this->clearConversations();
+  this->clearFilters();
+  found.clear();
+  entries.clear();
+  inbox.clear();
+  sent.clear();
+  logSize = 0;
+  logUnsynced = false;
+  unreadCount = 0;
+  deletedCount = 0;
+  this->loaded = false;
 }
 
 int32_t Messages::inboxTotalSize() {
-  return this->countAll(INCOMING);
+  return this->inbox.size();
 }
 
 int32_t Messages::sentTotalSize() {
-  return this->countAll(SENT);
+  return this->sent.size();
 }
 
-/*
- * Description:
- *     Return current count of incoming/sent messages.
- *     If no such number is recorded in the database, parse partition files one-by-one if necessary.
+/* Description:
+ *     forget the window of preloaded messages. The messages stay in the cache.
  */
-int32_t Messages::countAll(bool incoming) {
-  int32_t cnt = 0;
-  bool indexChange = false;
-  for (auto ipart = index.iterator(1); ipart.valid(); ++ipart) {
-    if (!ipart->hasKey("d")) {
-      log_e("partition description without `d` key %d", (int32_t)ipart);
-      continue;
-    }
-    if (strcmp(ipart->getValueSafe("d",""), incoming ? "i" : "o")) {
-      continue;
-    }
-    int32_t n = ipart->getIntValueSafe("n", -1);
-    if (n>=0) {
-      cnt += n;  // avoid negative count at all cost
-    }
-  }
-  return cnt;
-}
-
 void Messages::clearPreloaded() {
   log_v("clearing preloaded");
-  for (auto it = preloaded.iterator(); it.valid(); ++it)
-    if (*it != nullptr) {
-      delete (*it);
-    }
+  for (auto it = uncached.iterator(); it.valid(); ++it) {
+    delete (*it);
+  }
+  uncached.clear();
   preloaded.clear();      // frees memory
   this->preloadedRangeStart = this->preloadedRangeEnd = 0;
+  this->preloadedPages[0] = this->preloadedPages[1] = -1;
 }
 
 /*
  * Description:
- *     Resolve up to two partitions and make sure `count` of messages from position `offset` are pre-loaded
- *     to an in-memory NanoIni structure (`MessagesArray preloaded`).
+ *     Make sure `count` of messages from position `offset` are pre-loaded from the log to an in-memory NanoIni structure
+ *     (`MessagesArray preloaded`). Messages are read a page at a time and cached, so that scrolling back and forth
+ *     reads the log only for the pages not seen recently; the pages next to the window are read ahead by prefetch().
  * Parameters:
- *     This method accepts negative offsets (in Python style).
+ *     This method accepts negative offsets (in Python style): -1 is the newest message, 0 is the oldest one.
+ *     Negative offsets go from the newest messages to older ones, non-negative ones from the oldest to newer ones.
  * Return:
- *     Number of messages actually preloaded (in addition to those, that happened to be preloaded already).
+ *     Number of messages actually read from the log (the others were cached already).
  */
 int32_t Messages::preload(bool incoming, int32_t offset, int32_t count) {
-  log_i("incoming? %d / offset: %d / count: %d / range: %d..%d", incoming, offset, count, preloadedRangeStart, preloadedRangeEnd);
-
-  if (incoming != preloadedIncoming || preloadedRangeStart == preloadedRangeEnd ||
-      ((offset >= 0) ? (offset < preloadedRangeStart || offset > preloadedRangeEnd) : (offset > preloadedRangeStart || offset < preloadedRangeEnd))) {
-    // Range needs to be reloaded entirely
-    this->clearPreloaded();
-    this->preloadedRangeStart = this->preloadedRangeEnd = offset;
-    this->preloadedIncoming = incoming;
-  } else {
-    // Partially loaded already?
-    int32_t diff = this->preloadedRangeEnd - offset;
-    offset += diff;
-    if (offset < 0) {
-      diff = -diff;
+  log_i("incoming? %d / offset: %d / count: %d", incoming, offset, count);
+
+  this->clearPreloaded();
+  this->preloadedRangeStart = this->preloadedRangeEnd = offset;
+  this->preloadedIncoming = incoming;
+
+  // Position in the view (sorted from the oldest to the newest message)
+  MessagesView& view = incoming ? inbox : sent;
+  int32_t step = (offset < 0) ? -1 : 1;
+  int32_t pos = (offset < 0) ? (int32_t) view.size() + offset : offset;
+  if (pos < 0 || pos >= (int32_t) view.size()) {
+    log_d("nothing to load");
+    return 0;
+  }
+
+  cacheClock++;
+  preloaded.ensure(count);
+  File log;
+  int32_t nRead = 0;
+  int32_t first = pos;
+  for (; pos >= 0 && pos < (int32_t) view.size() && (int32_t) preloaded.size() < count; pos += step) {
+    int32_t page = pos / PAGE_SIZE;
+    CachedPage* cached = this->findPage(incoming, page);
+    if (cached == NULL) {
+      if (!log && !(log = SPIFFS.open(logFile, FILE_READ))) {
+        log_e("could not open messages log");
+        break;
+      }
+      if ((cached = this->loadPage(log, incoming, page)) == NULL) {
+        break;
+      }
+      nRead += cached->count;
     }
-    count -= diff;
-    if (count <= 0) {
-      log_v("range fully loaded already");
-      return 0;   // fully loaded already
+    cached->lastUse = cacheClock;
+    if (pos - page * PAGE_SIZE >= cached->count) {
+      break;      // corrupt record
     }
+    preloaded.add(cached->messages[pos - page * PAGE_SIZE]);      // index == abs(preloadedRangeEnd - preloadedRangeStart)
+    preloadedRangeEnd += step;
+  }
+  log.close();
+
+  if (preloaded.size() > 0) {
+    int32_t last = first + step * ((int32_t) preloaded.size() - 1);
+    preloadedPages[0] = (first < last ? first : last) / PAGE_SIZE;
+    preloadedPages[1] = (first < last ? last : first) / PAGE_SIZE;
+
+    // Read ahead the next page in the direction of the offsets first, then the one before the window
+    int32_t ahead = step > 0 ? preloadedPages[1] + 1 : preloadedPages[0] - 1;
+    int32_t behind = step > 0 ? preloadedPages[0] - 1 : preloadedPages[1] + 1;
+    prefetchPages[0] = ahead >= 0 && ahead * PAGE_SIZE < (int32_t) view.size() ? ahead : -1;
+    prefetchPages[1] = behind >= 0 && behind * PAGE_SIZE < (int32_t) view.size() ? behind : -1;
+  }
+  this->evict();
+  log_i("preloaded: %d (%d read), from: %d, to: %d, cache: %d pages, %d bytes",
+        (int) preloaded.size(), nRead, preloadedRangeStart, preloadedRangeEnd, (int) cache.size(), (int) cacheBytes);
+  return nRead;
+}
+
+/* Description:
+ *     read one of the pages next to the last preloaded window into the cache, if it is not there yet.
+ *     Meant to be called while idle (e.g. between key presses), so that scrolling doesn't wait for the log.
+ * Return:
+ *     true if a page was read, false if there is nothing left to read ahead
+ */
+bool Messages::prefetch() {
+  if (!this->loaded) {
+    return false;
   }
+  MessagesView& view = preloadedIncoming ? inbox : sent;
+  for (int i = 0; i < 2; i++) {
+    int32_t page = prefetchPages[i];
+    prefetchPages[i] = -1;
+    if (page < 0 || page * PAGE_SIZE >= (int32_t) view.size() || this->findPage(preloadedIncoming, page) != NULL) {
+      continue;
+    }
+    File log = SPIFFS.open(logFile, FILE_READ);
+    if (!log) {
+      log_e("could not open messages log");
+      return false;
+    }
+    CachedPage* cached = this->loadPage(log, preloadedIncoming, page);
+    log.close();
+    if (cached != NULL) {
+      cached->lastUse = cacheClock;
+      this->evict();
+      log_v("prefetched page %d: %d messages", page, cached->count);
+    }
+    return true;
+  }
+  return false;
+}
+
+void Messages::setCacheBudget(size_t bytes) {
+  cacheBudget = bytes;
+  this->evict();
+}
+
+/* Description:
+ *     store message in the message database: one record appended to the log, one entry to the index.
+ * Return:
+ *     hash of the message text.
+ */
+Messages::hash_t Messages::saveMessage(const char* text, const char* fromUri, const char* toUri,
+                                       bool incoming, unsigned long time, unsigned long ackTime) {
+  log_v("saving message to %s, time = %d, d = %c", toUri ? toUri : "nil", (int) time, incoming ? 'i' : 'o');
 
-  // Load needed partitions
-  if (offset >= 0) {
-    // currently this assumes that offset is negative (we are counting from the end)
-    log_e("positive offsets not implemented");
+  if (!time) {
+    time--;  // store 0xFFFFFFFF insted of 0x00000000 so that sorting is still correct
+  }
+  // After a failed append the log is read again from flash: a record written only partly is cut off, one whose index
+  // entry failed is indexed. Nothing is appended until that succeeds.
+  if ((!this->loaded || this->logUnsynced) && !this->load(0)) {
+    log_e("no messages database to store");
     return 0;
   }
-  int32_t skip = -offset - 1;         // how many message to skip in the database? offset == -1 -> 0, -2 -> 1, ...
-  int32_t skipFirst = 0;              // how many messages to skip in the first partition?
-  bool firstPartFound = false;
-  for (auto ipart = index.iterator(1); ipart.valid(); ++ipart) {      // traverse index for partitions
-    ipart->show();
-    // Choose partitions according to `incoming`
-    log_d("d=%s", ipart->getValueSafe("d",""));
-    if (strcmp(ipart->getValueSafe("d",""), incoming ? "i" : "o")) {
-      continue;
+
+  File log = SPIFFS.open(logFile, FILE_APPEND);
+  File idx = SPIFFS.open(indexFile, FILE_APPEND);
+  bool ok = log && idx && this->append(log, idx, incoming ? toUri : fromUri, incoming ? fromUri : toUri, text,
+                                       time, ackTime, incoming ? (FLAG_INCOMING | FLAG_UNREAD) : 0);
+  log.close();
+  idx.close();
+  if (!ok) {
+    log_e("failed to save message");
+    return 0;
+  }
+
+  // Conversation (if the file fails to be appended, the entry is added from the log on the next load)
+  uint32_t record = entries.size() - 1;
+  if (recordConversation.size() == record) {
+    char key[MAX_CONVERSATION_KEY + 1];
+    conversationKey(incoming ? fromUri : toUri, key);
+    if (this->addToConversation(record, key)) {
+      File conv = SPIFFS.open(conversationsFile, FILE_APPEND);
+      if (!conv || !this->writeConversations(conv, record, record + 1)) {
+        log_e("failed to append to messages conversations");
+      }
+      conv.close();
     }
+  }
 
-    // Get number of messages in the partition
-    log_d("number of messages n=%s, skip=%d", ipart->getValueSafe("n",""), skip);
-    int32_t n = ipart->getIntValueSafe("n", 0);
+  // Search filter of the last segment (if it fails to be written, the record is added from the log on the next load)
+  if (filteredRecords == record && this->addToFilter(record, text)) {
+    this->writeFilters(record / SEGMENT_RECORDS);
+  }
 
-    if (skip < n && !firstPartFound) {
-      // First partition located
-      skipFirst = skip;
-      int32_t partn = ipart->getIntValueSafe("p", -1);
-      log_v("located first partition %d", partn);
-      firstPartFound = true;
-      if (partn < 0) {
-        log_e("illegal partition number: %s", ipart->getValueSafe("p", ""));
-      } else if (!part1.isLoaded() || part1.isEmpty() || part1[0].getIntValueSafe("p", -2) != partn) {
-        this->loadPartition(this->part1, partn);
-        // If we reloaded first partition, second partition must be also irrelevand if it's loaded
-        part2.unload();
-        if (skip + count <= n) {
-          log_v("only one partition needed");
-          break;   // no need to load next partition
+  // Insert into the view: messages mostly come in order, so this is usually the end
+  ViewItem item = { entries[record].time, record };
+  MessagesView& view = incoming ? inbox : sent;
+  int32_t pos = view.size();
+  while (pos > 0 && viewCompare(&view[pos-1], &item) > 0) {
+    pos--;
+  }
+  view.insert(pos, item);
+  this->dropPages(incoming, pos / PAGE_SIZE);     // positions from `pos` on have moved
+  if (incoming) {
+    unreadCount++;
+  }
+  return entries[record].hash;
+}
+
+/* Description:
+ *      take negative message offset (global message offset in the database), find the message in the cache (`preloaded` array)
+ *      and pass it for deletion.
+ */
+bool Messages::deleteMessage(int32_t messageOffset) {
+  log_i("messageOffset = %d", messageOffset);
+  int32_t i = (messageOffset - preloadedRangeStart) * (preloadedRangeStart < 0 ? -1 : 1);
+  if (i < 0 || i >= (int32_t) preloaded.size()) {
+    log_e("wrong message offset %d, not in |%d..%d>", messageOffset, preloadedRangeStart, preloadedRangeEnd);
+    return false;
+  }
+  log_v("delete: preloaded[%d]", i);
+  return this->deleteMessage(*preloaded[i]);
+}
+
+/* Description:
+ *     mark the message deleted in the index. Compact the log if enough of it is deleted.
+ *     NOTE: this clears the preloaded messages (including `msg`).
+ * Return:
+ *     true on success
+ */
+bool Messages::deleteMessage(MessageData& msg) {
+  log_i("deleting message");
+  IF_LOG(VERBOSE)
+  msg.show();
+
+  uint32_t record = msg.record;
+  if (!this->loaded || msg.record < 0 || record >= entries.size() || (entries[record].flags & FLAG_DELETED)) {
+    log_e("message not found: %d", msg.record);
+    return false;
+  }
+
+  IndexEntry& entry = entries[record];
+  uint8_t flags = entry.flags;
+  entry.flags |= FLAG_DELETED;
+  if (!this->writeEntry(record)) {
+    entry.flags = flags;
+    return false;
+  }
+  if (flags & FLAG_UNREAD) {
+    unreadCount--;
+  }
+  this->removeFromConversation(record, flags & FLAG_UNREAD);
+  for (size_t i = 0; i < found.size(); i++) {
+    if (found[i] == record) {
+      found.remove(i);
+      break;
+    }
+  }
+  bool incoming = entry.flags & FLAG_INCOMING;
+  int32_t pos = this->findInView(incoming ? inbox : sent, entry.time, record);
+  this->removeFromView(record);
+  this->dropPages(incoming, pos / PAGE_SIZE);     // positions from `pos` on have moved
+  deletedCount++;
+
+  if (deletedCount >= COMPACT_MIN_DELETED && deletedCount * 4 >= (int32_t) entries.size()) {
+    this->compact();
+  } else {
+    this->clearPreloaded();     // offsets after the deleted message have changed
+  }
+  return true;
+}
+
+void Messages::setRead(MessageData& msg) {
+  if (!msg.hasKey("u")) {
+    log_e("message already read");
+    return;
+  }
+
+  // Change "read" state in the preloaded array
+  msg.setRead();
+
+  // Change the flags in the index
+  uint32_t record = msg.record;
+  if (this->loaded && msg.record >= 0 && record < entries.size() && (entries[record].flags & FLAG_UNREAD)) {
+    entries[record].flags &= ~FLAG_UNREAD;
+    unreadCount--;
+    if (record < recordConversation.size()) {
+      conversations[recordConversation[record]].unread--;
+    }
+    this->writeEntry(record);
+
+    // The same message in the cache (if it was read in a conversation)
+    for (size_t i = 0; i < cache.size(); i++) {
+      for (int32_t k = 0; k < cache[i]->count; k++) {
+        if (cache[i]->messages[k] != &msg && cache[i]->messages[k]->record == msg.record) {
+          cache[i]->messages[k]->setRead();
         }
       }
-    } else if (firstPartFound) {
-      // Second partition directly follows first partition (if it is non-empty)
-      if (n <= 0) {
-        continue;
-      }
-      int32_t partn = ipart->getIntValueSafe("p", -1);
-      log_v("located second partition %d", partn);
-      if (partn < 0) {
-        log_e("illegal partition number: %s", ipart->getValueSafe("p", ""));
-      } else if (!part2.isLoaded() || part2.isEmpty() || part2[0].getIntValueSafe("p", -2) != partn) {
-        this->loadPartition(part2, partn);
+    }
+  } else {
+    log_e("message not found");
+  }
+}
+
+/* Description:
+ *     mark a sent message as delivered. `msg` is a copy of it (e.g. from the outbox): it is found by its time and text.
+ */
+void Messages::setSent(MessageData& msg) {
+  if (!this->loaded) {
+    return;
+  }
+  uint32_t time = msg.getTime() ? msg.getTime() : 0xFFFFFFFF;     // as stored by saveMessage()
+  int32_t record = this->findMessage(SENT, time, hash_murmur(msg.getMessageText()));
+  if (record < 0) {
+    log_d("sent message not found");
+    return;
+  }
+  if (!(entries[record].flags & FLAG_DELIVERED)) {
+    entries[record].flags |= FLAG_DELIVERED;
+    this->writeEntry(record);
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  Messages: files  - - - - - - - - - - - - - - - - - - - - -
+
+bool Messages::writeHeader(File& file, const char* magic, uint16_t entrySize) {
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, magic, sizeof(header.magic));
+  header.version = 1;
+  header.entrySize = entrySize;
+  return file.write((const uint8_t*) &header, sizeof(header)) == sizeof(header);
+}
+
+bool Messages::checkHeader(File& file, const char* magic, uint16_t entrySize) {
+  FileHeader header;
+  return file.read((uint8_t*) &header, sizeof(header)) == sizeof(header) && !memcmp(header.magic, magic, sizeof(header.magic)) &&
+         header.version == 1 && header.entrySize == entrySize;
+}
+
+/* Description:
+ *     create an empty database.
+ */
+bool Messages::create() {
+  log_d("creating messages log");
+  File log = SPIFFS.open(logFile, FILE_WRITE);
+  File idx = SPIFFS.open(indexFile, FILE_WRITE);
+  bool ok = log && idx && writeHeader(log, "WMLG", 0) && writeHeader(idx, "WMIX", sizeof(IndexEntry));
+  log.close();
+  idx.close();
+  if (!ok) {
+    log_e("failed to create messages log");
+    return false;
+  }
+  logSize = sizeof(FileHeader);
+  return true;
+}
+
+/* Description:
+ *     load the index into RAM. Rebuild it from the log, entirely or only the records it misses.
+ */
+bool Messages::open() {
+  File log = SPIFFS.open(logFile, FILE_READ);
+  if (!log || !checkHeader(log, "WMLG", 0)) {
+    log_e("messages log corrupt or unknown format");
+    return false;
+  }
+  logSize = log.size();
+  log.close();
+
+  File idx = SPIFFS.open(indexFile, FILE_READ);
+  bool valid = idx && checkHeader(idx, "WMIX", sizeof(IndexEntry));
+  bool partial = false;
+  if (valid) {
+    // Read entire index into the external RAM
+    size_t n = (idx.size() - sizeof(FileHeader)) / sizeof(IndexEntry);
+    partial = (idx.size() - sizeof(FileHeader)) % sizeof(IndexEntry) != 0;
+    entries.ensure(n);
+    IndexEntry buff[32];
+    while (entries.size() < n) {
+      size_t cnt = n - entries.size() < 32 ? n - entries.size() : 32;
+      if (idx.read((uint8_t*) buff, cnt * sizeof(IndexEntry)) != cnt * sizeof(IndexEntry)) {
+        break;
       }
-      break;
+      entries.extend(buff, cnt);
     }
-    skip -= n;
   }
-  if (!firstPartFound) {
-    log_d("nothing to load");
-    return 0;
+  idx.close();
+
+  // Entries past the end of the log (should not happen): drop them and rewrite the index from the log
+  uint32_t end = sizeof(FileHeader);
+  if (valid && entries.size()) {
+    IndexEntry& last = entries[entries.size()-1];
+    end = last.offset + last.length;
+    if (end > logSize) {
+      log_e("messages index is ahead of the log");
+      valid = false;
+    }
   }
-  if (!part1.isLoaded() || part1.isEmpty()) {
-    log_e("part1 not loaded or empty");
-    return 0;
+  if (!valid) {
+    log_e("rebuilding messages index");
+    entries.purge();
+    idx = SPIFFS.open(indexFile, FILE_WRITE);
+    bool ok = idx && writeHeader(idx, "WMIX", sizeof(IndexEntry));
+    idx.close();
+    if (!ok) {
+      return false;
+    }
+    end = sizeof(FileHeader);
+  } else if (partial) {
+    // Entry cut short by a power loss: the next ones would be appended after it, so the index is written anew
+    log_e("messages index ends with a partial entry");
+    idx = SPIFFS.open(indexFile, FILE_WRITE);
+    bool ok = idx && writeHeader(idx, "WMIX", sizeof(IndexEntry));
+    for (size_t i = 0; ok && i < entries.size(); i += 32) {
+      size_t cnt = entries.size() - i < 32 ? entries.size() - i : 32;
+      ok = idx.write((const uint8_t*) &entries[i], cnt * sizeof(IndexEntry)) == cnt * sizeof(IndexEntry);
+    }
+    idx.close();
+    if (!ok) {
+      return false;
+    }
   }
+  return end >= logSize || this->recover(end);
+}
 
-  // Preload messages from the located partition(s)
-  preloaded.ensure(abs(preloadedRangeEnd - preloadedRangeStart) + count);
-  int32_t cnt = 0;
-  log_d("loading from part1 %d", skipFirst);
-  int partn = part1[0].getIntValueSafe("p", -1);
-  for (auto im = part1.iterator(1+skipFirst); im.valid() && cnt < count; ++im) {
-    // WARNING: repeating code below
-    preloaded.add(new MessageData(*im, partn));      // index == abs(preloadedRangeEnd - preloadedRangeStart)
-    preloadedRangeEnd += (offset < 0) ? -1 : 1;
-    cnt++;
+/* Description:
+ *     index the records of the log starting at offset `from` (typically: the last message before the power was lost).
+ *     A truncated record at the end of the log is cut off.
+ */
+bool Messages::recover(uint32_t from) {
+  log_e("indexing messages log from %d of %d bytes", from, logSize);
+  File log = SPIFFS.open(logFile, FILE_READ);
+  File idx = SPIFFS.open(indexFile, FILE_APPEND);
+  if (!log || !idx) {
+    return false;
   }
-  if (part2.isLoaded() && cnt < count) {
-    partn = part1[0].getIntValueSafe("p", -1);
-    log_d("loading from part2");
-    for (auto im = part2.iterator(1); im.valid() && cnt < count; ++im) {
-      // WARNING: repeating code from above
-      preloaded.add(new MessageData(*im, partn));
-      preloadedRangeEnd += (offset < 0) ? -1 : 1;
-      cnt++;
+  char* textDyn = NULL;
+  uint32_t off = from;
+  while (off + sizeof(RecordHeader) <= logSize) {
+    RecordHeader rec;
+    log.seek(off);
+    if (log.read((uint8_t*) &rec, sizeof(rec)) != sizeof(rec) || rec.marker != RECORD_MARKER) {
+      break;
+    }
+    uint32_t len = sizeof(rec) + rec.ownLen + rec.otherLen + rec.textLen;
+    if (len > MAX_RECORD_SIZE || off + len > logSize) {
+      break;
+    }
+    IndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.time = rec.time;
+    entry.offset = off;
+    entry.length = len;
+    entry.flags = rec.flags & ~FLAG_DELETED;
+    textDyn = (char*) extRealloc(textDyn, rec.textLen + 1);
+    if (!textDyn) {
+      break;
     }
+    log.seek(off + sizeof(rec) + rec.ownLen + rec.otherLen);
+    log.read((uint8_t*) textDyn, rec.textLen);
+    textDyn[rec.textLen] = '\0';
+    entry.hash = hash_murmur(textDyn);
+    if (idx.write((const uint8_t*) &entry, sizeof(entry)) != sizeof(entry) || !entries.add(entry)) {
+      break;
+    }
+    off += len;
+  }
+  freeNull((void **) &textDyn);
+  log.close();
+  idx.close();
+  if (off < logSize) {
+    // The rest can't be parsed: the next message must not be appended after it
+    log_e("messages log: %d bytes lost", logSize - off);
+    return this->compact();
   }
-  log_i("preloaded: %d, from: %d, to: %d", cnt, preloadedRangeStart, preloadedRangeEnd);
-  return cnt;
+  return true;
 }
 
-bool Messages::loadPartition(IniFile& ini, int32_t part) {
-  log_d("loadPartition %d", part);
-  if (part < 0) {
-    log_e("invalid partition number: %d", part);
+/* Description:
+ *     append a record to the log and its entry to the index (both files are open for appending).
+ */
+bool Messages::append(File& log, File& idx, const char* ownUri, const char* otherUri, const char* text,
+                      uint32_t time, uint32_t ackTime, uint8_t flags) {
+  if (!ownUri) {
+    ownUri = "";
+  }
+  if (!otherUri) {
+    otherUri = "";
+  }
+  if (!text) {
+    text = "";
+  }
+  RecordHeader rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.marker = RECORD_MARKER;
+  rec.flags = flags;
+  rec.time = time;
+  rec.ackTime = ackTime;
+  rec.ownLen = strnlen(ownUri, 0xffff);
+  rec.otherLen = strnlen(otherUri, 0xffff);
+  rec.textLen = strnlen(text, 0xffff);
+  size_t len = sizeof(rec) + rec.ownLen + rec.otherLen + rec.textLen;
+  if (len > MAX_RECORD_SIZE) {
+    log_e("message too long: %d", (int) len);
     return false;
   }
-  char fn[20];
-  snprintf(fn, sizeof(fn), partitionFileFormat, part);
-  log_v("messages file: %s", fn);
-  return ini.load(fn);
+
+  IndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.time = time;
+  entry.hash = hash_murmur(text);
+  entry.offset = logSize;
+  entry.length = len;
+  entry.flags = flags;
+
+  // Whatever gets written, logSize and the index no longer tell where the log ends until the next load()
+  logUnsynced = true;
+  if (log.write((const uint8_t*) &rec, sizeof(rec)) != sizeof(rec) ||
+      log.write((const uint8_t*) ownUri, rec.ownLen) != rec.ownLen ||
+      log.write((const uint8_t*) otherUri, rec.otherLen) != rec.otherLen ||
+      log.write((const uint8_t*) text, rec.textLen) != rec.textLen) {
+    log_e("failed to append to messages log");        // a partial record is cut off by the next load()
+    return false;
+  }
+  if (idx.write((const uint8_t*) &entry, sizeof(entry)) != sizeof(entry)) {
+    log_e("failed to append to messages index");      // indexed again by the next load()
+    return false;
+  }
+  if (!entries.add(entry)) {
+    return false;
+  }
+  logSize += len;
+  logUnsynced = false;
+  return true;
 }
 
 /* Description:
- *     store message in the message database.
- *     Encode message in Base64 if it has non-printable characters or newlines.
- * Return:
- *     hash of the message text (or message data).
+ *     rewrite the index entry of a record in place.
  */
-Messages::hash_t Messages::saveMessage(const char* text, const char* fromUri, const char* toUri,
-                                       bool incoming, unsigned long time, unsigned long ackTime) {
-  log_v("saving message to %s, time = %d, d = %c", toUri ? toUri : "nil", time, incoming ? 'i' : 'o');
+bool Messages::writeEntry(uint32_t record) {
+  File idx = SPIFFS.open(indexFile, "r+");
+  bool ok = idx && idx.seek(sizeof(FileHeader) + record * sizeof(IndexEntry)) &&
+            idx.write((const uint8_t*) &entries[record], sizeof(IndexEntry)) == sizeof(IndexEntry);
+  idx.close();
+  if (!ok) {
+    log_e("failed to update messages index");
+  }
+  return ok;
+}
 
-  if (!time) {
-    time--;  // store 0xFFFFFFFF insted of 0x00000000 so that sorting is still correct
+/* Description:
+ *     read a record from the log into a dynamically allocated MessageData (to be deleted by the caller).
+ */
+MessageData* Messages::readMessage(File& log, uint32_t record) {
+  if (record >= entries.size()) {
+    return NULL;
+  }
+  IndexEntry& entry = entries[record];
+  RecordHeader rec;
+  if (!log.seek(entry.offset) || log.read((uint8_t*) &rec, sizeof(rec)) != sizeof(rec) || rec.marker != RECORD_MARKER ||
+      sizeof(rec) + rec.ownLen + rec.otherLen + rec.textLen != entry.length) {
+    log_e("corrupt message record %d at %d", record, entry.offset);
+    return NULL;
+  }
+  char* buffDyn = (char*) extMalloc(rec.ownLen + rec.otherLen + rec.textLen + 3);
+  if (!buffDyn) {
+    return NULL;
+  }
+  char* own = buffDyn;
+  char* other = own + rec.ownLen + 1;
+  char* text = other + rec.otherLen + 1;
+  log.read((uint8_t*) own, rec.ownLen);
+  own[rec.ownLen] = '\0';
+  log.read((uint8_t*) other, rec.otherLen);
+  other[rec.otherLen] = '\0';
+  log.read((uint8_t*) text, rec.textLen);
+  text[rec.textLen] = '\0';
+
+  bool incoming = entry.flags & FLAG_INCOMING;
+  MessageData* msg = incoming ? new MessageData(other, own, text, entry.time, true)
+                              : new MessageData(own, other, text, entry.time, false);
+  free(buffDyn);
+  if (entry.flags & FLAG_UNREAD) {
+    (*msg)["u"] = "1";
+  }
+  if (rec.ackTime) {
+    msg->putValueFullHex("a", rec.ackTime);
+  }
+  msg->record = record;
+  return msg;
+}
+
+/* Description:
+ *     put the files written by compact() in place of the old ones, once the old log is removed.
+ */
+void Messages::replaceCompacted() {
+  if (SPIFFS.exists(indexTmpFile)) {
+    SPIFFS.remove(indexFile);
+    SPIFFS.rename(indexTmpFile, indexFile);
+  }
+  if (SPIFFS.exists(conversationsTmpFile)) {
+    SPIFFS.remove(conversationsFile);
+    SPIFFS.rename(conversationsTmpFile, conversationsFile);
   }
+  SPIFFS.rename(logTmpFile, logFile);
+}
 
-  // Find first partition of the right type in index
-  int32_t msgcnt = -1;
-  int32_t partn  = -1;
-  int partPos = 0;
-  bool io = false;
-  index.show();
-  for (auto ipart = index.iterator(1); ipart.valid(); ++ipart) {       // traverse all partitions (start at section 1 because we want to skip 0, the header partition)
-    if (strchr(ipart->getValueSafe("d", ""), incoming ? 'i' : 'o')) {
-      msgcnt = ipart->getIntValueSafe("n", -1);
-      partn  = ipart->getIntValueSafe("p", -1);
-      partPos = (int32_t)ipart;
-      if (strchr(ipart->getValueSafe("d", ""), incoming ? 'o' : 'i')) {
-        io = true;
-      }
+/* Description:
+ *     rewrite the log and the index without the deleted records. The new files are written aside; removing the old log
+ *     commits the compaction: interrupted before that, the old files are kept, after that, load() finishes replacing
+ *     them. Nothing is replaced if a record of the old log can't be read.
+ *     Records are renumbered, so the preloaded messages are cleared.
+ */
+bool Messages::compact() {
+  log_d("compacting messages log: %d of %d records deleted", deletedCount, (int) entries.size());
+  this->clearCache();
+  this->clearPreloaded();
+
+  File log = SPIFFS.open(logFile, FILE_READ);
+  File newLog = SPIFFS.open(logTmpFile, FILE_WRITE);
+  File newIdx = SPIFFS.open(indexTmpFile, FILE_WRITE);
+  bool ok = log && newLog && newIdx && writeHeader(newLog, "WMLG", 0) && writeHeader(newIdx, "WMIX", sizeof(IndexEntry));
+
+  // Conversations of the kept records (if they are not known yet, the file is rebuilt from the new log on load)
+  File newConv;
+  if (recordConversation.size() == entries.size()) {
+    newConv = SPIFFS.open(conversationsTmpFile, FILE_WRITE);
+    if (newConv && !writeHeader(newConv, "WMCV", 0)) {
+      newConv.close();
+    }
+  }
+  LinearArray<IndexEntry, LA_EXTERNAL_RAM> kept;
+  uint32_t newSize = sizeof(FileHeader);
+  uint8_t buff[256];
+  for (size_t i = 0; ok && i < entries.size(); i++) {
+    IndexEntry entry = entries[i];
+    if (entry.flags & FLAG_DELETED) {
+      continue;
+    }
+    // Copy the record with the current flags in its header
+    RecordHeader rec;
+    if (!log.seek(entry.offset) || log.read((uint8_t*) &rec, sizeof(rec)) != sizeof(rec) || rec.marker != RECORD_MARKER) {
+      log_e("corrupt message record %d at %d: compaction aborted, the old log is kept", (int) i, entry.offset);
+      ok = false;
       break;
     }
+    rec.flags = entry.flags;
+    ok = newLog.write((const uint8_t*) &rec, sizeof(rec)) == sizeof(rec);
+    for (size_t left = entry.length - sizeof(rec); ok && left > 0;) {
+      size_t n = left < sizeof(buff) ? left : sizeof(buff);
+      ok = log.read(buff, n) == n && newLog.write(buff, n) == n;
+      left -= n;
+    }
+    entry.offset = newSize;
+    newSize += entry.length;
+    ok = ok && newIdx.write((const uint8_t*) &entry, sizeof(entry)) == sizeof(entry) && kept.add(entry);
+    if (ok && newConv && !this->writeConversations(newConv, i, i + 1)) {
+      newConv.close();
+      SPIFFS.remove(conversationsTmpFile);
+    }
+  }
+  log.close();
+  newLog.close();
+  newIdx.close();
+  newConv.close();
+  if (!ok) {
+    log_e("failed to compact messages log");
+    SPIFFS.remove(logTmpFile);
+    SPIFFS.remove(indexTmpFile);
+    SPIFFS.remove(conversationsTmpFile);
+    return false;
   }
 
-  // Load or create the partition
-  IniFile ini;
-  bool inited = false;
-  if (partn >=0 && msgcnt < Messages::PARTITION_SIZE) {
+  // Side files of the old log go first (rebuilt from whichever log is found), then the old log itself: from there on,
+  // the new files replace the old ones even if this is interrupted (see replaceCompacted())
+  SPIFFS.remove(conversationsFile);
+  SPIFFS.remove(filtersFile);
+  if (!SPIFFS.remove(logFile)) {
+    log_e("failed to replace messages log");
+    SPIFFS.remove(logTmpFile);
+    SPIFFS.remove(indexTmpFile);
+    SPIFFS.remove(conversationsTmpFile);
+    return false;
+  }
+  replaceCompacted();
 
-    log_d("selected partition: %d", partn);
-    // Non-filled partition found -> add message into it
-    this->loadPartition(ini, partn);
-    log_d("partition loaded: %d", partn);
+  entries.clear();
+  if (kept.size()) {
+    entries.extend(&kept[0], kept.size());
+  }
+  logSize = newSize;
+  this->buildViews();
+  found.clear();
+  if (this->loaded) {
+    this->loadConversations();      // renumbered
+    this->loadFilters();
+  }
+  log_d("messages log compacted: %d bytes", logSize);
+  return true;
+}
 
-  } else {
-    log_d("creating new partition");
-    // Else -> create new partition
-
-    // Determine the new partition number
-    partn = index[0].getIntValueSafe("x", 1);
-    for (auto ipart = index.iterator(1); ipart.valid(); ++ipart) {       // traverse all partitions
-      int pn = ipart->getIntValueSafe("p", 0) + 1;
-      if (pn > partn) {
-        partn = pn;
-      }
+// - - - - - - - - - - - - - - - - - - - - -  Messages: cache  - - - - - - - - - - - - - - - - - - - - -
+
+Messages::CachedPage* Messages::findPage(bool incoming, int32_t page) {
+  for (size_t i = 0; i < cache.size(); i++) {
+    if (cache[i]->incoming == incoming && cache[i]->page == page) {
+      return cache[i];
     }
-    log_d("partn = %d", partn);
+  }
+  return NULL;
+}
 
-    // Assign partition filename, make sure the file does not exist
-    char filename[20];
-    do {
-      snprintf(filename, sizeof(filename), partitionFileFormat, partn);
-      log_v("messages file: %s", filename);
-      if (ini.load(filename)) {
-        log_e("file exists");
-        partn++;
-      }
-    } while (ini.isLoaded());
-
-    // Initialize partition
-    ini.addSection();
-    ini[0]["desc"] = "WiPhone messages partition";
-    ini[0]["v"] = "1";
-    ini[0]["n"] = "1";
-    ini[0]["d"] = incoming ? "i" : "o";
-    ini[0].putValueFullHex("t1", time);
-    ini[0]["t2"] = ini[0]["t1"];
-    ini[0]["p"] = partn;
-    inited = true;
-  }
-
-  if (!ini.isLoaded() && !inited) {
-    log_e("no partition to store");
-    return 0;
+/* Description:
+ *     read the messages of a page from the log and add it to the cache. The page ends early at a corrupt record.
+ */
+Messages::CachedPage* Messages::loadPage(File& log, bool incoming, int32_t page) {
+  MessagesView& view = incoming ? inbox : sent;
+  int32_t first = page * PAGE_SIZE;
+  if (page < 0 || first >= (int32_t) view.size()) {
+    return NULL;
+  }
+  CachedPage* cached = (CachedPage*) extCalloc(1, sizeof(CachedPage));
+  if (cached == NULL || !cache.add(cached)) {
+    log_e("out of memory");
+    free(cached);
+    return NULL;
+  }
+  cached->incoming = incoming;
+  cached->page = page;
+  for (; cached->count < PAGE_SIZE && first + cached->count < (int32_t) view.size(); cached->count++) {
+    uint32_t record = view[first + cached->count].record;
+    MessageData* msg = this->readMessage(log, record);
+    if (msg == NULL) {
+      break;
+    }
+    cached->messages[cached->count] = msg;
+    cached->bytes += entries[record].length + MESSAGE_OVERHEAD;
   }
+  cacheBytes += cached->bytes;
+  return cached;
+}
 
-  // Actually store message into the partition
-  log_d("storing new message: %d", partn);
-  ini.addSection();
-  ini[-1].putValueFullHex("t", time);
-  if (fromUri) {
-    ini[-1][incoming ? "o" : "s"] = fromUri;
+/* Description:
+ *     remove the i-th page from the cache. Its messages in the preloaded window are kept until the window is cleared.
+ */
+void Messages::dropPage(size_t i) {
+  CachedPage* cached = cache[i];
+  for (int32_t k = 0; k < cached->count; k++) {
+    MessageData* msg = cached->messages[k];
+    size_t j;
+    for (j = 0; j < preloaded.size() && preloaded[j] != msg; j++);
+    if (j < preloaded.size()) {
+      uncached.add(msg);
+    } else {
+      delete msg;
+    }
   }
-  if (toUri) {
-    ini[-1][incoming ? "s" : "o"] = toUri;
+  cacheBytes -= cached->bytes;
+  free(cached);
+  cache.remove(i);
+}
+
+/* Description:
+ *     remove the pages of a view from `fromPage` on (the positions of their messages have changed).
+ */
+void Messages::dropPages(bool incoming, int32_t fromPage) {
+  for (size_t i = cache.size(); i-- > 0;) {
+    if (cache[i]->incoming == incoming && cache[i]->page >= fromPage) {
+      this->dropPage(i);
+    }
   }
-  if (ackTime) {
-    ini[-1].putValueFullHex("a", ackTime);
+}
+
+void Messages::clearCache() {
+  for (size_t i = cache.size(); i-- > 0;) {
+    this->dropPage(i);
   }
-  if (io) {
-    ini[-1]["d"] = incoming ? "i" : "o";
+  cache.clear();
+  prefetchPages[0] = prefetchPages[1] = -1;
+}
+
+/* Description:
+ *     remove the least recently used pages while the cache is over its budget, except those of the preloaded window.
+ */
+void Messages::evict() {
+  while (cacheBytes > cacheBudget) {
+    int32_t lru = -1;
+    for (size_t i = 0; i < cache.size(); i++) {
+      CachedPage* cached = cache[i];
+      if (cached->incoming == preloadedIncoming && cached->page >= preloadedPages[0] && cached->page <= preloadedPages[1]) {
+        continue;
+      }
+      if (lru < 0 || cached->lastUse < cache[lru]->lastUse) {
+        lru = i;
+      }
+    }
+    if (lru < 0) {
+      break;
+    }
+    log_v("evicting page %d", cache[lru]->page);
+    this->dropPage(lru);
   }
-  if (incoming) {
-    ini[-1]["u"] = "1";  // this message was not read yet
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  Messages: conversations  - - - - - - - - - - - - - - - - - - - - -
+
+/* Description:
+ *     key of the conversation with a URI: the URI normalized by CallerIdCache (or as it is, if that fails). A longer
+ *     one than MAX_CONVERSATION_KEY characters is cut and ends with '#' and the hash of the whole of it, so that URIs
+ *     differing only after the cut are kept apart. A key is its own key.
+ */
+void Messages::conversationKey(const char* uri, char* key) {
+  if (!uri) {
+    uri = "";
   }
-  if (text) {
-    if (NanoIni::isSafeString(text)) {
-      ini[-1]["m"] = text;
+  if (CallerIdCache::normalize(uri, key, MAX_CONVERSATION_KEY + 1)) {
+    return;
+  }
+  size_t size = strlen(uri) + 1;      // normalizing never makes a URI longer
+  char* normalizedDyn = (char*) extMalloc(size);
+  const char* full = normalizedDyn && CallerIdCache::normalize(uri, normalizedDyn, size) ? normalizedDyn : uri;
+  if (strlen(full) <= MAX_CONVERSATION_KEY) {
+    strcpy(key, full);
+  } else {
+    snprintf(key, MAX_CONVERSATION_KEY + 1, "%.*s#%08x", (int) MAX_CONVERSATION_KEY - 9, full, (unsigned) hash_murmur(full));
+  }
+  freeNull((void **) &normalizedDyn);
+}
+
+/* Description:
+ *     read the conversation of every record from the conversations file. Records it misses are read from the log and
+ *     appended to it; if it is corrupt (or has more records than the index), it is written anew.
+ */
+void Messages::loadConversations() {
+  this->clearConversations();
+  char key[MAX_CONVERSATION_KEY + 1];
+  File conv = SPIFFS.open(conversationsFile, FILE_READ);
+  bool found = conv;
+  bool valid = found && checkHeader(conv, "WMCV", 0);
+  while (valid && recordConversation.size() < entries.size()) {
+    uint8_t len;
+    if (conv.read(&len, 1) != 1) {
+      break;      // the rest is read from the log
+    }
+    if (len > MAX_CONVERSATION_KEY || conv.read((uint8_t*) key, len) != len) {
+      valid = false;
+      break;
+    }
+    key[len] = '\0';
+    valid = this->addToConversation(recordConversation.size(), key);
+  }
+  valid = valid && conv.available() == 0;
+  conv.close();
+  if (!valid) {
+    if (found) {
+      log_e("rebuilding messages conversations");
+    }
+    this->clearConversations();
+  }
+
+  if (!valid || recordConversation.size() < entries.size()) {
+    uint32_t from = recordConversation.size();
+    File log = SPIFFS.open(logFile, FILE_READ);
+    if (!log) {
+      this->clearConversations();
+      return;
+    }
+    while (recordConversation.size() < entries.size()) {
+      this->readConversationKey(log, recordConversation.size(), key);
+      if (!this->addToConversation(recordConversation.size(), key)) {
+        break;
+      }
+    }
+    log.close();
+    if (!valid) {
+      conv = SPIFFS.open(conversationsFile, FILE_WRITE);
+      valid = conv && writeHeader(conv, "WMCV", 0) && this->writeConversations(conv, 0, recordConversation.size());
     } else {
-      ini[-1].putValueBase64("b", text);
+      conv = SPIFFS.open(conversationsFile, FILE_APPEND);
+      valid = conv && this->writeConversations(conv, from, recordConversation.size());
+    }
+    conv.close();
+    if (!valid) {
+      log_e("failed to write messages conversations");
+      SPIFFS.remove(conversationsFile);
     }
   }
-  ini.reorderLast(1, Storage::messageCompare);
-  if (incoming) {
-    ini[0]["u"] = ini[0].getIntValueSafe("u", 0) + 1;  // increase the unread messages counter for entire partition
-  }
-
-  // Store partition
-  if (ini.store()) {
-
-    // Update index
-    log_d("updating index");
-    if (inited) {
-
-      // Register new partition
-      log_d("register new partition: %d", partn);
-      index.addSection();
-      index[-1]["p"] = partn;
-      index[-1]["d"] = incoming ? "i" : "o";
-      index[-1]["n"] = "1";
-      index[-1].putValueFullHex("t1", time);
-      index[-1]["t2"] = index[-1]["t1"];
-      partPos = -1;
-
-    } else if (partPos!=0) {
-
-      // Update existing index section
-      log_d("updated existing index");
-      index[partPos]["n"] = index[partPos].getIntValueSafe("n", 0) + 1;
-      auto tt = index[partPos].getHexValueSafe("t1", 2);
-      if (time < tt) {
-        index[partPos].putValueFullHex("t1", time);
+  log_d("messages conversations: %d", (int) conversations.size());
+}
+
+void Messages::clearConversations() {
+  for (size_t i = 0; i < conversations.size(); i++) {
+    freeNull((void **) &conversations[i].uriDyn);
+  }
+  conversations.clear();
+  recordConversation.clear();
+}
+
+/* Description:
+ *     add the next record (`record` == recordConversation.size()) to the conversation with the key, starting it if
+ *     this is the first such record.
+ */
+bool Messages::addToConversation(uint32_t record, const char* key) {
+  hash_t hash = hash_murmur(key);
+  size_t i;
+  for (i = 0; i < conversations.size() && (conversations[i].hash != hash || strcmp(conversations[i].uriDyn, key)); i++);
+  if (i == conversations.size()) {
+    Conversation conversation;
+    memset(&conversation, 0, sizeof(conversation));
+    conversation.hash = hash;
+    conversation.uriDyn = extStrdup(key);
+    if (i >= UINT16_MAX || conversation.uriDyn == NULL || !conversations.add(conversation)) {
+      log_e("out of memory");
+      free(conversation.uriDyn);
+      return false;
+    }
+  }
+  if (!recordConversation.add(i)) {
+    return false;
+  }
+  IndexEntry& entry = entries[record];
+  if (!(entry.flags & FLAG_DELETED)) {
+    Conversation& conversation = conversations[i];
+    if (!conversation.count || entry.time > conversation.lastTime) {
+      conversation.lastTime = entry.time;
+    }
+    conversation.count++;
+    if (entry.flags & FLAG_UNREAD) {
+      conversation.unread++;
+    }
+  }
+  return true;
+}
+
+/* Description:
+ *     write the entries of records [from, to) to the conversations file.
+ */
+bool Messages::writeConversations(File& file, uint32_t from, uint32_t to) {
+  for (uint32_t record = from; record < to; record++) {
+    const char* key = conversations[recordConversation[record]].uriDyn;
+    uint8_t len = strlen(key);
+    if (file.write(&len, 1) != 1 || file.write((const uint8_t*) key, len) != len) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Description:
+ *     conversation key of a record from the other URI in the log, "" if the record is corrupt.
+ */
+bool Messages::readConversationKey(File& log, uint32_t record, char* key) {
+  key[0] = '\0';
+  IndexEntry& entry = entries[record];
+  RecordHeader rec;
+  if (!log.seek(entry.offset) || log.read((uint8_t*) &rec, sizeof(rec)) != sizeof(rec) || rec.marker != RECORD_MARKER) {
+    log_e("corrupt message record %d at %d", record, entry.offset);
+    return false;
+  }
+  char* uriDyn = (char*) extMalloc(rec.otherLen + 1);      // whole: the key of a long one has its hash
+  if (!uriDyn) {
+    log_e("out of memory");
+    return false;
+  }
+  bool ok = log.seek(entry.offset + sizeof(rec) + rec.ownLen) && log.read((uint8_t*) uriDyn, rec.otherLen) == rec.otherLen;
+  if (ok) {
+    uriDyn[rec.otherLen] = '\0';
+    conversationKey(uriDyn, key);
+  }
+  freeNull((void **) &uriDyn);
+  return ok;
+}
+
+/* Description:
+ *     account for a deleted record in its conversation.
+ */
+void Messages::removeFromConversation(uint32_t record, bool unread) {
+  if (record >= recordConversation.size()) {
+    return;
+  }
+  uint16_t c = recordConversation[record];
+  Conversation& conversation = conversations[c];
+  conversation.count--;
+  if (unread) {
+    conversation.unread--;
+  }
+  if (entries[record].time >= conversation.lastTime && conversation.count > 0) {
+    // It was the newest one
+    conversation.lastTime = 0;
+    for (uint32_t i = 0; i < recordConversation.size(); i++) {
+      if (recordConversation[i] == c && !(entries[i].flags & FLAG_DELETED) && entries[i].time > conversation.lastTime) {
+        conversation.lastTime = entries[i].time;
       }
-      tt = index[partPos].getHexValueSafe("t2", 2);
-      if (time > tt) {
-        index[partPos].putValueFullHex("t2", time);
+    }
+  }
+}
+
+int32_t Messages::findConversation(const char* uri) {
+  char key[MAX_CONVERSATION_KEY + 1];
+  conversationKey(uri, key);
+  hash_t hash = hash_murmur(key);
+  for (int32_t i = 0; i < (int32_t) conversations.size(); i++) {
+    if (conversations[i].hash == hash && !strcmp(conversations[i].uriDyn, key)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Description:
+ *     indices of the conversations with messages, the most recent first.
+ */
+bool Messages::listConversations(LinearArray<int32_t, LA_EXTERNAL_RAM>& list) {
+  list.clear();
+  for (int32_t i = 0; i < (int32_t) conversations.size(); i++) {
+    if (conversations[i].count <= 0) {
+      continue;
+    }
+    int32_t pos = list.size();
+    while (pos > 0 && conversations[list[pos-1]].lastTime < conversations[i].lastTime) {
+      pos--;
+    }
+    if (!list.insert(pos, i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Description:
+ *     preload messages of a conversation, both incoming and sent, sorted by time. Only its own records are read.
+ *     Offsets are as in preload().
+ * Return:
+ *     number of messages read
+ */
+int32_t Messages::preloadConversation(int32_t conversation, int32_t offset, int32_t count) {
+  log_i("conversation: %d / offset: %d / count: %d", conversation, offset, count);
+
+  LinearArray<uint32_t, LA_EXTERNAL_RAM> records;
+  if (this->conversationSize(conversation) > 0 && recordConversation.size() == entries.size()) {
+    // Records of the conversation in both views, merged by time
+    records.ensure(this->conversationSize(conversation));
+    for (size_t i = 0, j = 0; i < inbox.size() || j < sent.size();) {
+      ViewItem& item = (j >= sent.size() || (i < inbox.size() && viewCompare(&inbox[i], &sent[j]) < 0)) ? inbox[i++] : sent[j++];
+      if (recordConversation[item.record] == conversation) {
+        records.add(item.record);
       }
     }
+  }
+  return this->preloadRecords(records, offset, count);
+}
+
+/* Description:
+ *     preload messages of a list of records (such as a conversation) into the window, like preload(). The preloaded
+ *     messages are not cached.
+ * Return:
+ *     number of messages read
+ */
+int32_t Messages::preloadRecords(LinearArray<uint32_t, LA_EXTERNAL_RAM>& records, int32_t offset, int32_t count) {
+  this->clearPreloaded();
+  this->preloadedRangeStart = this->preloadedRangeEnd = offset;
+  prefetchPages[0] = prefetchPages[1] = -1;
+  int32_t step = (offset < 0) ? -1 : 1;
+  int32_t pos = (offset < 0) ? (int32_t) records.size() + offset : offset;
+  if (pos < 0 || pos >= (int32_t) records.size()) {
+    log_d("nothing to load");
+    return 0;
+  }
+
+  File log = SPIFFS.open(logFile, FILE_READ);
+  if (!log) {
+    log_e("could not open messages log");
+    return 0;
+  }
+  preloaded.ensure(count);
+  for (; pos >= 0 && pos < (int32_t) records.size() && (int32_t) preloaded.size() < count; pos += step) {
+    MessageData* msg = this->readMessage(log, records[pos]);
+    if (!msg) {
+      break;
+    }
+    if (!uncached.add(msg)) {
+      delete msg;
+      break;
+    }
+    preloaded.add(msg);
+    preloadedRangeEnd += step;
+  }
+  log.close();
+  log_i("preloaded: %d, from: %d, to: %d", (int) preloaded.size(), preloadedRangeStart, preloadedRangeEnd);
+  return preloaded.size();
+}
 
-    // Update unread counters in the index
-    if (incoming) {
-      index[partPos]["u"] = ini[0]["u"];
-      index[0]["u"] = index[0].getIntValueSafe("u", 0) + 1;         // increase the unread messages counter for entire database
-    }
+// - - - - - - - - - - - - - - - - - - - - -  Messages: search  - - - - - - - - - - - - - - - - - - - - -
 
-    // Restore sorting by time in the index
-    log_v("sorting index");
-    index.sortFrom(1, Storage::messagePartitionCompare);
+/* Description:
+ *     filter bits of the trigram at `s`, in lower case (ASCII letters).
+ */
+void Messages::trigramBits(const char* s, uint32_t* bits) {
+  uint32_t v = (uint8_t) tolower((uint8_t) s[0]) | (uint8_t) tolower((uint8_t) s[1]) << 8 | (uint8_t) tolower((uint8_t) s[2]) << 16;
+  uint32_t h1 = v * 2654435761u;
+  uint32_t h2 = ((v ^ (v >> 11)) * 0x85ebca6bu) | 1;
+  for (int i = 0; i < FILTER_HASHES; i++) {
+    bits[i] = (h1 + i * h2) % (FILTER_BYTES * 8);
+  }
+}
 
-    if (!index.store()) {
-      log_e("failed to save index");
+bool Messages::addToFilter(uint32_t record, const char* text) {
+  uint32_t segment = record / SEGMENT_RECORDS;
+  if (segment >= filterSegments) {
+    uint8_t* grown = (uint8_t*) extRealloc(filtersDyn, (segment + 1) * FILTER_BYTES);
+    if (grown == NULL) {
+      log_e("out of memory");
+      return false;
+    }
+    memset(grown + filterSegments * FILTER_BYTES, 0, (segment + 1 - filterSegments) * FILTER_BYTES);
+    filtersDyn = grown;
+    filterSegments = segment + 1;
+  }
+  uint8_t* filter = filtersDyn + segment * FILTER_BYTES;
+  uint32_t bits[FILTER_HASHES];
+  for (size_t i = 0; text != NULL && text[i] && text[i+1] && text[i+2]; i++) {
+    trigramBits(text + i, bits);
+    for (int k = 0; k < FILTER_HASHES; k++) {
+      filter[bits[k] / 8] |= 1 << (bits[k] % 8);
     }
-
-  } else {
-    log_e("failed to save appended partition");
   }
-  return 0;
+  filteredRecords = record + 1;
+  return true;
 }
 
-bool Messages::findMessage(MessageData& msg, IniFile& part, int32_t& section) {
-  log_i("<-- Messages");
-
-  // Check if messages has all the necessary fields
-  if (!msg.hasKey("m") && !msg.hasKey("b") || !msg.hasKey("t") || !msg.hasKey("p")) {
-    log_e("missing field(s) in MessageData");
-    IF_LOG(ERROR) msg.show();
-    return false;
+/* Description:
+ *     false if the segment has no message with the text for sure (a trigram of it is not in the filter).
+ */
+bool Messages::mayContain(uint32_t segment, const char* text, size_t len) {
+  if (segment >= filterSegments || ((segment + 1) * SEGMENT_RECORDS > filteredRecords && filteredRecords < entries.size())) {
+    return true;      // not filtered (entirely)
+  }
+  const uint8_t* filter = filtersDyn + segment * FILTER_BYTES;
+  uint32_t bits[FILTER_HASHES];
+  for (size_t i = 0; i + 3 <= len; i++) {
+    trigramBits(text + i, bits);
+    for (int k = 0; k < FILTER_HASHES; k++) {
+      if (!(filter[bits[k] / 8] & (1 << (bits[k] % 8)))) {
+        return false;
+      }
+    }
   }
+  return true;
+}
 
-  int partn = msg.getIntValueSafe("p", -1);
-  log_v("looking for partition: %d", partn);
+/* Description:
+ *     write the filters from a segment on, then the header with the number of filtered records (so that a failed write
+ *     leaves the file as it was for that number). From the segment 0 the file is written anew.
+ */
+bool Messages::writeFilters(uint32_t fromSegment) {
+  if (!SPIFFS.exists(filtersFile)) {
+    fromSegment = 0;
+  }
+  File file = SPIFFS.open(filtersFile, fromSegment > 0 ? "r+" : FILE_WRITE);
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "WMBF", sizeof(header.magic));
+  header.version = 1;
+  header.entrySize = FILTER_BYTES;
+  header.reserved[0] = filteredRecords;
+  size_t size = (filterSegments - fromSegment) * FILTER_BYTES;
+  bool ok = file && file.seek(sizeof(FileHeader) + fromSegment * FILTER_BYTES) &&
+            (size == 0 || file.write(filtersDyn + fromSegment * FILTER_BYTES, size) == size) &&
+            file.seek(0) && file.write((const uint8_t*) &header, sizeof(header)) == sizeof(header);
+  file.close();
+  if (!ok) {
+    log_e("failed to write messages filters");
+  }
+  return ok;
+}
 
-  // Ensure the message partition is loaded
-  part = part1;
-  if (!part.isLoaded() || part.isEmpty() || part[0].getIntValueSafe("p", -2) != partn) {
-    part = part2;
-    if (!part.isLoaded() || part.isEmpty() || part[0].getIntValueSafe("p", -2) != partn) {
-      log_v("loading partition %d", partn);
-      part = part1;
-      this->loadPartition(part, partn);
+/* Description:
+ *     read the search filters. Records they miss are read from the log and added; if the file is corrupt (or has more
+ *     records than the index), it is written anew.
+ */
+void Messages::loadFilters() {
+  this->clearFilters();
+  File file = SPIFFS.open(filtersFile, FILE_READ);
+  FileHeader header;
+  bool valid = file && file.read((uint8_t*) &header, sizeof(header)) == sizeof(header) && !memcmp(header.magic, "WMBF", 4) &&
+               header.version == 1 && header.entrySize == FILTER_BYTES && header.reserved[0] <= entries.size();
+  if (valid && header.reserved[0] > 0) {
+    uint32_t segments = (header.reserved[0] + SEGMENT_RECORDS - 1) / SEGMENT_RECORDS;
+    filtersDyn = (uint8_t*) extMalloc(segments * FILTER_BYTES);
+    valid = filtersDyn != NULL && file.read(filtersDyn, segments * FILTER_BYTES) == segments * FILTER_BYTES;
+    if (valid) {
+      filterSegments = segments;
+      filteredRecords = header.reserved[0];
     }
   }
+  file.close();
+  if (!valid) {
+    this->clearFilters();
+  }
 
-  // Find the actual message in the partition by time ("t") and text ("m")
-  if (part.isLoaded() && !part.isEmpty()) {
-    const char* field = msg.hasKey("m") ? "m" : "b";
-    section = part.query("t", msg["t"], field, msg[field]);
-    return section > 0;
+  if (!valid || filteredRecords < entries.size()) {
+    uint32_t from = filteredRecords;
+    File log = SPIFFS.open(logFile, FILE_READ);
+    char* textDyn = NULL;
+    while (log && filteredRecords < entries.size()) {
+      if (!this->readText(log, filteredRecords, textDyn)) {
+        filteredRecords++;      // corrupt record: can't be found anyway
+      } else if (!this->addToFilter(filteredRecords, textDyn)) {
+        break;
+      }
+    }
+    freeNull((void **) &textDyn);
+    log.close();
+    this->writeFilters(valid ? from / SEGMENT_RECORDS : 0);
   }
-  log_e("not found");
-  return false;
+  log_d("messages filters: %d segments, %d records", filterSegments, filteredRecords);
+}
+
+void Messages::clearFilters() {
+  freeNull((void **) &filtersDyn);
+  filterSegments = 0;
+  filteredRecords = 0;
 }
 
 /* Description:
- *      take negative message offset (global message offset in the database), find the message in the cache (`preloaded` array)
- *      and pass it for deletion.
+ *     read the text of a record from the log into `textDyn` (reallocated as needed).
  */
-bool Messages::deleteMessage(int32_t messageOffset) {
-  log_i("messageOffset = %d", messageOffset);
-  if (messageOffset <= preloadedRangeEnd || messageOffset > preloadedRangeStart) {
-    log_e("wrong message offset %d, not in |%d..%d>", messageOffset, preloadedRangeStart, preloadedRangeEnd);
+bool Messages::readText(File& log, uint32_t record, char*& textDyn) {
+  IndexEntry& entry = entries[record];
+  RecordHeader rec;
+  if (!log.seek(entry.offset) || log.read((uint8_t*) &rec, sizeof(rec)) != sizeof(rec) || rec.marker != RECORD_MARKER) {
+    log_e("corrupt message record %d at %d", record, entry.offset);
+    return false;
+  }
+  char* text = (char*) extRealloc(textDyn, rec.textLen + 1);
+  if (text == NULL) {
+    return false;
+  }
+  textDyn = text;
+  if (!log.seek(entry.offset + sizeof(rec) + rec.ownLen + rec.otherLen) || log.read((uint8_t*) text, rec.textLen) != rec.textLen) {
     return false;
   }
-  messageOffset = abs(messageOffset - preloadedRangeStart);
-  log_v("delete: preloaded[%d]", messageOffset);
-  return this->deleteMessage(*preloaded[messageOffset]);
+  text[rec.textLen] = '\0';
+  return true;
 }
 
 /* Description:
- *     find message by partition, text and time and delete it. Remove partition if it becomes empty as a result.
+ *     find the messages with the text (case-insensitive for ASCII letters). Segments of the log whose filters don't have
+ *     all the trigrams of the text are skipped; the others are read and checked. Texts shorter than a trigram are
+ *     looked for in all the messages.
  * Return:
- *     true on success
+ *     number of messages found, see preloadFound()
  */
-bool Messages::deleteMessage(MessageData& msg) {
-  log_i("deleting message");
-  IF_LOG(VERBOSE)
-  msg.show();
-
-  // Find message
-  IniFile& ini = part1;
-  int key = 0;
-  bool found = this->findMessage(msg, ini, key);
-  log_v("found == %d", found);
-
-  // Remove message and update index
-  if (found && key > 0) {
-
-    // Remove message section from the partition
-    ini.removeSection(key);
-
-    // Update message counter in the index
-    int partn = msg.getIntValueSafe("p", -1);
-    int section = index.query("p", partn);    // key of the partition inside index
-    index[section]["n"] = (int32_t)(ini.nSections() - 1);
-
-    if (ini.nSections() > 1) {
-
-      // There are more messages left in this partition -> only update times
+int32_t Messages::search(const char* text) {
+  uint32_t ms = millis();
+  found.clear();
+  memset(&lastSearch, 0, sizeof(lastSearch));
+  char query[MAX_SEARCH_LENGTH + 1];
+  size_t len = 0;
+  for (; text != NULL && text[len] && len < MAX_SEARCH_LENGTH; len++) {
+    query[len] = tolower((uint8_t) text[len]);
+  }
+  query[len] = '\0';
+  if (!this->loaded || len == 0) {
+    return 0;
+  }
 
-      // Find min/max time
-      uint32_t t1 = 0xFFFFFFFF, t2 = 0;
-      for (auto it = ini.iterator(1); it.valid(); ++it) {
-        if (!it->hasKey("t")) {
-          continue;
-        }
-        uint32_t t = it->getHexValueSafe("t", 0);
-        if (t < t1) {
-          t1 = t;
-        }
-        if (t > t2) {
-          t2 = t;
+  File log = SPIFFS.open(logFile, FILE_READ);
+  if (!log) {
+    log_e("could not open messages log");
+    return 0;
+  }
+  char* textDyn = NULL;
+  lastSearch.segments = (entries.size() + SEGMENT_RECORDS - 1) / SEGMENT_RECORDS;
+  for (int32_t segment = 0; segment < lastSearch.segments; segment++) {
+    if (!this->mayContain(segment, query, len)) {
+      lastSearch.skipped++;
+      continue;
+    }
+    for (uint32_t record = segment * SEGMENT_RECORDS; record < (segment + 1) * SEGMENT_RECORDS && record < entries.size(); record++) {
+      if ((entries[record].flags & FLAG_DELETED) || !this->readText(log, record, textDyn)) {
+        continue;
+      }
+      lastSearch.read++;
+      for (char* c = textDyn; *c; c++) {
+        *c = tolower((uint8_t) *c);
+      }
+      if (strstr(textDyn, query) != NULL) {
+        // Sorted by time as the views: records are mostly in order
+        ViewItem item = { entries[record].time, record };
+        int32_t pos = found.size();
+        while (pos > 0) {
+          ViewItem prev = { entries[found[pos-1]].time, found[pos-1] };
+          if (viewCompare(&prev, &item) <= 0) {
+            break;
+          }
+          pos--;
         }
+        found.insert(pos, record);
       }
+    }
+  }
+  freeNull((void **) &textDyn);
+  log.close();
+  lastSearch.found = found.size();
+  lastSearch.ms = millis() - ms;
+  log_d("search \"%s\": %d found, %d of %d segments skipped, %d messages read in %d ms", query, lastSearch.found,
+        lastSearch.skipped, lastSearch.segments, lastSearch.read, lastSearch.ms);
+  return found.size();
+}
 
-      if (ini[0].getHexValueSafe("t1", 0xFFFFFFFF) != t1 || ini[0].getHexValueSafe("t2", 0) != t2) {
+int32_t Messages::preloadFound(int32_t offset, int32_t count) {
+  log_i("found: %d / offset: %d / count: %d", (int) found.size(), offset, count);
+  return this->preloadRecords(found, offset, count);
+}
 
-        // Update partition times
+// - - - - - - - - - - - - - - - - - - - - -  Messages: views  - - - - - - - - - - - - - - - - - - - - -
 
-        // - in partition file
-        ini[0].putValueFullHex("t1", t1);
-        ini[0].putValueFullHex("t2", t2);
-        // - in index file
-        if (section > 0) {
-          index[section].putValueFullHex("t1", t1);
-          index[section].putValueFullHex("t2", t2);
-        }
+int Messages::viewCompare(ViewItem* a, ViewItem* b) {
+  if (a->time != b->time) {
+    return a->time < b->time ? -1 : 1;
+  }
+  return a->record < b->record ? -1 : (a->record > b->record ? 1 : 0);
+}
 
+/* Description:
+ *     sort the messages of the index into the incoming and the sent view, count unread and deleted ones.
+ */
+void Messages::buildViews() {
+  inbox.clear();
+  sent.clear();
+  unreadCount = 0;
+  deletedCount = 0;
+  for (uint32_t i = 0; i < entries.size(); i++) {
+    IndexEntry& entry = entries[i];
+    if (entry.flags & FLAG_DELETED) {
+      deletedCount++;
+      continue;
+    }
+    ViewItem item = { entry.time, i };
+    if (entry.flags & FLAG_INCOMING) {
+      inbox.add(item);
+      if (entry.flags & FLAG_UNREAD) {
+        unreadCount++;
       }
-
-      // Save partition
-      ini.store();
-
     } else {
-
-      // No messages left in this partition -> remove the partition
-
-      // Remove partition file
-      ini.remove();
-
-      // Remove partition section
-      index.removeSection(section);
-
+      sent.add(item);
     }
+  }
+  inbox.sort(viewCompare);
+  sent.sort(viewCompare);
+}
 
-    // Restore sorting by time in the index
-    log_v("sorting index");
-    index.sortFrom(1, Storage::messagePartitionCompare);
-
-    // Save index
-    index.store();
+/* Description:
+ *     binary search for the first item of the view not before (time, record).
+ */
+int32_t Messages::findInView(MessagesView& view, uint32_t time, uint32_t record) {
+  ViewItem key = { time, record };
+  int32_t lo = 0, hi = view.size();
+  while (lo < hi) {
+    int32_t mid = (lo + hi) / 2;
+    if (viewCompare(&view[mid], &key) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
 
-    return true;
+/* Description:
+ *     find a message by its time and the hash of its text.
+ * Return:
+ *     record number, -1 - not found
+ */
+int32_t Messages::findMessage(bool incoming, uint32_t time, hash_t hash) {
+  MessagesView& view = incoming ? inbox : sent;
+  for (int32_t i = this->findInView(view, time, 0); i < (int32_t) view.size() && view[i].time == time; i++) {
+    if (entries[view[i].record].hash == hash) {
+      return view[i].record;
+    }
   }
-  return false;
+  return -1;
 }
 
-void Messages::setRead(MessageData& msg) {
-  if (!msg.hasKey("u")) {
-    log_e("message already read");
-    return;
+void Messages::removeFromView(uint32_t record) {
+  MessagesView& view = (entries[record].flags & FLAG_INCOMING) ? inbox : sent;
+  int32_t i = this->findInView(view, entries[record].time, record);
+  if (i < (int32_t) view.size() && view[i].record == record) {
+    view.remove(i);
   }
+}
 
-  // Change "read" state in the preloaded array
-  msg.setRead();
+// - - - - - - - - - - - - - - - - - - - - -  Messages: migration  - - - - - - - - - - - - - - - - - - - - -
 
-  // Find message
-  IniFile& ini = part1;
-  int key = 0;
-  bool found = this->findMessage(msg, ini, key);
-
-  // Change unread ("u") fields
-  if (found && key > 0) {
-    // Remove unread flag from the message
-    ini[key].remove("u");
-
-    // Update unread messages counters
-    // - unread counter in this partition
-    int unread = ini[0].getIntValueSafe("u", 1) - 1;
-    if (unread) {
-      ini[0]["u"] = unread;
-    } else {
-      ini[0].remove("u");
-    }
-    // - unread counter in the index for this partition
-    int partn = msg.getIntValueSafe("p", -1);
-    key = index.query("p", partn);    // key of the partition inside index
-    if (key>0) {
-      if (unread) {
-        index[key]["u"] = unread;
-      } else {
-        index[key].remove("u");
-      }
+/* Description:
+ *     copy the messages from the INI partitions of older firmware (index "/msg_index.ini", partitions "/msg_%05d.ini")
+ *     into a new log, then set the old index aside for removeOldPartitions(). Nothing is removed if any message fails
+ *     to be copied; if this is interrupted, load() starts over. Messages without time get `unixTime`.
+ */
+bool Messages::migrate(uint32_t unixTime) {
+  log_d("migrating messages from INI partitions");
+  IniFile index(oldIndexFile);
+  if (!index.load() || index.isEmpty()) {
+    log_e("old messages index could not be loaded");
+    return false;
+  }
+  if (!this->create()) {
+    return false;
+  }
+
+  File log = SPIFFS.open(logFile, FILE_APPEND);
+  File idx = SPIFFS.open(indexFile, FILE_APPEND);
+  if (!log || !idx) {
+    return false;
+  }
+  bool ok = true;
+  for (auto ipart = index.iterator(1); ok && ipart.valid(); ++ipart) {       // traverse all partitions
+    int32_t partn = ipart->getIntValueSafe("p", -1);
+    if (partn < 0) {
+      continue;
     }
-    // - unread counter of the index
-    int globalUnread = index[0].getIntValueSafe("u", unread+1) - 1;
-    if (globalUnread) {
-      index[0]["u"] = unread;
-    } else {
-      index[0].remove("u");
+    char fn[20];
+    snprintf(fn, sizeof(fn), oldPartitionFileFormat, partn);
+    IniFile part(fn);
+    if (!part.load() || part.isEmpty()) {
+      log_e("partition %d not found", partn);
+      continue;
+    }
+    bool partIncoming = strchr(part[0].getValueSafe("d", ipart->getValueSafe("d", "i")), 'i') != NULL;
+    for (auto im = part.iterator(1); ok && im.valid(); ++im) {
+      MessageData msg(*im);
+      bool incoming = im->hasKey("d") ? strchr(im->getValueSafe("d", ""), 'i') != NULL : partIncoming;
+      uint32_t time = im->hasKey("t") ? im->getHexValueSafe("t", 0) : (unixTime ? unixTime : 0xFFFFFFFF);
+      uint8_t flags = incoming ? FLAG_INCOMING : 0;
+      if (incoming && im->hasKey("u")) {
+        flags |= FLAG_UNREAD;
+      }
+      // Addresses may be set for the whole partition instead
+      const char* own = im->hasKey("s") ? msg.getOwnUri() : part[0].getValueSafe("s", ipart->getValueSafe("s", ""));
+      const char* other = im->hasKey("o") ? msg.getOtherUri() : part[0].getValueSafe("o", ipart->getValueSafe("o", ""));
+      ok = this->append(log, idx, own, other, msg.getMessageText(), time, im->getHexValueSafe("a", 0), flags);
     }
+    log_d("partition %d: %d messages", partn, (int) part.nSections()-1);
+  }
+  log.close();
+  idx.close();
+  if (!ok) {
+    return false;
+  }
 
-    // Save files to flash
-    ini.store();
-    index.store();
-  } else {
-    log_e("message not found");
+  // Everything is in the log: the old index is put aside (until then, load() migrates again), then the old files go
+  if (!SPIFFS.rename(oldIndexFile, oldIndexDoneFile)) {
+    log_e("failed to remove old messages index");
   }
+  log_d("migrated %d messages", (int) entries.size());
+  return true;
 }
 
-void Messages::setSent(MessageData& msg) {
-  // TODO
+/* Description:
+ *     remove the INI partitions of older firmware listed by the old index set aside by migrate(), then the index.
+ */
+void Messages::removeOldPartitions() {
+  IniFile index(oldIndexDoneFile);
+  if (index.load()) {
+    for (auto ipart = index.iterator(1); ipart.valid(); ++ipart) {
+      int32_t partn = ipart->getIntValueSafe("p", -1);
+      if (partn >= 0) {
+        char fn[20];
+        snprintf(fn, sizeof(fn), oldPartitionFileFormat, partn);
+        SPIFFS.remove(fn);
+      }
+    }
+  }
+  SPIFFS.remove(oldIndexDoneFile);
 }
 
-// # # # # # # # # # # # # # # # # # # # # # # # # # # # #  STORAGE CLASS  # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+// # # # # # # # # # # # # # # # # # # # # # # # # # # # #  MESSAGE OUTBOX  # # # # # # # # # # # # # # # # # # # # # # # # # # # #
 
-int Storage::messagePartitionCompare(NanoIni::Section** a, NanoIni::Section** b) {
-  int res = strcasecmp((*b)->getValueSafe("t2", ""), (*a)->getValueSafe("t2", ""));
-  if (!res) {
-    res = strcasecmp((*b)->getValueSafe("t1", ""), (*a)->getValueSafe("t1", ""));
+bool MessageOutbox::open() {
+  if (this->isLoaded()) {
+    return true;
   }
-  if (!res) {
-    res = strcasecmp((*b)->getValueSafe("p", ""), (*a)->getValueSafe("p", ""));
+  if (this->load() && !this->isEmpty() && (*this)[0].hasKey("v") && !strcmp((*this)[0]["v"], "1")) {
+    log_d("outbox: %d pending message(s)", (int) this->nSections()-1);
+    return true;
   }
-  return res;
+  log_d("creating messages outbox file");
+  this->clear();
+  this->addSection();
+  (*this)[0]["desc"] = "WiPhone outgoing messages";
+  (*this)[0]["v"] = "1";
+  (*this)[0]["n"] = "1";      // next key
+  this->loaded = this->store();
+  return this->loaded;
+}
+
+uint32_t MessageOutbox::add(MessageData& msg) {
+  if (!this->open()) {
+    return 0;
+  }
+  int32_t key = (*this)[0].getIntValueSafe("n", 1);
+  (*this)[0]["n"] = key < 0x7fffffff ? key + 1 : 1;
+  this->addSection(new NanoIni::Section(msg));
+  (*this)[-1]["k"] = key;
+  this->storeLater();
+  return key;
 }
 
-int Storage::messageCompare(NanoIni::Section** a, NanoIni::Section** b) {
-  return strcasecmp((*b)->getValueSafe("t", ""), (*a)->getValueSafe("t", ""));
+MessageData* MessageOutbox::take(uint32_t key) {
+  if (!this->open()) {
+    return NULL;
+  }
+  int i = this->query("k", (int32_t) key);
+  if (i <= 0) {
+    return NULL;
+  }
+  MessageData* msg = new MessageData((*this)[i]);
+  msg->remove("k");
+  this->removeSection(i);
+  this->storeLater();
+  return msg;
 }
 
+// # # # # # # # # # # # # # # # # # # # # # # # # # # # #  STORAGE CLASS  # # # # # # # # # # # # # # # # # # # # # # # # # # # #
+
 // - - - - - - - - - - - - - - - - - - - - -  Phonebook  - - - - - - - - - - - - - - - - - - - - -
 
 int Storage::phonebookCompare(NanoIni::Section** a, NanoIni::Section** b) {
@@ -1171,14 +2037,50 @@ bool Storage::loadPhonebookOld() {
 
 // - - - - - - - - - - - - - - - - - - - - -  IniFile class  - - - - - - - - - - - - - - - - - - - - -
 
-IniFile::IniFile(const char* fn) {
+IniFile* IniFile::files = nullptr;
+
+IniFile::IniFile() {
+  nextFile = files;
+  files = this;
+}
+
+IniFile::IniFile(const char* fn) : IniFile() {
   this->setFilename(fn);
 }
 
 IniFile::~IniFile() {
+  this->sync();
+  for (IniFile** p = &files; *p != nullptr; p = &(*p)->nextFile) {
+    if (*p == this) {
+      *p = nextFile;
+      break;
+    }
+  }
   freeNull((void **) &filenameDyn);
 }
 
+/* Description:
+ *     builds the Config like Config::Builder, and also notes where each section starts in the file
+ */
+class ExtentsBuilder : public NanoIni::Config::Builder {
+public:
+  ExtentsBuilder(NanoIni::Config& ini, LinearArray<size_t, LA_EXTERNAL_RAM>& offsets)
+    : NanoIni::Config::Builder(ini), offsets(offsets), parser(nullptr) {}
+
+  void setParser(NanoIni::Parser* p) {
+    parser = p;
+  }
+
+  bool section(const char* title, size_t titleLength) {
+    offsets.add(parser->lineOffset());
+    return NanoIni::Config::Builder::section(title, titleLength);
+  }
+
+protected:
+  LinearArray<size_t, LA_EXTERNAL_RAM>& offsets;
+  NanoIni::Parser* parser;
+};
+
 bool IniFile::load() {
   if (loaded) {
     log_e("file is already loaded");
@@ -1188,6 +2090,7 @@ bool IniFile::load() {
     log_e("could not load: filename empty");
     return false;
   }
+  recover(filenameDyn);
   if (!SPIFFS.exists(filenameDyn)) {
     log_e("could not load: file \"%s\" does not exist", filenameDyn);
     return false;
@@ -1195,23 +2098,35 @@ bool IniFile::load() {
   File file = SPIFFS.open(filenameDyn);
   if (file && file.available()) {
 
-    // Read entire INI file into the external RAM
+    // Parse the file as it is read: only a line split between two reads is ever copied
+    LinearArray<size_t, LA_EXTERNAL_RAM> offsets;
+    ExtentsBuilder builder(*this, offsets);
+    NanoIni::Parser parser(builder);
+    builder.setParser(&parser);
+    size_t total = 0;
     int bytes;
-    char buff[1025];
-    LinearArray<char, LA_EXTERNAL_RAM> fileContent;
-    do {
-      bytes = file.readBytes(buff, sizeof(buff)-1);
-      if (bytes > 0) {
-        fileContent.extend(buff, bytes);  // NOTE: this creates small unnecessary overhead for small files
-      }
-    } while (bytes == sizeof(buff)-1);
-    log_d("Read %d bytes from \"%s\"", fileContent.size(), filenameDyn);
-    fileContent.add('\0');    // terminate with nul-character to form a C-string
-
-    // Parse INI
-    if (fileContent.size() > 1) {
-      log_v("INI file before parsing:\n%s", &fileContent[0]);
-      this->parse(&fileContent[0]);
+    char buff[READ_CHUNK];
+    while ((bytes = file.read((uint8_t*) buff, sizeof(buff))) > 0) {
+      parser.feed(buff, bytes);
+      total += bytes;
+    }
+    parser.finish();
+    log_d("Read %d bytes from \"%s\"", (int) total, filenameDyn);
+
+    // Sections as they are in the file (each one up to the next)
+    extents.clear();
+    extentsValid = offsets.size() == sections.size() && extents.ensure(sections.size());
+    for (size_t i = 0; extentsValid && i < sections.size(); i++) {
+      Extent ext;
+      ext.section = sections[i];
+      ext.offset = offsets[i];
+      ext.length = (i + 1 < offsets.size() ? offsets[i + 1] : total) - offsets[i];
+      extents.add(ext);
+      sections[i]->clearModified();
+    }
+    fileSize = total;
+
+    if (!this->isEmpty()) {
       this->loaded = true;
     }
     return true;
@@ -1221,6 +2136,29 @@ bool IniFile::load() {
   }
 }
 
+/* Description:
+ *     parse an INI file without loading it: the visitor gets every section and key-value as they are read.
+ *     For files too large to be kept in RAM, or to find a single record.
+ * Return:
+ *     false if the file could not be read or the visitor stopped the parsing
+ */
+bool IniFile::scan(const char* fn, NanoIni::Visitor& visitor) {
+  recover(fn);
+  File file = SPIFFS.open(fn);
+  if (!file) {
+    log_e("could not scan: file \"%s\"", fn);
+    return false;
+  }
+  NanoIni::Parser parser(visitor);
+  int bytes;
+  char buff[READ_CHUNK];
+  bool more = true;
+  while (more && (bytes = file.read((uint8_t*) buff, sizeof(buff))) > 0) {
+    more = parser.feed(buff, bytes);
+  }
+  return more && parser.finish();
+}
+
 bool IniFile::load(const char* filename) {
   this->setFilename(filename);
   return this->load();
@@ -1230,41 +2168,229 @@ void IniFile::setFilename(const char* filename) {
   if (this->loaded) {
     this->unload();
   }
+  this->sync();
   freeNull((void **) &filenameDyn);
   filenameDyn = extStrdup(filename);
+  extentsValid = false;
 }
 
 /* Description:
- *     unload from RAM
+ *     unload from RAM (storing it first if storeLater() was called)
  */
 void IniFile::unload() {
+  this->sync();
   this->clear();
   this->loaded = false;
+  extents.clear();
+  extentsValid = false;
 }
 
+/* Description:
+ *     write the changes since the file was loaded or stored: patch the modified sections in place if possible,
+ *     rewrite the whole file otherwise.
+ */
 bool IniFile::store() {
   if (filenameDyn == nullptr || *filenameDyn=='\0') {
     log_e("could not store: filename empty");
     return false;
   }
+  pending = false;
+  if (this->storeChanged() || this->storeAll()) {
+    loaded = true;    // in-memory data corresponds to disk data
+    return true;
+  }
+  return false;
+}
+
+/* Description:
+ *     patch the modified sections in place, if none of them changed its length and the sections are the same ones
+ *     (same order, none added or removed) as in the file.
+ * Return:
+ *     false - the whole file has to be written
+ */
+bool IniFile::storeChanged() {
+  if (!extentsValid || extents.size() != sections.size()) {
+    return false;
+  }
+  size_t maxLength = 0;
+  int nModified = 0;
+  for (size_t i = 0; i < sections.size(); i++) {
+    if (sections[i] != extents[i].section) {
+      return false;
+    }
+    if (sections[i]->isModified()) {
+      size_t len = this->sectionLength(i);
+      if (len != extents[i].length) {
+        return false;
+      }
+      if (len > maxLength) {
+        maxLength = len;
+      }
+      nModified++;
+    }
+  }
+  if (nModified == 0) {
+    log_d("\"%s\": no changes to store", filenameDyn);
+    return true;
+  }
+
+  File file = SPIFFS.open(filenameDyn, "r+");
+  if (!file || file.size() != fileSize) {
+    log_e("\"%s\" changed on disk, rewriting", filenameDyn);
+    return false;
+  }
+  char* buff = (char*) extMalloc(maxLength + 1);
+  if (buff == nullptr) {
+    return false;
+  }
+  bool ok = true;
+  for (size_t i = 0; ok && i < sections.size(); i++) {
+    if (sections[i]->isModified()) {
+      size_t len = this->sprintSection(i, buff);
+      ok = file.seek(extents[i].offset) && file.write((const uint8_t*) buff, len) == len;
+    }
+  }
+  file.close();
+  free(buff);
+  if (!ok) {
+    log_e("failed to patch \"%s\"", filenameDyn);
+    return false;
+  }
+  log_d("patched %d section(s) of \"%s\"", nModified, filenameDyn);
+  this->stored();
+  return true;
+}
+
+/* Description:
+ *     write the whole file into a temporary file, section by section, and replace the file with it
+ */
+bool IniFile::storeAll() {
   log_d("writing file \"%s\"", filenameDyn);
-  File file = SPIFFS.open(filenameDyn, FILE_WRITE);
+  char* tmpDyn = tempFilename(filenameDyn);
+  if (tmpDyn == nullptr) {
+    return false;
+  }
+  extentsValid = false;
+  extents.clear();
+  bool ok = extents.ensure(sections.size());
+  File file = SPIFFS.open(tmpDyn, FILE_WRITE);
+  if (!file) {
+    log_e("failed to create a file");
+    ok = false;
+  }
+  char* buff = nullptr;
+  size_t buffSize = 0;
+  uint32_t offset = 0;
+  for (size_t i = 0; ok && i < sections.size(); i++) {
+    size_t len = this->sectionLength(i);
+    if (len + 1 > buffSize) {
+      char* p = (char*) extRealloc(buff, len + 1);
+      if (p == nullptr) {
+        ok = false;
+        break;
+      }
+      buff = p;
+      buffSize = len + 1;
+    }
+    this->sprintSection(i, buff);
+    log_v("%s", buff);            // prints entire file contents to logs
+    ok = file.write((const uint8_t*) buff, len) == len;
+    Extent ext;
+    ext.section = sections[i];
+    ext.offset = offset;
+    ext.length = len;
+    extents.add(ext);
+    offset += len;
+  }
   if (file) {
-    size_t len = this->length();
-    char* str = (char*) extMalloc(len+1);
-    this->sprint(str);
-    log_v("writing file:\n%s", str);            // prints entire file contents to logs
-    log_v("-------------\nfile size: %d", len);
-    file.write((const uint8_t*) str, len);
     file.close();
-    free(str);
-    log_v("wrote %d bytes to \"%s\"", len, filenameDyn);
-    loaded = true;    // in-memory data corresponds to disk data
-    return true;
+  }
+  freeNull((void **) &buff);
+
+  if (ok) {
+    SPIFFS.remove(filenameDyn);
+    ok = SPIFFS.rename(tmpDyn, filenameDyn);
   } else {
-    log_e("failed to create a file");
+    log_e("failed to write \"%s\"", tmpDyn);
+    SPIFFS.remove(tmpDyn);
+  }
+  free(tmpDyn);
+  if (!ok) {
+    extents.clear();
     return false;
   }
+  log_v("wrote %d bytes to \"%s\"", offset, filenameDyn);
+  fileSize = offset;
+  extentsValid = true;
+  this->stored();
+  return true;
+}
+
+/* Description:
+ *     the file on disk now matches this: clear the modifications, and make other instances for the same file
+ *     rewrite it whole on their next store()
+ */
+void IniFile::stored() {
+  for (size_t i = 0; i < sections.size(); i++) {
+    sections[i]->clearModified();
+  }
+  for (IniFile* f = files; f != nullptr; f = f->nextFile) {
+    if (f != this && f->filenameDyn != nullptr && !strcmp(f->filenameDyn, filenameDyn)) {
+      f->extentsValid = false;
+    }
+  }
+}
+
+void IniFile::storeLater() {
+  if (!pending) {
+    pending = true;
+    msPending = millis();
+  }
+}
+
+bool IniFile::sync() {
+  return !pending || this->store();
+}
+
+void IniFile::syncDue(uint32_t now) {
+  for (IniFile* f = files; f != nullptr; f = f->nextFile) {
+    if (f->pending && elapsedMillis(now, f->msPending, SYNC_DELAY_MS)) {
+      f->store();
+    }
+  }
+}
+
+void IniFile::syncAll() {
+  for (IniFile* f = files; f != nullptr; f = f->nextFile) {
+    f->sync();
+  }
+}
+
+char* IniFile::tempFilename(const char* fn) {
+  size_t len = strlen(fn);
+  char* tmp = (char*) extMalloc(len + 5);
+  if (tmp != nullptr) {
+    memcpy(tmp, fn, len);
+    strcpy(tmp + len, ".tmp");
+  }
+  return tmp;
+}
+
+/* Description:
+ *     finish or undo a store() interrupted by a power loss: the temporary file is complete only if the file itself
+ *     was already removed.
+ */
+void IniFile::recover(const char* fn) {
+  char* tmpDyn = tempFilename(fn);
+  if (tmpDyn != nullptr && SPIFFS.exists(tmpDyn)) {
+    if (SPIFFS.exists(fn)) {
+      SPIFFS.remove(tmpDyn);
+    } else {
+      log_e("restoring \"%s\" from an interrupted store", fn);
+      SPIFFS.rename(tmpDyn, fn);
+    }
+  }
+  freeNull((void **) &tmpDyn);
 }
 
 void IniFile::show() {
@@ -1272,8 +2398,11 @@ void IniFile::show() {
 }
 
 void IniFile::remove() {
+  pending = false;
   SPIFFS.remove(filenameDyn);
   this->clear();
+  extents.clear();
+  extentsValid = false;
 }
 
 // - - - - - - - - - - - - - - - - - - - - -  CriticalFile class  - - - - - - - - - - - - - - - - - - - - -
@@ -1281,7 +2410,7 @@ void IniFile::remove() {
 /* Description:
  *     try to save the NanoINI string into the NVS on backup() (but as long as it's not already stored)
  */
-bool CriticalFile::backup(uint32_t unixTime) {
+bool CriticalFile::backup(uint32_t) {
   // Get NVS page name
   char* pageDyn = this->pagename();
   if (!pageDyn) {
@@ -1319,7 +2448,7 @@ bool CriticalFile::backup(uint32_t unixTime) {
       HASHHEX thisHash;
       md5Compress(str, len, thisHash);
       if (!strcmp(storedHash, thisHash)) {
-        log_i("%d bytes to \"%s\": same data, skipping", len, pageDyn);
+        log_i("%d bytes to \"%s\": same data, skipping", (int) len, pageDyn);
         success = true;
       }
     }
@@ -1329,7 +2458,7 @@ bool CriticalFile::backup(uint32_t unixTime) {
       this->end();
       if (this->begin(pageDyn, false)) {      // not read-only
         if (this->putString(backupKey, str)>0) {
-          log_i("%d bytes to \"%s\": successful", len, pageDyn);
+          log_i("%d bytes to \"%s\": successful", (int) len, pageDyn);
           success = true;
         }
       }
@@ -1337,7 +2466,7 @@ bool CriticalFile::backup(uint32_t unixTime) {
   }
 
   if (!success) {
-    log_e("%d bytes to \"%s\": FAILED", len, pageDyn);
+    log_e("%d bytes to \"%s\": FAILED", (int) len, pageDyn);
   }
   freeNull((void **) &pageDyn);
   return success;
@@ -1476,8 +2605,10 @@ void Storage::storeUdpSender(const char* ip, const int32_t port, const char* tex
 // - - - - - - - - - - - - - - - - - - - - -  Generic helpers  - - - - - - - - - - - - - - - - - - - - -
 
 Storage::Storage()
-  : phonebook(Storage::PhonebookFile)
-{};
+  : phonebook(Storage::PhonebookFile) {
+  phonebook.indexKey("s");        // contacts are looked up by SIP URI: phonebook.query("s", uri)
+  phonebook.useArena();           // hundreds of contacts: loaded and unloaded in a few big chunks
+};
 
 void Storage::storeString(const char* page, const char* variable, const char* val) {
   this->end();
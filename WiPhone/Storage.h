@@ -121,10 +121,23 @@ protected:
 
 /* Description:
  *     configuration or data file stored and loaded from SPIFFS through NanoINI interface
+ *
+ *     store() only writes what changed since the file was loaded or stored. The position and length of every section
+ *     in the file are known, so sections modified without changing their length are patched in place; otherwise the
+ *     whole file is written to a temporary file that then replaces it, so that a power loss leaves either the old file
+ *     or the new one (see recover()). Patching is not atomic either, but SPIFFS rewrites only the pages involved:
+ *     at worst the section being patched is garbled, never the rest of the file.
+ *
+ *     storeLater() coalesces a burst of changes (e.g. volume key presses) into one write: the file is stored by the
+ *     main loop (syncDue()) SYNC_DELAY_MS after the first change, or earlier by sync(), unload() or destruction.
+ *     Every instance is linked into one list for this, and to tell the others when a file is written (several
+ *     instances for the same file do exist). Like NanoIni, this is meant for the main loop only.
  */
 class IniFile : public NanoIni::Config {
 public:
-  IniFile() {}
+  static const uint32_t SYNC_DELAY_MS = 3000;
+
+  IniFile();
   IniFile(const char* fn);
 
   ~IniFile();
@@ -132,9 +145,15 @@ public:
   bool load();                  // load from permanent storage (SPIFFS or SD)
   bool load(const char* fn);    // change associated filename and load
   bool store();                 // store to permanent storage (SPIFFS or SD)
+  void storeLater();            // store() within SYNC_DELAY_MS, with whatever changes are made meanwhile
+  bool sync();                  // store() now if storeLater() was called
+  static bool scan(const char* fn, NanoIni::Visitor& visitor);      // parse without loading
   void show();
   void remove();
 
+  static void syncDue(uint32_t now);    // store the files whose delay is over (main loop)
+  static void syncAll();                // store all pending files (before powering off or restarting)
+
   const char* filename() {
     return filenameDyn;
   }
@@ -144,10 +163,32 @@ public:
   void unload();    // unload from RAM
 
 protected:
+  static const size_t READ_CHUNK = 512;     // bytes parsed at a time (on the stack)
+
+  struct Extent {               // of a section in the file
+    NanoIni::Section* section;
+    uint32_t offset;
+    uint32_t length;
+  };
+
   char* filenameDyn = nullptr;
   bool loaded = false;
 
+  LinearArray<Extent, LA_EXTERNAL_RAM> extents;     // one per section; valid only if extentsValid
+  bool extentsValid = false;
+  uint32_t fileSize = 0;
+
+  bool pending = false;         // storeLater() called
+  uint32_t msPending = 0;
+  IniFile* nextFile = nullptr;
+  static IniFile* files;        // all instances
+
   void setFilename(const char* fn);
+  bool storeChanged();
+  bool storeAll();
+  void stored();
+  static char* tempFilename(const char* fn);            // dynamically allocated
+  static void recover(const char* fn);
 };
 
 /* Description:
@@ -173,7 +214,6 @@ protected:
 class MessageData : public NanoIni::Section {
 public:
   MessageData(NanoIni::Section& message);
-  MessageData(NanoIni::Section& message, int partn);
   MessageData(const char* fromUri, const char* toUri, const char* text, uint32_t time, bool incoming);
 
   bool isRead()             {
@@ -191,20 +231,50 @@ public:
   const char* getMessageText();
   unsigned long getTime();
   unsigned long getAckTime();
+  int32_t getRecord()       {
+    return record;
+  }
+  bool isIncoming()         {
+    return incoming;
+  }
 
 protected:
+  friend class Messages;
+
   std::string decodedText;
   unsigned long time = 0;
   unsigned long ackTime = 0;
+  int32_t record = -1;          // number of the message in the messages index, -1 - not from the database
+  bool incoming = false;
 };
 
 typedef LinearArray<MessageData*, LA_EXTERNAL_RAM> MessagesArray;
 
 /*
  * Description:
- *     messages database is split accross multiple files (handled by NanoIni interface), indexed by a single index file.
+ *     messages database: an append-only log of message records and a fixed-width binary index over it.
  *     This is a higher level interface that is meant to abstract from actual storage.
- *     (Incidentally, this is probably the most complex class in WiPhone firmware.)
+ *
+ *     Saving a message appends one record to the log and one entry to the index; reading, deleting a message or
+ *     changing its flags rewrites a single index entry in place. The whole index is loaded into the external RAM
+ *     (16 bytes per message) and viewed per direction sorted by time, so that a message is found by binary search.
+ *     Deleted records stay in the log until it is compacted (see COMPACT_MIN_DELETED).
+ *
+ *     Messages read from the log are cached by pages of PAGE_SIZE consecutive messages of a view, within a budget of
+ *     external RAM (see setCacheBudget()); the least recently used pages are evicted first.
+ *
+ *     Messages of both directions are grouped into conversations by the other URI (normalized as by CallerIdCache).
+ *     A side file keeps the conversation key of every record, so that the conversations are known on load() without
+ *     reading the log; it is appended with the log and rebuilt from the log if it misses records.
+ *
+ *     Full-text search reads only the segments of the log (SEGMENT_RECORDS records each) that may have the text: each
+ *     segment has a Bloom filter of the trigrams of its messages, kept in external RAM and in another side file.
+ *
+ *     The log is enough to rebuild the index: if the index misses the last records (power lost between the two
+ *     appends) or is missing altogether, it is rebuilt from the log on load(). Read and deleted states not yet
+ *     compacted into the log are lost in the latter case.
+ *
+ *     The INI partitions of older firmware are migrated into the log on the first load() (see INTERNAL_FLASH.txt).
  */
 class Messages {
 public:
@@ -244,15 +314,16 @@ public:
       return pos_;
     }
     bool      valid()                             {
-      return cnt_ > 0 && ((delta_ >= 0) ? (pos_ < arr_.size()) : (arr_.size() >= -pos_));
+      int32_t i = (pos_ - offset_) * delta_;
+      return cnt_ > 0 && i >= 0 && (size_t) i < arr_.size();
     }
 
   protected:
+    MessagesArray& arr_;
     int32_t offset_;
-    int32_t pos_;
     int32_t cnt_;
+    int32_t pos_;
     int8_t delta_ = 1;
-    MessagesArray& arr_;
   };
 
   /*
@@ -261,13 +332,14 @@ public:
   typedef uint32_t hash_t;           // we are using Murmur3_32 hash (seed 5381) to hashing text of the messages
 
   Messages();
+  ~Messages();
   bool load(uint32_t unixTime);
   void unload();
   bool isLoaded() {
     return this->loaded;
   }
   bool hasUnread() {
-    return this->loaded && this->index.isLoaded() && !this->index.isEmpty() && this->index[0].getIntValueSafe("u", 0) > 0;
+    return this->loaded && this->unreadCount > 0;
   }
 
   // Access interfaces
@@ -279,6 +351,49 @@ public:
 
   void clearPreloaded();
   int32_t preload(bool incoming, int32_t offset, int32_t count);       // this method accepts negative offsets (in Python style)
+  bool prefetch();
+
+  // Conversations: the messages with one other URI, in both directions
+  struct Conversation {
+    hash_t hash;                  // of the URI
+    char* uriDyn;                 // normalized
+    uint32_t lastTime;            // of the newest message
+    int32_t count;                // of messages, 0 - all deleted
+    int32_t unread;
+  };
+  int32_t conversationsCount() {
+    return conversations.size();
+  };
+  const Conversation& getConversation(int32_t i) {
+    return conversations[i];
+  };
+  int32_t findConversation(const char* uri);                           // -1 - none
+  bool listConversations(LinearArray<int32_t, LA_EXTERNAL_RAM>& list); // those with messages, the most recent first
+  int32_t conversationSize(int32_t conversation) {
+    return conversation >= 0 && (size_t) conversation < conversations.size() ? conversations[conversation].count : 0;
+  };
+  int32_t preloadConversation(int32_t conversation, int32_t offset, int32_t count);  // like preload(), both directions
+
+  // Full-text search (case-insensitive for ASCII letters)
+  static const size_t MAX_SEARCH_LENGTH = 64;           // longer texts are cut
+  struct SearchStats {
+    int32_t segments;             // of the log
+    int32_t skipped;              // ruled out by their filters, not read
+    int32_t read;                 // messages read to check them
+    int32_t found;
+    uint32_t ms;
+  };
+  int32_t search(const char* text);                    // number of messages found, until the next search or change
+  int32_t preloadFound(int32_t offset, int32_t count); // like preload(), the messages found sorted by time
+  const SearchStats& searchStats() {
+    return lastSearch;
+  };
+
+  // Cache of the messages read from the log
+  void setCacheBudget(size_t bytes);
+  size_t cacheMemory() {
+    return cacheBytes;
+  };
 
   // Modification interfaces
   hash_t saveMessage(const char* text, const char* fromUri, const char* toUri,
@@ -292,27 +407,180 @@ public:
 protected:
   static const bool INCOMING = true;
   static const bool SENT = false;
-  static const int  PARTITION_SIZE = 100;       // maximum number of messages in a partition
+  static const int  COMPACT_MIN_DELETED = 50;   // compact the log when this many records (and at least a quarter) are deleted
+  static const int32_t PAGE_SIZE = 8;           // messages read from the log and cached together
+  static const size_t DEFAULT_CACHE_BUDGET = 48 * 1024;
+  static const size_t MESSAGE_OVERHEAD = 256;   // bytes of a MessageData besides its record (approximately)
+
+  static constexpr const char* logFile = "/msg_log.bin";
+  static constexpr const char* indexFile = "/msg_idx.bin";
+  static constexpr const char* logTmpFile = "/msg_log.tmp";
+  static constexpr const char* indexTmpFile = "/msg_idx.tmp";
+  static constexpr const char* conversationsFile = "/msg_conv.bin";
+  static constexpr const char* conversationsTmpFile = "/msg_conv.tmp";
+  static constexpr const char* filtersFile = "/msg_bloom.bin";
+  static constexpr const char* oldIndexFile = "/msg_index.ini";
+  static constexpr const char* oldIndexDoneFile = "/msg_index.old";       // migrated, partitions not removed yet
+  static constexpr const char* oldPartitionFileFormat = "/msg_%05d.ini";
+
+  // Both files start with this header
+  struct FileHeader {
+    char magic[4];                // "WMLG" - log, "WMIX" - index
+    uint16_t version;
+    uint16_t entrySize;           // of the index entries, 0 in the log
+    uint32_t reserved[2];
+  };
 
-  static constexpr const char* indexFile = "/msg_index.ini";
-  static constexpr const char* partitionFileFormat = "/msg_%05d.ini";
+  // Message flags, in the index (current) and in the log (as of the last compaction)
+  static const uint8_t FLAG_INCOMING  = 0x01;
+  static const uint8_t FLAG_UNREAD    = 0x02;
+  static const uint8_t FLAG_DELIVERED = 0x04;   // sent message acknowledged by the server
+  static const uint8_t FLAG_DELETED   = 0x80;   // only in the index
+
+  // Record in the log, followed by own URI, other URI and the text (not NUL-terminated)
+  struct RecordHeader {
+    uint16_t marker;              // RECORD_MARKER
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t time;
+    uint32_t ackTime;
+    uint16_t ownLen;
+    uint16_t otherLen;
+    uint16_t textLen;
+    uint16_t reserved2;
+  };
+  static const uint16_t RECORD_MARKER = 0x4d57;
+  static const size_t MAX_RECORD_SIZE = 0xffff;
+
+  // The conversations file has an entry per record: length of the key (uint8_t), then the key (not NUL-terminated)
+  static const size_t MAX_CONVERSATION_KEY = 96;          // CallerIdCache::MAX_URI_LENGTH; longer URIs are cut and hashed
+
+  // Search filters: one per segment of the log, bits set by FILTER_HASHES hashes of every trigram of the texts
+  static const uint32_t SEGMENT_RECORDS = 32;
+  static const size_t FILTER_BYTES = 1024;
+  static const int FILTER_HASHES = 3;
+
+  // Fixed-width index entry, entry N describes record N
+  struct IndexEntry {
+    uint32_t time;
+    hash_t hash;                  // of the text
+    uint32_t offset;              // of the record in the log
+    uint16_t length;              // of the record
+    uint8_t flags;
+    uint8_t reserved;
+  };
 
-  IniFile index;
+  // Message of a view, sorted by time (and then by record number)
+  struct ViewItem {
+    uint32_t time;
+    uint32_t record;
+  };
+  typedef LinearArray<ViewItem, LA_EXTERNAL_RAM> MessagesView;
+
+  LinearArray<IndexEntry, LA_EXTERNAL_RAM> entries;
+  MessagesView inbox;
+  MessagesView sent;
+  uint32_t logSize = 0;
+  bool logUnsynced = false;       // an append failed midway: the log may not end where the index does, load() again first
+  int32_t unreadCount = 0;
+  int32_t deletedCount = 0;
+
+  /* Description:
+   *     consecutive messages of a view: positions [page * PAGE_SIZE, page * PAGE_SIZE + count). Positions count from
+   *     the oldest message, so new messages (which are mostly the newest) don't move the pages before them.
+   */
+  struct CachedPage {
+    bool incoming;
+    int32_t page;
+    int32_t count;
+    uint32_t lastUse;             // cacheClock when last preloaded
+    size_t bytes;
+    MessageData* messages[PAGE_SIZE];
+  };
+
+  // Pages of messages read from the log, the least recently used ones evicted beyond the budget
+  LinearArray<CachedPage*, LA_EXTERNAL_RAM> cache;
+  size_t cacheBytes = 0;
+  size_t cacheBudget = DEFAULT_CACHE_BUDGET;
+  uint32_t cacheClock = 0;
+  int32_t prefetchPages[2];       // next pages to read ahead (in the direction of the last preload first), -1 - none
 
+  // Window of the messages last preloaded (owned by the cache), see iteratorCount()
   MessagesArray preloaded;
+  MessagesArray uncached;         // messages of the window not in the cache (dropped from it, or of a conversation)
   bool preloadedIncoming;
   int32_t preloadedRangeStart;
   int32_t preloadedRangeEnd;      // past last element
+  int32_t preloadedPages[2];      // first and last page of the window
+
+  LinearArray<Conversation, LA_EXTERNAL_RAM> conversations;
+  LinearArray<uint16_t, LA_EXTERNAL_RAM> recordConversation;      // of each record, as long as the index
 
-  // Cached partitions
-  IniFile part1;
-  IniFile part2;    // consecutive to part1
+  uint8_t* filtersDyn = NULL;     // FILTER_BYTES per segment
+  uint32_t filterSegments = 0;
+  uint32_t filteredRecords = 0;   // records of the log in the filters (all of them, unless a file operation failed)
+  LinearArray<uint32_t, LA_EXTERNAL_RAM> found;                   // records of the last search, sorted by time
+  SearchStats lastSearch;
 
   bool loaded = false;
 
-  int32_t countAll(bool incoming);
-  bool loadPartition(IniFile& part, int num);
-  bool findMessage(MessageData& data, IniFile& part, int32_t& section);
+  bool open();
+  bool create();
+  bool recover(uint32_t from);
+  bool append(File& log, File& idx, const char* ownUri, const char* otherUri, const char* text,
+              uint32_t time, uint32_t ackTime, uint8_t flags);
+  bool writeEntry(uint32_t record);
+  MessageData* readMessage(File& log, uint32_t record);
+  CachedPage* findPage(bool incoming, int32_t page);
+  CachedPage* loadPage(File& log, bool incoming, int32_t page);
+  void dropPage(size_t i);
+  void dropPages(bool incoming, int32_t fromPage);
+  void clearCache();
+  void evict();
+  void loadConversations();
+  void clearConversations();
+  bool addToConversation(uint32_t record, const char* key);
+  bool writeConversations(File& file, uint32_t from, uint32_t to);
+  bool readConversationKey(File& log, uint32_t record, char* key);
+  void removeFromConversation(uint32_t record, bool unread);
+  static void conversationKey(const char* uri, char* key);
+  int32_t preloadRecords(LinearArray<uint32_t, LA_EXTERNAL_RAM>& records, int32_t offset, int32_t count);
+  void loadFilters();
+  void clearFilters();
+  bool addToFilter(uint32_t record, const char* text);
+  bool writeFilters(uint32_t fromSegment);
+  bool mayContain(uint32_t segment, const char* text, size_t len);
+  bool readText(File& log, uint32_t record, char*& textDyn);
+  static void trigramBits(const char* s, uint32_t* bits);
+  void buildViews();
+  int32_t findInView(MessagesView& view, uint32_t time, uint32_t record);
+  int32_t findMessage(bool incoming, uint32_t time, hash_t hash);
+  void removeFromView(uint32_t record);
+  bool compact();
+  static void replaceCompacted();
+  bool migrate(uint32_t unixTime);
+  static void removeOldPartitions();
+
+  static int viewCompare(ViewItem* a, ViewItem* b);
+  static bool writeHeader(File& file, const char* magic, uint16_t entrySize);
+  static bool checkHeader(File& file, const char* magic, uint16_t entrySize);
+};
+
+/*
+ * Description:
+ *     outgoing SIP messages that were not acknowledged by the server yet, kept in a small INI file so that they survive a reboot.
+ *     Section 0 is the header; every other section is a MessageData with a numeric key ("k") by which TinySIP reports the delivery.
+ *     add() and take() store the file with storeLater(): a burst of messages and deliveries is one write.
+ */
+class MessageOutbox : public IniFile {
+public:
+  static constexpr const char* OutboxFile = "/msg_outbox.ini";
+
+  MessageOutbox() : IniFile(OutboxFile) {};
+
+  bool open();                        // load the file or create an empty one
+  uint32_t add(MessageData& msg);     // store a copy, return its key (0 - failed)
+  MessageData* take(uint32_t key);    // remove from the file and return it (to be deleted by the caller), NULL if not found
 };
 
 class Storage : public Preferences {
@@ -332,8 +600,7 @@ public:
 
   // Messages database
   Messages messages;
-  static int messageCompare(NanoIni::Section** a, NanoIni::Section** b);              // by time
-  static int messagePartitionCompare(NanoIni::Section** a, NanoIni::Section** b);     // by time
+  MessageOutbox outbox;
 
   // Configs for UdpSenderApp (only NVS)
   void loadUdpSender(const char*& ipDyn, int32_t& port, const char*& textDyn);
@@ -0,0 +1,415 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#include "Stun.h"
+#include <unistd.h>
+#include "lwip/sockets.h"
+
+StunClient stun;
+
+StunClient::StunClient() : serverDyn(NULL), serverPort(STUN_PORT), serverIp((uint32_t) 0) {
+  for (int i = 0; i < MAX_QUERIES; i++) {
+    queries[i].fd = -1;
+  }
+  clear();
+}
+
+StunClient::~StunClient() {
+  clear();
+  freeNull((void **) &serverDyn);
+}
+
+void StunClient::setServer(const char* hostPort) {
+  freeNull((void **) &serverDyn);
+  serverPort = STUN_PORT;
+  if (hostPort != NULL && *hostPort) {
+    serverDyn = strdup(hostPort);
+    char* colon = serverDyn ? strchr(serverDyn, ':') : NULL;
+    if (colon) {
+      *colon = '\0';
+      serverPort = atoi(colon + 1);
+      if (!serverPort) {
+        serverPort = STUN_PORT;
+      }
+    }
+  }
+  clear();
+}
+
+void StunClient::clear() {
+  serverIp = (uint32_t) 0;
+  localIp = publicIp = (uint32_t) 0;
+  portPreserving = -1;
+  serverFailed = false;
+  nMappings = nextMapping = 0;
+  for (int i = 0; i < MAX_QUERIES; i++) {
+    finish(queries[i]);
+  }
+}
+
+/* Description:
+ *     public address and port of a UDP socket that is already open (e.g. the SIP flow to the proxy).
+ *     If not known yet, a request is sent through the socket and false is returned: the caller keeps reading
+ *     the socket, passes STUN messages to received(), and asks again once received() returns true.
+ */
+bool StunClient::mapSocket(int fd, uint16_t localPort, IPAddress& addr, uint16_t& port) {
+  if (!enabled() || fd < 0 || !sameNetwork()) {
+    return false;
+  }
+  if (known(localPort, addr, port)) {
+    return true;
+  }
+  if (!findQuery(localPort)) {
+    start(fd, false, localPort);
+  }
+  return false;
+}
+
+/* Description:
+ *     public address and port of a local UDP port that is not bound yet (e.g. RTP port of the next call), if it was
+ *     learned by requestPort() or can be predicted. Doesn't query: a call is not held up waiting for the server.
+ *     A query of the port still going on is dropped, since its socket would keep the port busy.
+ */
+bool StunClient::mapPort(uint16_t localPort, IPAddress& addr, uint16_t& port) {
+  if (!enabled() || !sameNetwork()) {
+    return false;
+  }
+  Query* q = findQuery(localPort);
+  if (q && q->ownSocket) {
+    finish(*q);                 // too late: the port is about to be bound by the caller
+  }
+  return known(localPort, addr, port);
+}
+
+/* Description:
+ *     start learning the mapping of a local UDP port that is not bound yet; poll() finishes the query.
+ *     The port is bound to a temporary socket for the query; the NAT keeps the binding for a while after it's closed,
+ *     so the socket opened later on the same port gets the same mapping. The port must not be in use meanwhile.
+ */
+void StunClient::requestPort(uint16_t localPort) {
+  IPAddress addr;
+  uint16_t port;
+  if (!enabled() || !sameNetwork() || known(localPort, addr, port) || findQuery(localPort) || serverFailed) {
+    return;
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (fd < 0) {
+    log_e("STUN: no socket");
+    return;
+  }
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_port = htons(localPort);
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(fd, (struct sockaddr*) &local, sizeof(local)) != 0) {
+    log_e("STUN: port %d is busy", localPort);
+    close(fd);
+    return;
+  }
+  if (!start(fd, true, localPort)) {
+    close(fd);
+  }
+}
+
+bool StunClient::pending(uint16_t localPort) {
+  return findQuery(localPort) != NULL;
+}
+
+/* Description:
+ *     STUN message read from the socket given to mapSocket() by its owner.
+ * Return:
+ *     true if it answered the query of the port (mapSocket() knows the mapping now)
+ */
+bool StunClient::received(uint16_t localPort, const uint8_t* msg, size_t len) {
+  Query* q = findQuery(localPort);
+  if (q == NULL || q->ownSocket) {
+    log_d("STUN: unexpected message dropped (%d bytes)", (int) len);
+    return false;
+  }
+  return answer(*q, msg, len);
+}
+
+/* Description:
+ *     read responses on the temporary sockets, retransmit unanswered requests, give up on the server after
+ *     MAX_REQUESTS. Called from the main loop; never waits.
+ */
+void StunClient::poll(uint32_t msNow) {
+  uint8_t msg[MAX_MESSAGE_SIZE];
+  for (int i = 0; i < MAX_QUERIES; i++) {
+    Query& q = queries[i];
+    if (q.fd < 0) {
+      continue;
+    }
+    if (q.ownSocket) {
+      struct sockaddr_in from;
+      socklen_t fromLen = sizeof(from);
+      int got;
+      while (q.fd >= 0 && (got = recvfrom(q.fd, msg, sizeof(msg), MSG_DONTWAIT, (struct sockaddr*) &from, &fromLen)) > 0) {
+        if (from.sin_addr.s_addr == (uint32_t) serverIp && from.sin_port == htons(serverPort)) {
+          answer(q, msg, got);
+        } else {
+          log_d("STUN: unexpected datagram dropped (%d bytes)", got);
+        }
+        fromLen = sizeof(from);
+      }
+      if (q.fd < 0) {
+        continue;
+      }
+    }
+    if ((int32_t) (msNow - q.msSent) < (int32_t) q.rto) {
+      continue;
+    }
+    if (q.requests >= MAX_REQUESTS) {
+      log_e("STUN: no response from %s:%d", serverDyn, serverPort);
+      serverFailed = true;          // don't keep asking on this network
+      for (int j = 0; j < MAX_QUERIES; j++) {
+        finish(queries[j]);
+      }
+      return;
+    }
+    q.rto *= 2;
+    if (!send(q)) {
+      finish(q);
+    }
+  }
+}
+
+bool StunClient::resolveServer() {
+  if ((uint32_t) serverIp) {
+    return true;
+  }
+  if (!WiFi.hostByName(serverDyn, serverIp) || !(uint32_t) serverIp) {
+    log_e("STUN: could not resolve %s", serverDyn);
+    serverIp = (uint32_t) 0;
+    serverFailed = true;
+    return false;
+  }
+  return true;
+}
+
+// Mappings belong to the network they were learned on: a new local address means a new NAT (or none)
+bool StunClient::sameNetwork() {
+  IPAddress ip = WiFi.localIP();
+  if (!(uint32_t) ip) {
+    return false;
+  }
+  if (ip != localIp) {
+    if ((uint32_t) localIp) {
+      log_d("STUN: network changed");
+    }
+    clear();
+    localIp = ip;
+  }
+  return true;
+}
+
+// Cached or predicted mapping
+bool StunClient::known(uint16_t localPort, IPAddress& addr, uint16_t& port) {
+  const Mapping* m = find(localPort);
+  if (m) {
+    addr = m->addr;
+    port = m->port;
+    return true;
+  }
+  if (portPreserving > 0 && (uint32_t) publicIp) {
+    log_d("STUN: port %d predicted", localPort);
+    addr = publicIp;
+    port = localPort;
+    remember(localPort, addr, port);
+    return true;
+  }
+  return false;
+}
+
+bool StunClient::start(int fd, bool ownSocket, uint16_t localPort) {
+  if (serverFailed || !resolveServer()) {
+    return false;
+  }
+  Query* q = NULL;
+  for (int i = 0; i < MAX_QUERIES && !q; i++) {
+    if (queries[i].fd < 0) {
+      q = &queries[i];
+    }
+  }
+  if (q == NULL) {
+    log_d("STUN: too many queries, port %d not asked", localPort);
+    return false;
+  }
+  q->fd = fd;
+  q->ownSocket = ownSocket;
+  q->localPort = localPort;
+  for (size_t i = 0; i < TRANSACTION_ID_SIZE; i += 4) {
+    uint32_t r = Random.random();
+    memcpy(q->txId + i, &r, 4);
+  }
+  q->requests = 0;
+  q->rto = RTO_MS;
+  if (!send(*q)) {
+    q->fd = -1;               // the socket is closed by the caller
+    return false;
+  }
+  return true;
+}
+
+bool StunClient::send(Query& q) {
+  uint8_t req[HEADER_SIZE];
+  size_t reqLen = bindingRequest(req, sizeof(req), q.txId);
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(serverPort);
+  server.sin_addr.s_addr = (uint32_t) serverIp;
+  if (sendto(q.fd, req, reqLen, 0, (struct sockaddr*) &server, sizeof(server)) != (int) reqLen) {
+    log_e("STUN: send failed");
+    return false;
+  }
+  q.requests++;
+  q.msSent = millis();
+  return true;
+}
+
+// Response to the query: remember the mapping and finish
+bool StunClient::answer(Query& q, const uint8_t* msg, size_t len) {
+  IPAddress addr;
+  uint16_t port;
+  if (!parseResponse(msg, len, q.txId, addr, port)) {
+    log_d("STUN: unexpected message dropped (%d bytes)", (int) len);
+    return false;
+  }
+  log_i("STUN: mapped %s:%d", addr.toString().c_str(), port);
+  publicIp = addr;
+  remember(q.localPort, addr, port);
+  finish(q);
+  return true;
+}
+
+void StunClient::finish(Query& q) {
+  if (q.fd >= 0 && q.ownSocket) {
+    close(q.fd);
+  }
+  q.fd = -1;
+}
+
+StunClient::Query* StunClient::findQuery(uint16_t localPort) {
+  for (int i = 0; i < MAX_QUERIES; i++) {
+    if (queries[i].fd >= 0 && queries[i].localPort == localPort) {
+      return &queries[i];
+    }
+  }
+  return NULL;
+}
+
+const StunClient::Mapping* StunClient::find(uint16_t localPort) {
+  for (int i = 0; i < nMappings; i++) {
+    if (mappings[i].localPort == localPort) {
+      return &mappings[i];
+    }
+  }
+  return NULL;
+}
+
+void StunClient::remember(uint16_t localPort, IPAddress addr, uint16_t port) {
+  Mapping* m;
+  if (nMappings < MAX_MAPPINGS) {
+    m = &mappings[nMappings++];
+  } else {
+    m = &mappings[nextMapping];
+    nextMapping = (nextMapping + 1) % MAX_MAPPINGS;
+  }
+  m->localPort = localPort;
+  m->addr = addr;
+  m->port = port;
+
+  // One port remapped is enough to stop predicting
+  if (port != localPort) {
+    portPreserving = 0;
+  } else if (portPreserving < 0) {
+    portPreserving = 1;
+  }
+}
+
+/* Description:
+ *     compose a Binding request without attributes.
+ * Return:
+ *     length of the message, 0 if it doesn't fit
+ */
+size_t StunClient::bindingRequest(uint8_t* msg, size_t size, const uint8_t* txId) {
+  if (size < HEADER_SIZE) {
+    return 0;
+  }
+  msg[0] = BINDING_REQUEST >> 8;
+  msg[1] = BINDING_REQUEST & 0xff;
+  msg[2] = msg[3] = 0;                // message length (attributes only)
+  msg[4] = MAGIC_COOKIE >> 24;
+  msg[5] = (MAGIC_COOKIE >> 16) & 0xff;
+  msg[6] = (MAGIC_COOKIE >> 8) & 0xff;
+  msg[7] = MAGIC_COOKIE & 0xff;
+  memcpy(msg + 8, txId, TRANSACTION_ID_SIZE);
+  return HEADER_SIZE;
+}
+
+// STUN message header: two zero bits, then the magic cookie (RFC 5389, 6). RTP starts with version 2 instead (RFC 7983).
+bool StunClient::isStun(const uint8_t* msg, size_t len) {
+  return len >= HEADER_SIZE && (msg[0] & 0xC0) == 0 &&
+         msg[4] == (MAGIC_COOKIE >> 24) && msg[5] == ((MAGIC_COOKIE >> 16) & 0xff) &&
+         msg[6] == ((MAGIC_COOKIE >> 8) & 0xff) && msg[7] == (MAGIC_COOKIE & 0xff);
+}
+
+/* Description:
+ *     parse a Binding success response to the request with transaction ID `txId`.
+ *     XOR-MAPPED-ADDRESS is preferred; MAPPED-ADDRESS is accepted from RFC 3489 servers. Only IPv4.
+ */
+bool StunClient::parseResponse(const uint8_t* msg, size_t len, const uint8_t* txId, IPAddress& addr, uint16_t& port) {
+  if (!isStun(msg, len) || memcmp(msg + 8, txId, TRANSACTION_ID_SIZE)) {
+    return false;
+  }
+  uint16_t type = (msg[0] << 8) | msg[1];
+  size_t bodyLen = (msg[2] << 8) | msg[3];
+  if (type == BINDING_ERROR) {
+    log_e("STUN: error response");
+    return false;
+  }
+  if (type != BINDING_SUCCESS || (bodyLen & 3) || HEADER_SIZE + bodyLen > len) {
+    return false;
+  }
+
+  bool found = false;
+  size_t off = HEADER_SIZE;
+  const size_t end = HEADER_SIZE + bodyLen;
+  while (off + 4 <= end) {
+    uint16_t attr = (msg[off] << 8) | msg[off+1];
+    uint16_t attrLen = (msg[off+2] << 8) | msg[off+3];
+    const uint8_t* v = msg + off + 4;
+    if (off + 4 + attrLen > end) {
+      return false;
+    }
+    if ((attr == ATTR_XOR_MAPPED_ADDRESS || (attr == ATTR_MAPPED_ADDRESS && !found)) && attrLen >= 8 && v[1] == 0x01) {
+      bool xored = attr == ATTR_XOR_MAPPED_ADDRESS;
+      port = ((v[2] << 8) | v[3]) ^ (xored ? MAGIC_COOKIE >> 16 : 0);
+      for (int i = 0; i < 4; i++) {
+        addr[i] = v[4+i] ^ (xored ? (MAGIC_COOKIE >> (24 - 8*i)) & 0xff : 0);
+      }
+      found = true;
+      if (xored) {
+        break;
+      }
+    }
+    off += 4 + ((attrLen + 3) & ~3);      // values are padded to 4 bytes
+  }
+  return found;
+}
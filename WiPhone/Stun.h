@@ -0,0 +1,128 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef STUN_H
+#define STUN_H
+
+#include <WiFi.h>
+#include "helpers.h"
+
+/* Description:
+ *     minimal STUN client (RFC 5389, Binding method only) to learn the public (server reflexive) address and port
+ *     of a local UDP port behind NAT. TinySIP advertises them in Contact (UDP flow to the proxy) and in SDP (RTP port),
+ *     so that media can flow directly instead of through a relay.
+ *
+ *     Mappings are cached per local port until clear() or setServer() is called, or the local IP address changes
+ *     (i.e. until a network change). Once the NAT is seen keeping the local port number (a common case), the mapping
+ *     of any other port is predicted without asking the server.
+ *
+ *     Queries don't block: mapSocket() and requestPort() send the request, poll() (main loop) retransmits it after
+ *     RTO_MS, doubling, up to MAX_REQUESTS times, and reads the responses of the sockets opened by requestPort().
+ *     A socket of the caller (the SIP flow) is read by the caller only: it hands the STUN messages over to received()
+ *     and keeps everything else, so no SIP message is lost to a query. A server that doesn't answer is not asked
+ *     again until a network change.
+ *
+ * Testing:
+ *     setServer() accepts a literal address, e.g. of a local stand-in (see tools/SipHost/stun_standin.py);
+ *     bindingRequest() and parseResponse() are static and can be fed canned messages.
+ */
+class StunClient {
+public:
+
+  static const uint16_t STUN_PORT = 3478;
+  static constexpr const char* DEFAULT_SERVER = "stun.l.google.com:19302";
+
+  static const uint32_t MAGIC_COOKIE = 0x2112A442;
+  static const uint16_t BINDING_REQUEST = 0x0001;
+  static const uint16_t BINDING_SUCCESS = 0x0101;
+  static const uint16_t BINDING_ERROR = 0x0111;
+  static const uint16_t ATTR_MAPPED_ADDRESS = 0x0001;
+  static const uint16_t ATTR_XOR_MAPPED_ADDRESS = 0x0020;
+  static const size_t HEADER_SIZE = 20;
+  static const size_t TRANSACTION_ID_SIZE = 12;
+  static const size_t MAX_MESSAGE_SIZE = 548;         // RFC 5389, 7.1: path MTU unknown
+
+  static const uint32_t RTO_MS = 250;                 // RFC 5389 suggests 500 ms; a LAN or ISP server answers much sooner
+  static const int MAX_REQUESTS = 3;                  // gives up after 250 + 500 + 1000 ms
+  static const int MAX_MAPPINGS = 6;
+  static const int MAX_QUERIES = 3;                   // at a time: the SIP flow and RTP ports of the next calls
+
+  StunClient();
+  ~StunClient();
+
+  void setServer(const char* hostPort);               // "host[:port]", NULL or empty - disabled; forgets all mappings
+  bool enabled() {
+    return serverDyn != NULL;
+  };
+  void clear();                                       // forget mappings (network changed)
+
+  bool mapSocket(int fd, uint16_t localPort, IPAddress& addr, uint16_t& port);    // known, or queried through the socket
+  bool mapPort(uint16_t localPort, IPAddress& addr, uint16_t& port);              // known or predicted, never queried
+  void requestPort(uint16_t localPort);               // query for a port not bound yet (e.g. RTP of the next call)
+  bool pending(uint16_t localPort);                   // query of the port waiting for its response
+  bool received(uint16_t localPort, const uint8_t* msg, size_t len);            // STUN message read by mapSocket()'s caller
+  void poll(uint32_t msNow);
+
+  static size_t bindingRequest(uint8_t* msg, size_t size, const uint8_t* txId);
+  static bool parseResponse(const uint8_t* msg, size_t len, const uint8_t* txId, IPAddress& addr, uint16_t& port);
+  static bool isStun(const uint8_t* msg, size_t len);
+
+protected:
+  struct Mapping {
+    uint16_t localPort;
+    uint16_t port;
+    IPAddress addr;
+  };
+
+  // Request sent, response awaited
+  struct Query {
+    int fd;                           // -1 - none
+    bool ownSocket;                   // opened by requestPort(): read by poll(), closed when done
+    uint16_t localPort;
+    uint8_t txId[TRANSACTION_ID_SIZE];
+    int requests;                     // sent so far
+    uint32_t msSent;                  // of the last one
+    uint32_t rto;
+  };
+
+  char* serverDyn;
+  uint16_t serverPort;
+  IPAddress serverIp;                 // 0 - not resolved yet
+  bool serverFailed;                  // no answer: not asked again until a network change
+
+  IPAddress localIp;                  // local address the mappings were learned with
+  IPAddress publicIp;                 // last reflexive address seen
+  int8_t portPreserving;              // NAT keeps local port numbers: 1 - yes, 0 - no, -1 - not known yet
+
+  Mapping mappings[MAX_MAPPINGS];
+  uint8_t nMappings;
+  uint8_t nextMapping;                // oldest one, replaced when full
+
+  Query queries[MAX_QUERIES];
+
+  bool resolveServer();
+  bool sameNetwork();
+  bool known(uint16_t localPort, IPAddress& addr, uint16_t& port);
+  bool start(int fd, bool ownSocket, uint16_t localPort);
+  bool send(Query& q);
+  bool answer(Query& q, const uint8_t* msg, size_t len);
+  void finish(Query& q);
+  Query* findQuery(uint16_t localPort);
+  const Mapping* find(uint16_t localPort);
+  void remember(uint16_t localPort, IPAddress addr, uint16_t port);
+};
+
+extern StunClient stun;
+
+#endif // STUN_H
@@ -0,0 +1,630 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+/* Related RFCs:
+ *  - RFC 5246: The Transport Layer Security (TLS) Protocol Version 1.2 (session resumption: 7.3, abbreviated handshake)
+ *  - RFC 5077: Transport Layer Security (TLS) Session Resumption without Server-Side State (session tickets)
+ *  - RFC 3261: Session Initiation Protocol, Section 26.2 (SIPS) and RFC 5630 (use of SIPS)
+ */
+
+#include "TlsConnection.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <Preferences.h>
+#include "lwip/sockets.h"
+#include "mbedtls/version.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/error.h"
+
+// The session is serialized field by field: mbedtls_ssl_session_save() only appeared in 2.19, while the ESP32 core
+// ships 2.16. mbedTLS 3 made these fields private.
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#error "TLS_SIPConnection needs mbedTLS 2.x"
+#endif
+
+TlsSessionCache tlsSessions;
+
+struct TlsContext {
+  mbedtls_ssl_context ssl;
+};
+
+// Shared by all connections
+static struct {
+  bool inited = false;
+  bool caLoaded = false;
+  mbedtls_ssl_config conf;                      // server must be verified
+  mbedtls_ssl_config confUnverified;            // verification failure is only reported (see setVerify)
+  mbedtls_entropy_context entropy;
+  mbedtls_ctr_drbg_context drbg;
+  mbedtls_x509_crt ca;
+} tlsShared;
+
+static void logTlsError(const char* what, int res) {
+  char buff[100] = "";
+#ifdef MBEDTLS_ERROR_C
+  mbedtls_strerror(res, buff, sizeof(buff));
+#endif
+  log_e("TLS: %s failed: -0x%04x %s", what, -res, buff);
+}
+
+static bool initConfig(mbedtls_ssl_config* conf, int authmode) {
+  int res = mbedtls_ssl_config_defaults(conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if (res) {
+    logTlsError("configuration", res);
+    return false;
+  }
+  mbedtls_ssl_conf_rng(conf, mbedtls_ctr_drbg_random, &tlsShared.drbg);
+  mbedtls_ssl_conf_authmode(conf, authmode);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+  return true;
+}
+
+static bool initShared() {
+  if (tlsShared.inited) {
+    return true;
+  }
+  mbedtls_ssl_config_init(&tlsShared.conf);
+  mbedtls_ssl_config_init(&tlsShared.confUnverified);
+  mbedtls_entropy_init(&tlsShared.entropy);
+  mbedtls_ctr_drbg_init(&tlsShared.drbg);
+  mbedtls_x509_crt_init(&tlsShared.ca);
+
+  static const char pers[] = "WiPhone SIP";
+  int res = mbedtls_ctr_drbg_seed(&tlsShared.drbg, mbedtls_entropy_func, &tlsShared.entropy, (const unsigned char*) pers, strlen(pers));
+  if (res) {
+    logTlsError("seeding", res);
+    return false;
+  }
+  if (!initConfig(&tlsShared.conf, MBEDTLS_SSL_VERIFY_REQUIRED) || !initConfig(&tlsShared.confUnverified, MBEDTLS_SSL_VERIFY_OPTIONAL)) {
+    return false;
+  }
+  tlsShared.inited = true;
+  return true;
+}
+
+/* Description:
+ *     certificates of the authorities trusted to sign SIP server certificates (PEM, one or more). Without any, no server
+ *     can be verified, so only the connections of the accounts that don't require it succeed.
+ */
+bool TLS_SIPConnection::setCaChain(const char* pem) {
+  if (!initShared()) {
+    return false;
+  }
+  mbedtls_x509_crt_free(&tlsShared.ca);
+  mbedtls_x509_crt_init(&tlsShared.ca);
+  tlsShared.caLoaded = false;
+  if (pem != NULL) {
+    int res = mbedtls_x509_crt_parse(&tlsShared.ca, (const unsigned char*) pem, strlen(pem) + 1);      // PEM length includes the terminator
+    if (res < 0) {
+      logTlsError("CA certificates", res);
+    } else {
+      if (res > 0) {
+        log_e("TLS: %d CA certificates skipped", res);
+      }
+      tlsShared.caLoaded = true;
+    }
+  }
+  mbedtls_x509_crt* chain = tlsShared.caLoaded ? &tlsShared.ca : NULL;
+  mbedtls_ssl_conf_ca_chain(&tlsShared.conf, chain, NULL);
+  mbedtls_ssl_conf_ca_chain(&tlsShared.confUnverified, chain, NULL);
+  return tlsShared.caLoaded;
+}
+
+/* Description:
+ *     serialize the fields a client needs to resume a session, and the hostname the server was verified for.
+ *     The peer certificate is left out: it was verified when the session was established and an abbreviated handshake
+ *     doesn't send it again, so the session must not be offered when connecting to the same address by another name.
+ * Return:
+ *     length, 0 if it doesn't fit
+ */
+static size_t packSession(const mbedtls_ssl_session* s, const char* host, uint8_t* buff, size_t size) {
+  size_t ticketLen = 0;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  ticketLen = s->ticket != NULL ? s->ticket_len : 0;
+#endif
+  size_t hostLen = host != NULL ? strlen(host) : 0;
+  size_t len = 1 + 1 + hostLen + 2 + 1 + 1 + sizeof(s->id) + sizeof(s->master) + 2 + 4 + ticketLen;
+  if (len > size || hostLen > 255 || s->id_len > sizeof(s->id)) {
+    return 0;
+  }
+  uint8_t* p = buff;
+  *p++ = 2;                           // format version
+  *p++ = hostLen;
+  memcpy(p, host, hostLen);
+  p += hostLen;
+  *p++ = s->ciphersuite >> 8;
+  *p++ = s->ciphersuite & 0xff;
+  *p++ = s->compression;
+  *p++ = s->id_len;
+  memcpy(p, s->id, sizeof(s->id));
+  p += sizeof(s->id);
+  memcpy(p, s->master, sizeof(s->master));
+  p += sizeof(s->master);
+  uint32_t lifetime = 0;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  lifetime = s->ticket_lifetime;
+#endif
+  *p++ = ticketLen >> 8;
+  *p++ = ticketLen & 0xff;
+  for (int i = 3; i >= 0; i--) {
+    *p++ = (lifetime >> (8*i)) & 0xff;
+  }
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  if (ticketLen) {
+    memcpy(p, s->ticket, ticketLen);
+  }
+#endif
+  return len;
+}
+
+// Counterpart of packSession(), only for the same `host`; `s` must be initialized, the ticket gets allocated (freed by mbedtls_ssl_session_free)
+static bool unpackSession(const uint8_t* buff, size_t len, const char* host, mbedtls_ssl_session* s) {
+  size_t hostLen = host != NULL ? strlen(host) : 0;
+  const size_t fixed = 1 + 1 + hostLen + 2 + 1 + 1 + sizeof(s->id) + sizeof(s->master) + 2 + 4;
+  if (len < fixed || buff[0] != 2 || buff[1] != hostLen || memcmp(buff + 2, host, hostLen)) {
+    return false;       // older format, or verified for another name
+  }
+  const uint8_t* p = buff + 2 + hostLen;
+  s->ciphersuite = (p[0] << 8) | p[1];
+  p += 2;
+  s->compression = *p++;
+  s->id_len = *p++;
+  if (s->id_len > sizeof(s->id)) {
+    return false;
+  }
+  memcpy(s->id, p, sizeof(s->id));
+  p += sizeof(s->id);
+  memcpy(s->master, p, sizeof(s->master));
+  p += sizeof(s->master);
+  size_t ticketLen = (p[0] << 8) | p[1];
+  p += 2;
+  uint32_t lifetime = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+  p += 4;
+  if (fixed + ticketLen != len) {
+    return false;
+  }
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  if (ticketLen) {
+    s->ticket = (unsigned char*) malloc(ticketLen);
+    if (s->ticket == NULL) {
+      return false;
+    }
+    memcpy(s->ticket, p, ticketLen);
+    s->ticket_len = ticketLen;
+    s->ticket_lifetime = lifetime;
+  }
+#else
+  if (ticketLen && !s->id_len) {
+    return false;       // ticket only, but tickets are not supported
+  }
+#endif
+  return true;
+}
+
+static void logVerifyFailure(uint32_t flags) {
+  char info[200];
+  mbedtls_x509_crt_verify_info(info, sizeof(info), "", flags);
+  log_e("TLS: server certificate not trusted: %s", info);
+}
+
+// Socket I/O for mbedTLS: the socket is non-blocking, waiting is done by the callers (see waitSocket)
+static int tlsSend(void* ctx, const unsigned char* buf, size_t len) {
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  flags = MSG_NOSIGNAL;
+#endif
+  int res = send(*(int*) ctx, buf, len, flags);
+  if (res < 0) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+  }
+  return res;
+}
+
+static int tlsRecv(void* ctx, unsigned char* buf, size_t len) {
+  int res = recv(*(int*) ctx, buf, len, 0);
+  if (res < 0) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+  }
+  return res;         // 0 - closed by the server
+}
+
+TLS_SIPConnection::TLS_SIPConnection() : Connection(), tlsDyn(NULL), hostnameDyn(NULL), sock(-1), mRemotePort(0), mLocalPort(0),
+  verifyServer(true), wasResumed(false), wasVerified(false), msHandshake(0) {
+  _connected = false;
+}
+
+TLS_SIPConnection::~TLS_SIPConnection() {
+  stop();
+  freeNull((void **) &hostnameDyn);
+}
+
+void TLS_SIPConnection::setHostname(const char* host) {
+  freeNull((void **) &hostnameDyn);
+  IPAddress literal;
+  if (host != NULL && *host && !literal.fromString(host)) {
+    hostnameDyn = strdup(host);               // server name indication is not sent for addresses (RFC 6066, 3)
+  }
+}
+
+int TLS_SIPConnection::connect(IPAddress &ip, uint16_t port, int32_t timeout) {
+  stop();
+  if (!initShared()) {
+    return 0;
+  }
+  mRemoteIP = ip;
+  mRemotePort = port;
+  wasResumed = wasVerified = false;
+  msHandshake = 0;
+  if (!connectSocket(timeout)) {
+    stop();
+    return 0;
+  }
+
+  tlsDyn = new TlsContext;
+  mbedtls_ssl_init(&tlsDyn->ssl);
+  int res = mbedtls_ssl_setup(&tlsDyn->ssl, verifyServer ? &tlsShared.conf : &tlsShared.confUnverified);
+  if (res) {
+    logTlsError("setup", res);
+    stop();
+    return 0;
+  }
+  if (hostnameDyn) {
+    mbedtls_ssl_set_hostname(&tlsDyn->ssl, hostnameDyn);
+  }
+  mbedtls_ssl_set_bio(&tlsDyn->ssl, &sock, tlsSend, tlsRecv, NULL);
+
+  // Offer the last session with this server
+  mbedtls_ssl_session offered;
+  mbedtls_ssl_session_init(&offered);
+  uint8_t buff[TlsSessionCache::MAX_SESSION_SIZE];
+  size_t len = tlsSessions.load(ip, port, buff, sizeof(buff));
+  bool resuming = len && unpackSession(buff, len, hostnameDyn, &offered) && mbedtls_ssl_set_session(&tlsDyn->ssl, &offered) == 0;
+
+  uint32_t msStart = millis();
+  noDelay(true);          // handshake messages go out as soon as written, not after the ACK of the previous one (Nagle)
+  bool ok = handshake(timeout > (int32_t) HANDSHAKE_TIMEOUT_MS ? timeout : HANDSHAKE_TIMEOUT_MS);
+  noDelay(false);         // SIP messages are written in small pieces: let TCP coalesce them
+  msHandshake = millis() - msStart;
+
+  if (ok) {
+    // A resumed session keeps its master secret, a full handshake derives a new one
+    const mbedtls_ssl_session* s = tlsDyn->ssl.session;
+    wasResumed = resuming && s != NULL && !memcmp(s->master, offered.master, sizeof(s->master));
+    tlsSessions.record(wasResumed, msHandshake);
+    log_i("TLS: %s handshake with %s:%d in %u ms, %s", wasResumed ? "resumed" : "full", ip.toString().c_str(), port,
+          msHandshake, mbedtls_ssl_get_ciphersuite(&tlsDyn->ssl));
+    uint32_t flags = mbedtls_ssl_get_verify_result(&tlsDyn->ssl);      // a resumed session was verified when it was new
+    wasVerified = !flags;
+    if (flags) {
+      logVerifyFailure(flags);
+      tlsSessions.forget(ip, port);         // not to be resumed: the server was not verified
+    } else if (s != NULL && (len = packSession(s, hostnameDyn, buff, sizeof(buff))) > 0) {
+      tlsSessions.save(ip, port, buff, len);          // new ticket or session
+    }
+    _connected = true;
+  } else {
+    log_e("TLS: handshake with %s:%d failed after %u ms", ip.toString().c_str(), port, msHandshake);
+    uint32_t flags = mbedtls_ssl_get_verify_result(&tlsDyn->ssl);
+    if (flags && flags != (uint32_t) -1) {
+      logVerifyFailure(flags);
+    }
+    if (resuming) {
+      tlsSessions.forget(ip, port);         // in case the session itself was the problem
+    }
+    stop();
+  }
+  mbedtls_ssl_session_free(&offered);
+  return ok ? 1 : 0;
+}
+
+bool TLS_SIPConnection::connectSocket(int32_t timeout) {
+  sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0) {
+    log_e("TLS: no socket");
+    return false;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(mRemotePort);
+  addr.sin_addr.s_addr = (uint32_t) mRemoteIP;
+  if (::connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+    log_e("TLS: connect failed: errno = %d", errno);
+    return false;
+  }
+  if (!waitSocket(true, timeout > 0 ? timeout : 0)) {
+    log_e("TLS: connect timeout");
+    return false;
+  }
+  int err = 0;
+  socklen_t errLen = sizeof(err);
+  if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err) {
+    log_e("TLS: connect failed: errno = %d", err);
+    return false;
+  }
+  struct sockaddr_in local;
+  socklen_t localLen = sizeof(local);
+  if (getsockname(sock, (struct sockaddr*) &local, &localLen) == 0) {
+    mLocalPort = ntohs(local.sin_port);
+  }
+  return true;
+}
+
+bool TLS_SIPConnection::handshake(uint32_t msTimeout) {
+  uint32_t msStart = millis();
+  int res;
+  while ((res = mbedtls_ssl_handshake(&tlsDyn->ssl)) != 0) {
+    if (res != MBEDTLS_ERR_SSL_WANT_READ && res != MBEDTLS_ERR_SSL_WANT_WRITE) {
+      logTlsError("handshake", res);
+      return false;
+    }
+    uint32_t elapsed = millis() - msStart;
+    if (elapsed >= msTimeout || !waitSocket(res == MBEDTLS_ERR_SSL_WANT_WRITE, msTimeout - elapsed)) {
+      log_e("TLS: handshake timeout");
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TLS_SIPConnection::waitSocket(bool forWrite, uint32_t ms) {
+  fd_set set;
+  FD_ZERO(&set);
+  FD_SET(sock, &set);
+  struct timeval tv = { (time_t) (ms / 1000), (long) (ms % 1000) * 1000 };
+  return select(sock + 1, forWrite ? NULL : &set, forWrite ? &set : NULL, NULL, &tv) > 0;
+}
+
+void TLS_SIPConnection::noDelay(bool on) {
+  int val = on ? 1 : 0;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+}
+
+void TLS_SIPConnection::stop() {
+  if (tlsDyn != NULL) {
+    if (_connected) {
+      mbedtls_ssl_close_notify(&tlsDyn->ssl);       // best effort, not waiting for the socket
+    }
+    mbedtls_ssl_free(&tlsDyn->ssl);
+    delete tlsDyn;
+    tlsDyn = NULL;
+  }
+  if (sock >= 0) {
+    close(sock);
+    sock = -1;
+  }
+  _connected = false;
+}
+
+uint8_t TLS_SIPConnection::connected() {
+  if (!_connected || sock < 0) {
+    return false;
+  }
+  if (mbedtls_ssl_get_bytes_avail(&tlsDyn->ssl)) {
+    return true;
+  }
+  // Closed by the server?
+  uint8_t dummy;
+  int res = recv(sock, &dummy, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (res == 0 || (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    log_d("TLS: disconnected");
+    stop();
+    return false;
+  }
+  return true;
+}
+
+int TLS_SIPConnection::available() {
+  if (!_connected) {
+    return 0;
+  }
+  // Decrypt the next record, if it is there, without taking anything out of it
+  int res = mbedtls_ssl_read(&tlsDyn->ssl, NULL, 0);
+  if (res < 0 && res != MBEDTLS_ERR_SSL_WANT_READ && res != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    if (res != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+      logTlsError("read", res);
+    }
+    stop();
+    return 0;
+  }
+  return mbedtls_ssl_get_bytes_avail(&tlsDyn->ssl);
+}
+
+int32_t TLS_SIPConnection::read(uint8_t *buffer, uint32_t length) {
+  if (!_connected) {
+    return -1;
+  }
+  int res = mbedtls_ssl_read(&tlsDyn->ssl, buffer, length);
+  if (res > 0) {
+    return res;
+  }
+  if (res == MBEDTLS_ERR_SSL_WANT_READ || res == MBEDTLS_ERR_SSL_WANT_WRITE) {
+    return 0;
+  }
+  if (res != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY && res != 0) {
+    logTlsError("read", res);
+  }
+  stop();
+  return -1;
+}
+
+void TLS_SIPConnection::write(uint8_t *buffer, uint32_t length) {
+  uint32_t msStart = millis();
+  while (_connected && length > 0) {
+    int res = mbedtls_ssl_write(&tlsDyn->ssl, buffer, length);
+    if (res > 0) {
+      buffer += res;
+      length -= res;
+      continue;
+    }
+    uint32_t elapsed = millis() - msStart;
+    if ((res != MBEDTLS_ERR_SSL_WANT_WRITE && res != MBEDTLS_ERR_SSL_WANT_READ) || elapsed >= WRITE_TIMEOUT_MS ||
+        !waitSocket(res == MBEDTLS_ERR_SSL_WANT_WRITE, WRITE_TIMEOUT_MS - elapsed)) {
+      logTlsError("write", res);
+      stop();
+    }
+  }
+}
+
+int TLS_SIPConnection::fd() {
+  if (sock >= 0 && tlsDyn != NULL && mbedtls_ssl_get_bytes_avail(&tlsDyn->ssl)) {
+    return -1;        // decrypted data is waiting: select() on the socket wouldn't tell
+  }
+  return sock;
+}
+
+// TlsSessionCache
+
+TlsSessionCache::TlsSessionCache() : useCounter(0) {
+  memset(slots, 0, sizeof(slots));
+  memset(&fullStats, 0, sizeof(fullStats));
+  memset(&resumedStats, 0, sizeof(resumedStats));
+}
+
+TlsSessionCache::~TlsSessionCache() {
+  clear();
+}
+
+// NVS keys are limited to 15 characters: address and port in hex
+void TlsSessionCache::nvsKey(char* key, IPAddress ip, uint16_t port) {
+  sprintf(key, "%08x%04x", (unsigned) (uint32_t) ip, port);
+}
+
+TlsSessionCache::Slot* TlsSessionCache::find(IPAddress ip, uint16_t port) {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (slots[i].len && slots[i].ip == (uint32_t) ip && slots[i].port == port) {
+      return &slots[i];
+    }
+  }
+  return NULL;
+}
+
+TlsSessionCache::Slot* TlsSessionCache::remember(IPAddress ip, uint16_t port, const uint8_t* session, size_t len) {
+  Slot* s = find(ip, port);
+  if (s == NULL) {
+    s = &slots[0];
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      if (!slots[i].len) {
+        s = &slots[i];
+        break;
+      }
+      if (slots[i].used < s->used) {
+        s = &slots[i];
+      }
+    }
+  }
+  uint8_t* copy = (uint8_t*) malloc(len);
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy, session, len);
+  freeNull((void **) &s->sessionDyn);
+  s->sessionDyn = copy;
+  s->ip = (uint32_t) ip;
+  s->port = port;
+  s->len = len;
+  s->used = ++useCounter;
+  return s;
+}
+
+size_t TlsSessionCache::load(IPAddress ip, uint16_t port, uint8_t* buff, size_t size) {
+  Slot* s = find(ip, port);
+  if (s == NULL) {
+    // Not used since boot: maybe persisted
+    size_t len = 0;
+#if TLS_SESSIONS_IN_NVS
+    char key[16];
+    nvsKey(key, ip, port);
+    Preferences nvs;
+    if (nvs.begin(nvsPage, true)) {
+      len = nvs.getBytes(key, buff, size);
+      nvs.end();
+    }
+#endif
+    if (!len || (s = remember(ip, port, buff, len)) == NULL) {
+      return 0;
+    }
+    log_d("TLS: session for %s:%d loaded from NVS", ip.toString().c_str(), port);
+  }
+  if (s->len > size) {
+    return 0;
+  }
+  memcpy(buff, s->sessionDyn, s->len);
+  s->used = ++useCounter;
+  return s->len;
+}
+
+void TlsSessionCache::save(IPAddress ip, uint16_t port, const uint8_t* session, size_t len) {
+  if (!len || len > MAX_SESSION_SIZE) {
+    return;
+  }
+  Slot* s = find(ip, port);
+  if (s != NULL && s->len == len && !memcmp(s->sessionDyn, session, len)) {
+    s->used = ++useCounter;
+    return;             // resumed without a new ticket: nothing to write
+  }
+  remember(ip, port, session, len);
+#if TLS_SESSIONS_IN_NVS
+  char key[16];
+  nvsKey(key, ip, port);
+  Preferences nvs;
+  if (nvs.begin(nvsPage, false)) {
+    if (nvs.putBytes(key, session, len) != len) {         // the master secret too: see the security note in TlsConnection.h
+      log_e("TLS: could not persist session");
+    }
+    nvs.end();
+  }
+#endif
+}
+
+void TlsSessionCache::forget(IPAddress ip, uint16_t port) {
+  Slot* s = find(ip, port);
+  if (s != NULL) {
+    freeNull((void **) &s->sessionDyn);
+    s->len = 0;
+  }
+  char key[16];
+  nvsKey(key, ip, port);
+  Preferences nvs;
+  if (nvs.begin(nvsPage, false)) {
+    nvs.remove(key);          // also when sessions are not persisted any more
+    nvs.end();
+  }
+}
+
+void TlsSessionCache::clear() {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    freeNull((void **) &slots[i].sessionDyn);
+    slots[i].len = 0;
+  }
+}
+
+void TlsSessionCache::record(bool resumed, uint32_t ms) {
+  Stats& st = resumed ? resumedStats : fullStats;
+  st.count++;
+  st.msLast = ms;
+  st.msTotal += ms;
+  if (ms > st.msMax) {
+    st.msMax = ms;
+  }
+}
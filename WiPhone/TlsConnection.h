@@ -0,0 +1,190 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef TLS_CONNECTION_H
+#define TLS_CONNECTION_H
+
+#include "tinySIP.h"
+
+/* Description:
+ *     TLS sessions negotiated with SIP servers, so that reconnecting (e.g. after roaming to another access point)
+ *     takes an abbreviated handshake: one round trip and no public key operations instead of a few seconds.
+ *
+ *     Sessions are opaque blobs here (serialized by TLS_SIPConnection), kept per server address in RAM only, so the
+ *     first connection after a reboot takes a full handshake. Only sessions with a verified server are kept (a resumed
+ *     session is not verified again).
+ *
+ *     Security: a session contains its master secret. Building with TLS_SESSIONS_IN_NVS 1 also keeps sessions in NVS
+ *     (written only when a server hands out a new session or ticket) so that they survive a reboot, but NVS stores
+ *     them as they are: only do so with flash and NVS encryption (CONFIG_NVS_ENCRYPTION). Otherwise anyone who can
+ *     read the flash can decrypt the signalling of the connections made with the session (past ones too, if recorded),
+ *     and resume it until the server expires it.
+ *
+ *     Also keeps the handshake timing since boot, full and resumed apart.
+ */
+#ifndef TLS_SESSIONS_IN_NVS
+#define TLS_SESSIONS_IN_NVS 0
+#endif
+
+class TlsSessionCache {
+public:
+
+  static const int MAX_SESSIONS = 4;                  // in RAM; NVS (if used) keeps any number (one key per server)
+  static const size_t MAX_SESSION_SIZE = 512;         // session tickets are typically under 200 bytes
+  static constexpr const char* nvsPage = "tls_sessions";
+
+  struct Stats {
+    uint16_t count;
+    uint32_t msLast;
+    uint32_t msTotal;
+    uint32_t msMax;
+  };
+
+  TlsSessionCache();
+  ~TlsSessionCache();
+
+  size_t load(IPAddress ip, uint16_t port, uint8_t* buff, size_t size);     // length of the session, 0 - none
+  void save(IPAddress ip, uint16_t port, const uint8_t* session, size_t len);
+  void forget(IPAddress ip, uint16_t port);
+  void clear();                                       // RAM only: persisted sessions are loaded again when needed
+
+  void record(bool resumed, uint32_t ms);
+  const Stats& stats(bool resumed) {
+    return resumed ? resumedStats : fullStats;
+  };
+
+protected:
+  struct Slot {
+    uint32_t ip;
+    uint16_t port;
+    uint16_t len;                   // 0 - empty slot
+    uint32_t used;                  // for replacing the least recently used one
+    uint8_t* sessionDyn;
+  };
+
+  Slot slots[MAX_SESSIONS];
+  uint32_t useCounter;
+  Stats fullStats;
+  Stats resumedStats;
+
+  Slot* find(IPAddress ip, uint16_t port);
+  Slot* remember(IPAddress ip, uint16_t port, const uint8_t* session, size_t len);
+  static void nvsKey(char* key, IPAddress ip, uint16_t port);
+};
+
+extern TlsSessionCache tlsSessions;
+
+struct TlsContext;        // mbedTLS state of a connection (TlsConnection.cpp)
+
+/* Description:
+ *     SIP over TLS (RFC 3261, 26.2: transport=tls, port 5061 by default) on top of mbedTLS and a plain lwIP socket.
+ *
+ *     The session of every successful handshake is kept in tlsSessions and offered on the next connection to the same
+ *     server: a session ticket (RFC 5077) or a session ID the server still remembers lets it resume the session
+ *     in one round trip. Each handshake is logged with its time, and whether it was full or resumed.
+ *
+ *     The server certificate must verify against the trusted certificates (see setCaChain()) and match the hostname,
+ *     otherwise the handshake fails. An account can turn this off with setVerify(false): the failure is only logged
+ *     then, and the session is not kept, so that it is never resumed.
+ *
+ *     mbedTLS state (mostly the record buffers, 2 x 16 KB) only exists while connected. Configuration, random
+ *     generator and the trusted certificates are shared by all connections.
+ *
+ *     Every write() is sent as a TLS record right away, like TCP_SIPConnection sends it in a TCP segment.
+ *     Decrypted data already buffered by mbedTLS is invisible to select(), so fd() returns -1 while there is some.
+ *
+ * Testing:
+ *     tools/SipHost/tls_standin.py is a local TLS server answering SIP requests; "./sip_host -t" connects to it
+ *     repeatedly and reports which handshakes were resumed (see README.txt there).
+ */
+class TLS_SIPConnection : public Connection {
+public:
+
+  static const uint32_t HANDSHAKE_TIMEOUT_MS = 15000;         // full handshake with an RSA-2048 server takes ~3 s on the ESP32
+  static const uint32_t WRITE_TIMEOUT_MS = 2000;
+
+  TLS_SIPConnection();
+  ~TLS_SIPConnection();
+
+  static bool setCaChain(const char* pem);                            // NULL - none: only unverified connections work
+  void setHostname(const char* host);                                 // SNI and the name the certificate must match
+  void setVerify(bool required) {                                     // for the next connect(); required by default
+    verifyServer = required;
+  };
+  bool verified() {                     // the server of the last handshake was verified (possibly when the session was new)
+    return wasVerified;
+  };
+
+  bool resumed() {                      // last handshake was an abbreviated one
+    return wasResumed;
+  };
+  uint32_t handshakeMs() {
+    return msHandshake;
+  };
+
+  bool isUdp() {
+    return false;
+  }
+  bool isTcp() {
+    return false;
+  }
+  bool isTls() {
+    return true;
+  }
+
+  uint8_t connected();
+  IPAddress remoteIP() {
+    return mRemoteIP;
+  }
+  uint16_t remotePort() {
+    return mRemotePort;
+  }
+  uint16_t localPort() {
+    return mLocalPort;
+  }
+  void stop();
+  int available();
+  int32_t read(uint8_t *buffer, uint32_t length);
+  void write(uint8_t *buffer, uint32_t length);
+  int connect(IPAddress &ip, uint16_t port, int32_t timeout);
+  int beginPacket(IPAddress /*ip*/, uint16_t /*port*/) {
+    log_e("tls should not call beginPacket!");
+    return 0;
+  }
+  int endPacket() {
+    log_e("tls should not call endPacket!");
+    return 0;
+  }
+  void flush() {}                       // nothing is buffered on the way out
+  int fd();
+
+protected:
+  TlsContext* tlsDyn;
+  char* hostnameDyn;
+  int sock;
+  IPAddress mRemoteIP;
+  uint16_t mRemotePort;
+  uint16_t mLocalPort;
+  bool verifyServer;
+  bool wasResumed;
+  bool wasVerified;
+  uint32_t msHandshake;
+
+  bool connectSocket(int32_t timeout);
+  bool handshake(uint32_t msTimeout);
+  bool waitSocket(bool forWrite, uint32_t ms);
+  void noDelay(bool on);
+};
+
+#endif // TLS_CONNECTION_H
@@ -29,6 +29,10 @@ governing permissions and limitations under the License.
 #include "config.h"
 #include "clock.h"
 #include "Audio.h"
+#include "CallTrace.h"
+#include "Stun.h"
+#include "TlsConnection.h"
+#include "Presence.h"
 #include "lwip/api.h"
 #include <WiFi.h>
 #include "Networks.h"
@@ -937,13 +941,21 @@ void setup() {
 
 // # # # # # # # # # # # # # # # # # # # # # # # # # # # #  MAIN LOOP  # # # # # # # # # # # # # # # # # # # # # # # # # # # #
 
-TinySIP sip;
+TinySIP sipMain;                      // primary SIP account
+TinySIP* sip = &sipMain;              // the account whose call the GUI is handling (primary, unless another one rings)
+SipPool sipPool;                      // connections shared by the SIP accounts registered at the same time
+LinearArray<TinySIP*, LA_INTERNAL_RAM> sipOthers;     // accounts kept registered besides the primary one
 char lastKeys[7];         // TODO: use RingBuffer?
 uint32_t msLastKeyPress = 0;        // for any button being pressed
 uint32_t msLastKeyInput = 0;        // for the keyboard timeouts during alphanumeric intputs
 uint32_t msPowerOffStarted = 0;
 uint32_t msHangingUp = 0;
 uint32_t msHungUp = 0;
+uint32_t msCallStarted = 0;           // INVITE sent or incoming call accepted
+bool rtpPrepared = false;             // RTP socket and audio path are ready for the call being set up
+bool firstAudioPending = false;       // time to first audio is not reported yet
+uint16_t earlyMediaPort = 0;          // remote port of the early media being played, 0 - none
+uint8_t  earlyMediaFormat = TinySIP::NULL_RTP_PAYLOAD;
 uint32_t msLastRtpPacket = 0;
 uint32_t msLastBatt = 0;
 uint32_t msLastUsbCheck = 0;
@@ -968,6 +980,231 @@ bool lastTurnOff = true;
 
 uint32_t last_lora_send = 0;
 
+/* Description:
+ *     copy remote audio session configs from the last SDP received
+ * Return:
+ *     true if they are sufficient to start an RTP session
+ */
+bool remoteAudioConfig(IPAddress& rtpRemoteIP, int& rtpRemotePort, uint8_t& audioFormat) {
+  if (!rtpRemoteIP.fromString(sip->getRemoteAudioAddr())) {
+    rtpRemoteIP = resolveDomain(sip->getRemoteAudioAddr());
+    if (!(uint32_t) rtpRemoteIP) {
+      log_e("couldn't parse IP address from \"%s\"", sip->getRemoteAudioAddr());
+    }
+  }
+  rtpRemotePort = sip->getRemoteAudioPort();
+  audioFormat = sip->getAudioFormat();
+  log_d("  RTP rmt addr: %8X", (uint32_t) rtpRemoteIP);
+  log_d("  RTP rmt port: %d", rtpRemotePort);
+  log_d("  Audio format:  %d", audioFormat);
+  return (uint32_t)rtpRemoteIP && rtpRemotePort && audioFormat != TinySIP::NULL_RTP_PAYLOAD;
+}
+
+/* Description:
+ *     get the RTP socket and audio path ready while the call is being set up, so that no audio gets clipped when it starts
+ */
+void prepareCallAudio(uint32_t now) {
+  msCallStarted = now;
+  rtpPrepared = firstAudioPending = true;
+  earlyMediaPort = 0;
+  earlyMediaFormat = TinySIP::NULL_RTP_PAYLOAD;
+  audio->prepareRtp(sip->getLocalAudioPort());
+}
+
+/* Description:
+ *     undo prepareCallAudio(): power the audio down and forget the early media, also when the call being set up
+ *     ends without being established (rejected, failed, declined, hung up while ringing)
+ */
+void releaseCallAudio() {
+  audio->shutdown();
+  rtpPrepared = firstAudioPending = false;
+  earlyMediaPort = 0;
+  earlyMediaFormat = TinySIP::NULL_RTP_PAYLOAD;
+}
+
+/* Description:
+ *     apply the media session renegotiated during the call (hold / resume, new address or codec):
+ *     while nothing flows either way the audio pipeline stays powered down
+ */
+void updateCallAudio() {
+  IPAddress rtpRemoteIP((uint32_t) 0);
+  int rtpRemotePort = 0;
+  uint8_t audioFormat = TinySIP::NULL_RTP_PAYLOAD;
+  uint8_t dir = sip->mediaDirection();
+  log_d("media direction: %d", dir);
+  if (remoteAudioConfig(rtpRemoteIP, rtpRemotePort, audioFormat) || !(dir & TinySIP::MEDIA_SEND)) {
+    audio->updateRtpStream(audioFormat, rtpRemoteIP, rtpRemotePort, dir & TinySIP::MEDIA_SEND, dir & TinySIP::MEDIA_RECV);
+  } else {
+    log_e("audio session update failure");
+  }
+  gui.state.callOnHold = sip->isOnHold();
+  gui.state.callRemoteHold = sip->isRemoteHold();
+}
+
+/* Description:
+ *     NAT traversal for the SIP accounts: STUN server of the primary account (key "t"), none - local addresses are advertised.
+ *     Setting it also forgets the public addresses learned before (e.g. on another network).
+ */
+void initStun() {
+  const char* server = NULL;
+  CriticalFile ini(SipAccountsApp::filename);
+  if ((ini.load() || ini.restore()) && !ini.isEmpty()) {
+    for (auto si = ini.iterator(1); si.valid(); ++si) {
+      if (si->hasKey("m")) {
+        server = si->getValueSafe("t", "");
+        break;
+      }
+    }
+  }
+  stun.setServer(server);
+}
+
+/* Description:
+ *     SIP over TLS: servers are verified against /sip_ca.pem (the user's choice) or else the CAs that come with
+ *     the firmware (same as for OTA), loaded once. An account with key "i" (insecure) doesn't require verification:
+ *     for providers whose CA is not there; such connections are never resumed (see TLS_SIPConnection).
+ */
+void initTls() {
+  static bool loaded = false;
+  if (!TLS_SIP) {
+    return;
+  }
+  bool verify = true;
+  CriticalFile ini(SipAccountsApp::filename);
+  if ((ini.load() || ini.restore()) && !ini.isEmpty()) {
+    for (auto si = ini.iterator(1); si.valid(); ++si) {
+      if (si->hasKey("m")) {
+        verify = !si->hasKey("i");
+        break;
+      }
+    }
+  }
+  sipMain.verifyTlsServer(verify);
+  if (!verify) {
+    log_e("TLS: the server of the primary account is not verified");
+  }
+  if (loaded) {
+    return;
+  }
+  const char* fname = SPIFFS.exists("/sip_ca.pem") ? "/sip_ca.pem" : SPIFFS.exists("/user.pem") ? "/user.pem" : "/wiphone.pem";
+  File f = SPIFFS.open(fname);
+  if (!f) {
+    log_e("TLS: no CA certificates, only accounts that don't verify the server can connect");
+    TLS_SIPConnection::setCaChain(NULL);
+    loaded = true;
+    return;
+  }
+  size_t size = f.size();
+  char* pemDyn = (char*) extMalloc(size + 1);
+  if (pemDyn != NULL) {
+    size = f.read((uint8_t*) pemDyn, size);
+    pemDyn[size] = '\0';
+    loaded = TLS_SIPConnection::setCaChain(pemDyn);
+    log_i("TLS: CA certificates from %s", fname);
+  }
+  f.close();
+  freeNull((void **) &pemDyn);
+}
+
+/* Description:
+ *     register the other accounts marked "keep registered" (besides the primary one) on the same proxy connections.
+ *     Only accounts with the same transport as the primary one are used: the transport is a global setting.
+ */
+void initOtherSipAccounts(const uint8_t* mac) {
+  for (auto it = sipOthers.iterator(); it.valid(); ++it) {
+    delete *it;
+  }
+  sipOthers.clear();
+
+  CriticalFile ini(SipAccountsApp::filename);
+  if (!(ini.load() || ini.restore()) || ini.isEmpty() || !ini[0].hasKey("v") || strcmp(ini[0]["v"], "1")) {
+    return;
+  }
+  for (auto si = ini.iterator(1); si.valid(); ++si) {
+    if (si->hasKey("m") || !si->hasKey("r") || !si->hasKey("s")) {
+      continue;
+    }
+    bool udp = !strcmp(si->getValueSafe("u", ""), "UDP-SIP");
+    bool tls = !strcmp(si->getValueSafe("u", ""), "TLS-SIP");
+    if (udp != UDP_SIP || tls != TLS_SIP) {
+      log_e("account %s skipped: transport differs from the primary account", si->getValueSafe("s", ""));
+      continue;
+    }
+    TinySIP* account = new TinySIP();
+    if (account==NULL || !sipPool.attach(account)) {
+      log_e("no more SIP accounts: %s", si->getValueSafe("s", ""));
+      delete account;
+      break;
+    }
+    sipOthers.add(account);
+    account->verifyTlsServer(!si->hasKey("i"));      // see initTls()
+    if (!account->init(si->getValueSafe("d", ""), si->getValueSafe("s", ""), si->getValueSafe("p", ""), mac)) {
+      log_e("failed to connect SIP account %s", si->getValueSafe("s", ""));     // checkCall() keeps reconnecting
+    }
+  }
+  log_d("SIP accounts registered besides the primary: %d", sipOthers.size());
+}
+
+/* Description:
+ *     keep the accounts that are not handling the current call going: keepalives, registration refreshes, messages.
+ *     An incoming call on one of them becomes the current call when the phone is idle. Calls that cannot be taken
+ *     are answered "486 Busy Here" by TinySIP itself, as the pool knows another account is busy.
+ * Return:
+ *     the account that got an incoming call, NULL otherwise.
+ */
+TinySIP* checkOtherSipAccounts(uint32_t now) {
+  TinySIP* ringing = NULL;
+  for (int i = -1; i < (int) sipOthers.size(); i++) {
+    TinySIP* account = i < 0 ? &sipMain : sipOthers[i];
+    if (account == sip) {
+      continue;
+    }
+    TinySIP::StateFlags_t res;
+    do {
+      res = account->checkCall(now);
+      if ((res & TinySIP::EVENT_INCOMING_CALL) && account->isBusy()) {      // not busy: it has replied 486 already
+        if (ringing == NULL && gui.state.sipState == CallState::Idle) {
+          ringing = account;
+        } else {
+          account->declineCall();
+        }
+      }
+    } while (res & TinySIP::EVENT_MORE_BUFFER);
+  }
+  return ringing;
+}
+
+static const char* CALL_TRACE_FILE = "/call_trace.log";
+
+/* Description:
+ *     end the call setup trace: write its events to the log and, if an SD card is present, append them to CALL_TRACE_FILE
+ */
+void dumpCallTrace() {
+  callTrace.finish();
+  const size_t size = 48 + CallTrace::RING_SIZE * 40;
+  char* buff = (char*) extMalloc(size);
+  if (buff == NULL) {
+    log_e("no memory for call trace");
+    return;
+  }
+  callTrace.report(buff, size);
+  log_i("%s", buff);
+  if (gui.state.cardPresent) {
+    File file = SD.open(CALL_TRACE_FILE, FILE_APPEND);
+    if (file) {
+      file.print(buff);
+      file.close();
+    } else {
+      log_e("failed to open %s", CALL_TRACE_FILE);
+    }
+  }
+  freeNull((void **) &buff);
+}
+
+// When idle, the main loop sleeps in select() on SIP sockets for up to this long instead of spinning.
+// Keypad and GPIO extender events are flagged by interrupts, so they are picked up at most this late.
+static const uint32_t IDLE_WAIT_MS = 10;
+
 void loop() {
   while (1) {
     uint32_t now = millis();
@@ -1109,11 +1346,11 @@ void loop() {
           gui.state.setSipState(CallState::InvitingCallee);
         } else if (!memcmp(lastKeys + 2, "301**", 5)) {    // **103##
           log_d("Easter egg = 103: send register request");
-          sip.registration();
+          sip->registration();
         } else if (!memcmp(lastKeys + 2, "601**", 5)) {    // **106##
           //log_d("Easter egg = 106: send message test");
           log_d("Easter egg = 106: send message test. Add a sip account in WiPhone.ino to use this test");
-          sip.sendMessage("sip:user@host.com", "Hello from WiPhone");
+          sip->sendMessage("sip:user@host.com", "Hello from WiPhone");
         } else if (!memcmp(lastKeys + 2, "701", 5)) {    // **107##
           log_d("Easter egg = 107: test motor and blink LED");
           allDigitalWrite(VIBRO_MOTOR_CONTROL, HIGH);
@@ -1226,6 +1463,9 @@ void loop() {
       updateMessageTimes = false;
     }
 
+    // Deferred INI file writes
+    IniFile::syncDue(now);
+
     /*if (wifiState.isConnected()) {
       const char* host = "phonetester";
       MDNSResponder mdnsResponder; // = new MDNSResponder();
@@ -1382,7 +1622,7 @@ void loop() {
 
     //Added: check if disconnected from wif during call
     if (gui.state.hasSipAccount() && !wifiState.isConnected()) {
-      if (sip.isBusy()) {
+      if (sip->isBusy()) {
         log_d("Device disconnected from WIFI");
         log_d("Call will be terminated");
 
@@ -1391,7 +1631,7 @@ void loop() {
         audio->shutdown();
         audio->setVolumes(restoreSpeakerVol, restoreHeadphonesVol, restoreLoudspeakerVol);
 
-        sip.wifiTerminateCall();  // wifi is disconnected but need to destroy this dialogue
+        sip->wifiTerminateCall();  // wifi is disconnected but need to destroy this dialogue
         gui.exitCall();
         
         gui.state.setSipState(CallState::HungUp);
@@ -1405,12 +1645,16 @@ void loop() {
         /*
          * in order to do ping and update staled state.
         */
-        //sip.checkCall(now);
+        //sip->checkCall(now);
       }
     }
 
     /*check if remote party is disconnected during call*/
-    if (rtpSilentPeriod == RTP_SILENT_ON) {
+    if (rtpSilentPeriod == RTP_SILENT_ON && sip->mediaDirection() != TinySIP::MEDIA_SENDRECV) {
+
+      rtpSilentPeriod = RTP_SILENT_OFF;     // on hold the remote party doesn't have to send anything
+
+    } else if (rtpSilentPeriod == RTP_SILENT_ON) {
 
       rtpSilentPeriod = RTP_SILENT_OFF;
 
@@ -1422,10 +1666,10 @@ void loop() {
         audio->shutdown();
         audio->setVolumes(restoreSpeakerVol, restoreHeadphonesVol, restoreLoudspeakerVol);
 
-        if (sip.isBusy()) {
+        if (sip->isBusy()) {
           log_d("No RTP Packets From Remote Part");  // Send logs msgs with wifi disconnection
 
-          sip.rtpSilent();
+          sip->rtpSilent();
           gui.exitCall();
 
           gui.state.setSipState(CallState::HungUp);
@@ -1449,34 +1693,51 @@ void loop() {
         // Connect to SIP proxy
         uint8_t mac[6];
         wifiState.getMac(mac);
-        if (sip.init( gui.state.fromNameDyn,
+        sip = &sipMain;
+        sipPool.attach(&sipMain);
+        initStun();
+        initTls();
+        if (sip->init( gui.state.fromNameDyn,
                       gui.state.fromUriDyn,
                       gui.state.proxyPassDyn,
                       mac )) {
-          sip.triedToMakeCallCounter = 0;
+          sip->triedToMakeCallCounter = 0;
           log_d("Connected to SIP");
           gui.state.setSipState(CallState::Idle);
-          log_d("caller free (0) = %s", sip.isBusy() ? "NO" : "YES");
+          log_d("caller free (0) = %s", sip->isBusy() ? "NO" : "YES");
         } else {
           // Failed to connect to proxy
           log_e("failed to connect to SIP");
           gui.state.setSipState(CallState::Error);      // permanent error state  TODO
         }
+        initOtherSipAccounts(mac);
+        PhonebookApp::watchPresence(gui.flash, gui.state.fromUriDyn);      // the primary account subscribes for the phonebook
+        sipMain.watchPresence(true);
         Random.feed(now);
         gui.state.sipEnabled = true;
         gui.state.sipAccountChanged = false;
 
       } else if (gui.state.sipState == CallState::Idle) {
-        sip.triedToMakeCallCounter = 0;
+        sip = &sipMain;           // the call of another account is over
+        sip->triedToMakeCallCounter = 0;
         bool anySip = false;      // anything received?
         TinySIP::StateFlags_t res;
         do {
-          res = sip.checkCall(now);     // TODO: all of this logic could be reorganized to call checkCall in one place and then process results according to the current state
+          res = sip->checkCall(now);     // TODO: all of this logic could be reorganized to call checkCall in one place and then process results according to the current state
           if (res != TinySIP::EVENT_NONE && res != TinySIP::EVENT_RESPONSE_PARSED && res != TinySIP::EVENT_REQUEST_PARSED) {
             anySip = true;
           }
+          if (!(res & TinySIP::EVENT_INCOMING_CALL) && !(res & TinySIP::EVENT_MORE_BUFFER)) {
+            // Another account is ringing -> it is the current call now
+            TinySIP* ringing = checkOtherSipAccounts(now);
+            if (ringing != NULL) {
+              sip = ringing;
+              res |= TinySIP::EVENT_INCOMING_CALL;
+            }
+          }
           if (res & TinySIP::EVENT_INCOMING_CALL) {
-            gui.state.setRemoteNameUri(sip.getRemoteName(), sip.getRemoteUri());
+            const char* contactName = PhonebookApp::callerName(gui.flash, sip->getRemoteUri());     // the name in the phonebook
+            gui.state.setRemoteNameUri(contactName != NULL ? contactName : sip->getRemoteName(), sip->getRemoteUri());
             gui.becomeCallee();
             gui.state.setSipState(CallState::BeingInvited);
             startRingtone();
@@ -1485,10 +1746,14 @@ void loop() {
             gui.state.setSipState(CallState::Idle);
           }
         } while (res & TinySIP::EVENT_MORE_BUFFER);
-        bool isRegistered = sip.registrationValid(now);
+        bool isRegistered = sipMain.registrationValid(now);
+        gui.state.sipKeepaliveS = sipMain.keepaliveIntervalS();
+        gui.state.sipKeepaliveLearned = sipMain.keepaliveLearned();
+        gui.state.sipRegExpiresS = sipMain.registrationExpiresS();
+        gui.state.sipRegRefreshS = sipMain.registrationRefreshS();
         if (anySip || isRegistered != gui.state.sipRegistered) {
           log_d("setting reason @ CallState::Idle");
-          gui.state.setSipReason(sip.getReason());
+          gui.state.setSipReason(sip->getReason());
           // Force GUI to update screen
           appEventResult res = gui.processEvent(now, CALL_UPDATE_EVENT);
           // Force GUI to update screen if registration status has changed
@@ -1502,21 +1767,6 @@ void loop() {
           }
           gui.redrawScreen(res & REDRAW_HEADER, res & REDRAW_FOOTER, res & REDRAW_SCREEN);
 
-        } else if (gui.state.outgoingMessages.size()) {
-
-          // Send queued messages
-          MessageData* msg = gui.state.outgoingMessages[0];
-          if (msg) {
-            auto err = sip.sendMessage(msg->getOtherUri(), msg->getMessageText());
-            if (err == TINY_SIP_OK) {
-              gui.flash.messages.setSent(*msg);
-              delete msg;
-              gui.state.outgoingMessages.remove(0);
-            } else {
-              log_e("message sending FAILED");
-            }
-          }
-
         }
 
       } else if (gui.state.sipState == CallState::BeingInvited) {
@@ -1524,7 +1774,7 @@ void loop() {
         bool anySip = false;      // anything received
         TinySIP::StateFlags_t res;
         do {
-          res = sip.checkCall(now);
+          res = sip->checkCall(now);
           if (res != TinySIP::EVENT_NONE && res != TinySIP::EVENT_RESPONSE_PARSED && res != TinySIP::EVENT_REQUEST_PARSED) {
             anySip = true;
           }
@@ -1541,7 +1791,7 @@ void loop() {
         } while (res & TinySIP::EVENT_MORE_BUFFER);
         if (anySip) {
           log_d("setting reason @ CallState::BeingInvited");
-          gui.state.setSipReason(sip.getReason());
+          gui.state.setSipReason(sip->getReason());
           // Force GUI to update screen
           appEventResult res = gui.processEvent(now, CALL_UPDATE_EVENT);
           gui.redrawScreen(res & REDRAW_HEADER, res & REDRAW_FOOTER, res & REDRAW_SCREEN);
@@ -1552,8 +1802,9 @@ void loop() {
         log_v("Accepting call");
 
         stopRingtone();
-        int res = sip.acceptCall();
+        int res = sip->acceptCall();
         if (res == TINY_SIP_OK) {
+          prepareCallAudio(now);
           gui.state.setSipState(CallState::InvitedCallee);
         } else {
           log_e("could not accept call, err = %d", res);
@@ -1568,8 +1819,9 @@ void loop() {
         log_d("Declining call");
 
         stopRingtone();
+        releaseCallAudio();       // the call may have been accepted already (terminated @ InvitedCallee)
 
-        int res = sip.declineCall();
+        int res = sip->declineCall();
         if (res == TINY_SIP_OK) {
           gui.state.setSipState(CallState::HangingUp);
         } else {
@@ -1586,7 +1838,8 @@ void loop() {
 
         log_d("Calling: %s", gui.state.calleeUriDyn);
         if (strchr(gui.state.calleeUriDyn, '@') != NULL and  strlen(gui.state.calleeUriDyn)>0 and gui.state.sipRegistered) {
-          sip.startCall(gui.state.calleeUriDyn, now);
+          sip->startCall(gui.state.calleeUriDyn, now);
+          prepareCallAudio(now);
           // Proceed to next state
           gui.state.setSipState(CallState::InvitedCallee);
           gui.redrawScreen(true, true, true, true);         // TODO: one of two special cases of redrawAll
@@ -1603,38 +1856,33 @@ void loop() {
         uint8_t audioFormat = TinySIP::NULL_RTP_PAYLOAD;
 
         bool callEstablished = false;
+        bool earlyMedia = false;
         bool anySip = false;      // anything received
         TinySIP::StateFlags_t res;
         do {
-          res = sip.checkCall(now);
+          res = sip->checkCall(now);
           if (res != TinySIP::EVENT_NONE && res != TinySIP::EVENT_RESPONSE_PARSED && res != TinySIP::EVENT_REQUEST_PARSED) {
             anySip = true;
           }
           if (res & TinySIP::EVENT_CALL_CONFIRMED) {
             if (gui.state.sipState != CallState::Call) {  // change state only once
               log_d("call established");
+              log_i("call setup: answered in %d ms", now - msCallStarted);
               callEstablished = true;
 
               // Copy audio session configs
-              if (!rtpRemoteIP.fromString(sip.getRemoteAudioAddr())) {
-                rtpRemoteIP = resolveDomain(sip.getRemoteAudioAddr());
-                if (!(uint32_t) rtpRemoteIP) {
-                  log_e("couldn't parse IP address from \"%s\"", sip.getRemoteAudioAddr());
-                }
-              }
-              rtpRemotePort = sip.getRemoteAudioPort();
-              audioFormat = sip.getAudioFormat();
-              log_d("  RTP rmt addr: %8X", (uint32_t) rtpRemoteIP);
-              log_d("  RTP rmt port: %d", rtpRemotePort);
-              log_d("  Audio format:  %d", audioFormat);
-
-              if ((uint32_t)rtpRemoteIP && rtpRemotePort && audioFormat != TinySIP::NULL_RTP_PAYLOAD) {
-                rtpLocalPort = sip.getLocalAudioPort();
+              if (remoteAudioConfig(rtpRemoteIP, rtpRemotePort, audioFormat)) {
+                rtpLocalPort = sip->getLocalAudioPort();
                 log_d("  RTP loc port: %d", rtpLocalPort);
               }
               gui.state.setSipState(CallState::Call);
             }
+          } else if (res & TinySIP::EVENT_EARLY_MEDIA) {
+            log_d("early media");
+            earlyMedia = remoteAudioConfig(rtpRemoteIP, rtpRemotePort, audioFormat);
           } else if (res & TinySIP::EVENT_CALL_TERMINATED) {
+            releaseCallAudio();
+            earlyMedia = false;
             if (gui.state.sipState != CallState::HungUp) {
               gui.state.setSipState(CallState::Decline);
               log_d("call terminated @ InvitedCallee = %d", now);
@@ -1653,24 +1901,37 @@ void loop() {
         //work by techtesh
         if (anySip) {
           log_d("setting reason @ CallState::InvitedCallee");
-          gui.state.setSipReason(sip.getReason());
+          gui.state.setSipReason(sip->getReason());
           appEventResult res = gui.processEvent(now, CALL_UPDATE_EVENT);
           gui.redrawScreen(res & REDRAW_HEADER, res & REDRAW_FOOTER, res & REDRAW_SCREEN);
         }
 
+        // Play early media (ringback tone, announcements) from the 18x answer: the socket and audio path were prepared with the INVITE
+        if (earlyMedia && !callEstablished && (rtpRemotePort != earlyMediaPort || audioFormat != earlyMediaFormat)) {
+          audio->playRtpStream(audioFormat, rtpRemotePort);
+          earlyMediaPort = rtpRemotePort;
+          earlyMediaFormat = audioFormat;
+        }
+
         // Start audio only after the screen is updated
         if (callEstablished) {
           // If audio configs are OK -> turn on audio (speaker & microphone) & start listening to audio port
           if ((uint32_t)rtpRemoteIP && rtpRemotePort && audioFormat != TinySIP::NULL_RTP_PAYLOAD) {
-            audio->openRtpConnection(rtpLocalPort);
+            if (!rtpPrepared) {
+              audio->openRtpConnection(rtpLocalPort);
+            }
+            rtpPrepared = false;
             // This works the opposite of how you might expect. The ear speaker is what ends up getting muted. Probably need to remove after checking with Andriy.
             //audio->getVolumes(restoreSpeakerVol, restoreHeadphonesVol, restoreLoudspeakerVol);
             //audio->setVolume(-70, 6);                                   // max. volume for headphones, min. volume for speaker
             //audio->setVolumes(restoreSpeakerVol, restoreHeadphonesVol, Audio::MuteVolume);    // mute loudspeaker for calls
             audio->sendRtpStreamFromMic(audioFormat, rtpRemoteIP, rtpRemotePort);
-            audio->playRtpStream(audioFormat, rtpRemotePort);
+            if (rtpRemotePort != earlyMediaPort || audioFormat != earlyMediaFormat) {
+              audio->playRtpStream(audioFormat, rtpRemotePort);
+            }     // else: the early media stream just continues, nothing is reset
           } else {
             log_e("audio session failure");
+            releaseCallAudio();
             gui.state.setSipReason("audio failed");
             // Force GUI to update screen
             appEventResult res = gui.processEvent(now, CALL_UPDATE_EVENT);
@@ -1683,12 +1944,23 @@ void loop() {
         // Process any SIP requests quickly when call is established
 
         bool anySip = false;      // anything received
+        bool mediaUpdate = false;
+        if (gui.state.callHoldRequested) {
+          gui.state.callHoldRequested = false;
+          if (sip->holdCall(!sip->isOnHold()) != TINY_SIP_OK) {
+            gui.state.setSipReason("hold failed");
+            anySip = true;
+          }
+        }
         TinySIP::StateFlags_t res;
         do {
-          res = sip.checkCall(now);
+          res = sip->checkCall(now);
           if (res != TinySIP::EVENT_NONE && res != TinySIP::EVENT_RESPONSE_PARSED && res != TinySIP::EVENT_REQUEST_PARSED) {
             anySip = true;
           }
+          if (res & TinySIP::EVENT_MEDIA_UPDATE) {
+            mediaUpdate = true;
+          }
           if (res & TinySIP::EVENT_CALL_TERMINATED) {
             if (gui.state.sipState != CallState::HungUp) {
               audio->showAudioStats();
@@ -1699,15 +1971,18 @@ void loop() {
               msHungUp = now;
             } else if(gui.state.sipState == CallState::HungUp) {
               log_d("Hang up call before remote party answers it");
-              sip.declineCall();
+              sip->declineCall();
             }
-          } else if (res != TinySIP::EVENT_NONE && res != TinySIP::EVENT_RESPONSE_PARSED && res != TinySIP::EVENT_REQUEST_PARSED) {
+          } else if (res != TinySIP::EVENT_NONE && res != TinySIP::EVENT_RESPONSE_PARSED && res != TinySIP::EVENT_REQUEST_PARSED && !mediaUpdate) {
             log_d("UNPROCESSED CALL STATE (2): 0x%x", res);
           }
         } while (res & TinySIP::EVENT_MORE_BUFFER);
+        if (mediaUpdate && gui.state.sipState == CallState::Call) {
+          updateCallAudio();
+        }
         if (anySip) {
           log_d("setting reason @ CallState::Call");
-          gui.state.setSipReason(sip.getReason());
+          gui.state.setSipReason(sip->getReason());
           // Force GUI to update screen
           appEventResult res = gui.processEvent(now, CALL_UPDATE_EVENT);
           gui.redrawScreen(res & REDRAW_HEADER, res & REDRAW_FOOTER, res & REDRAW_SCREEN);
@@ -1718,7 +1993,7 @@ void loop() {
         bool anySip = false;      // anything received
         TinySIP::StateFlags_t res;
         do {
-          res = sip.checkCall(now);
+          res = sip->checkCall(now);
           if (res != TinySIP::EVENT_NONE && res != TinySIP::EVENT_RESPONSE_PARSED && res != TinySIP::EVENT_REQUEST_PARSED) {
             anySip = true;
           }
@@ -1737,11 +2012,11 @@ void loop() {
         if (anySip || elapsedMillis(now, msHangingUp, HANGUP_TIMEOUT_MS)) {
           if (anySip) {
             log_d("setting reason @ CallState::HangingUp");
-            gui.state.setSipReason(sip.getReason());
+            gui.state.setSipReason(sip->getReason());
           } else {
             log_d("hang up timeout");
             gui.state.setSipState(CallState::Idle);     // go straight to Idle on timeout
-            log_d("caller free (1) = %s", sip.isBusy() ? "NO" : "YES");
+            log_d("caller free (1) = %s", sip->isBusy() ? "NO" : "YES");
           }
 
           // Force GUI to update screen
@@ -1754,12 +2029,12 @@ void loop() {
         // User request to hangup call -> send BYE / CANCEL request
         log_d("Terminating call");
         stopRingtone();
-        // Stop media session
+        // Stop media session (or the one prepared for the call being set up)
         audio->showAudioStats();
-        audio->shutdown();
+        releaseCallAudio();
         audio->setVolumes(restoreSpeakerVol, restoreHeadphonesVol, restoreLoudspeakerVol);
 
-        int res = sip.terminateCall(now);
+        int res = sip->terminateCall(now);
         if (res == TINY_SIP_OK) {
           msHangingUp = now;
 
@@ -1780,7 +2055,7 @@ void loop() {
 
           log_d("hungup timeout: now = %d, msHungUp = %d", now, msHungUp);
           gui.state.setSipState(CallState::Idle);
-          log_d("caller free (2) = %s", sip.isBusy() ? "NO" : "YES");
+          log_d("caller free (2) = %s", sip->isBusy() ? "NO" : "YES");
           appEventResult res = gui.processEvent(now, CALL_UPDATE_EVENT);
           gui.redrawScreen(res & REDRAW_HEADER, res & REDRAW_FOOTER, res & REDRAW_SCREEN, true);       // TODO: one of two special cases of redrawAll
         }*/
@@ -1793,22 +2068,115 @@ void loop() {
 
           log_d("hungup timeout: now = %d, msHungUp = %d", now, msHungUp);
           gui.state.setSipState(CallState::Idle);
-          log_d("caller free (2) = %s", sip.isBusy() ? "NO" : "YES");
+          log_d("caller free (2) = %s", sip->isBusy() ? "NO" : "YES");
           appEventResult res = gui.processEvent(now, CALL_UPDATE_EVENT);
           gui.redrawScreen(res & REDRAW_HEADER, res & REDRAW_FOOTER, res & REDRAW_SCREEN, true);       // TODO: one of two special cases of redrawAll
         }
 
       }
 
-      // Check for incoming messages
-      TextMessage* msg = NULL;
-      if (msg = sip.checkMessage(now, ntpClock.getExactUtcTime(), ntpClock.isTimeKnown())) {
-        log_v("message received");
-        // Save message from external RAM into a file (part of message database)
-        gui.flash.messages.saveMessage(msg->message, msg->from, msg->to, true, msg->useTime ? msg->utcTime : 0);    // time == 0 for unknown real time
-        delete msg;
-        // Pass event to GUI
-        appEventResult res = gui.processEvent(now, NEW_MESSAGE_EVENT);
+      // Time to first audio of a call: from the INVITE (or accepting a call) till the first RTP packet played
+      if (firstAudioPending && audio->firstPacketMillis()) {
+        log_i("call setup: first audio in %d ms%s", audio->firstPacketMillis() - msCallStarted, earlyMediaPort ? " (early media)" : "");
+        firstAudioPending = false;
+      }
+
+      // Call setup trace is complete once the call is over
+      if (callTrace.active() && (gui.state.sipState == CallState::HungUp || gui.state.sipState == CallState::Idle)) {
+        dumpCallTrace();
+      }
+
+      if (gui.state.sipState != CallState::NotInited && gui.state.sipState != CallState::Error) {
+
+        // The other accounts (the idle state checks them itself, so that they can ring)
+        if (gui.state.sipState != CallState::Idle) {
+          checkOtherSipAccounts(now);
+        }
+
+        // Resend messages left in the outbox by the previous boot (keys below the next key at boot), oldest first,
+        // as the queue of TinySIP takes them; new messages wait until all of them are handed over
+        static bool outboxRestored = false;
+        static int32_t outboxBootKey = 0;       // next key when the outbox was opened
+        static int32_t outboxResentKey = 0;     // the last message handed over
+        if (!outboxRestored) {
+          outboxRestored = true;                // also if the file can't be read: nothing to resend then
+          if (gui.flash.outbox.open()) {
+            if (!outboxBootKey) {
+              outboxBootKey = gui.flash.outbox[0].getIntValueSafe("n", 1);
+            }
+            for (int i=1; i<gui.flash.outbox.nSections(); i++) {
+              int32_t key = gui.flash.outbox[i].getIntValueSafe("k", 0);
+              if (key <= outboxResentKey || key >= outboxBootKey) {
+                continue;
+              }
+              if (sipMain.outboxSize() >= TinySIP::MESSAGE_QUEUE) {
+                outboxRestored = false;         // the rest once some are delivered
+                break;
+              }
+              MessageData msg(gui.flash.outbox[i]);
+              if (sipMain.sendMessage(msg.getOtherUri(), msg.getMessageText(), key) != TINY_SIP_OK) {
+                log_e("outbox: message %d not resent", key);     // stays in the file until the next boot
+              }
+              outboxResentKey = key;
+            }
+          }
+        }
+
+        // Hand outgoing messages over to TinySIP: they are sent in any call state, the outbox file keeps them until delivered
+        while (outboxRestored && gui.state.outgoingMessages.size()) {
+          MessageData* msg = gui.state.outgoingMessages[0];
+          if (msg) {
+            if (sipMain.outboxSize() >= TinySIP::MESSAGE_QUEUE) {
+              break;
+            }
+            uint32_t key = gui.flash.outbox.add(*msg);
+            if (sipMain.sendMessage(msg->getOtherUri(), msg->getMessageText(), key) != TINY_SIP_OK) {
+              log_e("message sending FAILED");
+              gui.flash.outbox.take(key);     // never sent: forget it
+              break;
+            }
+            delete msg;
+          }
+          gui.state.outgoingMessages.remove(0);
+        }
+
+        // Delivery reports
+        MessageDelivery* delivery;
+        while (delivery = sipMain.checkDelivery()) {
+          MessageData* msg = gui.flash.outbox.take(delivery->id);
+          if (delivery->delivered) {
+            log_d("message delivered in %d ms", delivery->msLatency);
+            if (msg) {
+              gui.flash.messages.setSent(*msg);
+            }
+          } else {
+            log_e("message NOT delivered: %d, %d attempt(s)", delivery->code, delivery->attempts);
+          }
+          delete msg;
+          delete delivery;
+        }
+      }
+
+      // Check for incoming messages (of every account)
+      for (int i = -1; i < (int) sipOthers.size(); i++) {
+        TinySIP* account = i < 0 ? &sipMain : sipOthers[i];
+        TextMessage* msg = NULL;
+        if (msg = account->checkMessage(now, ntpClock.getExactUtcTime(), ntpClock.isTimeKnown())) {
+          log_v("message received");
+          // Save message from external RAM into a file (part of message database)
+          gui.flash.messages.saveMessage(msg->message, msg->from, msg->to, true, msg->useTime ? msg->utcTime : 0);    // time == 0 for unknown real time
+          delete msg;
+          // Pass event to GUI
+          appEventResult res = gui.processEvent(now, NEW_MESSAGE_EVENT);
+          gui.redrawScreen(res & REDRAW_HEADER, res & REDRAW_FOOTER, res & REDRAW_SCREEN);
+        }
+      }
+
+      // Presence of the phonebook contacts changed
+      static uint32_t presenceRevision = 0;
+      if (presence.revision() != presenceRevision) {
+        presenceRevision = presence.revision();
+        appEventResult res = gui.processEvent(now, PRESENCE_UPDATE_EVENT);
         gui.redrawScreen(res & REDRAW_HEADER, res & REDRAW_FOOTER, res & REDRAW_SCREEN);
       }
     } else {
@@ -1921,7 +2289,13 @@ void loop() {
     // Theoretically, gives time for modem sleep? Allows to consume less power?
     //delay(1);   // sleep for 1 millisecond
     //vTaskDelay(1);    // sleep for a single tick: allows context switch
-    taskYIELD();      // force context switch
+    if (gui.state.sipState == CallState::Idle && !audio->isOn() && !gui.state.ringing && !poweringOff &&
+        !keypadToRead && !gpioExtenderEvent && !headphoneEvent && keypadBuff.empty()) {
+      // Nothing needs the CPU: sleep until SIP data arrives or the idle slice passes
+      sipPool.pollConnections(IDLE_WAIT_MS);       // the connections of every account
+    } else {
+      taskYIELD();      // force context switch
+    }
 
     //esp_sleep_enable_timer_wakeup(1000000); // 0.001 s
     //int ret = esp_light_sleep_start();
@@ -1931,6 +2305,7 @@ void loop() {
 
 void powerOff() {
   log_i("POWER OFF");
+  IniFile::syncAll();
   allDigitalWrite(POWER_CONTROL, HIGH);       // produces a power down from software
   msPowerOffStarted = millis();
   poweringOff = true;
@@ -0,0 +1,576 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+/* Related RFCs:
+ *  - RFC 1035: Domain names - implementation and specification (message format, name compression)
+ *  - RFC 2782: A DNS RR for specifying the location of services (DNS SRV)
+ *  - RFC 3403: Dynamic Delegation Discovery System (DDDS) Part Three: The Domain Name System (DNS) Database (NAPTR)
+ *  - RFC 3263: Session Initiation Protocol (SIP): Locating SIP Servers
+ */
+
+#include "resolver.h"
+#include "Networks.h"
+#include "Storage.h"
+#include "clock.h"
+
+SipResolver::CacheEntry::CacheEntry(const char* domain, Transport_t transport) : transport(transport), nTargets(0), current(0), msExpires(0), utcExpires(0), stale(false) {
+  domainDyn = extStrdup(domain);
+}
+
+SipResolver::CacheEntry::~CacheEntry() {
+  freeNull((void **) &domainDyn);
+}
+
+SipResolver::SipResolver() : server((uint32_t) 0), serverPort(53), loaded(false) {
+  queryId = Random.random();
+}
+
+SipResolver::~SipResolver() {
+  clear();
+}
+
+void SipResolver::setServer(IPAddress server, uint16_t port) {
+  this->server = server;
+  this->serverPort = port;
+}
+
+void SipResolver::clear() {
+  for (auto it = cache.iterator(); it.valid(); ++it) {
+    delete *it;
+  }
+  cache.clear();
+}
+
+SipResolver::CacheEntry* SipResolver::find(const char* domain, Transport_t transport) {
+  for (auto it = cache.iterator(); it.valid(); ++it) {
+    if ((*it)->transport == transport && !strcasecmp((*it)->domainDyn, domain)) {
+      return *it;
+    }
+  }
+  return NULL;
+}
+
+/* Description:
+ *     find the server for SIP URI host. If `port` is non-zero (explicitly present in the URI), only A record is resolved (RFC 3263, 4.2).
+ *     Otherwise: NAPTR -> SRV -> A, using the cache if possible.
+ * Return:
+ *     true if resolved, `ip` and `targetPort` are set to the current target.
+ */
+bool SipResolver::resolve(const char* host, uint16_t port, Transport_t transport, IPAddress& ip, uint16_t& targetPort) {
+  if (isdigit(host[0]) && ip.fromString(host)) {
+    targetPort = port ? port : defaultPort(transport);
+    return true;
+  }
+  if (port) {
+    ip = resolveDomain(host);
+    targetPort = port;
+    return (uint32_t) ip != 0;
+  }
+
+  if (!loaded) {
+    load();
+  }
+
+  uint32_t msNow = millis();
+  CacheEntry* entry = find(host, transport);
+  if (entry!=NULL && !entry->stale && !elapsedMillis(msNow, entry->msExpires, 0) && entry->nTargets) {
+    log_d("DNS cache hit: %s", host);
+  } else {
+    CacheEntry* fresh = lookup(host, transport);
+    if (fresh!=NULL) {
+      if (entry!=NULL) {
+        cache.removeByValue(entry);
+        delete entry;
+      }
+      if (cache.size() >= MAX_DOMAINS) {
+        delete cache[0];
+        cache.remove(0);
+      }
+      cache.add(fresh);
+      entry = fresh;
+      store();
+    } else if (entry!=NULL && entry->nTargets) {
+      log_e("DNS failed, using expired records for %s", host);
+    } else {
+      // Last resort: whatever lwIP / mDNS can find
+      ip = resolveDomain(host);
+      targetPort = defaultPort(transport);
+      return (uint32_t) ip != 0;
+    }
+  }
+
+  ip = entry->targets[entry->current].ip;
+  targetPort = entry->targets[entry->current].port;
+  log_d("Resolved %s -> %s:%d (target %d of %d)", host, ip.toString().c_str(), targetPort, entry->current+1, entry->nTargets);
+  return true;
+}
+
+/* Description:
+ *     connecting to the current target for `host` failed -> switch to the next target (RFC 3263, Section 4.3).
+ * Return:
+ *     true if there was another target to try; false if all targets were tried (then the first target is returned again).
+ */
+bool SipResolver::failover(const char* host, Transport_t transport, IPAddress& ip, uint16_t& targetPort) {
+  CacheEntry* entry = find(host, transport);
+  if (entry==NULL || !entry->nTargets) {
+    return false;
+  }
+  bool more = true;
+  if (++entry->current >= entry->nTargets) {
+    entry->current = 0;
+    more = false;
+  }
+  ip = entry->targets[entry->current].ip;
+  targetPort = entry->targets[entry->current].port;
+  log_i("Failover %s -> %s:%d", host, ip.toString().c_str(), targetPort);
+  return more;
+}
+
+/* Description:
+ *     resolve a domain through the DNS server: NAPTR -> SRV -> A (RFC 3263, Section 4.1 and 4.2).
+ * Return:
+ *     new cache entry or NULL if the DNS server didn't answer or nothing was found.
+ */
+SipResolver::CacheEntry* SipResolver::lookup(const char* domain, Transport_t transport) {
+  LinearArray<Record*, LA_EXTERNAL_RAM> records;
+  char srvName[MAX_NAME] = "";
+  uint32_t ttl = MAX_TTL_S;
+  const char* service = transport == UDP ? "SIP+D2U" : transport == TCP ? "SIP+D2T" : "SIPS+D2T";
+
+  // 1) NAPTR
+  if (!query(domain, TYPE_NAPTR, records)) {
+    return NULL;
+  }
+  int best = -1;
+  for (size_t i=0; i<records.size(); i++) {
+    Record* r = records[i];
+    if (r->type == TYPE_NAPTR && !strcasecmp(r->service, service) && !strcasecmp(r->flags, "s") && r->target[0]) {
+      if (best < 0 || r->order < records[best]->order || (r->order == records[best]->order && r->preference < records[best]->preference)) {
+        best = i;
+      }
+    }
+  }
+  if (best >= 0) {
+    snprintf(srvName, sizeof(srvName), "%s", records[best]->target);
+    ttl = records[best]->ttl < ttl ? records[best]->ttl : ttl;
+    log_d("NAPTR %s -> %s", domain, srvName);
+  } else {
+    snprintf(srvName, sizeof(srvName), "%s.%s", transport == UDP ? "_sip._udp" : transport == TCP ? "_sip._tcp" : "_sips._tcp", domain);
+  }
+  clearRecords(records);
+
+  CacheEntry* entry = new CacheEntry(domain, transport);
+
+  // 2) SRV
+  if (query(srvName, TYPE_SRV, records)) {
+    for (size_t i=0; i<records.size() && entry->nTargets < MAX_TARGETS; i++) {
+      Record* r = records[i];
+      if (r->type != TYPE_SRV || !r->target[0]) {
+        continue;     // "." target means the service is decidedly not available
+      }
+      uint32_t addr, aTtl;
+      if (resolveA(r->target, records, addr, aTtl)) {
+        Target& t = entry->targets[entry->nTargets++];
+        t.ip = IPAddress(addr);
+        t.port = r->port;
+        t.priority = r->order;
+        t.weight = r->preference;
+        ttl = r->ttl < ttl ? r->ttl : ttl;
+        ttl = aTtl < ttl ? aTtl : ttl;
+        log_d("SRV %s -> %s:%d (%d/%d)", srvName, r->target, r->port, r->order, r->preference);
+      }
+    }
+    clearRecords(records);
+  }
+
+  // 3) A
+  if (!entry->nTargets && query(domain, TYPE_A, records)) {
+    for (size_t i=0; i<records.size() && entry->nTargets < MAX_TARGETS; i++) {
+      Record* r = records[i];
+      if (r->type == TYPE_A) {
+        Target& t = entry->targets[entry->nTargets++];
+        t.ip = IPAddress(r->addr);
+        t.port = defaultPort(transport);
+        t.priority = 0;
+        t.weight = 0;
+        ttl = r->ttl < ttl ? r->ttl : ttl;
+      }
+    }
+    clearRecords(records);
+  }
+
+  if (!entry->nTargets) {
+    delete entry;
+    return NULL;
+  }
+
+  orderTargets(entry->targets, entry->nTargets);
+  ttl = ttl < MIN_TTL_S ? MIN_TTL_S : ttl > MAX_TTL_S ? MAX_TTL_S : ttl;
+  entry->msExpires = millis() + ttl*1000;
+  entry->utcExpires = ntpClock.isTimeKnown() ? ntpClock.getExactUtcTime() + ttl : 0;
+  return entry;
+}
+
+/* Description:
+ *     find A record for a SRV target: first in the additional section of the SRV response, then by a separate query.
+ */
+bool SipResolver::resolveA(const char* name, LinearArray<Record*, LA_EXTERNAL_RAM>& additional, uint32_t& addr, uint32_t& ttl) {
+  for (auto it = additional.iterator(); it.valid(); ++it) {
+    if ((*it)->type == TYPE_A && !strcasecmp((*it)->name, name)) {
+      addr = (*it)->addr;
+      ttl = (*it)->ttl;
+      return true;
+    }
+  }
+  LinearArray<Record*, LA_EXTERNAL_RAM> records;
+  bool found = false;
+  if (query(name, TYPE_A, records)) {
+    for (auto it = records.iterator(); it.valid(); ++it) {
+      if ((*it)->type == TYPE_A) {
+        addr = (*it)->addr;
+        ttl = (*it)->ttl;
+        found = true;
+        break;
+      }
+    }
+  }
+  clearRecords(records);
+  return found;
+}
+
+/* Description:
+ *     order targets by SRV priority; within the same priority - weighted random order (RFC 2782, page 3)
+ */
+void SipResolver::orderTargets(Target* targets, uint8_t n) {
+  // Insertion sort by priority, zero weights first
+  for (int i=1; i<n; i++) {
+    Target t = targets[i];
+    int j = i - 1;
+    while (j >= 0 && (targets[j].priority > t.priority || (targets[j].priority == t.priority && targets[j].weight > 0 && t.weight == 0))) {
+      targets[j+1] = targets[j];
+      j--;
+    }
+    targets[j+1] = t;
+  }
+
+  // Weighted selection within each priority group
+  for (int start=0; start<n; ) {
+    int end = start;
+    while (end < n && targets[end].priority == targets[start].priority) {
+      end++;
+    }
+    for (int i=start; i<end-1; i++) {
+      uint32_t sum = 0;
+      for (int j=i; j<end; j++) {
+        sum += targets[j].weight;
+      }
+      uint32_t pick = sum ? Random.random() % (sum + 1) : 0;
+      uint32_t running = 0;
+      for (int j=i; j<end; j++) {
+        running += targets[j].weight;
+        if (running >= pick) {
+          Target t = targets[j];
+          for (int k=j; k>i; k--) {
+            targets[k] = targets[k-1];
+          }
+          targets[i] = t;
+          break;
+        }
+      }
+    }
+    start = end;
+  }
+}
+
+/* Description:
+ *     send a single DNS query and wait for the response
+ * Return:
+ *     true if the server responded (even if with no records or NXDOMAIN)
+ */
+bool SipResolver::query(const char* name, uint16_t type, LinearArray<Record*, LA_EXTERNAL_RAM>& records) {
+  IPAddress dns = (uint32_t) server ? server : WiFi.dnsIP();
+  if ((uint32_t) dns == 0) {
+    log_e("no DNS server");
+    return false;
+  }
+
+  // Compose the query
+  uint8_t msg[512];
+  uint16_t id = ++queryId;
+  size_t len = 0;
+  msg[len++] = id >> 8;
+  msg[len++] = id & 0xff;
+  msg[len++] = 0x01;      // RD: recursion desired
+  msg[len++] = 0x00;
+  msg[len++] = 0x00;      // QDCOUNT = 1
+  msg[len++] = 0x01;
+  memset(msg + len, 0, 6);
+  len += 6;
+  for (const char* label = name; *label; ) {
+    const char* dot = strchr(label, '.');
+    size_t labelLen = dot ? dot - label : strlen(label);
+    if (labelLen > 63 || len + labelLen + 6 > sizeof(msg)) {
+      log_e("bad domain name: %s", name);
+      return false;
+    }
+    msg[len++] = labelLen;
+    memcpy(msg + len, label, labelLen);
+    len += labelLen;
+    label += labelLen + (dot ? 1 : 0);
+  }
+  msg[len++] = 0x00;
+  msg[len++] = type >> 8;
+  msg[len++] = type & 0xff;
+  msg[len++] = 0x00;      // QCLASS = IN
+  msg[len++] = 0x01;
+
+  // Send & receive
+  WiFiUDP udp;
+  if (!udp.begin(0)) {
+    log_e("failed to open DNS socket");
+    return false;
+  }
+  bool res = false;
+  if (udp.beginPacket(dns, serverPort)) {
+    udp.write(msg, len);
+    if (udp.endPacket()) {
+      uint32_t msStart = millis();
+      while (!elapsedMillis(millis(), msStart, QUERY_TIMEOUT_MS)) {
+        if (udp.parsePacket() > 0) {
+          int got = udp.read(msg, sizeof(msg));
+          if (got > 0 && parseResponse(msg, got, id, records) >= 0) {
+            res = true;
+            break;
+          }
+        }
+        delay(5);
+      }
+    }
+  }
+  udp.stop();
+  if (!res) {
+    log_e("DNS query timed out: %s (type %d)", name, type);
+  }
+  return res;
+}
+
+/* Description:
+ *     read domain name (with compression) at offset `off` of the message
+ * Return:
+ *     offset right after the name in the original position, -1 if malformed
+ */
+int SipResolver::readName(const uint8_t* msg, size_t len, size_t off, char* name, size_t nameSize) {
+  int after = -1;
+  size_t n = 0;
+  int jumps = 0;
+  while (off < len) {
+    uint8_t l = msg[off];
+    if ((l & 0xC0) == 0xC0) {
+      // Pointer (RFC 1035, 4.1.4)
+      if (off + 1 >= len || ++jumps > 16) {
+        return -1;
+      }
+      if (after < 0) {
+        after = off + 2;
+      }
+      off = ((l & 0x3F) << 8) | msg[off+1];
+      continue;
+    }
+    if (l == 0) {
+      if (n < nameSize) {
+        name[n] = '\0';
+      }
+      return after < 0 ? off + 1 : after;
+    }
+    if (off + 1 + l > len || n + l + 1 >= nameSize) {
+      return -1;
+    }
+    if (n) {
+      name[n++] = '.';
+    }
+    memcpy(name + n, msg + off + 1, l);
+    n += l;
+    off += 1 + l;
+  }
+  return -1;
+}
+
+int SipResolver::readCharString(const uint8_t* msg, size_t len, size_t off, char* str, size_t strSize) {
+  if (off >= len || off + 1 + msg[off] > len) {
+    return -1;
+  }
+  uint8_t l = msg[off];
+  size_t copy = l < strSize - 1 ? l : strSize - 1;
+  memcpy(str, msg + off + 1, copy);
+  str[copy] = '\0';
+  return off + 1 + l;
+}
+
+/* Description:
+ *     parse a DNS response: A, SRV and NAPTR records from answer and additional sections are appended to `records`.
+ * Return:
+ *     number of records added; -1 if the message is not a valid response to query `id` (NXDOMAIN is valid: returns 0).
+ */
+int SipResolver::parseResponse(const uint8_t* msg, size_t len, uint16_t id, LinearArray<Record*, LA_EXTERNAL_RAM>& records) {
+  if (len < 12 || ((msg[0] << 8) | msg[1]) != id || !(msg[2] & 0x80)) {
+    return -1;
+  }
+  uint8_t rcode = msg[3] & 0x0F;
+  if (rcode != 0 && rcode != 3) {
+    log_e("DNS error: rcode = %d", rcode);
+    return -1;
+  }
+  uint16_t qdCount = (msg[4] << 8) | msg[5];
+  uint16_t rrCount = ((msg[6] << 8) | msg[7]) + ((msg[8] << 8) | msg[9]) + ((msg[10] << 8) | msg[11]);
+
+  char name[MAX_NAME];
+  int off = 12;
+  for (int i=0; i<qdCount; i++) {
+    off = readName(msg, len, off, name, sizeof(name));
+    if (off < 0 || (size_t) off + 4 > len) {
+      return -1;
+    }
+    off += 4;
+  }
+
+  int added = 0;
+  for (int i=0; i<rrCount; i++) {
+    off = readName(msg, len, off, name, sizeof(name));
+    if (off < 0 || (size_t) off + 10 > len) {
+      break;          // truncated: keep what was parsed
+    }
+    uint16_t type = (msg[off] << 8) | msg[off+1];
+    uint32_t ttl = ((uint32_t) msg[off+4] << 24) | ((uint32_t) msg[off+5] << 16) | (msg[off+6] << 8) | msg[off+7];
+    uint16_t rdLength = (msg[off+8] << 8) | msg[off+9];
+    off += 10;
+    if ((size_t) off + rdLength > len) {
+      break;
+    }
+    if (type == TYPE_A || type == TYPE_SRV || type == TYPE_NAPTR) {
+      Record* r = (Record*) extCalloc(1, sizeof(Record));
+      if (r == NULL) {
+        break;
+      }
+      r->type = type;
+      r->ttl = ttl;
+      strcpy(r->name, name);
+      bool ok = true;
+      if (type == TYPE_A) {
+        ok = rdLength == 4;
+        memcpy(&r->addr, msg + off, 4);
+      } else if (type == TYPE_SRV) {
+        ok = rdLength >= 7;
+        r->order = (msg[off] << 8) | msg[off+1];
+        r->preference = (msg[off+2] << 8) | msg[off+3];
+        r->port = (msg[off+4] << 8) | msg[off+5];
+        ok = ok && readName(msg, len, off + 6, r->target, sizeof(r->target)) >= 0;
+      } else {
+        // NAPTR: order, preference, flags, service, regexp, replacement (RFC 3403, 4.1)
+        int p = off + 4;
+        char regexp[64];
+        r->order = (msg[off] << 8) | msg[off+1];
+        r->preference = (msg[off+2] << 8) | msg[off+3];
+        ok = (p = readCharString(msg, len, p, r->flags, sizeof(r->flags))) >= 0 &&
+             (p = readCharString(msg, len, p, r->service, sizeof(r->service))) >= 0 &&
+             (p = readCharString(msg, len, p, regexp, sizeof(regexp))) >= 0 &&
+             readName(msg, len, p, r->target, sizeof(r->target)) >= 0;
+      }
+      if (ok && records.add(r)) {
+        added++;
+      } else {
+        free(r);
+      }
+    }
+    off += rdLength;
+  }
+  return added;
+}
+
+void SipResolver::clearRecords(LinearArray<Record*, LA_EXTERNAL_RAM>& records) {
+  for (auto it = records.iterator(); it.valid(); ++it) {
+    free(*it);
+  }
+  records.clear();
+}
+
+/* Description:
+ *     load persisted cache from SPIFFS. If the time is not known yet, entries are marked stale and only used when DNS fails.
+ */
+void SipResolver::load() {
+  loaded = true;
+  IniFile ini(filename);
+  if (!ini.load()) {
+    return;
+  }
+  uint32_t utcNow = ntpClock.isTimeKnown() ? ntpClock.getExactUtcTime() : 0;
+  uint32_t msNow = millis();
+  for (auto it = ini.iterator(); it.valid() && cache.size() < MAX_DOMAINS; ++it) {
+    if (!it->hasKey("d") || !it->hasKey("e")) {
+      continue;
+    }
+    uint32_t utcExpires = strtoul((*it)["e"], NULL, 10);
+    if (utcNow && utcExpires <= utcNow) {
+      continue;       // expired while the phone was off
+    }
+    const char* t = it->getValueSafe("t", "");
+    CacheEntry* entry = new CacheEntry((*it)["d"], !strcmp(t, "udp") ? UDP : !strcmp(t, "tls") ? TLS : TCP);
+    entry->utcExpires = utcExpires;
+    entry->stale = !utcNow;
+    entry->msExpires = utcNow ? msNow + (utcExpires - utcNow)*1000 : msNow;
+    for (size_t i=0; i<it->nValues() && entry->nTargets < MAX_TARGETS; i++) {
+      NanoIni::KeyValue& kv = (*it)[i];
+      if (kv.key() && !strcmp(kv.key(), "r")) {
+        char ip[16];
+        unsigned int port, prio, weight;
+        if (sscanf(kv.value(), "%15[0-9.]:%u:%u:%u", ip, &port, &prio, &weight) == 4) {
+          Target& t = entry->targets[entry->nTargets];
+          if (t.ip.fromString(ip)) {
+            t.port = port;
+            t.priority = prio;
+            t.weight = weight;
+            entry->nTargets++;
+          }
+        }
+      }
+    }
+    if (entry->nTargets) {
+      cache.add(entry);
+    } else {
+      delete entry;
+    }
+  }
+  log_d("DNS cache loaded: %d domains", (int) cache.size());
+}
+
+void SipResolver::store() {
+  IniFile ini(filename);
+  for (auto it = cache.iterator(); it.valid(); ++it) {
+    CacheEntry* entry = *it;
+    if (!entry->utcExpires) {
+      continue;       // expiration time unknown
+    }
+    NanoIni::Section& sec = ini[ini.addSection()];
+    sec["d"] = entry->domainDyn;
+    sec["t"] = entry->transport == UDP ? "udp" : entry->transport == TCP ? "tcp" : "tls";
+    char buff[40];
+    sprintf(buff, "%u", entry->utcExpires);
+    sec["e"] = buff;
+    for (int i=0; i<entry->nTargets; i++) {
+      Target& t = entry->targets[i];
+      sprintf(buff, "%s:%u:%u:%u", t.ip.toString().c_str(), t.port, t.priority, t.weight);
+      sec.addKeyValue("r", buff);
+    }
+  }
+  ini.store();
+}
@@ -0,0 +1,134 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <WiFi.h>
+#include <WiFiUdp.h>
+#include "helpers.h"
+#include "LinearArray.h"
+
+/* Description:
+ *     locating SIP servers according to RFC 3263: NAPTR -> SRV -> A.
+ *
+ *     lwIP resolver only supports A records, so this class implements a minimal DNS client (RFC 1035) over UDP.
+ *     Results are cached in RAM respecting the TTL of the records and persisted to SPIFFS (see `filename`) so that
+ *     after a reboot the phone can connect before the DNS answers. Entries loaded while the time is unknown
+ *     (no NTP yet) are only used as a fallback if the DNS server can't be reached.
+ *
+ *     Each domain keeps an ordered list of targets (by SRV priority, weighted random order within same priority,
+ *     RFC 2782). If connecting to the current target fails, failover() moves to the next one.
+ *
+ * Testing:
+ *     setServer() allows pointing the resolver to a stub DNS server on the local network; parseResponse() is static
+ *     and can be fed canned DNS packets.
+ */
+class SipResolver {
+public:
+
+  // DNS record types (RFC 1035, RFC 2782, RFC 3403)
+  static const uint16_t TYPE_A = 1;
+  static const uint16_t TYPE_SRV = 33;
+  static const uint16_t TYPE_NAPTR = 35;
+
+  static const uint16_t SIP_PORT = 5060;              // default port when not given by SRV record
+  static const uint16_t SIPS_PORT = 5061;             // same for TLS
+
+  typedef enum Transport {
+    UDP = 0,
+    TCP,
+    TLS
+  } Transport_t;
+
+  static const int MAX_TARGETS = 6;                   // per domain
+  static const int MAX_DOMAINS = 8;                   // cache size
+  static const int MAX_NAME = 128;
+  static const uint32_t QUERY_TIMEOUT_MS = 1500u;
+  static const uint32_t MIN_TTL_S = 30;               // don't hammer DNS even if records have tiny TTL
+  static const uint32_t MAX_TTL_S = 86400;
+
+  static constexpr const char* filename = "/dns_cache.ini";
+
+  struct Target {
+    IPAddress ip;
+    uint16_t port;
+    uint16_t priority;
+    uint16_t weight;
+  };
+
+  // One parsed resource record
+  struct Record {
+    uint16_t type;
+    uint32_t ttl;
+    char name[MAX_NAME];
+    char target[MAX_NAME];        // NAPTR replacement or SRV target
+    char service[16];             // NAPTR service, e.g. "SIP+D2U"
+    char flags[4];                // NAPTR flags, e.g. "s"
+    uint16_t order;               // NAPTR order / SRV priority
+    uint16_t preference;          // NAPTR preference / SRV weight
+    uint16_t port;                // SRV port
+    uint32_t addr;                // A record (network order, as IPAddress expects)
+  };
+
+  SipResolver();
+  ~SipResolver();
+
+  void setServer(IPAddress server, uint16_t port = 53);     // use this DNS server instead of the one from DHCP (e.g. a stub for testing)
+  bool resolve(const char* host, uint16_t port, Transport_t transport, IPAddress& ip, uint16_t& targetPort);
+  bool failover(const char* host, Transport_t transport, IPAddress& ip, uint16_t& targetPort);
+  void clear();
+
+  static uint16_t defaultPort(Transport_t transport) {
+    return transport == TLS ? SIPS_PORT : SIP_PORT;
+  };
+  static int parseResponse(const uint8_t* msg, size_t len, uint16_t id, LinearArray<Record*, LA_EXTERNAL_RAM>& records);
+
+protected:
+
+  class CacheEntry {
+  public:
+    CacheEntry(const char* domain, Transport_t transport);
+    ~CacheEntry();
+
+    char* domainDyn;
+    Transport_t transport;
+    Target targets[MAX_TARGETS];
+    uint8_t nTargets;
+    uint8_t current;                // index of the target in use (advanced by failover)
+    uint32_t msExpires;             // millis() when the entry expires
+    uint32_t utcExpires;            // same in UTC seconds (for persisting), 0 if unknown
+    bool stale;                     // loaded from flash without knowing the time
+  };
+
+  LinearArray<CacheEntry*, LA_EXTERNAL_RAM> cache;
+  IPAddress server;
+  uint16_t serverPort;
+  uint16_t queryId;
+  bool loaded;
+
+  CacheEntry* find(const char* domain, Transport_t transport);
+  CacheEntry* lookup(const char* domain, Transport_t transport);
+  bool query(const char* name, uint16_t type, LinearArray<Record*, LA_EXTERNAL_RAM>& records);
+  bool resolveA(const char* name, LinearArray<Record*, LA_EXTERNAL_RAM>& additional, uint32_t& addr, uint32_t& ttl);
+  void orderTargets(Target* targets, uint8_t n);
+  void load();
+  void store();
+
+  static void clearRecords(LinearArray<Record*, LA_EXTERNAL_RAM>& records);
+  static int readName(const uint8_t* msg, size_t len, size_t off, char* name, size_t nameSize);
+  static int readCharString(const uint8_t* msg, size_t len, size_t off, char* str, size_t strSize);
+};
+
+#endif // RESOLVER_H
@@ -51,7 +51,9 @@ uint32_t MurmurHash3_32 ( const void * key, int len,
   switch(len & 3)
   {
   case 3: k1 ^= tail[2] << 16;
+          // fall through
   case 2: k1 ^= tail[1] << 8;
+          // fall through
   case 1: k1 ^= tail[0];
           k1 *= c1; k1 = rotl32(k1,15); k1 *= c2; h1 ^= k1;
   };
@@ -14,8 +14,11 @@ governing permissions and limitations under the License.
 
 #include "tinySIP.h"
 #include "helpers.h"
+#include "CallTrace.h"
+#include "Stun.h"
+#include "TlsConnection.h"
+#include "Presence.h"
 
-extern bool UDP_SIP;
 // Handle disconnect timeout
 bool    timeout_disconnect = false;
 uint32_t timeout_disconnect_mls = 0;
@@ -81,11 +84,24 @@ AddrSpec::AddrSpec(const char* str)
   if (pEnd) {
     _copy[pEnd - pStart] = '\0';
 
+    // Offsets of the parsed parts: pStart must not be used once realloc() may have freed it
+    char** parts[] = { &_scheme, &_hostport, &_userinfo, &_uriParams, &_headers };
+    ptrdiff_t offsets[sizeof(parts)/sizeof(parts[0])];
+    for (size_t i = 0; i < sizeof(parts)/sizeof(parts[0]); i++) {
+      offsets[i] = *parts[i] ? *parts[i] - pStart : -1;
+    }
+
     // Try to free a little memory in the case that str has irrelevant extra characters
     char* ptr = (char*) realloc(pStart, pEnd - pStart + 1);
     if (ptr) {
       _copy.release();
       _copy.reset(ptr);
+      // The block may have moved -> rebase the parsed pointers
+      for (size_t i = 0; i < sizeof(parts)/sizeof(parts[0]); i++) {
+        if (offsets[i] >= 0) {
+          *parts[i] = ptr + offsets[i];
+        }
+      }
     }
   }
 }
@@ -141,6 +157,142 @@ void AddrSpec::show() {
   }
 }
 
+ParseArena::ParseArena(size_t size)
+  : blockDyn(NULL), blockSize(size), blockUsed(0), overflowDyn(NULL), overflowSize(0),
+    nAllocs(0), nHeapAllocs(0), nMessages(0), nTotalHeapAllocs(0), peakUsed(0) {
+}
+
+ParseArena::~ParseArena() {
+  this->reset();
+  freeNull((void **) &blockDyn);
+}
+
+void* ParseArena::alloc(size_t size) {
+  size = (size + 3) & ~3;         // keep 4-byte alignment
+  nAllocs++;
+  if (blockDyn==NULL) {
+    // The block is only allocated once (and again after it gets grown)
+    blockDyn = (char*) extMalloc(blockSize);
+    nTotalHeapAllocs++;
+  }
+  if (blockDyn!=NULL && blockUsed + size <= blockSize) {
+    void* p = blockDyn + blockUsed;
+    blockUsed += size;
+    return p;
+  }
+
+  // Doesn't fit -> chain a heap chunk, freed on reset()
+  Chunk* c = (Chunk*) extMalloc(sizeof(Chunk) + size);
+  if (c==NULL) {
+    log_e("parse arena: out of memory");
+    return NULL;
+  }
+  c->next = overflowDyn;
+  overflowDyn = c;
+  overflowSize += size;
+  nHeapAllocs++;
+  nTotalHeapAllocs++;
+  return c + 1;
+}
+
+char* ParseArena::copy(const char* str, size_t n) {
+  if (str==NULL) {
+    return NULL;
+  }
+  size_t len = strnlen(str, n);
+  char* p = (char*) this->alloc(len + 1);
+  if (p!=NULL) {
+    memcpy(p, str, len);
+    p[len] = '\0';
+  }
+  return p;
+}
+
+char* ParseArena::copy(const char* str) {
+  return str!=NULL ? this->copy(str, strlen(str)) : NULL;
+}
+
+/* Description:
+ *     forget everything allocated since the previous reset. Normally this only rewinds the pointer; heap chunks
+ *     are freed if the message didn't fit, and the block is grown so that the next message like this one fits.
+ */
+void ParseArena::reset() {
+  size_t total = blockUsed + overflowSize;
+  if (total > peakUsed) {
+    peakUsed = total;
+  }
+  if (nAllocs > 0) {
+    nMessages++;
+  }
+  while (overflowDyn!=NULL) {
+    Chunk* next = overflowDyn->next;
+    free(overflowDyn);
+    overflowDyn = next;
+  }
+  if (overflowSize > 0 && blockSize < MAX_SIZE) {
+    size_t size = (total + 63) & ~63;
+    blockSize = size < MAX_SIZE ? size : MAX_SIZE;
+    freeNull((void **) &blockDyn);      // reallocated on next use
+    log_d("parse arena: growing to %d bytes", (int) blockSize);
+  }
+  blockUsed = 0;
+  overflowSize = 0;
+  nAllocs = 0;
+  nHeapAllocs = 0;
+}
+
+void FlowTimer::reset() {
+  interval = lastGood = START_INTERVAL_MS;
+  maxInterval = MAX_INTERVAL_MS;
+  goodPongs = 0;
+  done = false;
+}
+
+uint32_t FlowTimer::pingDelayMs(uint32_t capMs) {
+  uint32_t base = interval < capMs ? interval : capMs;
+  return base - (uint32_t)((uint64_t) base * (Random.random() % 201) / 1000);
+}
+
+void FlowTimer::ponged() {
+  if (done || ++goodPongs < PROBES) {
+    return;
+  }
+  goodPongs = 0;
+  lastGood = interval;
+  if (interval < maxInterval) {
+    interval = interval/2*3 < maxInterval ? interval/2*3 : maxInterval;
+    log_d("flow timer: trying %d s", interval/1000);
+  } else {
+    done = true;
+  }
+}
+
+void FlowTimer::missed() {
+  goodPongs = 0;
+  if (!done) {
+    // First failure: settle on the longest interval that worked
+    interval = lastGood;
+    done = true;
+  } else {
+    // Failed on a learned interval: the binding got shorter (different network or NAT), back off
+    interval = interval/3*2 > MIN_INTERVAL_MS ? interval/3*2 : MIN_INTERVAL_MS;
+    lastGood = interval;
+  }
+  log_d("flow timer: settled on %d s", interval/1000);
+}
+
+void FlowTimer::setServerTimer(uint32_t seconds) {
+  if (seconds > MAX_INTERVAL_MS/1000) {
+    seconds = MAX_INTERVAL_MS/1000;
+  }
+  if (seconds > 0) {
+    // RFC 5626, 4.4.1: "the UA SHOULD send keep-alives at an interval somewhat less than the Flow-Timer"
+    maxInterval = seconds*1000 > MIN_INTERVAL_MS ? seconds*1000 : MIN_INTERVAL_MS;
+    interval = lastGood = maxInterval;
+    done = true;
+  }
+}
+
 bool Connection::stale() {
   // This works only for proxy connections, which are regularly pinged
   // TODO: include other indicators
@@ -148,6 +300,417 @@ bool Connection::stale() {
   // elapsedMillis(msNow, tcpProxy->msLastReceived, STALE_CONNECTION_MS) && elapsedMillis(msNow, tcpProxy->msLastConnected, STALE_CONNECTION_MS) ? true : false;
 }
 
+SipPool::~SipPool() {
+  for (auto it = accounts.iterator(); it.valid(); ++it) {
+    (*it)->pool = NULL;
+  }
+  accounts.clear();
+  for (auto it = connections.iterator(); it.valid(); ++it) {
+    dropFlow(*it);
+    (*it)->stop();
+    delete *it;
+  }
+  connections.clear();
+}
+
+bool SipPool::attach(TinySIP* account) {
+  if (account==NULL || accounts.size() >= MAX_ACCOUNTS) {
+    return false;
+  }
+  for (auto it = accounts.iterator(); it.valid(); ++it) {
+    if (*it==account) {
+      return true;
+    }
+  }
+  if (!accounts.add(account)) {
+    return false;
+  }
+  account->setPool(this);
+  return true;
+}
+
+void SipPool::detach(TinySIP* account) {
+  if (accounts.removeByValue(account)) {
+    account->setPool(NULL);
+    collect();
+  }
+}
+
+/* Description:
+ *     find a live connection to the address with the transport required.
+ */
+Connection* SipPool::find(IPAddress &ip, uint16_t port, bool udp, bool tls) {
+  for (auto it = connections.iterator(); it.valid(); ++it) {
+    Connection* conn = *it;
+    if (conn->isUdp()==udp && conn->isTls()==tls && conn->connected() && conn->remoteIP()==ip && conn->remotePort()==port && !conn->stale()) {
+      return conn;
+    }
+  }
+  return NULL;
+}
+
+void SipPool::add(Connection* conn) {
+  for (auto it = connections.iterator(); it.valid(); ++it) {
+    if (*it==conn) {
+      return;
+    }
+  }
+  connections.add(conn);
+}
+
+/* Description:
+ *     an account stopped using the connection (its slot is nulled already).
+ * Return:
+ *     false if the connection is not pooled: the caller has to delete it.
+ */
+bool SipPool::release(Connection* conn, bool broken) {
+  bool pooled = false;
+  for (auto it = connections.iterator(); it.valid(); ++it) {
+    if (*it==conn) {
+      pooled = true;
+      break;
+    }
+  }
+  if (!pooled) {
+    return false;
+  }
+  if (broken) {
+    conn->stop();
+    dropFlow(conn);
+  }
+  collect();
+  return true;
+}
+
+bool SipPool::inUse(Connection* conn) {
+  for (auto it = accounts.iterator(); it.valid(); ++it) {
+    TinySIP* acc = *it;
+    if (acc->tcpProxy==conn || acc->tcpRoute==conn || acc->tcpCallee==conn) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Description:
+ *     delete connections that none of the accounts refers to.
+ */
+void SipPool::collect() {
+  for (int i = connections.size() - 1; i >= 0; i--) {
+    Connection* conn = connections[i];
+    if (!inUse(conn)) {
+      log_d("pooled connection deleted");
+      connections.remove(i);
+      dropFlow(conn);
+      conn->stop();
+      delete conn;
+    }
+  }
+}
+
+/* Description:
+ *     the buffer of a pooled connection (created if `create`), NULL if there is none.
+ */
+SipPool::Flow* SipPool::flow(Connection* conn, bool create) {
+  for (auto it = flows.iterator(); it.valid(); ++it) {
+    if ((*it)->conn==conn) {
+      return *it;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  Flow* f = new Flow();
+  f->conn = conn;
+  f->length = 0;
+  f->buffDyn = (char*) extMalloc(TinySIP::MAX_MESSAGE_SIZE+1);
+  if (f->buffDyn==NULL || !flows.add(f)) {
+    log_e("no memory for a shared connection");
+    freeNull((void **) &f->buffDyn);
+    delete f;
+    return NULL;
+  }
+  return f;
+}
+
+void SipPool::dropFlow(Connection* conn) {
+  for (size_t i = 0; i < flows.size(); i++) {
+    if (flows[i]->conn==conn) {
+      freeNull((void **) &flows[i]->buffDyn);
+      delete flows[i];
+      flows.remove(i);
+      return;
+    }
+  }
+}
+
+/* Description:
+ *     read what is available (`avail` bytes, decreased by what is read) from a TCP/TLS connection shared by several
+ *     accounts into the buffer of the pool, then hand every complete message over to its account (see dispatch()).
+ * Return:
+ *     false if the pool doesn't read this connection: the account has to read it itself.
+ */
+bool SipPool::read(TinySIP* reader, Connection* conn, int32_t& avail) {
+  if (accounts.size() < 2 || conn->isUdp() || !connections.size()) {
+    return false;
+  }
+  bool pooled = false;
+  for (auto it = connections.iterator(); it.valid(); ++it) {
+    if (*it==conn) {
+      pooled = true;
+      break;
+    }
+  }
+  Flow* f = pooled ? flow(conn, true) : NULL;
+  if (f==NULL) {
+    return false;
+  }
+  while (avail > 0) {
+    if (f->length >= (size_t) TinySIP::MAX_MESSAGE_SIZE) {
+      this->dispatch(reader, f);
+      if (f->length >= (size_t) TinySIP::MAX_MESSAGE_SIZE) {
+        log_e("shared connection: no message within %d bytes, dropped", (int) f->length);
+        f->length = 0;
+      }
+    }
+    int32_t justRead = conn->read((uint8_t*) f->buffDyn + f->length, TinySIP::MAX_MESSAGE_SIZE - f->length);
+    if (justRead <= 0) {
+      break;
+    }
+    avail -= justRead;
+    f->length += justRead;
+  }
+  f->buffDyn[f->length] = '\0';
+  this->dispatch(reader, f);
+  return true;
+}
+
+/* Description:
+ *     hand the complete messages at the start of a flow buffer over to their accounts: messages of none of them and
+ *     keepalive pongs (CRLF) go to the account that read them. What an account has no room for is kept for the next
+ *     dispatch(), as is an incomplete message.
+ */
+void SipPool::dispatch(TinySIP* reader, Flow* f) {
+  size_t off = 0;
+  while (off < f->length) {
+    const char* msg = f->buffDyn + off;
+    size_t len = !strncmp(msg, TINY_SIP_CRLF, 2) ? 2 : messageLength(msg, f->buffDyn + f->length);
+    if (len == 0) {
+      break;
+    }
+    TinySIP* owner = len > 2 ? route(msg, len) : NULL;
+    if (owner==NULL) {
+      owner = reader;
+    }
+    if (!owner->deliver(msg, len)) {
+      break;
+    }
+    if (owner!=reader) {
+      log_d("message handed over to %s", owner->localUriDyn);
+    }
+    off += len;
+  }
+  if (off > 0) {
+    f->length -= off;
+    memmove(f->buffDyn, f->buffDyn + off, f->length);
+    f->buffDyn[f->length] = '\0';
+  }
+}
+
+/* Description:
+ *     hand over the messages left in the flow buffers because their accounts had no room for them.
+ */
+void SipPool::dispatch(TinySIP* reader) {
+  for (auto it = flows.iterator(); it.valid(); ++it) {
+    if ((*it)->length > 0) {
+      this->dispatch(reader, *it);
+    }
+  }
+}
+
+/* Description:
+ *     wait until a connection of any of the accounts has incoming data, or until timeout (see TinySIP::pollConnections()).
+ *     The result is kept by each account for its next checkCall().
+ */
+void SipPool::pollConnections(uint32_t timeoutMs) {
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  int maxFd = -1;
+  bool unknown = false;
+  for (auto it = accounts.iterator(); it.valid(); ++it) {
+    unknown |= ((*it)->watchConnections(readSet, maxFd) & TinySIP::READY_UNKNOWN) != 0;
+  }
+  if (unknown) {
+    timeoutMs = 0;          // some connection may have data already -> don't block
+  }
+  int res = 0;
+  if (maxFd < 0) {
+    if (timeoutMs) {
+      delay(timeoutMs);     // nothing to wait for
+    }
+  } else {
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    res = select(maxFd + 1, &readSet, NULL, NULL, &tv);
+    if (res < 0) {
+      log_e("select failed: errno = %d", errno);
+      for (auto it = accounts.iterator(); it.valid(); ++it) {
+        (*it)->readyPolled = false;
+      }
+      return;
+    }
+  }
+  for (auto it = accounts.iterator(); it.valid(); ++it) {
+    (*it)->readyConnections(readSet, res > 0);
+  }
+}
+
+/* Description:
+ *     is any account other than the one given in a call (or ringing)? There is only one audio path.
+ */
+bool SipPool::busy(const TinySIP* except) {
+  for (auto it = accounts.iterator(); it.valid(); ++it) {
+    if (*it!=except && (*it)->isBusy()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Description:
+ *     find the value of a header (full or compact form) within the header section of a message.
+ * Return:
+ *     pointer to the value (leading spaces skipped) and its length in `len`; NULL if the header is absent.
+ */
+const char* SipPool::headerValue(const char* msg, const char* end, const char* name, char compact, size_t& len) {
+  size_t nameLen = strlen(name);
+  const char* line = strstr(msg, TINY_SIP_CRLF);
+  while (line!=NULL && line < end) {
+    line += 2;
+    if (!strncmp(line, TINY_SIP_CRLF, 2)) {
+      break;      // end of headers
+    }
+    const char* p = NULL;
+    if (!strncasecmp(line, name, nameLen)) {
+      p = line + nameLen;
+    } else if (tolower(*line)==compact) {
+      p = line + 1;
+    }
+    if (p!=NULL) {
+      while (*p==' ' || *p=='\t') {
+        p++;
+      }
+      if (*p==TINY_SIP_HCOLON) {
+        p++;
+        while (*p==' ' || *p=='\t') {
+          p++;
+        }
+        const char* eol = strstr(p, TINY_SIP_CRLF);
+        len = (eol!=NULL && eol < end ? eol : end) - p;
+        return p;
+      }
+    }
+    line = strstr(line, TINY_SIP_CRLF);
+  }
+  return NULL;
+}
+
+/* Description:
+ *     length of the first message in the buffer (headers and the body of Content-Length).
+ * Return:
+ *     0 if the message is not received completely yet.
+ */
+size_t SipPool::messageLength(const char* msg, const char* end) {
+  const char* body = strstr(msg, TINY_SIP_CRLF TINY_SIP_CRLF);
+  if (body==NULL || body + 4 > end) {
+    return 0;
+  }
+  body += 4;
+  size_t len;
+  const char* val = headerValue(msg, body, "Content-Length", 'l', len);
+  long bodyLength = val!=NULL ? atol(val) : 0;
+  if (bodyLength < 0 || body + bodyLength > end) {
+    return 0;
+  }
+  return body + bodyLength - msg;
+}
+
+/* Description:
+ *     which account a message belongs to:
+ *       - requests: Request-URI is our Contact (its user part is unique per account), otherwise the To address (AOR);
+ *       - responses: the From address, which is always ours.
+ * Return:
+ *     NULL if none of the accounts matches.
+ */
+TinySIP* SipPool::route(const char* msg, size_t len) {
+  const char* end = msg + len;
+  bool isResponse = !strncmp(msg, "SIP/", 4);
+
+  // Request-URI
+  if (!isResponse) {
+    const char* uri = strchr(msg, ' ');
+    const char* uriEnd = uri!=NULL ? strpbrk(uri + 1, " \r\n") : NULL;
+    if (uriEnd!=NULL && uriEnd < end && uriEnd - uri - 1 < 128) {
+      char buf[128];
+      memcpy(buf, uri + 1, uriEnd - uri - 1);
+      buf[uriEnd - uri - 1] = '\0';
+      AddrSpec addr(buf);
+      if (addr.userinfo()!=NULL) {
+        for (auto it = accounts.iterator(); it.valid(); ++it) {
+          char contactUser[12];
+          snprintf(contactUser, sizeof(contactUser), "%u", (*it)->phoneNumber);
+          if ((*it)->phoneNumber && !strcmp(addr.userinfo(), contactUser)) {
+            return *it;
+          }
+        }
+      }
+    }
+  }
+
+  // To / From address
+  size_t valLen;
+  const char* val = isResponse ? headerValue(msg, end, "From", 'f', valLen) : headerValue(msg, end, "To", 't', valLen);
+  if (val==NULL) {
+    return NULL;
+  }
+  const char* valEnd = val + valLen;
+  const char* laquot = (const char*) memchr(val, TINY_SIP_LAQUOT, valLen);
+  if (laquot!=NULL) {
+    val = laquot + 1;
+    const char* raquot = (const char*) memchr(val, TINY_SIP_RAQUOT, valEnd - val);
+    if (raquot!=NULL) {
+      valEnd = raquot;
+    }
+  } else {
+    const char* semi = (const char*) memchr(val, TINY_SIP_SEMI, valLen);
+    if (semi!=NULL) {
+      valEnd = semi;
+    }
+  }
+  if (valEnd - val >= 128) {
+    return NULL;
+  }
+  char buf[128];
+  memcpy(buf, val, valEnd - val);
+  buf[valEnd - val] = '\0';
+  AddrSpec addr(buf);
+  if (addr.host()==NULL) {
+    return NULL;
+  }
+  for (auto it = accounts.iterator(); it.valid(); ++it) {
+    if ((*it)->localUriDyn==NULL) {
+      continue;
+    }
+    AddrSpec local((*it)->localUriDyn);
+    if (local.host()!=NULL && !strcasecmp(local.host(), addr.host()) &&
+        (local.userinfo()==NULL ? addr.userinfo()==NULL : addr.userinfo()!=NULL && !strcmp(local.userinfo(), addr.userinfo()))) {
+      return *it;
+    }
+  }
+  return NULL;
+}
+
 TextMessage::TextMessage(const char* msg, const char* src, const char* dst, uint32_t msTime) {
   if (msg) {
     message = extStrdup(msg);
@@ -167,7 +730,23 @@ TextMessage::~TextMessage() {
   freeNull((void **) &to);
 }
 
-TinySIP::RouteSet::RouteSet() : set(LinearArray<const char*, LA_INTERNAL_RAM>()) {
+OutgoingMessage::OutgoingMessage(const char* msg, const char* dst, uint32_t id, uint32_t msTime)
+  : id(id), msQueued(msTime), msSent(msTime) {
+  if (msg) {
+    message = extStrdup(msg);
+  }
+  if (dst) {
+    to = extStrdup(dst);
+  }
+}
+
+OutgoingMessage::~OutgoingMessage() {
+  freeNull((void **) &message);
+  freeNull((void **) &to);
+  freeNull((void **) &callId);
+}
+
+TinySIP::RouteSet::RouteSet() : set(LinearArray<uint16_t, LA_INTERNAL_RAM>()), textDyn(NULL), textSize(0), textUsed(0) {
   setReverse = false;
 }
 
@@ -176,27 +755,24 @@ TinySIP::RouteSet::RouteSet(RouteSet& other) : RouteSet() {
 }
 
 TinySIP::RouteSet::~RouteSet() {
-  this->clear();
+  freeNull((void **) &textDyn);
 }
 
 void TinySIP::RouteSet::copy(RouteSet& other) {
   log_v("RouteSet::copy");
-  this->clear();
-  this->setReverse = other.setReverse;
-  for (uint16_t i=0; i<other.set.size(); i++)
-    if (other.set[i] != NULL) {
-      this->set.add(strdup(other.set[i]));
-    }
+  this->clear(other.setReverse);
+  for (uint16_t i=0; i<other.set.size(); i++) {
+    this->add(other.textDyn + other.set[i], NULL);
+  }
 }
 
+/* Description:
+ *     forget the routes, keeping the memory for the next ones
+ */
 void TinySIP::RouteSet::clear(bool reverse) {
   log_v("RouteSet::clear");
-  for (uint16_t i=0; i<set.size(); i++) {
-    if (set[i]!=NULL) {
-      freeNull((void **) &set[i]);
-    }
-  }
-  set.clear();
+  set.purge();
+  textUsed = 0;
   setReverse = reverse;
 }
 
@@ -205,21 +781,91 @@ bool TinySIP::RouteSet::add(const char *rrAddrSpec, const char *rrParams) {
   if (rrParams != NULL) {
     log_d("WARNING: non-empty route parameter (rr-param)");
   }
-  const char* s = (const char*) strdup(rrAddrSpec);
-  return (s != nullptr) ? set.add(s) : false;
+  size_t len = strlen(rrAddrSpec) + 1;
+  if (textUsed + len > UINT16_MAX) {
+    return false;
+  }
+  if (textUsed + len > textSize) {
+    // Grow the buffer: the routes are referred to by offsets, so they may move
+    size_t newSize = textSize ? textSize : 128;
+    while (newSize < textUsed + len) {
+      newSize *= 2;
+    }
+    char* p = (char*) wRealloc<LA_INTERNAL_RAM>(textDyn, newSize);
+    if (p == NULL) {
+      return false;
+    }
+    textDyn = p;
+    textSize = newSize;
+  }
+  if (!set.add((uint16_t) textUsed)) {
+    return false;
+  }
+  memcpy(textDyn + textUsed, rrAddrSpec, len);
+  textUsed += len;
+  return true;
 }
 
 const char* TinySIP::RouteSet::operator[](uint16_t index) const {
-  return set[setReverse ? set.size()-1-index : index];
+  return textDyn + set[setReverse ? set.size()-1-index : index];
+}
+
+TinySIP::DigestChallenge::DigestChallenge()
+  : realmDyn(nullptr), nonceDyn(nullptr), opaqueDyn(nullptr), algorithmDyn(nullptr),
+    proxyAuth(false), ha1Valid(false), nonceCount(0), used(false), proxy((uint32_t) 0) {
+  qop[0] = '\0';
+}
+
+TinySIP::DigestChallenge::~DigestChallenge() {
+  this->clear();
+}
+
+void TinySIP::DigestChallenge::clear() {
+  freeNull((void **) &realmDyn);
+  freeNull((void **) &nonceDyn);
+  freeNull((void **) &opaqueDyn);
+  freeNull((void **) &algorithmDyn);
+  qop[0] = '\0';
+  ha1Valid = false;
+  nonceCount = 0;
+  used = false;
+}
+
+/* Description:
+ *     remember a new challenge. H(A1) is kept if the realm didn't change (e.g., after stale=true); nonce count restarts with a new nonce.
+ */
+void TinySIP::DigestChallenge::update(const char* realm, const char* nonce, const char* opaque, const char* qop, const char* algorithm, bool proxyAuth, IPAddress proxy) {
+  if (realm==NULL) {
+    realm = "";
+  }
+  if (realmDyn==NULL || strcmp(realmDyn, realm) || (uint32_t) proxy!=(uint32_t) this->proxy) {
+    ha1Valid = false;
+  }
+  if (nonceDyn==NULL || nonce==NULL || strcmp(nonceDyn, nonce)) {
+    nonceCount = 0;
+    used = false;
+  }
+  freeNull((void **) &realmDyn);
+  freeNull((void **) &nonceDyn);
+  freeNull((void **) &opaqueDyn);
+  freeNull((void **) &algorithmDyn);
+  realmDyn = strdup(realm);
+  nonceDyn = strdup(nonce ? nonce : "");
+  opaqueDyn = opaque ? strdup(opaque) : NULL;
+  algorithmDyn = strdup(algorithm ? algorithm : "");
+  strncpy(this->qop, qop ? qop : "", sizeof(this->qop)-1);
+  this->qop[sizeof(this->qop)-1] = '\0';
+  this->proxyAuth = proxyAuth;
+  this->proxy = proxy;
 }
 
 TinySIP::Dialog::Dialog(bool isCaller)
-  : caller(isCaller), usageTimeMs(0),
+  : usageTimeMs(0),
     callIdDyn(nullptr), localTagDyn(nullptr), remoteTagDyn(nullptr),
     localUriDyn(nullptr), remoteUriDyn(nullptr),
     localNameDyn(nullptr), remoteNameDyn(nullptr),
     remoteTargetDyn(nullptr),
-    early(0), confirmed(0), terminated(0), secure(0), accepted(0) {}
+    caller(isCaller), early(0), confirmed(0), terminated(0), secure(0), accepted(0) {}
 
 TinySIP::Dialog::Dialog(bool isCaller, const char* callId, const char* localTag, const char* remoteTag)
   : Dialog(isCaller) {
@@ -289,8 +935,8 @@ bool TinySIP::Dialog::operator==(const Dialog& other) const {
   // Check whether all parts of dialog ID really match
   if ( !(this->callIdDyn && other.callIdDyn && !strcmp(this->callIdDyn, other.callIdDyn) &&
          this->localTagDyn && other.localTagDyn && !strcmp(this->localTagDyn, other.localTagDyn) &&
-         (this->remoteTagDyn &&  other.remoteTagDyn && !strcmp(this->localTagDyn, other.localTagDyn) ||
-          !this->remoteTagDyn && !other.remoteTagDyn)) ) {
+         ((this->remoteTagDyn &&  other.remoteTagDyn && !strcmp(this->localTagDyn, other.localTagDyn)) ||
+          (!this->remoteTagDyn && !other.remoteTagDyn))) ) {
     return false;
   }
 
@@ -341,8 +987,8 @@ TinySIP::Dialog* TinySIP::findCreateDialog(bool isCaller, const char* callId, co
 
       // TODO: dialogs: update dialog with new information
       (*it)->setUseTime(now);
-      if (!diag->remoteTargetDyn && respContAddrSpecDyn) {
-        diag->remoteTargetDyn = extStrdup(respContAddrSpecDyn);
+      if (!(*it)->remoteTargetDyn && respContAddrSpec) {
+        (*it)->remoteTargetDyn = extStrdup(respContAddrSpec);
       }
 
       // TODO: dialogs: update CSeq
@@ -382,8 +1028,8 @@ TinySIP::Dialog* TinySIP::findCreateDialog(bool isCaller, const char* callId, co
   diag->localCSeq  = isCaller ? cseq : respCSeq;
   diag->remoteCSeq = isCaller ? respCSeq : cseq;
 
-  if (respContAddrSpecDyn) {
-    diag->remoteTargetDyn = extStrdup(respContAddrSpecDyn);
+  if (respContAddrSpec) {
+    diag->remoteTargetDyn = extStrdup(respContAddrSpec);
   }
 
   if (respRouteSet.size()) {
@@ -393,7 +1039,7 @@ TinySIP::Dialog* TinySIP::findCreateDialog(bool isCaller, const char* callId, co
   // Second: add this dialog to the array
   diag->setUseTime(now);
   if (this->dialogs.size() < MAX_DIALOGS) {
-    log_v("adding dialog 0x%08x to dialogs (size=%d)", (uint32_t)*diag, this->dialogs.size());
+    log_v("adding dialog 0x%08x to dialogs (size=%d)", (uint32_t)*diag, (int) this->dialogs.size());
     this->dialogs.add(diag);
     return diag;
   }
@@ -427,7 +1073,7 @@ search:
   return nullptr;
 }
 
-void TinySIP::restoreDialogContext(Dialog& diag) {
+void TinySIP::restoreDialogContext(Dialog&) {
 //  log_v("restoreDialogContext");
 //  // TODO: dialogs: see sendResponse to what is needed to reply
 //  // TODO: dialogs: see sendBye to what is needed to hangup
@@ -438,36 +1084,47 @@ void TinySIP::restoreDialogContext(Dialog& diag) {
 }
 
 TinySIP::TinySIP()
-  : tcpLast(tcpProxy), respRouteSet() {
+  : tcpLast(&tcpProxy), respRouteSet() {
   log_i("TinySIP construct");
 
   connectReturnedFalse = false;
 
   // Dynamic variables
-  respToTagDyn = NULL;
-  remoteToFromDyn = NULL;
-  respFromTagDyn = NULL;
+  respToTag = NULL;
+  remoteToFrom = NULL;
+  respFromTag = NULL;
   remoteUriDyn = NULL;
-  outgoingMsgDyn = NULL;
   localUserDyn = NULL;
   localNameDyn = NULL;
   localUriDyn = NULL;
   proxyPasswDyn = NULL;
-  remoteAudioAddrDyn = NULL;
+  remoteAudioAddr[0] = '\0';
   remoteAudioPort = 0;
   //dialogsDyn = NULL;
-  respContDispNameDyn = NULL;
-  respContAddrSpecDyn = NULL;
+  respContDispName = NULL;
+  respContAddrSpec = NULL;
   guiReasonDyn = NULL;
   callIdDyn = NULL;
   regCallIdDyn = NULL;
-  msgCallIdDyn = NULL;
+  presCallIdDyn = NULL;
+  presRemoteTagDyn = NULL;
+  presTargetDyn = NULL;
+  presenceWanted = presPending = presActive = false;
+  presLocalTag[0] = '\0';
+  presCSeq = 0;
+  presListVersion = presExpiresReq = 0;
+  msPresRequest = msPresWait = 0;
 
   sdpSessionId = 0;
+  sdpRemoteDir = MEDIA_SENDRECV;
+  resetSession();
+  sipPublicIP[0] = rtpPublicIP[0] = '\0';
+  sipPublicPort = sipPublicLocalPort = rtpPublicPort = 0;
   phoneNumber = 0;
   cseq = 0;
   regCSeq = 0;
-  nonceCount = 0;
+  macHex[0] = '\0';
+  msgCSeq = 0;
   nonFree = 0;
 
   tcpProxy = NULL;
@@ -477,12 +1134,20 @@ TinySIP::TinySIP()
   leftOver = false;
 
   // Reset buffer variables
+  buff = (char*) extMalloc(MAX_MESSAGE_SIZE+1);
+  if (buff == NULL) {
+    log_e("no memory for the SIP buffer");
+  }
   resetBuffer();
 
   // Timing
   this->msLastKnownTime = 0;
+  this->registerExpiresS = TinySIP::REGISTER_EXPIRATION_S;
+  this->msRegisterRefresh = TinySIP::REGISTER_EXPIRATION_S*800;
   this->msLastRegistered = 0xffffffff - TinySIP::REGISTER_EXPIRATION_S*1000;
-  this->msLastRegisterRequest = 0xffffffff - TinySIP::REGISTER_PERIOD_MS + 4500;   // register 4.5 seconds after starting
+  this->msLastRegisterRequest = 0xffffffff - TinySIP::REGISTER_RETRY_MS + 4500;   // register 4.5 seconds after starting
+  this->msPingDelay = FlowTimer::START_INTERVAL_MS;
+  flowTimer.reset();
 }
 
 /*
@@ -497,6 +1162,7 @@ bool TinySIP::init(const char* name, const char* fromUri, const char* proxyPass,
   // re-init logic
   clearDynamicState();
   resetBuffer();
+  authCache.clear();
 
   // Reset bools
   this->registered = false;
@@ -520,11 +1186,15 @@ bool TinySIP::init(const char* name, const char* fromUri, const char* proxyPass,
   // connect(): socket error on fd 57, errno: 104, "Connection reset by peer"
   // it probably means the proxy doesn't support TCP. Better to warn the user instead of failing silently.
   // Something like: IP address X.X.X.X not accepting TCP connections on port XXXX.
-  proxyIpAddr = ensureConnection(tcpProxy, fromUri, false, 500);
+  proxyIpAddr = ensureConnection(tcpProxy, fromUri, false, 500, &proxyPort);
+  while (!(tcpProxy && tcpProxy->connected()) && failoverProxy()) {
+    ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort, false, 500);
+  }
   if (tcpProxy && tcpProxy->connected()) {
     log_i("Connected to proxy!");
     log_i("  IP: %s", proxyIpAddr.toString().c_str());
     thisIP = WiFi.localIP().toString();
+    mapSipFlow(*tcpProxy);
     return true;
   }
   // Else: connection failed
@@ -584,6 +1254,23 @@ void TinySIP::freeNullConnectionProxyObject(bool isProxy) {
   }
 }
 
+/*
+ * Description:
+ *     stop using a connection: null the slot (and those identical to tcpProxy), then delete the connection.
+ *     A connection shared with other accounts is only deleted once none of them uses it; a broken one is stopped
+ *     right away, so that the other accounts reconnect too instead of keeping a dead flow.
+ */
+void TinySIP::dropConnection(Connection*& tcp, bool isProxy, bool broken) {
+  Connection* conn = tcp;
+  freeNullConnectionProxyObject(isProxy);//tcpProxy=null etc.
+  tcp = NULL;
+  if (pool!=NULL && pool->release(conn, broken)) {
+    return;
+  }
+  conn->stop();
+  delete conn;
+}
+
 /*
  * Description:
  *     ensure tcp is connected to host specified by IP and port
@@ -622,10 +1309,20 @@ bool TinySIP::ensureIpConnection(Connection*& tcp, IPAddress &ipAddr, uint16_t p
     } else {
       // Connection is not good -> clean it up
       log_d("TCP connection state: %s", forceRenew ? "FORCED RENEWAL" : tcp->stale() ? "stale" : (tcp->connected() ? "new destination" : "not connected"));
-      tcp->stop();
-      delete tcp;
-      freeNullConnectionProxyObject(isProxy);//tcpProxy=null etc.
-      tcp = NULL;
+      dropConnection(tcp, isProxy, forceRenew || tcp->stale() || !tcp->connected());
+    }
+  }
+
+  // Another account may be connected to the same address already -> share its connection
+  if (!good && pool!=NULL) {
+    Connection* shared = pool->find(ipAddr, port, UDP_SIP, TLS_SIP);
+    if (shared!=NULL && TLS_SIP && tlsVerify && !((TLS_SIPConnection*) shared)->verified()) {
+      shared = NULL;        // opened by an account that doesn't verify the server
+    }
+    if (shared!=NULL) {
+      log_d("Sharing pooled connection");
+      tcp = shared;
+      good = true;
     }
   }
   uint32_t get_millis = millis();
@@ -643,11 +1340,18 @@ bool TinySIP::ensureIpConnection(Connection*& tcp, IPAddress &ipAddr, uint16_t p
     log_e("  Port: %d", port);
     //UDP_SIP=1;
     if(UDP_SIP) {
-      if(tcp && !tcp->isUdp() && !connectReturnedFalse || !tcp) {
+      if((tcp && !tcp->isUdp() && !connectReturnedFalse) || !tcp) {
         tcp = new UDP_SIPConnection;
       }
+    } else if(TLS_SIP) {
+      if((tcp && !tcp->isTls() && !connectReturnedFalse) || !tcp) {
+        tcp = new TLS_SIPConnection;
+      }
+      AddrSpec domain(localUriDyn ? localUriDyn : "");
+      ((TLS_SIPConnection*) tcp)->setHostname(domain.host());   // server name to ask for and to check the certificate against
+      ((TLS_SIPConnection*) tcp)->setVerify(tlsVerify);
     } else {
-      if(tcp && !tcp->isTcp() && !connectReturnedFalse || !tcp) {
+      if((tcp && !tcp->isTcp() && !connectReturnedFalse) || !tcp) {
         tcp = new TCP_SIPConnection;
       }
     }
@@ -660,12 +1364,13 @@ bool TinySIP::ensureIpConnection(Connection*& tcp, IPAddress &ipAddr, uint16_t p
         log_d("ERROR: DISCONNECTED");
         timeout_disconnect = true;
         timeout_disconnect_mls = get_millis;
-        delete tcp;
-        freeNullConnectionProxyObject(isProxy);//tcpProxy=null etc.
-        tcp = NULL;
+        dropConnection(tcp, isProxy, true);
       } else {
         tcp->msLastConnected = msLastKnownTime;
         timeout_disconnect = false;
+        if (pool!=NULL) {
+          pool->add(tcp);
+        }
       }
       tcp->msLastConnected = msLastKnownTime;
       connectReturnedFalse = false;
@@ -675,9 +1380,7 @@ bool TinySIP::ensureIpConnection(Connection*& tcp, IPAddress &ipAddr, uint16_t p
       connectReturnedFalse = true;
       log_d("Error: could not connect");
       if(tcp) {
-        delete tcp;
-        freeNullConnectionProxyObject(isProxy);//tcpProxy=null etc.
-        tcp = NULL;
+        dropConnection(tcp, isProxy, true);
       }
     }
   } else {
@@ -687,48 +1390,51 @@ bool TinySIP::ensureIpConnection(Connection*& tcp, IPAddress &ipAddr, uint16_t p
   return good;
 }
 
+/*
+ * Description:
+ *     switch proxy address to the next server found for the domain of the account (RFC 3263, Section 4.3).
+ *     The reconnection backoff in ensureIpConnection is meant for the same server, so it is reset for a new one.
+ * Return:
+ *     true if switched to a server that was not tried yet.
+ */
+bool TinySIP::failoverProxy() {
+  if (localUriDyn == NULL) {
+    return false;
+  }
+  AddrSpec addrParsed(localUriDyn);
+  if (!addrParsed.hostPort() || addrParsed.port()) {
+    return false;     // explicit port: A record only, no backup servers
+  }
+  if (resolver.failover(addrParsed.host(), transport(), proxyIpAddr, proxyPort)) {
+    timeout_disconnect = false;
+    return true;
+  }
+  return false;
+}
+
 /*
  * Description:
  *     ensure `tcp` is connected to host specified by addrSpec.
  * Return:
  *     IP address which was resolved from addrSpec
  */
-IPAddress TinySIP::ensureConnection(Connection*& tcp, const char* addrSpec, bool forceRenew, int32_t timeout) {
+IPAddress TinySIP::ensureConnection(Connection*& tcp, const char* addrSpec, bool forceRenew, int32_t timeout, uint16_t* resolvedPort) {
   log_d("Ensuring connection: %s", addrSpec);
   AddrSpec addrParsed(addrSpec);
   IPAddress ipAddr((uint32_t) 0);
   if (addrParsed.hostPort()) {
-    int port = addrParsed.port() ? addrParsed.port() : TINY_SIP_PORT;
+    uint16_t port = addrParsed.port() ? addrParsed.port() : TLS_SIP ? TINY_SIPS_PORT : TINY_SIP_PORT;
     log_d(" - host: %s", addrParsed.host());
-    log_d(" - port: %d", port);
-
-    // Connect to IP
-    // TODO: correctly resolve NAPTR DNS records to IP addresses (this seems to be needed only for sip2sip.info)
-    if (isdigit(addrParsed.host()[0]) && ipAddr.fromString(addrParsed.host())) {
-      log_d("Proper IP address: %s", addrParsed.host());
-    } else if (!strcasecmp(addrParsed.host(), "sip2sip.info")) {
-      log_d("WARNING: hardcoded IP address");
-      ipAddr.fromString("85.17.186.7");
-//    } else if (!strcasecmp(addrParsed.host(), "sip.linphone.org")) {
-//      log_d("WARNING: hardcoded IP address");
-//      ipAddr.fromString("91.121.209.194");
-//    } else if (!strcasecmp(addrParsed.host(), "iptel.org")) {
-//      log_d("WARNING: hardcoded IP address");
-//      ipAddr.fromString("212.79.111.155");    // A record of iptel.org, sip.iptel.org
-//    } else if (!strcasecmp(addrParsed.host(), "antisip.org")) {
-//      log_d("WARNING: hardcoded IP address");
-//      ipAddr.fromString("91.121.30.149");    // A record of antisip.com, sip.antisip.com
-//    } else if (!strcasecmp(addrParsed.host(), "opensips.org")) {
-//      log_d("WARNING: hardcoded IP address");
-//      ipAddr.fromString("136.243.23.236");    // A record of opensips.org
+    log_d(" - port: %d", addrParsed.port());
+
+    // Resolve the host: NAPTR -> SRV -> A (RFC 3263), cached
+    if (resolver.resolve(addrParsed.host(), addrParsed.port(), transport(), ipAddr, port)) {
+      log_d("Resolved: %s -> %s:%d", addrParsed.host(), ipAddr.toString().c_str(), port);
     } else {
-      // TODO: this resolves domains only through A-record; need to use NAPTR- and SRV-records
-      ipAddr = resolveDomain(addrParsed.host());
-      if ((uint32_t) ipAddr != 0) {
-        log_d("Resolved: %s -> %s", addrParsed.host(), ipAddr.toString().c_str());
-      } else {
-        log_d("Could not resolve: \"%s\"", addrParsed.host());
-      }
+      log_d("Could not resolve: \"%s\"", addrParsed.host());
+    }
+    if (resolvedPort) {
+      *resolvedPort = port;
     }
     ensureIpConnection(tcp, ipAddr, port, forceRenew, timeout);
   } else {
@@ -746,7 +1452,7 @@ IPAddress TinySIP::ensureConnection(Connection*& tcp, const char* addrSpec, bool
 Connection* TinySIP::getConnection(bool isClient) {
   log_d("--- Getting connection ---");
   log_d("TinySIP::getConnection as %s", isClient ? "client" : "server");
-  log_d("TinySIP::getConnection respRouteSet.size() is : %d ", respRouteSet.size());
+  log_d("TinySIP::getConnection respRouteSet.size() is : %d ", (int) respRouteSet.size());
   // UAS found -> connect to UAS directly
   if (respRouteSet.size() > 0) {
 
@@ -764,12 +1470,12 @@ Connection* TinySIP::getConnection(bool isClient) {
       log_d("EMPTY");
     }
   } else if (respClass=='2') {
-    if (respContAddrSpecDyn!=NULL) {
+    if (respContAddrSpec!=NULL) {
 
       // Response should be sent to UAS directly
 
-      //ensureConnection(tcpCallee, respContAddrSpecDyn, true);       // TODO: why forced renewal?
-      ensureConnection(tcpCallee, respContAddrSpecDyn);
+      //ensureConnection(tcpCallee, respContAddrSpec, true);       // TODO: why forced renewal?
+      ensureConnection(tcpCallee, respContAddrSpec);
       log_d("ensuring tcpCallee: ");
       if (tcpCallee!=NULL) {
         log_d("OK: port = %d", tcpCallee->localPort());
@@ -778,7 +1484,7 @@ Connection* TinySIP::getConnection(bool isClient) {
         log_d("EMPTY");
       }
     } else {
-      log_d("EMPTY respContAddrSpecDyn");
+      log_d("EMPTY respContAddrSpec");
     }
   }
   // Fallback to proxy connection
@@ -790,6 +1496,9 @@ TinySIP::~TinySIP() {
   log_d("tinySIP: destruction");
   //SIP_DEBUG_DELAY(100);       // seems to improve stability
   clearDynamicState();
+  if (pool!=NULL) {
+    pool->detach(this);
+  }
 
   // Clean up all Dialog objects
   for (auto it = dialogs.iterator(); it.valid(); ++it)
@@ -797,9 +1506,24 @@ TinySIP::~TinySIP() {
       delete *it;
     }
 
+  // Messages not picked up
+  for (auto it = outbox.iterator(); it.valid(); ++it) {
+    delete *it;
+  }
+  outbox.clear();
+  for (auto it = deliveries.iterator(); it.valid(); ++it) {
+    delete *it;
+  }
+  deliveries.clear();
+  for (auto it = textMessages.iterator(); it.valid(); ++it) {
+    delete *it;
+  }
+  textMessages.clear();
+
   // Free the linear array itself
   dialogs.clear();
   freeNull((void **) &regCallIdDyn);
+  freeNull((void **) &buff);
 
   log_d("tinySIP: finishing destruction");
 }
@@ -818,8 +1542,11 @@ void TinySIP::clearDynamicState() {
   freeNull((void **) &localUriDyn);
   freeNull((void **) &proxyPasswDyn);
   freeNull((void **) &callIdDyn);
-  freeNull((void **) &msgCallIdDyn);
-  freeNull((void **) &outgoingMsgDyn);
+  freeNull((void **) &presCallIdDyn);
+  freeNull((void **) &presRemoteTagDyn);
+  freeNull((void **) &presTargetDyn);
+  presPending = presActive = false;
+  msPresWait = 0;
 
   clearDynamicParsed();
   clearDynamicConnections();
@@ -832,12 +1559,13 @@ void TinySIP::clearDynamicState() {
  */
 void TinySIP::clearDynamicParsed() {
   log_d("TinySIP::clearDynamicParsed");
-  freeNull((void **) &respToTagDyn);
-  freeNull((void **) &remoteToFromDyn);
-  freeNull((void **) &respFromTagDyn);
-  freeNull((void **) &remoteAudioAddrDyn);
-  freeNull((void **) &respContDispNameDyn);
-  freeNull((void **) &respContAddrSpecDyn);
+  respToTag = NULL;
+  remoteToFrom = NULL;
+  respFromTag = NULL;
+  respContDispName = NULL;
+  respContAddrSpec = NULL;
+  msgArena.reset();
+  remoteAudioAddr[0] = '\0';
   freeNull((void **) &guiReasonDyn);
 
   remoteAudioPort = 0;
@@ -851,6 +1579,14 @@ void TinySIP::clearDynamicConnections() {
   log_d("clearDynamicConnections");
   //SIP_DEBUG_DELAY(100);       // seems to improve stability
 
+  if (pool!=NULL) {
+    // Other accounts may still use these connections
+    tcpProxy = tcpRoute = tcpCallee = NULL;
+    pool->collect();
+    leftOver = false;
+    return;
+  }
+
   if (tcpProxy!=NULL) {
     delete tcpProxy;
     //in order not to delete the same objects twice then cause crashes, we assign null to same pointer with the tcpProxy
@@ -872,13 +1608,39 @@ void TinySIP::clearDynamicConnections() {
 void TinySIP::resetBuffer() {
   log_d("reset SIP buffer");
 
-  buff[0] = '\0';
+  if (buff != NULL) {
+    buff[0] = '\0';
+  }
   buffLength = 0;
   buffStart = buff;
 
   resetBufferParsing();
 }
 
+/*
+ * Description:
+ *     append a message read from a shared connection by another account of the pool; it gets parsed on the next checkCall().
+ * Return:
+ *     false if the buffer has no room for it.
+ */
+bool TinySIP::deliver(const char* msg, size_t len) {
+  if (buff != NULL && buffLength + len > MAX_MESSAGE_SIZE && buffStart > buff) {
+    // Shift unparsed data to the beginning to clear some space
+    buffLength -= buffStart-buff;
+    memmove(buff, buffStart, buffLength);
+    buffStart = buff;
+  }
+  if (buff == NULL || buffLength + len > MAX_MESSAGE_SIZE) {
+    log_e("no room for a message of another account: %d", (int) len);
+    return false;
+  }
+  memcpy(buff+buffLength, msg, len);
+  buffLength += len;
+  buff[buffLength] = '\0';
+  resetBufferParsing();
+  return true;
+}
+
 void TinySIP::resetBufferParsing() {
   log_d("reset SIP buffer parsing");
 
@@ -912,10 +1674,18 @@ void TinySIP::resetBufferParsing() {
   respFromDispName = NULL;
   respFromAddrSpec = NULL;
 
-  //log_d(" - reset complete");
-  // Resetting dynamically allocated variable
-  //freeNull((void **) &respToTagDyn);       // TODO: do we really need to delete these here?
-  //freeNull((void **) &respFromTagDyn);     // TODO: do we really need to delete these here?
+  // Values copied from the previous message share its lifetime: drop them all at once
+  if (msgArena.allocs() > 0) {
+    log_d("parse arena: %d allocs, %d bytes, %d on heap (peak %d bytes, %d heap allocs in %d messages)",
+          msgArena.allocs(), (int) msgArena.used(), msgArena.heapAllocs(), (int) msgArena.peak(), msgArena.totalHeapAllocs(), msgArena.totalMessages());
+  }
+  remoteToFrom = NULL;
+  respToTag = NULL;
+  respFromTag = NULL;
+  respContDispName = NULL;
+  respContAddrSpec = NULL;
+  remoteTag = NULL;
+  msgArena.reset();
 }
 
 // INVITE method
@@ -933,7 +1703,7 @@ int TinySIP::requestInvite(uint32_t msNow, Connection& tcp, const char* toUri, c
     cseq;
   }*/
   cseq++;
-  freeNull((void **) &respToTagDyn);
+  respToTag = NULL;
 
   // Set timer for next retransmission
   msTimerAStart = msNow;
@@ -955,11 +1725,11 @@ int TinySIP::requestInvite(uint32_t msNow, Connection& tcp, const char* toUri, c
   sendHeaderCSeq(tcp, cseq, "INVITE");
   sendHeaderAllow(tcp);
   sendHeaderUserAgent(tcp);
-  sendHeaderAuthorization(tcp, toUri);    // Proxy-Authorization or Authorization
+  sendHeaderAuthorization(tcp, "INVITE", toUri);    // Proxy-Authorization or Authorization
 
   // Content headers and body
   if (body==NULL) {
-    const char* cstr = thisIP.c_str();
+    const char* cstr = mediaHost();
     int len = sdpBody(tcp, cstr, true);
     sendBodyHeaders(tcp, len, "application/sdp");
     sdpBody(tcp, cstr, false);
@@ -971,9 +1741,79 @@ int TinySIP::requestInvite(uint32_t msNow, Connection& tcp, const char* toUri, c
   if(UDP_SIP) {
     tcp.endPacket();
   }
+  callTrace.mark(CallTrace::INVITE_SENT);
   return TINY_SIP_OK;
 }
 
+/* Description:
+ *     learn the public address of the UDP flow to the proxy, so that Contact can be reached from outside the NAT.
+ *     TCP flows are left alone: the proxy sends requests back over the same connection (RFC 5626, ";ob"),
+ *     and Via is fixed up by the proxy anyway ("rport", RFC 3581).
+ *     If the mapping is not known yet, the query is sent through the flow and its response comes back to checkCall(),
+ *     which calls this again; REGISTER waits for it meanwhile. The RTP ports of the next calls are asked about too.
+ */
+void TinySIP::mapSipFlow(Connection& tcp) {
+  sipPublicIP[0] = '\0';
+  sipPublicPort = sipPublicLocalPort = 0;
+  IPAddress addr;
+  uint16_t port;
+  if (tcp.isUdp() && stun.mapSocket(tcp.fd(), tcp.localPort(), addr, port)) {
+    snprintf(sipPublicIP, sizeof(sipPublicIP), "%s", addr.toString().c_str());
+    sipPublicPort = port;
+    sipPublicLocalPort = tcp.localPort();
+  }
+  if (tcp.isUdp() && currentCall == NULL) {
+    stun.requestPort(getLocalAudioPort());                      // incoming call reuses the session port
+    stun.requestPort(50000 + 2*(nextSdpSessionId() % 4096));    // outgoing one takes the next one
+  }
+}
+
+/* Description:
+ *     public address of the RTP port of the session being offered or answered (before the SDP is sent).
+ *     Only a mapping learned beforehand is used: a call is not held up by the STUN server. The port of the session
+ *     after this one is asked about meanwhile.
+ */
+void TinySIP::mapMedia() {
+  rtpPublicIP[0] = '\0';
+  rtpPublicPort = 0;
+  IPAddress addr;
+  uint16_t port;
+  if (stun.mapPort(getLocalAudioPort(), addr, port)) {
+    snprintf(rtpPublicIP, sizeof(rtpPublicIP), "%s", addr.toString().c_str());
+    rtpPublicPort = port;
+  }
+  stun.requestPort(50000 + 2*(nextSdpSessionId() % 4096));
+}
+
+const char* TinySIP::contactHost(Connection& tcp) {
+  return (sipPublicIP[0] && tcp.isUdp() && tcp.localPort() == sipPublicLocalPort) ? sipPublicIP : thisIP.c_str();
+}
+
+uint16_t TinySIP::contactPort(Connection& tcp) {
+  return (sipPublicIP[0] && tcp.isUdp() && tcp.localPort() == sipPublicLocalPort) ? sipPublicPort : tcp.localPort();
+}
+
+const char* TinySIP::mediaHost() {
+  return rtpPublicIP[0] ? rtpPublicIP : thisIP.c_str();
+}
+
+uint16_t TinySIP::mediaPort() {
+  return rtpPublicIP[0] ? rtpPublicPort : getLocalAudioPort();
+}
+
+static const char* sdpDirection(uint8_t dir) {
+  switch (dir) {
+  case TinySIP::MEDIA_SEND:
+    return "sendonly";
+  case TinySIP::MEDIA_RECV:
+    return "recvonly";
+  case TinySIP::MEDIA_INACTIVE:
+    return "inactive";
+  default:
+    return "sendrecv";
+  }
+}
+
 /*
  * Description:
  *    send SDP body (if not onlyLen) or return length of the SDP body and exit
@@ -991,7 +1831,7 @@ int TinySIP::sdpBody(Connection& tcp, const char* ip, bool onlyLen) {
   // Here we just ensure that it cycles withing 8 decimal digits
   sdpSessionId = 0x2000000 + (sdpSessionId % 0x2000000);        // ensure it has at least 8 digits, but no more: 33554432 .. 67108863
 
-  const uint16_t localAudioPort = this->getLocalAudioPort();    // port to which audio should be sent through RTP
+  const uint16_t localAudioPort = this->mediaPort();            // port to which audio should be sent through RTP
   const uint16_t localRtcpPort = localAudioPort + 1;
 
   // TODO: send a single format chosen from the invite or 200 OK
@@ -1004,14 +1844,14 @@ int TinySIP::sdpBody(Connection& tcp, const char* ip, bool onlyLen) {
                                 "c=IN IP4 %s\r\n"
                                 "a=r%s:%d\r\n"// %s is replaced by udp or tcp
                                 "%s"
-                                "a=sendrecv\r\n";
+                                "a=%s\r\n";
 
   char rtpPayloads[40];
   char rtpMaps[100];
   rtpPayloads[0] = rtpMaps[0] = '\0';
   char *p = rtpPayloads;
   char *m = rtpMaps;
-  for (int i=0; i<sizeof(SUPPORTED_RTP_PAYLOADS)/sizeof(SUPPORTED_RTP_PAYLOADS[0]); i++) {
+  for (size_t i=0; i<sizeof(SUPPORTED_RTP_PAYLOADS)/sizeof(SUPPORTED_RTP_PAYLOADS[0]); i++) {
     if (this->audioFormat == TinySIP::NULL_RTP_PAYLOAD || SUPPORTED_RTP_PAYLOADS[i] == this->audioFormat) {
       p += snprintf(p, sizeof(rtpPayloads) - (p-rtpPayloads), " %d", SUPPORTED_RTP_PAYLOADS[i]);
       const char *s;
@@ -1040,7 +1880,8 @@ int TinySIP::sdpBody(Connection& tcp, const char* ip, bool onlyLen) {
 
   // NOTE: assumes that final SDP message will be shorter than double the size of the format string
   char buff[2*strlen(format)];
-  snprintf(buff, sizeof(buff), format, sdpSessionId, sdpSessionId, ip, localAudioPort, rtpPayloads, ip, (UDP_SIP ? "udp" : "tcp"), localRtcpPort, rtpMaps);
+  snprintf(buff, sizeof(buff), format, sdpSessionId, sdpSessionId + sdpVersion, ip, localAudioPort, rtpPayloads, ip, (UDP_SIP ? "udp" : "tcp"), localRtcpPort, rtpMaps,
+           sdpDirection(sdpLocalDir));
   auto sdpBodyLen = strlen(buff);
   if (sdpBodyLen == sizeof(buff)-1)
     // TODO: allocate more and retry
@@ -1108,14 +1949,14 @@ int TinySIP::sendAck(Connection& tcp, const char* toUri) {
 
     // Acknowledging 200 OK (or 2xx) after INVITE
 
-    if (respContAddrSpecDyn==NULL) {
+    if (respContAddrSpec==NULL) {
       return TINY_SIP_ERR;  // TODO
     }
 
     newBranch(branch);
 
     // Answer to UAS directly
-    sendRequestLine(tcp, "ACK", respContAddrSpecDyn);
+    sendRequestLine(tcp, "ACK", respContAddrSpec);
 
   } else {
 
@@ -1148,6 +1989,9 @@ int TinySIP::sendAck(Connection& tcp, const char* toUri) {
   if(UDP_SIP) {
     tcp.endPacket();
   }
+  if (ackInvite200) {
+    callTrace.mark(CallTrace::ACK_SENT);
+  }
 
   return TINY_SIP_OK;
 }
@@ -1166,7 +2010,7 @@ int TinySIP::requestBye(Connection& tcp) {
     tcp.beginPacket(tcp.remoteIP(), tcp.remotePort());
   }
   // Send BYE
-  sendRequestLine(tcp, "BYE", respContAddrSpecDyn!=NULL ? respContAddrSpecDyn : remoteUriDyn);
+  sendRequestLine(tcp, "BYE", respContAddrSpec!=NULL ? respContAddrSpec : remoteUriDyn);
 
   // Headers
   sendHeaderVia(tcp, thisIP, tcp.localPort(), branch);      // TODO: dialogs: store Via per dialog?
@@ -1195,6 +2039,86 @@ int TinySIP::requestBye(Connection& tcp) {
 }
 
 
+/* Description:
+ *      re-INVITE within the current call: new SDP offer (see modifySession) sent to the remote target of the dialog
+ */
+int TinySIP::requestReinvite(Connection& tcp) {
+  if (!tcp.connected() || !currentCall || !currentCall->callIdDyn) {
+    return TINY_SIP_ERR;
+  }
+  const char* target = currentCall->remoteTargetDyn ? currentCall->remoteTargetDyn : currentCall->remoteUriDyn;
+  if (!target) {
+    return TINY_SIP_ERR+1;
+  }
+
+  randInit();
+  newBranch(branch);
+  reinviteCSeq = ++currentCall->localCSeq;
+  respRouteSet.copy(currentCall->routeSet);
+  if(UDP_SIP) {
+    tcp.beginPacket(tcp.remoteIP(), tcp.remotePort());
+  }
+  // Send INVITE
+  sendRequestLine(tcp, "INVITE", target);
+
+  // Headers
+  sendHeaderVia(tcp, thisIP, tcp.localPort(), branch);
+  sendHeaderMaxForwards(tcp, 70);
+  sendRouteSetHeaders(tcp, true);
+  sendByeHeadersToFrom(tcp, currentCall);             // From: local, To: remote (both with dialog tags)
+  sendHeaderContact(tcp);
+  sendHeaderCallId(tcp, currentCall->callIdDyn);
+  sendHeaderCSeq(tcp, reinviteCSeq, "INVITE");
+  sendHeaderAllow(tcp);
+  sendHeaderUserAgent(tcp);
+  sendHeaderAuthorization(tcp, "INVITE", target);    // Proxy-Authorization or Authorization
+
+  // Content headers and body
+  const char* cstr = mediaHost();
+  int len = sdpBody(tcp, cstr, true);
+  sendBodyHeaders(tcp, len, "application/sdp");
+  sdpBody(tcp, cstr, false);
+  tcp.flush();
+  if(UDP_SIP) {
+    tcp.endPacket();
+  }
+  return TINY_SIP_OK;
+}
+
+/* Description:
+ *      ACK for a final response to our re-INVITE. Unlike sendAck(), all the headers come from the dialog:
+ *      2xx is acknowledged in a new transaction, other responses - in the transaction of the re-INVITE (same branch).
+ */
+int TinySIP::sendReinviteAck(Connection& tcp, bool ack2xx) {
+  if (!tcp.connected()) {
+    return TINY_SIP_ERR;
+  }
+  log_d("---------------Sending ACK (re-INVITE)---------------");
+  if (ack2xx) {
+    newBranch(branch);
+  }
+  if(UDP_SIP) {
+    tcp.beginPacket(tcp.remoteIP(), tcp.remotePort());
+  }
+  sendRequestLine(tcp, "ACK", currentCall->remoteTargetDyn ? currentCall->remoteTargetDyn : currentCall->remoteUriDyn);
+
+  // Headers
+  sendHeaderVia(tcp, thisIP, tcp.localPort(), branch);
+  sendHeaderMaxForwards(tcp, 70);
+  sendRouteSetHeaders(tcp, true);
+  sendByeHeadersToFrom(tcp, currentCall);
+  sendHeaderCallId(tcp, currentCall->callIdDyn);
+  sendHeaderCSeq(tcp, respCSeq, "ACK");
+  sendHeaderUserAgent(tcp);
+  sendBodyHeaders(tcp);
+
+  if(UDP_SIP) {
+    tcp.endPacket();
+  }
+  return TINY_SIP_OK;
+}
+
+
 // CANCEL method
 int TinySIP::requestCancel(Connection& tcp) {     // TODO: cancelling outgoing call still doesn't work for some reason
   if (!tcp.connected()) {
@@ -1279,8 +2203,9 @@ int TinySIP::requestRegister(Connection& tcp) {
   sendHeaderCallId(tcp, regCallIdDyn);
   sendHeaderCSeq(tcp, regCSeq, "REGISTER");
   sendHeaderContact(tcp);
+  snprintf(regContact, sizeof(regContact), "%d@%s:%d", phoneNumber, contactHost(tcp), contactPort(tcp));
   sendHeaderExpires(tcp, REGISTER_EXPIRATION_S);
-  sendHeaderAuthorization(tcp, localUriDyn);    // Proxy-Authorization or Authorization
+  sendHeaderAuthorization(tcp, "REGISTER", localUriDyn);    // Proxy-Authorization or Authorization
   sendBodyHeaders(tcp);
 
   msLastRegisterRequest = msLastKnownTime;
@@ -1293,34 +2218,41 @@ int TinySIP::requestRegister(Connection& tcp) {
 }
 
 // MESSAGE method
-int TinySIP::requestMessage(Connection& tcp) {
+// NOTE: this doesn't touch the call state (branch, cseq, remoteUriDyn), so messages can be sent during a call
+int TinySIP::requestMessage(Connection& tcp, OutgoingMessage* msg, bool retransmit) {
   if (!tcp.connected()) {
     return TINY_SIP_ERR;
   }
   if(UDP_SIP) {
     tcp.beginPacket(tcp.remoteIP(), tcp.remotePort());
   }
-  randInit();
-  newBranch(branch);
-  byeCSeq = ++cseq;     // remember bye CSeq to check against response  TODO
+  // A retransmission belongs to the same transaction: same branch and CSeq
+  if (!retransmit) {
+    randInit();
+    newBranch(msg->branch);
+    if (++msgCSeq > 60000) {
+      msgCSeq = 1;
+    }
+    msg->cseq = msgCSeq;
+  }
 
   // Send MESSAGE
-  sendRequestLine(tcp, "MESSAGE", remoteUriDyn);
+  sendRequestLine(tcp, "MESSAGE", msg->to);
 
   // Headers
-  sendHeaderVia(tcp, thisIP, tcp.localPort(), branch);
+  sendHeaderVia(tcp, thisIP, tcp.localPort(), msg->branch);
   sendHeaderMaxForwards(tcp, 70);
 
   sendHeaderToFromLocal(tcp, 'F');
-  sendHeaderToFromRemote(tcp, 'T', false, remoteUriDyn);
-  sendHeaderCallId(tcp, msgCallIdDyn);
-  sendHeaderCSeq(tcp, cseq, "MESSAGE");
+  sendHeaderToFromRemote(tcp, 'T', false, msg->to);
+  sendHeaderCallId(tcp, msg->callId);
+  sendHeaderCSeq(tcp, msg->cseq, "MESSAGE");
   sendHeaderUserAgent(tcp);
-  sendHeaderAuthorization(tcp, remoteUriDyn);
+  sendHeaderAuthorization(tcp, "MESSAGE", msg->to);
 
   // Body
-  sendBodyHeaders(tcp, strlen(outgoingMsgDyn), "text/plain");
-  TCP(tcp, outgoingMsgDyn);
+  sendBodyHeaders(tcp, strlen(msg->message), "text/plain");
+  TCP(tcp, msg->message);
   if(UDP_SIP) {
     tcp.endPacket();
   }
@@ -1332,11 +2264,11 @@ int TinySIP::requestMessage(Connection& tcp) {
 // - via header contents - sendHeadersVia()
 // - route set - sendRouteSetHeaders()
 // - localNameDyn, localUriDyn, localTag - sendHeaderToFromLocal()
-// - remoteToFromDyn, toUri, toTag - sendHeaderToFromRemote()
+// - remoteToFrom, toUri, toTag - sendHeaderToFromRemote()
 // - respCallId - sendHeaderCallId()
 // - respCSeq, respCSeqMethod - sendHeaderCSeq()
 // - sdpSessionId, sdpSessionId, localAudioPort, rtpPayloads, localRtcpPort, rtpMaps  - sdpBody()
-int TinySIP::sendResponse(Dialog* diag, Connection& tcp, uint16_t code, const char* reason, bool sendSdp) {
+int TinySIP::sendResponse(Dialog*, Connection& tcp, uint16_t code, const char* reason, bool sendSdp) {
   if (!tcp.connected()) {
     return TINY_SIP_ERR;
   }
@@ -1351,17 +2283,17 @@ int TinySIP::sendResponse(Dialog* diag, Connection& tcp, uint16_t code, const ch
   TCP(tcp, "\r\n");
 
   // Send headers
-  bool caller = (!diag || !diag->caller) ? false : true;   // most requests are outside of a dialog, so if we are replying to them -> we are assuming that other party is the "caller"
+  // The request came from the other party (even within a dialog that we've started): To is us, From is them
   sendHeadersVia(tcp);
   sendRouteSetHeaders(tcp, false);
-  sendHeaderToFromLocal(tcp, caller ? 'F' : 'T');          // To tag
-  sendHeaderToFromRemote(tcp, caller ? 'T' : 'F', true);   // From tag mirror
+  sendHeaderToFromLocal(tcp, 'T');          // To tag
+  sendHeaderToFromRemote(tcp, 'F', true);   // From tag mirror
   sendHeaderCallId(tcp);
   sendHeaderCSeq(tcp);
   sendHeaderContact(tcp);
   if (sendSdp) {
     // Send SDP body
-    const char* cstr = thisIP.c_str();
+    const char* cstr = mediaHost();
     int len = sdpBody(tcp, cstr, true);
     sendBodyHeaders(tcp, len, "application/sdp");
     sdpBody(tcp, cstr, false);
@@ -1374,8 +2306,32 @@ int TinySIP::sendResponse(Dialog* diag, Connection& tcp, uint16_t code, const ch
   return TINY_SIP_OK;
 }
 
+/* Description:
+ *      response to a NOTIFY: unlike in dialogs of calls, To is ours as it came (the tag of the subscription)
+ */
+int TinySIP::sendNotifyResponse(Connection& tcp, uint16_t code, const char* reason) {
+  if (!tcp.connected()) {
+    return TINY_SIP_ERR;
+  }
+  if(UDP_SIP) {
+    tcp.beginPacket(tcp.remoteIP(), tcp.remotePort());
+  }
+  TCP_PRINTF(tcp, "SIP/2.0 %d %s\r\n", code, reason);
+  sendHeadersVia(tcp);
+  TCP_PRINTF(tcp, "To: <%s>%s%s\r\n", respToAddrSpec ? respToAddrSpec : localUriDyn, respToTag ? ";tag=" : "", respToTag ? respToTag : "");
+  sendHeaderToFromRemote(tcp, 'F', true);   // From tag mirror
+  sendHeaderCallId(tcp);
+  sendHeaderCSeq(tcp);
+  sendBodyHeaders(tcp);
+  if(UDP_SIP) {
+    tcp.endPacket();
+  }
+  return TINY_SIP_OK;
+}
+
 int TinySIP::startCall(const char* toUri, uint32_t msNow) {
   log_i("startCall with %s",toUri);
+  callTrace.start();
 
   // Reset state before making a call
   resetBuffer();
@@ -1392,49 +2348,490 @@ int TinySIP::startCall(const char* toUri, uint32_t msNow) {
     log_i("NULL CALLEE ERROR ");
   }
 
-  // New session ID
-  randInit();
-  sdpSessionId = sdpSessionId>0 ? sdpSessionId + 1 : phoneNumber;
-  log_d("phoneNumber  = %d", phoneNumber);
-  log_d("sdpSessionId = %d", sdpSessionId);
+  // New session ID
+  randInit();
+  sdpSessionId = nextSdpSessionId();
+  log_d("phoneNumber  = %d", phoneNumber);
+  log_d("sdpSessionId = %d", sdpSessionId);
+  resetSession();
+  sdpRemoteDir = MEDIA_SENDRECV;
+  mapMedia();
+
+  // Send INVITE
+//    log_d("FORCING PROXY");
+//    if (ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort, true)) {     // TODO: why does this require renewing connection?
+//      requestInvite(msNow, *tcpProxy, toUri, NULL);
+//    }
+  if (ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort)) {
+    callTrace.mark(CallTrace::CONNECTED);
+    requestInvite(msNow, *tcpProxy, toUri, NULL);
+  }
+
+  return TINY_SIP_OK;     // TODO: check for errors
+}
+
+/* Description:
+ *      queue a MESSAGE request; it gets sent from checkCall() in any call state, up to MESSAGE_PIPELINE at a time.
+ *      The outcome is reported through checkDelivery() with the same `id`.
+ * Return:
+ *      TINY_SIP_OK if queued, TINY_SIP_ERR if the outbox is full
+ */
+int TinySIP::sendMessage(const char* toUri, const char* msg, uint32_t id) {
+  log_d("TinySIP::sendMessage");
+  if (toUri==NULL || msg==NULL || outbox.size() >= MESSAGE_QUEUE) {
+    return TINY_SIP_ERR;
+  }
+  OutgoingMessage* m = new OutgoingMessage(msg, toUri, id, msLastKnownTime);
+  if (m->message==NULL || m->to==NULL) {
+    delete m;
+    return TINY_SIP_ERR;
+  }
+  newCallId(&m->callId);    // outside of a dialog, therefore creating a new unique Call-ID
+  outbox.add(m);
+  pumpOutbox(msLastKnownTime);
+  return TINY_SIP_OK;
+}
+
+/* Description:
+ *      send queued messages and retry the failed ones, keeping at most MESSAGE_PIPELINE transactions in flight
+ */
+void TinySIP::pumpOutbox(uint32_t msNow) {
+  int inFlight = 0;
+  for (size_t i=0; i<outbox.size(); i++) {
+    OutgoingMessage* m = outbox[i];
+    if (m->inFlight) {
+      if (elapsedMillis(msNow, m->msSent, MESSAGE_TIMEOUT_MS)) {
+        log_d("MESSAGE %d: timeout", m->id);
+        m->code = 0;
+        if (m->attempts >= MESSAGE_ATTEMPTS) {
+          finishOutgoing(i--, false, msNow);
+        } else {
+          retryOutgoing(i, msNow);
+        }
+      } else {
+        inFlight++;
+        // RFC 3261, 17.1.2.2: over UDP the request is sent again until a response comes, T1 doubling up to T2
+        if (m->msTimerE && elapsedMillis(msNow, m->msResent, m->msTimerE) && tcpProxy!=NULL && tcpProxy->connected() &&
+            requestMessage(*tcpProxy, m, true)==TINY_SIP_OK) {
+          m->msResent = msNow;
+          m->msTimerE = m->msTimerE*2 < T2_MS ? m->msTimerE*2 : T2_MS;
+          log_d("MESSAGE %d: retransmitted, CSeq %d", m->id, m->cseq);
+        }
+      }
+    }
+  }
+
+  // Only use a live connection: (re)connecting is done by registration
+  if (tcpProxy==NULL || !tcpProxy->connected()) {
+    return;
+  }
+  for (size_t i=0; i<outbox.size() && inFlight<MESSAGE_PIPELINE; i++) {
+    OutgoingMessage* m = outbox[i];
+    if (!m->inFlight && (!m->attempts || elapsedMillis(msNow, m->msSent, m->msWait))) {
+      if (requestMessage(*tcpProxy, m)!=TINY_SIP_OK) {
+        break;
+      }
+      m->inFlight = true;
+      m->attempts++;
+      sentOutgoing(m, msNow);
+      inFlight++;
+      log_d("MESSAGE %d: attempt %d, CSeq %d", m->id, m->attempts, m->cseq);
+    }
+  }
+}
+
+// New transaction of an outgoing MESSAGE: Timer F (MESSAGE_TIMEOUT_MS) starts, and Timer E if the transport is unreliable
+void TinySIP::sentOutgoing(OutgoingMessage* msg, uint32_t msNow) {
+  msg->msSent = msg->msResent = msNow;
+  msg->msTimerE = tcpProxy->isUdp() ? T1_MS : 0;
+}
+
+int TinySIP::findOutgoing(const char* callId) {
+  if (callId!=NULL) {
+    for (size_t i=0; i<outbox.size(); i++) {
+      if (!strcmp(outbox[i]->callId, callId)) {
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+/* Description:
+ *      final response to a MESSAGE request from the outbox (authentication challenges are handled in checkCall)
+ */
+void TinySIP::outgoingResponse(int i, uint32_t msNow) {
+  OutgoingMessage* m = outbox[i];
+  if (!m->inFlight || respCSeq!=m->cseq) {
+    return;     // stray response
+  }
+  if (respClass=='1') {
+    if (m->msTimerE) {
+      m->msTimerE = T2_MS;        // RFC 3261, 17.1.2.2: Proceeding, retransmitted every T2
+    }
+    return;
+  }
+  m->code = respCode;
+  if (respClass=='2') {
+    finishOutgoing(i, true, msNow);
+  } else if ((respCode==408 || respCode==480 || respCode==500 || respCode==503 || respCode==504) && m->attempts < MESSAGE_ATTEMPTS) {
+    retryOutgoing(i, msNow);    // temporary failure
+  } else {
+    finishOutgoing(i, false, msNow);
+  }
+}
+
+void TinySIP::retryOutgoing(int i, uint32_t msNow) {
+  OutgoingMessage* m = outbox[i];
+  m->inFlight = false;
+  m->msSent = msNow;
+  m->msWait = MESSAGE_RETRY_MS << (m->attempts - 1);
+  log_d("MESSAGE %d: retry in %d ms", m->id, m->msWait);
+}
+
+void TinySIP::finishOutgoing(int i, bool delivered, uint32_t msNow) {
+  OutgoingMessage* m = outbox[i];
+  MessageDelivery* d = new MessageDelivery();
+  d->id = m->id;
+  d->delivered = delivered;
+  d->code = m->code;
+  d->attempts = m->attempts;
+  d->msLatency = msNow - m->msQueued;
+  log_i("MESSAGE %d: %s (%d) in %d ms, %d attempt(s)", d->id, delivered ? "delivered" : "failed", d->code, d->msLatency, d->attempts);
+  deliveries.add(d);
+  delete m;
+  outbox.remove(i);
+}
+
+/* Description:
+ *      remember the incoming MESSAGE transaction being answered (Call-ID and CSeq)
+ * Return:
+ *      true if it was answered before: a retransmission after a lost 200 OK, the text is not delivered twice
+ */
+bool TinySIP::repeatedMessage() {
+  if (respCallId==NULL) {
+    return false;
+  }
+  uint32_t h = hash_murmur(respCallId);
+  for (int i=0; i<MESSAGE_SEEN; i++) {
+    if (msgSeen[i].callIdHash==h && msgSeen[i].cseq==respCSeq) {
+      log_d("MESSAGE retransmission, CSeq %d", respCSeq);
+      return true;
+    }
+  }
+  msgSeen[msgSeenNext].callIdHash = h;
+  msgSeen[msgSeenNext].cseq = respCSeq;
+  msgSeenNext = (msgSeenNext + 1) % MESSAGE_SEEN;
+  return false;
+}
+
+/* Description:
+ *      returns the outcome of an outgoing message, if there is one (to be deleted by the caller)
+ */
+MessageDelivery* TinySIP::checkDelivery() {
+  if (!deliveries.size()) {
+    return nullptr;
+  }
+  MessageDelivery* res = deliveries[0];
+  deliveries.remove(0);
+  return res;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - -  Presence  - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// Longest list in the SUBSCRIBE body: a UDP request must fit a single datagram
+static const size_t PRESENCE_LIST_UDP = 700;
+static const size_t PRESENCE_LIST_STREAM = 8000;
+
+void TinySIP::watchPresence(bool on) {
+  presenceWanted = on;
+  if (!on && !presActive) {
+    endPresence(0);
+  }
+  // An active subscription is ended by checkPresence()
+}
+
+/* Description:
+ *      keep one subscription to the presence of all the contacts in the PresenceTable: a resource list (RFC 4662) given
+ *      in the body of the initial SUBSCRIBE (RFC 5367) to the list server (the registrar domain). Such a list can't be
+ *      changed within the subscription, so a new one is made whenever the phonebook changes.
+ */
+void TinySIP::checkPresence(uint32_t msNow) {
+  if (presPending) {
+    if (elapsedMillis(msNow, msPresRequest, MESSAGE_TIMEOUT_MS)) {
+      log_d("SUBSCRIBE: timeout");
+      endPresence(PRESENCE_RETRY_MS);
+    }
+    return;
+  }
+
+  // Only use a live connection: (re)connecting is done by registration
+  if (!this->registered || tcpProxy==NULL || !tcpProxy->connected() || localUriDyn==NULL) {
+    return;
+  }
+
+  if (presActive && (!presenceWanted || presListVersion!=presence.listVersion())) {
+    log_d("SUBSCRIBE: unsubscribing");
+    requestSubscribe(*tcpProxy, 0);     // the response is of no interest
+    endPresence(0);
+  }
+  if (!presenceWanted || !presence.size() || !elapsedMillis(msNow, msPresRequest, msPresWait)) {
+    return;
+  }
+
+  if (!presActive) {
+    // New subscription
+    AddrSpec addrParsed(localUriDyn);
+    if (addrParsed.scheme()==NULL || addrParsed.hostPort()==NULL) {
+      return;
+    }
+    freeNull((void **) &presTargetDyn);
+    presTargetDyn = (char*) extMalloc(strlen(addrParsed.scheme()) + strlen(addrParsed.hostPort()) + 2);
+    if (presTargetDyn==NULL) {
+      return;
+    }
+    sprintf(presTargetDyn, "%s:%s", addrParsed.scheme(), addrParsed.hostPort());
+    newCallId(&presCallIdDyn);
+    presLocalTag[0] = 'z';
+    Random.randChars(presLocalTag+1, OWN_TAG_LENGTH-1);
+    presLocalTag[OWN_TAG_LENGTH] = '\0';
+    freeNull((void **) &presRemoteTagDyn);
+    presListVersion = presence.listVersion();
+    presence.newSubscription();
+  }
+  if (requestSubscribe(*tcpProxy, PRESENCE_EXPIRES_S)!=TINY_SIP_OK) {
+    endPresence(PRESENCE_RETRY_MS);
+  }
+}
+
+/* Description:
+ *      SUBSCRIBE for the presence event package: initial (with the resource list), refresh or removal (expiresS = 0)
+ */
+int TinySIP::requestSubscribe(Connection& tcp, uint32_t expiresS) {
+  if (!tcp.connected() || presCallIdDyn==NULL || presTargetDyn==NULL) {
+    return TINY_SIP_ERR;
+  }
+  AddrSpec server(localUriDyn);       // the list server, as in the initial Request-URI
+  if (server.scheme()==NULL || server.hostPort()==NULL) {
+    return TINY_SIP_ERR;
+  }
+  bool initial = presRemoteTagDyn==NULL && expiresS;
+  size_t maxLen = tcp.isUdp() ? PRESENCE_LIST_UDP : PRESENCE_LIST_STREAM;
+  int len = initial ? presenceListBody(tcp, maxLen, true) : 0;
+  if(UDP_SIP) {
+    tcp.beginPacket(tcp.remoteIP(), tcp.remotePort());
+  }
+  randInit();
+  char subBranch[BRANCH_CONSTANT_LEN+BRANCH_VARIABLE_LEN+1];
+  newBranch(subBranch);
+  if (++presCSeq > 60000) {
+    presCSeq = 1;
+  }
+
+  // Send SUBSCRIBE
+  sendRequestLine(tcp, "SUBSCRIBE", presTargetDyn);
+
+  // Headers
+  sendHeaderVia(tcp, thisIP, tcp.localPort(), subBranch);
+  sendHeaderMaxForwards(tcp, 70);
+
+  TCP_PRINTF(tcp, "From: \"%s\" <%s>;tag=%s\r\n", localNameDyn, localUriDyn, presLocalTag);
+  TCP_PRINTF(tcp, "To: <%s:%s>%s%s\r\n", server.scheme(), server.hostPort(),
+             presRemoteTagDyn ? ";tag=" : "", presRemoteTagDyn ? presRemoteTagDyn : "");
+  sendHeaderCallId(tcp, presCallIdDyn);
+  sendHeaderCSeq(tcp, presCSeq, "SUBSCRIBE");
+  sendHeaderContact(tcp);
+  TCP(tcp, "Event: presence\r\n");
+  TCP(tcp, "Accept: application/pidf+xml, application/rlmi+xml, multipart/related\r\n");
+  TCP(tcp, "Supported: eventlist\r\n");
+  sendHeaderExpires(tcp, expiresS);
+  sendHeaderUserAgent(tcp);
+  sendHeaderAuthorization(tcp, "SUBSCRIBE", presTargetDyn);
+
+  // Body: the list (RFC 4826)
+  if (initial) {
+    TCP(tcp, "Require: recipient-list-subscribe\r\n");
+    TCP(tcp, "Content-Disposition: recipient-list\r\n");
+    sendBodyHeaders(tcp, len, "application/resource-lists+xml");
+    presenceListBody(tcp, maxLen, false);
+  } else {
+    sendBodyHeaders(tcp);
+  }
+  if(UDP_SIP) {
+    tcp.endPacket();
+  }
+  presPending = expiresS > 0;
+  presExpiresReq = expiresS;
+  msPresRequest = msLastKnownTime;
+  log_d("SUBSCRIBE: CSeq %d, expires %d%s", presCSeq, expiresS, initial ? ", with the list" : "");
+  return TINY_SIP_OK;
+}
+
+/* Description:
+ *      the resource list of the watched URIs; those that don't fit into maxLen are left out
+ * Return:
+ *      length of the body if onlyLen is true, otherwise 0
+ */
+int TinySIP::presenceListBody(Connection& tcp, size_t maxLen, bool onlyLen) {
+  const char head[] PROGMEM = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+                              "<resource-lists xmlns=\"urn:ietf:params:xml:ns:resource-lists\">\r\n"
+                              "<list>\r\n";
+  const char tail[] PROGMEM = "</list>\r\n"
+                              "</resource-lists>\r\n";
+  size_t len = strlen(head) + strlen(tail);
+  if (!onlyLen) {
+    TCP(tcp, head);
+  }
+  int left = presence.size();
+  for (const char* uri = presence.firstUri(); uri!=NULL; uri = presence.nextUri(uri), left--) {
+    size_t entryLen = strlen(uri) + 17;           // <entry uri=""/> CRLF
+    if (len + entryLen > maxLen) {
+      if (onlyLen) {
+        log_e("SUBSCRIBE: %d contacts don't fit", left);
+      }
+      break;
+    }
+    len += entryLen;
+    if (!onlyLen) {
+      TCP_PRINTF(tcp, "<entry uri=\"%s\"/>\r\n", uri);
+    }
+  }
+  if (!onlyLen) {
+    TCP(tcp, tail);
+  }
+  return onlyLen ? len : 0;
+}
+
+/* Description:
+ *      stop the presence subscription (without unsubscribing) and forget the statuses; start a new one in msRetry
+ */
+void TinySIP::endPresence(uint32_t msRetry) {
+  freeNull((void **) &presCallIdDyn);
+  freeNull((void **) &presRemoteTagDyn);
+  presPending = presActive = false;
+  msPresRequest = msLastKnownTime;
+  msPresWait = msRetry;
+  presence.forget();
+}
+
+void TinySIP::subscribeResponse(uint32_t msNow) {
+  if (!presPending || respCallId==NULL || presCallIdDyn==NULL || strcmp(respCallId, presCallIdDyn) || respCSeq!=presCSeq || respClass=='1') {
+    return;
+  }
+  presPending = false;
+  log_d("SUBSCRIBE: %d", respCode);
+
+  if (respClass=='2') {
+
+    // Subscription accepted: refresh it before the granted time runs out (the NOTIFYs may tell another time)
+    if (presRemoteTagDyn==NULL && respToTag!=NULL) {
+      presRemoteTagDyn = extStrdup(respToTag);
+    }
+    if (respContAddrSpec!=NULL) {
+      freeNull((void **) &presTargetDyn);
+      presTargetDyn = extStrdup(respContAddrSpec);
+    }
+    uint32_t expiresS = respExpires > 0 && (uint32_t) respExpires < presExpiresReq ? respExpires : presExpiresReq;
+    presActive = true;
+    msPresRequest = msNow;
+    msPresWait = expiresS*800;
+
+  } else if (respCode==PROXY_AUTHENTICATION_REQUIRED_407 || respCode==UNAUTHORIZED_401) {
+
+    bool stale = digestStale!=NULL && !strcasecmp(digestStale, "true");
+    if (!stale && authCache.isValid(proxyIpAddr) && authCache.used && digestNonce!=NULL && !strcmp(digestNonce, authCache.nonceDyn)) {
+      log_e("SUBSCRIBE: authentication failed");
+      endPresence(PRESENCE_UNSUPPORTED_MS);
+    } else {
+      authCache.update(digestRealm, digestNonce, digestOpaque, digestQopPref, digestAlgorithm,
+                       respCode==PROXY_AUTHENTICATION_REQUIRED_407, proxyIpAddr);
+      if (requestSubscribe(*tcpProxy, presExpiresReq)!=TINY_SIP_OK) {
+        endPresence(PRESENCE_RETRY_MS);
+      }
+    }
+
+  } else if (respCode==INTERVAL_TOO_BRIEF_423) {
 
-  // Send INVITE
-//    log_d("FORCING PROXY");
-//    if (ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT, true)) {     // TODO: why does this require renewing connection?
-//      requestInvite(msNow, *tcpProxy, toUri, NULL);
-//    }
-  if (ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT)) {
-    requestInvite(msNow, *tcpProxy, toUri, NULL);
-  }
+    // Interval Too Brief: ask for the minimum
+    const char* minExpires = findHeader("min-expires");
+    uint32_t expiresS = minExpires!=NULL ? strtoul(minExpires, NULL, 10) : 0;
+    if (expiresS <= presExpiresReq || requestSubscribe(*tcpProxy, expiresS)!=TINY_SIP_OK) {
+      endPresence(PRESENCE_RETRY_MS);
+    }
 
-  return TINY_SIP_OK;     // TODO: check for errors
-}
+  } else if (respCode==403 || respCode==404 || respCode==405 || respCode==415 || respCode==420 || respCode==BAD_EVENT_489 ||
+             respCode==501) {
 
-int TinySIP::sendMessage(const char* toUri, const char* msg) {
-  log_d("TinySIP::sendMessage");
+    // The server doesn't do resource lists (or presence at all)
+    log_i("SUBSCRIBE: presence lists not supported");
+    endPresence(PRESENCE_UNSUPPORTED_MS);
 
-  // Reset state before making a call
-  resetBuffer();
-  clearDynamicParsed();
+  } else {
 
-  // New callID
-  newCallId(&msgCallIdDyn);   // outside of a dialog, therefore creating a new unique Call-ID
+    // 481 - the subscription is gone, anything else - try again later
+    endPresence(respCode==CALL_DOES_NOT_EXIST_481 ? 0 : PRESENCE_RETRY_MS);
 
-  // New "callee"
-  freeNull((void **) &remoteUriDyn);
-  remoteUriDyn = strdup(toUri);
+  }
+}
+
+/* Description:
+ *      apply a NOTIFY of the presence subscription to the PresenceTable and answer it (RFC 6665, 4.1.3)
+ */
+TinySIP::StateFlags_t TinySIP::notifyRequest() {
+  uint16_t localCode = OK_200;
+  const char* localReason = "OK";
+  const char* event = findHeader("event");
+  if (event==NULL) {
+    event = findHeader("o");
+  }
+  if (respCallId==NULL || presCallIdDyn==NULL || strcmp(respCallId, presCallIdDyn) || respToTag==NULL || strcmp(respToTag, presLocalTag)) {
+    localCode = CALL_DOES_NOT_EXIST_481;
+    localReason = "Subscription Does Not Exist";
+  } else if (event==NULL || strncasecmp(event, "presence", 8) || (event[8] && event[8]!=';' && !isspace((unsigned char) event[8]))) {
+    localCode = BAD_EVENT_489;
+    localReason = "Bad Event";
+  } else {
+
+    // The list server: its tag (if the NOTIFY came before the 2xx) and target
+    if (presRemoteTagDyn==NULL && respFromTag!=NULL) {
+      presRemoteTagDyn = extStrdup(respFromTag);
+    }
+    if (respContAddrSpec!=NULL && (presTargetDyn==NULL || strcmp(presTargetDyn, respContAddrSpec))) {
+      freeNull((void **) &presTargetDyn);
+      presTargetDyn = extStrdup(respContAddrSpec);
+    }
 
-  // New message text
-  freeNull((void **) &outgoingMsgDyn);
-  outgoingMsgDyn = strdup(msg);
+    // Statuses
+    if (presence.applyNotify(respContentType, respBody, respBody!=NULL ? respContentLength : 0)==PresenceTable::OUT_OF_SEQUENCE) {
+      log_d("NOTIFY: versions skipped, refreshing");
+      msPresWait = 0;       // the refresh brings the full state
+    }
 
-  // Send MESSAGE request
-  if (ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT)) {
-    requestMessage(*tcpProxy);
-    return TINY_SIP_OK;
+    // Subscription state
+    const char* state = findHeader("subscription-state");
+    if (state!=NULL && !strncasecmp(state, "terminated", 10)) {
+      const char* reason = strstr(state, "reason=");
+      reason = reason!=NULL ? reason + 7 : "";
+      log_i("NOTIFY: subscription terminated: %s", reason);
+      if (!strncasecmp(reason, "rejected", 8) || !strncasecmp(reason, "noresource", 10)) {
+        endPresence(PRESENCE_UNSUPPORTED_MS);
+      } else {
+        endPresence(!strncasecmp(reason, "deactivated", 11) || !strncasecmp(reason, "timeout", 7) ? 0 : PRESENCE_RETRY_MS);
+      }
+    } else if (state!=NULL && presActive) {
+      const char* expires = strstr(state, "expires=");
+      uint32_t expiresS = expires!=NULL ? strtoul(expires + 8, NULL, 10) : 0;
+      if (expiresS && !elapsedMillis(msLastKnownTime, msPresRequest, msPresWait) &&
+          expiresS*800 < msPresWait - (msLastKnownTime - msPresRequest)) {
+        msPresRequest = msLastKnownTime;
+        msPresWait = expiresS*800;
+      }
+    }
   }
 
-  return TINY_SIP_ERR;
+  Connection* tcpReply = getConnection(false);
+  log_v("--- %d %s for NOTIFY ---", localCode, localReason);
+  return sendNotifyResponse(*tcpReply, localCode, localReason)==TINY_SIP_OK ? EVENT_NONE : EVENT_SIP_ERROR;
 }
 
 /* Description:
@@ -1459,8 +2856,9 @@ int TinySIP::acceptCall() {
     currentCall->terminated = 1;
     return TINY_SIP_ERR+1;
   }
+  callTrace.start(CallTrace::ACCEPT_CALL);
 
-  if (!ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT)) {
+  if (!ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort)) {
     log_e("error: could not ensure proxy connection");
   }
   Connection* tcpReply = getConnection(false);
@@ -1468,11 +2866,14 @@ int TinySIP::acceptCall() {
 // tcpProxy->beginPacket(tcpProxy->remoteIP(), tcpProxy->remotePort());
 // #endif
   log_v("--- 200 OK for INVITE ---");
+  sdpLocalDir = answerDirection();
+  mapMedia();
   int err = sendResponse(currentCall, *tcpReply, OK_200, "OK", true);
   //int err = sendResponse(currentCall, *tcpProxy, OK_200, "OK", true);
   if (err==TINY_SIP_OK) {
     // Change dialog state to confirmed
     currentCall->setConfirmed();
+    callTrace.mark(CallTrace::OK_SENT);
   } else {
     log_d("terminated = 1");
     currentCall->terminated = 1;
@@ -1501,7 +2902,7 @@ int TinySIP::declineCall() {
     return TINY_SIP_ERR+1;
   }
 
-  if (!ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT)) {
+  if (!ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort)) {
     log_d("Error: could not ensure proxy connection");
   }
   Connection* tcpReply = getConnection(false);
@@ -1523,20 +2924,74 @@ int TinySIP::declineCall() {
  */
 int TinySIP::registration() {
   log_d("TinySIP::register");
-  if (ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT)) {         // stale connection is checked against msLastReceived
+  if (ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort)) {         // stale connection is checked against msLastReceived
+    if (!sipPublicIP[0] && tcpProxy->isUdp()) {
+      mapSipFlow(*tcpProxy);          // the STUN response may have been read by another account on this connection
+    }
     requestRegister(*tcpProxy);
   }
   return TINY_SIP_OK;     // TODO: check for errors in sending
 }
 
+/*
+ * Description:
+ *      use the registration lifetime granted in the 2xx response to REGISTER (RFC 3261, 10.2.4: the expires parameter of
+ *      our own Contact, or else the Expires header) and schedule the refresh at a random point between 80% and 90% of it,
+ *      so that phones behind the same registrar don't refresh in lockstep. Not sooner than REGISTER_MIN_REFRESH_MS, unless
+ *      the registration would lapse by then: the refresh is always sent before it does.
+ */
+void TinySIP::scheduleRegisterRefresh() {
+  if (respContExpires > 0) {
+    registerExpiresS = respContExpires;
+  } else if (respExpires > 0) {
+    registerExpiresS = respExpires;
+  } else {
+    registerExpiresS = REGISTER_EXPIRATION_S;
+  }
+  if (registerExpiresS > 86400) {
+    registerExpiresS = 86400;     // keep the milliseconds within 32 bits
+  }
+  uint32_t msGranted = registerExpiresS*1000;
+  uint32_t msLatest = msGranted > 2*REGISTER_MARGIN_MS ? msGranted - REGISTER_MARGIN_MS : msGranted/2;
+  msRegisterRefresh = registerExpiresS*800 + Random.random() % (registerExpiresS*100 + 1);
+  if (msRegisterRefresh < REGISTER_MIN_REFRESH_MS) {
+    msRegisterRefresh = REGISTER_MIN_REFRESH_MS < msLatest ? REGISTER_MIN_REFRESH_MS : msLatest;
+    log_e("registrar granted only %d s, refreshing in %d ms", registerExpiresS, msRegisterRefresh);
+  }
+  flowTimer.setServerTimer(respFlowTimer);
+  log_d("registered for %d s, refresh in %d s", registerExpiresS, msRegisterRefresh/1000);
+}
+
+/*
+ * Description:
+ *      is a Contact of a 2xx to REGISTER our own binding? By its +sip.instance (RFC 5626), if it has one, otherwise by
+ *      the user@host:port we sent in the REGISTER.
+ */
+bool TinySIP::isOwnContact(const char* addrSpec, char* params) {
+  char* instance = NULL;
+  if (params!=NULL && retrieveGenericParam(params, "+sip.instance", TINY_SIP_SEMI, &instance, &msgArena) && instance!=NULL) {
+    char own[64];
+    snprintf(own, sizeof(own), TINYSIP_URN_UUID_PREFIX "%s", macHex);
+    return macHex[0] && strstr(instance, own)!=NULL;
+  }
+  if (!regContact[0] || strncasecmp(addrSpec, "sip:", 4)) {
+    return false;
+  }
+  const char* hostport = addrSpec + 4;
+  size_t len = strcspn(hostport, ";?>");
+  return len==strlen(regContact) && !strncasecmp(hostport, regContact, len);
+}
+
 int TinySIP::ping(uint32_t now) {
   log_d("TinySIP::ping");
-  if (ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT)) {         // stale connection is checked against msLastReceived
+  if (ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort)) {         // stale connection is checked against msLastReceived
     if (tcpProxy->connected()) {
       TCP((*tcpProxy), TINY_SIP_CRLF TINY_SIP_CRLF);
       tcpProxy->msLastPing = now;
       tcpProxy->rePinged = tcpProxy->pinged;      // connection can be considered stale only after second ping sent without reply to the first one
       tcpProxy->pinged = true;
+      tcpProxy->pongMissed = false;
+      msPingDelay = flowTimer.pingDelayMs(msRegisterRefresh);     // a registration refresh keeps the binding alive as well
       return TINY_SIP_OK;
     }
   }
@@ -1560,7 +3015,7 @@ int TinySIP::terminateCall(uint32_t now) {
   }
   if (currentCall->terminated) {
     if(tcpProxy) {
-      int errCancel = requestCancel(*tcpProxy);
+      requestCancel(*tcpProxy);
     }
     log_e("currentCall is already terminated");
     return TINY_SIP_ERR+1;
@@ -1602,18 +3057,15 @@ int TinySIP::terminateCall(uint32_t now) {
     cseq  = currentCall->remoteCSeq;
   }
 
-  freeNull((void **) &respContAddrSpecDyn);
-  if (currentCall->remoteTargetDyn) {
-    respContAddrSpecDyn = extStrdup(currentCall->remoteTargetDyn);
-  }
+  respContAddrSpec = msgArena.copy(currentCall->remoteTargetDyn);
 
   respRouteSet.copy(currentCall->routeSet);
 
   int err = TINY_SIP_ERR+1;
   if (0 && currentCall && currentCall->caller && !currentCall->confirmed) {     // TODO: sending CANCEL request doesn't work now; instead we are sending a regular BYE request
 //    log_v("FORCING PROXY");
-//    if (ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT, true)) {                 // TODO: why renewing the connection?
-    if (ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT)) {
+//    if (ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort, true)) {                 // TODO: why renewing the connection?
+    if (ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort)) {
       log_v("--- Cancelling ---");
       err = requestCancel(*tcpProxy);
       if (err!=TINY_SIP_OK) {
@@ -1679,6 +3131,172 @@ void TinySIP::rtpSilent() {
 
 }
 
+/* Description:
+ *      put the current call on hold or resume it (RFC 6337): re-INVITE with "a=sendonly" / "a=inactive" or "a=sendrecv".
+ *      The outcome is reported by checkCall() as EVENT_MEDIA_UPDATE, see mediaDirection().
+ */
+int TinySIP::holdCall(bool hold) {
+  log_i("TinySIP::holdCall %d", hold);
+  if (!currentCall || currentCall->terminated || !currentCall->confirmed) {
+    log_e("no confirmed call to hold");
+    return TINY_SIP_ERR;
+  }
+  if (reinviteCSeq) {
+    log_e("re-INVITE is already pending");
+    return TINY_SIP_ERR+1;
+  }
+  reinvitePrevHold = localHold;
+  localHold = hold;
+  reinviteRetry = false;
+  return modifySession();
+}
+
+/* Description:
+ *      offer the media direction that reflects `localHold` in a re-INVITE
+ */
+int TinySIP::modifySession() {
+  reinvitePrevDir = sdpLocalDir;
+  sdpLocalDir = offerDirection();
+  sdpVersion++;                   // RFC 3264: the version is incremented for each modification of the session
+  int err = requestReinvite(*getConnection(true));
+  if (err!=TINY_SIP_OK) {
+    log_e("re-INVITE error: %d", err);
+    sdpLocalDir = reinvitePrevDir;
+    localHold = reinvitePrevHold;
+    reinviteCSeq = 0;
+  }
+  return err;
+}
+
+/* Description:
+ *      process a final response to our re-INVITE
+ */
+TinySIP::StateFlags_t TinySIP::reinviteResponse(uint32_t msNow) {
+  if (respClass=='1') {
+    return EVENT_NONE;
+  }
+  StateFlags_t res = EVENT_NONE;
+  bool success = respClass=='2';
+  if (success && respContAddrSpec) {
+    // RFC 3261, 12.2.1.2: 2xx to re-INVITE is a target refresh
+    freeNull((void **) &currentCall->remoteTargetDyn);
+    currentCall->remoteTargetDyn = extStrdup(respContAddrSpec);
+  }
+  respRouteSet.copy(currentCall->routeSet);
+  int err = sendReinviteAck(*getConnection(true), success);
+  if (err!=TINY_SIP_OK) {
+    log_e("acking error: %d", err);
+  }
+  if (respCode==UNAUTHORIZED_401 || respCode==PROXY_AUTHENTICATION_REQUIRED_407) {
+    return res;                   // the re-INVITE gets repeated with credentials (see checkCall)
+  }
+  reinviteCSeq = 0;
+
+  if (success) {
+    res |= EVENT_MEDIA_UPDATE;
+  } else if (respCode==CALL_DOES_NOT_EXIST_481 || respCode==REQUEST_TIMEOUT_408) {
+    // RFC 3261, 14.1: the dialog is gone
+    log_d("terminated = 1");
+    currentCall->terminated = 1;
+    res |= EVENT_CALL_TERMINATED;
+  } else {
+    // The session stays as it was
+    sdpLocalDir = reinvitePrevDir;
+    if (respCode==REQUEST_PENDING) {
+      // RFC 3261, 14.1: re-INVITEs crossed (glare) -> try again after a random delay
+      reinviteRetry = true;
+      msReinviteRetry = msNow;
+      msReinviteDelay = (currentCall->caller ? GLARE_OWNER_MS : GLARE_OTHER_MS) + Random.random() % GLARE_RANDOM_MS;
+      log_d("re-INVITE in %d ms", msReinviteDelay);
+    } else {
+      localHold = reinvitePrevHold;
+      res |= EVENT_MEDIA_UPDATE;
+    }
+  }
+  return res;
+}
+
+/* Description:
+ *      answer a re-INVITE from the remote party within the current call
+ */
+TinySIP::StateFlags_t TinySIP::reinviteRequest() {
+  StateFlags_t res = EVENT_NONE;
+  uint16_t localCode = OK_200;
+  const char* localReason = "OK";
+  bool sendSdp = false;
+
+  Dialog* dialog = findDialog(respCallId, respToTag, respFromTag);
+  if (dialog!=currentCall) {
+    localCode = CALL_DOES_NOT_EXIST_481;
+    localReason = "Call Does Not Exist";
+  } else if (reinviteCSeq) {
+    // RFC 3261, 14.2: "A UAS that receives an INVITE on a dialog while an INVITE it had sent / on that dialog is in progress MUST return a 491"
+    localCode = REQUEST_PENDING;
+    localReason = "Request Pending";
+  } else if (respContentLength > 0 && !respSdp) {
+    localCode = NOT_ACCEPTABLE_HERE_488;
+    localReason = "Not Acceptable Here";
+  } else {
+    currentCall->remoteCSeq = respCSeq;
+    if (respContAddrSpec) {
+      // Target refresh
+      freeNull((void **) &currentCall->remoteTargetDyn);
+      currentCall->remoteTargetDyn = extStrdup(respContAddrSpec);
+    }
+    if (respSdp) {
+      sdpLocalDir = answerDirection();
+      res |= EVENT_MEDIA_UPDATE;
+    } else {
+      // RFC 3264: re-INVITE without SDP -> the offer is in our 2xx, the answer will come in the ACK
+      sdpLocalDir = offerDirection();
+    }
+    sdpVersion++;
+    sendSdp = true;
+    reinviteAnswered = true;
+  }
+
+  Connection* tcpReply = getConnection(false);
+  log_v("--- %d %s for re-INVITE ---", localCode, localReason);
+  int sendErr = sendResponse(dialog, *tcpReply, localCode, localReason, sendSdp);
+  if (sendErr!=TINY_SIP_OK) {
+    log_e("responding error: %d", sendErr);
+    res |= EVENT_SIP_ERROR;
+  }
+  return res;
+}
+
+/* Description:
+ *      forget the hold state and session modifications: each call starts with audio flowing both ways
+ */
+void TinySIP::resetSession() {
+  localHold = reinvitePrevHold = false;
+  sdpLocalDir = reinvitePrevDir = MEDIA_SENDRECV;
+  sdpVersion = 0;
+  reinviteCSeq = 0;
+  reinviteRetry = reinviteAnswered = false;
+  msReinviteRetry = msReinviteDelay = 0;
+}
+
+// Direction to offer: RFC 6337, 5.3 - if the remote party holds the call already, holding it as well makes it "inactive"
+uint8_t TinySIP::offerDirection() {
+  if (!localHold) {
+    return MEDIA_SENDRECV;
+  }
+  return (sdpRemoteDir & MEDIA_RECV) ? MEDIA_SEND : MEDIA_INACTIVE;
+}
+
+// Direction to answer: whatever is offered (mirrored), minus receiving if we hold the call
+uint8_t TinySIP::answerDirection() {
+  return (localHold ? MEDIA_SEND : MEDIA_SENDRECV) & peerDirection(sdpRemoteDir);
+}
+
+uint8_t TinySIP::mediaDirection() {
+  if (localHold) {
+    return MEDIA_INACTIVE;        // no music on hold: while we hold the call, nothing is sent either
+  }
+  return sdpLocalDir & peerDirection(sdpRemoteDir);
+}
+
 void TinySIP::showParsed() {
   // Show parsing results
   log_d("%s", isResponse ? "Response parsed:" : "Request parsed:");
@@ -1705,6 +3323,112 @@ void TinySIP::showParsed() {
   }
 }
 
+/* Description:
+ *     wait until any of the SIP connections has incoming data, or until timeout.
+ *     This replaces querying each connection in turn: WiFiUDP::parsePacket() and WiFiClient::available() cost a socket call each.
+ *     With zero timeout it only checks readiness and returns immediately. The result is kept for the next checkCall(), so that
+ *     the main loop waiting here while idle doesn't make checkCall() run select() once more.
+ *     With several accounts (SipPool), the main loop waits in SipPool::pollConnections() instead, on the sockets of all.
+ * Return:
+ *     bitmask of READY_* flags for connections that have data to read.
+ *     READY_UNKNOWN is set if some connection has no known socket descriptor (it needs to be queried directly).
+ */
+uint8_t TinySIP::pollConnections(uint32_t timeoutMs) {
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  int maxFd = -1;
+  uint8_t ready = watchConnections(readSet, maxFd);
+
+  if (ready & READY_UNKNOWN) {
+    timeoutMs = 0;          // the unknown connection may have data already -> don't block
+  }
+  if (maxFd < 0) {
+    if (timeoutMs) {
+      delay(timeoutMs);     // nothing to wait for
+    }
+    polledReady = ready;
+    readyPolled = true;
+    return ready;
+  }
+
+  struct timeval tv;
+  tv.tv_sec = timeoutMs / 1000;
+  tv.tv_usec = (timeoutMs % 1000) * 1000;
+  int res = select(maxFd + 1, &readSet, NULL, NULL, &tv);
+  if (res < 0) {
+    log_e("select failed: errno = %d", errno);
+    readyPolled = false;
+    return ready | READY_UNKNOWN;
+  }
+  return readyConnections(readSet, res > 0);
+}
+
+/* Description:
+ *     add the sockets of the connections to `readSet` for select() (see pollConnections()).
+ * Return:
+ *     READY_UNKNOWN if some connection has no known socket descriptor, READY_NONE otherwise.
+ */
+uint8_t TinySIP::watchConnections(fd_set& readSet, int& maxFd) {
+  Connection* conns[] = { tcpProxy, tcpRoute, tcpCallee };
+  uint8_t ready = READY_NONE;
+  for (size_t i=0; i<sizeof(conns)/sizeof(conns[0]); i++) {
+    if (conns[i]==NULL) {
+      continue;
+    }
+    int fd = conns[i]->fd();
+    if (fd < 0) {
+      ready |= READY_UNKNOWN;
+      continue;
+    }
+    FD_SET(fd, &readSet);
+    maxFd = fd > maxFd ? fd : maxFd;
+  }
+  return ready;
+}
+
+/* Description:
+ *     keep what select() found (if `any` socket is readable) about the connections for the next checkCall().
+ * Return:
+ *     bitmask of READY_* flags.
+ */
+uint8_t TinySIP::readyConnections(fd_set& readSet, bool any) {
+  Connection* conns[] = { tcpProxy, tcpRoute, tcpCallee };
+  const uint8_t flags[] = { READY_PROXY, READY_ROUTE, READY_CALLEE };
+  uint8_t ready = READY_NONE;
+  for (size_t i=0; i<sizeof(conns)/sizeof(conns[0]); i++) {
+    if (conns[i]==NULL) {
+      continue;
+    }
+    int fd = conns[i]->fd();
+    if (fd < 0) {
+      ready |= READY_UNKNOWN;
+    } else if (any && FD_ISSET(fd, &readSet)) {
+      ready |= flags[i];
+    }
+  }
+  polledReady = ready;
+  readyPolled = true;
+  return ready;
+}
+
+/* Description:
+ *     query how much data can be read from a connection, but only if pollConnections() reported it as readable
+ *     or if the connection might hold data buffered earlier (`buffered`).
+ * Return:
+ *     number of bytes available, 0 if none (or the value is bogus).
+ */
+int32_t TinySIP::readableBytes(Connection* tcp, uint8_t ready, bool buffered) {
+  if (tcp==NULL) {
+    return 0;
+  }
+  if (!buffered && !(ready & READY_UNKNOWN) &&
+      !(tcp==tcpProxy && (ready & READY_PROXY)) && !(tcp==tcpRoute && (ready & READY_ROUTE)) && !(tcp==tcpCallee && (ready & READY_CALLEE))) {
+    return 0;
+  }
+  int32_t avail = tcp->available();
+  return (avail <= 0 || avail >= IMPOSSIBLY_HIGH) ? 0 : avail;
+}
+
 /*
  * Description:
  *    process one incoming SIP request or reply
@@ -1714,6 +3438,10 @@ void TinySIP::showParsed() {
  */
 TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
   msLastKnownTime = msNow;
+  stun.poll(msNow);
+  if (buff == NULL) {
+    return EVENT_NONE;
+  }
 
   // TODO: are we sure we want to create entirely new connection here?
   bool reconnected = false;
@@ -1724,8 +3452,12 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
       log_d("RENEWING: %s", "proxy connection doesn't exist" );
       this->registered = false;
     }
-    reconnected = ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT, true, 500);
+    uint32_t msLastAttempt = timeout_disconnect_mls;
+    reconnected = ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort, true, 500);
     if (!reconnected) {
+      if (timeout_disconnect && timeout_disconnect_mls != msLastAttempt) {
+        failoverProxy();      // connecting failed (rather than being postponed) -> next attempt goes to the backup server
+      }
       return EVENT_CONNECTION_ERROR;
     }
   }
@@ -1734,20 +3466,31 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
 
   // 1) Receive data
 
-  // Pick the connection with incoming data
+  // Pick the connection with incoming data: a single select() tells which sockets are readable, only those are queried.
+  // Data already pulled out of the socket by WiFiClient/WiFiUDP (leftOver) is not visible to select(), so tcpLast is queried regardless.
+  // If the main loop has just waited in pollConnections(), its result is used (unless the proxy connection was made anew since).
+  uint8_t ready = (readyPolled && !reconnected) ? polledReady : pollConnections(0);
+  readyPolled = false;
+  if (pool!=NULL) {
+    pool->dispatch(this);     // messages read earlier from a shared stream, for accounts that had no room then
+  }
   int32_t avail;
-  Connection* tcp = tcpLast;
-  avail = tcp!=NULL ? tcp->available() : 0;
-  if (!leftOver || avail <= 0 || avail >= IMPOSSIBLY_HIGH) {
+  Connection** slot = tcpLast;
+  Connection* tcp = *slot;
+  avail = readableBytes(tcp, ready, leftOver);
+  if (!leftOver || avail <= 0) {
+    slot = &tcpProxy;
     tcp = tcpProxy;
-    avail = tcp!=NULL ? tcp->available() : 0;
-    if (avail <= 0 || avail >= IMPOSSIBLY_HIGH) {
+    avail = readableBytes(tcp, ready, false);
+    if (avail <= 0) {
+      slot = &tcpRoute;
       tcp = tcpRoute;
-      avail = tcp!=NULL ? tcp->available() : 0;
-      if (avail <= 0 || avail >= IMPOSSIBLY_HIGH) {
+      avail = readableBytes(tcp, ready, false);
+      if (avail <= 0) {
+        slot = &tcpCallee;
         tcp = tcpCallee;
-        avail = tcp!=NULL ? tcp->available() : 0;
-        if (!(avail <= 0 || avail >= IMPOSSIBLY_HIGH)) {
+        avail = readableBytes(tcp, ready, false);
+        if (avail > 0) {
           log_d("READING: tcpCallee %d", avail);
         }
       } else {
@@ -1761,7 +3504,13 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
   }
 
   // Read from the connection with incoming data
-  if (avail > 0 && avail < IMPOSSIBLY_HIGH) {
+  if (avail > 0 && avail < IMPOSSIBLY_HIGH && pool!=NULL && pool->read(this, tcp, avail)) {
+    // Stream shared with other accounts: the pool frames the messages and hands each to its account (ours into `buff`)
+    tcpLast = slot;
+    leftOver = (avail > 0);
+    Random.feed(msNow);
+    tcp->msLastReceived = msNow;
+  } else if (avail > 0 && avail < IMPOSSIBLY_HIGH) {
     auto totalReceived = 0;       // just for debugging
     log_v("avail: %d", avail);
     while (avail > 0) {
@@ -1771,9 +3520,15 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
 
       // Process one of the three options: 1) something read; 2) nothing read but buffer can be cleaned up; 3) neither
 
-      if (justRead>0) {
+      if (justRead>0 && tcp->isUdp() && StunClient::isStun((const uint8_t*) buff+buffLength, justRead)) {
+        // STUN response to the query sent through the flow (see mapSipFlow): not a part of the SIP stream
+        avail -= justRead;
+        if (stun.received(tcp->localPort(), (const uint8_t*) buff+buffLength, justRead) && tcp == tcpProxy) {
+          mapSipFlow(*tcp);
+        }
+      } else if (justRead>0) {
         // Something read
-        tcpLast = tcp;
+        tcpLast = slot;
         avail -= justRead;
         buffLength += justRead;
         totalReceived += justRead;
@@ -1786,7 +3541,7 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
           buffStart = buff;
         } else {
           // Buffer is not empty and starts not at the beginning -> shift it to the left
-          log_d("BUFFER SHIFTED: %d", buffStart - buff);
+          log_d("BUFFER SHIFTED: %d", (int) (buffStart - buff));
           for (char* p=buffStart; p<buff+buffLength; p++) {
             buff[p-buffStart] = *p;
           }
@@ -1813,6 +3568,21 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
     }
   }
 
+  // Accounts sharing a UDP flow (SipPool) read each other's datagrams: hand a complete message over to its account
+  // (streams are framed and handed over by the pool as they are read)
+  if (UDP_SIP && pool!=NULL && pool->size() > 1 && buffStart<buff+buffLength && strncmp(buffStart, TINY_SIP_CRLF, 2)) {
+    size_t len = SipPool::messageLength(buffStart, buff+buffLength);
+    TinySIP* owner = len > 0 ? pool->route(buffStart, len) : NULL;
+    if (owner!=NULL && owner!=this && owner->deliver(buffStart, len)) {
+      log_d("message handed over to %s", owner->localUriDyn);
+      buffStart += len;
+      if (buffStart<buff+buffLength) {
+        res |= EVENT_MORE_BUFFER;
+      }
+      return res;
+    }
+  }
+
   // Process one message (response or request)
   // TODO: filter out garbage messages
   // TODO: how do we skip incorrect responses and/or requests?
@@ -1820,7 +3590,7 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
 
     log_d("--- parsing ---");
     log_d("Length: %d", buffLength);
-    log_d("Offset: %d", buffStart - buff);
+    log_d("Offset: %d", (int) (buffStart - buff));
     xxd(buffStart);
     log_d("---------------");
 
@@ -1828,6 +3598,7 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
     // Parse one of the three options: 1) pong; 2) response; 3) request.
 
     uint16_t parsingErr = TINY_SIP_ERR;
+    bool sessionUpdate = false;     // the message is a re-INVITE (or its response / ACK) within the current call
     this->isResponse = strncmp(buffStart, "SIP/", 4) ? false : true;
     if (!strncmp(buffStart, TINY_SIP_CRLF, 2)) {
 
@@ -1838,6 +3609,7 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
         tcpProxy->everPonged = true;
         tcpProxy->pinged = tcpProxy->rePinged = false;
         tcpProxy->msLastPong = msNow;
+        flowTimer.ponged();
       } else {
         log_d("-----------------------> ERROR: wrong pong <-----------------------");
       }
@@ -1856,16 +3628,33 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
 
         // Take actions:
 
-        if (respType==TINY_SIP_METHOD_INVITE) {
+        if (respType==TINY_SIP_METHOD_INVITE && reinviteCSeq && respCSeq==reinviteCSeq && currentCall && !currentCall->terminated &&
+            respCallId && !strcmp(respCallId, currentCall->callIdDyn)) {
+
+          // Response to our re-INVITE (hold / resume)
+          sessionUpdate = true;
+          res |= reinviteResponse(msNow);
+
+        } else if (respType==TINY_SIP_METHOD_INVITE) {
 
           // Response to INVITE request
 
+          if (respCode==100) {
+            callTrace.mark(CallTrace::TRYING);
+          } else if (respCode==180) {
+            callTrace.mark(CallTrace::RINGING);
+          } else if (respClass=='1') {
+            callTrace.mark(CallTrace::PROGRESS);
+          } else if (respClass=='2') {
+            callTrace.mark(CallTrace::ANSWERED);
+          }
+
           // Create (or find) a dialog for the outgoing INVITE (that we've received a response to, supposedly)
           TinySIP::Dialog* dialog = nullptr;
-          if (respToTagDyn) {
+          if (respToTag) {
             // TODO: check that this response is legit: Maybe create another type of a dialog, MONOLOGUE with only our credentials; then destroy it on creating an "early" or "confirmed" dialog
             // TODO: save RouteSet here; (or where is RouteSet created? in 200 OK?)
-            dialog = findCreateDialog(true, respCallId, respFromTagDyn, respToTagDyn);    // true - we are the caller, "From" is us
+            dialog = findCreateDialog(true, respCallId, respFromTag, respToTag);    // true - we are the caller, "From" is us
           }
 
           // TODO: dialogs: accept only one dialog into session
@@ -1911,72 +3700,86 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
               log_e("no dialog at INVITE response");
             }
           }
+        } else if (respType==TINY_SIP_METHOD_MESSAGE && respCode!=PROXY_AUTHENTICATION_REQUIRED_407 && respCode!=UNAUTHORIZED_401 && respCode!=REQUEST_PENDING) {
+
+          // Response to a MESSAGE request from the outbox
+          int i = findOutgoing(respCallId);
+          if (i>=0) {
+            outgoingResponse(i, msNow);
+          }
+        } else if (respType==TINY_SIP_METHOD_SUBSCRIBE) {
+
+          // Response to the presence SUBSCRIBE (authenticates by itself)
+          subscribeResponse(msNow);
         }
 
         // - authenticate with the proxy
         // - authenticate with the registrar
-        if ((respCode==PROXY_AUTHENTICATION_REQUIRED_407 || respCode==UNAUTHORIZED_401 || respCode == REQUEST_PENDING) &&
+        if ((respCode==PROXY_AUTHENTICATION_REQUIRED_407 || respCode==UNAUTHORIZED_401 || (respCode == REQUEST_PENDING && !sessionUpdate)) &&
             (respType==TINY_SIP_METHOD_INVITE || respType==TINY_SIP_METHOD_REGISTER || respType==TINY_SIP_METHOD_MESSAGE)) {
           log_d("Authentication parameters");
-          if (tmpRespSeq != respCSeq) {
-            char empty[] = "";
-            char* alg = (digestAlgorithm!=NULL) ? digestAlgorithm : empty;
-            char* user = (localUserDyn!=NULL) ? localUserDyn : (char*) "anonymous";
-            char* realm = (digestRealm!=NULL) ? digestRealm : empty;
-            char* pass = (proxyPasswDyn!=NULL) ? proxyPasswDyn : empty;
-            char* nonce = (digestNonce!=NULL) ? digestNonce : empty;
-            char* qop = (digestQopPref!=NULL) ? digestQopPref : empty;
-            *cnonce = '\0';
-            char nonceCountStr[9] = "";
-            // TODO: response-auth / rspauth
-            if (*qop) {
-              newCNonce((char *) cnonce);
-              sprintf(nonceCountStr, "%08x", ++nonceCount);     // TODO: we always increment this, but maybe should check for nonce value first
-            }
-            char* toUri = empty;
+          int outgoing = respType==TINY_SIP_METHOD_MESSAGE ? findOutgoing(respCallId) : -1;
+          if (respType==TINY_SIP_METHOD_MESSAGE ? (outgoing>=0 && outbox[outgoing]->inFlight && outbox[outgoing]->cseq==respCSeq) : tmpRespSeq != respCSeq) {
             bool registerResponse = !strcasecmp(respCSeqMethod,"REGISTER");
-            if (!registerResponse && remoteUriDyn!=NULL) {
-              toUri = remoteUriDyn;
-            } else if (registerResponse && localUriDyn != NULL) {
-              toUri = localUriDyn;
+            bool retry = true;
+            if (respCode != REQUEST_PENDING) {
+              bool stale = digestStale!=NULL && !strcasecmp(digestStale, "true");
+              if (!stale && authCache.isValid(proxyIpAddr) && authCache.used && digestNonce!=NULL && !strcmp(digestNonce, authCache.nonceDyn)) {
+                // Credentials were rejected for the same nonce: username or password is wrong (RFC 2617, 3.2.1)
+                log_e("Authentication failed");
+                authCache.clear();
+                retry = false;
+                if (sessionUpdate) {
+                  // The call goes on as it was
+                  reinviteCSeq = 0;
+                  sdpLocalDir = reinvitePrevDir;
+                  localHold = reinvitePrevHold;
+                  res |= EVENT_MEDIA_UPDATE;
+                } else if (respType==TINY_SIP_METHOD_INVITE) {
+                  res |= EVENT_CALL_TERMINATED;
+                }
+              } else {
+                // Remember the challenge: the response digest is calculated in sendHeaderAuthorization for each request
+                authCache.update(digestRealm, digestNonce, digestOpaque, digestQopPref, digestAlgorithm,
+                                 respCode==PROXY_AUTHENTICATION_REQUIRED_407, proxyIpAddr);
+              }
             }
-            char* meth = respCSeqMethod;
-
-            HASHHEX HA1;
-            HASHHEX HA2 = "";
-
-            log_d("Digesting");
-            DigestCalcHA1(alg, user, realm, pass,  nonce, cnonce, HA1);
-            log_d("Digest HA1 = %s", HA1);
-            DigestCalcResponse(HA1, nonce, nonceCountStr, cnonce, qop, meth, toUri, HA2, digestResponse);
-            log_d("Digest reponse = %s", digestResponse);
 
             // Send updated request with digest response
-            if (registerResponse) {
-              requestRegister(*tcpProxy);
-            } else if (respType==TINY_SIP_METHOD_INVITE) {
-              if (!reconnected && !ensureIpConnection(tcpProxy, proxyIpAddr, TINY_SIP_PORT)) {    // <-- INVITE with authorization
-                return EVENT_CONNECTION_ERROR;
-              }
+            if (retry) {
+              if (registerResponse) {
+                requestRegister(*tcpProxy);
+              } else if (sessionUpdate) {
+                requestReinvite(*getConnection(true));
+              } else if (respType==TINY_SIP_METHOD_INVITE) {
+                if (!reconnected && !ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort)) {    // <-- INVITE with authorization
+                  return EVENT_CONNECTION_ERROR;
+                }
 
-              /*
-                The Arduino board may restart itself because of sending the invite and receiving 401 error message numerous times.
-                This check fixes this restart problem.
-              */
-              triedToMakeCallCounter++;
-
-              //if(triedToMakeCallCounter < 5) {
-              //cseq--;
-              requestInvite(msNow, *tcpProxy, remoteUriDyn, NULL);
-              /*} else {
-                res |= EVENT_CALL_TERMINATED;
-                //std::cout << "call terminated due to not registered callee_____________________" << endl;
-                log_d("call terminated due to not registered callee_____________________");
-              }*/
-            } else {
-              requestMessage(*tcpProxy);
+                /*
+                  The Arduino board may restart itself because of sending the invite and receiving 401 error message numerous times.
+                  This check fixes this restart problem.
+                */
+                triedToMakeCallCounter++;
+
+                //if(triedToMakeCallCounter < 5) {
+                //cseq--;
+                requestInvite(msNow, *tcpProxy, remoteUriDyn, NULL);
+                /*} else {
+                  res |= EVENT_CALL_TERMINATED;
+                  //std::cout << "call terminated due to not registered callee_____________________" << endl;
+                  log_d("call terminated due to not registered callee_____________________");
+                }*/
+              } else if (requestMessage(*tcpProxy, outbox[outgoing])==TINY_SIP_OK) {
+                sentOutgoing(outbox[outgoing], msNow);
+              }
+            } else if (respType==TINY_SIP_METHOD_MESSAGE) {
+              outbox[outgoing]->code = respCode;
+              finishOutgoing(outgoing, false, msNow);
+            }
+            if (respType!=TINY_SIP_METHOD_MESSAGE) {
+              tmpRespSeq = respCSeq;
             }
-            tmpRespSeq = respCSeq;
           }
         }
 
@@ -1996,6 +3799,15 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
 
         // Take actions:
 
+        // - answer re-INVITE within the current call (hold / resume by the remote party)
+        if (respType==TINY_SIP_METHOD_INVITE && respToTag && respCallId && currentCall && !currentCall->terminated && currentCall->confirmed &&
+            !strcmp(respCallId, currentCall->callIdDyn)) {
+
+          sessionUpdate = true;
+          res |= reinviteRequest();
+
+        } else
+
         // - send 180 Ringing or 486 Busy Here for INVITE
         if (respType==TINY_SIP_METHOD_INVITE && respCallId && (!callIdDyn || strcmp(respCallId, callIdDyn))) {      // ignore one's own INVITE
 
@@ -2003,14 +3815,16 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
           const char* localReason = "Ringing";
 
           // Create a dialog for the incoming INVITE
-          TinySIP::Dialog* dialog = findCreateDialog(false, respCallId, localTag, respFromTagDyn);    // false - we are the callee, "From" is them
+          TinySIP::Dialog* dialog = findCreateDialog(false, respCallId, localTag, respFromTag);    // false - we are the callee, "From" is them
+          bool busy = isBusy() || (pool!=NULL && pool->busy(this));       // another account may have the call
 
-          if (dialog && !isBusy()) {
+          if (dialog && !busy) {
             // Accept this INVITE and start ringing
             log_v("start ringing / 180 Ringing");
 
             dialog->early = true;
             currentCall = dialog;
+            resetSession();
 
             // Change call state
             freeNull((void **) &remoteUriDyn);
@@ -2020,7 +3834,7 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
             freeNull((void **) &callIdDyn);
             callIdDyn = strdup(respCallId);
 
-          } else if (dialog && this->isBusy()) {
+          } else if (dialog && busy) {
             // Reply that this phone is busy
             log_v("busy / 486 Busy Here");
             log_d("terminated = 1");
@@ -2054,9 +3868,9 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
             const char* localReason = "OK";
 
             // Find the dialog: try both cases: we are the caller and the callee
-            TinySIP::Dialog* dialog = findDialog(respCallId, respFromTagDyn, respToTagDyn);   // in case the caller is hanging up
+            TinySIP::Dialog* dialog = findDialog(respCallId, respFromTag, respToTag);   // in case the caller is hanging up
             if (!dialog) {
-              dialog = findDialog(respCallId, respToTagDyn, respFromTagDyn);  // in case the callee is hanging up (we are the caller)
+              dialog = findDialog(respCallId, respToTag, respFromTag);  // in case the callee is hanging up (we are the caller)
             }
 
             if (dialog && !dialog->isTerminated()) {
@@ -2091,9 +3905,32 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
                 return sendErr;
               }
 
-              // Save message to be processed by checkMessage
-              textMessages.add(new TextMessage(respBody, respFromAddrSpec, respToAddrSpec, msNow));
-            }
+              // Save message to be processed by checkMessage (unless the 200 OK got lost and this is a retransmission)
+              if (!repeatedMessage()) {
+                textMessages.add(new TextMessage(respBody, respFromAddrSpec, respToAddrSpec, msNow));
+              }
+            } else
+
+              // - NOTIFY of the presence subscription; SUBSCRIBE is not served (RFC 6665, 3.2: 489 Bad Event)
+              if (respType==TINY_SIP_METHOD_NOTIFY) {
+                res |= notifyRequest();
+              } else if (respType==TINY_SIP_METHOD_SUBSCRIBE) {
+                Connection* tcpReply = getConnection(false);
+                int sendErr = sendResponse(NULL, *tcpReply, BAD_EVENT_489, "Bad Event");
+                if (sendErr!=TINY_SIP_OK) {
+                  log_e("send response error: %d", sendErr);
+                  return sendErr;
+                }
+              } else
+
+              // - ACK for our 2xx to a re-INVITE: carries the SDP answer if the re-INVITE had no offer
+              if (respType==TINY_SIP_METHOD_ACK && reinviteAnswered && currentCall && respCallId && !strcmp(respCallId, currentCall->callIdDyn)) {
+                sessionUpdate = true;
+                reinviteAnswered = false;
+                if (respSdp) {
+                  res |= EVENT_MEDIA_UPDATE;
+                }
+              }
 
 
         if (respType==TINY_SIP_METHOD_CANCEL) {
@@ -2128,10 +3965,13 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
 
           // Response
 
-          if (respType==TINY_SIP_METHOD_INVITE) {
+          if (respType==TINY_SIP_METHOD_INVITE && !sessionUpdate) {
             if (respCode==180) {
               res |= EVENT_RINGING;
             }
+            if (respClass=='1' && respCode!=100 && respSdp) {
+              res |= EVENT_EARLY_MEDIA;     // RFC 3960: play the media from the first SDP answer (ringback, announcements)
+            }
             if (respClass>='3' && respCode!=407 && respCode!=401) {      // 401 - is a special treatment for VoIP.ms, which returns 401 on INVITE
               res |= EVENT_CALL_TERMINATED;
               log_d("terminated = 1");
@@ -2153,6 +3993,7 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
               this->registered = true;
               this->everRegistered = true;
               msLastRegistered = msNow;
+              scheduleRegisterRefresh();
               res |= EVENT_REGISTERED;
             }
           }
@@ -2166,10 +4007,13 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
             if (currentCall) {
               currentCall->terminated = 1;  // TODO: check if the request is legit
             }
+          } else if (sessionUpdate) {
+            // re-INVITE or its ACK: see reinviteRequest()
           } else if (respType==TINY_SIP_METHOD_INVITE) {
             res |= EVENT_INCOMING_CALL;
           } else if (respType==TINY_SIP_METHOD_ACK && respCSeqMethod && respMethod && !strcmp(respMethod, respCSeqMethod)) {
             res |= EVENT_CALL_CONFIRMED;
+            callTrace.mark(CallTrace::ACK_RECEIVED);
             log_d("Received ACK for SDP request");
           } else if (respType==TINY_SIP_METHOD_MESSAGE) {
             res |= EVENT_INCOMING_MESSAGE;
@@ -2190,7 +4034,7 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
       // TODO: pass wrong request/responses
       log_d("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!! DROPPING BUFFER 0x%x !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!", parsingErr);
       log_d("Length: %d", buffLength);
-      log_d("Offset: %d", buffStart - buff);
+      log_d("Offset: %d", (int) (buffStart - buff));
       xxd(buffStart);
       log_d("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!");
       resetBuffer();    // DEBUG
@@ -2209,18 +4053,47 @@ TinySIP::StateFlags_t TinySIP::checkCall(uint32_t msNow) {
 
   } else if (!isBusy() || nonFree % 16 == 0) {       // do these less important checks every 16th time, not each time (minor optimization)
 
-    if (tcpProxy!=NULL && this->everRegistered && elapsedMillis(msNow, tcpProxy->msLastPing, PING_PERIOD_MS)) {
+    if (tcpProxy!=NULL && tcpProxy->everPonged && tcpProxy->pinged && !tcpProxy->pongMissed && elapsedMillis(msNow, tcpProxy->msLastPing, PING_TIMEOUT_MS)) {
+
+      // RFC 5626: the flow failed, most likely the NAT binding expired before the ping -> shorten the interval, connect and register again
+      tcpProxy->pongMissed = true;
+      flowTimer.missed();
+      log_i("pong missed, keepalive interval: %d s", flowTimer.intervalMs()/1000);
+      if (ensureIpConnection(tcpProxy, proxyIpAddr, proxyPort, true)) {
+        requestRegister(*tcpProxy);
+      }
+
+    } else if (tcpProxy!=NULL && this->everRegistered && elapsedMillis(msNow, tcpProxy->msLastPing, msPingDelay)) {
 
       ping(msNow);
 
-    } else if (!this->registrationRequested || elapsedMillis(msNow, msLastRegisterRequest, REGISTER_PERIOD_MS)) {
+    } else if ((!this->registrationRequested || elapsedMillis(msNow, msLastRegisterRequest, this->registered ? msRegisterRefresh : REGISTER_RETRY_MS)) &&
+               !(tcpProxy!=NULL && tcpProxy->isUdp() && stun.pending(tcpProxy->localPort()))) {
 
-      // send REGISTER if nothing happened and the time has come
+      // send REGISTER if nothing happened and the time has come (and Contact is not about to change, see mapSipFlow)
       registration();
 
+    }
+
+    // Send queued text messages, retry the failed ones
+    if (outbox.size()) {
+      pumpOutbox(msNow);
+    }
+
+    // Presence subscription: start, refresh, retry
+    if (presenceWanted || presActive || presPending) {
+      checkPresence(msNow);
+    }
+
+    // Resend re-INVITE after 491 Request Pending
+    if (reinviteRetry && elapsedMillis(msNow, msReinviteRetry, msReinviteDelay)) {
+      reinviteRetry = false;
+      if (currentCall && !currentCall->terminated && !reinviteCSeq) {
+        modifySession();
       }
+    }
 
-    } else {
+  } else {
 
     nonFree++;
 
@@ -2274,6 +4147,9 @@ int TinySIP::parseResponse() {
   respCSeqMethod = NULL;
   respMethod = NULL;
   respUri = NULL;
+  respContExpires = respExpires = -1;
+  respFlowTimer = 0;
+  respSdp = false;
 
   // First line:
   // - protocol and version
@@ -2292,6 +4168,9 @@ int TinySIP::parseResponse() {
   if (respReason==NULL) {
     return TINY_SIP_ERR+2;
   }
+  if (s==NULL) {
+    return TINY_SIP_ERR+2;    // no headers
+  }
   if (s[0]=='\n') {
     s++;
   }
@@ -2301,7 +4180,7 @@ int TinySIP::parseResponse() {
   respType = methodType(respCSeqMethod);
 
   // Synonyms
-  remoteTag = respToTagDyn;
+  remoteTag = respToTag;
 
   return err;
 }
@@ -2320,6 +4199,9 @@ int TinySIP::parseRequest() {
   respCSeqMethod = NULL;
   respMethod = NULL;
   respUri = NULL;
+  respContExpires = respExpires = -1;
+  respFlowTimer = 0;
+  respSdp = false;
   respType = TINY_SIP_METHOD_NONE;
 
   // First line:
@@ -2341,6 +4223,9 @@ int TinySIP::parseRequest() {
   if (respProtocol==NULL) {
     return TINY_SIP_ERR+2;
   }
+  if (s==NULL) {
+    return TINY_SIP_ERR+2;    // no headers
+  }
   if (s[0]=='\n') {
     s++;
   }
@@ -2349,7 +4234,7 @@ int TinySIP::parseRequest() {
   int err = parseAllHeaders(s);
 
   // Synonyms
-  remoteTag = respFromTagDyn;
+  remoteTag = respFromTag;
 
   return err;
 }
@@ -2365,7 +4250,6 @@ int TinySIP::parseAllHeaders(char* s) {
 
   // Locate headers and body
   bool crlf = false;
-  char* colon = NULL;
   while (s<=buffEnd && s[0]!='\0') {
 
     // Check for end of headers section, start of body section
@@ -2465,9 +4349,11 @@ int TinySIP::parseAllHeaders(char* s) {
 
       // parse the body
       if (respContentType!=NULL && !strcasecmp(respContentType, "application/sdp")) {
-        parseSdp(respBody);
+        respSdp = parseSdp(respBody)==TINY_SIP_OK && remoteAudioPort && audioFormat!=NULL_RTP_PAYLOAD;
       } else if (respContentType!=NULL && !strcasecmp(respContentType, "text/plain")) {
         // Do nothing: this is is probably a message
+      } else if (respType==TINY_SIP_METHOD_NOTIFY) {
+        // Presence documents: see notifyRequest()
       } else {
         log_e("not parsing SDP: unknown contentType=%s", respContentType!=NULL ? respContentType : "NULL");
       }
@@ -2486,7 +4372,7 @@ int TinySIP::parseAllHeaders(char* s) {
   if (buffStart < buff+buffLength) {
     // Show leftover buffer
     log_d("*********************parseAllHeaders*********************");
-    log_d("Buffer leftover: %d", buffLength-(buffStart-buff));
+    log_d("Buffer leftover: %d", (int) (buffLength-(buffStart-buff)));
     log_d("%s", buffStart);
     log_d("*********************************************************");
   }
@@ -2501,6 +4387,15 @@ int TinySIP::parseAllHeaders(char* s) {
   return TINY_SIP_OK;
 }
 
+const char* TinySIP::findHeader(const char* name) {
+  for (int i=0; i<respHeaderCnt; i++) {
+    if (respHeaderName[i]!=NULL && !strcmp(respHeaderName[i], name)) {
+      return respHeaderValue[i];
+    }
+  }
+  return NULL;
+}
+
 /*
  *  Description:
  *      parse specific types of headers
@@ -2557,17 +4452,16 @@ void TinySIP::parseHeader(uint16_t param) {
 
       // We are only interested in the tag-param
 
-      freeNull((void **) &respToTagDyn);
+      respToTag = NULL;
       if (isResponse) {
-        freeNull((void **) &remoteToFromDyn);
-        remoteToFromDyn = strdup(respHeaderValue[param]);
+        remoteToFrom = msgArena.copy(respHeaderValue[param]);
       }
 
       parseContactParam(respHeaderValue[param], &respToDispName, &respToAddrSpec, &respToParams);
 
       // Find tag parameter value
       if (respToParams!=NULL) {
-        retrieveGenericParam(respToParams, "tag", TINY_SIP_SEMI, &respToTagDyn);
+        retrieveGenericParam(respToParams, "tag", TINY_SIP_SEMI, &respToTag, &msgArena);
       }
     }
   } else if (c0=='f') {
@@ -2576,11 +4470,10 @@ void TinySIP::parseHeader(uint16_t param) {
 
       char* headerParams = NULL;
       respFromDispName = respFromAddrSpec = NULL;
-      freeNull((void **) &respFromTagDyn);
+      respFromTag = NULL;
 
       if (!isResponse) {
-        freeNull((void **) &remoteToFromDyn);
-        remoteToFromDyn = strdup(respHeaderValue[param]);
+        remoteToFrom = msgArena.copy(respHeaderValue[param]);
       }
 
       parseContactParam(respHeaderValue[param], &respFromDispName, &respFromAddrSpec, &headerParams);
@@ -2590,8 +4483,16 @@ void TinySIP::parseHeader(uint16_t param) {
             headerParams ? headerParams : "null");
 
       if (headerParams!=NULL) {
-        retrieveGenericParam(headerParams, "tag", TINY_SIP_SEMI, &respFromTagDyn);
+        retrieveGenericParam(headerParams, "tag", TINY_SIP_SEMI, &respFromTag, &msgArena);
       }
+    } else if (!strcmp(respHeaderName[param],"flow-timer")) {
+      // RFC 5626: Flow-Timer  =  "Flow-Timer" HCOLON 1*DIGIT
+      respFlowTimer = atoi(respHeaderValue[param]);
+    }
+  } else if (c0=='e') {
+    if (!compact && !strcmp(respHeaderName[param],"expires")) {
+      // Expires  =  "Expires" HCOLON delta-seconds
+      respExpires = atoi(respHeaderValue[param]);
     }
   } else if (c0=='p' || c0=='w') {
     if (!strcmp(respHeaderName[param],"proxy-authenticate") || !strcmp(respHeaderName[param],"www-authenticate")) {
@@ -2628,6 +4529,9 @@ void TinySIP::parseHeader(uint16_t param) {
         p = skipLinearSpace(e+1);     // start of header digest-cln
         while (p!=NULL && *p!='\0') {
           e = skipToken(p);           // end of parameter name
+          if (e==p) {
+            break;    // not a token: malformed challenge
+          }
           if (e==p+5) {
             if (!strncasecmp(p, "realm", e-p)) {
               digestRealm = parseQuotedStringValue(&e, TINY_SIP_COMMA);
@@ -2642,9 +4546,20 @@ void TinySIP::parseHeader(uint16_t param) {
                 p = e;    // past separator after quoted string end
               }
             } else if (!strncasecmp(p, "stale", e-p)) {
-              // TODO
+              p = nextParameter(p, TINY_SIP_COMMA);
+              digestStale = skipCharLiteral(e, TINY_SIP_EQUAL);
+              char* ee = digestStale!=NULL ? skipToken(digestStale) : NULL;     // NULL if EQUAL is missing
+              if (ee && *ee) {
+                *ee++='\0';
+              }
+              if (digestStale!=NULL) {
+                log_d("Stale: %s", digestStale);
+              }
             }
           }
+          if (p==NULL || e==NULL) {
+            break;    // malformed parameter
+          }
           if (e==p+6) {
             if (!strncasecmp(p, "domain", e-p)) {
               // TODO
@@ -2677,7 +4592,7 @@ void TinySIP::parseHeader(uint16_t param) {
             } else if (!strncasecmp(p, "algorithm", e-p)) {
               p = nextParameter(p, TINY_SIP_COMMA);
               digestAlgorithm = skipCharLiteral(e, TINY_SIP_EQUAL);
-              char* ee = skipToken(digestAlgorithm);
+              char* ee = digestAlgorithm!=NULL ? skipToken(digestAlgorithm) : NULL;     // NULL if EQUAL is missing
               if (ee && *ee) {
                 *ee++='\0';
               }
@@ -2714,38 +4629,41 @@ void TinySIP::parseHeader(uint16_t param) {
       // Grammar:
       //    Contact           =  ("Contact" / "m" ) HCOLON  ( STAR / (contact-param *(COMMA contact-param)))
 
-      // We are only interested in SIP addr-spec, other contacts are ignored
+      // We are only interested in SIP addr-spec, other contacts are ignored; the Contact may be repeated,
+      // the first SIP contact of the message is the remote target
 
-      freeNull((void **) &respContDispNameDyn);
-      freeNull((void **) &respContAddrSpecDyn);
-      char* respContDispName;
-      char* respContAddrSpec;
+      char* dispName;
+      char* addrSpec;
 
       // Special case: single token (probably STAR)
       char* e = skipToken(respHeaderValue[param]);
       char* n = skipLinearSpace(e);
       if (*n=='\0') {
         if (e == respHeaderValue[param] + 1) {  // single character, probably STAR
-          respContAddrSpecDyn = strdup(respHeaderValue[param]);
+          respContAddrSpec = msgArena.copy(respHeaderValue[param]);
           return;
         }
       }
 
       // STAR ruled out
       char* p = respHeaderValue[param];
-      while (*p!='\0') {
+      while (p!=NULL && *p!='\0') {
         // Parse each contact-param separately
         char* params;
-        p = parseContactParam(p, &respContDispName, &respContAddrSpec, &params);
-        if (respContAddrSpec!=NULL && !strncasecmp(respContAddrSpec, "sip:", 4)) {
-          // SIP contact found -> ignore the rest in this header
-          respContAddrSpecDyn = strdup(respContAddrSpec);
-          if (respContDispName!=NULL) {
-            respContDispNameDyn = strdup(respContDispName);
+        p = parseContactParam(p, &dispName, &addrSpec, &params);
+        if (addrSpec!=NULL && !strncasecmp(addrSpec, "sip:", 4)) {
+          if (respContAddrSpec==NULL) {
+            respContAddrSpec = msgArena.copy(addrSpec);
+            respContDispName = msgArena.copy(dispName);
+          }
+          // A 2xx to REGISTER lists every binding of the AOR, other devices' too: only our own one's expires counts
+          char* expires = NULL;
+          if (respContExpires<0 && isOwnContact(addrSpec, params) &&
+              params!=NULL && retrieveGenericParam(params, "expires", TINY_SIP_SEMI, &expires, &msgArena) && expires!=NULL) {
+            respContExpires = atoi(expires);
           }
-          break;
         }
-        if (*p && *p==',') {
+        if (p!=NULL && *p==',') {
           p = skipCharLiteral(p, TINY_SIP_COMMA);
         }
       }
@@ -2774,14 +4692,14 @@ void TinySIP::parseHeader(uint16_t param) {
       char *rrParams = NULL;
 
       char* p = respHeaderValue[param];
-      while (*p!='\0') {
+      while (p!=NULL && *p!='\0') {
         // Parse each rec-route separately
         p = parseContactParam(p, &rrDispName, &rrAddrSpec, &rrParams);
         if (rrAddrSpec!=NULL) {
           // Add this address to route set
           respRouteSet.add(rrAddrSpec, rrParams);
         }
-        if (*p && *p==',') {
+        if (p!=NULL && *p==',') {
           p = skipCharLiteral(p, TINY_SIP_COMMA);
         }
       }
@@ -2799,7 +4717,7 @@ void TinySIP::parseHeader(uint16_t param) {
  *      Parse IP address and port where to send audio.
  *      This assumes that there is only once audio media descpription. If there is more, they are ignored.
  * implicit return parameters:
- *      remoteAudioAddrDyn
+ *      remoteAudioAddr
  *      remoteAudioPort
  *      audioFormat
  * return
@@ -2809,20 +4727,21 @@ int TinySIP::parseSdp(const char* body) {
   log_d("SDP parsing:");
 
   // Zero the return values
-  freeNull((void **) &remoteAudioAddrDyn);
+  remoteAudioAddr[0] = '\0';
   remoteAudioPort = 0;
+  sdpRemoteDir = MEDIA_SENDRECV;      // RFC 4566: "sendrecv" is the default
 
   // Parse SDP line by line. What we do here is:
   //   1) ensure SDP version is correct;
   //   2) find first audio media type description;
   //      a) figure out the connection description for that media type;
-  //      b) choose compatible audio type payload.
+  //      b) choose compatible audio type payload;
+  //      c) find the direction attribute (session level or media level).
 
   bool audioMediaTypeFound = false;
-  bool audioConnectionFound = false;
   char *s=(char *)body;
-  char *connAddrDyn = NULL;
-  while (*s!='\0' && (!audioMediaTypeFound || !audioConnectionFound)) {
+  char *connAddr = NULL;
+  while (*s!='\0') {
     char *e = s+strcspn(s, "\r\n");     // end of value / end of line
     if (*(s+1)=='=') {
       if (*s=='v') {
@@ -2843,7 +4762,6 @@ int TinySIP::parseSdp(const char* body) {
         // This can be listed once on session level (above any "m=" media description, or once for each media description)
 
         if (audioMediaTypeFound) {
-          audioConnectionFound = true;
           log_d("- audio conn data found");
         }
         char *ee = s+2+strcspn(s+2, " \r\n");           // end of nettype (by first space)
@@ -2851,9 +4769,8 @@ int TinySIP::parseSdp(const char* body) {
           char *eee = ee+1+strcspn(ee+1, " \r\n");      // end of addrtype (by second space)
           if (!strncmp(ee+1, "IP4", eee-ee-1) && *eee==' ') {
             ee = eee+1+strcspn(eee+1, " \r\n");         // end of address (by third space or end)
-            freeNull((void **) &connAddrDyn);
-            connAddrDyn = strndup(eee+1, ee-eee-1);
-            log_d("- connaddr: %s", connAddrDyn);
+            connAddr = msgArena.copy(eee+1, ee-eee-1);
+            log_d("- connaddr: %s", connAddr);
           } else {
             log_d("- addrtype error");
           }
@@ -2896,11 +4813,19 @@ int TinySIP::parseSdp(const char* body) {
         }
 
       } else if (*s == 'a') {
-        char* ee = s + 2 + strcspn(s + 2, " \r\n");           // end of media stream type (by first space)
+        char* ee = s + 2 + strcspn(s + 2, " :\r\n");          // end of attribute name
         if (!strncmp(s + 2, "mid", ee - s - 2) && *ee == ' ') {
           this->audioFormat = NULL_RTP_PAYLOAD;
           audioMediaTypeFound = true;
           break;
+        } else if (ee - s - 2 == 8 && !strncmp(s + 2, "sendrecv", 8)) {
+          sdpRemoteDir = MEDIA_SENDRECV;
+        } else if (ee - s - 2 == 8 && !strncmp(s + 2, "sendonly", 8)) {
+          sdpRemoteDir = MEDIA_SEND;
+        } else if (ee - s - 2 == 8 && !strncmp(s + 2, "recvonly", 8)) {
+          sdpRemoteDir = MEDIA_RECV;
+        } else if (ee - s - 2 == 8 && !strncmp(s + 2, "inactive", 8)) {
+          sdpRemoteDir = MEDIA_INACTIVE;
         }
       }
     } else {
@@ -2911,10 +4836,20 @@ int TinySIP::parseSdp(const char* body) {
     s = e + strspn(e, " \r\n");
   }
   //
-  if (connAddrDyn!=NULL) {
+  if (connAddr!=NULL && !strcmp(connAddr, "0.0.0.0")) {
+    // RFC 3264 (obsolete RFC 2543 hold): the remote party doesn't want to receive anything
+    log_d("- hold by connection address");
+    sdpRemoteDir &= ~MEDIA_RECV;
+  }
+  if (connAddr!=NULL) {
     // TODO: taking the last one for simplicity
-    remoteAudioAddrDyn = connAddrDyn;
-    log_d("- final connaddr: %s", remoteAudioAddrDyn);
+    // Copied out of the arena: audio gets started after the call is accepted, possibly several messages later
+    if (strlen(connAddr) > MAX_AUDIO_ADDR) {
+      log_e("connection address too long: %s", connAddr);
+      return TINY_SIP_ERR;
+    }
+    strcpy(remoteAudioAddr, connAddr);
+    log_d("- final connaddr: %s", remoteAudioAddr);
   }
   return TINY_SIP_OK;
 }
@@ -2946,6 +4881,9 @@ char* TinySIP::nextParameter(const char* p, char sep, const char* terminateAt) {
       }
     }
   }   // else -> no parameter value
+  if (p==NULL) {
+    return NULL;      // unterminated quoted string
+  }
   // Terminal characters
   if (strchr(terminateAt, *p)) {
     return (char*) p;
@@ -2963,15 +4901,20 @@ char* TinySIP::nextParameter(const char* p, char sep, const char* terminateAt) {
  *      parName - name of parameter to retrieve
  *      sep - SEMI or COMMA, separator between parameters
  *      val - actual result, pointer to a new string, if not NULL, the string will be freed first (DANGEROUS)
+ *      arena - if given, the value is allocated there and `val` is not freed
  * return:
  *      parameter found (bool)
  */
-bool TinySIP::retrieveGenericParam(const char* p, const char* const parName, const char sep, char** val) {
+bool TinySIP::retrieveGenericParam(const char* p, const char* const parName, const char sep, char** val, ParseArena* arena) {
   // Grammar:
   //    generic-param =  token [EQUAL gen-value]
   //    gen-value     =  token / host / quoted-string
   //    host          =                                           ; alphabet = alphanum / "-" / "." / ":" / "[" / "]"
-  freeNull((void **) val);      // ***THIS IS CORRECT, DO NOT CHANGE***, `val` is already of type char**
+  if (arena) {
+    *val = NULL;                // arena memory is never freed individually
+  } else {
+    freeNull((void **) val);    // ***THIS IS CORRECT, DO NOT CHANGE***, `val` is already of type char**
+  }
   bool res = false;
   while (p!=NULL && *p!='\0') {
     char* e = skipToken(p);     // end of parameter name
@@ -2987,14 +4930,23 @@ bool TinySIP::retrieveGenericParam(const char* p, const char* const parName, con
         if (*e=='"') {
           // Quoted string
           ee = quotedStringEnd(e+1);             // find closing double quote
-          char* tmp = strndup(e+1, ee-e-1);      // copy without the closing doublequote
-          char* e = parseQuotedString(tmp);      // unescape (does some OVERHEAD)
-          *val = strndup(tmp, e-1-tmp);
-          free(tmp);
+          if (arena) {
+            char* tmp = arena->copy(e+1, ee-e-1);     // copy without the closing doublequote
+            if (tmp) {
+              char* e = parseQuotedString(tmp);       // unescape in place
+              tmp[e-1-tmp] = '\0';
+            }
+            *val = tmp;
+          } else {
+            char* tmp = strndup(e+1, ee-e-1);      // copy without the closing doublequote
+            char* e = parseQuotedString(tmp);      // unescape (does some OVERHEAD)
+            *val = strndup(tmp, e-1-tmp);
+            free(tmp);
+          }
         } else {
           // Token or host (doesn't check validity of host)
           ee = skipAlphanumAndSpecials(e, "-.!%*_+`'~:[]");
-          *val = strndup(e, ee-e);
+          *val = arena ? arena->copy(e, ee-e) : strndup(e, ee-e);
         }
         break;
       }
@@ -3031,12 +4983,18 @@ uint8_t TinySIP::methodType(const char* methd) {
   if (!strcasecmp(methd, "CANCEL")) {
     return TINY_SIP_METHOD_CANCEL;
   }
+  if (!strcasecmp(methd, "SUBSCRIBE")) {
+    return TINY_SIP_METHOD_SUBSCRIBE;
+  }
+  if (!strcasecmp(methd, "NOTIFY")) {
+    return TINY_SIP_METHOD_NOTIFY;
+  }
   log_d("ERROR: unknown method: %s", methd);
   return TINY_SIP_METHOD_UNKNOWN;
 }
 
 // Skip all "token" characters        (RFC 3261, p. 221)
-// p - is not NULL
+// p - NULL is returned as is
 inline char* TinySIP::skipToken(const char* p) {
   return skipAlphanumAndSpecials(p, "-.!%*_+`'~");
 }
@@ -3155,7 +5113,7 @@ char* TinySIP::parseContactParam(char* p, char** dispName, char** addrSpec, char
     //log_d("paraseContactParam: params");
     p = *contactParams;
     //log_d("p = %s", p);
-    while (p!=NULL && p!='\0') {
+    while (p!=NULL && *p!='\0') {
       char* pp = nextParameter(p, TINY_SIP_SEMI, ",");      // terminate at NUL or COMMA  (Contact grammar at page 228, RFC 3261, Route grammaer at page 231)
       if (pp==p) {
         break;  // cannot parse -> means the end reached or incorrect value
@@ -3380,24 +5338,21 @@ char* TinySIP::parseQuotedString(char* p) {
   }
   *e = '\0';
 
-  // Unescaping
+  // Unescaping in place: the unescaped string is never longer
   if (escCnt) {
     // Most quoted strings will not have any escaped characters
-    char* bff = (char *) malloc((e-p)*sizeof(char));      // TODO: escaped cnt can be deducted
-    char* bbff = bff;
+    char* w = p;
     char* q = p;
     while (q<e) {
       if (esc || *q!='\\') {
         esc = false;
-        *(bff++) = *q;
+        *(w++) = *q;
       } else {    // *q == '\\'
         esc = true;
       }
       q++;
     }
-    strncpy(p, bbff, bff-bbff);
-    free(bbff);
-    p[bff-bbff] = '\0';
+    *w = '\0';
   }
 
   return e+1;   // past closing double quote
@@ -3492,6 +5447,9 @@ char* TinySIP::skipCharLiteral(const char* p, char c) {
 }
 
 char* TinySIP::skipAlphanumAndSpecials(const char* p, const char* const specials) {
+  if (p==NULL) {
+    return NULL;    // propagate failure of a previous step (e.g. missing EQUAL or closing quote)
+  }
   while (*p!='\0' && ((*p>='a' && *p<='z') || (*p>='0' && *p<='9') || (*p>='A' && *p<='Z') || strchr(specials, *p)!=NULL)) {
     p++;
   }
@@ -3505,7 +5463,7 @@ char* TinySIP::skipAlphanumAndSpecials(const char* p, const char* const specials
 //    p - points past parameter name token; this value is modified to point past separator or to end of string (NUL character)    - OUTPUT
 //    sep - TINY_SIP_COMMA or TINY_SIP_SEMI
 // return - pointer to quoted string value (deescaped), the string is necessarily terminated by NUL character
-char* TinySIP::parseQuotedStringValue(char** p, char sep) {
+char* TinySIP::parseQuotedStringValue(char** p, char) {
   char* e = skipCharLiteral(*p, TINY_SIP_EQUAL);
   if (e==NULL) {
     return NULL;  // incorrect EQUAL separator
@@ -3526,6 +5484,8 @@ char* TinySIP::parseQuotedStringValue(char** p, char sep) {
 void TinySIP::sendHeaderVia(Connection& tcp, String& thisIp, uint16_t port, const char* branch) {
   if(UDP_SIP) {
     TCP(tcp, "Via: SIP/2.0/UDP ");
+  } else if(TLS_SIP) {
+    TCP(tcp, "Via: SIP/2.0/TLS ");
   } else {
     TCP(tcp, "Via: SIP/2.0/TCP ");
   }
@@ -3564,7 +5524,7 @@ void TinySIP::sendRouteSetHeaders(Connection& tcp, bool isClient) {
     // Loose routing parameter absent -> need to change response URI for outdated strict routing
     log_d("ERROR: lr-param absent, TinySIP doesn't implement strict routing");
   }
-  for (int i=0; i<respRouteSet.size(); i++) {
+  for (size_t i=0; i<respRouteSet.size(); i++) {
     TCP_PRINTF(tcp, "%sRoute: <%s>\r\n", !isClient ? "Record-" : "", respRouteSet[i]);  // route set gets reversed internally
   }
 }
@@ -3638,7 +5598,7 @@ void TinySIP::sendHeaderToFromRemote(Connection& tcp, char TF, bool mirror, cons
   TCP(tcp, TF=='T' ? "To: " : "From: ");
   if (mirror) {
     // Only duplicate parameters from response for ACK
-    TCP(tcp, remoteToFromDyn);    // "To / header field in the ACK MUST equal the To header field in the / response being acknowledged" (RFC 3162, p. 129)
+    TCP(tcp, remoteToFrom);    // "To / header field in the ACK MUST equal the To header field in the / response being acknowledged" (RFC 3162, p. 129)
   } else if (toUri!=NULL) {
     TCP(tcp, "<");
     TCP(tcp, toUri);
@@ -3689,93 +5649,112 @@ void TinySIP::sendHeaderUserAgent(Connection& tcp) {
   TCP(tcp, "User-Agent: tinySIP/0.6.0alpha\r\n");
 }
 
-void TinySIP::sendHeaderAuthorization(Connection& tcp, const char* URI) {
-  if ((respCode==UNAUTHORIZED_401 || respCode==PROXY_AUTHENTICATION_REQUIRED_407 || respCode == REQUEST_PENDING) &&
-      digestResponse!=NULL && digestResponse[0]!='\0'
-     ) {
-    if (respCode==UNAUTHORIZED_401) {
-      TCP(tcp, "Authorization: Digest");
-    } else {
-      TCP(tcp, "Proxy-Authorization: Digest");
-    }
+/* Description:
+ *     send credentials for the cached challenge (if any). This is done for every request once the proxy challenged us,
+ *     saving a round trip on each REGISTER, INVITE and MESSAGE. If the nonce expires, the proxy responds with stale=true
+ *     and the request is repeated with the new nonce (see checkCall).
+ */
+void TinySIP::sendHeaderAuthorization(Connection& tcp, const char* method, const char* URI) {
+  if (!authCache.isValid(proxyIpAddr)) {
+    return;
+  }
 
-    // username
-    TCP(tcp, " username=\"");
-    if (localUserDyn!=NULL && *localUserDyn) {
-      TCP(tcp, localUserDyn);
-    } else {
-      TCP(tcp, "anonymous");  // TODO: how does this work?
-    }
-    TCP(tcp, "\"");
+  // Calculate digest response (RFC 2617, 3.2.2)
+  char empty[] = "";
+  char* user = (localUserDyn!=NULL && *localUserDyn) ? localUserDyn : (char*) "anonymous";     // TODO: how does this work?
+  char* pass = (proxyPasswDyn!=NULL) ? proxyPasswDyn : empty;
+  char nonceCountStr[9] = "";
+  *cnonce = '\0';
+  // TODO: response-auth / rspauth
+  if (authCache.qop[0]) {
+    newCNonce((char *) cnonce);
+    sprintf(nonceCountStr, "%08x", ++authCache.nonceCount);
+  }
+  bool sess = !strcasecmp(authCache.algorithmDyn, "md5-sess");
+  if (!authCache.ha1Valid || sess) {
+    log_d("Digesting");
+    DigestCalcHA1(authCache.algorithmDyn, user, authCache.realmDyn, pass, authCache.nonceDyn, cnonce, authCache.ha1);
+    authCache.ha1Valid = !sess;
+  }
+  HASHHEX HA2 = "";
+  DigestCalcResponse(authCache.ha1, authCache.nonceDyn, nonceCountStr, cnonce, authCache.qop, (char*) method, (char*) URI, HA2, digestResponse);
+  log_d("Digest reponse = %s", digestResponse);
+  authCache.used = true;
+
+  if (authCache.proxyAuth) {
+    TCP(tcp, "Proxy-Authorization: Digest");
+  } else {
+    TCP(tcp, "Authorization: Digest");
+  }
 
-    // realm
-    if (digestRealm!=NULL && *digestRealm) {
-      TCP(tcp, ", realm=\"");
-      TCP(tcp, digestRealm);
-      TCP(tcp, "\"");
-    }
+  // username
+  TCP(tcp, " username=\"");
+  TCP(tcp, user);
+  TCP(tcp, "\"");
 
-    // nonce
-    if (digestNonce!=NULL && *digestNonce) {
-      TCP(tcp, ", nonce=\"");
-      TCP(tcp, digestNonce);
-      TCP(tcp, "\"");
-    }
+  // realm
+  if (*authCache.realmDyn) {
+    TCP(tcp, ", realm=\"");
+    TCP(tcp, authCache.realmDyn);
+    TCP(tcp, "\"");
+  }
 
-    // opaque: should be returned  by the client unchanged (RFC 2617)
-    if (digestOpaque!=NULL && *digestOpaque) {
-      TCP(tcp, ", opaque=\"");
-      TCP(tcp, digestOpaque);
-      TCP(tcp, "\"");
-    }
+  // nonce
+  if (*authCache.nonceDyn) {
+    TCP(tcp, ", nonce=\"");
+    TCP(tcp, authCache.nonceDyn);
+    TCP(tcp, "\"");
+  }
 
-    if (digestQopPref!=NULL) {
-      // New line
-      // RFC 2617: "cnonce", and "nonce-count"  directives MUST be present IFF qop directive was sent
-      // RFC 2617: The "response-auth", "cnonce", and "nonce-count"  directives MUST BE present if "qop=auth" or "qop=auth-int" is  specified. (TODO: response-auth)
+  // opaque: should be returned  by the client unchanged (RFC 2617)
+  if (authCache.opaqueDyn!=NULL && *authCache.opaqueDyn) {
+    TCP(tcp, ", opaque=\"");
+    TCP(tcp, authCache.opaqueDyn);
+    TCP(tcp, "\"");
+  }
 
-      // qop
-      log_d("\r\n ++");       // this will show up only in the logs
-      TCP(tcp, ", qop=\"");
-      TCP(tcp, digestQopPref);
-      TCP(tcp, "\"");
+  if (authCache.qop[0]) {
+    // New line
+    // RFC 2617: "cnonce", and "nonce-count"  directives MUST be present IFF qop directive was sent
+    // RFC 2617: The "response-auth", "cnonce", and "nonce-count"  directives MUST BE present if "qop=auth" or "qop=auth-int" is  specified. (TODO: response-auth)
 
-      // nonce-count
-      char nonceCountStr[9];
-      sprintf(nonceCountStr, "%08x", nonceCount);
-      TCP(tcp, ", nc=\"");
-      TCP(tcp, nonceCountStr);
-      TCP(tcp, "\"");
+    // qop
+    log_d("\r\n ++");       // this will show up only in the logs
+    TCP(tcp, ", qop=\"");
+    TCP(tcp, authCache.qop);
+    TCP(tcp, "\"");
 
-      // cnonce
-      TCP(tcp, ", cnonce=\"");
-      TCP(tcp, cnonce);
-      TCP(tcp, "\"");
-    }
+    // nonce-count
+    TCP(tcp, ", nc=\"");
+    TCP(tcp, nonceCountStr);
+    TCP(tcp, "\"");
 
-    // Last line
-    // URI
-    log_d("\r\n ++");        // this will show up only in the logs
-    TCP(tcp, ", uri=\"");
-    TCP(tcp, URI);
+    // cnonce
+    TCP(tcp, ", cnonce=\"");
+    TCP(tcp, cnonce);
     TCP(tcp, "\"");
+  }
 
-    // response
-    if (digestResponse!=NULL && *digestResponse) {
-      TCP(tcp, ", response=\"");
-      TCP(tcp, digestResponse);
-      TCP(tcp, "\"");
-    }
+  // Last line
+  // URI
+  log_d("\r\n ++");        // this will show up only in the logs
+  TCP(tcp, ", uri=\"");
+  TCP(tcp, URI);
+  TCP(tcp, "\"");
 
-    // End
-    TCP(tcp, "\r\n");
-  }
+  // response
+  TCP(tcp, ", response=\"");
+  TCP(tcp, digestResponse);
+  TCP(tcp, "\"");
+
+  // End
+  TCP(tcp, "\r\n");
 }
 
 void TinySIP::sendHeaderContact(Connection& tcp) {
   // TODO: if our IP-address changes, need to send re-INVITE within a dialog
   TCP_PRINTF(tcp, "Contact: <sip:%d@%s:%d;transport=%s;ob>;+sip.instance=\"<" TINYSIP_URN_UUID_PREFIX "%s>\"\r\n",
-             phoneNumber, thisIP.c_str(), tcp.localPort(), (UDP_SIP ? "udp" : "tcp"), this->macHex);
+             phoneNumber, contactHost(tcp), contactPort(tcp), (UDP_SIP ? "udp" : TLS_SIP ? "tls" : "tcp"), this->macHex);
 }
 
 void TinySIP::sendBodyHeaders(Connection& tcp, int len, const char* type) {
@@ -3794,7 +5773,7 @@ void TinySIP::newBranch(char* branch) {
   Random.randChars((char *)(branch+BRANCH_CONSTANT_LEN), BRANCH_VARIABLE_LEN);
 }
 
-void TinySIP::newLocalTag(bool caller) {
+void TinySIP::newLocalTag(bool) {
   // RFC 3261, Section 19.3:
   // "A property of this selection  requirement is that a UA will place a different tag into the From
   //  header of an INVITE than it would place into the To header of the response to the same INVITE.  This is needed in order for a UA to  invite itself to a session..."
@@ -3838,7 +5817,7 @@ void TinySIP::unitTest() {
       "hello ,  ipv6=[2001:0db8:0000:0000:0000:ff00:0042:8329],my=123.123.1.12,\r\n\ttag=\"123\",jesus",
     };
     bool succ = true;
-    for (int i=0; i<sizeof(sParams)/sizeof(char*); i++) {
+    for (size_t i=0; i<sizeof(sParams)/sizeof(char*); i++) {
       char* str = NULL;
       bool found = retrieveGenericParam(sParams[i], "tag", TINY_SIP_COMMA, &str);
       if (!found || str==NULL || strcmp(str,"123")) {
@@ -3877,7 +5856,7 @@ void TinySIP::unitTest() {
     //log_d("  - parsing: "); log_d("%s", respHeaderName[0]); log_d(" - %s", respHeaderValue[0]);
     parseHeader(0);
     if (!strcasecmp(respToDispName, "Mei Mei") && !strcmp(respToAddrSpec, "sip:test@test.sip2sip.info") &&
-        respToTagDyn!=NULL && !strcmp(respToTagDyn, "abcedfghijklmnopqrtsuvwxyz.0123456789")) {
+        respToTag!=NULL && !strcmp(respToTag, "abcedfghijklmnopqrtsuvwxyz.0123456789")) {
       log_d("OK");
     } else {
       log_d("FAILED");
@@ -3936,8 +5915,8 @@ void TinySIP::unitTest() {
       "sip:bob@192.0.2.4 Z",
     };
     bool succ = true;
-    for (int i=0; i<sizeof(addrSpec)/sizeof(char*); i++) {
-      log_d("%d ", i);
+    for (size_t i=0; i<sizeof(addrSpec)/sizeof(char*); i++) {
+      log_d("%d ", (int) i);
       strcpy(buff, addrSpec[i]);
       log_d("%s", addrSpec[i]);
       AddrSpec addrParsed(addrSpec[i]);
@@ -3988,9 +5967,9 @@ void TinySIP::unitTest() {
       "<sip:81.23.228.150;lr;ftag=b6fddfeb-097c-48f0-81b3-8a5aa37134d1;did=853.a749fca5>,Z",        // Record-Route real world example
     };
     bool succ = true;
-    for (int i=0; i<sizeof(sToFrom)/sizeof(char*); i++) {
+    for (size_t i=0; i<sizeof(sToFrom)/sizeof(char*); i++) {
       strcpy(buff, sToFrom[i]);
-      log_d("%d %s", i, buff);
+      log_d("%d %s", (int) i, buff);
       char* p = buff;
       char *dispName, *addrSpec, *params;
       p = parseContactParam(p, &dispName, &addrSpec, &params);
@@ -4028,7 +6007,7 @@ void TinySIP::unitTest() {
       "m: \"Mr. Watson\" <mailto:watson@bell-telephone.com> ;q=0.7,\r\n\t\"Mr. Watson\" <sips:watson@worcester.bell-telephone.com>;q=0.1;expires=3600,\r\n\t\"Mr. Watson\"<sip:watson@worcester.bell-telephone.com>;q=0.1; expires=3600",
     };
     bool succ = true;
-    for (int i=0; i<sizeof(sContact)/sizeof(char*); i++) {
+    for (size_t i=0; i<sizeof(sContact)/sizeof(char*); i++) {
       strcpy(buff, sContact[i]);
       char* p = strchr(buff, ':');
       respHeaderCnt = 1;
@@ -4036,9 +6015,9 @@ void TinySIP::unitTest() {
       respHeaderValue[0] = p+2;
       *p = '\0';
       parseHeader(0);
-      log_d("%d", i);
-      log_d("    Name: %s", respContDispNameDyn==NULL ? "" : respContDispNameDyn);
-      log_d("     SIP: %s", respContAddrSpecDyn==NULL ? "" : respContAddrSpecDyn);
+      log_d("%d", (int) i);
+      log_d("    Name: %s", respContDispName==NULL ? "" : respContDispName);
+      log_d("     SIP: %s", respContAddrSpec==NULL ? "" : respContAddrSpec);
     }
     log_d("  parsing contact: %s", succ ? "OK" : "FAILED");
   }
@@ -4060,9 +6039,9 @@ void TinySIP::unitTest() {
     //char* p = strchr(buff, ':');
     //respHeaderCnt = 1;    respHeaderName[0] = buff;  respHeaderValue[0] = p+2;    *p = '\0';
     //parseHeader(0);
-    log_d("  Route set size: %d", respRouteSet.size());
+    log_d("  Route set size: %d", (int) respRouteSet.size());
     log_d("  Route set order: %s", respRouteSet.isReverse() ? "REVERSE" : "STRAIGHT");
-    for (int i=0; i<respRouteSet.size(); i++) {
+    for (size_t i=0; i<respRouteSet.size(); i++) {
       log_d("  Route: <%s>", respRouteSet[i] ? respRouteSet[i] : "NULL");
     }
     log_d("  parsing record-route: %s", (respRouteSet.size() == 9) ? "OK" : "FAILED");
@@ -4107,9 +6086,9 @@ void TinySIP::unitTest() {
     //char* p = strchr(buff, ':');
     //respHeaderCnt = 1;    respHeaderName[0] = buff;  respHeaderValue[0] = p+2;    *p = '\0';
     //parseHeader(0);
-    log_d("  Route set size: %d", respRouteSet.size());
+    log_d("  Route set size: %d", (int) respRouteSet.size());
     log_d("  Route set order: %s", respRouteSet.isReverse() ? "REVERSE" : "STRAIGHT");
-    for (int i=0; i<respRouteSet.size(); i++) {
+    for (size_t i=0; i<respRouteSet.size(); i++) {
       log_d("  Route: <%s>", respRouteSet[i] ? respRouteSet[i] : "NULL");
     }
     log_d("  parsing entire response: %s", (respRouteSet.size() == 3) ? "OK" : "FAILED");
@@ -4243,7 +6222,7 @@ void TinySIP::xxd(char* b) {
     } else if (*b=='\0') {
       ended = true;
       //log_d("\\x0");
-    } else if (*b>=32 && *b<=254) {
+    } else if ((unsigned char) *b>=32 && (unsigned char) *b<=254) {
       //log_d("%c", *b);
       TmpStringToSIPLogs[idx++]=*b;
     } else {
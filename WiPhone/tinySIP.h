@@ -82,11 +82,17 @@ governing permissions and limitations under the License.
 #include "config.h"
 #include "Networks.h"
 #include "LinearArray.h"
+#include "resolver.h"
 #include <WiFiUdp.h>
 
 #define TINY_SIP_DEBUG      // allow debugging (calling unitTest)
 
 #define TINY_SIP_PORT   5060
+#define TINY_SIPS_PORT  5061
+
+// Transport of all the accounts (GUI.cpp, see ControlState::setSipAccount()): UDP, TLS or else TCP
+extern bool UDP_SIP;
+extern bool TLS_SIP;
 
 // Logical constants
 #define TINY_SIP_NONE   0
@@ -105,6 +111,8 @@ governing permissions and limitations under the License.
 #define TINY_SIP_METHOD_CANCEL    0x08
 #define TINY_SIP_METHOD_REGISTER  0x10
 #define TINY_SIP_METHOD_MESSAGE   0x20
+#define TINY_SIP_METHOD_SUBSCRIBE 0x40
+#define TINY_SIP_METHOD_NOTIFY    0x80
 #define TINY_SIP_METHOD_UNKNOWN   0xff
 
 // Character literals (RFC 3261, p. 221)
@@ -134,12 +142,15 @@ governing permissions and limitations under the License.
 #define OK_200                              200       // success
 #define UNAUTHORIZED_401                    401       // unauthorized at UAS
 #define PROXY_AUTHENTICATION_REQUIRED_407   407       // unauthorized at proxy
+#define REQUEST_TIMEOUT_408                 408
 #define UNSUPPORTED_URI_SCHEME_416          416
+#define INTERVAL_TOO_BRIEF_423              423
 #define TRANSACTION_DOES_NOT_EXIST_481      481       // TODO: implement
 #define CALL_DOES_NOT_EXIST_481             481
 #define BUSY_HERE_486                       486       // TODO: test
 #define REQUEST_TERMINATED_487              487
 #define NOT_ACCEPTABLE_HERE_488             488
+#define BAD_EVENT_489                       489
 #define SERVER_INTERNAL_ERROR_500           500
 #define DECLINE_603                         603
 #define REQUEST_PENDING                     491
@@ -196,6 +207,109 @@ protected:
   void parseHostPort();
 };
 
+/* Description:
+ *      bump allocator for strings copied out of a received SIP message (tags, Contact, the mirrored To/From, etc.)
+ * Usage:
+ *      copy() while parsing a message, reset() before parsing the next one
+ * Memory usage:
+ *      one block allocated on first use. Allocations only move a pointer and reset() simply rewinds it, so parsing
+ *      a message does no heap allocations. If a message doesn't fit, the extra chunks go to the heap and get freed on
+ *      reset(); the block is then grown to the largest message seen so far.
+ *      Anything allocated here has the same lifetime as the pointers into the receive buffer: values that must
+ *      outlive the message have to be copied out explicitly (see TinySIP::Dialog).
+ */
+class ParseArena {
+public:
+  static const size_t DEFAULT_SIZE = 512;
+  static const size_t MAX_SIZE = 4096;
+
+  ParseArena(size_t size = DEFAULT_SIZE);
+  ~ParseArena();
+
+  char* copy(const char* str);
+  char* copy(const char* str, size_t n);      // copies at most n characters and terminates
+  void* alloc(size_t size);
+  void reset();
+
+  // Statistics for the current message
+  uint16_t allocs() const {
+    return nAllocs;
+  };
+  uint16_t heapAllocs() const {
+    return nHeapAllocs;
+  };
+  size_t used() const {
+    return blockUsed + overflowSize;
+  };
+
+  // Statistics since boot
+  uint32_t totalMessages() const {
+    return nMessages;
+  };
+  uint32_t totalHeapAllocs() const {
+    return nTotalHeapAllocs;
+  };
+  size_t peak() const {
+    return peakUsed;
+  };
+
+protected:
+  struct Chunk {
+    Chunk* next;
+  };
+
+  char* blockDyn;
+  size_t blockSize;
+  size_t blockUsed;
+  Chunk* overflowDyn;           // heap chunks for allocations that didn't fit in the block
+  size_t overflowSize;
+
+  uint16_t nAllocs;
+  uint16_t nHeapAllocs;
+  uint32_t nMessages;
+  uint32_t nTotalHeapAllocs;
+  size_t peakUsed;
+};
+
+/* Description:
+ *      learns how long the NAT binding of the proxy flow survives without traffic (RFC 5626, Section 4.4.1)
+ * Usage:
+ *      pingDelayMs() when a CRLFCRLF ping is sent, then either ponged() or missed() depending on whether the pong came
+ *      within PING_TIMEOUT_MS. Each interval is probed a few times, then lengthened; the first miss settles the interval
+ *      on the longest one that always got a pong. A Flow-Timer header from the registrar limits the interval instead.
+ */
+class FlowTimer {
+public:
+  static const uint32_t MIN_INTERVAL_MS = 29000u;     // RFC 5626: recommended interval for UDP (lower bound)
+  static const uint32_t START_INTERVAL_MS = 60000u;
+  static const uint32_t MAX_INTERVAL_MS = 900000u;    // 15 min
+  static const uint8_t PROBES = 3;                    // successful pongs needed before lengthening the interval
+
+  FlowTimer() {
+    reset();
+  };
+  void reset();
+
+  uint32_t pingDelayMs(uint32_t capMs);               // randomized 80-100% of the interval (RFC 5626, p. 20)
+  void ponged();
+  void missed();
+  void setServerTimer(uint32_t seconds);              // Flow-Timer header value, 0 - absent
+
+  uint32_t intervalMs() const {
+    return interval;
+  };
+  bool learned() const {
+    return done;
+  };
+
+protected:
+  uint32_t interval;
+  uint32_t lastGood;            // longest interval that always got a pong
+  uint32_t maxInterval;
+  uint8_t goodPongs;            // pongs received at the current interval
+  bool done;
+};
+
 class TextMessage {
 public:
   char* message = NULL;
@@ -211,6 +325,43 @@ public:
 protected:
 };
 
+/* Description:
+ *      outgoing MESSAGE (RFC 3428) in TinySIP's outbox: waiting to be sent, in flight or waiting for a retry.
+ *      Each attempt is a separate non-INVITE transaction with the message's own Call-ID and a new CSeq.
+ */
+class OutgoingMessage {
+public:
+  uint32_t id;                  // caller's key, reported back in MessageDelivery
+  char* message = NULL;
+  char* to = NULL;
+  char* callId = NULL;
+  uint16_t cseq = 0;            // CSeq of the latest attempt
+  uint16_t code = 0;            // last final response, 0 - none
+  uint8_t attempts = 0;
+  bool inFlight = false;
+  uint32_t msQueued;
+  uint32_t msSent;              // start of the latest attempt
+  uint32_t msWait = 0;          // delay before the next attempt, counted from msSent
+  char branch[32] = "";         // Via branch of the latest attempt, kept by its retransmissions
+  uint32_t msResent;            // latest (re)transmission of the attempt
+  uint32_t msTimerE = 0;        // RFC 3261, Timer E: UDP retransmission interval; 0 - reliable transport, not retransmitted
+
+  OutgoingMessage(const char* msg, const char* dst, uint32_t id, uint32_t msTime);
+  ~OutgoingMessage();
+};
+
+/* Description:
+ *      final outcome of an OutgoingMessage, see TinySIP::checkDelivery()
+ */
+class MessageDelivery {
+public:
+  uint32_t id;
+  bool delivered;
+  uint16_t code;                // final response code, 0 - no response at all
+  uint8_t attempts;
+  uint32_t msLatency;           // from queueing till the final response
+};
+
 class Connection {
 public:
   Connection() {
@@ -219,6 +370,9 @@ public:
   virtual ~Connection() {}
   virtual bool isUdp()=0;
   virtual bool isTcp()=0;
+  virtual bool isTls() {
+    return false;
+  }
   virtual uint8_t connected()=0;
   virtual IPAddress remoteIP()=0;
   virtual uint16_t remotePort()=0;
@@ -231,6 +385,7 @@ public:
   virtual int beginPacket(IPAddress ip, uint16_t port)=0;
   virtual int endPacket()=0;
   virtual void flush()=0;
+  virtual int fd()=0;                   // socket descriptor for select(), -1 if unknown
   bool stale();
 
   /*virtual int print(const char *format, ...)=0;
@@ -271,7 +426,6 @@ public:
 
 protected:
   uint8_t _connected;
-  //int _fd;
   uint32_t msLastConnected = 0;
   uint32_t msLastReceived = 0xffffffff - 3600000;
 
@@ -282,6 +436,7 @@ protected:
   bool pinged = false;
   bool rePinged = false;
   bool everPonged = false;              // did we ever receive a pong to a ping?
+  bool pongMissed = false;              // last ping got no pong within PING_TIMEOUT_MS
 
 //  uint32_t msLastWrite;
 //  uint32_t msLastRead;
@@ -299,8 +454,9 @@ public:
   //WiFiUDP udpSocket;
 
   UDP_SIPConnection() : Connection() {
-    //_fd = -1;
+    _fd = -1;
     mRemotePort = 5060;
+    mLocalPort = 0;
     _connected = false;
     lastUdpWriteTime = 0;
     endSent = false;
@@ -356,6 +512,10 @@ public:
     WiFiUDP::flush();
   }
 
+  int fd() {
+    return _fd;
+  }
+
   /*
     int print(const char *format, ...){return 0;}
     int print(uint8_t a, ...){return 0;}
@@ -366,6 +526,7 @@ private:
   IPAddress mRemoteIP;
   uint16_t mRemotePort;
   uint16_t mLocalPort;
+  int _fd;                    // socket of the underlying WiFiUDP (found after begin(), since WiFiUDP keeps it private)
   //long long int lastUdpWriteTime;
   uint32_t lastUdpWriteTime;
   bool endSent;
@@ -386,12 +547,10 @@ public:
   void stop() {
     WiFiUDP::stop();
     _connected = false;
+    _fd = -1;
   }
 
   int available() {
-    /*if(_fd < 0) {
-      return 0;
-    }*/
     //log_d("available...");
     WiFiUDP::parsePacket();
     int len = WiFiUDP::available();
@@ -404,15 +563,20 @@ public:
     return len;
   }
 
-  int connect(IPAddress &ip, uint16_t port, int32_t timeout) {
+  int connect(IPAddress &ip, uint16_t port, int32_t /*timeout*/) {
     log_d("Connection(UDP)::connect\n");
     /*if(WiFiUDP::beginPacket(ip, port) <= 0) {
       return 0;
     }*/
+    uint32_t before = udpSocketsMask();
     WiFiUDP::begin(mLocalPort);
-    mRemotePort = 5060;//port;
+    _fd = udpSocketFd(udpSocketsMask() & ~before);
+    if (!mLocalPort) {
+      mLocalPort = socketLocalPort(_fd);      // ephemeral port chosen by lwIP
+    }
+    log_d("Connection(UDP): fd = %d, local port = %d", _fd, mLocalPort);
+    mRemotePort = port ? port : 5060;
     mRemoteIP = ip;
-    //_fd = WiFiUDP::getUdpFd();
     _connected = true;
     log_d("Connection(UDP)::connect success\n");
 
@@ -471,7 +635,7 @@ public:
     log_e("TCP_SIPConnection::connect()");
     return WiFiClient::connect(ip, port, timeout);
   }
-  int beginPacket(IPAddress ip, uint16_t port) {
+  int beginPacket(IPAddress /*ip*/, uint16_t /*port*/) {
     log_e("tcp should not call beginPacket!\n");
     return 0;
   }
@@ -484,6 +648,10 @@ public:
     log_e("TCP_SIPConnection::flush()");
     WiFiClient::flush();
   }
+
+  int fd() {
+    return WiFiClient::fd();
+  }
   /*
   int print(const char *format, ...){return 0;}
   int print(uint8_t a, ...){return 0;}
@@ -496,6 +664,68 @@ public:
 
 };
 
+class TinySIP;
+
+/* Description:
+ *      connections shared by several SIP accounts (TinySIP objects) registered at the same time.
+ *      An account that needs a connection to an address another account is already connected to gets that same
+ *      flow, so there is one socket and one keepalive schedule per proxy (ping state lives in the Connection).
+ *      A pooled connection is deleted once no account refers to it.
+ *      Any account may read from a shared flow. A TCP/TLS stream is read into a buffer of the pool, whatever account
+ *      reads it: complete messages are framed out of it and each is handed to the account route() tells (a message
+ *      split across segments is never divided between accounts). A UDP datagram is a message of its own, read by
+ *      the account into its buffer and handed over from there.
+ * Usage:
+ *      attach() every account before its init(), then call checkCall() of each account as usual; while idle, wait in
+ *      pollConnections(), which watches the connections of every account.
+ */
+class SipPool {
+public:
+  static const int MAX_ACCOUNTS = 4;
+
+  ~SipPool();
+
+  bool attach(TinySIP* account);
+  void detach(TinySIP* account);
+  size_t size() {
+    return accounts.size();
+  };
+
+  // Connections
+  Connection* find(IPAddress &ip, uint16_t port, bool udp, bool tls);
+  void add(Connection* conn);
+  bool release(Connection* conn, bool broken);
+  void collect();
+
+  // Reading
+  bool read(TinySIP* reader, Connection* conn, int32_t& avail);
+  void dispatch(TinySIP* reader);
+  void pollConnections(uint32_t timeoutMs);
+
+  // Accounts
+  bool busy(const TinySIP* except);
+  TinySIP* route(const char* msg, size_t len);
+  static size_t messageLength(const char* msg, const char* end);
+
+protected:
+  // Bytes read from a shared stream that are not handed over yet (an incomplete message, mostly)
+  struct Flow {
+    Connection* conn;
+    char* buffDyn;
+    size_t length;
+  };
+
+  LinearArray<Connection*, LA_INTERNAL_RAM> connections;
+  LinearArray<Flow*, LA_INTERNAL_RAM> flows;                // of the streams read while several accounts are attached
+  LinearArray<TinySIP*, LA_INTERNAL_RAM> accounts;
+
+  bool inUse(Connection* conn);
+  Flow* flow(Connection* conn, bool create);
+  void dropFlow(Connection* conn);
+  void dispatch(TinySIP* reader, Flow* flow);
+  static const char* headerValue(const char* msg, const char* end, const char* name, char compact, size_t& len);
+};
+
 
 
 class TinySIP {
@@ -505,7 +735,8 @@ public:
   typedef uint16_t StateFlags_t;
 
   // Variables' sizes
-  static const int MAX_MESSAGE_SIZE = 2000;           // we expect any incoming SIP messages to fit into 2000 bytes (Ethernet MTU 1500 bytes - 20 for IP - 20 for TCP at least)
+  static const int MAX_AUDIO_ADDR = 63;               // longest SDP connection address (an IPv4/IPv6 address or a host name) kept
+  static const int MAX_MESSAGE_SIZE = 4000;           // most SIP messages fit into an Ethernet MTU (1500 bytes), a full-state NOTIFY of the presence list (RFC 4662) with a PIDF document per contact doesn't
   // (outgoing SIP messages should be within 1300 bytes, see RFC 3261)
   static const int MAX_HEADER_CNT = 100;              // we expect no more than 100 headers        // TODO: make it dynamic, use LinearArray
   static const int MAX_DIALOGS = 32;                  // how many dialogs to remember at most (see `dialogs`): single call can result in many dialogs (UAC-to-UAS)
@@ -525,6 +756,15 @@ public:
   static const StateFlags_t EVENT_INVITE_TIMEOUT = 0x800;
   static const StateFlags_t EVENT_PONGED = 0x1000;
   static const StateFlags_t EVENT_INCOMING_MESSAGE = 0x2000;        // TODO
+  static const StateFlags_t EVENT_EARLY_MEDIA = 0x4000;             // 18x response to INVITE with SDP: remote audio can be played before the call is answered
+  static const StateFlags_t EVENT_MEDIA_UPDATE = 0x8000;            // media session of the current call changed (re-INVITE: hold/resume, new address or codec)
+
+  // 1-bit result flags for pollConnections() method: which sockets have incoming data
+  static const uint8_t READY_NONE = 0x00;
+  static const uint8_t READY_PROXY = 0x01;
+  static const uint8_t READY_ROUTE = 0x02;
+  static const uint8_t READY_CALLEE = 0x04;
+  static const uint8_t READY_UNKNOWN = 0x80;                        // some connection has no known socket -> it has to be queried directly
 
   /*bool endUdpSending() {
     if(tcpProxy) {
@@ -544,12 +784,26 @@ public:
   }
 
   bool registrationInvalid(uint32_t msNow) {
-    return !this->registered || elapsedMillis(msNow, msLastRegistered, REGISTER_EXPIRATION_S*1000);
+    return !this->registered || elapsedMillis(msNow, msLastRegistered, registerExpiresS*1000);
   }
   bool registrationValid(uint32_t msNow) {
     return !registrationInvalid(msNow);
   }
 
+  // Keepalive & registration refresh timings (for diagnostics)
+  uint32_t keepaliveIntervalS() {
+    return flowTimer.intervalMs()/1000;
+  }
+  bool keepaliveLearned() {
+    return flowTimer.learned();
+  }
+  uint32_t registrationExpiresS() {
+    return registerExpiresS;
+  }
+  uint32_t registrationRefreshS() {
+    return msRegisterRefresh/1000;
+  }
+
   // class constants
   static const uint8_t BRANCH_CONSTANT_LEN      = 11;       // length of TINYSIP_BRANCH_PREFIX     // TODO: check for matching lenth with this value
   static const uint8_t BRANCH_VARIABLE_LEN      = 9;
@@ -565,8 +819,14 @@ public:
 
   const static uint8_t SUPPORTED_RTP_PAYLOADS[3];
 
+  // Media direction bits (SDP "a=sendrecv" / "a=sendonly" / "a=recvonly" / "a=inactive", RFC 4566)
+  static const uint8_t MEDIA_INACTIVE           = 0;
+  static const uint8_t MEDIA_SEND               = 1;
+  static const uint8_t MEDIA_RECV               = 2;
+  static const uint8_t MEDIA_SENDRECV           = MEDIA_SEND | MEDIA_RECV;
+
   bool isAudioSupported(uint8_t rtpPayloadType) {
-    for (int i=0; i<sizeof(SUPPORTED_RTP_PAYLOADS)/sizeof(uint8_t); i++)
+    for (size_t i=0; i<sizeof(SUPPORTED_RTP_PAYLOADS)/sizeof(uint8_t); i++)
       if (rtpPayloadType == SUPPORTED_RTP_PAYLOADS[i]) {
         return true;
       }
@@ -574,12 +834,25 @@ public:
   }
 
   // Timings
-  static const uint32_t PING_PERIOD_MS = 58761u;        // 58.8 s     // TODO: use random, according to Page 20 of RFC 5626
   static const uint32_t PING_TIMEOUT_MS = 10000u;       // 10s; RFC 5626: "If a pong is not received within 10 seconds after sending a ping .. / .. then the client MUST treat the flow as / failed."
-  static const uint32_t REGISTER_PERIOD_MS = 60000;   //modified to one minute // 3.29 m     // TODO: do registration retries (every minute if failed)
-  static const uint32_t REGISTER_EXPIRATION_S = 60;    //modified to one minute // 15 min (in seconds)
+  static const uint32_t REGISTER_RETRY_MS = 60000u;     // 1 min; retry period for a registration that failed or got no response
+  static const uint32_t REGISTER_EXPIRATION_S = 900;    // 15 min (in seconds); requested, the registrar may grant a different value
+  static const uint32_t REGISTER_MIN_REFRESH_MS = 30000u;   // 30 s; a registrar granting a few seconds would otherwise get a REGISTER storm
+  static const uint32_t REGISTER_MARGIN_MS = 5000u;     // 5 s; the refresh is sent at least this long before the registration expires
   static const uint32_t STALE_CONNECTION_MS = 10000;    // 10 seconds
   static const uint32_t T1_MS = 500u;                   // 500 ms; RFC 3261, Section 17: "The default value for T1 is 500 ms"
+  static const uint32_t T2_MS = 4000u;                  // 4 s; RFC 3261, Section 17: maximum retransmit interval for non-INVITE requests
+  static const uint32_t MESSAGE_TIMEOUT_MS = 64*T1_MS;  // 32 s; RFC 3261, Timer F: non-INVITE transaction timeout
+  static const uint32_t MESSAGE_RETRY_MS = 2000u;       // delay before the first retry of a MESSAGE, doubled with each attempt
+  static const uint8_t MESSAGE_ATTEMPTS = 5;
+  static const uint8_t MESSAGE_PIPELINE = 4;            // MESSAGE transactions in flight at the same time
+  static const uint8_t MESSAGE_QUEUE = 32;              // maximum number of outgoing messages in the outbox
+  static const uint32_t GLARE_OWNER_MS = 2100u;         // RFC 3261, 14.1: after 491 the owner of the Call-ID retries re-INVITE in 2.1..4 s,
+  static const uint32_t GLARE_OTHER_MS = 0u;            //                 the other side - in 0..2 s
+  static const uint32_t GLARE_RANDOM_MS = 1900u;
+  static const uint32_t PRESENCE_EXPIRES_S = 3600;      // 1 hour; requested for the presence subscription, the server may grant less
+  static const uint32_t PRESENCE_RETRY_MS = REGISTER_RETRY_MS;
+  static const uint32_t PRESENCE_UNSUPPORTED_MS = 30*60000u;    // 30 min; retry period when the server refused list subscriptions
 
   TinySIP();
   bool init(const char* name, const char* fromUri, const char* proxyPass, const uint8_t *mac);
@@ -589,6 +862,14 @@ public:
   void clearDynamicConnections();
   ~TinySIP();
 
+  // Several accounts at once (see SipPool)
+  void setPool(SipPool* pool) {
+    this->pool = pool;
+  };
+  const char* getLocalUri() {
+    return localUriDyn;
+  };
+
   // High level flow control
   int startCall(const char* toUri, uint32_t now);
   int acceptCall();
@@ -597,13 +878,22 @@ public:
   int wifiTerminateCall();
   void rtpSilent();
   StateFlags_t checkCall(uint32_t msNow);
+  uint8_t pollConnections(uint32_t timeoutMs);
   TextMessage* checkMessage(uint32_t msNow, uint32_t timeNow, bool useTime);
   int registration();
-  int sendMessage(const char* toUri, const char* msg);
+  int sendMessage(const char* toUri, const char* msg, uint32_t id=0);
+  MessageDelivery* checkDelivery();
+  size_t outboxSize() {
+    return outbox.size();
+  }
+  void watchPresence(bool on);      // keep a presence subscription for the phonebook (see PresenceTable)
+  void verifyTlsServer(bool on) {   // off: connect over TLS even if the server certificate can't be verified
+    tlsVerify = on;
+  };
 
   // Where to send audio
   char*     getRemoteAudioAddr() {
-    return remoteAudioAddrDyn;
+    return remoteAudioAddr[0] ? remoteAudioAddr : NULL;
   };
   uint16_t  getRemoteAudioPort() {
     return remoteAudioPort;
@@ -615,6 +905,16 @@ public:
     return audioFormat;
   };
 
+  // Call hold (RFC 6337): the session of the current call is modified with a re-INVITE
+  int holdCall(bool hold);
+  bool isOnHold() {
+    return localHold;
+  };
+  bool isRemoteHold() {
+    return !(sdpRemoteDir & MEDIA_RECV);    // the remote party doesn't want to receive audio
+  };
+  uint8_t mediaDirection();                 // what the audio should be doing: MEDIA_SEND / MEDIA_RECV bits
+
   // UI
   const char* getReason();
   const char* getRemoteName();
@@ -633,7 +933,11 @@ protected:
 
   // Messages
   LinearArray<TextMessage*, LA_EXTERNAL_RAM> textMessages;      // incoming messages in RAM waiting to be saved to flash
+  LinearArray<OutgoingMessage*, LA_EXTERNAL_RAM> outbox;        // outgoing messages, up to MESSAGE_PIPELINE of them in flight
+  LinearArray<MessageDelivery*, LA_EXTERNAL_RAM> deliveries;    // outcomes of outgoing messages waiting to be picked up
 
+  // The routes are kept one after another in a buffer of their own, which is reused once cleared: parsing the
+  // Record-Route of each message doesn't allocate once the buffer has grown large enough.
   class RouteSet {
   public:
     RouteSet();
@@ -654,10 +958,39 @@ protected:
     };
 
   protected:
-    LinearArray<const char*, LA_INTERNAL_RAM> set;            // array of pointers to dynamic strings for SIP URIs
+    LinearArray<uint16_t, LA_INTERNAL_RAM> set;               // offsets of the SIP URIs in textDyn
+    char* textDyn;                                            // NUL-terminated SIP URIs, one after another
+    size_t textSize;
+    size_t textUsed;
     bool setReverse;                                          // route set learned as client (UAC) -> route set needs to be sent in reverse order
   };
 
+  // Last digest challenge from the proxy, kept to authorize subsequent requests preemptively (RFC 3261, 22.3; RFC 2617, 3.2.2).
+  // Strings are copied: challenge parameters parsed from the buffer are only valid until the next message.
+  class DigestChallenge {
+  public:
+    DigestChallenge();
+    ~DigestChallenge();
+
+    void clear();
+    void update(const char* realm, const char* nonce, const char* opaque, const char* qop, const char* algorithm, bool proxyAuth, IPAddress proxy);
+    bool isValid(IPAddress proxy) const {
+      return nonceDyn!=NULL && (uint32_t) proxy==(uint32_t) this->proxy;
+    };
+
+    char* realmDyn;
+    char* nonceDyn;
+    char* opaqueDyn;
+    char* algorithmDyn;
+    char qop[9];                    // "auth", "auth-int" or empty
+    bool proxyAuth;                 // challenged with 407 -> Proxy-Authorization, otherwise Authorization
+    bool ha1Valid;                  // H(A1) = MD5(user:realm:password) is computed once per realm
+    HASHHEX ha1;
+    uint32_t nonceCount;            // incremented with each request that uses the same nonce
+    bool used;                      // credentials were sent with this nonce
+    IPAddress proxy;                // the challenge is valid only for this proxy
+  };
+
   // Class to contain state of each individual dialog.
   // Dialogs represent relationship between two UACs (Note: REGISTER requests is outside of dialogs, so as  OPTIONS and first INVITE).
   // Dialogs are established via INVITE request.
@@ -750,17 +1083,22 @@ protected:
   Connection* tcpProxy;     // the server that we are calling through
   Connection* tcpRoute;     // the address of the route-set
   Connection* tcpCallee;    // "direct" connection to the callee (in real-world can be routed through a proxy)
-  Connection*& tcpLast;     // reference to pointer to last connection from which data was read
+  Connection** tcpLast;     // slot (tcpProxy, tcpRoute or tcpCallee) of the last connection from which data was read
   bool leftOver;
+  uint8_t polledReady = READY_NONE;     // result of the last pollConnections()
+  bool readyPolled = false;             // ... not yet used by checkCall()
+  bool tlsVerify = true;                // TLS connections require a server certificate that verifies (see TLS_SIPConnection)
+  SipPool* pool = NULL;     // connections shared with other accounts, NULL - this account owns its connections
 
   // Local call credentials
   IPAddress proxyIpAddr;
+  uint16_t proxyPort = TINY_SIP_PORT;     // from DNS SRV record, if any
+  SipResolver resolver;                   // RFC 3263 server location with cache and failover
   char* localUserDyn;
   char* localNameDyn;       // display name
   char* localUriDyn;
   char* proxyPasswDyn;
   char* remoteUriDyn;       // set when making (startCall) or accepting (sending 180 response) a call
-  char* outgoingMsgDyn;
   uint8_t mac[6];
   char macHex[13];
 
@@ -771,18 +1109,24 @@ protected:
   char localTag[OWN_TAG_LENGTH+1];      // local tag
   char* callIdDyn;                      // current call ID - this is set when 1) startCall(); 2) replying with 180
   uint16_t cseq;                        // "command sequence"
-  uint32_t nonceCount;
+  DigestChallenge authCache;            // cached challenge for preemptive authorization
   char cnonce[CNONCE_LENGTH+1];
   Dialog* currentCall = NULL;           // the dialog that has an active media session (person talking on the phone within this dialog)
 
-  // MESSAGE method parameters
-  char* msgCallIdDyn;                   // MESSAGE Call-ID is separate because messages exist outside of calls and outside of SIP dialogs;
-  // it is generated only on sendMessage() and can be used to identify responses for MESSAGE request
+  // MESSAGE method parameters (each message has its own Call-ID, because messages exist outside of calls and outside of SIP dialogs)
+  uint16_t msgCSeq;
+  static const uint8_t MESSAGE_SEEN = 8;
+  struct {
+    uint32_t callIdHash;
+    uint16_t cseq;
+  } msgSeen[MESSAGE_SEEN] = {};         // incoming MESSAGE transactions answered lately: retransmissions are not delivered twice
+  uint8_t msgSeenNext = 0;
 
   // REGISTER method parameters
   uint16_t regCSeq;                     // REGISTER method CSeq (starting at 1)
   char* regCallIdDyn;                   // REGISTER method Call-ID; RFC 3261: Call-ID "SHOULD be the same in each registration from a UA."
   char regBranch[BRANCH_CONSTANT_LEN+BRANCH_VARIABLE_LEN+1];
+  char regContact[48] = "";             // user@host:port of the Contact sent in the last REGISTER: finds our binding in the 2xx
   bool registrationRequested = false;
   bool registered = false;              // was the last registration request successful? TODO: ensure that response matches the request
   bool everRegistered = false;          // did we ever receive a registration response?
@@ -790,12 +1134,33 @@ protected:
   // BYE method parameters
   uint16_t byeCSeq;
 
+  // SUBSCRIBE method parameters: one resource list subscription (RFC 4662) for the presence of all watched contacts
+  bool presenceWanted;
+  bool presPending;                     // SUBSCRIBE sent, no final response yet
+  bool presActive;                      // 2xx received, the subscription is (still) on
+  char* presCallIdDyn;
+  char presLocalTag[OWN_TAG_LENGTH+1];
+  char* presRemoteTagDyn;               // tag of the list server, learned from the 2xx or the first NOTIFY
+  char* presTargetDyn;                  // Request-URI: the list server, then its Contact
+  uint16_t presCSeq;
+  uint32_t presListVersion;             // presence.listVersion() subscribed to
+  uint32_t presExpiresReq;              // Expires of the SUBSCRIBE in flight (0 - unsubscribing)
+  uint32_t msPresRequest;               // when the SUBSCRIBE was sent or the subscription granted
+  uint32_t msPresWait;                  // when to act again, relative to msPresRequest
+
   String thisIP;            // TODO: remove, use IPAddress tcp.localIP(), tcp.localIP().toString().c_str(); maybe store in C-string
   uint32_t sdpSessionId;
 
+  // Public addresses behind NAT (see StunClient), empty - not known, local ones are advertised
+  char      sipPublicIP[16];      // of the UDP flow to the proxy (Contact)
+  uint16_t  sipPublicPort;
+  uint16_t  sipPublicLocalPort;   // local port of that flow
+  char      rtpPublicIP[16];      // of the RTP port of the current session (SDP)
+  uint16_t  rtpPublicPort;
+
   // Response buffer
   uint16_t  buffLength;
-  char      buff[MAX_MESSAGE_SIZE+1];
+  char*     buff;                 // MAX_MESSAGE_SIZE+1 bytes in PSRAM: one per account, too big for the internal RAM
   char*     buffStart;
 
   // Parsed response/request
@@ -816,16 +1181,22 @@ protected:
   uint16_t  respHeaderCnt;      // number of headers
   char*     respHeaderName[MAX_HEADER_CNT];
   char*     respHeaderValue[MAX_HEADER_CNT];
-  char*     remoteToFromDyn;        // exact copy of the remote From (for caller) or To (for callee) header value
+  char*     remoteToFrom;           // exact copy of the remote From (for caller) or To (for callee) header value (arena)
   char*     respToDispName;         // display name from the To header
   char*     respToAddrSpec;         // addr-spec (SIP URI) from the To header
   char*     respToParams;           // parameters from the To header
-  char*     respToTagDyn;           // tag parameter from the To header         TODO: replace with remoteTagDyn?
+  char*     respToTag;              // tag parameter from the To header (arena)
   char*     respFromDispName;       // display name from the From header
   char*     respFromAddrSpec;       // addr-spec (SIP URI) from the From header
-  char*     respFromTagDyn;         // tag parameter from the From header
-  char*     respContDispNameDyn;
-  char*     respContAddrSpecDyn;    // SIP URI from Contact header
+  char*     respFromTag;            // tag parameter from the From header (arena)
+  char*     respContDispName;       // (arena)
+  char*     respContAddrSpec;       // SIP URI from Contact header (arena)
+  int32_t   respContExpires;        // expires parameter of our own Contact (any of them, see isOwnContact()), -1 if absent
+  int32_t   respExpires;            // Expires header, -1 if absent
+  uint32_t  respFlowTimer;          // Flow-Timer header (RFC 5626), 0 if absent
+  bool      respSdp;                // the body was SDP with an audio stream we support
+
+  ParseArena msgArena;              // copies of parsed values, valid until the next message is parsed
 
   RouteSet  respRouteSet;
 
@@ -833,7 +1204,7 @@ protected:
   char*     respCSeqMethod;
 
   // Synonyms
-  char*     remoteTag;      // points to either respToTagDyn or respFromTagDyn
+  char*     remoteTag;      // points to either respToTag or respFromTag
 
   // Parsed challenge parameters (pointers to buffer)
   char*     respChallenge;
@@ -851,9 +1222,22 @@ protected:
   HASHHEX   digestResponse;
 
   // Parsed SDP
-  char*     remoteAudioAddrDyn;   // IPv4 address where audio from local microphone needs to be sent after encoding
+  char      remoteAudioAddr[MAX_AUDIO_ADDR+1];    // IPv4 address where audio from local microphone needs to be sent after encoding
   uint16_t  remoteAudioPort;      // port where audio from local microphone needs to be sent after encoding
   uint8_t   audioFormat;          // chosen RTP payload type number
+  uint8_t   sdpRemoteDir;         // media direction from the last remote SDP (as seen by the remote party)
+
+  // Session modification (re-INVITE within the current call)
+  bool      localHold;            // the call is put on hold by us
+  bool      reinvitePrevHold;     // localHold before the pending re-INVITE (restored if it fails)
+  uint8_t   sdpLocalDir;          // media direction from the last local SDP
+  uint8_t   reinvitePrevDir;      // sdpLocalDir before the pending re-INVITE (restored if it fails)
+  uint16_t  sdpVersion;           // incremented with each new local SDP offer within the session (o= line)
+  int32_t   reinviteCSeq;         // CSeq of the pending re-INVITE, 0 - none
+  bool      reinviteRetry;        // 491 received: resend re-INVITE when msReinviteDelay passes
+  uint32_t  msReinviteRetry;
+  uint32_t  msReinviteDelay;
+  bool      reinviteAnswered;     // the remote re-INVITE got our 2xx response, ACK is expected (it carries the answer to an offerless re-INVITE)
 
   // GUI
   char*     guiReasonDyn;
@@ -862,6 +1246,10 @@ protected:
   uint32_t  msLastKnownTime;
   uint32_t  msLastRegisterRequest;
   uint32_t  msLastRegistered;
+  uint32_t  registerExpiresS;     // registration lifetime granted by the registrar
+  uint32_t  msRegisterRefresh;    // when to refresh the registration (randomized, relative to msLastRegisterRequest)
+  uint32_t  msPingDelay;          // when to send the next ping (randomized, relative to tcpProxy->msLastPing)
+  FlowTimer flowTimer;
   uint32_t  msTermination;
   uint8_t   nonFree;              // when call is in progress, ping and registration are checked less often; this is a counter of skipped checks
 
@@ -878,29 +1266,75 @@ protected:
 
   // SDP
   int sdpBody(Connection& tcp, const char* ip, bool onlyLen);
+  uint32_t nextSdpSessionId() {
+    return sdpSessionId>0 ? sdpSessionId + 1 : phoneNumber;
+  };     // session of the next outgoing call
+
+  // NAT traversal
+  void mapSipFlow(Connection& tcp);
+  void mapMedia();
+  const char* contactHost(Connection& tcp);
+  uint16_t contactPort(Connection& tcp);
+  const char* mediaHost();
+  uint16_t mediaPort();
 
   // Methods
   int ping(uint32_t now);
+  void scheduleRegisterRefresh();
+  bool isOwnContact(const char* addrSpec, char* params);
   int requestInvite(uint32_t now, Connection& tcp, const char* toUri, const char* body=NULL);
+  int requestReinvite(Connection& tcp);
+  int sendReinviteAck(Connection& tcp, bool ack2xx);
+  int modifySession();
+  StateFlags_t reinviteResponse(uint32_t msNow);
+  StateFlags_t reinviteRequest();
+  void resetSession();
+  uint8_t offerDirection();
+  uint8_t answerDirection();
+  static uint8_t peerDirection(uint8_t dir) {
+    return (dir & MEDIA_SEND ? MEDIA_RECV : 0) | (dir & MEDIA_RECV ? MEDIA_SEND : 0);
+  };
   int sendAck(Connection& tcp, const char* toUri);
   int requestBye(Connection& tcp);
   int requestCancel(Connection& tcp);
   int requestRegister(Connection& tcp);        // register method
-  int requestMessage(Connection& tcp);
+  int requestMessage(Connection& tcp, OutgoingMessage* msg, bool retransmit = false);
+  void sentOutgoing(OutgoingMessage* msg, uint32_t msNow);
+  bool repeatedMessage();
+  void pumpOutbox(uint32_t msNow);
+  int findOutgoing(const char* callId);
+  void outgoingResponse(int i, uint32_t msNow);
+  void retryOutgoing(int i, uint32_t msNow);
+  void finishOutgoing(int i, bool delivered, uint32_t msNow);
+  void checkPresence(uint32_t msNow);
+  int requestSubscribe(Connection& tcp, uint32_t expiresS);
+  int presenceListBody(Connection& tcp, size_t maxLen, bool onlyLen);
+  void subscribeResponse(uint32_t msNow);
+  void endPresence(uint32_t msRetry);
+  StateFlags_t notifyRequest();
 
   // Replies
   int sendResponse(Dialog* diag, Connection& tcp, uint16_t code, const char* reason, bool sendSdp=false);
+  int sendNotifyResponse(Connection& tcp, uint16_t code, const char* reason);
 
   // Connections
   bool ensureIpConnection(Connection*& tcp, IPAddress &ip, uint16_t port, bool forceRenew=false, int32_t timeout=5000);
-  IPAddress ensureConnection(Connection*& tcp, const char* addrSpec, bool forceRenew=false, int32_t timeout=5000);
+  bool failoverProxy();
+  static SipResolver::Transport_t transport() {
+    return UDP_SIP ? SipResolver::UDP : TLS_SIP ? SipResolver::TLS : SipResolver::TCP;
+  };
+  IPAddress ensureConnection(Connection*& tcp, const char* addrSpec, bool forceRenew=false, int32_t timeout=5000, uint16_t* resolvedPort=NULL);
   Connection* getConnection(bool isClient);
+  int32_t readableBytes(Connection* tcp, uint8_t ready, bool buffered);
+  uint8_t watchConnections(fd_set& readSet, int& maxFd);
+  uint8_t readyConnections(fd_set& readSet, bool any);
 
   // Parsing
   int parseResponse();
   int parseRequest();
   int parseAllHeaders(char* startOfHeaders);
   void parseHeader(uint16_t p);
+  const char* findHeader(const char* name);     // value of a header not parsed into resp* fields (lowercase name), NULL - absent
   int parseSdp(const char* body);
 
 public:
@@ -918,7 +1352,7 @@ public:
   static char* quotedStringEnd(const char* p);
   static char* parseQuotedString(char* p);
   static char* parseQuotedStringValue(char** p, char sep);      // returns pointer to quoted string value (deescaped), the string is necessarily terminated by NUL character
-  static bool retrieveGenericParam(const char* p, const char* const parName, const char sep, char** val);
+  static bool retrieveGenericParam(const char* p, const char* const parName, const char sep, char** val, ParseArena* arena=NULL);   // value is allocated in arena (if given) or on heap
   static uint8_t methodType(const char* methd);
 
   //this variable fixes restart problem on calling a not registered sip info.
@@ -931,12 +1365,13 @@ protected:
   bool connectReturnedFalse;
 
   void freeNullConnectionProxyObject(bool isProxy);
+  void dropConnection(Connection*& tcp, bool isProxy, bool broken);
   // - these headers are recommended to be appear towards the top (Via, Route, Record-Route, Proxy-Require, Max-Forwards, and Proxy-Authorization), p. 30
   static void sendHeaderVia(Connection& tcp, String& thisIp, uint16_t port, const char* branch);
   void sendHeadersVia(Connection& tcp);             // copy Via from request
   void sendRouteSetHeaders(Connection& tcp, bool isClient);
   void sendHeaderMaxForwards(Connection& tcp, uint8_t n);
-  void sendHeaderAuthorization(Connection& tcp, const char* toUri);     // Authorization: or Proxy-Authorization:
+  void sendHeaderAuthorization(Connection& tcp, const char* method, const char* toUri);     // Authorization: or Proxy-Authorization:
 
   // - other headers:
   void sendHeaderToFromLocal(Connection& tcp, char TF, const Dialog* diag=NULL);           // send local credentials
@@ -962,8 +1397,11 @@ protected:
   void newCNonce(char* dStr);
   void resetBuffer();
   void resetBufferParsing();
+  bool deliver(const char* msg, size_t len);      // take a message read by another account of the pool
 
   void randInit();
+
+  friend class SipPool;
 };
 
 #endif // TINY_SIP_h
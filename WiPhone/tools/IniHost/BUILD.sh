@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+
+# Licensed under the WiPhone Public License v.1.0 (the "License"); you
+# may not use this file except in compliance with the License. You may
+# obtain a copy of the License at
+# https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+# Unless required by applicable law or agreed to in writing, software,
+# hardware or documentation distributed under the License is distributed
+# on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+# either express or implied. See the License for the specific language
+# governing permissions and limitations under the License.
+
+# Usage:
+#   ./BUILD.sh            - build ./ini_host
+#   ./BUILD.sh check      - build, then parse corpus/*.ini whole and streamed and compare against corpus/expected.txt,
+#                           check queries with an index against queries without one,
+#                           check T9 contact search against a search of every contact,
+#                           check caller ID lookups of differently written URIs,
+#                           and check storing INI files: patched in place, rewritten, interrupted by a power loss
+#   ./BUILD.sh bench      - build, then load a 500-contact phonebook: whole file, streamed and scanned;
+#                           look up contacts in a 2000-contact phonebook with and without an index;
+#                           load, iterate and unload the 500-contact phonebook with and without an arena;
+#                           search a 5000-contact T9 index; and look up caller IDs of 2000 contacts
+
+set -e
+cd "$(dirname "$0")"
+
+SRC="../.."
+SOURCES="$SRC/NanoINI.cpp $SRC/Storage.cpp $SRC/ContactIndex.cpp $SRC/CallerId.cpp $SRC/helpers.cpp $SRC/src/MurmurHash3_32.cpp ../SipHost/stubs.cpp"
+FLAGS="-std=gnu++17 -DESP32 -Ishim -I../SipHost/shim -I$SRC"
+WARN="-Wall -Wextra"
+
+build_host() {
+    gcc $WARN -O2 -I../SipHost/shim -c $SRC/src/digcalc.c -o digcalc.o
+    g++ $FLAGS $WARN -O2 "$@" ini_host.cpp $SOURCES digcalc.o -o ini_host
+    rm -f digcalc.o
+}
+
+case "$1" in
+    check)
+        build_host
+        ./ini_host -c corpus/*.ini | diff -u corpus/expected.txt -
+        ./ini_host -i
+        ./ini_host -t 1000
+        ./ini_host -n 500
+        ./ini_host -s 2000
+        echo "OK"
+        ;;
+    bench)
+        build_host
+        ./ini_host -b 500
+        ./ini_host -q 2000
+        ./ini_host -a 500
+        ./ini_host -t 5000
+        ./ini_host -n 2000
+        ;;
+    *)
+        build_host
+        ;;
+esac
@@ -0,0 +1,942 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+
+/*
+ * Host harness for NanoIni (see README.txt):
+ *   - with -c parses each file whole and streamed in chunks of every size from 1 to 64 bytes (every other size into an
+ *     arena), checks that they agree and prints what got parsed, for diffing against corpus/expected.txt;
+ *   - with -b N generates a phonebook of N contacts and compares loading it the way IniFile::load() used to
+ *     (whole file copied into RAM, then parsed) with loading it streamed, and with only scanning it (Visitor):
+ *     time, heap allocations and peak heap use;
+ *   - with -i applies random changes to a Config with an index (and to one also using an arena) and checks every query()
+ *     against a Config without one;
+ *   - with -q N looks up contacts of an N-contact phonebook by URI, with and without the index of "s";
+ *   - with -a N loads, iterates and unloads an N-contact phonebook with and without an arena;
+ *   - with -t N checks T9 contact search (ContactIndex) of N random contacts against a brute-force search, while
+ *     contacts get edited, and measures the time of a search;
+ *   - with -n N looks up the names of N random contacts (CallerIdCache) by differently written URIs and checks them,
+ *     with the time of a lookup and of comparing the URI with every contact instead;
+ *   - with -s N stores INI files (IniFile::store()) after N random edits, checking the files against what got printed,
+ *     that same-length changes are patched in place, and what is left of a store() interrupted by a power loss.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "NanoINI.h"
+#include "ContactIndex.h"
+#include "CallerId.h"
+#include "Storage.h"
+
+// Heap accounting: wraps glibc allocator; peak is of the bytes in use (as malloc_usable_size() counts them)
+
+static uint64_t heapAllocs = 0;
+static uint64_t heapFrees = 0;
+static size_t heapInUse = 0;
+static size_t heapPeak = 0;
+
+extern "C" {
+  extern void* __libc_malloc(size_t size);
+  extern void* __libc_calloc(size_t n, size_t size);
+  extern void* __libc_realloc(void* p, size_t size);
+  extern void __libc_free(void* p);
+
+  static void* counted(void* p) {
+    if (p) {
+      heapAllocs++;
+      heapInUse += malloc_usable_size(p);
+      if (heapInUse > heapPeak) {
+        heapPeak = heapInUse;
+      }
+    }
+    return p;
+  }
+  void* malloc(size_t size) {
+    return counted(__libc_malloc(size));
+  }
+  void* calloc(size_t n, size_t size) {
+    return counted(__libc_calloc(n, size));
+  }
+  void* realloc(void* p, size_t size) {
+    if (p) {
+      heapInUse -= malloc_usable_size(p);
+    }
+    return counted(__libc_realloc(p, size));
+  }
+  void free(void* p) {
+    if (p) {
+      heapInUse -= malloc_usable_size(p);
+      heapFrees++;
+    }
+    __libc_free(p);
+  }
+}
+
+static const size_t READ_CHUNK = 512;     // as IniFile::load()
+
+static double msNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static std::string readFile(const char* fn) {
+  std::string s;
+  FILE* f = fopen(fn, "rb");
+  if (f) {
+    char buff[4096];
+    size_t n;
+    while ((n = fread(buff, 1, sizeof(buff), f)) > 0) {
+      s.append(buff, n);
+    }
+    fclose(f);
+  }
+  return s;
+}
+
+static std::string dump(NanoIni::Config& ini) {
+  std::string s;
+  char line[64];
+  for (size_t i = 0; i < ini.nSections(); i++) {
+    snprintf(line, sizeof(line), "[%zu] ", i);
+    s += line;
+    s += "\"" + std::string(ini[i].title()) + "\"\n";
+    for (size_t j = 0; j < ini[i].nValues(); j++) {
+      const char* key = ini[i][j].key();
+      s += "  " + (key ? "\"" + std::string(key) + "\"" : std::string("(no key)")) + " = \"" + ini[i][j].value() + "\"\n";
+    }
+  }
+  return s;
+}
+
+/* Description:
+ *     parse `text` fed in chunks of `chunk` bytes.
+ */
+static void parseChunked(NanoIni::Config& ini, const std::string& text, size_t chunk) {
+  NanoIni::Config::Builder builder(ini);
+  NanoIni::Parser parser(builder);
+  for (size_t off = 0; off < text.size(); off += chunk) {
+    parser.feed(text.data() + off, text.size() - off < chunk ? text.size() - off : chunk);
+  }
+  parser.finish();
+}
+
+static int check(int argc, char** argv) {
+  int errors = 0;
+  for (int i = 0; i < argc; i++) {
+    std::string text = readFile(argv[i]);
+    NanoIni::Config whole(text.c_str());
+    std::string expected = dump(whole);
+    for (size_t chunk = 1; chunk <= 64; chunk++) {
+      NanoIni::Config streamed;
+      if (chunk % 2) {
+        streamed.useArena();
+      }
+      parseChunked(streamed, text, chunk);
+      if (dump(streamed) != expected) {
+        printf("%s: MISMATCH when streamed in chunks of %zu bytes\n", argv[i], chunk);
+        errors++;
+        break;
+      }
+    }
+    printf("== %s: %zu sections\n%s", argv[i], whole.nSections(), expected.c_str());
+  }
+  return errors ? 1 : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - -  Benchmark  - - - - - - - - - - - - - - - - - - - - - - - -
+
+/* Description:
+ *     counts the contacts with a SIP URI, like PhonebookUriVisitor of the firmware.
+ */
+class CountingVisitor : public NanoIni::Visitor {
+public:
+  int uris = 0;
+  bool section(const char*, size_t) {
+    return true;
+  }
+  bool keyValue(const char* key, size_t keyLength, const char*, size_t valueLength) {
+    if (key && keyLength == 1 && *key == 's' && valueLength > 0) {
+      uris++;
+    }
+    return true;
+  }
+};
+
+static void writePhonebook(const char* fn, int contacts) {
+  FILE* f = fopen(fn, "wb");
+  fprintf(f, "desc=WiPhone phonebook\nv=2\n");
+  for (int i = 1; i <= contacts; i++) {
+    fprintf(f, "[%d]\nn=Contact Number %d\ns=sip:contact%d@sip.example.org\n", i, i, i);
+    if (i % 5 == 0) {
+      fprintf(f, "l=%06x\n", i * 7919);
+    }
+  }
+  fclose(f);
+}
+
+/* Description:
+ *     what IniFile::load() did before the streaming parser: the whole file into a LinearArray, then Config::parse().
+ */
+static void loadWhole(NanoIni::Config& ini, const char* fn) {
+  FILE* f = fopen(fn, "rb");
+  int bytes;
+  char buff[1025];
+  LinearArray<char, LA_EXTERNAL_RAM> fileContent;
+  do {
+    bytes = fread(buff, 1, sizeof(buff)-1, f);
+    if (bytes > 0) {
+      fileContent.extend(buff, bytes);
+    }
+  } while (bytes == sizeof(buff)-1);
+  fclose(f);
+  fileContent.add('\0');
+  ini.parse(&fileContent[0]);
+}
+
+static void loadStreamed(NanoIni::Config& ini, const char* fn) {
+  FILE* f = fopen(fn, "rb");
+  NanoIni::Config::Builder builder(ini);
+  NanoIni::Parser parser(builder);
+  size_t bytes;
+  char buff[READ_CHUNK];
+  while ((bytes = fread(buff, 1, sizeof(buff), f)) > 0) {
+    parser.feed(buff, bytes);
+  }
+  parser.finish();
+  fclose(f);
+}
+
+static int scanStreamed(const char* fn) {
+  FILE* f = fopen(fn, "rb");
+  CountingVisitor visitor;
+  NanoIni::Parser parser(visitor);
+  size_t bytes;
+  char buff[READ_CHUNK];
+  while ((bytes = fread(buff, 1, sizeof(buff), f)) > 0) {
+    parser.feed(buff, bytes);
+  }
+  parser.finish();
+  fclose(f);
+  return visitor.uris;
+}
+
+static void report(const char* name, double ms, int rounds, uint64_t allocs, size_t peak, size_t base, int sections) {
+  printf("%-22s %9.1f us %10.0f allocs %10zu bytes peak   %d sections\n",
+         name, ms * 1000 / rounds, (double) allocs / rounds, peak - base, sections);
+}
+
+static int bench(int contacts) {
+  const char* fn = "/tmp/ini_host_phonebook.ini";
+  writePhonebook(fn, contacts);
+  FILE* f = fopen(fn, "rb");
+  fseek(f, 0, SEEK_END);
+  printf("phonebook: %d contacts, %ld bytes\n", contacts, ftell(f));
+  fclose(f);
+  const int rounds = 200;
+
+  for (int mode = 0; mode < 3; mode++) {
+    int sections = 0;
+    size_t base = heapInUse;
+    heapPeak = heapInUse;
+    uint64_t allocs = heapAllocs;
+    double t = msNow();
+    for (int r = 0; r < rounds; r++) {
+      if (mode < 2) {
+        NanoIni::Config ini;
+        if (mode == 0) {
+          loadWhole(ini, fn);
+        } else {
+          loadStreamed(ini, fn);
+        }
+        sections = ini.nSections();
+      } else {
+        sections = scanStreamed(fn) + 1;
+      }
+    }
+    t = msNow() - t;
+    report(mode == 0 ? "whole file + parse" : mode == 1 ? "streamed" : "scanned (visitor)", t, rounds, heapAllocs - allocs, heapPeak, base, sections);
+  }
+  remove(fn);
+  return 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - -  Index  - - - - - - - - - - - - - - - - - - - - - - - -
+
+static int compareNames(NanoIni::Section** a, NanoIni::Section** b) {
+  return strcmp((*a)->getValueSafe("n", ""), (*b)->getValueSafe("n", ""));
+}
+
+/* Description:
+ *     the same random changes to two configs, only one of them indexed: every query must give the same section.
+ */
+static int checkIndex(int operations) {
+  NanoIni::Config plain, indexed, arena;
+  indexed.indexKey("s");
+  arena.indexKey("s");
+  arena.useArena();
+  NanoIni::Config* const configs[] = { &plain, &indexed, &arena };
+  srand(1);
+  char value[16], value2[16];
+  int mismatches = 0;
+  for (int op = 0; op < operations; op++) {
+    int n = plain.nSections();
+    int i = n ? rand() % n : 0;
+    snprintf(value, sizeof(value), "v%d", rand() % 40);
+    snprintf(value2, sizeof(value2), "n%d", rand() % 40);
+    int j = n ? rand() % n : 0;
+    int what = rand() % 13;
+    bool rare = rand() % 50 == 0;
+    std::string text;
+    if (what == 11 && rare) {
+      text.assign(plain.length() + 1, '\0');
+      plain.sprint(&text[0]);
+    }
+    for (NanoIni::Config* c : configs) {
+      switch (what) {
+      case 0: case 1:
+        c->addSection();
+        (*c)[-1]["s"] = value;
+        (*c)[-1]["n"] = value2;
+        break;
+      case 2: case 3:
+        if (n) {
+          (*c)[i]["s"] = value;
+        }
+        break;
+      case 4:
+        if (n) {
+          (*c)[i].addKeyValue("s", value);      // a second "s": only the first one counts
+        }
+        break;
+      case 5:
+        if (n) {
+          (*c)[i].remove("s");
+        }
+        break;
+      case 6: case 7:
+        if (n) {
+          c->removeSection(i);
+        }
+        break;
+      case 8:
+        if (n) {
+          c->addSection(new NanoIni::Section((*c)[i]));
+          (*c)[-1]["n"] = value2;
+          c->reorderLast(0, compareNames);
+        }
+        break;
+      case 9:
+        if (rare) {
+          c->sortFrom(0, compareNames);
+        }
+        break;
+      case 10:
+        if (n) {
+          (*c)[i].deepCopy((*c)[j]);
+        }
+        break;
+      case 11:
+        if (rare) {
+          c->parse(text.c_str());     // into the arena again
+        }
+        break;
+      default:
+        if (n) {
+          (void) (*c)[i]["x"];        // provisional key-values, not assigned
+        }
+        break;
+      }
+    }
+    bool sweep = op % 500 == 499 || op == operations - 1;
+    for (int k = 0; k < (sweep ? 40 : 3); k++) {
+      int v = sweep ? k : rand() % 40;
+      snprintf(value, sizeof(value), "v%d", v);
+      snprintf(value2, sizeof(value2), "n%d", v);
+      for (NanoIni::Config* c : { &indexed, &arena }) {
+        if (plain.query("s", value) != c->query("s", value) ||
+            plain.query("n", value2, "s", value) != c->query("n", value2, "s", value)) {
+          if (!mismatches++) {
+            printf("operation %d: query(\"s\", \"%s\") = %d, %s: %d\n", op, value, plain.query("s", value),
+                   c == &arena ? "arena" : "indexed", c->query("s", value));
+          }
+        }
+      }
+    }
+    if (sweep && dump(plain) != dump(arena)) {
+      if (!mismatches++) {
+        printf("operation %d: arena differs\n", op);
+      }
+    }
+  }
+  printf("index: %d operations, %d sections, %d mismatches\n", operations, (int) plain.nSections(), mismatches);
+  return mismatches ? 1 : 0;
+}
+
+/* Description:
+ *     load, go through every key-value, unload: separately allocated objects against the arena.
+ */
+static int benchArena(int contacts) {
+  const char* fn = "/tmp/ini_host_phonebook.ini";
+  writePhonebook(fn, contacts);
+  printf("phonebook: %d contacts\n", contacts);
+  const int rounds = 200;
+
+  for (int arena = 0; arena < 2; arena++) {
+    NanoIni::Config ini;
+    ini.indexKey("s");
+    if (arena) {
+      ini.useArena();
+    }
+    double ms[3] = { 0, 0, 0 };
+    uint64_t allocs[2] = { 0, 0 };
+    uint64_t frees = 0;
+    size_t loaded = 0, total = 0;
+    for (int r = 0; r < rounds; r++) {
+      size_t base = heapInUse;
+      uint64_t a = heapAllocs;
+      double t = msNow();
+      loadStreamed(ini, fn);
+      ms[0] += msNow() - t;
+      allocs[0] += heapAllocs - a;
+      loaded = heapInUse - base;
+
+      a = heapAllocs;
+      t = msNow();
+      for (auto it = ini.iterator(); it.valid(); ++it) {
+        for (size_t k = 0; k < it->nValues(); k++) {
+          total += strlen((*it)[k].value());
+        }
+      }
+      ms[1] += msNow() - t;
+      allocs[1] += heapAllocs - a;
+
+      uint64_t f = heapFrees;
+      t = msNow();
+      ini.clear();
+      ms[2] += msNow() - t;
+      frees += heapFrees - f;
+    }
+    printf("%-9s load %8.1f us %7.0f allocs %8zu bytes   iterate %7.1f us   unload %7.1f us %7.0f frees   (%zu)\n",
+           arena ? "arena" : "separate", ms[0] * 1000 / rounds, (double) allocs[0] / rounds, loaded,
+           ms[1] * 1000 / rounds, ms[2] * 1000 / rounds, (double) frees / rounds, total / rounds);
+  }
+  remove(fn);
+  return 0;
+}
+
+static int benchQuery(int contacts) {
+  const char* fn = "/tmp/ini_host_phonebook.ini";
+  writePhonebook(fn, contacts);
+  printf("phonebook: %d contacts\n", contacts);
+  const int lookups = 20000;
+
+  for (int indexed = 0; indexed < 2; indexed++) {
+    NanoIni::Config ini;
+    if (indexed) {
+      ini.indexKey("s");
+    }
+    const int rounds = 20;
+    double t = msNow();
+    for (int r = 0; r < rounds; r++) {
+      loadStreamed(ini, fn);
+    }
+    double msLoad = (msNow() - t) / rounds;
+    ini.clear();
+    size_t base = heapInUse;
+    loadStreamed(ini, fn);
+    size_t loaded = heapInUse - base;
+
+    char uri[64];
+    int found = 0;
+    srand(2);
+    t = msNow();
+    for (int i = 0; i < lookups; i++) {
+      int c = rand() % (contacts * 2) + 1;        // half of them are not there
+      snprintf(uri, sizeof(uri), "sip:contact%d@sip.example.org", c);
+      found += ini.query("s", uri) == (c <= contacts ? c : -1);
+    }
+    double msQuery = msNow() - t;
+
+    printf("%-10s load %8.1f us  %8zu bytes (index %zu)   query(\"s\", uri) %8.3f us   %d/%d right\n",
+           indexed ? "indexed" : "linear", msLoad * 1000, loaded, ini.indexMemory(), msQuery * 1000 / lookups, found, lookups);
+  }
+  remove(fn);
+  return 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - -  T9 search  - - - - - - - - - - - - - - - - - - - - - - - -
+
+// GUI::alphNum, plus a character that is not ASCII (ContactIndex ignores such bytes, whether char is signed or not)
+static const char* keypad[11] = { " +0", "1", "abc2", "def3", "ghi4", "jkl5", "mno6", "pqrs7", "tuv8", "wxyz9",
+                                  ".,!?@$/+-=%^ _:;'*#\xc3\xbc" };
+
+static char t9Digit(char c) {
+  for (int i = 0; i < 11; i++) {
+    if ((unsigned char) c < 128 && c && strchr(keypad[i], tolower(c))) {
+      return i < 10 ? '0' + i : '#';
+    }
+  }
+  return 0;
+}
+
+/* Description:
+ *     the word keys of a string, as ContactIndex is supposed to make them: digits from each word start to the end.
+ */
+static void t9Keys(const std::string& s, std::vector<std::string>& keys) {
+  for (size_t i = 0; i < s.size(); i++) {
+    if (isalnum((unsigned char) s[i]) && (i == 0 || !isalnum((unsigned char) s[i - 1]) || !t9Digit(s[i - 1]))) {
+      std::string k;
+      for (size_t j = i; j < s.size(); j++) {
+        if (t9Digit(s[j])) {
+          k += t9Digit(s[j]);
+        }
+      }
+      keys.push_back(k);
+    }
+  }
+}
+
+/* Description:
+ *     rank (0 - first word of the name, 1 - another word, 2 - user part of the URI, 3 - none) and digits of the best
+ *     key of a contact starting with `digits`
+ */
+static std::pair<int, std::string> bestT9Key(const std::string& name, const std::string& uri, const std::string& digits) {
+  std::pair<int, std::string> best(3, "");
+  std::vector<std::string> nameKeys, userKeys;
+  t9Keys(name, nameKeys);
+  t9Keys(uri.substr(4, uri.find('@') - 4), userKeys);
+  for (size_t k = 0; k < nameKeys.size() + userKeys.size(); k++) {
+    std::pair<int, std::string> key(k == 0 ? 0 : k < nameKeys.size() ? 1 : 2, k < nameKeys.size() ? nameKeys[k] : userKeys[k - nameKeys.size()]);
+    if (!key.second.compare(0, digits.size(), digits) && key < best) {
+      best = key;
+    }
+  }
+  return best;
+}
+
+struct T9Contact {
+  std::string name, uri;
+};
+
+static std::string randomName(int i) {
+  static const char* first[] = { "Anna", "Bob", "Carol", "Dmitri", "Eve", "Frank", "Grace", "Heidi", "Ivan", "Judy",
+                                  "Mallory", "Niaj", "Olivia", "Peggy", "Rupert", "Sybil", "Trent", "Victor", "Walter" };
+  static const char* last[] = { "Smith", "Johnson", "O'Brien", "van der Berg", "Lee", "Garcia", "M\xc3\xbcller", "Kowalski",
+                                 "Nguyen", "Tanaka", "Rossi", "Dubois" };
+  char buff[64];
+  snprintf(buff, sizeof(buff), "%s %s-%d", first[rand() % 19], last[rand() % 12], i);
+  return buff;
+}
+
+static std::string randomUri(int i) {
+  char buff[64];
+  if (rand() % 3 == 0) {
+    snprintf(buff, sizeof(buff), "sip:+%d%06d@pbx.example.org", 1 + rand() % 99, rand() % 1000000);
+  } else {
+    snprintf(buff, sizeof(buff), "sip:user.%c%d@sip.example.com", 'a' + rand() % 26, i);
+  }
+  return buff;
+}
+
+static int checkT9(int n) {
+  ContactIndex index;
+  index.setKeypad(keypad, 11);
+  std::vector<T9Contact> contacts;
+  srand(3);
+  index.beginBuild();
+  for (int i = 0; i < n; i++) {
+    contacts.push_back({ randomName(i), randomUri(i) });
+    index.add(contacts.back().name.c_str(), contacts.back().uri.c_str());
+  }
+  index.endBuild();
+  printf("T9: %d contacts, %zu bytes\n", n, index.memoryUsed());
+
+  int mismatches = 0, searches = 0;
+  double msMax = 0, msTotal = 0;
+  for (int op = 0; op < 2000; op++) {
+    // Edit a contact (as PhonebookApp does: remove, then add the new one) or delete one and add another
+    int c = rand() % contacts.size();
+    if (!index.remove(contacts[c].name.c_str(), contacts[c].uri.c_str())) {
+      mismatches++;
+    }
+    contacts[c] = { op % 2 ? randomName(n + op) : contacts[c].name, randomUri(n + op) };
+    index.add(contacts[c].name.c_str(), contacts[c].uri.c_str());
+
+    // Search for the beginning of a word of a random contact
+    const T9Contact& t = contacts[rand() % contacts.size()];
+    std::vector<std::string> keys;
+    t9Keys(rand() % 2 ? t.name : t.uri.substr(4, t.uri.find('@') - 4), keys);
+    std::string digits = keys[rand() % keys.size()].substr(0, 1 + rand() % 6);
+
+    ContactIndex::Match found[5];
+    double ms = msNow();
+    int nFound = index.find(digits.c_str(), found, 5);
+    ms = msNow() - ms;
+    msTotal += ms;
+    msMax = ms > msMax ? ms : msMax;
+    searches++;
+
+    // Brute force: the best key of each contact, lowest rank first, then in the order of the digits
+    std::vector<std::pair<int, std::string>> expected, got;
+    for (const T9Contact& e : contacts) {
+      expected.push_back(bestT9Key(e.name, e.uri, digits));
+    }
+    std::sort(expected.begin(), expected.end());
+    while (!expected.empty() && expected.back().first > 2) {
+      expected.pop_back();
+    }
+    expected.resize(std::min<size_t>(expected.size(), 5));
+    for (int k = 0; k < nFound; k++) {
+      got.push_back(bestT9Key(found[k].name, found[k].uri, digits));
+    }
+    if (got != expected && !mismatches++) {
+      printf("\"%s\": %d found, %zu expected\n", digits.c_str(), nFound, expected.size());
+    }
+  }
+  printf("T9: %d searches, %.2f us average, %.2f us max, %d mismatches\n", searches, msTotal * 1000 / searches, msMax * 1000, mismatches);
+  return mismatches ? 1 : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - -  Caller ID  - - - - - - - - - - - - - - - - - - - - - - - -
+
+/* Description:
+ *     another way to write the same URI: case, display name, brackets, default port, parameters, headers
+ */
+static std::string decorateUri(const std::string& user, const std::string& host) {
+  std::string uri = std::string(rand() % 2 ? "sip:" : "SIP:") + user;
+  if (!host.empty()) {
+    uri += "@" + host;
+    if (rand() % 3 == 0) {
+      uri += ":5060";
+    }
+  }
+  for (size_t i = 0; i < uri.size(); i++) {
+    if (rand() % 4 == 0) {
+      uri[i] = toupper(uri[i]);
+    }
+  }
+  if (rand() % 3 == 0) {
+    uri += ";transport=tcp";
+  }
+  if (rand() % 3 == 0) {
+    uri = "\"Someone\" <" + uri + (rand() % 2 ? "?subject=hi>" : ">");
+  }
+  return uri;
+}
+
+static int checkCallerId(int n) {
+  struct Contact {
+    std::string name, user, host;     // host empty - saved as just a number
+  };
+  std::vector<Contact> contacts;
+  std::vector<std::string> uris;      // as saved in the phonebook
+  srand(4);
+  for (int i = 0; i < n; i++) {
+    char user[32];
+    bool number = rand() % 4 == 0;
+    snprintf(user, sizeof(user), number ? "+%d%06d" : "user.%c%d", number ? 1 + i % 99 : 'a' + rand() % 26, i);
+    contacts.push_back({ randomName(i), user, number ? "" : "sip.example.com" });
+    uris.push_back(decorateUri(user, contacts.back().host));
+  }
+  CallerIdCache cache;
+  double ms = msNow();
+  cache.beginBuild();
+  for (int i = 0; i < n; i++) {
+    cache.add(contacts[i].name.c_str(), uris[i].c_str());
+  }
+  cache.endBuild();
+  ms = msNow() - ms;
+  printf("caller ID: %d contacts, %zu bytes, built in %.2f ms\n", n, cache.memoryUsed(), ms);
+
+  int lookups = 20000, mismatches = 0;
+  double msLinear = 0;
+  ms = 0;
+  for (int i = 0; i < lookups; i++) {
+    // A contact (numbers are called from any domain), or someone unknown
+    const Contact* c = rand() % 4 ? &contacts[rand() % n] : NULL;
+    std::string uri = c ? decorateUri(c->user, c->host.empty() ? "pbx" + std::to_string(rand() % 10) + ".example.net" : c->host)
+                        : decorateUri("stranger" + std::to_string(rand()), "sip.example.com");
+    double t = msNow();
+    const char* name = cache.name(uri.c_str());
+    ms += msNow() - t;
+    if (c ? name == NULL || c->name != name : name != NULL) {
+      if (!mismatches++) {
+        printf("%s: \"%s\", expected \"%s\"\n", uri.c_str(), name ? name : "(none)", c ? c->name.c_str() : "(none)");
+      }
+    }
+
+    // What a lookup costs without the cache: the URI compared with every contact
+    if (i % 100 == 0) {
+      t = msNow();
+      char key[CallerIdCache::MAX_URI_LENGTH + 1], other[CallerIdCache::MAX_URI_LENGTH + 1];
+      CallerIdCache::normalize(uri.c_str(), key, sizeof(key));
+      volatile int found = -1;
+      for (int k = 0; k < n && found < 0; k++) {
+        std::string contactUri = "sip:" + contacts[k].user + (contacts[k].host.empty() ? "" : "@" + contacts[k].host);
+        if (CallerIdCache::normalize(contactUri.c_str(), other, sizeof(other)) && !strcmp(key, other)) {
+          found = k;
+        }
+      }
+      msLinear += msNow() - t;
+    }
+  }
+  const CallerIdCache::Stats& stats = cache.stats();
+  printf("caller ID: %d lookups, %u%% known, %.3f us average (every contact compared: %.1f us), %d mismatches\n",
+         lookups, stats.known * 100 / stats.lookups, ms * 1000 / lookups, msLinear * 1000 / (lookups / 100), mismatches);
+  return mismatches ? 1 : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  -s: IniFile::store()  - - - - - - - - - - - - - - - - - - - - -
+
+static std::string flashDir;
+static int storeErrors = 0;
+
+static void expect(bool ok, int line, const char* what) {
+  if (!ok && storeErrors++ < 20) {
+    printf("store: line %d: %s\n", line, what);
+  }
+}
+#define EXPECT(cond) expect(cond, __LINE__, #cond)
+
+static std::string flashFile(const char* fn) {
+  return readFile((flashDir + fn).c_str());
+}
+
+static void putFlashFile(const char* fn, const char* text) {
+  FILE* f = fopen((flashDir + fn).c_str(), "wb");
+  fputs(text, f);
+  fclose(f);
+}
+
+static ino_t flashInode(const char* fn) {
+  struct stat st;
+  return stat((flashDir + fn).c_str(), &st) == 0 ? st.st_ino : 0;
+}
+
+// What store() must have written
+static std::string printed(NanoIni::Config& ini) {
+  std::string s(ini.length() + 1, '\0');
+  s.resize(ini.sprint(&s[0]));
+  return s;
+}
+
+/* Description:
+ *     store a change the same length (patched in place: the file stays the same one), then another length (written
+ *     into "name.tmp" and renamed), with the contents checked after each.
+ */
+static void checkStoreCases() {
+  IniFile f("/a.ini");
+  f[0]["desc"] = "test";
+  f[0]["v"] = "1";
+  f.addSection("audio");
+  f["audio"]["vol"] = -12;
+  f.addSection();
+  f[2]["x"] = "abc";
+  EXPECT(f.store() && flashFile("/a.ini") == printed(f));
+  ino_t inode = flashInode("/a.ini");
+  f["audio"]["vol"] = -18;
+  EXPECT(f.store() && flashFile("/a.ini") == printed(f));
+  EXPECT(flashInode("/a.ini") == inode);
+  f["audio"]["vol"] = -6;
+  EXPECT(f.store() && flashFile("/a.ini") == printed(f));
+  EXPECT(flashInode("/a.ini") != inode);
+  EXPECT(!SPIFFS.exists("/a.ini.tmp"));
+
+  // Written as loaded, not as printed: a section can be patched only if it was printed the same
+  putFlashFile("/b.ini", "k=1\n[s1]]]\n\nx=10\n[2]\ny=2\nnoeq\n[last]\nz=3\n");
+  IniFile b("/b.ini");
+  EXPECT(b.load());
+  b["last"]["z"] = "4";
+  EXPECT(b.store() && flashFile("/b.ini") == "k=1\n[s1]]]\n\nx=10\n[2]\ny=2\nnoeq\n[last]\nz=4\n");
+  b["s1"]["x"] = "11";
+  EXPECT(b.store() && flashFile("/b.ini") == printed(b));
+
+  // Sections added, removed, renamed
+  b.removeSection(1);
+  EXPECT(b.store() && flashFile("/b.ini") == printed(b));
+  b.addSection("new");
+  b["new"]["q"] = "1";
+  EXPECT(b.store() && flashFile("/b.ini") == printed(b));
+  b[1].setTitle("old");
+  EXPECT(b.store() && flashFile("/b.ini") == printed(b));
+
+  // Two instances of one file: the other one's offsets are stale once this one rewrites it
+  IniFile c1("/c.ini");
+  c1[0]["k"] = "aaaa";
+  c1.addSection("s");
+  c1["s"]["v"] = "1";
+  EXPECT(c1.store());
+  IniFile c2("/c.ini");
+  EXPECT(c2.load());
+  c1[0]["k"] = "bbbbbbbb";
+  EXPECT(c1.store());
+  c2["s"]["v"] = "2";
+  EXPECT(c2.store() && flashFile("/c.ini") == printed(c2));
+
+  // Deferred: stored once the delay is over, or on syncAll()
+  IniFile d("/d.ini");
+  d[0]["n"] = 1;
+  EXPECT(d.store());
+  for (int i = 0; i < 5; i++) {
+    d[0]["n"] = i;
+    d.storeLater();
+  }
+  IniFile::syncDue(millis());
+  EXPECT(flashFile("/d.ini") == "n=1\n");
+  IniFile::syncDue(millis() + IniFile::SYNC_DELAY_MS + 1);
+  EXPECT(flashFile("/d.ini") == "n=4\n");
+  d[0]["n"] = 9;
+  d.storeLater();
+  IniFile::syncAll();
+  EXPECT(flashFile("/d.ini") == "n=9\n");
+
+  // Left by a power loss: a complete temporary file (the file was already removed), a stale one (it wasn't)
+  putFlashFile("/e.ini.tmp", "r=1\n");
+  IniFile e("/e.ini");
+  EXPECT(e.load() && !strcmp(e[0].getValueSafe("r", ""), "1") && !SPIFFS.exists("/e.ini.tmp"));
+  putFlashFile("/e.ini.tmp", "r=");
+  IniFile e2("/e.ini");
+  EXPECT(e2.load() && !strcmp(e2[0].getValueSafe("r", ""), "1") && !SPIFFS.exists("/e.ini.tmp"));
+}
+
+/* Description:
+ *     store a change with the power cut after 0, 1, 2, ... changes of the flash until it completes: loaded again,
+ *     the file must be the old one or the new one.
+ */
+static void checkStorePowerCuts() {
+  for (long cut = 0;; cut++) {
+    IniFile f("/p.ini");
+    f.remove();
+    for (int i = 0; i < 20; i++) {
+      f.addSection();
+      f[i]["a"] = i;
+    }
+    EXPECT(f.store());
+    std::string before = printed(f);
+    f[5]["a"] = "a longer value";
+    std::string after = printed(f);
+    SPIFFS.powerCutAfter(cut);
+    bool stored = f.store();
+    SPIFFS.powerRestore();
+    IniFile g("/p.ini");
+    EXPECT(g.load());
+    std::string got = printed(g);
+    EXPECT(got == before || got == after);
+    EXPECT(!SPIFFS.exists("/p.ini.tmp"));
+    if (stored) {
+      EXPECT(got == after);
+      break;
+    }
+  }
+}
+
+/* Description:
+ *     random edits of a file of 50 sections (values of the same or another length, keys and sections added and
+ *     removed), stored every third edit on average and reloaded now and then: the file must always be what got printed.
+ */
+static int checkStore(int operations) {
+  char tmpl[] = "/tmp/ini_host.XXXXXX";
+  if (mkdtemp(tmpl) == NULL) {
+    perror("mkdtemp");
+    return 2;
+  }
+  flashDir = tmpl;
+  SPIFFS.setRoot(tmpl);
+
+  checkStoreCases();
+  checkStorePowerCuts();
+
+  srand(1);
+  int stores = 0, patched = 0;
+  IniFile r("/r.ini");
+  for (int i = 0; i < 50; i++) {
+    r.addSection();
+    r[i]["a"] = 10 + rand() % 90;
+  }
+  EXPECT(r.store());
+  for (int op = 0; op < operations; op++) {
+    int what = rand() % 10;
+    int i = rand() % r.nSections();
+    if (what < 6) {
+      r[i]["a"] = what < 5 ? 10 + rand() % 90 : rand() % 1000;     // mostly the same length
+    } else if (what == 6) {
+      r[i]["b"] = "x";
+    } else if (what == 7) {
+      r[i].remove("b");
+    } else if (what == 8 && r.nSections() > 2) {
+      r.removeSection(1 + rand() % (r.nSections() - 1));
+    } else {
+      r.addSection();
+      r[-1]["a"] = 10;
+    }
+    if (rand() % 3 == 0) {
+      ino_t inode = flashInode("/r.ini");
+      EXPECT(r.store());
+      EXPECT(flashFile("/r.ini") == printed(r));
+      stores++;
+      patched += flashInode("/r.ini") == inode;
+    }
+    if (rand() % 50 == 0) {
+      r.unload();
+      EXPECT(r.load());
+    }
+  }
+  EXPECT(patched > 0 && patched < stores);
+
+  SPIFFS.setRoot(NULL);
+  std::string rm = "rm -rf " + flashDir;
+  system(rm.c_str());
+  printf("store: %d operations, %d stores (%d patched in place), power cut at every change: %d errors\n", operations,
+         stores, patched, storeErrors);
+  return storeErrors ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && !strcmp(argv[1], "-c")) {
+    return check(argc - 2, argv + 2);
+  }
+  if (argc > 2 && !strcmp(argv[1], "-b")) {
+    return bench(atoi(argv[2]));
+  }
+  if (argc > 1 && !strcmp(argv[1], "-i")) {
+    return checkIndex(argc > 2 ? atoi(argv[2]) : 10000);
+  }
+  if (argc > 2 && !strcmp(argv[1], "-q")) {
+    return benchQuery(atoi(argv[2]));
+  }
+  if (argc > 2 && !strcmp(argv[1], "-a")) {
+    return benchArena(atoi(argv[2]));
+  }
+  if (argc > 2 && !strcmp(argv[1], "-t")) {
+    return checkT9(atoi(argv[2]));
+  }
+  if (argc > 2 && !strcmp(argv[1], "-n")) {
+    return checkCallerId(atoi(argv[2]));
+  }
+  if (argc > 1 && !strcmp(argv[1], "-s")) {
+    return checkStore(argc > 2 ? atoi(argv[2]) : 2000);
+  }
+  fprintf(stderr, "Usage:\n  %s -c file.ini ...\n  %s -b contacts\n  %s -i [operations]\n  %s -q contacts\n  %s -a contacts\n"
+          "  %s -t contacts\n  %s -n contacts\n  %s -s [operations]\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+          argv[0]);
+  return 2;
+}
@@ -0,0 +1,46 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+
+// Host stand-in for libb64 of the ESP32 core (same interface; characters outside the alphabet are skipped)
+
+#ifndef BASE64_CDECODE_H
+#define BASE64_CDECODE_H
+
+#include <string.h>
+
+#define base64_decode_expected_len(n) (((n) * 3) / 4)
+
+static inline int base64_decode_chars(const char* in, int len, char* out) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char* p = out;
+  unsigned bits = 0;
+  int n = 0;
+  for (int i = 0; i < len && in[i] != '='; i++) {
+    const char* c = in[i] ? strchr(alphabet, in[i]) : NULL;
+    if (c == NULL) {
+      continue;
+    }
+    bits = (bits << 6) | (c - alphabet);
+    n += 6;
+    if (n >= 8) {
+      n -= 8;
+      *p++ = (bits >> n) & 0xff;
+    }
+  }
+  *p = '\0';
+  return p - out;
+}
+
+#endif // BASE64_CDECODE_H
@@ -0,0 +1,68 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+
+// Host stand-in for libb64 of the ESP32 core (same interface and output: no line breaks, '=' padding)
+
+#ifndef BASE64_CENCODE_H
+#define BASE64_CENCODE_H
+
+#define base64_encode_expected_len(n) ((((4 * (n)) / 3) + 3) & ~3)
+
+typedef struct {
+  int step;                   // bytes pending in `bits` (0..2)
+  unsigned bits;
+} base64_encodestate;
+
+static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static inline void base64_init_encodestate(base64_encodestate* state) {
+  state->step = 0;
+  state->bits = 0;
+}
+
+static inline int base64_encode_block(const char* in, int len, char* out, base64_encodestate* state) {
+  char* p = out;
+  for (int i = 0; i < len; i++) {
+    state->bits = (state->bits << 8) | (unsigned char) in[i];
+    if (++state->step == 3) {
+      *p++ = base64_alphabet[(state->bits >> 18) & 63];
+      *p++ = base64_alphabet[(state->bits >> 12) & 63];
+      *p++ = base64_alphabet[(state->bits >> 6) & 63];
+      *p++ = base64_alphabet[state->bits & 63];
+      state->step = 0;
+      state->bits = 0;
+    }
+  }
+  return p - out;
+}
+
+static inline int base64_encode_blockend(char* out, base64_encodestate* state) {
+  char* p = out;
+  if (state->step == 1) {
+    *p++ = base64_alphabet[(state->bits >> 2) & 63];
+    *p++ = base64_alphabet[(state->bits << 4) & 63];
+    *p++ = '=';
+    *p++ = '=';
+  } else if (state->step == 2) {
+    *p++ = base64_alphabet[(state->bits >> 10) & 63];
+    *p++ = base64_alphabet[(state->bits >> 4) & 63];
+    *p++ = base64_alphabet[(state->bits << 2) & 63];
+    *p++ = '=';
+  }
+  *p = '\0';
+  return p - out;
+}
+
+#endif // BASE64_CENCODE_H
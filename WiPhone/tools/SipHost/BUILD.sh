@@ -0,0 +1,151 @@
+#!/bin/bash
+
+# Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+
+# Licensed under the WiPhone Public License v.1.0 (the "License"); you
+# may not use this file except in compliance with the License. You may
+# obtain a copy of the License at
+# https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+# Unless required by applicable law or agreed to in writing, software,
+# hardware or documentation distributed under the License is distributed
+# on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+# either express or implied. See the License for the specific language
+# governing permissions and limitations under the License.
+
+# Usage:
+#   ./BUILD.sh            - build ./sip_host (benchmark & dump)
+#   ./BUILD.sh check      - build, then compare parsed fields of the corpus against corpus/expected.txt
+#                           and the routing between two accounts against corpus/routing.txt,
+#                           and the messages each of them gets from a stream they share (./sip_host -w),
+#                           and the presence statuses from the NOTIFYs of corpus/presence/ against corpus/presence.txt,
+#                           and STUN mappings through a local stand-in server against corpus/stun.txt,
+#                           and SIP servers located through a local stand-in DNS server against corpus/dns.txt,
+#                           and TLS session resumption with a local stand-in server against corpus/tls.txt,
+#                           and that replaying the corpus allocates nothing (./sip_host -a),
+#                           and when registrations are refreshed (./sip_host -g);
+#                           then simulates calls between two phones, clean and impaired (see ./sip_sim)
+#   ./BUILD.sh bench      - build, then replay the corpus
+#   ./BUILD.sh sim        - build ./sip_sim, then run 2000 call cycles clean and 2000 with loss, delay and reordering
+#   ./BUILD.sh fuzz       - build ./sip_fuzz with clang and libFuzzer (run as: ./sip_fuzz corpus/)
+#   ./BUILD.sh verbose    - build ./sip_host with the firmware logs printed to stderr
+
+set -e
+cd "$(dirname "$0")"
+
+SRC="../.."
+SOURCES="stubs.cpp $SRC/tinySIP.cpp $SRC/resolver.cpp $SRC/CallerId.cpp $SRC/CallTrace.cpp $SRC/Stun.cpp $SRC/Presence.cpp"
+SOURCES="$SOURCES $SRC/Storage.cpp $SRC/NanoINI.cpp $SRC/helpers.cpp $SRC/src/MurmurHash3_32.cpp"
+FLAGS="-std=gnu++17 -DESP32 -Ishim -I../IniHost/shim -I$SRC"
+WARN="-Wall -Wextra"
+ACCOUNTS="sip:alice@sip2sip.info,sip:bob@example.org"      # two accounts sharing a connection, see corpus/routing.txt
+STUN_PORT=34780
+TLS_PORT=35061
+DNS_PORT=35353
+LIBS=""
+
+# SIP over TLS: TlsConnection.cpp needs the mbedTLS 2.x headers (libmbedtls-dev); without them TLS never connects
+if grep -Eqs "define MBEDTLS_VERSION_MAJOR +2$" /usr/include/mbedtls/version.h; then
+    FLAGS="$FLAGS -DSIP_HOST_TLS -DTLS_SESSIONS_IN_NVS=1"      # cover the NVS path too (the shim keeps it in memory)
+    SOURCES="$SOURCES $SRC/TlsConnection.cpp"
+    LIBS="-lmbedtls -lmbedx509 -lmbedcrypto"
+fi
+
+# build <sip_host|sip_sim> [flags...]
+build() {
+    OUT=$1
+    shift
+    gcc $WARN -O2 -Ishim -c $SRC/src/digcalc.c -o digcalc.o
+    g++ $FLAGS $WARN -O2 "$@" $OUT.cpp $SOURCES digcalc.o $LIBS -o $OUT
+    rm -f digcalc.o
+}
+
+build_host() {
+    build sip_host "$@"
+}
+
+build_sim() {
+    build sip_sim "$@"
+}
+
+# STUN: a NAT that remaps ports and loses the first request, then a port-preserving one
+check_stun() {
+    (
+        python3 stun_standin.py --port $STUN_PORT --public 203.0.113.7 --shift 1000 --drop 1 & STANDIN=$!
+        sleep 0.3
+        ./sip_host -s 127.0.0.1:$STUN_PORT
+        kill $STANDIN
+        python3 stun_standin.py --port $STUN_PORT --public 203.0.113.7 & STANDIN=$!
+        sleep 0.3
+        ./sip_host -s 127.0.0.1:$STUN_PORT
+        kill $STANDIN
+    ) | diff -u corpus/stun.txt -
+}
+
+# TLS: full handshake first, then resumed ones, also after the RAM cache is gone; by ticket, then by session ID
+# DNS: NAPTR, SRV and A records, failover, TTL expiry, then the server stops answering
+check_dns() {
+    (
+        python3 dns_standin.py --port $DNS_PORT & STANDIN=$!
+        sleep 0.3
+        ./sip_host -x 127.0.0.1:$DNS_PORT
+        kill $STANDIN
+    ) | diff -u corpus/dns.txt -
+}
+
+check_tls() {
+    if [ -z "$LIBS" ]; then
+        echo "TLS check skipped: no mbedTLS 2.x headers" >&2
+        return
+    fi
+    TMP=$(mktemp -d)
+    openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -subj /CN=localhost -days 1 \
+        -keyout $TMP/key.pem -out $TMP/cert.pem 2> /dev/null
+    (
+        for MODE in "" "--no-tickets"; do
+            python3 tls_standin.py --port $TLS_PORT --cert $TMP/cert.pem --key $TMP/key.pem $MODE 2> /dev/null & STANDIN=$!
+            sleep 0.3
+            ./sip_host -c $TMP/cert.pem -t 127.0.0.1:$TLS_PORT 2> /dev/null
+            kill $STANDIN
+        done
+    ) | diff -u corpus/tls.txt -
+    rm -rf $TMP
+}
+
+case "$1" in
+    fuzz)
+        clang $WARN -g -O1 -fsanitize=address -Ishim -c $SRC/src/digcalc.c -o digcalc.o
+        clang++ $FLAGS $WARN -g -O1 -DSIP_HOST_FUZZ -fsanitize=fuzzer,address sip_host.cpp $SOURCES digcalc.o $LIBS -o sip_fuzz
+        rm -f digcalc.o
+        ;;
+    verbose)
+        build_host -DSIP_HOST_VERBOSE
+        ;;
+    check)
+        build_host
+        ./sip_host -d corpus/*.sip | diff -u corpus/expected.txt -
+        ./sip_host -r $ACCOUNTS corpus/*.sip | diff -u corpus/routing.txt -
+        ./sip_host -w $ACCOUNTS corpus/*.sip
+        ./sip_host -p corpus/presence/*.sip | diff -u corpus/presence.txt -
+        ./sip_host -a -n 200 corpus/*.sip
+        ./sip_host -g
+        check_stun
+        check_dns
+        check_tls
+        build_sim
+        ./sip_sim -n 200 > /dev/null
+        ./sip_sim -n 200 -l 2 -d 20 -j 40 > /dev/null && echo "OK"
+        ;;
+    sim)
+        build_sim
+        ./sip_sim -n 2000
+        ./sip_sim -n 2000 -l 2 -d 20 -j 40
+        ;;
+    bench)
+        build_host
+        ./sip_host -n 20000 corpus/*.sip
+        ;;
+    *)
+        build_host
+        ;;
+esac
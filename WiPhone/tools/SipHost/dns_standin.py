@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+
+# Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+
+# Licensed under the WiPhone Public License v.1.0 (the "License"); you
+# may not use this file except in compliance with the License. You may
+# obtain a copy of the License at
+# https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+# Unless required by applicable law or agreed to in writing, software,
+# hardware or documentation distributed under the License is distributed
+# on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+# either express or implied. See the License for the specific language
+# governing permissions and limitations under the License.
+
+# Local stand-in for a DNS server (RFC 1035) with the records of a few SIP domains (RFC 3263): NAPTR -> SRV -> A,
+# SRV only, A only, a short TTL, and a missing domain. Every time a name is asked again, its SRV ports grow by 100 and the
+# last byte of its A address by 1, so that a client can tell a cached answer from a new one.
+
+import argparse
+import socket
+import struct
+from collections import Counter
+
+TYPE_A, TYPE_SRV, TYPE_NAPTR = 1, 33, 35
+TTL = 60
+
+# name -> records: ("NAPTR", order, preference, flags, service, replacement), ("SRV", priority, weight, port, target),
+# ("A", address); SRV targets in ADDITIONAL are sent in the additional section with their A records
+ZONE = {
+    "example.test": [("NAPTR", 10, 0, "s", "SIP+D2U", "_sip._udp.example.test"),
+                     ("NAPTR", 20, 0, "s", "SIP+D2T", "_sip._tcp.example.test")],
+    "_sip._udp.example.test": [("SRV", 20, 0, 5080, "b.example.test"), ("SRV", 10, 0, 5070, "a.example.test")],
+    "_sip._tcp.example.test": [("SRV", 10, 0, 5090, "b.example.test")],
+    "_sip._udp.srv.test": [("SRV", 10, 0, 5062, "a.example.test")],
+    "a.example.test": [("A", "127.0.0.2")],
+    "b.example.test": [("A", "127.0.0.3")],
+    "plain.test": [("A", "127.0.0.9")],
+    "short.test": [("A", "127.0.1.1")],
+}
+SHORT_TTL = {"short.test": 5}
+ADDITIONAL = {"a.example.test"}
+
+def encodeName(name):
+    return b"".join(bytes([len(label)]) + label.encode() for label in name.split(".") if label) + b"\0"
+
+def charString(s):
+    return bytes([len(s)]) + s.encode()
+
+def record(name, rr, asked, ttl):
+    kind = rr[0]
+    if kind == "NAPTR":
+        _, order, preference, flags, service, replacement = rr
+        rtype = TYPE_NAPTR
+        rdata = struct.pack("!HH", order, preference) + charString(flags) + charString(service) + charString("") + encodeName(replacement)
+    elif kind == "SRV":
+        _, priority, weight, port, target = rr
+        rtype = TYPE_SRV
+        rdata = struct.pack("!HHH", priority, weight, port + 100 * (asked - 1)) + encodeName(target)
+    else:
+        addr = bytearray(socket.inet_aton(rr[1]))
+        addr[3] += asked - 1
+        rtype = TYPE_A
+        rdata = bytes(addr)
+    return encodeName(name) + struct.pack("!HHIH", rtype, 1, ttl, len(rdata)) + rdata
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--port", type=int, default=5353)
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", args.port))
+    asked = Counter()
+    while True:
+        msg, client = sock.recvfrom(512)
+        if len(msg) < 12:
+            continue
+        qid, flags, qdCount = struct.unpack("!HHH", msg[:6])
+        if flags & 0x8000 or qdCount != 1:
+            continue
+
+        # Question
+        labels, off = [], 12
+        while off < len(msg) and msg[off]:
+            labels.append(msg[off+1:off+1+msg[off]].decode())
+            off += 1 + msg[off]
+        qtype, = struct.unpack("!H", msg[off+1:off+3])
+        question = msg[12:off+5]
+        name = ".".join(labels).lower()
+
+        # Answers of the type asked for
+        answers = [rr for rr in ZONE.get(name, []) if rr[0] == {TYPE_A: "A", TYPE_SRV: "SRV", TYPE_NAPTR: "NAPTR"}.get(qtype)]
+        if answers:
+            asked[name, qtype] += 1
+        ttl = SHORT_TTL.get(name, TTL)
+        body = b"".join(record(name, rr, asked[name, qtype], ttl) for rr in answers)
+        extra = [rr[4] for rr in answers if rr[0] == "SRV" and rr[4] in ADDITIONAL]
+        body += b"".join(record(target, ZONE[target][0], 1, TTL) for target in extra)
+        rcode = 0 if name in ZONE or any(n.endswith("." + name) for n in ZONE) else 3
+        header = struct.pack("!HHHHHH", qid, 0x8180 | rcode, 1, len(answers), 0, len(extra))
+        sock.sendto(header + question + body, client)
+
+if __name__ == "__main__":
+    main()
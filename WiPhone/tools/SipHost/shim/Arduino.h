@@ -0,0 +1,210 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef SIP_HOST_ARDUINO_H
+#define SIP_HOST_ARDUINO_H
+
+/* Description:
+ *     minimal Arduino/ESP32 environment for building the SIP parser on a Linux host (see ../README.txt).
+ *     Only what tinySIP.cpp and the headers it pulls in need to compile. Nothing here talks to a network:
+ *     TCP sockets never connect, and file systems are empty unless a driver gives SPIFFS a directory (see FS.h).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+#include <memory>
+#include <algorithm>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define F(s)              (s)
+#define pgm_read_byte(p)  (*(const uint8_t*)(p))
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+// Logging: silent unless built with -DSIP_HOST_VERBOSE (printing dominates the timing otherwise)
+#ifdef SIP_HOST_VERBOSE
+#define SIP_HOST_LOG(l, fmt, ...)   fprintf(stderr, "[" l "] " fmt "\n", ##__VA_ARGS__)
+#else
+#define SIP_HOST_LOG(l, fmt, ...)   do { if (0) fprintf(stderr, fmt, ##__VA_ARGS__); } while(0)
+#endif
+#define ESP_LOG_NONE      0
+#define ESP_LOG_ERROR     1
+#define ESP_LOG_WARN      2
+#define ESP_LOG_INFO      3
+#define ESP_LOG_DEBUG     4
+#define ESP_LOG_VERBOSE   5
+#ifdef SIP_HOST_VERBOSE
+#define ARDUHAL_LOG_LEVEL ESP_LOG_VERBOSE
+#else
+#define ARDUHAL_LOG_LEVEL ESP_LOG_NONE
+#endif
+#define LOG_LOCAL_LEVEL   ARDUHAL_LOG_LEVEL
+#define log_e(fmt, ...)   SIP_HOST_LOG("E", fmt, ##__VA_ARGS__)
+#define log_w(fmt, ...)   SIP_HOST_LOG("W", fmt, ##__VA_ARGS__)
+#define log_i(fmt, ...)   SIP_HOST_LOG("I", fmt, ##__VA_ARGS__)
+#define log_d(fmt, ...)   SIP_HOST_LOG("D", fmt, ##__VA_ARGS__)
+#define log_v(fmt, ...)   SIP_HOST_LOG("V", fmt, ##__VA_ARGS__)
+#define DEBUG(fmt, ...)   SIP_HOST_LOG("D", fmt, ##__VA_ARGS__)
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void yield();
+long random(long max);
+long random(long min, long max);
+
+// FreeRTOS
+typedef void* SemaphoreHandle_t;
+typedef void* TaskHandle_t;
+typedef int BaseType_t;
+#define portMAX_DELAY     0xffffffff
+#define pdTRUE            1
+#define pdFALSE           0
+#define taskYIELD()       yield()
+#define xSemaphoreCreateMutex()         ((SemaphoreHandle_t) 1)
+#define xSemaphoreTake(s, t)            pdTRUE
+#define xSemaphoreGive(s)               pdTRUE
+
+// Heap
+#define MALLOC_CAP_8BIT     (1<<2)
+#define MALLOC_CAP_32BIT    (1<<1)
+#define MALLOC_CAP_SPIRAM   (1<<10)
+#define MALLOC_CAP_INTERNAL (1<<11)
+static inline void* heap_caps_malloc(size_t size, uint32_t) {
+  return malloc(size);
+}
+static inline void* heap_caps_calloc(size_t n, size_t size, uint32_t) {
+  return calloc(n, size);
+}
+static inline void* heap_caps_realloc(void* p, size_t size, uint32_t) {
+  return realloc(p, size);
+}
+static inline size_t heap_caps_get_free_size(uint32_t) {
+  return 0;
+}
+
+class String : public std::string {
+public:
+  String() {}
+  String(const char* s) : std::string(s ? s : "") {}
+  String(const std::string& s) : std::string(s) {}
+  String(int x) : std::string(std::to_string(x)) {}
+  String(unsigned int x) : std::string(std::to_string(x)) {}
+  String(long x) : std::string(std::to_string(x)) {}
+  String(unsigned long x) : std::string(std::to_string(x)) {}
+
+  int indexOf(char c) const {
+    size_t p = find(c);
+    return p==npos ? -1 : (int) p;
+  }
+  String substring(size_t from, size_t to = npos) const {
+    return String(substr(from, to==npos ? npos : to - from));
+  }
+  long toInt() const {
+    return atol(c_str());
+  }
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) {
+    return 1;
+  }
+  virtual size_t write(const uint8_t*, size_t size) {
+    return size;
+  }
+  size_t print(const char* s) {
+    return write((const uint8_t*) s, strlen(s));
+  }
+  size_t printf(const char* fmt, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return write((const uint8_t*) buf, n < (int) sizeof(buf) ? n : sizeof(buf) - 1);
+  }
+};
+
+class IPAddress {
+public:
+  IPAddress() : addr(0) {}
+  IPAddress(uint32_t a) : addr(a) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    bytes[0] = a;
+    bytes[1] = b;
+    bytes[2] = c;
+    bytes[3] = d;
+  }
+  operator uint32_t() const {
+    return addr;
+  }
+  bool operator==(const IPAddress& other) const {
+    return addr==other.addr;
+  }
+  bool operator!=(const IPAddress& other) const {
+    return addr!=other.addr;
+  }
+  uint8_t operator[](int i) const {
+    return bytes[i];
+  }
+  uint8_t& operator[](int i) {
+    return bytes[i];
+  }
+  bool fromString(const char* s) {
+    unsigned a, b, c, d;
+    char tail;
+    if (s==NULL || sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &tail)!=4 || a>255 || b>255 || c>255 || d>255) {
+      return false;
+    }
+    *this = IPAddress(a, b, c, d);
+    return true;
+  }
+  String toString() const {
+    char s[16];
+    snprintf(s, sizeof(s), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+    return String(s);
+  }
+
+protected:
+  union {
+    uint32_t addr;
+    uint8_t bytes[4];
+  };
+};
+
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long) {}
+  int available() {
+    return 0;
+  }
+  int read() {
+    return -1;
+  }
+};
+extern HardwareSerial Serial;
+
+#endif // SIP_HOST_ARDUINO_H
@@ -0,0 +1,207 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef SIP_HOST_FS_H
+#define SIP_HOST_FS_H
+
+/* Description:
+ *     the ESP32 file system API over a directory of the host: SPIFFS.setRoot("dir") makes "/name" the file "dir/name".
+ *     Without a root every open() fails, as on a phone with no file system.
+ *
+ *     For checking what survives a power loss: powerCutAfter(n) lets n more changes reach the "flash" (a write, a rename,
+ *     a removal or creating a file count as one each), then every change fails; the write at the cut is torn (only half
+ *     of it is written). powerRestore() ends the cut. changes() counts the changes made so far.
+ */
+
+#include "Arduino.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+
+#define FILE_READ       "r"
+#define FILE_WRITE      "w"
+#define FILE_APPEND     "a"
+
+namespace fs {
+
+enum SeekMode {
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+class FS;
+
+class File {
+public:
+  File() {}
+  File(FILE* f, FS* fs) : handle(f != NULL ? std::make_shared<Handle>(f) : NULL), fs(fs) {}
+
+  operator bool() const {
+    return handle != NULL && handle->f != NULL;
+  }
+  size_t write(const uint8_t* buf, size_t size);
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+  int read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+  size_t read(uint8_t* buf, size_t size) {
+    return *this ? fread(buf, 1, size, handle->f) : 0;
+  }
+  size_t readBytes(char* buf, size_t size) {
+    return read((uint8_t*) buf, size);
+  }
+  int available() {
+    return *this ? size() - position() : 0;
+  }
+  bool seek(uint32_t pos, SeekMode mode = SeekSet) {
+    return *this && fseek(handle->f, pos, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END) == 0;
+  }
+  size_t position() const {
+    return *this ? ftell(handle->f) : 0;
+  }
+  size_t size() const {
+    if (!*this) {
+      return 0;
+    }
+    long pos = ftell(handle->f);
+    fseek(handle->f, 0, SEEK_END);
+    long end = ftell(handle->f);
+    fseek(handle->f, pos, SEEK_SET);
+    return end;
+  }
+  void flush() {
+    if (*this) {
+      fflush(handle->f);
+    }
+  }
+  void close() {
+    if (handle != NULL) {
+      handle->close();
+    }
+  }
+
+protected:
+  struct Handle {
+    FILE* f;
+    Handle(FILE* f) : f(f) {}
+    ~Handle() {
+      close();
+    }
+    void close() {
+      if (f != NULL) {
+        fclose(f);
+        f = NULL;
+      }
+    }
+  };
+  std::shared_ptr<Handle> handle;       // shared by the copies, like the ESP32 core's FileImplPtr
+  FS* fs = NULL;
+};
+
+class FS {
+public:
+  void setRoot(const char* dir) {
+    root = dir != NULL ? dir : "";
+  }
+  File open(const char* path, const char* mode = FILE_READ) {
+    if (root.empty() || path == NULL) {
+      return File();
+    }
+    bool changing = mode[0] == 'w' || (mode[0] == 'a' && !exists(path));     // truncating or creating the file
+    if (changing && !change()) {
+      return File();
+    }
+    return File(fopen(hostPath(path).c_str(), mode), this);
+  }
+  bool exists(const char* path) {
+    return !root.empty() && access(hostPath(path).c_str(), F_OK) == 0;
+  }
+  bool remove(const char* path) {
+    return exists(path) && change() && ::remove(hostPath(path).c_str()) == 0;
+  }
+  bool rename(const char* from, const char* to) {
+    return exists(from) && change() && ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+  }
+
+  // Power loss
+  void powerCutAfter(long n) {
+    cut = true;
+    changesLeft = n;
+  }
+  void powerRestore() {
+    cut = false;
+  }
+  bool powerCut() {
+    return cut && changesLeft <= 0;
+  }
+  unsigned long changes() {
+    return changeCount;
+  }
+
+  /* Description:
+   *     count a change; false if the power is cut (then `torn` tells whether this is the change at the cut)
+   */
+  bool change(bool* torn = NULL) {
+    if (torn != NULL) {
+      *torn = false;
+    }
+    if (cut && changesLeft-- <= 0) {
+      if (torn != NULL) {
+        *torn = changesLeft == -1;
+      }
+      return false;
+    }
+    changeCount++;
+    return true;
+  }
+
+protected:
+  std::string root;
+  bool cut = false;
+  long changesLeft = 0;
+  unsigned long changeCount = 0;
+
+  std::string hostPath(const char* path) {
+    return root + (path[0] == '/' ? "" : "/") + path;
+  }
+};
+
+inline size_t File::write(const uint8_t* buf, size_t size) {
+  if (!*this || size == 0) {
+    return 0;
+  }
+  bool torn;
+  if (fs != NULL && !fs->change(&torn)) {
+    size_t written = torn ? fwrite(buf, 1, size / 2, handle->f) : 0;
+    fflush(handle->f);
+    return written;
+  }
+  return fwrite(buf, 1, size, handle->f);
+}
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+
+#endif // SIP_HOST_FS_H
@@ -0,0 +1,85 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef SIP_HOST_PREFERENCES_H
+#define SIP_HOST_PREFERENCES_H
+
+#include "Arduino.h"
+#include <map>
+#include <string>
+
+// NVS kept in the process memory: it outlives any Preferences object, like the flash outlives a reboot
+class Preferences {
+public:
+  bool begin(const char* name, bool = false) {
+    page = name;
+    return true;
+  }
+  void end() {}
+
+  size_t putBytes(const char* key, const void* value, size_t len) {
+    nvsData()[page + "/" + key].assign((const char*) value, len);
+    return len;
+  }
+  size_t getBytes(const char* key, void* buf, size_t maxLen) {
+    auto it = nvsData().find(page + "/" + key);
+    if (it == nvsData().end() || it->second.size() > maxLen) {
+      return 0;
+    }
+    memcpy(buf, it->second.data(), it->second.size());
+    return it->second.size();
+  }
+  size_t putString(const char* key, const char* value) {
+    return putBytes(key, value, strlen(value) + 1) - 1;
+  }
+  size_t getString(const char* key, char* buf, size_t maxLen) {
+    auto it = nvsData().find(page + "/" + key);
+    if (it == nvsData().end() || it->second.size() > maxLen) {
+      return 0;
+    }
+    memcpy(buf, it->second.data(), it->second.size());
+    return it->second.size();           // with the NUL, as the ESP32 core returns it
+  }
+  String getString(const char* key, const String defaultValue = String()) {
+    auto it = nvsData().find(page + "/" + key);
+    return it == nvsData().end() ? defaultValue : String(it->second.c_str());
+  }
+  size_t putInt(const char* key, int32_t value) {
+    return putBytes(key, &value, sizeof(value));
+  }
+  int32_t getInt(const char* key, int32_t defaultValue = 0) {
+    int32_t value;
+    return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+  }
+  size_t putUShort(const char* key, uint16_t value) {
+    return putBytes(key, &value, sizeof(value));
+  }
+  uint16_t getUShort(const char* key, uint16_t defaultValue = 0) {
+    uint16_t value;
+    return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+  }
+  bool remove(const char* key) {
+    return nvsData().erase(page + "/" + key) > 0;
+  }
+
+protected:
+  std::string page;
+
+  static std::map<std::string, std::string>& nvsData() {
+    static std::map<std::string, std::string> nvs;
+    return nvs;
+  }
+};
+
+#endif // SIP_HOST_PREFERENCES_H
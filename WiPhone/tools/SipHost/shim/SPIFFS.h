@@ -0,0 +1,30 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef SIP_HOST_SPIFFS_H
+#define SIP_HOST_SPIFFS_H
+
+#include "FS.h"
+
+class SPIFFSFS : public fs::FS {
+public:
+  bool begin(bool = false) {
+    return !root.empty();
+  }
+  void end() {}
+};
+
+extern SPIFFSFS SPIFFS;      // stubs.cpp; no root (no file system) unless a driver sets one
+
+#endif // SIP_HOST_SPIFFS_H
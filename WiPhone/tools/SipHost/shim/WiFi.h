@@ -0,0 +1,201 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef SIP_HOST_WIFI_H
+#define SIP_HOST_WIFI_H
+
+// TCP sockets never connect: the parser harness feeds messages straight into TinySIP.
+// UDP sockets are real (non-blocking, like lwIP ones under the ESP32 WiFiUDP), so that UDP_SIPConnection works unchanged
+// over the loopback interface (see sip_sim.cpp).
+
+#include <unistd.h>
+#include <fcntl.h>
+#include "Arduino.h"
+#include "lwip/sockets.h"
+
+class WiFiClient : public Print {
+public:
+  virtual ~WiFiClient() {}
+  int connect(IPAddress, uint16_t, int32_t = 0) {
+    return 0;
+  }
+  uint8_t connected() {
+    return 0;
+  }
+  IPAddress remoteIP() {
+    return IPAddress();
+  }
+  uint16_t remotePort() {
+    return 0;
+  }
+  uint16_t localPort() {
+    return 0;
+  }
+  void stop() {}
+  int available() {
+    return 0;
+  }
+  int read(uint8_t*, size_t) {
+    return -1;
+  }
+  size_t write(const uint8_t*, size_t size) {
+    return size;
+  }
+  void flush() {}
+  int fd() const {
+    return -1;
+  }
+};
+
+/* Description:
+ *     the same behaviour as the ESP32 core class: one datagram is composed between beginPacket() and endPacket()
+ *     (a full 1460-byte buffer is sent right away), parsePacket() takes the next datagram and drops what was left unread
+ *     of the previous one.
+ */
+class WiFiUDP : public Print {
+public:
+  static const size_t BUFFER_SIZE = 1460;
+
+  WiFiUDP() : udpFd(-1), txLen(0), rxLen(0), rxPos(0) {}
+  virtual ~WiFiUDP() {
+    stop();
+  }
+  uint8_t begin(uint16_t port) {
+    stop();
+    udpFd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udpFd < 0) {
+      return 0;
+    }
+    int one = 1;
+    setsockopt(udpFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(udpFd, (struct sockaddr*) &local, sizeof(local)) < 0) {
+      stop();
+      return 0;
+    }
+    fcntl(udpFd, F_SETFL, O_NONBLOCK);
+    return 1;
+  }
+  void stop() {
+    if (udpFd >= 0) {
+      close(udpFd);
+      udpFd = -1;
+    }
+    txLen = rxLen = rxPos = 0;
+  }
+  int beginPacket(IPAddress ip, uint16_t port) {
+    if (udpFd < 0 && !begin(0)) {
+      return 0;
+    }
+    memset(&txAddr, 0, sizeof(txAddr));
+    txAddr.sin_family = AF_INET;
+    txAddr.sin_port = htons(port);
+    txAddr.sin_addr.s_addr = (uint32_t) ip;
+    txLen = 0;
+    return 1;
+  }
+  int endPacket() {
+    if (udpFd < 0) {
+      return 0;
+    }
+    int sent = sendto(udpFd, txBuff, txLen, 0, (struct sockaddr*) &txAddr, sizeof(txAddr));
+    txLen = 0;
+    return sent < 0 ? 0 : 1;
+  }
+  size_t write(uint8_t c) {
+    return write(&c, 1);
+  }
+  size_t write(const uint8_t* buf, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      if (txLen == BUFFER_SIZE) {
+        endPacket();
+      }
+      txBuff[txLen++] = buf[i];
+    }
+    return size;
+  }
+  int parsePacket() {
+    if (udpFd < 0) {
+      return 0;
+    }
+    socklen_t len = sizeof(rxAddr);
+    int got = recvfrom(udpFd, rxBuff, sizeof(rxBuff), MSG_DONTWAIT, (struct sockaddr*) &rxAddr, &len);
+    if (got <= 0) {
+      return 0;
+    }
+    rxLen = got;
+    rxPos = 0;
+    return got;
+  }
+  int available() {
+    return rxLen - rxPos;
+  }
+  int read(uint8_t* buf, size_t size) {
+    size_t n = rxLen - rxPos < size ? rxLen - rxPos : size;
+    if (n == 0) {
+      return -1;
+    }
+    memcpy(buf, rxBuff + rxPos, n);
+    rxPos += n;
+    return n;
+  }
+  int read(char* buf, size_t size) {
+    return read((uint8_t*) buf, size);
+  }
+  void flush() {
+    rxLen = rxPos = 0;
+  }
+  IPAddress remoteIP() {
+    return IPAddress((uint32_t) rxAddr.sin_addr.s_addr);
+  }
+  uint16_t remotePort() {
+    return ntohs(rxAddr.sin_port);
+  }
+
+protected:
+  int udpFd;
+  struct sockaddr_in txAddr;
+  struct sockaddr_in rxAddr = {};
+  uint8_t txBuff[BUFFER_SIZE];
+  uint8_t rxBuff[BUFFER_SIZE];
+  size_t txLen;
+  size_t rxLen;
+  size_t rxPos;
+};
+
+class WiFiClass {
+public:
+  IPAddress localIP() {
+    return local;
+  }
+  void setLocalIP(IPAddress ip) {           // host only: sip_sim puts the phones on the loopback interface
+    local = ip;
+  }
+  IPAddress dnsIP(uint8_t = 0) {
+    return IPAddress();
+  }
+  bool hostByName(const char* host, IPAddress& ip) {
+    return ip.fromString(host);
+  }
+
+protected:
+  IPAddress local = IPAddress(192, 168, 1, 2);
+};
+extern WiFiClass WiFi;
+
+#endif // SIP_HOST_WIFI_H
@@ -0,0 +1,41 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+#ifndef SIP_HOST_MD5_HASH_H
+#define SIP_HOST_MD5_HASH_H
+
+// Same interface as the MD5 in ESP32 ROM; implemented in ../stubs.cpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct MD5Context {
+  uint32_t buf[4];
+  uint32_t bits[2];
+  uint8_t in[64];
+};
+
+void MD5Init(struct MD5Context* context);
+void MD5Update(struct MD5Context* context, unsigned char const* buf, unsigned len);
+void MD5Final(unsigned char digest[16], struct MD5Context* context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIP_HOST_MD5_HASH_H
@@ -0,0 +1,750 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+/*
+ * Host harness for the TinySIP parser (see README.txt):
+ *   - replays a corpus of SIP messages and reports messages/second and heap allocations/message;
+ *   - with -a only checks that the replay allocates nothing (once warmed up);
+ *   - with -d prints what got parsed out of each message, for diffing against corpus/expected.txt;
+ *   - with -r tells which of the accounts sharing a connection each message belongs to (SipPool routing);
+ *   - with -w reads the corpus as one TCP stream shared by the accounts, cut into segments, each read by any of them;
+ *   - with -s queries a STUN server (stun_standin.py) the way TinySIP learns its public addresses;
+ *   - with -x locates SIP servers through a DNS server (dns_standin.py): NAPTR, SRV, A, TTL and failover;
+ *   - with -t connects to a TLS server (tls_standin.py) repeatedly, to see the sessions resumed;
+ *   - with -p applies the NOTIFYs to a presence table of a few contacts, for diffing against corpus/presence.txt;
+ *   - with -g checks when registrations are refreshed, for lifetimes from a second to a day;
+ *   - built with -DSIP_HOST_FUZZ it becomes a libFuzzer target instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "tinySIP.h"
+#include "Stun.h"
+#include "TlsConnection.h"
+#include "Presence.h"
+#include "resolver.h"
+
+// Heap allocation counter: wraps glibc allocator (sanitizers bring their own, so not when fuzzing)
+
+static uint64_t heapAllocs = 0;
+
+#ifndef SIP_HOST_FUZZ
+extern "C" {
+  extern void* __libc_malloc(size_t size);
+  extern void* __libc_calloc(size_t n, size_t size);
+  extern void* __libc_realloc(void* p, size_t size);
+
+  void* malloc(size_t size) {
+    heapAllocs++;
+    return __libc_malloc(size);
+  }
+  void* calloc(size_t n, size_t size) {
+    heapAllocs++;
+    return __libc_calloc(n, size);
+  }
+  void* realloc(void* p, size_t size) {
+    heapAllocs++;
+    return __libc_realloc(p, size);
+  }
+}
+#endif // SIP_HOST_FUZZ
+
+/* Description:
+ *     TinySIP with a way to feed it a message directly, the same way checkCall() does after reading a socket.
+ */
+class HostSip : public TinySIP {
+public:
+  int feed(const uint8_t* data, size_t len) {
+    if (len > MAX_MESSAGE_SIZE) {
+      len = MAX_MESSAGE_SIZE;
+    }
+    memcpy(buff, data, len);
+    buff[len] = '\0';
+    buffLength = len;
+    buffStart = buff;
+    resetBufferParsing();
+
+    isResponse = strncmp(buffStart, "SIP/", 4) ? false : true;
+    int err = isResponse ? parseResponse() : parseRequest();
+
+#ifdef SIP_HOST_FUZZ
+    // Exercise the addr-spec grammar on what would be used as the remote target (not counted in the benchmark)
+    if (err==TINY_SIP_OK && respContAddrSpec!=NULL) {
+      AddrSpec addr(respContAddrSpec);
+      addr.host();
+      addr.port();
+    }
+#endif // SIP_HOST_FUZZ
+    return err;
+  }
+
+  void dump(const char* name, int err) {
+    printf("%s: err=%d %s=%s cseq=%d/%s call-id=%s\n", name, err,
+           isResponse ? "code" : "method", isResponse ? (respReason ? String(respCode).c_str() : "-") : nul(respMethod),
+           respCSeq, nul(respCSeqMethod), nul(respCallId));
+    printf("  from=%s tag=%s\n", nul(respFromAddrSpec), nul(respFromTag));
+    printf("  to=%s tag=%s\n", nul(respToAddrSpec), nul(respToTag));
+    printf("  contact=%s routes=%d", nul(respContAddrSpec), (int) respRouteSet.size());
+    for (size_t i=0; i<respRouteSet.size(); i++) {
+      printf(" %s", respRouteSet[i]);
+    }
+    printf("\n");
+    if (respExpires>=0 || respContExpires>=0 || respFlowTimer>0) {
+      printf("  expires=%d contact-expires=%d flow-timer=%u\n", respExpires, respContExpires, respFlowTimer);
+    }
+    if (isResponse && respCode/100==2 && respCSeqMethod!=NULL && !strcmp(respCSeqMethod, "REGISTER")) {
+      scheduleRegisterRefresh();
+      printf("  registered=%u s\n", registerExpiresS);
+    }
+    if (digestNonce!=NULL) {
+      printf("  challenge realm=%s nonce=%s qop=%s stale=%s\n", nul(digestRealm), nul(digestNonce), nul(digestQopOpt), nul(digestStale));
+    }
+    if (respContentLength > 0) {
+      printf("  body=%d %s audio=%s:%d format=%d sdp=%d dir=%d\n", respContentLength, nul(respContentType),
+             nul(getRemoteAudioAddr()), remoteAudioPort, audioFormat, (int) respSdp, sdpRemoteDir);
+    }
+  }
+
+  // Presence documents of the parsed NOTIFY, applied as notifyRequest() does
+  PresenceTable::Result_t applyPresence() {
+    return presence.applyNotify(respContentType, respBody, respBody!=NULL ? respContentLength : 0);
+  }
+
+  const ParseArena& arena() {
+    return msgArena;
+  }
+
+  // Account identity as init() and registration would set it, without connecting anywhere
+  void account(const char* uri, uint32_t contactUser) {
+    freeNull((void **) &localUriDyn);
+    localUriDyn = strdup(uri);
+    phoneNumber = contactUser;
+  }
+
+  // The device (MAC address in hex) and the Contact of its last REGISTER (user@host:port), as requestRegister() keeps it
+  void device(const char* mac, const char* contact) {
+    snprintf(macHex, sizeof(macHex), "%s", mac);
+    snprintf(regContact, sizeof(regContact), "%s", contact);
+  }
+
+  // The complete messages in the buffer (handed over by the pool), as checkCall() would take them one by one
+  void takeMessages(std::vector<std::string>& taken) {
+    while (buffStart < buff + buffLength) {
+      size_t len = SipPool::messageLength(buffStart, buff + buffLength);
+      if (len == 0) {
+        break;
+      }
+      taken.push_back(std::string(buffStart, len));
+      buffStart += len;
+    }
+  }
+
+  // When a registration granted for `seconds` is refreshed, in ms
+  uint32_t refreshAfter(int32_t seconds) {
+    respContExpires = seconds;
+    respExpires = -1;
+    scheduleRegisterRefresh();
+    return msRegisterRefresh;
+  }
+
+protected:
+  static const char* nul(const char* s) {
+    return s ? s : "-";
+  }
+};
+
+#ifdef SIP_HOST_FUZZ
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  static HostSip* sip = new HostSip();
+  sip->feed(data, size);
+  return 0;
+}
+
+#else
+
+struct Message {
+  const char* name;
+  uint8_t* data;
+  size_t len;
+};
+
+static bool readFile(const char* path, Message& msg) {
+  FILE* f = fopen(path, "rb");
+  if (f==NULL) {
+    perror(path);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  msg.name = path;
+  msg.data = (uint8_t*) malloc(len > 0 ? len + 1 : 1);
+  msg.len = fread(msg.data, 1, len, f);
+  msg.data[msg.len] = '\0';        // routing (-r) looks at the message as a C-string, like checkCall() does
+  fclose(f);
+  return true;
+}
+
+/* Description:
+ *     STUN client against a server given as "ip:port": the RFC 5769 sample response first, then the mappings
+ *     of an open socket (as the SIP flow) and of unbound ports (as RTP), printed relative to the local port.
+ *     The flow socket is read the way checkCall() reads it: STUN goes to the client, everything else is kept.
+ */
+static int stunCheck(const char* server) {
+  // RFC 5769, 2.2: sample IPv4 response (SOFTWARE, XOR-MAPPED-ADDRESS, MESSAGE-INTEGRITY, FINGERPRINT)
+  static const uint8_t sample[] = {
+    0x01, 0x01, 0x00, 0x3c, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01, 0xbc, 0x34, 0xd6, 0x86, 0xfa, 0x87, 0xdf, 0xae,
+    0x80, 0x22, 0x00, 0x0b, 0x74, 0x65, 0x73, 0x74, 0x20, 0x76, 0x65, 0x63, 0x74, 0x6f, 0x72, 0x20,
+    0x00, 0x20, 0x00, 0x08, 0x00, 0x01, 0xa1, 0x47, 0xe1, 0x12, 0xa6, 0x43,
+    0x00, 0x08, 0x00, 0x14, 0x2b, 0x91, 0xf5, 0x99, 0xfd, 0x9e, 0x90, 0xc3, 0x8c, 0x74, 0x89, 0xf9, 0x2a, 0xf9, 0xba, 0x53,
+    0xf0, 0x6b, 0xe7, 0xd7,
+    0x80, 0x28, 0x00, 0x04, 0xc0, 0x7d, 0x4c, 0x96
+  };
+  IPAddress addr;
+  uint16_t port = 0;
+  bool ok = StunClient::parseResponse(sample, sizeof(sample), sample + 8, addr, port);
+  printf("rfc5769: %s %s:%d\n", ok ? "ok" : "failed", addr.toString().c_str(), port);
+
+  stun.setServer(server);
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int peer = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(local);
+  if (fd < 0 || peer < 0 || bind(fd, (struct sockaddr*) &local, sizeof(local)) || getsockname(fd, (struct sockaddr*) &local, &len)) {
+    perror("socket");
+    return 1;
+  }
+  uint16_t localPort = ntohs(local.sin_port);
+
+  // The query goes out, a SIP message comes in before the response
+  ok = stun.mapSocket(fd, localPort, addr, port);
+  static const char sip[] = "OPTIONS sip:host SIP/2.0\r\n\r\n";
+  sendto(peer, sip, strlen(sip), 0, (struct sockaddr*) &local, sizeof(local));
+  int kept = 0;
+  uint8_t msg[StunClient::MAX_MESSAGE_SIZE];
+  for (uint32_t msStart = millis(); !ok && stun.pending(localPort) && millis() - msStart < 5000; usleep(5000)) {
+    stun.poll(millis());
+    int got;
+    while ((got = recv(fd, msg, sizeof(msg), MSG_DONTWAIT)) > 0) {
+      if (StunClient::isStun(msg, got)) {
+        stun.received(localPort, msg, got);
+      } else {
+        kept += got == (int) strlen(sip) && !memcmp(msg, sip, got);
+      }
+    }
+    ok = stun.mapSocket(fd, localPort, addr, port);
+  }
+  printf("flow: %s %s local%+d, sip %s\n", ok ? "ok" : "failed", addr.toString().c_str(), (int) port - localPort,
+         kept == 1 ? "kept" : "lost");
+  close(fd);
+  close(peer);
+
+  // Ports of the next calls: asked about beforehand, the second 50000 comes from the cache, 50004 is never asked
+  const uint16_t rtpPorts[] = { 50000, 50000, 50002, 50004 };
+  for (size_t i=0; i<sizeof(rtpPorts)/sizeof(rtpPorts[0]); i++) {
+    if (rtpPorts[i] != 50004) {
+      stun.requestPort(rtpPorts[i]);
+    }
+    for (uint32_t msStart = millis(); stun.pending(rtpPorts[i]) && millis() - msStart < 5000; usleep(5000)) {
+      stun.poll(millis());
+    }
+    port = 0;
+    ok = stun.mapPort(rtpPorts[i], addr, port);
+    printf("rtp %d: %s %s:%d\n", rtpPorts[i], ok ? "ok" : "failed", addr.toString().c_str(), port);
+  }
+  return 0;
+}
+
+extern unsigned long hostClockWarpUs;
+
+static void printResolved(SipResolver& resolver, const char* what, const char* host, SipResolver::Transport_t transport) {
+  IPAddress ip;
+  uint16_t port = 0;
+  if (resolver.resolve(host, 0, transport, ip, port)) {
+    printf("%s: %s:%d\n", what, ip.toString().c_str(), port);
+  } else {
+    printf("%s: not resolved\n", what);
+  }
+}
+
+/* Description:
+ *     SipResolver against a DNS server given as "ip:port" (see dns_standin.py): NAPTR -> SRV -> A, SRV without NAPTR,
+ *     A only, failover between the SRV targets, answers cached until their TTL passes (the clock is moved forward),
+ *     TTL below the minimum, expired records used when the DNS server doesn't answer.
+ */
+static int dnsCheck(const char* server) {
+  char host[32];
+  unsigned int port = 0;
+  IPAddress ip;
+  if (sscanf(server, "%31[0-9.]:%u", host, &port) != 2 || !ip.fromString(host)) {
+    fprintf(stderr, "bad server: %s\n", server);
+    return 2;
+  }
+  SipResolver resolver;
+  resolver.setServer(ip, port);
+
+  printResolved(resolver, "example.test udp", "example.test", SipResolver::UDP);
+  uint16_t targetPort = 0;
+  for (int k=0; k<2; k++) {
+    bool more = resolver.failover("example.test", SipResolver::UDP, ip, targetPort);
+    printf("failover: %s %s:%d\n", more ? "next" : "first again", ip.toString().c_str(), targetPort);
+  }
+  printResolved(resolver, "example.test tcp", "example.test", SipResolver::TCP);
+  printResolved(resolver, "srv.test udp", "srv.test", SipResolver::UDP);
+  printResolved(resolver, "plain.test udp", "plain.test", SipResolver::UDP);
+  printResolved(resolver, "short.test udp", "short.test", SipResolver::UDP);
+  printResolved(resolver, "missing.test udp", "missing.test", SipResolver::UDP);
+
+  hostClockWarpUs += 20 * 1000000ul;
+  printResolved(resolver, "after 20 s: example.test udp", "example.test", SipResolver::UDP);
+  printResolved(resolver, "after 20 s: short.test udp", "short.test", SipResolver::UDP);
+  hostClockWarpUs += 11 * 1000000ul;
+  printResolved(resolver, "after 31 s: example.test udp", "example.test", SipResolver::UDP);
+  printResolved(resolver, "after 31 s: short.test udp", "short.test", SipResolver::UDP);
+  hostClockWarpUs += 30 * 1000000ul;
+  printResolved(resolver, "after 61 s: example.test udp", "example.test", SipResolver::UDP);
+
+  ip.fromString(host);
+  resolver.setServer(ip, port + 1);      // nobody answers there
+  hostClockWarpUs += 61 * 1000000ul;
+  printResolved(resolver, "after 122 s, no DNS: example.test udp", "example.test", SipResolver::UDP);
+  return 0;
+}
+
+/* Description:
+ *     TLS_SIPConnection against a server given as "ip:port", trusting the certificates in `caFile`: a few connections
+ *     in a row, each sending OPTIONS, then one more after forgetting the sessions kept in RAM (as after a reboot,
+ *     when they come from NVS: BUILD.sh turns TLS_SESSIONS_IN_NVS on). Then by a name the certificate doesn't match:
+ *     refused, unless verification is turned off, and such a session is not resumed. Prints whether each handshake was full or resumed; the timing goes to stderr.
+ */
+static int tlsCheck(const char* server, const char* caFile) {
+#ifdef SIP_HOST_TLS
+  char host[32];
+  unsigned int port = 0;
+  IPAddress ip;
+  if (sscanf(server, "%31[0-9.]:%u", host, &port) != 2 || !ip.fromString(host)) {
+    fprintf(stderr, "-t needs ip:port\n");
+    return 2;
+  }
+  Message ca;
+  if (caFile==NULL || !readFile(caFile, ca) || !TLS_SIPConnection::setCaChain((const char*) ca.data)) {
+    fprintf(stderr, "-t needs CA certificates (-c file.pem)\n");
+    return 2;
+  }
+
+  static const struct {
+    const char* what;
+    const char* host;
+    bool verify;
+    bool reboot;
+  } steps[] = {
+    { "connect", "localhost", true, false }, { "connect", "localhost", true, false }, { "connect", "localhost", true, false },
+    { "after reboot", "localhost", true, true },
+    { "wrong name", "wrong.test", true, false },
+    { "unverified", "wrong.test", false, false }, { "unverified", "wrong.test", false, false },
+  };
+  const int nSteps = sizeof(steps)/sizeof(steps[0]);
+  for (int k=0; k<nSteps; k++) {
+    if (steps[k].reboot) {
+      tlsSessions.clear();
+    }
+    TLS_SIPConnection conn;
+    conn.setHostname(steps[k].host);
+    conn.setVerify(steps[k].verify);
+    char status[64] = "-";
+    bool ok = conn.connect(ip, port, 2000);
+    if (ok) {
+      char req[400];
+      snprintf(req, sizeof(req), "OPTIONS sip:%s:%u;transport=tls SIP/2.0\r\n"
+               "Via: SIP/2.0/TLS 127.0.0.1:%u;rport;branch=z9hG4bK%d\r\n"
+               "Max-Forwards: 70\r\nFrom: <sip:host@localhost>;tag=%d\r\nTo: <sip:%s:%u>\r\n"
+               "Call-ID: tls-check-%d\r\nCSeq: 1 OPTIONS\r\nContent-Length: 0\r\n\r\n",
+               host, port, conn.localPort(), k, k, host, port, k);
+      conn.write((uint8_t*) req, strlen(req));
+      size_t got = 0;
+      char resp[1024] = "";
+      for (uint32_t msStart = millis(); millis() - msStart < 2000 && !strstr(resp, "\r\n"); ) {
+        if (conn.available() > 0) {
+          int32_t n = conn.read((uint8_t*) resp + got, sizeof(resp) - 1 - got);
+          got += n > 0 ? n : 0;
+          resp[got] = '\0';
+        } else {
+          delay(1);
+        }
+      }
+      char* eol = strstr(resp, "\r\n");
+      if (eol) {
+        *eol = '\0';
+        strncpy(status, resp, sizeof(status)-1);
+      }
+    }
+    printf("%s %d: %s%s, %s\n", steps[k].what, k+1, ok ? (conn.resumed() ? "resumed" : "full") : "failed",
+           ok && !conn.verified() ? " (not verified)" : "", status);
+    fprintf(stderr, "handshake %d: %u ms\n", k+1, conn.handshakeMs());
+    conn.stop();
+  }
+  const TlsSessionCache::Stats& full = tlsSessions.stats(false);
+  const TlsSessionCache::Stats& resumed = tlsSessions.stats(true);
+  fprintf(stderr, "full:    %u, average %u ms, max %u ms\n", full.count, full.count ? full.msTotal / full.count : 0, full.msMax);
+  fprintf(stderr, "resumed: %u, average %u ms, max %u ms\n", resumed.count, resumed.count ? resumed.msTotal / resumed.count : 0, resumed.msMax);
+  return 0;
+#else
+  (void) server;
+  (void) caFile;
+  fprintf(stderr, "built without mbedTLS (see BUILD.sh)\n");
+  return 2;
+#endif // SIP_HOST_TLS
+}
+
+/* Description:
+ *     watch a few contacts of the account sip:alice@example.com, as the phonebook would, apply the NOTIFYs one after
+ *     another and print the statuses after each
+ */
+static int presenceCheck(HostSip* sip, Message* corpus, int n) {
+  static const char* const contacts[] = { "sip:bob@example.com", "sip:Carol@example.com;transport=tcp", "1234",
+                                          "sip:dave@example.com", "sip:erin@example.com" };
+  static const char* const statusNames[] = { "unknown", "offline", "available", "away", "busy" };
+  static const char* const resultNames[] = { "applied", "ignored", "out-of-sequence" };
+  const int nContacts = sizeof(contacts)/sizeof(contacts[0]);
+
+  presence.beginList("sip:alice@example.com:5060");
+  for (int k=0; k<nContacts; k++) {
+    presence.watch(contacts[k]);
+  }
+  presence.watch("sip:bob@example.com");      // duplicate
+  presence.endList();
+  printf("watching %d:", presence.size());
+  for (const char* uri = presence.firstUri(); uri!=NULL; uri = presence.nextUri(uri)) {
+    printf(" %s", uri);
+  }
+  printf("\n");
+
+  for (int j=0; j<n; j++) {
+    int err = sip->feed(corpus[j].data, corpus[j].len);
+    uint32_t revision = presence.revision();
+    PresenceTable::Result_t res = sip->applyPresence();
+    printf("%s: err=%d %s%s\n", corpus[j].name, err, resultNames[res], presence.revision()!=revision ? ", changed" : "");
+    for (int k=0; k<nContacts; k++) {
+      printf("  %s: %s\n", contacts[k], statusNames[presence.status(contacts[k])]);
+    }
+  }
+  return 0;
+}
+
+/* Description:
+ *     registrations granted for a second to a day: the refresh must be sent before the registration lapses, but not
+ *     sooner than REGISTER_MIN_REFRESH_MS (30 s) after the REGISTER unless it would lapse by then, and otherwise at 80-90%.
+ */
+/* Description:
+ *     a TCP connection that delivers what is queued one segment at a time, as a socket does.
+ */
+class StreamConnection : public Connection {
+public:
+  void segment(const uint8_t* data, size_t len) {
+    seg = data;
+    segLen = len;
+  }
+
+  bool isUdp() {
+    return false;
+  }
+  bool isTcp() {
+    return true;
+  }
+  uint8_t connected() {
+    return 1;
+  }
+  IPAddress remoteIP() {
+    return IPAddress(192, 0, 2, 1);
+  }
+  uint16_t remotePort() {
+    return 5060;
+  }
+  uint16_t localPort() {
+    return 51012;
+  }
+  void stop() {}
+  int available() {
+    return segLen;
+  }
+  int32_t read(uint8_t* buffer, uint32_t length) {
+    size_t n = length < segLen ? length : segLen;
+    memcpy(buffer, seg, n);
+    seg += n;
+    segLen -= n;
+    return n;
+  }
+  void write(uint8_t*, uint32_t) {}
+  int connect(IPAddress&, uint16_t, int32_t) {
+    return 1;
+  }
+  int beginPacket(IPAddress, uint16_t) {
+    return 1;
+  }
+  int endPacket() {
+    return 1;
+  }
+  void flush() {}
+  int fd() {
+    return -1;
+  }
+
+protected:
+  const uint8_t* seg = NULL;
+  size_t segLen = 0;
+};
+
+/* Description:
+ *     the corpus, 200 times over, sent as one stream through a connection shared by the accounts, cut into segments
+ *     of 1 to 600 bytes; each segment is read by a random account (SipPool::read()). Every account must end up with
+ *     the messages route() gives it, whole and in order, whichever account read their parts.
+ */
+static int sharedStreamCheck(char* uris, Message* corpus, int n) {
+  SipPool pool;
+  std::vector<HostSip*> accounts;
+  for (char* uri = strtok(uris, ","); uri!=NULL; uri = strtok(NULL, ",")) {
+    HostSip* account = new HostSip();
+    account->account(uri, 10000001 + accounts.size());
+    if (!pool.attach(account)) {
+      fprintf(stderr, "too many accounts\n");
+      return 2;
+    }
+    accounts.push_back(account);
+  }
+  StreamConnection* conn = new StreamConnection();
+  pool.add(conn);
+
+  std::string stream;
+  std::vector<std::vector<std::string>> expected(accounts.size());
+  for (int k=0; k<200; k++) {
+    for (int j=0; j<n; j++) {
+      size_t len = SipPool::messageLength((const char*) corpus[j].data, (const char*) corpus[j].data + corpus[j].len);
+      TinySIP* owner = len > 0 ? pool.route((const char*) corpus[j].data, len) : NULL;
+      for (size_t a=0; a<accounts.size(); a++) {
+        if (accounts[a]==owner) {
+          expected[a].push_back(std::string((const char*) corpus[j].data, len));
+          stream.append((const char*) corpus[j].data, len);
+        }
+      }
+    }
+  }
+
+  srand(7);
+  std::vector<std::vector<std::string>> got(accounts.size());
+  size_t segments = 0;
+  for (size_t off = 0; off < stream.size(); segments++) {
+    size_t len = 1 + rand() % 600;
+    len = len < stream.size() - off ? len : stream.size() - off;
+    conn->segment((const uint8_t*) stream.data() + off, len);
+    off += len;
+    HostSip* reader = accounts[rand() % accounts.size()];
+    int32_t avail = conn->available();
+    pool.read(reader, conn, avail);
+    for (size_t a=0; a<accounts.size(); a++) {
+      accounts[a]->takeMessages(got[a]);
+    }
+  }
+
+  bool ok = true;
+  for (size_t a=0; a<accounts.size(); a++) {
+    printf("%s: %d of %d messages\n", accounts[a]->getLocalUri(), (int) got[a].size(), (int) expected[a].size());
+    ok = ok && got[a] == expected[a];
+  }
+  printf("shared stream: %d bytes in %d segments: %s\n", (int) stream.size(), (int) segments, ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}
+
+static int refreshCheck(HostSip* sip) {
+  static const int32_t grants[] = { 1, 2, 5, 10, 20, 29, 30, 31, 35, 36, 40, 60, 600, 3600, 86400, 200000 };
+  int failures = 0, schedules = 0;
+  for (int32_t granted : grants) {
+    uint32_t msGranted = (granted < 86400 ? granted : 86400) * 1000u;
+    for (int k=0; k<100; k++, schedules++) {
+      uint32_t ms = sip->refreshAfter(granted);
+      bool ok = ms > 0 && ms < msGranted;
+      ok = ok && (ms >= 30000 || ms + 5000 >= msGranted || ms == msGranted / 2);
+      ok = ok && (ms <= 30000 || (ms >= msGranted / 10 * 8 && ms <= msGranted / 10 * 9));
+      if (!ok) {
+        printf("granted %d s: refresh in %u ms\n", granted, ms);
+        failures++;
+      }
+    }
+  }
+  printf("register refresh: %d lifetimes, %d schedules: %s\n", (int) (sizeof(grants)/sizeof(grants[0])), schedules,
+         failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "Usage: %s [-n iterations] [-a] [-d] [-r uri,uri...] [-w uri,uri...] [-s ip:port] [-x ip:port] [-c ca.pem -t ip:port] [-p] [-g] [-u] message.sip ...\n", prog);
+  fprintf(stderr, "  -n N  replay the corpus N times (default 10000)\n");
+  fprintf(stderr, "  -a    fail unless replaying the corpus allocates nothing once warmed up\n");
+  fprintf(stderr, "  -d    print parsed fields of each message instead of benchmarking\n");
+  fprintf(stderr, "  -r    print which account each message is routed to; accounts get Contact users 10000001, 10000002, ...\n");
+  fprintf(stderr, "  -w    read the corpus as one TCP stream shared by the accounts, cut into segments, and check what each gets\n");
+  fprintf(stderr, "  -s    query the STUN server (see stun_standin.py) as TinySIP does, no messages needed\n");
+  fprintf(stderr, "  -x    locate SIP servers through the DNS server (see dns_standin.py), no messages needed\n");
+  fprintf(stderr, "  -t    connect to the TLS server (see tls_standin.py) a few times, trusting the certificates of -c\n");
+  fprintf(stderr, "  -p    apply the NOTIFYs to a presence table of a few contacts and print their statuses\n");
+  fprintf(stderr, "  -g    check when registrations granted for a second to a day are refreshed, no messages needed\n");
+  fprintf(stderr, "  -u    run TinySIP::unitTest() (build with -DSIP_HOST_VERBOSE to see the output)\n");
+}
+
+int main(int argc, char* argv[]) {
+  long iterations = 10000;
+  bool dump = false;
+  bool noAllocs = false;
+  bool unit = false;
+  bool refresh = false;
+  bool presenceDump = false;
+  char* routeUris = NULL;
+  char* streamUris = NULL;
+  const char* caFile = NULL;
+  int i = 1;
+  for (; i<argc && argv[i][0]=='-'; i++) {
+    if (!strcmp(argv[i], "-n") && i+1<argc) {
+      iterations = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "-d")) {
+      dump = true;
+    } else if (!strcmp(argv[i], "-a")) {
+      noAllocs = true;
+    } else if (!strcmp(argv[i], "-r") && i+1<argc) {
+      routeUris = argv[++i];
+    } else if (!strcmp(argv[i], "-w") && i+1<argc) {
+      streamUris = argv[++i];
+    } else if (!strcmp(argv[i], "-s") && i+1<argc) {
+      return stunCheck(argv[++i]);
+    } else if (!strcmp(argv[i], "-x") && i+1<argc) {
+      return dnsCheck(argv[++i]);
+    } else if (!strcmp(argv[i], "-c") && i+1<argc) {
+      caFile = argv[++i];
+    } else if (!strcmp(argv[i], "-t") && i+1<argc) {
+      return tlsCheck(argv[++i], caFile);
+    } else if (!strcmp(argv[i], "-p")) {
+      presenceDump = true;
+    } else if (!strcmp(argv[i], "-u")) {
+      unit = true;
+    } else if (!strcmp(argv[i], "-g")) {
+      refresh = true;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  HostSip* sip = new HostSip();
+
+  if (unit) {
+    sip->unitTest();
+    return 0;
+  }
+  if (refresh) {
+    return refreshCheck(sip);
+  }
+
+  int n = argc - i;
+  if (n <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  Message* corpus = new Message[n];
+  for (int j=0; j<n; j++) {
+    if (!readFile(argv[i+j], corpus[j])) {
+      return 1;
+    }
+  }
+
+  if (routeUris) {
+    SipPool pool;
+    int nAccounts = 0;
+    for (char* uri = strtok(routeUris, ","); uri!=NULL; uri = strtok(NULL, ",")) {
+      HostSip* account = new HostSip();
+      account->account(uri, 10000001 + nAccounts++);
+      if (!pool.attach(account)) {
+        fprintf(stderr, "too many accounts\n");
+        return 2;
+      }
+    }
+    for (int j=0; j<n; j++) {
+      size_t len = SipPool::messageLength((const char*) corpus[j].data, (const char*) corpus[j].data + corpus[j].len);
+      TinySIP* owner = len > 0 ? pool.route((const char*) corpus[j].data, len) : NULL;
+      printf("%s: length=%d/%d account=%s\n", corpus[j].name, (int) len, (int) corpus[j].len, owner ? owner->getLocalUri() : "-");
+    }
+    return 0;
+  }
+
+  if (streamUris) {
+    return sharedStreamCheck(streamUris, corpus, n);
+  }
+
+  if (presenceDump) {
+    return presenceCheck(sip, corpus, n);
+  }
+
+  if (dump) {
+    sip->device("240ac4a1b2c3", "alice@192.168.1.2:51012");    // the phone of the corpus
+    for (int j=0; j<n; j++) {
+      int err = sip->feed(corpus[j].data, corpus[j].len);
+      sip->dump(corpus[j].name, err);
+    }
+    return 0;
+  }
+
+  // Warm up: the arena settles on its block size, lazily allocated members get allocated
+  size_t bytes = 0;
+  for (int j=0; j<n; j++) {
+    sip->feed(corpus[j].data, corpus[j].len);
+    bytes += corpus[j].len;
+  }
+
+  uint64_t failed = 0;
+  uint64_t allocsBefore = heapAllocs;
+  unsigned long start = micros();
+  for (long k=0; k<iterations; k++) {
+    for (int j=0; j<n; j++) {
+      if (sip->feed(corpus[j].data, corpus[j].len)!=TINY_SIP_OK) {
+        failed++;
+      }
+    }
+  }
+  unsigned long elapsedUs = micros() - start;
+  uint64_t allocs = heapAllocs - allocsBefore;
+
+  double messages = (double) iterations * n;
+  if (noAllocs) {
+    printf("replay: %.0f messages, %lu allocations: %s\n", messages, (unsigned long) allocs, allocs ? "FAILED" : "OK");
+    return allocs ? 1 : 0;
+  }
+  double seconds = elapsedUs / 1e6;
+  printf("messages:          %.0f (%d in corpus, %lu bytes)\n", messages, n, (unsigned long) bytes);
+  printf("failed to parse:   %lu\n", (unsigned long) failed);
+  printf("time:              %.3f s\n", seconds);
+  printf("messages/second:   %.0f\n", seconds > 0 ? messages / seconds : 0.0);
+  printf("MB/second:         %.2f\n", seconds > 0 ? bytes * (double) iterations / seconds / 1e6 : 0.0);
+  printf("allocations/msg:   %.2f\n", allocs / messages);
+  printf("arena peak:        %lu bytes\n", (unsigned long) sip->arena().peak());
+  return 0;
+}
+
+#endif // SIP_HOST_FUZZ
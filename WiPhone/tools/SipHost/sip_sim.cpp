@@ -0,0 +1,700 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+/*
+ * Loopback call simulator (see README.txt): two TinySIP phones and a registrar/proxy stand-in in one process,
+ * talking SIP over UDP through real sockets on the loopback interface.
+ *
+ * Each cycle alice registers, calls bob (bob answers), hangs up and sends him a MESSAGE. The proxy can lose, delay
+ * and reorder what it forwards. Reported: transactions/second (wall clock), call setup latency percentiles and heap use.
+ *
+ * Time: when nothing is in flight and the phones only wait for their timers, the clock shared by TinySIP and the proxy
+ * (millis(), micros()) is moved forward instead of sleeping, so delays and retransmission timeouts cost no wall time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <malloc.h>
+#include "tinySIP.h"
+
+extern bool UDP_SIP;
+extern unsigned long hostClockWarpUs;
+
+// Heap allocation counter: wraps glibc allocator
+
+static uint64_t heapAllocs = 0;
+
+extern "C" {
+  extern void* __libc_malloc(size_t size);
+  extern void* __libc_calloc(size_t n, size_t size);
+  extern void* __libc_realloc(void* p, size_t size);
+
+  void* malloc(size_t size) {
+    heapAllocs++;
+    return __libc_malloc(size);
+  }
+  void* calloc(size_t n, size_t size) {
+    heapAllocs++;
+    return __libc_calloc(n, size);
+  }
+  void* realloc(void* p, size_t size) {
+    heapAllocs++;
+    return __libc_realloc(p, size);
+  }
+}
+
+static size_t heapInUse() {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks;
+}
+
+// Repeatable pseudo-random numbers for the impairments (xorshift32), independent of the Random used by TinySIP
+
+static uint32_t simSeed = 1;
+
+static uint32_t simRandom() {
+  simSeed ^= simSeed << 13;
+  simSeed ^= simSeed >> 17;
+  simSeed ^= simSeed << 5;
+  return simSeed;
+}
+
+/* Description:
+ *     registrar and stateless-ish proxy for the two phones. REGISTER is answered with 200 OK and the source address
+ *     of the request is remembered for the user of To and the user of Contact (the phones are reached through their flows,
+ *     RFC 5626). Requests are forwarded by the user part of Request-URI, responses go back to where the request came from
+ *     (by Call-ID and CSeq). INVITE gets Record-Route, and the port of each forwarded Contact is changed to that of the proxy
+ *     (the phones share its address), so that requests within the dialog come through the proxy too.
+ *
+ *     Everything the proxy sends goes through the impairment queue: lost with `lossPercent`, delayed by `delayMs` plus
+ *     up to `jitterMs` (datagrams overtake each other when jitter exceeds the gap between them).
+ */
+class SimProxy {
+public:
+  static const int MAX_BINDINGS = 8;
+  static const int MAX_TRANSACTIONS = 64;
+  static const int MAX_QUEUE = 256;
+  static const size_t MAX_DATAGRAM = 2048;
+
+  float lossPercent = 0;
+  uint32_t delayMs = 0;
+  uint32_t jitterMs = 0;
+
+  uint32_t received = 0;
+  uint32_t forwarded = 0;
+  uint32_t lost = 0;
+
+  bool begin(IPAddress ip, uint16_t port) {
+    fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0) {
+      return false;
+    }
+    memset(&self, 0, sizeof(self));
+    self.sin_family = AF_INET;
+    self.sin_port = htons(port);
+    self.sin_addr.s_addr = (uint32_t) ip;
+    if (::bind(fd, (struct sockaddr*) &self, sizeof(self)) < 0) {
+      close(fd);
+      fd = -1;
+      return false;
+    }
+    snprintf(recordRoute, sizeof(recordRoute), "Record-Route: <sip:%s;lr>\r\n", ip.toString().c_str());
+    return true;
+  }
+
+  /* Description:
+   *     handle all datagrams waiting in the socket, then send those from the queue that are due.
+   * Return:
+   *     number of datagrams received and sent (0 - idle)
+   */
+  int poll(uint32_t msNow) {
+    int n = 0;
+    char msg[MAX_DATAGRAM + 1];
+    struct sockaddr_in from;
+    socklen_t fromLen = sizeof(from);
+    int got;
+    while ((got = recvfrom(fd, msg, MAX_DATAGRAM, MSG_DONTWAIT, (struct sockaddr*) &from, &fromLen)) > 0) {
+      msg[got] = '\0';
+      received++;
+      handle(msNow, msg, got, from);
+      fromLen = sizeof(from);
+      n++;
+    }
+    for (int i = 0; i < queueLen; ) {
+      if ((int32_t) (msNow - queue[i].msDue) >= 0) {
+        sendto(fd, queue[i].data, queue[i].len, 0, (struct sockaddr*) &queue[i].to, sizeof(queue[i].to));
+        free(queue[i].data);
+        queue[i] = queue[--queueLen];
+        forwarded++;
+        n++;
+      } else {
+        i++;
+      }
+    }
+    return n;
+  }
+
+  // Time until the next queued datagram is due, -1 if the queue is empty
+  int32_t nextDueMs(uint32_t msNow) {
+    int32_t res = -1;
+    for (int i = 0; i < queueLen; i++) {
+      int32_t left = (int32_t) (queue[i].msDue - msNow);
+      left = left > 0 ? left : 0;
+      if (res < 0 || left < res) {
+        res = left;
+      }
+    }
+    return res;
+  }
+
+protected:
+  struct Binding {
+    char user[32];
+    struct sockaddr_in addr;
+  };
+  struct Transaction {
+    char key[128];                    // Call-ID and CSeq
+    struct sockaddr_in addr;
+  };
+  struct Datagram {
+    uint32_t msDue;
+    struct sockaddr_in to;
+    char* data;
+    size_t len;
+  };
+
+  int fd = -1;
+  struct sockaddr_in self;
+  char recordRoute[64];
+
+  Binding bindings[MAX_BINDINGS];
+  int nBindings = 0;
+  Transaction transactions[MAX_TRANSACTIONS];
+  int nextTransaction = 0;
+  Datagram queue[MAX_QUEUE];
+  int queueLen = 0;
+
+  void handle(uint32_t msNow, char* msg, size_t len, const struct sockaddr_in& from) {
+    if (len < 4 || !strncmp(msg, "\r\n", 2)) {
+      return;         // keepalive
+    }
+    if (strncmp(msg, "REGISTER ", 9)) {
+      len = contactViaProxy(msg, len);
+    }
+    char callId[80], cseq[40], key[128];
+    header(msg, "Call-ID", "i", callId, sizeof(callId));
+    header(msg, "CSeq", NULL, cseq, sizeof(cseq));
+    snprintf(key, sizeof(key), "%s %s", callId, cseq);
+
+    if (!strncmp(msg, "SIP/", 4)) {
+      for (int i = 0; i < MAX_TRANSACTIONS; i++) {
+        if (!strcmp(transactions[i].key, key)) {
+          send(msNow, msg, len, transactions[i].addr);
+          return;
+        }
+      }
+      return;         // stray response
+    }
+
+    char user[32];
+    requestUser(msg, user, sizeof(user));
+    if (!strncmp(msg, "REGISTER ", 9)) {
+      char to[128], contact[256];
+      header(msg, "To", "t", to, sizeof(to));
+      header(msg, "Contact", "m", contact, sizeof(contact));
+      uriUser(to, user, sizeof(user));
+      bind(user, from);
+      char contactUser[32];
+      uriUser(contact, contactUser, sizeof(contactUser));
+      bind(contactUser, from);
+      char extra[320];
+      snprintf(extra, sizeof(extra), "Contact: %s;expires=3600\r\n", contact);
+      respond(msNow, msg, from, "200 OK", extra);
+      return;
+    }
+
+    const Binding* b = find(user);
+    if (b == NULL) {
+      if (strncmp(msg, "ACK ", 4)) {
+        respond(msNow, msg, from, "404 Not Found", "");
+      }
+      return;
+    }
+    if (strncmp(msg, "ACK ", 4)) {
+      Transaction& t = transactions[nextTransaction];
+      nextTransaction = (nextTransaction + 1) % MAX_TRANSACTIONS;
+      snprintf(t.key, sizeof(t.key), "%s", key);
+      t.addr = from;
+    }
+    if (!strncmp(msg, "INVITE ", 7) && !strstr(msg, recordRoute)) {
+      // Record-Route goes right after the request line
+      const char* eol = strstr(msg, "\r\n");
+      size_t rrLen = strlen(recordRoute);
+      if (eol != NULL && len + rrLen <= MAX_DATAGRAM) {
+        char routed[MAX_DATAGRAM + 1];
+        size_t head = eol + 2 - msg;
+        memcpy(routed, msg, head);
+        memcpy(routed + head, recordRoute, rrLen);
+        memcpy(routed + head + rrLen, msg + head, len - head);
+        send(msNow, routed, len + rrLen, b->addr);
+        return;
+      }
+    }
+    send(msNow, msg, len, b->addr);
+  }
+
+  /* Description:
+   *     replace the port of the Contact URI in `msg` (NUL-terminated, MAX_DATAGRAM + 1 bytes) with the port of the proxy.
+   * Return:
+   *     new length of the message
+   */
+  size_t contactViaProxy(char* msg, size_t len) {
+    const char* h = headerLine(msg, "Contact", "m");
+    if (h == NULL) {
+      return len;
+    }
+    char* at = strpbrk((char*) h, "@\r");
+    if (at == NULL || *at != '@') {
+      return len;
+    }
+    char* colon = strpbrk(at, ":;>\r");
+    if (colon == NULL || *colon != ':') {
+      return len;
+    }
+    char* digits = colon + 1;
+    char* end = digits + strspn(digits, "0123456789");
+    char port[8];
+    size_t portLen = snprintf(port, sizeof(port), "%d", ntohs(self.sin_port));
+    size_t tail = len - (end - msg);
+    if (len - (end - digits) + portLen > MAX_DATAGRAM) {
+      return len;
+    }
+    memmove(digits + portLen, end, tail + 1);
+    memcpy(digits, port, portLen);
+    return len - (end - digits) + portLen;
+  }
+
+  void respond(uint32_t msNow, const char* req, const struct sockaddr_in& to, const char* status, const char* extra) {
+    char resp[MAX_DATAGRAM + 1];
+    size_t len = snprintf(resp, sizeof(resp), "SIP/2.0 %s\r\n", status);
+    len += copyHeaders(req, "Via", "v", resp + len, sizeof(resp) - len);
+    len += copyHeaders(req, "From", "f", resp + len, sizeof(resp) - len);
+    char toHdr[160];
+    header(req, "To", "t", toHdr, sizeof(toHdr));
+    char callId[80], cseq[40];
+    header(req, "Call-ID", "i", callId, sizeof(callId));
+    header(req, "CSeq", NULL, cseq, sizeof(cseq));
+    len += snprintf(resp + len, sizeof(resp) - len, "To: %s%s\r\nCall-ID: %s\r\nCSeq: %s\r\n%sContent-Length: 0\r\n\r\n",
+                    toHdr, strstr(toHdr, ";tag=") ? "" : ";tag=simproxy", callId, cseq, extra);
+    if (len < sizeof(resp)) {
+      send(msNow, resp, len, to);
+    }
+  }
+
+  void send(uint32_t msNow, const char* msg, size_t len, const struct sockaddr_in& to) {
+    if (lossPercent > 0 && simRandom() % 10000 < lossPercent * 100) {
+      lost++;
+      return;
+    }
+    if (queueLen >= MAX_QUEUE) {
+      lost++;
+      return;
+    }
+    Datagram& d = queue[queueLen++];
+    d.msDue = msNow + delayMs + (jitterMs ? simRandom() % (jitterMs + 1) : 0);
+    d.to = to;
+    d.data = (char*) malloc(len);
+    memcpy(d.data, msg, len);
+    d.len = len;
+  }
+
+  void bind(const char* user, const struct sockaddr_in& addr) {
+    if (!*user) {
+      return;
+    }
+    for (int i = 0; i < nBindings; i++) {
+      if (!strcmp(bindings[i].user, user)) {
+        bindings[i].addr = addr;
+        return;
+      }
+    }
+    if (nBindings < MAX_BINDINGS) {
+      snprintf(bindings[nBindings].user, sizeof(bindings[nBindings].user), "%s", user);
+      bindings[nBindings++].addr = addr;
+    }
+  }
+
+  const Binding* find(const char* user) {
+    for (int i = 0; i < nBindings; i++) {
+      if (!strcmp(bindings[i].user, user)) {
+        return &bindings[i];
+      }
+    }
+    return NULL;
+  }
+
+  // Start of the header line `name` (or its compact form), NULL if absent
+  static const char* headerLine(const char* msg, const char* name, const char* compact, const char* from = NULL) {
+    const char* end = strstr(msg, "\r\n\r\n");
+    for (const char* p = strstr(from ? from : msg, "\r\n"); p != NULL && (end == NULL || p < end); p = strstr(p + 2, "\r\n")) {
+      const char* h = p + 2;
+      size_t n = strlen(name);
+      const char* colon = NULL;
+      if (!strncasecmp(h, name, n)) {
+        colon = h + n;
+      } else if (compact && !strncasecmp(h, compact, strlen(compact))) {
+        colon = h + strlen(compact);
+      }
+      if (colon) {
+        while (*colon == ' ' || *colon == '\t') {
+          colon++;
+        }
+        if (*colon == ':') {
+          return h;
+        }
+      }
+    }
+    return NULL;
+  }
+
+  static void header(const char* msg, const char* name, const char* compact, char* out, size_t size) {
+    out[0] = '\0';
+    const char* h = headerLine(msg, name, compact);
+    if (h == NULL) {
+      return;
+    }
+    const char* v = strchr(h, ':') + 1;
+    while (*v == ' ' || *v == '\t') {
+      v++;
+    }
+    const char* eol = strstr(v, "\r\n");
+    size_t n = eol ? eol - v : strlen(v);
+    n = n < size - 1 ? n : size - 1;
+    memcpy(out, v, n);
+    out[n] = '\0';
+  }
+
+  static size_t copyHeaders(const char* msg, const char* name, const char* compact, char* out, size_t size) {
+    size_t len = 0;
+    for (const char* h = headerLine(msg, name, compact); h != NULL; h = headerLine(msg, name, compact, h)) {
+      const char* eol = strstr(h, "\r\n");
+      size_t n = eol + 2 - h;
+      if (len + n < size) {
+        memcpy(out + len, h, n);
+        len += n;
+      }
+    }
+    out[len] = '\0';
+    return len;
+  }
+
+  // User part of a SIP URI (possibly inside a name-addr)
+  static void uriUser(const char* s, char* out, size_t size) {
+    out[0] = '\0';
+    const char* p = strstr(s, "sip:");
+    if (p == NULL) {
+      return;
+    }
+    p += 4;
+    const char* at = strpbrk(p, "@>; \r\n");
+    if (at == NULL || *at != '@') {
+      return;
+    }
+    size_t n = (size_t) (at - p) < size - 1 ? at - p : size - 1;
+    memcpy(out, p, n);
+    out[n] = '\0';
+  }
+
+  static void requestUser(const char* msg, char* out, size_t size) {
+    const char* sp = strchr(msg, ' ');
+    const char* eol = strstr(msg, "\r\n");
+    if (sp == NULL || eol == NULL || sp > eol) {
+      out[0] = '\0';
+      return;
+    }
+    uriUser(sp + 1, out, size);
+  }
+};
+
+/* Description:
+ *     a phone of the simulation: TinySIP and the events it reported since the last clear().
+ */
+class SimPhone {
+public:
+  TinySIP sip;
+  const char* uri;
+  TinySIP::StateFlags_t events = 0;
+  uint32_t messagesIn = 0;
+  uint32_t delivered = 0;
+  uint32_t undelivered = 0;
+
+  SimPhone(const char* uri) : uri(uri) {}
+
+  bool init(const char* name, uint8_t macLast) {
+    const uint8_t mac[6] = { 0x24, 0x0a, 0xc4, 0x00, 0x00, macLast };
+    return sip.init(name, uri, "", mac);
+  }
+
+  // One pass of the main loop; returns false if nothing happened
+  bool loop(uint32_t msNow) {
+    bool busy = false;
+    TinySIP::StateFlags_t ev;
+    do {
+      ev = sip.checkCall(msNow);
+      events |= ev;
+      busy |= ev != TinySIP::EVENT_NONE;
+      if (ev & TinySIP::EVENT_INCOMING_CALL) {
+        sip.acceptCall();
+      }
+    } while (ev & TinySIP::EVENT_MORE_BUFFER);
+    TextMessage* msg;
+    while ((msg = sip.checkMessage(msNow, 0, false)) != NULL) {
+      messagesIn++;
+      delete msg;
+    }
+    MessageDelivery* delivery;
+    while ((delivery = sip.checkDelivery()) != NULL) {
+      (delivery->delivered ? delivered : undelivered)++;
+      delete delivery;
+    }
+    return busy;
+  }
+
+  void clear() {
+    events = 0;
+    messagesIn = delivered = undelivered = 0;
+  }
+};
+
+enum Phase { REGISTER = 0, INVITE, BYE, MESSAGE, PHASES };
+static const char* PHASE_NAMES[PHASES] = { "REGISTER", "INVITE", "BYE", "MESSAGE" };
+static const uint32_t PHASE_TIMEOUT_MS[PHASES] = { 4000, 4000, 4000, 40000 };     // MESSAGE is retried by TinySIP for 32 s
+
+static SimProxy proxy;
+static SimPhone* phones[2];
+static const uint32_t IDLE_STEP_MS = 10;
+
+/* Description:
+ *     run the phones and the proxy until `done` or timeout, moving the clock forward while everyone is idle.
+ * Return:
+ *     true if done before the timeout
+ */
+template<typename Done>
+static bool runUntil(uint32_t timeoutMs, Done done) {
+  uint32_t msStart = millis();
+  while (!done()) {
+    uint32_t msNow = millis();
+    if (msNow - msStart >= timeoutMs) {
+      return false;
+    }
+    bool busy = phones[0]->loop(msNow);
+    busy |= phones[1]->loop(msNow);
+    busy |= proxy.poll(msNow) > 0;
+    if (!busy) {
+      int32_t due = proxy.nextDueMs(msNow);
+      hostClockWarpUs += (due >= 0 && (uint32_t) due < IDLE_STEP_MS ? due : IDLE_STEP_MS) * 1000ul;
+    }
+  }
+  return true;
+}
+
+// Let late datagrams arrive and get dropped, so that they don't count for the next phase
+static void settle() {
+  runUntil(2*(proxy.delayMs + proxy.jitterMs) + 500, [] { return false; });
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [-n cycles] [-l loss_percent] [-d delay_ms] [-j jitter_ms] [-s seed] [-p proxy_ip] [-m min_ok_percent]\n", name);
+}
+
+static int cmpU32(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char* argv[]) {
+  long cycles = 1000;
+  uint32_t seed = simSeed;
+  const char* proxyIp = "127.0.0.1";
+  double minOkPercent = -1;         // not given: see below
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i+1<argc) {
+      cycles = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "-l") && i+1<argc) {
+      proxy.lossPercent = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "-d") && i+1<argc) {
+      proxy.delayMs = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "-j") && i+1<argc) {
+      proxy.jitterMs = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "-s") && i+1<argc) {
+      seed = strtoul(argv[++i], NULL, 0);
+      simSeed = seed ? seed : 1;
+    } else if (!strcmp(argv[i], "-p") && i+1<argc) {
+      proxyIp = argv[++i];
+    } else if (!strcmp(argv[i], "-m") && i+1<argc) {
+      minOkPercent = atof(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (cycles <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  // Without loss every transaction must succeed. With loss some fail (TinySIP doesn't retransmit INVITE, BYE or REGISTER),
+  // about one in a hundred per percent of loss; three times that is tolerated.
+  if (minOkPercent < 0) {
+    minOkPercent = proxy.lossPercent > 0 ? 100 - 3*proxy.lossPercent : 100;
+  }
+
+  // The phones register at UDP port 5060 of the proxy; their Contacts are changed to it as well
+  IPAddress ip;
+  if (!ip.fromString(proxyIp) || !proxy.begin(ip, SipResolver::SIP_PORT)) {
+    fprintf(stderr, "cannot bind %s:%d\n", proxyIp, SipResolver::SIP_PORT);
+    return 1;
+  }
+  UDP_SIP = true;
+  WiFi.setLocalIP(ip);
+
+  char aliceUri[64], bobUri[64];
+  snprintf(aliceUri, sizeof(aliceUri), "sip:alice@%s", proxyIp);
+  snprintf(bobUri, sizeof(bobUri), "sip:bob@%s", proxyIp);
+  SimPhone alice(aliceUri), bob(bobUri);
+  phones[0] = &alice;
+  phones[1] = &bob;
+  if (!alice.init("Alice", 1) || !bob.init("Bob", 2)) {
+    fprintf(stderr, "phones cannot connect\n");
+    return 1;
+  }
+
+  // Both register on their own in the first checkCall(); retry through lost responses
+  while (!runUntil(PHASE_TIMEOUT_MS[REGISTER], [&] { return (alice.events & bob.events & TinySIP::EVENT_REGISTERED) != 0; })) {
+    if (!(alice.events & TinySIP::EVENT_REGISTERED)) {
+      alice.sip.registration();
+    }
+    if (!(bob.events & TinySIP::EVENT_REGISTERED)) {
+      bob.sip.registration();
+    }
+  }
+  settle();
+
+  uint32_t* setupUs = (uint32_t*) calloc(cycles, sizeof(uint32_t));
+  long nSetup = 0;
+  long ok[PHASES] = {0}, failed[PHASES] = {0};
+  size_t heapStart = heapInUse(), heapPeak = heapStart;
+  uint64_t allocsBefore = heapAllocs;
+  uint32_t msSimStart = millis();
+  unsigned long usWallStart = micros() - hostClockWarpUs;
+
+  for (long c = 0; c < cycles; c++) {
+    // REGISTER (refresh)
+    alice.clear();
+    alice.sip.registration();
+    if (runUntil(PHASE_TIMEOUT_MS[REGISTER], [&] { return (alice.events & TinySIP::EVENT_REGISTERED) != 0; })) {
+      ok[REGISTER]++;
+    } else {
+      failed[REGISTER]++;
+      settle();
+    }
+
+    // INVITE, answered by bob
+    alice.clear();
+    bob.clear();
+    unsigned long usStart = micros();
+    alice.sip.startCall(bobUri, millis());
+    bool answered = runUntil(PHASE_TIMEOUT_MS[INVITE], [&] { return (alice.events & TinySIP::EVENT_CALL_CONFIRMED) != 0; });
+    if (answered) {
+      ok[INVITE]++;
+      setupUs[nSetup++] = micros() - usStart;
+    } else {
+      failed[INVITE]++;
+    }
+
+    // BYE
+    if (answered) {
+      alice.clear();
+      bob.clear();
+      alice.sip.terminateCall(millis());
+      if (runUntil(PHASE_TIMEOUT_MS[BYE], [&] { return (alice.events & TinySIP::EVENT_CALL_TERMINATED) &&
+                                                      (bob.events & TinySIP::EVENT_CALL_TERMINATED); })) {
+        ok[BYE]++;
+      } else {
+        failed[BYE]++;
+        answered = false;
+      }
+    }
+    if (!answered) {
+      // Leave no half-established call behind
+      for (SimPhone* p : phones) {
+        if (p->sip.isBusy()) {
+          p->sip.terminateCall(millis());
+        }
+      }
+      settle();
+    }
+
+    // MESSAGE
+    alice.clear();
+    bob.clear();
+    char text[32];
+    snprintf(text, sizeof(text), "cycle %ld", c);
+    alice.sip.sendMessage(bobUri, text, c);
+    if (runUntil(PHASE_TIMEOUT_MS[MESSAGE], [&] { return alice.delivered || alice.undelivered; }) && alice.delivered && bob.messagesIn) {
+      ok[MESSAGE]++;
+    } else {
+      failed[MESSAGE]++;
+      settle();
+    }
+
+    size_t heap = heapInUse();
+    heapPeak = heap > heapPeak ? heap : heapPeak;
+  }
+
+  unsigned long usWall = micros() - hostClockWarpUs - usWallStart;
+  uint32_t msSim = millis() - msSimStart;
+  uint64_t allocs = heapAllocs - allocsBefore;
+  long transactions = 0, failures = 0;
+  for (int p = 0; p < PHASES; p++) {
+    transactions += ok[p];
+    failures += failed[p];
+  }
+
+  printf("cycles: %ld, loss %.1f%%, delay %u+%u ms, seed %u\n", cycles, proxy.lossPercent, proxy.delayMs, proxy.jitterMs, seed);
+  printf("transactions: %ld ok, %ld failed (", transactions, failures);
+  for (int p = 0; p < PHASES; p++) {
+    printf("%s%s %ld/%ld", p ? ", " : "", PHASE_NAMES[p], ok[p], ok[p] + failed[p]);
+  }
+  printf(")\n");
+  printf("datagrams: %u received by proxy, %u forwarded, %u lost\n", proxy.received, proxy.forwarded, proxy.lost);
+  printf("%.0f transactions/second (%.3f s wall clock, %.1f s simulated)\n",
+         usWall ? transactions * 1e6 / usWall : 0.0, usWall / 1e6, msSim / 1e3);
+  if (nSetup > 0) {
+    qsort(setupUs, nSetup, sizeof(uint32_t), cmpU32);
+    printf("call setup: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", setupUs[(nSetup - 1) * 50 / 100] / 1e3,
+           setupUs[(nSetup - 1) * 90 / 100] / 1e3, setupUs[(nSetup - 1) * 99 / 100] / 1e3, setupUs[nSetup - 1] / 1e3);
+  }
+  printf("heap: %.1f allocations/transaction, %zu bytes in use at start, peak %zu, growth %ld\n",
+         transactions ? (double) allocs / transactions : 0.0, heapStart, heapPeak, (long) heapInUse() - (long) heapStart);
+  free(setupUs);
+
+  double okPercent = transactions + failures ? 100.0 * transactions / (transactions + failures) : 0.0;
+  if (okPercent < minOkPercent) {
+    fprintf(stderr, "%.1f%% of transactions completed, at least %.1f%% required\n", okPercent, minOkPercent);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,298 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+/*
+ * Definitions that the firmware gets from the ESP32 core or from modules not built on the host.
+ */
+
+#include <time.h>
+#include <sched.h>
+#include "Arduino.h"
+#include "WiFi.h"
+#include "rom/md5_hash.h"
+#include "tinySIP.h"
+#include "TlsConnection.h"
+#include "clock.h"
+
+bool UDP_SIP = false;
+bool TLS_SIP = false;
+WiFiClass WiFi;
+HardwareSerial Serial;
+
+unsigned long hostClockWarpUs = 0;          // sip_sim skips the time when everyone just waits for a timer
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+unsigned long micros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000000ul + ts.tv_nsec / 1000 + hostClockWarpUs;
+}
+
+void delay(uint32_t ms) {
+  struct timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000l };
+  nanosleep(&ts, NULL);
+}
+
+void yield() {
+  sched_yield();
+}
+
+long random(long max) {
+  return max > 0 ? Random.random() % max : 0;
+}
+
+long random(long min, long max) {
+  return min + random(max - min);
+}
+
+// Networks.cpp: the same lookup over host descriptors (UDP sockets of the shim WiFiUDP are real)
+
+uint32_t udpSocketsMask(uint16_t localPort) {
+  uint32_t mask = 0;
+  for (int fd = 0; fd < 32; fd++) {
+    int type = 0;
+    socklen_t len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_DGRAM) {
+      continue;
+    }
+    if (localPort && socketLocalPort(fd) != localPort) {
+      continue;
+    }
+    mask |= 1u << fd;
+  }
+  return mask;
+}
+
+int udpSocketFd(uint32_t mask) {
+  for (int fd = 0; fd < 32; fd++) {
+    if (mask & (1u << fd)) {
+      return fd;
+    }
+  }
+  return -1;
+}
+
+uint16_t socketLocalPort(int fd) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  if (fd < 0 || getsockname(fd, (struct sockaddr*) &addr, &len) < 0) {
+    return 0;
+  }
+  return ntohs(addr.sin_port);
+}
+
+// Networks.cpp: only literal IP addresses resolve through lwIP on the host (SipResolver asks its own DNS server)
+
+IPAddress resolveDomain(const char* hostName) {
+  IPAddress ip;
+  ip.fromString(hostName);
+  return ip;
+}
+
+// clock.cpp: the time is never known (no NTP)
+
+Clock ntpClock;
+
+Clock::Clock(long timeOffsetSeconds) : timeOffsetSeconds(timeOffsetSeconds) {
+}
+
+uint32_t Clock::getExactUtcTime() {
+  return 0;
+}
+
+// SPIFFS: see shim/FS.h
+
+SPIFFSFS SPIFFS;
+
+#ifndef SIP_HOST_TLS
+// TlsConnection.cpp needs mbedTLS (see BUILD.sh): without it, TLS connections never connect
+
+TLS_SIPConnection::TLS_SIPConnection() : Connection(), tlsDyn(NULL), hostnameDyn(NULL), sock(-1), mRemotePort(0), mLocalPort(0),
+  verifyServer(true), wasResumed(false), wasVerified(false), msHandshake(0) {
+  _connected = false;
+}
+
+TLS_SIPConnection::~TLS_SIPConnection() {
+  freeNull((void **) &hostnameDyn);
+}
+
+bool TLS_SIPConnection::setCaChain(const char*) {
+  return false;
+}
+
+void TLS_SIPConnection::setHostname(const char* host) {
+  freeNull((void **) &hostnameDyn);
+  hostnameDyn = host ? strdup(host) : NULL;
+}
+
+int TLS_SIPConnection::connect(IPAddress &ip, uint16_t port, int32_t) {
+  mRemoteIP = ip;
+  mRemotePort = port;
+  return 0;
+}
+
+uint8_t TLS_SIPConnection::connected() {
+  return false;
+}
+
+void TLS_SIPConnection::stop() {}
+
+int TLS_SIPConnection::available() {
+  return 0;
+}
+
+int32_t TLS_SIPConnection::read(uint8_t*, uint32_t) {
+  return -1;
+}
+
+void TLS_SIPConnection::write(uint8_t*, uint32_t) {}
+
+int TLS_SIPConnection::fd() {
+  return -1;
+}
+#endif // SIP_HOST_TLS
+
+// MD5 (RFC 1321) with the interface of the ESP32 ROM implementation, so that src/digcalc.c builds unchanged
+
+#define MD5_F1(x, y, z) (z ^ (x & (y ^ z)))
+#define MD5_F2(x, y, z) MD5_F1(z, x, y)
+#define MD5_F3(x, y, z) (x ^ y ^ z)
+#define MD5_F4(x, y, z) (y ^ (x | ~z))
+#define MD5_STEP(f, w, x, y, z, data, s) (w += f(x, y, z) + data, w = w<<s | w>>(32-s), w += x)
+
+static void md5Transform(uint32_t buf[4], const uint8_t block[64]) {
+  uint32_t in[16];
+  for (int i=0; i<16; i++) {
+    in[i] = (uint32_t) block[4*i] | (uint32_t) block[4*i+1] << 8 | (uint32_t) block[4*i+2] << 16 | (uint32_t) block[4*i+3] << 24;
+  }
+  uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  MD5_STEP(MD5_F1, a, b, c, d, in[0] + 0xd76aa478, 7);
+  MD5_STEP(MD5_F1, d, a, b, c, in[1] + 0xe8c7b756, 12);
+  MD5_STEP(MD5_F1, c, d, a, b, in[2] + 0x242070db, 17);
+  MD5_STEP(MD5_F1, b, c, d, a, in[3] + 0xc1bdceee, 22);
+  MD5_STEP(MD5_F1, a, b, c, d, in[4] + 0xf57c0faf, 7);
+  MD5_STEP(MD5_F1, d, a, b, c, in[5] + 0x4787c62a, 12);
+  MD5_STEP(MD5_F1, c, d, a, b, in[6] + 0xa8304613, 17);
+  MD5_STEP(MD5_F1, b, c, d, a, in[7] + 0xfd469501, 22);
+  MD5_STEP(MD5_F1, a, b, c, d, in[8] + 0x698098d8, 7);
+  MD5_STEP(MD5_F1, d, a, b, c, in[9] + 0x8b44f7af, 12);
+  MD5_STEP(MD5_F1, c, d, a, b, in[10] + 0xffff5bb1, 17);
+  MD5_STEP(MD5_F1, b, c, d, a, in[11] + 0x895cd7be, 22);
+  MD5_STEP(MD5_F1, a, b, c, d, in[12] + 0x6b901122, 7);
+  MD5_STEP(MD5_F1, d, a, b, c, in[13] + 0xfd987193, 12);
+  MD5_STEP(MD5_F1, c, d, a, b, in[14] + 0xa679438e, 17);
+  MD5_STEP(MD5_F1, b, c, d, a, in[15] + 0x49b40821, 22);
+
+  MD5_STEP(MD5_F2, a, b, c, d, in[1] + 0xf61e2562, 5);
+  MD5_STEP(MD5_F2, d, a, b, c, in[6] + 0xc040b340, 9);
+  MD5_STEP(MD5_F2, c, d, a, b, in[11] + 0x265e5a51, 14);
+  MD5_STEP(MD5_F2, b, c, d, a, in[0] + 0xe9b6c7aa, 20);
+  MD5_STEP(MD5_F2, a, b, c, d, in[5] + 0xd62f105d, 5);
+  MD5_STEP(MD5_F2, d, a, b, c, in[10] + 0x02441453, 9);
+  MD5_STEP(MD5_F2, c, d, a, b, in[15] + 0xd8a1e681, 14);
+  MD5_STEP(MD5_F2, b, c, d, a, in[4] + 0xe7d3fbc8, 20);
+  MD5_STEP(MD5_F2, a, b, c, d, in[9] + 0x21e1cde6, 5);
+  MD5_STEP(MD5_F2, d, a, b, c, in[14] + 0xc33707d6, 9);
+  MD5_STEP(MD5_F2, c, d, a, b, in[3] + 0xf4d50d87, 14);
+  MD5_STEP(MD5_F2, b, c, d, a, in[8] + 0x455a14ed, 20);
+  MD5_STEP(MD5_F2, a, b, c, d, in[13] + 0xa9e3e905, 5);
+  MD5_STEP(MD5_F2, d, a, b, c, in[2] + 0xfcefa3f8, 9);
+  MD5_STEP(MD5_F2, c, d, a, b, in[7] + 0x676f02d9, 14);
+  MD5_STEP(MD5_F2, b, c, d, a, in[12] + 0x8d2a4c8a, 20);
+
+  MD5_STEP(MD5_F3, a, b, c, d, in[5] + 0xfffa3942, 4);
+  MD5_STEP(MD5_F3, d, a, b, c, in[8] + 0x8771f681, 11);
+  MD5_STEP(MD5_F3, c, d, a, b, in[11] + 0x6d9d6122, 16);
+  MD5_STEP(MD5_F3, b, c, d, a, in[14] + 0xfde5380c, 23);
+  MD5_STEP(MD5_F3, a, b, c, d, in[1] + 0xa4beea44, 4);
+  MD5_STEP(MD5_F3, d, a, b, c, in[4] + 0x4bdecfa9, 11);
+  MD5_STEP(MD5_F3, c, d, a, b, in[7] + 0xf6bb4b60, 16);
+  MD5_STEP(MD5_F3, b, c, d, a, in[10] + 0xbebfbc70, 23);
+  MD5_STEP(MD5_F3, a, b, c, d, in[13] + 0x289b7ec6, 4);
+  MD5_STEP(MD5_F3, d, a, b, c, in[0] + 0xeaa127fa, 11);
+  MD5_STEP(MD5_F3, c, d, a, b, in[3] + 0xd4ef3085, 16);
+  MD5_STEP(MD5_F3, b, c, d, a, in[6] + 0x04881d05, 23);
+  MD5_STEP(MD5_F3, a, b, c, d, in[9] + 0xd9d4d039, 4);
+  MD5_STEP(MD5_F3, d, a, b, c, in[12] + 0xe6db99e5, 11);
+  MD5_STEP(MD5_F3, c, d, a, b, in[15] + 0x1fa27cf8, 16);
+  MD5_STEP(MD5_F3, b, c, d, a, in[2] + 0xc4ac5665, 23);
+
+  MD5_STEP(MD5_F4, a, b, c, d, in[0] + 0xf4292244, 6);
+  MD5_STEP(MD5_F4, d, a, b, c, in[7] + 0x432aff97, 10);
+  MD5_STEP(MD5_F4, c, d, a, b, in[14] + 0xab9423a7, 15);
+  MD5_STEP(MD5_F4, b, c, d, a, in[5] + 0xfc93a039, 21);
+  MD5_STEP(MD5_F4, a, b, c, d, in[12] + 0x655b59c3, 6);
+  MD5_STEP(MD5_F4, d, a, b, c, in[3] + 0x8f0ccc92, 10);
+  MD5_STEP(MD5_F4, c, d, a, b, in[10] + 0xffeff47d, 15);
+  MD5_STEP(MD5_F4, b, c, d, a, in[1] + 0x85845dd1, 21);
+  MD5_STEP(MD5_F4, a, b, c, d, in[8] + 0x6fa87e4f, 6);
+  MD5_STEP(MD5_F4, d, a, b, c, in[15] + 0xfe2ce6e0, 10);
+  MD5_STEP(MD5_F4, c, d, a, b, in[6] + 0xa3014314, 15);
+  MD5_STEP(MD5_F4, b, c, d, a, in[13] + 0x4e0811a1, 21);
+  MD5_STEP(MD5_F4, a, b, c, d, in[4] + 0xf7537e82, 6);
+  MD5_STEP(MD5_F4, d, a, b, c, in[11] + 0xbd3af235, 10);
+  MD5_STEP(MD5_F4, c, d, a, b, in[2] + 0x2ad7d2bb, 15);
+  MD5_STEP(MD5_F4, b, c, d, a, in[9] + 0xeb86d391, 21);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+extern "C" void MD5Init(struct MD5Context* ctx) {
+  ctx->buf[0] = 0x67452301;
+  ctx->buf[1] = 0xefcdab89;
+  ctx->buf[2] = 0x98badcfe;
+  ctx->buf[3] = 0x10325476;
+  ctx->bits[0] = ctx->bits[1] = 0;
+}
+
+extern "C" void MD5Update(struct MD5Context* ctx, unsigned char const* buf, unsigned len) {
+  uint32_t used = (ctx->bits[0] >> 3) & 0x3f;
+  if ((ctx->bits[0] += (uint32_t) len << 3) < ((uint32_t) len << 3)) {
+    ctx->bits[1]++;
+  }
+  ctx->bits[1] += len >> 29;
+  while (len > 0) {
+    uint32_t n = 64 - used < len ? 64 - used : len;
+    memcpy(ctx->in + used, buf, n);
+    used += n;
+    buf += n;
+    len -= n;
+    if (used == 64) {
+      md5Transform(ctx->buf, ctx->in);
+      used = 0;
+    }
+  }
+}
+
+extern "C" void MD5Final(unsigned char digest[16], struct MD5Context* ctx) {
+  static const uint8_t padding[64] = { 0x80 };
+  uint8_t bits[8];
+  for (int i=0; i<4; i++) {
+    bits[i] = ctx->bits[0] >> (8*i);
+    bits[i+4] = ctx->bits[1] >> (8*i);
+  }
+  uint32_t used = (ctx->bits[0] >> 3) & 0x3f;
+  MD5Update(ctx, padding, used < 56 ? 56 - used : 120 - used);
+  MD5Update(ctx, bits, 8);
+  for (int i=0; i<16; i++) {
+    digest[i] = ctx->buf[i/4] >> (8*(i%4));
+  }
+}
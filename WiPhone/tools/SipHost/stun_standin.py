@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+
+# Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+
+# Licensed under the WiPhone Public License v.1.0 (the "License"); you
+# may not use this file except in compliance with the License. You may
+# obtain a copy of the License at
+# https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+# Unless required by applicable law or agreed to in writing, software,
+# hardware or documentation distributed under the License is distributed
+# on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+# either express or implied. See the License for the specific language
+# governing permissions and limitations under the License.
+
+# Local stand-in for a STUN server (RFC 5389, Binding only), pretending to sit behind a NAT:
+# answers with XOR-MAPPED-ADDRESS of the given public address and the source port shifted by a constant.
+# Point the phone to it by setting "t=<ip>:<port>" in the SIP account (/sip_accounts.ini).
+
+import argparse
+import socket
+import struct
+
+MAGIC_COOKIE = 0x2112A442
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--port", type=int, default=3478)
+    parser.add_argument("--public", default=None, help="address to report (default: the real source address)")
+    parser.add_argument("--shift", type=int, default=0, help="add this to the source port (0: port-preserving NAT)")
+    parser.add_argument("--drop", type=int, default=0, help="ignore the first N requests (exercises retransmission)")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("0.0.0.0", args.port))
+    dropped = 0
+    while True:
+        msg, (host, port) = sock.recvfrom(2048)
+        if len(msg) < 20:
+            continue
+        msgType, length, cookie = struct.unpack("!HHI", msg[:8])
+        if msgType != 0x0001 or cookie != MAGIC_COOKIE:
+            continue
+        if dropped < args.drop:
+            dropped += 1
+            continue
+        txId = msg[8:20]
+        addr = socket.inet_aton(args.public or host)
+        mappedPort = (port + args.shift) & 0xffff
+        xAddr = bytes(a ^ b for a, b in zip(addr, struct.pack("!I", MAGIC_COOKIE)))
+        attr = struct.pack("!HHBBH", 0x0020, 8, 0, 1, mappedPort ^ (MAGIC_COOKIE >> 16)) + xAddr
+        sock.sendto(struct.pack("!HHI", 0x0101, len(attr), MAGIC_COOKIE) + txId + attr, (host, port))
+
+if __name__ == "__main__":
+    main()
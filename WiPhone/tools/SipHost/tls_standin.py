@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+
+# Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+
+# Licensed under the WiPhone Public License v.1.0 (the "License"); you
+# may not use this file except in compliance with the License. You may
+# obtain a copy of the License at
+# https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+# Unless required by applicable law or agreed to in writing, software,
+# hardware or documentation distributed under the License is distributed
+# on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+# either express or implied. See the License for the specific language
+# governing permissions and limitations under the License.
+
+# Local stand-in for a SIP server over TLS (TLS 1.2, as mbedTLS 2.x speaks): answers every request "200 OK"
+# and every CRLFCRLF keepalive with CRLF (RFC 5626). Sessions can be resumed by ticket (RFC 5077) or, with
+# --no-tickets, by session ID only. Each handshake is reported on stderr as full or resumed.
+# Point the phone to it with an account "sip:user@<ip>:<port>" and transport TLS-SIP; the phone must trust
+# the certificate (put it in /sip_ca.pem), or it only logs that it doesn't.
+
+import argparse
+import socket
+import ssl
+import sys
+
+COPIED = ("via", "v", "from", "f", "to", "t", "call-id", "i", "cseq")
+
+def respond(head):
+    lines = head.split("\r\n")
+    copied = [l for l in lines[1:] if l.split(":", 1)[0].strip().lower() in COPIED]
+    return "SIP/2.0 200 OK\r\n" + "".join(l + "\r\n" for l in copied) + "Content-Length: 0\r\n\r\n"
+
+def serve(conn):
+    buff = b""
+    while True:
+        data = conn.recv(4096)
+        if not data:
+            return
+        buff += data
+        while buff:
+            if buff.startswith(b"\r\n\r\n"):
+                conn.sendall(b"\r\n")
+                buff = buff[4:]
+                continue
+            end = buff.find(b"\r\n\r\n")
+            if end < 0:
+                break
+            head = buff[:end].decode(errors="replace")
+            length = 0
+            for line in head.split("\r\n")[1:]:
+                name, _, value = line.partition(":")
+                if name.strip().lower() in ("content-length", "l"):
+                    length = int(value.strip() or 0)
+            if len(buff) < end + 4 + length:
+                break
+            buff = buff[end + 4 + length:]
+            if not head.startswith("SIP/"):
+                conn.sendall(respond(head).encode())
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--port", type=int, default=5061)
+    parser.add_argument("--cert", required=True, help="server certificate (PEM)")
+    parser.add_argument("--key", required=True, help="its private key (PEM)")
+    parser.add_argument("--no-tickets", action="store_true", help="resume by session ID only")
+    args = parser.parse_args()
+
+    ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    ctx.maximum_version = ssl.TLSVersion.TLSv1_2
+    ctx.load_cert_chain(args.cert, args.key)
+    if args.no_tickets:
+        ctx.options |= ssl.OP_NO_TICKET
+
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(("0.0.0.0", args.port))
+    listener.listen(4)
+    while True:
+        sock, addr = listener.accept()
+        try:
+            with ctx.wrap_socket(sock, server_side=True) as conn:
+                print("%s:%d %s handshake, %s" % (addr[0], addr[1], "resumed" if conn.session_reused else "full",
+                                                  conn.cipher()[0]), file=sys.stderr)
+                serve(conn)
+                try:
+                    conn.unwrap()       # OpenSSL drops a session from its cache if the connection isn't shut down
+                except (ssl.SSLError, OSError):
+                    pass
+        except (ssl.SSLError, OSError) as e:
+            print("%s:%d %s" % (addr[0], addr[1], e), file=sys.stderr)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,52 @@
+#!/bin/bash
+
+# Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+
+# Licensed under the WiPhone Public License v.1.0 (the "License"); you
+# may not use this file except in compliance with the License. You may
+# obtain a copy of the License at
+# https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+# Unless required by applicable law or agreed to in writing, software,
+# hardware or documentation distributed under the License is distributed
+# on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+# either express or implied. See the License for the specific language
+# governing permissions and limitations under the License.
+
+# Usage:
+#   ./BUILD.sh            - build ./storage_host
+#   ./BUILD.sh check      - build, then check the messages database with the power cut at every change: migration of
+#                           the INI partitions, saving, reading and deleting messages, and compaction of the log;
+#                           check rebuilding its index, check preloaded messages (cached) against direct reads,
+#                           check conversations and their file, and check search against reading every message
+
+set -e
+cd "$(dirname "$0")"
+
+SRC="../.."
+SOURCES="$SRC/Storage.cpp $SRC/NanoINI.cpp $SRC/CallerId.cpp $SRC/helpers.cpp $SRC/src/MurmurHash3_32.cpp ../SipHost/stubs.cpp"
+FLAGS="-std=gnu++17 -DESP32 -I../SipHost/shim -I../IniHost/shim -I$SRC"
+WARN="-Wall -Wextra"
+
+build_host() {
+    gcc $WARN -O2 -I../SipHost/shim -c $SRC/src/digcalc.c -o digcalc.o
+    g++ $FLAGS $WARN -O2 "$@" storage_host.cpp $SOURCES digcalc.o -o storage_host
+    rm -f digcalc.o
+}
+
+case "$1" in
+    check)
+        build_host
+        ./storage_host -m
+        ./storage_host -r
+        ./storage_host -x
+        ./storage_host -k
+        ./storage_host -c 20000
+        ./storage_host -v 3000
+        ./storage_host -f 3000
+        echo "OK"
+        ;;
+    *)
+        build_host
+        ;;
+esac
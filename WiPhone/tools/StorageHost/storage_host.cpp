@@ -0,0 +1,931 @@
+/*
+Copyright © 2019, 2020, 2021, 2022 HackEDA, Inc.
+Licensed under the WiPhone Public License v.1.0 (the "License"); you
+may not use this file except in compliance with the License. You may
+obtain a copy of the License at
+https://wiphone.io/WiPhone_Public_License_v1.0.txt.
+
+Unless required by applicable law or agreed to in writing, software,
+hardware or documentation distributed under the License is distributed
+on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+either express or implied. See the License for the specific language
+governing permissions and limitations under the License.
+*/
+
+
+/*
+ * Host harness for the messages database (Messages of Storage.cpp, see README.txt). SPIFFS is a directory of the host
+ * (../SipHost/shim/FS.h) that can lose power after any number of changes; "rebooting" is loading the database again
+ * into a new Messages. Every check compares the messages the database shows with what it is expected to have:
+ *   - with -m migrates INI partitions of older firmware into the log, with the power cut at every change of the way;
+ *   - with -r saves, reads and deletes messages with the power cut at every change of each: after the reboot
+ *     the database must have the message as before or as after the operation (a torn append is recovered);
+ *     also saves a message right after one whose writes failed, without a reboot;
+ *   - with -x rebuilds the index: missing, cut in the middle of an entry, ahead of the log;
+ *   - with -k compacts the log with the power cut at every change, each rename included;
+ *   - with -c N preloads random windows of messages (served from the cache) while messages get saved and deleted,
+ *     checking them against what is expected and against reading the log directly;
+ *   - with -v N saves, deletes and reads messages of a few correspondents, checking the conversations and the file
+ *     kept of them, through compactions and reboots with the file damaged;
+ *   - with -f N saves and deletes messages, searching them (Bloom filters of the log segments) and comparing with reading
+ *     every message, through compactions and reboots with the filters file damaged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <filesystem>
+#include "Storage.h"
+#include "CallerId.h"
+
+namespace fsys = std::filesystem;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("FAILED at line %d: %s\n", __LINE__, #cond); \
+      if (++failures > 20) { \
+        exit(1); \
+      } \
+    } \
+  } while (0)
+
+// Access to what the checks need besides the public interface
+class HostMessages : public Messages {
+public:
+  using Messages::compact;
+  int32_t deleted() {
+    return deletedCount;
+  }
+};
+
+static std::string workDir;
+static std::string baseDir;
+
+// Replace the "flash" with a copy of `from` (empty if NULL)
+static void resetFlash(const char* from = NULL) {
+  fsys::remove_all(workDir);
+  if (from != NULL) {
+    fsys::copy(from, workDir);
+  } else {
+    fsys::create_directories(workDir);
+  }
+  SPIFFS.setRoot(workDir.c_str());
+  SPIFFS.powerRestore();
+}
+
+static void saveFlash(const std::string& to) {
+  fsys::remove_all(to);
+  fsys::copy(workDir, to);
+}
+
+/* Description:
+ *     what the database shows: every message of both views, as a sorted list of "direction time read/unread other text".
+ */
+static std::vector<std::string> snapshot(Messages& m) {
+  std::vector<std::string> res;
+  for (int d = 0; d < 2; d++) {
+    bool incoming = d == 0;
+    int32_t n = incoming ? m.inboxTotalSize() : m.sentTotalSize();
+    m.preload(incoming, 0, n);
+    for (auto it = m.iteratorCount(0, n); it.valid(); ++it) {
+      char head[64];
+      snprintf(head, sizeof(head), "%c %08lx %s ", incoming ? 'i' : 'o', it->getTime(), it->isRead() ? "r" : "u");
+      res.push_back(head + std::string(it->getOtherUri()) + " " + it->getMessageText());
+    }
+  }
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+static std::vector<std::string> reboot(HostMessages*& m) {
+  delete m;
+  SPIFFS.powerRestore();
+  m = new HostMessages();
+  CHECK(m->load(0));
+  return snapshot(*m);
+}
+
+// A few messages of both directions with a few correspondents
+static void fill(Messages& m, int n, uint32_t time) {
+  static const char* const others[] = { "sip:bob@example.com", "sip:carol@example.org", "sip:dave@example.net" };
+  for (int i = 0; i < n; i++) {
+    char text[64];
+    bool incoming = i % 3 != 1;
+    const char* other = others[i % 3];
+    snprintf(text, sizeof(text), "message %d: %s", i, i % 5 ? "see you later" : "lunch tomorrow?");
+    m.saveMessage(text, incoming ? other : "sip:alice@example.com", incoming ? "sip:alice@example.com" : other,
+                  incoming, time + i * 7);
+  }
+}
+
+// Delete the message at `offset` of a view (negative: from the newest)
+static bool deleteAt(Messages& m, bool incoming, int32_t offset) {
+  if (m.preload(incoming, offset, 1) < 0) {
+    return false;
+  }
+  auto it = m.iteratorCount(offset, 1);
+  return it.valid() && m.deleteMessage(*it);
+}
+
+static void readAt(Messages& m, bool incoming, int32_t offset) {
+  m.preload(incoming, offset, 1);
+  for (auto it = m.iteratorCount(offset, 1); it.valid(); ++it) {
+    if (!it->isRead()) {
+      m.setRead(*it);
+    }
+  }
+}
+
+/* Description:
+ *     starting from the flash saved in baseDir, run `op` with the power cut after 0, 1, 2, ... changes until it completes
+ *     without reaching the cut. After each reboot the database must show what it showed before `op`, or after it;
+ *     then it must take another message and still have it after one more reboot.
+ * Return:
+ *     number of changes `op` makes
+ */
+template<typename Op>
+static long powerCuts(const char* name, Op op) {
+  // Without a cut: the state after, and how many changes it takes
+  resetFlash(baseDir.c_str());
+  HostMessages* m = new HostMessages();
+  CHECK(m->load(0));
+  std::vector<std::string> before = snapshot(*m);
+  unsigned long start = SPIFFS.changes();
+  op(*m);
+  long changes = SPIFFS.changes() - start;
+  std::vector<std::string> after = reboot(m);
+  delete m;
+  CHECK(before != after);
+
+  for (long cut = 0; cut < changes; cut++) {
+    resetFlash(baseDir.c_str());
+    m = new HostMessages();
+    CHECK(m->load(0));
+    SPIFFS.powerCutAfter(cut);
+    op(*m);
+    std::vector<std::string> got = reboot(m);
+    bool same = got == before || got == after;
+    if (!same) {
+      printf("%s: power cut after %ld of %ld changes: %d messages, %d before, %d after\n", name, cut, changes,
+             (int) got.size(), (int) before.size(), (int) after.size());
+    }
+    CHECK(same);
+
+    // Still usable
+    m->saveMessage("after the reboot", "sip:erin@example.com", "sip:alice@example.com", true, 0x7fff0000);
+    got.push_back("i 7fff0000 u sip:erin@example.com after the reboot");
+    std::sort(got.begin(), got.end());
+    CHECK(reboot(m) == got);
+    delete m;
+  }
+  return changes;
+}
+
+/* Description:
+ *     starting from the flash saved in baseDir, save a message with the writes failing after 0, 1, 2, ... changes
+ *     (the write at the failure is torn), then with the writes working again save another one without a reboot.
+ *     The database must show the first message or not, and the second one, and show the same after a reboot.
+ */
+static void failedWrites(const char* name, const char* text, const char* fromUri, const char* toUri, bool incoming,
+                         uint32_t time, long changes) {
+  char head[64];
+  snprintf(head, sizeof(head), "%c %08lx %s ", incoming ? 'i' : 'o', (unsigned long) time, incoming ? "u" : "r");
+  std::string message = head + std::string(incoming ? fromUri : toUri) + " " + text;
+  for (long cut = 0; cut < changes; cut++) {
+    resetFlash(baseDir.c_str());
+    HostMessages* m = new HostMessages();
+    CHECK(m->load(0));
+    std::vector<std::string> before = snapshot(*m);
+    SPIFFS.powerCutAfter(cut);
+    m->saveMessage(text, fromUri, toUri, incoming, time);
+    SPIFFS.powerRestore();
+
+    m->saveMessage("after the failure", "sip:erin@example.com", "sip:alice@example.com", true, 0x7fff0000);
+    std::vector<std::string> got = snapshot(*m);
+    before.push_back("i 7fff0000 u sip:erin@example.com after the failure");
+    std::vector<std::string> after = before;
+    after.push_back(message);
+    std::sort(before.begin(), before.end());
+    std::sort(after.begin(), after.end());
+    bool same = got == before || got == after;
+    if (!same) {
+      printf("%s: writes failing after %ld of %ld changes: %d messages, %d before, %d after\n", name, cut, changes,
+             (int) got.size(), (int) before.size(), (int) after.size());
+    }
+    CHECK(same);
+    CHECK(reboot(m) == got);
+    delete m;
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  -m: migration  - - - - - - - - - - - - - - - - - - - - -
+
+/* Description:
+ *     INI partitions as written by older firmware (see INTERNAL_FLASH.txt): one of incoming messages with the addresses
+ *     in each message, one of sent messages with the addresses set for the partition, the text plain or in Base64.
+ * Return:
+ *     the snapshot() the migrated database must show
+ */
+static std::vector<std::string> writeOldPartitions() {
+  IniFile index("/msg_index.ini");
+  index[0]["desc"] = "WiPhone messages index";
+  index[0]["v"] = "1";
+  for (int p = 1; p <= 2; p++) {
+    int s = index.addSection();
+    index[s]["p"] = p;
+    index[s]["d"] = p == 1 ? "i" : "o";
+  }
+  CHECK(index.store());
+
+  std::vector<std::string> expected;
+  char line[128];
+  IniFile in("/msg_00001.ini");
+  in[0]["desc"] = "WiPhone messages partition";
+  in[0]["v"] = "1";
+  in[0]["d"] = "i";
+  for (int i = 0; i < 30; i++) {
+    char other[40], text[40];
+    snprintf(other, sizeof(other), "sip:friend%d@example.com", i % 4);
+    snprintf(text, sizeof(text), i % 2 ? "old incoming %d" : "old incoming %d\nsecond line", i);
+    int s = in.addSection();
+    MessageData msg(other, "sip:alice@example.com", text, 0x5e000000 + i * 60, true);
+    in[s].deepCopy(msg);
+    if (i % 3 == 0) {
+      in[s]["u"] = "1";
+    }
+    snprintf(line, sizeof(line), "i %08x %s %s %s", 0x5e000000 + i * 60, i % 3 == 0 ? "u" : "r", other, text);
+    expected.push_back(line);
+  }
+  CHECK(in.store());
+
+  IniFile out("/msg_00002.ini");
+  out[0]["desc"] = "WiPhone messages partition";
+  out[0]["v"] = "1";
+  out[0]["d"] = "o";
+  out[0]["s"] = "sip:alice@example.com";
+  out[0]["o"] = "sip:friend0@example.com";
+  for (int i = 0; i < 20; i++) {
+    char text[40];
+    snprintf(text, sizeof(text), "old sent %d", i);
+    int s = out.addSection();
+    out[s]["m"] = text;
+    out[s].putValueFullHex("t", 0x5e000020 + i * 60);
+    snprintf(line, sizeof(line), "o %08x r sip:friend0@example.com %s", 0x5e000020 + i * 60, text);
+    expected.push_back(line);
+  }
+  CHECK(out.store());
+  std::sort(expected.begin(), expected.end());
+  return expected;
+}
+
+static int checkMigration() {
+  resetFlash();
+  std::vector<std::string> expected = writeOldPartitions();
+  saveFlash(baseDir);
+
+  // Uninterrupted
+  HostMessages* m = new HostMessages();
+  unsigned long start = SPIFFS.changes();
+  CHECK(m->load(0));
+  long changes = SPIFFS.changes() - start;
+  CHECK(snapshot(*m) == expected);
+  CHECK(reboot(m) == expected);
+  delete m;
+  for (auto& f : fsys::directory_iterator(workDir)) {
+    CHECK(f.path().extension() == ".bin");
+  }
+
+  // Power lost on the way: the next boot migrates again, or finds it done
+  for (long cut = 0; cut < changes; cut++) {
+    resetFlash(baseDir.c_str());
+    m = new HostMessages();
+    SPIFFS.powerCutAfter(cut);
+    m->load(0);
+    std::vector<std::string> got = reboot(m);
+    if (got != expected) {
+      printf("migration: power cut after %ld of %ld changes: %d of %d messages\n", cut, changes, (int) got.size(), (int) expected.size());
+    }
+    CHECK(got == expected);
+    delete m;
+    for (auto& f : fsys::directory_iterator(workDir)) {
+      CHECK(f.path().extension() == ".bin");
+    }
+  }
+  printf("migration: %d messages, power cut after each of %ld changes: %s\n", (int) expected.size(), changes,
+         failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  -r: torn appends  - - - - - - - - - - - - - - - - - - - - -
+
+static int checkRecovery() {
+  resetFlash();
+  HostMessages* m = new HostMessages();
+  CHECK(m->load(0));
+  fill(*m, 70, 1000);
+  delete m;
+  saveFlash(baseDir);
+
+  long save = powerCuts("save", [](Messages& m) {
+    m.saveMessage("a new message", "sip:bob@example.com", "sip:alice@example.com", true, 5000);
+  });
+  long saveOld = powerCuts("save (older than the rest)", [](Messages& m) {
+    m.saveMessage("a delayed message", "sip:alice@example.com", "sip:carol@example.org", false, 999);
+  });
+  long read = powerCuts("read", [](Messages& m) {
+    readAt(m, true, -1);
+  });
+  long del = powerCuts("delete", [](Messages& m) {
+    deleteAt(m, false, 3);
+  });
+  failedWrites("save", "a new message", "sip:bob@example.com", "sip:alice@example.com", true, 5000, save);
+  failedWrites("save (older than the rest)", "a delayed message", "sip:alice@example.com", "sip:carol@example.org", false,
+               999, saveOld);
+  printf("recovery: save %ld, save older %ld, read %ld, delete %ld changes, power cut after each; "
+         "saving after a failed write: %s\n", save, saveOld, read, del, failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  -x: index rebuild  - - - - - - - - - - - - - - - - - - - - -
+
+static int checkRebuild() {
+  resetFlash();
+  HostMessages* m = new HostMessages();
+  CHECK(m->load(0));
+  fill(*m, 100, 1000);
+  for (int i = 0; i < 10; i++) {
+    readAt(*m, true, i);
+  }
+  std::vector<std::string> expected = reboot(m);
+  delete m;
+  saveFlash(baseDir);
+  std::string index = workDir + "/msg_idx.bin";
+  uintmax_t indexSize = fsys::file_size(index);
+
+  // Read states are in the index only (until the log is compacted): rebuilt from the log, the messages are unread again
+  std::vector<std::string> unread;
+  for (auto s : expected) {
+    if (s[0] == 'i') {
+      s[11] = 'u';
+    }
+    unread.push_back(s);
+  }
+  std::sort(unread.begin(), unread.end());
+
+  struct {
+    const char* what;
+    uintmax_t size;                 // of the index left, -1 - removed
+    bool readKept;
+  } cases[] = {
+    { "missing", (uintmax_t) -1, false },
+    { "header only", 16, false },
+    { "last entry cut", indexSize - 5, true },
+    { "last 10 entries lost", indexSize - 160, true },
+    { "half lost, the last entry cut", indexSize / 2 + 3, true },
+  };
+  for (auto& c : cases) {
+    resetFlash(baseDir.c_str());
+    if (c.size == (uintmax_t) -1) {
+      fsys::remove(index);
+    } else {
+      fsys::resize_file(index, c.size);
+    }
+    m = new HostMessages();
+    std::vector<std::string> got = reboot(m);
+    bool ok = got == (c.readKept ? expected : unread);
+    if (!ok) {
+      printf("index %s: %d messages of %d\n", c.what, (int) got.size(), (int) expected.size());
+    }
+    CHECK(ok);
+    CHECK(fsys::file_size(index) == indexSize);
+
+    // And the rebuilt index is good for the next message
+    m->saveMessage("after the rebuild", "sip:erin@example.com", "sip:alice@example.com", true, 0x7fff0000);
+    got.push_back("i 7fff0000 u sip:erin@example.com after the rebuild");
+    std::sort(got.begin(), got.end());
+    CHECK(reboot(m) == got);
+    delete m;
+  }
+
+  // Index of another (longer) log: entries past the end of the log
+  resetFlash(baseDir.c_str());
+  fsys::resize_file(workDir + "/msg_log.bin", fsys::file_size(workDir + "/msg_log.bin") - 200);
+  m = new HostMessages();
+  std::vector<std::string> got = reboot(m);
+  CHECK(got.size() < expected.size() && got.size() > 0);
+  delete m;
+
+  printf("index rebuild: %d cases: %s\n", (int) (sizeof(cases)/sizeof(cases[0]) + 1), failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  -k: compaction  - - - - - - - - - - - - - - - - - - - - -
+
+static int checkCompaction() {
+  resetFlash();
+  HostMessages* m = new HostMessages();
+  CHECK(m->load(0));
+  fill(*m, 150, 1000);
+  for (int i = 0; i < 20; i++) {
+    readAt(*m, true, -1 - i);
+  }
+  while (m->deleted() < 49) {
+    CHECK(deleteAt(*m, m->deleted() % 2, m->deleted() % 7));
+  }
+  delete m;
+  saveFlash(baseDir);
+
+  // The 50th deletion compacts the log
+  long changes = powerCuts("compaction", [](HostMessages& m) {
+    deleteAt(m, true, 5);
+  });
+
+  // A record that can't be read: the old log is kept whole
+  resetFlash(baseDir.c_str());
+  FILE* f = fopen((workDir + "/msg_idx.bin").c_str(), "rb");
+  uint8_t entry[16];
+  fseek(f, 16, SEEK_SET);
+  while (fread(entry, 1, sizeof(entry), f) == sizeof(entry) && (entry[14] & 0x80)) {}
+  fclose(f);
+  uint32_t offset;
+  memcpy(&offset, entry + 8, sizeof(offset));
+  f = fopen((workDir + "/msg_log.bin").c_str(), "r+b");
+  fseek(f, offset, SEEK_SET);
+  fwrite("XX", 1, 2, f);
+  fclose(f);
+  uintmax_t logSize = fsys::file_size(workDir + "/msg_log.bin");
+  m = new HostMessages();
+  CHECK(m->load(0));
+  CHECK(!m->compact());
+  CHECK(m->deleted() == 49);
+  CHECK(fsys::file_size(workDir + "/msg_log.bin") == logSize);
+  CHECK(!fsys::exists(workDir + "/msg_log.tmp") && !fsys::exists(workDir + "/msg_idx.tmp"));
+  delete m;
+
+  printf("compaction: power cut after each of %ld changes (the deletion, the new files, removals and renames), "
+         "unreadable record: %s\n", changes, failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  -c: cache  - - - - - - - - - - - - - - - - - - - - -
+
+struct Expected {
+  uint32_t time;
+  std::string text;
+};
+
+/* Description:
+ *     the messages of a view as the database must show them, oldest first: inserted after those of the same time or
+ *     older, as they are sorted by time, then by record (the new one is the last record).
+ */
+static void expectSaved(std::vector<Expected>& view, uint32_t time, const std::string& text) {
+  size_t pos = view.size();
+  while (pos > 0 && view[pos-1].time > time) {
+    pos--;
+  }
+  view.insert(view.begin() + pos, { time, text });
+}
+
+// Texts of the messages of a view, as read from the log by another Messages that caches nothing
+static std::vector<std::string> directRead(bool incoming) {
+  Messages direct;
+  CHECK(direct.load(0));
+  direct.setCacheBudget(0);
+  std::vector<std::string> texts;
+  int32_t n = incoming ? direct.inboxTotalSize() : direct.sentTotalSize();
+  for (int32_t i = 0; i < n; i++) {
+    direct.preload(incoming, i, 1);
+    auto it = direct.iteratorCount(i, 1);
+    CHECK(it.valid());
+    texts.push_back(it.valid() ? it->getMessageText() : "");
+  }
+  return texts;
+}
+
+/* Description:
+ *     random preload() windows (offsets from the oldest and from the newest message, some past the ends) with prefetch()
+ *     in between, messages saved (mostly not the newest) and deleted, and the cache budget changed now and then:
+ *     every message preloaded must be the one expected, and every 100 operations the views must be what another
+ *     Messages reads from the log directly.
+ */
+static int checkCache(int operations) {
+  resetFlash();
+  HostMessages m;
+  CHECK(m.load(0));
+  srand(3);
+  std::vector<Expected> views[2];         // incoming, sent
+  for (int i = 0; i < 100; i++) {
+    char text[32];
+    snprintf(text, sizeof(text), "in %d", i);
+    m.saveMessage(text, "sip:bob@example.com", "sip:alice@example.com", true, 1000 + i);
+    expectSaved(views[1], 1000 + i, text);
+    snprintf(text, sizeof(text), "out %d", i);
+    m.saveMessage(text, "sip:alice@example.com", "sip:carol@example.org", false, 1000 + i);
+    expectSaved(views[0], 1000 + i, text);
+  }
+  int32_t read = 0, preloaded = 0, compared = 0;
+  for (int op = 0; op < operations; op++) {
+    int what = rand() % 100;
+    bool incoming = rand() % 2;
+    std::vector<Expected>& view = views[incoming];
+    int32_t n = view.size();
+    if (what < 3) {
+      m.setCacheBudget((rand() % 3) * 2000 + 100);
+    } else if (what < 6) {
+      char text[32];
+      snprintf(text, sizeof(text), "%s new %d", incoming ? "in" : "out", op);
+      uint32_t time = 1000 + rand() % 300;
+      m.saveMessage(text, incoming ? "sip:bob@example.com" : "sip:alice@example.com",
+                    incoming ? "sip:alice@example.com" : "sip:carol@example.org", incoming, time);
+      expectSaved(view, time, text);
+    } else if (what < 9 && n > 10) {
+      int32_t offset = rand() % 2 ? -(rand() % n) - 1 : rand() % n;
+      m.preload(incoming, offset, 5);
+      CHECK(m.deleteMessage(offset));
+      view.erase(view.begin() + (offset < 0 ? n + offset : offset));
+    } else if (what < 30) {
+      while (m.prefetch());
+    } else {
+      int32_t offset = rand() % 2 ? -(rand() % (n + 3)) - 1 : rand() % (n + 3);
+      int32_t count = rand() % 7 + 1;
+      read += m.preload(incoming, offset, count);
+      preloaded += count;
+      int32_t k = 0;
+      for (auto it = m.iteratorCount(offset, count); it.valid(); ++it, k++) {
+        int32_t pos = offset < 0 ? n + (int32_t) it : (int32_t) it;
+        CHECK(pos >= 0 && pos < n && view[pos].text == it->getMessageText());
+      }
+      int32_t inRange = offset < 0 ? std::min(count, n + offset + 1) : std::min(count, n - offset);
+      CHECK(k == std::max(inRange, 0));
+    }
+    if (op % 100 == 99) {
+      for (int d = 0; d < 2; d++) {
+        std::vector<std::string> texts;
+        for (auto& e : views[d]) {
+          texts.push_back(e.text);
+        }
+        CHECK(directRead(d) == texts);
+      }
+      compared++;
+    }
+  }
+  printf("cache: %d operations, %d messages preloaded, %d read from the log (whole pages), views read directly %d times: "
+         "%s\n", operations, preloaded, read, compared, failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  -v: conversations  - - - - - - - - - - - - - - - - - - - - -
+
+static std::string flashFile(const char* fn) {
+  std::string s;
+  FILE* f = fopen((workDir + fn).c_str(), "rb");
+  if (f != NULL) {
+    char buff[4096];
+    size_t n;
+    while ((n = fread(buff, 1, sizeof(buff), f)) > 0) {
+      s.append(buff, n);
+    }
+    fclose(f);
+  }
+  return s;
+}
+
+struct ExpectedConversation {
+  int32_t count = 0;
+  int32_t unread = 0;
+  uint32_t lastTime = 0;
+};
+
+// The whole normalized URI (conversation keys of long ones are cut)
+static std::string normalizedUri(const char* uri) {
+  char key[512];
+  if (!CallerIdCache::normalize(uri, key, sizeof(key))) {
+    snprintf(key, sizeof(key), "%s", uri);
+  }
+  return key;
+}
+
+/* Description:
+ *     the conversations, their messages and the conversations file must be what the views show: every message of both
+ *     views is counted by its normalized other URI.
+ */
+static void compareConversations(HostMessages& m) {
+  std::map<std::string, ExpectedConversation> expected;
+  for (int d = 0; d < 2; d++) {
+    int32_t n = d ? m.inboxTotalSize() : m.sentTotalSize();
+    m.preload(d, 0, n);
+    for (auto it = m.iteratorCount(0, n); it.valid(); ++it) {
+      ExpectedConversation& e = expected[normalizedUri(it->getOtherUri())];
+      e.count++;
+      e.unread += !it->isRead();
+      e.lastTime = std::max(e.lastTime, (uint32_t) it->getTime());
+    }
+  }
+  LinearArray<int32_t, LA_EXTERNAL_RAM> list;
+  CHECK(m.listConversations(list));
+  CHECK(list.size() == expected.size());
+  uint32_t prev = 0xFFFFFFFF;
+  for (size_t i = 0; i < list.size(); i++) {
+    const Messages::Conversation& c = m.getConversation(list[i]);
+    CHECK(c.lastTime <= prev);
+    prev = c.lastTime;
+    CHECK(strlen(c.uriDyn) <= CallerIdCache::MAX_URI_LENGTH);
+    CHECK(m.findConversation(c.uriDyn) == list[i]);
+
+    // Messages of both directions, newest first, all with the same other URI
+    int32_t k = 0;
+    uint32_t time = 0xFFFFFFFF;
+    std::string uri;
+    m.preloadConversation(list[i], -1, 1000);
+    for (auto it = m.iteratorCount(-1, 1000); it.valid(); ++it, k++) {
+      CHECK(it->getTime() <= time);
+      time = it->getTime();
+      CHECK(m.findConversation(it->getOtherUri()) == list[i]);
+      if (!k) {
+        uri = normalizedUri(it->getOtherUri());
+      }
+      CHECK(normalizedUri(it->getOtherUri()) == uri);
+    }
+    CHECK(k == c.count);
+    auto e = expected.find(uri);
+    CHECK(e != expected.end());
+    if (e != expected.end()) {
+      CHECK(c.count == e->second.count && c.unread == e->second.unread && c.lastTime == e->second.lastTime);
+    }
+  }
+}
+
+/* Description:
+ *     random messages of a few correspondents (written differently) saved, deleted (compacting the log every 50 or so)
+ *     and read, in the inbox and in conversations; now and then a reboot, with the conversations file removed, cut
+ *     or with a byte appended. The conversations must always be what the views show, and the file kept up to date
+ *     must be what it is rebuilt into from the log (checked every 50 operations and after every compaction).
+ *     Two of the correspondents have URIs longer than a conversation key that differ only past it.
+ */
+static int checkConversations(int operations) {
+  std::string longUri = "sip:" + std::string(100, 'l') + "@example.com";
+  std::string longUri2 = "sip:" + std::string(100, 'l') + "@example.org";
+  const char* const uris[] = { "sip:Bob@example.com", "<sip:bob@example.com:5060>",
+                               "\"Carol\" <sip:carol@example.org;transport=tcp>", "sip:carol@example.org",
+                               "tel:+123", "sip:dave@example.net", longUri.c_str(), longUri2.c_str() };
+  const int nUris = sizeof(uris) / sizeof(uris[0]);
+  resetFlash();
+  srand(5);
+  HostMessages* m = new HostMessages();
+  CHECK(m->load(0));
+
+  // The long ones are two conversations, also when their keys are read back from the log
+  m->saveMessage("long 1", longUri.c_str(), "sip:alice@example.com", true, 500);
+  m->saveMessage("long 2", longUri2.c_str(), "sip:alice@example.com", true, 501);
+  for (int i = 0; i < 2; i++) {
+    CHECK(m->conversationsCount() == 2);
+    CHECK(m->findConversation(longUri.c_str()) >= 0 && m->findConversation(longUri2.c_str()) >= 0);
+    CHECK(m->findConversation(longUri.c_str()) != m->findConversation(longUri2.c_str()));
+    delete m;
+    fsys::remove(workDir + "/msg_conv.bin");
+    m = new HostMessages();
+    CHECK(m->load(0));
+  }
+  compareConversations(*m);
+
+  int compactions = 0, damaged = 0, compared = 0;
+  for (int op = 0; op < operations; op++) {
+    int what = rand() % 100;
+    bool incoming = rand() % 2;
+    int32_t n = incoming ? m->inboxTotalSize() : m->sentTotalSize();
+    bool compacted = false;
+    if (what < 50) {
+      char text[32];
+      snprintf(text, sizeof(text), "message %d", op);
+      const char* uri = uris[rand() % nUris];
+      m->saveMessage(text, incoming ? uri : "sip:alice@example.com", incoming ? "sip:alice@example.com" : uri, incoming,
+                     1000 + rand() % 5000);
+    } else if (what < 70 && n > 0) {
+      int32_t deleted = m->deleted();
+      CHECK(deleteAt(*m, incoming, -(rand() % n) - 1));
+      compacted = m->deleted() < deleted;
+      compactions += compacted;
+    } else if (what < 85) {
+      readAt(*m, true, rand() % (m->inboxTotalSize() + 1));
+    } else if (what < 90 && m->conversationsCount()) {
+      m->preloadConversation(rand() % m->conversationsCount(), -1, 3);
+      for (auto it = m->iteratorCount(-1, 3); it.valid(); ++it) {
+        if (!it->isRead()) {
+          m->setRead(*it);
+        }
+      }
+    } else if (what < 93) {
+      reboot(m);
+    } else if (what < 95) {
+      delete m;
+      std::string conv = workDir + "/msg_conv.bin";
+      int how = rand() % 3;
+      if (how == 0) {
+        fsys::remove(conv);
+      } else if (how == 1) {
+        fsys::resize_file(conv, fsys::file_size(conv) - 7);
+      } else {
+        FILE* f = fopen(conv.c_str(), "ab");
+        fputc('x', f);
+        fclose(f);
+      }
+      damaged++;
+      m = nullptr;
+      reboot(m);
+    }
+
+    if (op % 50 == 49 || compacted) {
+      compareConversations(*m);
+      std::string kept = flashFile("/msg_conv.bin");
+      delete m;
+      fsys::remove(workDir + "/msg_conv.bin");
+      m = new HostMessages();
+      CHECK(m->load(0));
+      CHECK(flashFile("/msg_conv.bin") == kept);
+      compareConversations(*m);
+      compared++;
+    }
+  }
+  printf("conversations: %d operations, %d conversations, %d compactions, file damaged %d times, checked %d times: %s\n",
+         operations, m->conversationsCount(), compactions, damaged, compared, failures ? "FAILED" : "OK");
+  delete m;
+  return failures ? 1 : 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - -  -f: search  - - - - - - - - - - - - - - - - - - - - -
+
+static std::string lowerCase(std::string s) {
+  for (auto& c : s) {
+    c = tolower(c);
+  }
+  return s;
+}
+
+/* Description:
+ *     search() must find what reading every message finds: the same messages (time and text) sorted by time,
+ *     from the newest (negative offsets) and from the oldest.
+ */
+static void compareSearch(Messages& m, const char* text, int& skipped, int& segments) {
+  std::vector<std::pair<uint32_t, std::string>> expected;
+  for (int d = 0; d < 2; d++) {
+    int32_t n = d ? m.inboxTotalSize() : m.sentTotalSize();
+    m.preload(d, 0, n);
+    for (auto it = m.iteratorCount(0, n); it.valid(); ++it) {
+      if (lowerCase(it->getMessageText()).find(lowerCase(text)) != std::string::npos) {
+        expected.push_back({ (uint32_t) it->getTime(), it->getMessageText() });
+      }
+    }
+  }
+  std::sort(expected.begin(), expected.end());
+
+  int32_t n = m.search(text);
+  CHECK(n == (int32_t) expected.size());
+  skipped += m.searchStats().skipped;
+  segments += m.searchStats().segments;
+  m.preloadFound(-1, n);
+  std::vector<std::pair<uint32_t, std::string>> got;
+  for (auto it = m.iteratorCount(-1, n); it.valid(); ++it) {
+    got.push_back({ (uint32_t) it->getTime(), it->getMessageText() });
+  }
+  std::reverse(got.begin(), got.end());
+  for (size_t i = 1; i < got.size(); i++) {
+    CHECK(got[i-1].first <= got[i].first);
+  }
+  std::sort(got.begin(), got.end());
+  if (got != expected) {
+    printf("search \"%s\": %d found, %d expected\n", text, (int) got.size(), (int) expected.size());
+  }
+  CHECK(got == expected);
+  if (n > 0) {
+    m.preloadFound(0, 1);
+    auto it = m.iteratorCount(0, 1);
+    CHECK(it.valid() && it->getTime() == expected[0].first);
+  }
+}
+
+/* Description:
+ *     messages on a few topics (words changing every 200 operations, so that most segments of the log are ruled out
+ *     by their filters) saved out of order, deleted, compacted; reboots, some with /msg_bloom.bin removed, cut (in
+ *     the header, in a filter) or with a byte appended. Every 100 operations, and after every compaction or damage,
+ *     a search must find what reading every message finds.
+ */
+static int checkSearch(int operations) {
+  static const char* const words[] = { "hello", "World", "lunch", "meeting", "ok", "tomorrow", "ESP32", "call", "me",
+                                       "later", "Pizza", "zebra" };
+  static const char* const texts[] = { "hello", "WORLD", "zebra", "o", "za", "lunch tom", "esp", "xyz", "meeting ok",
+                                       "all" };
+  resetFlash();
+  srand(7);
+  HostMessages* m = new HostMessages();
+  CHECK(m->load(0));
+  int skipped = 0, segments = 0, searches = 0, compactions = 0, damaged = 0;
+  for (int op = 0; op < operations; op++) {
+    int what = rand() % 100;
+    bool incoming = rand() % 2;
+    int32_t n = incoming ? m->inboxTotalSize() : m->sentTotalSize();
+    bool check = op % 100 == 99;
+    if (what < 60) {
+      std::string text;
+      int topic = (op / 200) % 12;
+      for (int i = 1 + rand() % 4; i > 0; i--) {
+        text += std::string(text.empty() ? "" : " ") + words[(topic + rand() % 3) % 12];
+      }
+      m->saveMessage(text.c_str(), incoming ? "sip:bob@example.com" : "sip:alice@example.com",
+                     incoming ? "sip:alice@example.com" : "sip:bob@example.com", incoming, 1000 + (op * 7919) % 100003);
+    } else if (what < 72 && n > 0) {
+      CHECK(deleteAt(*m, incoming, -(rand() % n) - 1));
+    } else if (what < 74) {
+      reboot(m);
+    } else if (what < 77) {
+      delete m;
+      std::string bloom = workDir + "/msg_bloom.bin";
+      uintmax_t size = fsys::exists(bloom) ? fsys::file_size(bloom) : 0;
+      int how = rand() % 4;
+      if (how == 0) {
+        fsys::remove(bloom);
+      } else if (how == 1 && size > 100) {
+        fsys::resize_file(bloom, size - 100);
+      } else if (how == 2 && size > 0) {
+        fsys::resize_file(bloom, std::min(size, (uintmax_t) 10));
+      } else if (size > 0) {
+        FILE* f = fopen(bloom.c_str(), "ab");
+        fputc('x', f);
+        fclose(f);
+      }
+      damaged++;
+      m = nullptr;
+      reboot(m);
+      check = true;
+    } else if (what < 80) {
+      // Delete a message found
+      if (m->search("pizza") > 0) {
+        m->preloadFound(-1, 1);
+        CHECK(m->deleteMessage(*m->iteratorCount(-1, 1)));
+      }
+    } else if (what < 81 && m->deleted() > 0) {
+      CHECK(m->compact());
+      compactions++;
+      check = true;
+    }
+    if (check) {
+      compareSearch(*m, texts[rand() % 10], skipped, segments);
+      searches++;
+    }
+  }
+  for (auto text : texts) {
+    compareSearch(*m, text, skipped, segments);
+    searches++;
+  }
+  printf("search: %d operations, %d searches, %d of %d segments ruled out by filters, %d compactions, filters damaged "
+         "%d times: %s\n", operations, searches, skipped, segments, compactions, damaged, failures ? "FAILED" : "OK");
+  delete m;
+  return failures ? 1 : 0;
+}
+
+static char tmpRoot[] = "/tmp/storage_host.XXXXXX";
+
+static void removeTmpRoot() {
+  SPIFFS.setRoot(NULL);
+  fsys::remove_all(tmpRoot);
+}
+
+int main(int argc, char** argv) {
+  if (mkdtemp(tmpRoot) == NULL) {
+    perror("mkdtemp");
+    return 2;
+  }
+  atexit(removeTmpRoot);
+  workDir = std::string(tmpRoot) + "/flash";
+  baseDir = std::string(tmpRoot) + "/base";
+
+  if (argc > 1 && !strcmp(argv[1], "-m")) {
+    return checkMigration();
+  }
+  if (argc > 1 && !strcmp(argv[1], "-r")) {
+    return checkRecovery();
+  }
+  if (argc > 1 && !strcmp(argv[1], "-x")) {
+    return checkRebuild();
+  }
+  if (argc > 1 && !strcmp(argv[1], "-k")) {
+    return checkCompaction();
+  }
+  if (argc > 1 && !strcmp(argv[1], "-c")) {
+    return checkCache(argc > 2 ? atoi(argv[2]) : 20000);
+  }
+  if (argc > 1 && !strcmp(argv[1], "-v")) {
+    return checkConversations(argc > 2 ? atoi(argv[2]) : 3000);
+  }
+  if (argc > 1 && !strcmp(argv[1], "-f")) {
+    return checkSearch(argc > 2 ? atoi(argv[2]) : 3000);
+  }
+  fprintf(stderr, "Usage:\n  %s -m\n  %s -r\n  %s -x\n  %s -k\n  %s -c [operations]\n  %s -v [operations]\n"
+          "  %s -f [operations]\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+  return 2;
+}